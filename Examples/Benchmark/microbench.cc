@@ -0,0 +1,306 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Measures core kernels in isolation. Fixtures are built by tracking the first frames of a
+// monocular sequence (tracked frames, keyframes and map), then every kernel is run on them
+// for a fixed time and reported as ns and heap allocations per operation. Kernels that
+// modify the map (local BA) run on the same map, so each op starts from the previous result.
+// Debug output goes to stdout, redirect it to ignore it.
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <unordered_set>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include "System.h"
+#include "Tracking.h"
+#include "Map.h"
+#include "Config.h"
+#include "ORBextractor.h"
+#include "ORBmatcher.h"
+#include "ImageAlign.h"
+#include "Optimizer.h"
+#include "Initializer.h"
+#include "PnPsolver.h"
+#include "Sim3Solver.h"
+#include "sensors/EKF.h"
+#include "sensors/ConstantVelocity.h"
+#include "extra/dataset_reader.h"
+
+using namespace std;
+
+// Every heap allocation of the process goes through here, library included
+static std::atomic<unsigned long> gAllocations(0);
+
+void* operator new(size_t size) {
+  gAllocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size > 0 ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+// Runs op until minTime seconds have passed (at least 3 times). Each call does opsPerCall operations
+class MicroBench {
+ public:
+  MicroBench(const string &filter, double minTime): filter_(filter), minTime_(minTime) {
+    cout << left << setw(36) << "kernel" << right << setw(14) << "ns/op" << setw(14) << "allocs/op"
+         << setw(12) << "ops" << endl;
+  }
+
+  void Run(const string &name, const function<void()> &op, int opsPerCall = 1) {
+    if (!filter_.empty() && name.find(filter_) == string::npos)
+      return;
+
+    op();  // Warm up caches and buffers
+
+    long calls = 0;
+    unsigned long allocations = gAllocations;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0.0;
+    while (calls < 3 || elapsed < minTime_) {
+      op();
+      calls++;
+      elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    }
+    allocations = gAllocations-allocations;
+
+    const double ops = static_cast<double>(calls)*opsPerCall;
+    cout << left << setw(36) << name << right << fixed << setprecision(1) << setw(14) << elapsed*1e9/ops
+         << setprecision(2) << setw(14) << allocations/ops << setw(12) << static_cast<long>(ops) << endl;
+  }
+
+ private:
+  string filter_;
+  double minTime_;
+};
+
+int main(int argc, char **argv) {
+  vector<string> vFilenames;
+
+  if (argc < 3 || argc > 5) {
+    cerr << endl << "Usage: ./sdslam_microbench path_to_settings path_to_sequence [frames] [kernel_filter]" << endl;
+    return 1;
+  }
+
+  const int nMaxFrames = argc > 3 ? atoi(argv[3]) : 300;
+  const string filter = argc > 4 ? string(argv[4]) : "";
+
+  // Read parameters
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[1])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  // Retrieve paths to images
+  string strSequence = string(argv[2]);
+  string filename = strSequence+"/files.txt";
+  if (!SD_SLAM::DatasetReader::LoadImages(filename, vFilenames)) {
+    cerr << "[ERROR] Couldn't find images, does " << filename << " exist?" << endl;
+    return 1;
+  }
+
+  const int nImages = std::min(static_cast<int>(vFilenames.size()), nMaxFrames);
+  vector<cv::Mat> vImages(nImages);
+  for (int i = 0; i < nImages; i++) {
+    vImages[i] = cv::imread(strSequence+"/"+vFilenames[i], CV_LOAD_IMAGE_GRAYSCALE);
+    if (vImages[i].empty()) {
+      cerr << "[ERROR] Failed to load image at: " << strSequence << "/" << vFilenames[i] << endl;
+      return 1;
+    }
+  }
+
+  // Fixture: tracked frames and the map built from them
+  SD_SLAM::System SLAM(SD_SLAM::System::MONOCULAR, false);
+  vector<SD_SLAM::Frame> vFrames;
+  for (int ni = 0; ni < nImages; ni++) {
+    SLAM.TrackMonocular(vImages[ni], vFilenames[ni]);
+    if (SLAM.GetTrackingState() == SD_SLAM::Tracking::OK)
+      vFrames.push_back(SLAM.GetTracker()->GetCurrentFrame());
+  }
+  SLAM.Shutdown();
+
+  SD_SLAM::Map* pMap = SLAM.GetMap();
+  vector<SD_SLAM::KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
+  sort(vpKFs.begin(), vpKFs.end(), SD_SLAM::KeyFrame::lId);
+
+  if (vFrames.size() < 12 || vpKFs.size() < 3) {
+    cerr << "[ERROR] Only " << vFrames.size() << " frames were tracked, use more frames or another sequence" << endl;
+    return 1;
+  }
+
+  // Points culled while tracking were freed, frames only keep the ones still in the map
+  const vector<SD_SLAM::MapPoint*> vpMPs = pMap->GetAllMapPoints();
+  const unordered_set<SD_SLAM::MapPoint*> sMPs(vpMPs.begin(), vpMPs.end());
+  for (SD_SLAM::Frame &F : vFrames) {
+    for (SD_SLAM::MapPoint* &pMP : F.mvpMapPoints) {
+      if (pMP && !sMPs.count(pMP))
+        pMP = nullptr;
+    }
+  }
+
+  cerr << "[INFO] Fixture has " << vFrames.size() << " frames, " << vpKFs.size() << " keyframes and "
+       << vpMPs.size() << " points" << endl;
+
+  MicroBench bench(filter, 1.0);
+  const SD_SLAM::Frame &lastFrame = vFrames[vFrames.size()-2];
+  const SD_SLAM::Frame &curFrame = vFrames.back();
+
+  // Feature extraction
+  SD_SLAM::ORBextractor extractor(SD_SLAM::Config::NumFeatures(), SD_SLAM::Config::ScaleFactor(),
+                                  SD_SLAM::Config::NumLevels(), SD_SLAM::Config::ThresholdFAST());
+  vector<cv::KeyPoint> vKeys;
+  cv::Mat descriptors;
+  vector<cv::Mat> vPyramid;
+  int nImage = 0;
+  bench.Run("ORBextractor::operator()", [&]() {
+    extractor(vImages[nImage++ % nImages], cv::Mat(), vKeys, descriptors, vPyramid);
+  });
+
+  // Descriptor distances, all pairs of two blocks of descriptors
+  const int nDesc = std::min(std::min(curFrame.N, lastFrame.N), 256);
+  int sum = 0;
+  bench.Run("ORBmatcher::DescriptorDistance", [&]() {
+    for (int i = 0; i < nDesc; i++) {
+      const uchar* a = curFrame.mDescriptors.ptr<uchar>(i);
+      for (int j = 0; j < nDesc; j++)
+        sum += SD_SLAM::ORBmatcher::DescriptorDistance(a, lastFrame.mDescriptors.ptr<uchar>(j));
+    }
+  }, nDesc*nDesc);
+  if (sum == 42)
+    cerr << endl;
+
+  // Frame to frame matching, current frame starts without matches at its final pose
+  SD_SLAM::Frame searchFrame(curFrame);
+  SD_SLAM::ORBmatcher matcher(0.9, true);
+  bench.Run("ORBmatcher::SearchByProjection", [&]() {
+    fill(searchFrame.mvpMapPoints.begin(), searchFrame.mvpMapPoints.end(), static_cast<SD_SLAM::MapPoint*>(nullptr));
+    matcher.SearchByProjection(searchFrame, lastFrame, 15, true);
+  });
+
+  // Direct alignment against last frame, from last pose
+  SD_SLAM::Frame alignFrame(curFrame);
+  SD_SLAM::ImageAlign align;
+  bench.Run("ImageAlign::ComputePose", [&]() {
+    alignFrame.SetPose(lastFrame.GetPose());
+    align.ComputePose(alignFrame, lastFrame);
+  });
+
+  // Motion only BA from a perturbed pose
+  SD_SLAM::Frame poseFrame(curFrame);
+  Eigen::Matrix4d perturbed = curFrame.GetPose();
+  perturbed.block<3, 1>(0, 3) += Eigen::Vector3d(0.01, -0.01, 0.01);
+  bench.Run("Optimizer::PoseOptimization", [&]() {
+    poseFrame.SetPose(perturbed);
+    fill(poseFrame.mvbOutlier.begin(), poseFrame.mvbOutlier.end(), false);
+    SD_SLAM::Optimizer::PoseOptimization(&poseFrame);
+  });
+
+  // Local BA around last keyframe
+  SD_SLAM::KeyFrame* pLastKF = vpKFs.back();
+  bool bStop = false;
+  bench.Run("Optimizer::LocalBundleAdjustment", [&]() {
+    SD_SLAM::Optimizer::LocalBundleAdjustment(pLastKF, &bStop, pMap);
+  });
+
+  // Two view initialization between the first tracked frames
+  const SD_SLAM::Frame &iniFrame1 = vFrames[0];
+  SD_SLAM::Frame iniFrame2(vFrames[10]);
+  vector<cv::Point2f> vPrevMatched(iniFrame1.mvKeysUn.size());
+  for (size_t i = 0; i < iniFrame1.mvKeysUn.size(); i++)
+    vPrevMatched[i] = iniFrame1.mvKeysUn[i].pt;
+  vector<int> vIniMatches;
+  SD_SLAM::Frame iniMatchFrame1(iniFrame1);
+  matcher.SearchForInitialization(iniMatchFrame1, iniFrame2, vPrevMatched, vIniMatches, 100);
+  bench.Run("Initializer::Initialize", [&]() {
+    Eigen::Matrix3d R21;
+    Eigen::Vector3d t21;
+    vector<cv::Point3f> vP3D;
+    vector<bool> vbTriangulated;
+    SD_SLAM::Initializer initializer(iniFrame1, 1.0, 200);
+    initializer.Initialize(iniFrame2, vIniMatches, R21, t21, vP3D, vbTriangulated);
+  });
+
+  // Relocalization RANSAC with the tracked matches of current frame
+  bench.Run("PnPsolver::iterate(5)", [&]() {
+    SD_SLAM::PnPsolver solver(curFrame, curFrame.mvpMapPoints);
+    solver.SetRansacParameters(0.99, 10, 300, 4, 0.5, 5.991);
+    bool bNoMore;
+    vector<bool> vbInliers;
+    int nInliers;
+    solver.iterate(5, bNoMore, vbInliers, nInliers);
+  });
+
+  // Loop RANSAC between a keyframe and its best covisible one, with their shared points
+  SD_SLAM::KeyFrame* pKF1 = vpKFs[vpKFs.size()/2];
+  vector<SD_SLAM::KeyFrame*> vpCovisible = pKF1->GetBestCovisibilityKeyFrames(1);
+  if (!vpCovisible.empty()) {
+    SD_SLAM::KeyFrame* pKF2 = vpCovisible[0];
+    vector<SD_SLAM::MapPoint*> vpMatched12 = pKF1->GetMapPointMatches();
+    for (SD_SLAM::MapPoint* &pMP : vpMatched12) {
+      if (pMP && (pMP->isBad() || pMP->GetIndexInKeyFrame(pKF2) < 0))
+        pMP = nullptr;
+    }
+
+    bench.Run("Sim3Solver::iterate(5)", [&]() {
+      SD_SLAM::Sim3Solver solver(pKF1, pKF2, vpMatched12, false);
+      solver.SetRansacParameters(0.99, 20, 300);
+      bool bNoMore;
+      vector<bool> vbInliers;
+      int nInliers;
+      solver.iterate(5, bNoMore, vbInliers, nInliers);
+    });
+  }
+
+  // Brute force loop candidate matching, last keyframe against a batch of earlier ones
+  vector<SD_SLAM::KeyFrame*> vpBatch(vpKFs.begin(), vpKFs.begin() + std::min<size_t>(4, vpKFs.size()-1));
+  vector<vector<SD_SLAM::MapPoint*> > vvBatchMatches;
+  vector<int> vnBatchMatches;
+  SD_SLAM::ORBmatcher loopMatcher(0.75, true);
+  bench.Run("ORBmatcher::SearchByPoints(batch)", [&]() {
+    loopMatcher.SearchByPoints(pLastKF, vpBatch, vvBatchMatches, vnBatchMatches);
+  }, vpBatch.size());
+
+  // Motion model over the tracked trajectory
+  SD_SLAM::ConstantVelocity sensor;
+  SD_SLAM::EKF<SD_SLAM::ConstantVelocity::STATE_SIZE, SD_SLAM::ConstantVelocity::MEASUREMENT_SIZE> ekf(&sensor);
+  const vector<double> params;
+  size_t nPose = 0;
+  double timestamp = 0.0;
+  bench.Run("EKF::Predict+Update", [&]() {
+    const Eigen::Matrix4d &pose = vFrames[nPose++ % vFrames.size()].GetPose();
+    timestamp += 1.0/30.0;
+    ekf.SetTimestamp(timestamp);
+    ekf.Predict(pose);
+    ekf.Update(pose, params);
+  });
+
+  return 0;
+}
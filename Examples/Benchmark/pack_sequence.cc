@@ -0,0 +1,134 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Packs a TUM or EuRoC sequence (images, depthmaps and IMU samples) into a single file that
+// slam_bench maps directly, so runs don't depend on directory walks and PNG decoding.
+
+#include <iostream>
+#include <opencv2/core/core.hpp>
+#include "extra/dataset_reader.h"
+#include "extra/sequence_file.h"
+
+using namespace std;
+
+double TimestampFromFilename(const string &filename);
+
+int main(int argc, char **argv) {
+  vector<string> vFilenames, vFilenamesD;
+  vector<double> vTimestamps;
+  vector<vector<double> > vIMUValues;
+  string strSequence, strOutput, strIMU;
+
+  if (argc < 4) {
+    cerr << endl << "Usage: ./pack_sequence mono path_to_sequence output.sdseq [path_to_IMU_data]" << endl;
+    cerr << "       ./pack_sequence rgbd path_to_sequence path_to_association output.sdseq" << endl;
+    return 1;
+  }
+
+  const string sensor = string(argv[1]);
+  const bool rgbd = sensor == "rgbd";
+  if (!rgbd && sensor != "mono") {
+    cerr << "[ERROR] Unknown sensor " << sensor << endl;
+    return 1;
+  }
+
+  if ((rgbd && argc != 5) || (!rgbd && argc > 5)) {
+    cerr << "[ERROR] Wrong number of arguments" << endl;
+    return 1;
+  }
+
+  // Retrieve paths to images
+  strSequence = string(argv[2]);
+  if (rgbd) {
+    strOutput = string(argv[4]);
+    if (!SD_SLAM::DatasetReader::LoadAssociations(string(argv[3]), vTimestamps, vFilenames, vFilenamesD)) {
+      cerr << "[ERROR] Couldn't find images, does " << argv[3] << " exist?" << endl;
+      return 1;
+    }
+  } else {
+    strOutput = string(argv[3]);
+    string filename = strSequence+"/files.txt";
+    if (!SD_SLAM::DatasetReader::LoadImages(filename, vFilenames)) {
+      cerr << "[ERROR] Couldn't find images, does " << filename << " exist?" << endl;
+      return 1;
+    }
+    for (const string &f : vFilenames)
+      vTimestamps.push_back(TimestampFromFilename(f));
+
+    if (argc == 5) {
+      strIMU = string(argv[4]);
+      if (!SD_SLAM::DatasetReader::LoadIMU(strIMU, vIMUValues)) {
+        cerr << "[ERROR] Couldn't read IMU values from " << strIMU << endl;
+        return 1;
+      }
+    }
+  }
+
+  if (vFilenames.empty()) {
+    cerr << "[ERROR] No images found in provided path." << endl;
+    return 1;
+  }
+
+  SD_SLAM::SequenceWriter writer;
+  if (!writer.Open(strOutput))
+    return 1;
+
+  // IMU timestamps are in ns (EuRoC) or s
+  for (const vector<double> &v : vIMUValues) {
+    const double t = v[0] > 1e12 ? v[0]*1e-9 : v[0];
+    writer.AddIMU(t, &v[1], &v[4]);
+  }
+
+  // Decode images in background, they are written in sequence order
+  SD_SLAM::DatasetReader reader(strSequence, vFilenames, vFilenamesD);
+  const int nImages = vFilenames.size();
+  for (int ni = 0; ni < nImages; ni++) {
+    SD_SLAM::DatasetReader::Item item;
+    if (!reader.Next(item) || item.image.empty() || (rgbd && item.depth.empty())) {
+      cerr << "[ERROR] Failed to load image at: " << strSequence << "/" << vFilenames[ni] << endl;
+      return 1;
+    }
+
+    if (!writer.AddFrame(vTimestamps[ni], item.image, item.depth)) {
+      cerr << "[ERROR] Couldn't write frame " << ni << " to " << strOutput << endl;
+      return 1;
+    }
+  }
+
+  if (!writer.Close()) {
+    cerr << "[ERROR] Couldn't write " << strOutput << endl;
+    return 1;
+  }
+
+  cerr << "[INFO] Packed " << nImages << " frames and " << vIMUValues.size() << " IMU samples into "
+       << strOutput << endl;
+
+  return 0;
+}
+
+// Image names are timestamps in seconds (TUM) or nanoseconds (EuRoC)
+double TimestampFromFilename(const string &filename) {
+  string name = filename.substr(filename.find_last_of('/')+1);
+  name = name.substr(0, name.find_last_of('.'));
+
+  double t = atof(name.c_str());
+  if (t > 1e12)
+    t *= 1e-9;
+  return t;
+}
@@ -0,0 +1,421 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Measures how the stages whose cost may depend on the map size scale with it. A synthetic
+// RGB-D camera moves along a wall of points and observes the ones in view with pixel noise,
+// so poses and points have known ground truth. The map is grown in stages (doubling up to
+// max_keyframes) the way local mapping does, and after each stage keyframe insertion, local
+// map tracking, loop candidate search, map queries, local and global BA and map persistence
+// are timed, together with memory and the trajectory error after global BA.
+// Results are written to stderr. Debug output goes to stdout, redirect it to ignore it.
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_set>
+#include <sys/resource.h>
+#include <opencv2/core/core.hpp>
+#include "System.h"
+#include "Tracking.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "KeyFrame.h"
+#include "KeyFrameDatabase.h"
+#include "Config.h"
+#include "ORBmatcher.h"
+#include "Optimizer.h"
+#include "extra/timer.h"
+
+using namespace std;
+
+// Points are on a wall about this far from the camera path (m), each one seen by about
+// OBSERVATIONS consecutive keyframes
+const double WALL_DEPTH = 4.0;
+const int OBSERVATIONS = 5;
+
+// Initial errors of keyframe positions and points (m), keypoints (px) and bits flipped
+// in each observed descriptor
+const double POSE_NOISE = 0.02;
+const double POINT_NOISE = 0.03;
+const double PIXEL_NOISE = 0.5;
+const int DESCRIPTOR_NOISE = 3;
+
+// Wall points and camera path. Keyframe i is at Center(i), looking at the wall (+z)
+class SyntheticWorld {
+ public:
+  SyntheticWorld(int nKeyFrames, int nPointsPerKF);
+
+  Eigen::Vector3d Center(double i) const;
+  Eigen::Matrix4d Pose(double i) const;
+
+  inline size_t Points() const { return mvPoints.size(); }
+  inline const Eigen::Vector3d &Point(int id) const { return mvPoints[id]; }
+
+  // Frame at position i with a keypoint for every point in view. vIds gets the point of each one
+  SD_SLAM::Frame MakeFrame(SD_SLAM::Tracking* pTracker, double i, vector<int> &vIds);
+
+  // Appearance descriptor of the place of keyframe i. Revisits add noise
+  vector<float> Thumbnail(int i, double noise);
+
+  inline mt19937 &Rng() { return mRng; }
+
+ private:
+  vector<Eigen::Vector3d> mvPoints;  // Sorted by x
+  double mfStep;
+  double mfHalfWidth;
+  mt19937 mRng;
+};
+
+uint64_t SplitMix64(uint64_t x);
+double RMSE(const vector<SD_SLAM::KeyFrame*> &vpKFs, const SyntheticWorld &world);
+long PeakRSS();
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 5) {
+    cerr << endl << "Usage: ./sdslam_scalebench path_to_settings [max_keyframes] [points_per_keyframe] "
+         << "[max_gba_keyframes]" << endl;
+    return 1;
+  }
+
+  const int nMaxKFs = argc > 2 ? atoi(argv[2]) : 10000;
+  const int nPointsPerKF = argc > 3 ? atoi(argv[3]) : 500;
+  const int nMaxGBA = argc > 4 ? atoi(argv[4]) : 2000;
+
+  // Read parameters
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[1])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  // Map is built here, only the tracker is used to create frames
+  SD_SLAM::System SLAM(SD_SLAM::System::RGBD, false);
+  SLAM.Shutdown();
+
+  SD_SLAM::Map* pMap = SLAM.GetMap();
+  SD_SLAM::Tracking* pTracker = SLAM.GetTracker();
+  SD_SLAM::KeyFrameDatabase* pDB = pMap->GetKeyFrameDatabase();
+
+  SyntheticWorld world(nMaxKFs, nPointsPerKF);
+  mt19937 &rng = world.Rng();
+  normal_distribution<double> poseNoise(0.0, POSE_NOISE), pointNoise(0.0, POINT_NOISE);
+
+  cerr << "[INFO] World has " << world.Points() << " points for " << nMaxKFs << " keyframes" << endl;
+
+  cerr << setw(8) << "kfs" << setw(10) << "points" << setw(10) << "insert" << setw(9) << "track"
+       << setw(9) << "loop" << setw(7) << "recall" << setw(10) << "allpts" << setw(9) << "getkf"
+       << setw(10) << "localba" << setw(10) << "gba" << setw(9) << "gbaMB" << setw(8) << "ate" << setw(10)
+       << "save" << setw(10) << "load" << setw(9) << "mapMB" << setw(9) << "rssMB" << endl;
+  cerr << setw(8) << "" << setw(10) << "" << setw(10) << "ms/kf" << setw(9) << "ms" << setw(9) << "ms"
+       << setw(7) << "" << setw(10) << "ms" << setw(9) << "us" << setw(10) << "ms" << setw(10) << "ms"
+       << setw(9) << "" << setw(8) << "cm" << setw(10) << "ms" << setw(10) << "ms" << endl;
+
+  vector<SD_SLAM::MapPoint*> vpPoints(world.Points(), nullptr);
+  vector<SD_SLAM::KeyFrame*> vpKFs;
+  SD_SLAM::MapPointBatch batch;
+  SD_SLAM::ORBmatcher matcher(0.9, true);
+  const string mapname = "sdslam_scalebench.map";
+
+  int nStage = std::min(1000, nMaxKFs);
+  while (true) {
+    // Grow the map as local mapping would: new keyframe, its points, connections and point updates
+    const int nNew = nStage - vpKFs.size();
+    SD_SLAM::Timer insert(true);
+    while (static_cast<int>(vpKFs.size()) < nStage) {
+      const int i = vpKFs.size();
+      vector<int> vIds;
+      SD_SLAM::Frame frame = world.MakeFrame(pTracker, i, vIds);
+
+      Eigen::Matrix4d Tcw = world.Pose(i);
+      if (i > 0)
+        Tcw.block<3, 1>(0, 3) += Eigen::Vector3d(poseNoise(rng), poseNoise(rng), poseNoise(rng));
+      frame.SetPose(Tcw);
+
+      SD_SLAM::KeyFrame* pKF = new SD_SLAM::KeyFrame(frame, pMap);
+      pDB->add(pKF, world.Thumbnail(i, 0.0));
+      pMap->AddKeyFrame(pKF);
+      if (i == 0)
+        pMap->mvpKeyFrameOrigins.push_back(pKF);
+
+      for (size_t j = 0; j < vIds.size(); j++) {
+        SD_SLAM::MapPoint* &pMP = vpPoints[vIds[j]];
+        if (!pMP) {
+          Eigen::Vector3d pos = world.Point(vIds[j]);
+          pos += Eigen::Vector3d(pointNoise(rng), pointNoise(rng), pointNoise(rng));
+          pMP = new SD_SLAM::MapPoint(pos, pKF, pMap);
+          pMap->AddMapPoint(pMP);
+        }
+        pKF->AddMapPoint(pMP, j);
+        pMP->AddObservation(pKF, j);
+        batch.Add(pMP, true);
+      }
+
+      pKF->UpdateConnections();
+      batch.Apply(nullptr, 0);
+      vpKFs.push_back(pKF);
+    }
+    insert.Stop();
+
+    SD_SLAM::KeyFrame* pLastKF = vpKFs.back();
+
+    // Local map tracking of a frame between the last two keyframes, from a perturbed pose
+    vector<int> vIds;
+    SD_SLAM::Frame frame = world.MakeFrame(pTracker, vpKFs.size()-1.5, vIds);
+    Eigen::Matrix4d Tcw = world.Pose(vpKFs.size()-1.5);
+    Tcw.block<3, 1>(0, 3) += Eigen::Vector3d(0.01, -0.01, 0.01);
+    frame.SetPose(Tcw);
+
+    SD_SLAM::Timer track(true);
+    vector<SD_SLAM::KeyFrame*> vpLocalKFs = pLastKF->GetBestCovisibilityKeyFrames(20);
+    vpLocalKFs.push_back(pLastKF);
+    unordered_set<SD_SLAM::MapPoint*> sLocal;
+    vector<SD_SLAM::MapPoint*> vpLocalPoints;
+    for (SD_SLAM::KeyFrame* pKF : vpLocalKFs) {
+      for (SD_SLAM::MapPoint* pMP : pKF->GetMapPointMatches()) {
+        if (pMP && sLocal.insert(pMP).second && frame.isInFrustum(pMP, 0.5))
+          vpLocalPoints.push_back(pMP);
+      }
+    }
+    matcher.SearchByProjection(frame, vpLocalPoints, 3);
+    SD_SLAM::Optimizer::PoseOptimization(&frame);
+    track.Stop();
+
+    // Loop candidates of a keyframe revisiting an early place, which must be found
+    const int nPlace = std::uniform_int_distribution<int>(0, vpKFs.size()/4)(rng);
+    vIds.clear();
+    SD_SLAM::Frame revisit = world.MakeFrame(pTracker, nPlace, vIds);
+    revisit.SetPose(world.Pose(nPlace));
+    SD_SLAM::KeyFrame* pRevisitKF = new SD_SLAM::KeyFrame(revisit, pMap);  // Not added to the map
+    pDB->add(pRevisitKF, world.Thumbnail(nPlace, 0.5));
+
+    SD_SLAM::Timer loop(true);
+    vector<SD_SLAM::KeyFrame*> vpCandidates = pDB->DetectLoopCandidates(pRevisitKF, 3);
+    loop.Stop();
+    pDB->erase(pRevisitKF);
+    const bool bFound = find(vpCandidates.begin(), vpCandidates.end(), vpKFs[nPlace]) != vpCandidates.end();
+
+    // Map queries
+    SD_SLAM::Timer allPoints(true);
+    const vector<SD_SLAM::MapPoint*> vpAllMPs = pMap->GetAllMapPoints();
+    allPoints.Stop();
+
+    const int nLookups = 10000;
+    std::uniform_int_distribution<int> kfDist(0, vpKFs.size()-1);
+    vector<int> vLookups(nLookups);
+    for (int &id : vLookups)
+      id = vpKFs[kfDist(rng)]->mnId;
+    int nFound = 0;
+    SD_SLAM::Timer getKF(true);
+    for (int id : vLookups)
+      nFound += pMap->GetKeyFrame(id) != nullptr;
+    getKF.Stop();
+    if (nFound != nLookups)
+      cerr << "[ERROR] Only " << nFound << " of " << nLookups << " keyframes were found" << endl;
+
+    // Local BA around last keyframe
+    bool bStop = false;
+    SD_SLAM::Timer localBA(true);
+    SD_SLAM::Optimizer::LocalBundleAdjustment(pLastKF, &bStop, pMap, SD_SLAM::Config::ThreadsBA());
+    localBA.Stop();
+
+    // Global BA, skipped for maps too large for the time given to the benchmark
+    SD_SLAM::Timer gba(true);
+    const bool bGBA = static_cast<int>(vpKFs.size()) <= nMaxGBA;
+    if (bGBA)
+      SD_SLAM::Optimizer::GlobalBundleAdjustemnt(pMap, 5, NULL, 0, true, SD_SLAM::Config::ThreadsBA(),
+                                                 SD_SLAM::Config::BackendBA());
+    gba.Stop();
+    const double ate = RMSE(vpKFs, world);
+
+    // Persistence, loaded in a new system
+    SD_SLAM::Timer save(true);
+    const bool bSaved = SLAM.SaveMap(mapname);
+    save.Stop();
+
+    SD_SLAM::Timer load(true);
+    bool bLoaded = false;
+    if (bSaved) {
+      SD_SLAM::System loader(SD_SLAM::System::RGBD, false);
+      bLoaded = loader.LoadMap(mapname);
+      load.Stop();
+      loader.Shutdown();
+    }
+    remove(mapname.c_str());
+
+    const SD_SLAM::Map::MemoryReport memory = pMap->GetMemoryReport();
+    const double MB = 1.0/(1024.0*1024.0);
+
+    cerr << fixed << setprecision(2) << setw(8) << vpKFs.size() << setw(10) << vpAllMPs.size()
+         << setw(10) << insert.GetMsTime()/std::max(nNew, 1) << setw(9) << track.GetMsTime()
+         << setw(9) << loop.GetMsTime() << setw(7) << (bFound ? "yes" : "no")
+         << setw(10) << allPoints.GetMsTime() << setw(9) << getKF.GetMsTime()*1000.0/nLookups
+         << setw(10) << localBA.GetMsTime();
+    if (bGBA)
+      cerr << setw(10) << gba.GetMsTime() << setw(9) << SD_SLAM::Optimizer::GetPeakGraphBytes()*MB;
+    else
+      cerr << setw(10) << "-" << setw(9) << "-";
+    cerr << setw(8) << ate*100.0;
+    if (bLoaded)
+      cerr << setw(10) << save.GetMsTime() << setw(10) << load.GetMsTime();
+    else
+      cerr << setw(10) << "-" << setw(10) << "-";
+    cerr << setw(9) << memory.total*MB << setw(9) << PeakRSS()/1024.0 << endl;
+
+    if (nStage >= nMaxKFs)
+      break;
+    nStage = std::min(2*nStage, nMaxKFs);
+  }
+
+  return 0;
+}
+
+SyntheticWorld::SyntheticWorld(int nKeyFrames, int nPointsPerKF): mRng(42) {
+  const double fx = SD_SLAM::Config::fx(), fy = SD_SLAM::Config::fy();
+
+  // Part of the wall in view, points are kept away from the borders
+  mfHalfWidth = 0.9*WALL_DEPTH*SD_SLAM::Config::Width()/(2.0*fx);
+  const double halfHeight = 0.9*WALL_DEPTH*SD_SLAM::Config::Height()/(2.0*fy);
+  mfStep = 2.0*mfHalfWidth/OBSERVATIONS;
+
+  const double density = nPointsPerKF/(2.0*mfHalfWidth);
+  const double length = (nKeyFrames+1)*mfStep + 2.0*mfHalfWidth;
+  const size_t nPoints = length*density;
+
+  uniform_real_distribution<double> jitter(0.0, 1.0/density), y(-halfHeight, halfHeight), z(-0.5, 0.5);
+  mvPoints.resize(nPoints);
+  for (size_t j = 0; j < nPoints; j++)
+    mvPoints[j] = Eigen::Vector3d(-mfHalfWidth + j/density + jitter(mRng), y(mRng), WALL_DEPTH + z(mRng));
+
+  sort(mvPoints.begin(), mvPoints.end(), [](const Eigen::Vector3d &a, const Eigen::Vector3d &b) {
+    return a.x() < b.x();
+  });
+}
+
+Eigen::Vector3d SyntheticWorld::Center(double i) const {
+  return Eigen::Vector3d(i*mfStep, 0.2*sin(0.05*i), 0.2*sin(0.03*i));
+}
+
+Eigen::Matrix4d SyntheticWorld::Pose(double i) const {
+  Eigen::Matrix4d Tcw = Eigen::Matrix4d::Identity();
+  Tcw.block<3, 1>(0, 3) = -Center(i);
+  return Tcw;
+}
+
+SD_SLAM::Frame SyntheticWorld::MakeFrame(SD_SLAM::Tracking* pTracker, double i, vector<int> &vIds) {
+  const double fx = SD_SLAM::Config::fx(), fy = SD_SLAM::Config::fy();
+  const double cx = SD_SLAM::Config::cx(), cy = SD_SLAM::Config::cy();
+  const double bf = SD_SLAM::Config::bf();
+  const double width = SD_SLAM::Config::Width(), height = SD_SLAM::Config::Height();
+  normal_distribution<double> pixelNoise(0.0, PIXEL_NOISE);
+  uniform_int_distribution<int> bit(0, 8*SD_SLAM::MapPoint::DESCRIPTOR_SIZE-1);
+
+  const Eigen::Vector3d c = Center(i);
+  vector<cv::KeyPoint> vKeys;
+  vector<float> vDepth, vRight;
+  vIds.clear();
+
+  // Points in view are within the visible width at the nearest depth
+  const double margin = 1.5*mfHalfWidth;
+  auto it = lower_bound(mvPoints.begin(), mvPoints.end(), c.x()-margin,
+                        [](const Eigen::Vector3d &p, double x) { return p.x() < x; });
+  for (; it != mvPoints.end() && it->x() < c.x()+margin; it++) {
+    const Eigen::Vector3d Xc = *it - c;
+    const double u = fx*Xc.x()/Xc.z() + cx + pixelNoise(mRng);
+    const double v = fy*Xc.y()/Xc.z() + cy + pixelNoise(mRng);
+    if (u < 0.0 || v < 0.0 || u >= width || v >= height)
+      continue;
+
+    vKeys.push_back(cv::KeyPoint(u, v, 31.0f, 0.0f, 0.0f, 0));
+    vDepth.push_back(Xc.z());
+    vRight.push_back(bf > 0.0 ? u - bf/Xc.z() : -1.0f);
+    vIds.push_back(it - mvPoints.begin());
+  }
+
+  // Descriptor of each point, with a few bits changed in every observation
+  cv::Mat descriptors(vKeys.size(), SD_SLAM::MapPoint::DESCRIPTOR_SIZE, CV_8U);
+  for (size_t j = 0; j < vIds.size(); j++) {
+    uchar* desc = descriptors.ptr<uchar>(j);
+    for (int w = 0; w < SD_SLAM::MapPoint::DESCRIPTOR_SIZE/8; w++) {
+      const uint64_t bits = SplitMix64(4*static_cast<uint64_t>(vIds[j]) + w);
+      for (int b = 0; b < 8; b++)
+        desc[8*w+b] = static_cast<uchar>(bits >> (8*b));
+    }
+    for (int k = 0; k < DESCRIPTOR_NOISE; k++) {
+      const int n = bit(mRng);
+      desc[n/8] ^= 1 << (n%8);
+    }
+  }
+
+  vector<cv::KeyPoint> vKeysUn(vKeys);
+  return pTracker->CreateFrame(std::move(vKeys), std::move(vKeysUn), std::move(vRight), std::move(vDepth),
+                               descriptors, vector<cv::Mat>(), cv::Mat(), cv::Size(width, height));
+}
+
+vector<float> SyntheticWorld::Thumbnail(int i, double noise) {
+  const int size = SD_SLAM::KeyFrameDatabase::THUMB_WIDTH*SD_SLAM::KeyFrameDatabase::THUMB_HEIGHT;
+  mt19937 place(i);
+  normal_distribution<float> value(0.0f, 1.0f);
+
+  // Zero mean and unit norm, as computed from images
+  vector<float> desc(size);
+  double mean = 0.0;
+  for (float &d : desc) {
+    d = value(place) + noise*value(mRng);
+    mean += d;
+  }
+  mean /= size;
+
+  double norm = 0.0;
+  for (float &d : desc) {
+    d -= mean;
+    norm += d*d;
+  }
+  norm = sqrt(norm);
+  for (float &d : desc)
+    d /= norm;
+
+  return desc;
+}
+
+uint64_t SplitMix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Root mean square error of keyframe centers. The first keyframe is fixed at its true pose
+double RMSE(const vector<SD_SLAM::KeyFrame*> &vpKFs, const SyntheticWorld &world) {
+  double sum = 0.0;
+  for (size_t i = 0; i < vpKFs.size(); i++)
+    sum += (vpKFs[i]->GetCameraCenter() - world.Center(i)).squaredNorm();
+  return sqrt(sum/vpKFs.size());
+}
+
+// Peak resident set size in kilobytes
+long PeakRSS() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
+}
@@ -0,0 +1,221 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Processes a list of TUM or EuRoC sequences concurrently in one process, each one with its
+// own SLAM system, and writes the trajectory of every sequence in TUM format. All sequences
+// use the same settings file. Debug output goes to stdout, redirect it to ignore it.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <Eigen/Geometry>
+#include "System.h"
+#include "Tracking.h"
+#include "Map.h"
+#include "Config.h"
+#include "extra/timer.h"
+#include "extra/dataset_reader.h"
+
+using namespace std;
+
+struct Sequence {
+  string path;
+  string association;
+};
+
+bool LoadSequences(const string &strFile, vector<Sequence> &vSequences);
+bool RunSequence(const Sequence &seq, bool rgbd, const string &strOutput, string &summary);
+double TimestampFromFilename(const string &filename);
+
+int main(int argc, char **argv) {
+  if (argc < 5 || argc > 6) {
+    cerr << endl << "Usage: ./slam_batch mono|rgbd path_to_settings sequences.txt output_folder [jobs]" << endl;
+    cerr << "       Each line of sequences.txt is path_to_sequence (mono) or path_to_sequence path_to_association (rgbd)" << endl;
+    return 1;
+  }
+
+  const string sensor = string(argv[1]);
+  const bool rgbd = sensor == "rgbd";
+  if (!rgbd && sensor != "mono") {
+    cerr << "[ERROR] Unknown sensor " << sensor << endl;
+    return 1;
+  }
+
+  // Read parameters, shared by all systems
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[2])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  vector<Sequence> vSequences;
+  if (!LoadSequences(argv[3], vSequences) || vSequences.empty()) {
+    cerr << "[ERROR] Couldn't read sequences from " << argv[3] << endl;
+    return 1;
+  }
+
+  for (const Sequence &seq : vSequences) {
+    if (rgbd && seq.association.empty()) {
+      cerr << "[ERROR] Sequence " << seq.path << " has no association file" << endl;
+      return 1;
+    }
+  }
+
+  const string strOutput = string(argv[4]);
+  int nJobs = argc == 6 ? atoi(argv[5]) : std::thread::hardware_concurrency();
+  nJobs = std::max(1, std::min(nJobs, static_cast<int>(vSequences.size())));
+
+  // Every worker takes the next pending sequence
+  std::atomic<int> next(0), failed(0);
+  mutex mutexOutput;
+  SD_SLAM::Timer total(true);
+
+  vector<thread> vWorkers;
+  for (int j = 0; j < nJobs; j++) {
+    vWorkers.push_back(thread([&]() {
+      for (int i = next++; i < static_cast<int>(vSequences.size()); i = next++) {
+        stringstream ss;
+        ss << strOutput << "/trajectory_" << i << ".txt";
+
+        string summary;
+        bool ok = RunSequence(vSequences[i], rgbd, ss.str(), summary);
+        if (!ok)
+          failed++;
+
+        unique_lock<mutex> lock(mutexOutput);
+        cerr << (ok ? "[INFO] " : "[ERROR] ") << vSequences[i].path << ": " << summary << endl;
+      }
+    }));
+  }
+
+  for (thread &t : vWorkers)
+    t.join();
+  total.Stop();
+
+  cerr << "[INFO] " << vSequences.size() << " sequences (" << failed << " failed) in " << total.GetTime()
+       << "s with " << nJobs << " jobs" << endl;
+
+  return failed > 0 ? 1 : 0;
+}
+
+bool RunSequence(const Sequence &seq, bool rgbd, const string &strOutput, string &summary) {
+  vector<string> vFilenames, vFilenamesD;
+  vector<double> vTimestamps;
+
+  if (rgbd) {
+    if (!SD_SLAM::DatasetReader::LoadAssociations(seq.association, vTimestamps, vFilenames, vFilenamesD)) {
+      summary = "couldn't read " + seq.association;
+      return false;
+    }
+  } else {
+    if (!SD_SLAM::DatasetReader::LoadImages(seq.path+"/files.txt", vFilenames)) {
+      summary = "couldn't read " + seq.path + "/files.txt";
+      return false;
+    }
+    for (const string &f : vFilenames)
+      vTimestamps.push_back(TimestampFromFilename(f));
+  }
+
+  ofstream f(strOutput.c_str());
+  if (!f.is_open()) {
+    summary = "couldn't write " + strOutput;
+    return false;
+  }
+  f << fixed;
+
+  // Images are read while processing, sequences are not preloaded
+  SD_SLAM::System SLAM(rgbd ? SD_SLAM::System::RGBD : SD_SLAM::System::MONOCULAR, true);
+
+  const int nImages = vFilenames.size();
+  int nTracked = 0;
+  SD_SLAM::Timer timer(true);
+  for (int ni = 0; ni < nImages && !SLAM.StopRequested(); ni++) {
+    cv::Mat im = cv::imread(seq.path+"/"+vFilenames[ni], CV_LOAD_IMAGE_GRAYSCALE);
+    cv::Mat imD;
+    if (rgbd)
+      imD = cv::imread(seq.path+"/"+vFilenamesD[ni], CV_LOAD_IMAGE_UNCHANGED);
+
+    if (im.empty() || (rgbd && imD.empty())) {
+      SLAM.Shutdown();
+      summary = "failed to load image " + vFilenames[ni];
+      return false;
+    }
+
+    Eigen::Matrix4d pose = rgbd ? SLAM.TrackRGBD(im, imD, vFilenames[ni]) : SLAM.TrackMonocular(im, vFilenames[ni]);
+    if (SLAM.GetTrackingState() != SD_SLAM::Tracking::OK)
+      continue;
+
+    // Camera pose in world coordinates
+    Eigen::Matrix3d Rwc = pose.block<3, 3>(0, 0).transpose();
+    Eigen::Vector3d Ow = -Rwc*pose.block<3, 1>(0, 3);
+    Eigen::Quaterniond q(Rwc);
+    f << setprecision(6) << vTimestamps[ni] << setprecision(7) << " " << Ow(0) << " " << Ow(1) << " " << Ow(2)
+      << " " << q.x() << " " << q.y() << " " << q.z() << " " << q.w() << endl;
+    nTracked++;
+  }
+  timer.Stop();
+
+  SLAM.Shutdown();
+  f.close();
+
+  stringstream ss;
+  ss << nTracked << "/" << nImages << " frames tracked, " << SLAM.GetMap()->KeyFramesInMap() << " keyframes in "
+     << timer.GetTime() << "s, trajectory saved to " << strOutput;
+  summary = ss.str();
+  return true;
+}
+
+// One sequence per line, empty lines and comments are skipped
+bool LoadSequences(const string &strFile, vector<Sequence> &vSequences) {
+  ifstream f(strFile.c_str());
+  if (!f.is_open())
+    return false;
+
+  string line;
+  while (getline(f, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    stringstream ss(line);
+    Sequence seq;
+    ss >> seq.path >> seq.association;
+    if (!seq.path.empty())
+      vSequences.push_back(seq);
+  }
+
+  return true;
+}
+
+// Image names are timestamps in seconds (TUM) or nanoseconds (EuRoC)
+double TimestampFromFilename(const string &filename) {
+  string name = filename.substr(filename.find_last_of('/')+1);
+  name = name.substr(0, name.find_last_of('.'));
+
+  double t = atof(name.c_str());
+  if (t > 1e12)
+    t *= 1e-9;
+  return t;
+}
@@ -0,0 +1,336 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Runs a TUM or EuRoC sequence as fast as possible, without viewer and with all images
+// preloaded, and writes a JSON report with stage latencies, map size, peak memory and
+// absolute trajectory error. Debug output goes to stdout, redirect it to ignore it.
+// Packed sequences (pack_sequence) are mapped instead of decoded, frames are read in place.
+
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <sys/resource.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <Eigen/Geometry>
+#include "System.h"
+#include "Tracking.h"
+#include "Map.h"
+#include "Config.h"
+#include "extra/timer.h"
+#include "extra/stats.h"
+#include "extra/dataset_reader.h"
+#include "extra/sequence_file.h"
+
+using namespace std;
+
+struct StampedPosition {
+  double t;
+  Eigen::Vector3d p;
+};
+
+bool LoadGroundTruth(const string &strFile, vector<StampedPosition> &vGroundTruth);
+double TimestampFromFilename(const string &filename);
+long PeakRSS();
+
+int main(int argc, char **argv) {
+  vector<string> vFilenames, vFilenamesD;
+  vector<double> vTimestamps;
+  vector<cv::Mat> vImages, vDepths;
+  vector<StampedPosition> vGroundTruth, vEstimated;
+  string sensor, strGroundTruth, strOutput = "benchmark.json";
+  SD_SLAM::SequenceReader packed;
+
+  if (argc < 5) {
+    cerr << endl << "Usage: ./slam_bench mono path_to_settings path_to_sequence path_to_groundtruth|none [output.json]" << endl;
+    cerr << "       ./slam_bench rgbd path_to_settings path_to_sequence path_to_association path_to_groundtruth|none [output.json]" << endl;
+    cerr << "       ./slam_bench packed path_to_settings sequence.sdseq path_to_groundtruth|none [output.json]" << endl;
+    return 1;
+  }
+
+  sensor = string(argv[1]);
+  const bool isPacked = sensor == "packed";
+  if (isPacked) {
+    if (!packed.Open(argv[3])) {
+      cerr << "[ERROR] Couldn't read packed sequence " << argv[3] << endl;
+      return 1;
+    }
+    sensor = packed.HasDepth() ? "rgbd" : "mono";
+  }
+
+  const bool rgbd = sensor == "rgbd";
+  if (!rgbd && sensor != "mono") {
+    cerr << "[ERROR] Unknown sensor " << sensor << endl;
+    return 1;
+  }
+
+  // Packed sequences carry their own associations
+  const bool association = rgbd && !isPacked;
+  if ((association && argc < 6) || argc > (association ? 7 : 6)) {
+    cerr << "[ERROR] Wrong number of arguments" << endl;
+    return 1;
+  }
+
+  strGroundTruth = string(argv[association ? 5 : 4]);
+  if (argc == (association ? 7 : 6))
+    strOutput = string(argv[argc-1]);
+
+  // Read parameters
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[2])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  // Retrieve paths to images
+  string strSequence = string(argv[3]);
+  if (isPacked) {
+    vTimestamps.resize(packed.Size());
+    vFilenames.resize(packed.Size());
+  } else if (rgbd) {
+    if (!SD_SLAM::DatasetReader::LoadAssociations(string(argv[4]), vTimestamps, vFilenames, vFilenamesD)) {
+      cerr << "[ERROR] Couldn't find images, does " << argv[4] << " exist?" << endl;
+      return 1;
+    }
+  } else {
+    string filename = strSequence+"/files.txt";
+    if (!SD_SLAM::DatasetReader::LoadImages(filename, vFilenames)) {
+      cerr << "[ERROR] Couldn't find images, does " << filename << " exist?" << endl;
+      return 1;
+    }
+    for (const string &f : vFilenames)
+      vTimestamps.push_back(TimestampFromFilename(f));
+  }
+
+  if (vFilenames.empty()) {
+    cerr << "[ERROR] No images found in provided path." << endl;
+    return 1;
+  }
+
+  if (strGroundTruth != "none" && !LoadGroundTruth(strGroundTruth, vGroundTruth)) {
+    cerr << "[ERROR] Couldn't read ground truth " << strGroundTruth << endl;
+    return 1;
+  }
+
+  // Preload images so disk access is not measured. Packed frames are views of the mapping,
+  // touching them here faults their pages in before the run
+  const int nImages = vFilenames.size();
+  vImages.resize(nImages);
+  if (rgbd)
+    vDepths.resize(nImages);
+  for (int i = 0; i < nImages && isPacked; i++) {
+    SD_SLAM::SequenceReader::Frame frame;
+    if (!packed.Get(i, frame) || (rgbd && frame.depth.empty())) {
+      cerr << "[ERROR] Frame " << i << " of " << strSequence << " is not valid" << endl;
+      return 1;
+    }
+
+    vTimestamps[i] = frame.timestamp;
+    vImages[i] = frame.image;
+    if (rgbd)
+      vDepths[i] = frame.depth;
+
+    volatile uint8_t touch = 0;
+    for (const cv::Mat &m : {frame.image, frame.depth}) {
+      for (size_t k = 0; k < m.total()*m.elemSize(); k += 4096)
+        touch += m.data[k];
+    }
+  }
+
+  for (int i = 0; i < nImages && !isPacked; i++) {
+    vImages[i] = cv::imread(strSequence+"/"+vFilenames[i], CV_LOAD_IMAGE_GRAYSCALE);
+    if (rgbd)
+      vDepths[i] = cv::imread(strSequence+"/"+vFilenamesD[i], CV_LOAD_IMAGE_UNCHANGED);
+
+    if (vImages[i].empty() || (rgbd && vDepths[i].empty())) {
+      cerr << "[ERROR] Failed to load image at: " << strSequence << "/" << vFilenames[i] << endl;
+      return 1;
+    }
+  }
+
+  const long preloadRSS = PeakRSS();
+  cerr << "[INFO] Sequence has " << nImages << " images" << endl;
+
+  // Create SLAM system. It initializes all system threads and gets ready to process frames.
+  SD_SLAM::System SLAM(rgbd ? SD_SLAM::System::RGBD : SD_SLAM::System::MONOCULAR, true);
+  SLAM.ResetStatistics();
+
+  // Main loop, no waiting between frames
+  int nTracked = 0;
+  SD_SLAM::Timer total(true);
+  for (int ni = 0; ni < nImages && !SLAM.StopRequested(); ni++) {
+    Eigen::Matrix4d pose;
+    if (rgbd)
+      pose = SLAM.TrackRGBD(vImages[ni], vDepths[ni], vFilenames[ni]);
+    else
+      pose = SLAM.TrackMonocular(vImages[ni], vFilenames[ni]);
+
+    if (SLAM.GetTrackingState() != SD_SLAM::Tracking::OK)
+      continue;
+
+    // Camera center in world coordinates
+    StampedPosition sp;
+    sp.t = vTimestamps[ni];
+    sp.p = -pose.block<3, 3>(0, 0).transpose()*pose.block<3, 1>(0, 3);
+    vEstimated.push_back(sp);
+    nTracked++;
+  }
+  total.Stop();
+
+  vector<SD_SLAM::Statistics::Summary> stats = SLAM.GetStatistics();
+
+  // Stop all threads
+  SLAM.Shutdown();
+
+  const long nKeyFrames = SLAM.GetMap()->KeyFramesInMap();
+  const long nMapPoints = SLAM.GetMap()->MapPointsInMap();
+
+  // Associate estimated positions with closest ground truth
+  const double maxDiff = 0.02;
+  vector<Eigen::Vector3d> vMatchedEst, vMatchedGt;
+  for (const StampedPosition &e : vEstimated) {
+    auto it = std::lower_bound(vGroundTruth.begin(), vGroundTruth.end(), e.t,
+                               [](const StampedPosition &a, double t) { return a.t < t; });
+    const StampedPosition* best = nullptr;
+    if (it != vGroundTruth.end())
+      best = &(*it);
+    if (it != vGroundTruth.begin() && (!best || fabs((it-1)->t-e.t) < fabs(best->t-e.t)))
+      best = &(*(it-1));
+
+    if (best && fabs(best->t-e.t) < maxDiff) {
+      vMatchedEst.push_back(e.p);
+      vMatchedGt.push_back(best->p);
+    }
+  }
+
+  // Align trajectories (with scale for monocular) and compute ATE
+  bool ateValid = vMatchedEst.size() >= 3;
+  double ateRmse = 0.0, ateMean = 0.0, ateMax = 0.0;
+  if (ateValid) {
+    const int n = vMatchedEst.size();
+    Eigen::Matrix3Xd src(3, n), dst(3, n);
+    for (int i = 0; i < n; i++) {
+      src.col(i) = vMatchedEst[i];
+      dst.col(i) = vMatchedGt[i];
+    }
+
+    Eigen::Matrix4d T = Eigen::umeyama(src, dst, !rgbd);
+    for (int i = 0; i < n; i++) {
+      const double e = (T.block<3, 3>(0, 0)*src.col(i)+T.block<3, 1>(0, 3)-dst.col(i)).norm();
+      ateRmse += e*e;
+      ateMean += e;
+      ateMax = std::max(ateMax, e);
+    }
+    ateRmse = sqrt(ateRmse/n);
+    ateMean /= n;
+  }
+
+  // Write report
+  ofstream f(strOutput.c_str());
+  if (!f.is_open()) {
+    cerr << "[ERROR] Couldn't write " << strOutput << endl;
+    return 1;
+  }
+
+  const double wallTime = total.GetTime();
+  f << "{" << endl;
+  f << "  \"sensor\": \"" << sensor << "\"," << endl;
+  f << "  \"sequence\": \"" << strSequence << "\"," << endl;
+  f << "  \"frames\": " << nImages << "," << endl;
+  f << "  \"tracked_frames\": " << nTracked << "," << endl;
+  f << "  \"wall_time_s\": " << wallTime << "," << endl;
+  f << "  \"fps\": " << (wallTime > 0 ? nImages/wallTime : 0.0) << "," << endl;
+  f << "  \"stages\": {" << endl;
+  for (size_t i = 0; i < stats.size(); i++) {
+    f << "    \"" << stats[i].name << "\": {\"count\": " << stats[i].count << ", \"p50_ms\": " << stats[i].p50
+      << ", \"p99_ms\": " << stats[i].p99 << ", \"max_ms\": " << stats[i].max << ", \"mean_ms\": " << stats[i].mean
+      << ", \"jitter_ms\": " << stats[i].jitter << "}";
+    f << (i+1 < stats.size() ? "," : "") << endl;
+  }
+  f << "  }," << endl;
+  f << "  \"keyframes\": " << nKeyFrames << "," << endl;
+  f << "  \"mappoints\": " << nMapPoints << "," << endl;
+  f << "  \"preload_rss_kb\": " << preloadRSS << "," << endl;
+  f << "  \"peak_rss_kb\": " << PeakRSS() << "," << endl;
+  if (ateValid) {
+    f << "  \"ate\": {\"pairs\": " << vMatchedEst.size() << ", \"rmse_m\": " << ateRmse << ", \"mean_m\": " << ateMean
+      << ", \"max_m\": " << ateMax << "}" << endl;
+  } else {
+    f << "  \"ate\": null" << endl;
+  }
+  f << "}" << endl;
+  f.close();
+
+  cerr << "[INFO] " << nImages << " frames in " << wallTime << "s, report saved to " << strOutput << endl;
+
+  return 0;
+}
+
+// TUM format (timestamp tx ty tz qx qy qz qw) or EuRoC csv (nanoseconds, px, py, pz, ...)
+bool LoadGroundTruth(const string &strFile, vector<StampedPosition> &vGroundTruth) {
+  ifstream f;
+  f.open(strFile.c_str());
+  if(!f.is_open())
+    return false;
+
+  while(!f.eof()) {
+    string s;
+    getline(f, s);
+    if (s.empty() || s[0] == '#')
+      continue;
+
+    std::replace(s.begin(), s.end(), ',', ' ');
+    stringstream ss;
+    ss << s;
+
+    StampedPosition sp;
+    if (!(ss >> sp.t >> sp.p(0) >> sp.p(1) >> sp.p(2)))
+      continue;
+
+    if (sp.t > 1e12)
+      sp.t *= 1e-9;
+    vGroundTruth.push_back(sp);
+  }
+
+  std::sort(vGroundTruth.begin(), vGroundTruth.end(),
+            [](const StampedPosition &a, const StampedPosition &b) { return a.t < b.t; });
+
+  return !vGroundTruth.empty();
+}
+
+// Image names are timestamps in seconds (TUM) or nanoseconds (EuRoC)
+double TimestampFromFilename(const string &filename) {
+  string name = filename.substr(filename.find_last_of('/')+1);
+  name = name.substr(0, name.find_last_of('.'));
+
+  double t = atof(name.c_str());
+  if (t > 1e12)
+    t *= 1e-9;
+  return t;
+}
+
+// Peak resident set size in kilobytes
+long PeakRSS() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
+}
@@ -0,0 +1,83 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Replays an input recording (System.RecordFile) and prints stage latencies. With the
+// deterministic option every run processes exactly the same workload, so results of
+// different builds can be compared. Debug output goes to stdout, redirect it to ignore it.
+
+#include <iostream>
+#include <string>
+#include "System.h"
+#include "Map.h"
+#include "Config.h"
+#include "extra/timer.h"
+#include "extra/stats.h"
+#include "extra/input_log.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argc > 4 || (argc == 4 && string(argv[3]) != "deterministic")) {
+    cerr << endl << "Usage: ./slam_replay path_to_settings path_to_recording [deterministic]" << endl;
+    return 1;
+  }
+
+  const bool deterministic = argc == 4;
+
+  // Read parameters
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[1])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  SD_SLAM::InputPlayer player;
+  if (!player.Open(argv[2])) {
+    cerr << "[ERROR] Couldn't read recording " << argv[2] << endl;
+    return 1;
+  }
+
+  // Create SLAM system for the recorded sensor
+  SD_SLAM::System SLAM(static_cast<SD_SLAM::System::eSensor>(player.GetSensor()), true);
+  SLAM.ResetStatistics();
+
+  SD_SLAM::Timer total(true);
+  const int nFrames = SLAM.Replay(player, deterministic);
+  total.Stop();
+
+  if (nFrames < 0) {
+    cerr << "[ERROR] Recording doesn't match the sensor" << endl;
+    SLAM.Shutdown();
+    return 1;
+  }
+
+  vector<SD_SLAM::Statistics::Summary> stats = SLAM.GetStatistics();
+
+  // Stop all threads
+  SLAM.Shutdown();
+
+  cerr << "[INFO] " << nFrames << " frames in " << total.GetTime() << "s, " << SLAM.GetMap()->KeyFramesInMap()
+       << " keyframes, " << SLAM.GetMap()->MapPointsInMap() << " map points" << endl;
+  for (const SD_SLAM::Statistics::Summary &s : stats) {
+    cerr << "[INFO] " << s.name << ": count " << s.count << ", p50 " << s.p50 << "ms, p99 " << s.p99
+         << "ms, max " << s.max << "ms, jitter " << s.jitter << "ms" << endl;
+  }
+
+  return 0;
+}
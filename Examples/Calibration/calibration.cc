@@ -21,19 +21,40 @@
 #include <fstream>
 #include <vector>
 #include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include "extra/thread_pool.h"
 
 using namespace std;
 
+// Detected pattern in an image
+struct View {
+  bool found;
+  vector<cv::Point2f> corners;
+  double feature[5];   // Position, size and tilt of the pattern, used to select views
+};
+
 void LoadImages(const string &strFile, vector<string> &vFilenames);
 
+// Find pattern in a downscaled image first, corners are then refined at full resolution
+bool DetectCorners(const cv::Mat &img, const cv::Size &patternsize, vector<cv::Point2f> &corners);
+
+// Summarize where the pattern is and how it is seen, so similar views are close
+void ComputeFeature(const vector<cv::Point2f> &corners, const cv::Size &patternsize, const cv::Size &imsize, double *feature);
+
+// Choose up to n views spread over the image and over distances and angles (farthest point sampling)
+vector<int> SelectViews(const vector<View> &views, int n);
+
 int main(int argc, char **argv) {
-  bool debug = true;
+  bool debug = false;
   const cv::Size patternsize(6,4);  // Num internal corners of pattern
   const double size = 0.0302;  // Cell size (cm)
+  int maxViews = 40;  // Views given to calibrateCamera
 
   vector<string> vFilenames;
   int nImages;
@@ -44,39 +65,59 @@ int main(int argc, char **argv) {
   vector<cv::Point3f> corners3D;
   cv::Size cam_size;
 
-  if(argc != 2) {
-      cerr << endl << "Usage: ./calibration path_to_sequence" << endl;
+  if(argc < 2 || argc > 4) {
+      cerr << endl << "Usage: ./calibration path_to_sequence [max_views] [debug]" << endl;
       return 1;
   }
 
+  if (argc >= 3)
+    maxViews = std::max(atoi(argv[2]), 1);
+  if (argc == 4)
+    debug = atoi(argv[3]) != 0;
+
   // Retrieve paths to images
   string filename = string(argv[1])+"/files.txt";
   LoadImages(filename, vFilenames);
   nImages = vFilenames.size();
   cout << "Found " << nImages << " images" << endl;
 
-  // Detect corners in images
-  for(int i=0; i<nImages; i++) {
-    vector<cv::Point2f> corners;
-    stringstream ss;
-
-    cout << "Reading image " << string(argv[1])+"/"+vFilenames[i] << endl;
+  // Detect corners in images, in parallel
+  vector<View> views(nImages);
+  vector<cv::Size> sizes(nImages);
+  SD_SLAM::ThreadPool pool(0);
+  pool.ParallelFor(nImages, [&](int i) {
     cv::Mat img = cv::imread(string(argv[1])+"/"+vFilenames[i], CV_LOAD_IMAGE_GRAYSCALE);
-    cv::Mat img_color = cv::imread(string(argv[1])+"/"+vFilenames[i], CV_LOAD_IMAGE_COLOR);
-    cam_size = img.size();
+    View &view = views[i];
+    view.found = !img.empty() && DetectCorners(img, patternsize, view.corners);
+    sizes[i] = img.size();
+    if (view.found)
+      ComputeFeature(view.corners, patternsize, img.size(), view.feature);
+  });
 
-    bool found = cv::findChessboardCorners(img, patternsize, corners);
+  int nFound = 0;
+  for(int i=0; i<nImages; i++) {
+    if (sizes[i].area() > 0)
+      cam_size = sizes[i];
+    if (views[i].found)
+      nFound++;
+  }
+  cout << "Pattern found in " << nFound << " images" << endl;
 
-    if (found) {
-      // Refine corners
-      cv::cornerSubPix(img,corners,cv::Size(11,11),cv::Size(-1,-1), cv::TermCriteria(CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 30, 0.1));
-      coord2D.push_back(corners);
+  if (nFound == 0) {
+    cerr << "[ERROR] Pattern not found" << endl;
+    return 1;
+  }
 
-      if (debug)
-        cv::drawChessboardCorners(img_color,patternsize,corners,found);
-    }
+  vector<int> selected = SelectViews(views, maxViews);
+  cout << "Calibrating with " << selected.size() << " views" << endl;
+
+  for (int i : selected) {
+    coord2D.push_back(views[i].corners);
 
     if (debug) {
+      cout << "Showing image " << string(argv[1])+"/"+vFilenames[i] << endl;
+      cv::Mat img_color = cv::imread(string(argv[1])+"/"+vFilenames[i], CV_LOAD_IMAGE_COLOR);
+      cv::drawChessboardCorners(img_color,patternsize,views[i].corners,true);
       cv::namedWindow("Display window", CV_WINDOW_AUTOSIZE );
       cv::imshow("Display window", img_color);
       cv::waitKey(0);
@@ -100,23 +141,122 @@ int main(int argc, char **argv) {
 
   // Save undistorted images
   if (debug) {
-    cv::Mat view, rview, map1, map2;
+    cv::Mat map1, map2;
     cv::initUndistortRectifyMap(cameraMatrix, distCoeffs, cv::Mat(),
       cv::getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, cam_size, 1, cam_size, 0),
       cam_size, CV_16SC2, map1, map2);
 
-    for(int i=0; i<nImages; i++) {
-      cout << "Saving image " << string(argv[1])+"/"+vFilenames[i] << endl;
-
+    pool.ParallelFor(nImages, [&](int i) {
+      cv::Mat view, rview;
       view = cv::imread(string(argv[1])+"/"+vFilenames[i], CV_LOAD_IMAGE_COLOR);
       cv::remap(view, rview, map1, map2, CV_INTER_LINEAR);
       cv::imwrite(string(argv[1])+"/"+vFilenames[i]+"_dst.png", rview);
-    }
+    });
   }
- 
+
   return 0;
 }
 
+bool DetectCorners(const cv::Mat &img, const cv::Size &patternsize, vector<cv::Point2f> &corners) {
+  const int MAX_SIDE = 640;
+  const int flags = CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE | CV_CALIB_CB_FAST_CHECK;
+  const double scale = static_cast<double>(MAX_SIDE)/std::max(img.cols, img.rows);
+
+  bool found = false;
+  if (scale < 1.0) {
+    cv::Mat small;
+    cv::resize(img, small, cv::Size(), scale, scale, cv::INTER_AREA);
+    found = cv::findChessboardCorners(small, patternsize, corners, flags);
+    if (found) {
+      for (cv::Point2f &pt : corners)
+        pt *= 1.0/scale;
+    }
+  }
+
+  // Small or blurred patterns may only be found at full resolution
+  if (!found)
+    found = cv::findChessboardCorners(img, patternsize, corners, flags);
+
+  if (found) {
+    // Refine corners, window covers the error of the downscaled detection
+    const int win = std::max(11, static_cast<int>(std::ceil(2.0/std::min(scale, 1.0))));
+    cv::cornerSubPix(img,corners,cv::Size(win,win),cv::Size(-1,-1), cv::TermCriteria(CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 30, 0.1));
+  }
+
+  return found;
+}
+
+void ComputeFeature(const vector<cv::Point2f> &corners, const cv::Size &patternsize, const cv::Size &imsize, double *feature) {
+  // Outer corners
+  const cv::Point2f &tl = corners[0];
+  const cv::Point2f &tr = corners[patternsize.width-1];
+  const cv::Point2f &bl = corners[corners.size()-patternsize.width];
+  const cv::Point2f &br = corners[corners.size()-1];
+
+  cv::Point2f center(0, 0);
+  for (const cv::Point2f &pt : corners)
+    center += pt;
+  center *= 1.0/corners.size();
+
+  vector<cv::Point2f> quad = {tl, tr, br, bl};
+  const double area = std::fabs(cv::contourArea(quad));
+
+  // Perspective shows as opposite sides of different length
+  const double top = cv::norm(tr-tl), bottom = cv::norm(br-bl);
+  const double left = cv::norm(bl-tl), right = cv::norm(br-tr);
+
+  feature[0] = center.x/imsize.width;
+  feature[1] = center.y/imsize.height;
+  feature[2] = std::sqrt(area/imsize.area());
+  feature[3] = std::log((top+1e-6)/(bottom+1e-6));
+  feature[4] = std::log((left+1e-6)/(right+1e-6));
+}
+
+vector<int> SelectViews(const vector<View> &views, int n) {
+  vector<int> candidates;
+  for (size_t i = 0; i < views.size(); i++) {
+    if (views[i].found)
+      candidates.push_back(i);
+  }
+
+  if (static_cast<int>(candidates.size()) <= n)
+    return candidates;
+
+  // Start with the largest pattern, then add the view farthest from the selected ones
+  vector<double> dist(candidates.size(), 1e30);
+  size_t next = 0;
+  for (size_t c = 1; c < candidates.size(); c++) {
+    if (views[candidates[c]].feature[2] > views[candidates[next]].feature[2])
+      next = c;
+  }
+
+  vector<int> selected;
+  while (static_cast<int>(selected.size()) < n) {
+    const double *f = views[candidates[next]].feature;
+    selected.push_back(candidates[next]);
+    dist[next] = -1.0;
+
+    size_t best = 0;
+    for (size_t c = 0; c < candidates.size(); c++) {
+      if (dist[c] < 0)
+        continue;
+
+      const double *g = views[candidates[c]].feature;
+      double d = 0.0;
+      for (int k = 0; k < 5; k++)
+        d += (f[k]-g[k])*(f[k]-g[k]);
+      dist[c] = std::min(dist[c], d);
+
+      if (dist[best] < 0 || dist[c] > dist[best])
+        best = c;
+    }
+    next = best;
+  }
+
+  std::sort(selected.begin(), selected.end());
+  return selected;
+}
+
 void LoadImages(const string &strFile, vector<string> &vFilenames) {
   ifstream f;
   f.open(strFile.c_str());
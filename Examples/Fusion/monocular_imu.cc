@@ -28,6 +28,7 @@
 #include "Map.h"
 #include "Config.h"
 #include "extra/timer.h"
+#include "extra/dataset_reader.h"
 #ifdef PANGOLIN
 #include "ui/Viewer.h"
 #include "ui/FrameDrawer.h"
@@ -36,16 +37,12 @@
 
 using namespace std;
 
-bool LoadImages(const string &strFile, vector<string> &vFilenames);
-void LoadIMU(const string &strFile, vector<vector<double>> &values);
-void Associate(const vector<string> &vFilenames, const vector<vector<double>> &valuesIn, vector<int> &valuesIdx);
-
 int main(int argc, char **argv) {
   vector<string> vFilenames;
   vector<vector<double>> vIMUValues;
   vector<int> vIdxValues;
   cv::Mat im;
-  int nImages, nValues, nAssociated, ni = 0;
+  int nImages, nValues, nAssociated, ni = 0, nextValue = 0;
   bool useViewer = true;
   double freq = 1.0/30.0;
 
@@ -63,7 +60,7 @@ int main(int argc, char **argv) {
 
   // Retrieve paths to images
   string filename = string(argv[2])+"/files.txt";
-  bool ok = LoadImages(filename, vFilenames);
+  bool ok = SD_SLAM::DatasetReader::LoadImages(filename, vFilenames);
   if (!ok) {
     cerr << "[ERROR] Couldn't find images, does " << filename << " exist?" << endl;
     return 1;
@@ -73,15 +70,21 @@ int main(int argc, char **argv) {
 
   // Read IMU values
   string filename_imu = string(argv[3]);
-  LoadIMU(filename_imu, vIMUValues);
+  if (!SD_SLAM::DatasetReader::LoadIMU(filename_imu, vIMUValues)) {
+    cerr << "[ERROR] Couldn't read IMU values from " << filename_imu << endl;
+    return 1;
+  }
   nValues = vIMUValues.size();
   cout << "[INFO] Sequence has " << nValues << " IMU values" << endl;
 
   // Associate images and IMU values
-  Associate(vFilenames, vIMUValues, vIdxValues);
+  SD_SLAM::DatasetReader::AssociateIMU(vFilenames, vIMUValues, vIdxValues);
   nAssociated = vIdxValues.size();
   cout << "[INFO] Associated " << nAssociated << " values" << endl;
 
+  // Decode images in background
+  SD_SLAM::DatasetReader reader(string(argv[2]), vFilenames);
+
   // Create SLAM system. It initializes all system threads and gets ready to process frames.
   SD_SLAM::System SLAM(SD_SLAM::System::MONOCULAR_IMU, true);
 
@@ -104,24 +107,30 @@ int main(int argc, char **argv) {
 
   // Main loop
   while (ni<nImages && !SLAM.StopRequested()) {
-    // Read image from file
+    // Get decoded image
+    SD_SLAM::DatasetReader::Item item;
+    reader.Next(item);
     cout << "[INFO] Reading Frame " << string(argv[2])+"/"+vFilenames[ni] << endl;
-    im = cv::imread(string(argv[2])+"/"+vFilenames[ni], CV_LOAD_IMAGE_GRAYSCALE);
+    im = item.image;
 
     if(im.empty()) {
       cerr << endl << "[ERROR] Failed to load image at: "  << string(argv[2]) << "/" << vFilenames[ni] << endl;
       return 1;
     }
 
-    // Get values
-    vector<double> values = vIMUValues[vIdxValues[ni]];
-    cout << "[INFO] Reading IMU values for timestamp "  << (long) values[0] << endl;
-    values.erase(values.begin()); // Remove timestamp
+    // Add all IMU samples up to this image, timestamps are in ns
+    int nLast = vIdxValues[ni];
+    for (; nextValue <= nLast; nextValue++) {
+      const vector<double> &v = vIMUValues[nextValue];
+      SLAM.AddIMUMeasurement(v[0]*1e-9, Eigen::Vector3d(v[1], v[2], v[3]), Eigen::Vector3d(v[4], v[5], v[6]));
+    }
+    cout << "[INFO] Added IMU values up to timestamp "  << (long) vIMUValues[nLast][0] << endl;
 
     SD_SLAM::Timer ttracking(true);
 
-    // Pass the image and measurements to the SLAM system
-    Eigen::Matrix4d pose = SLAM.TrackFusion(im, values);
+    // Pass the image to the SLAM system, IMU samples are preintegrated up to its timestamp
+    string rawname = vFilenames[ni].substr(0, vFilenames[ni].find_last_of("."));
+    Eigen::Matrix4d pose = SLAM.TrackFusion(im, std::stol(rawname)*1e-9);
 
     // Set data to UI
 #ifdef PANGOLIN
@@ -132,8 +141,8 @@ int main(int argc, char **argv) {
     ttracking.Stop();
     double delay = ttracking.GetTime();
 
-    // Wait to load the next frame
-    if(delay<freq)
+    // Wait to load the next frame (offline runs as fast as possible)
+    if(delay<freq && !SD_SLAM::Config::InputOffline())
       usleep((freq-delay)*1e6);
 
 #ifdef PANGOLIN
@@ -159,95 +168,3 @@ int main(int argc, char **argv) {
 
   return 0;
 }
-
-bool LoadImages(const string &strFile, vector<string> &vFilenames) {
-  ifstream f;
-  f.open(strFile.c_str());
-  if(!f.is_open())
-    return false;
-
-  while(!f.eof()) {
-    string s;
-    getline(f, s);
-    if(!s.empty()) {
-      stringstream ss;
-      string sRGB;
-      ss << s;
-      ss >> sRGB;
-      vFilenames.push_back(sRGB);
-    }
-  }
-
-  return true;
-}
-
-void LoadIMU(const string &strFile, vector<vector<double>> &values) {
-  ifstream f;
-  f.open(strFile.c_str());
-  while(!f.eof()) {
-    string s;
-    getline(f, s);
-    if(!s.empty()) {
-      if (s[0] == '#') {
-        continue; // skip comments
-      }
-
-      stringstream ss;
-      long ts;
-      double wx, wy, wz, ax, ay, az;
-      vector<double> cvalues;
-
-      std::replace(s.begin(), s.end(), ',', ' ');
-      ss << s;
-      ss >> ts;
-      ss >> wx;
-      ss >> wy;
-      ss >> wz;
-      ss >> ax;
-      ss >> ay;
-      ss >> az;
-      cvalues.push_back((double)ts);
-      cvalues.push_back(wx);
-      cvalues.push_back(wy);
-      cvalues.push_back(wz);
-      cvalues.push_back(ax);
-      cvalues.push_back(ay);
-      cvalues.push_back(az);
-      values.push_back(cvalues);
-    }
-  }
-}
-
-void Associate(const vector<string> &vFilenames, const vector<vector<double>> &values, vector<int> &valuesIdx) {
-  int cindex = 0;
-  int vsize = values.size();
-
-  for (auto it=vFilenames.begin(); it!=vFilenames.end(); it++) {
-
-    // Get time stamp
-    size_t lastindex = (*it).find_last_of(".");
-    string rawname =  (*it).substr(0, lastindex);
-    string::size_type sz;
-    long ts = stol(rawname,&sz);
-
-    // Search in imu values
-    bool found = false;
-    for (int i=cindex; i<vsize && !found; i++) {
-      long cts = values[i][0];
-
-      // Save equal or great
-      if (cts >= ts) {
-        cindex = i;
-        found = true;
-      }
-    }
-
-    // Save last one
-    if (!found)
-      cindex = vsize-1;
-
-    // Save index
-    valuesIdx.push_back(cindex);
-  }
-
-}
@@ -0,0 +1,87 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Merges several sessions saved with SaveMap into a single map. Each session is aligned
+// with the ones merged before it, sessions that do not overlap are kept unaligned.
+// With -optimize, a global BA (partitioned for large maps) is run over the result.
+
+#include <iostream>
+#include <string>
+#include "System.h"
+#include "Config.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  const bool optimize = argc > 1 && string(argv[1]) == "-optimize";
+  if (optimize) {
+    argc--;
+    argv++;
+  }
+
+  if (argc < 6) {
+    cerr << endl << "Usage: ./map_merge [-optimize] mono|rgbd path_to_settings output.map session1.map session2.map [...]"
+         << endl;
+    return 1;
+  }
+
+  const string sensor = string(argv[1]);
+  const bool rgbd = sensor == "rgbd";
+  if (!rgbd && sensor != "mono") {
+    cerr << "[ERROR] Unknown sensor " << sensor << endl;
+    return 1;
+  }
+
+  // Read parameters
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[2])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  // No mapping threads, map is only modified here
+  SD_SLAM::System SLAM(rgbd ? SD_SLAM::System::RGBD : SD_SLAM::System::MONOCULAR, false, true);
+
+  if (!SLAM.LoadMap(argv[4])) {
+    cerr << "[ERROR] Couldn't load " << argv[4] << endl;
+    return 1;
+  }
+
+  int nMerged = 0;
+  for (int i = 5; i < argc; i++) {
+    if (SLAM.MergeMap(argv[i]))
+      nMerged++;
+    else
+      cerr << "[WARNING] " << argv[i] << " was not aligned" << endl;
+  }
+
+  if (optimize)
+    SLAM.OptimizeMap(20);
+
+  if (!SLAM.SaveMap(argv[3])) {
+    cerr << "[ERROR] Couldn't save " << argv[3] << endl;
+    return 1;
+  }
+
+  cout << nMerged << "/" << argc-5 << " sessions merged into " << argv[3] << endl;
+
+  SLAM.Shutdown();
+
+  return 0;
+}
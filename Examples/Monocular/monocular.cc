@@ -28,6 +28,8 @@
 #include "Map.h"
 #include "Config.h"
 #include "extra/timer.h"
+#include "extra/dataset_reader.h"
+#include "extra/v4l2_capture.h"
 #ifdef PANGOLIN
 #include "ui/Viewer.h"
 #include "ui/FrameDrawer.h"
@@ -36,8 +38,6 @@
 
 using namespace std;
 
-bool LoadImages(const string &strFile, vector<string> &vFilenames);
-
 void ShowPose(const Eigen::Matrix4d &pose) {
   Eigen::Matrix4d wpose;
   wpose.setIdentity();
@@ -51,13 +51,15 @@ void ShowPose(const Eigen::Matrix4d &pose) {
 
 int main(int argc, char **argv) {
   vector<string> vFilenames;
-  cv::Mat im_rgb, im;
-  cv::VideoCapture * cap = nullptr;
+  cv::Mat im;
+  SD_SLAM::V4L2Capture * cap = nullptr;
+  SD_SLAM::V4L2Capture::Frame frame;
+  SD_SLAM::DatasetReader * reader = nullptr;
   int nImages, ni = 0;
   bool useViewer = true;
   bool live = false;
   double freq = 1.0/30.0;
-  std::string src, fname;
+  std::string fname;
 
   if(argc != 3 && argc !=4) {
     cerr << endl << "Usage: ./monocular path_to_settings path_to_sequence/device_number [path_to_saved_map]" << endl;
@@ -78,12 +80,10 @@ int main(int argc, char **argv) {
     int device;
     istringstream(sdevice) >> device;
 
-    cap = new cv::VideoCapture(device);
-    cap->set(CV_CAP_PROP_FRAME_WIDTH, config.Width());
-    cap->set(CV_CAP_PROP_FRAME_HEIGHT, config.Height());
-    cap->set(CV_CAP_PROP_FPS, config.fps());
-
-    if (!cap->isOpened()) {
+    // Frames are tracked straight from the driver buffers, timestamps are CLOCK_MONOTONIC
+    // (Input.TimestampClock: 1)
+    cap = new SD_SLAM::V4L2Capture();
+    if (!cap->Open("/dev/video" + std::to_string(device), config.Width(), config.Height(), config.fps())) {
       cerr << "[ERROR] Couldn't open video device" << endl;
       return 1;
     }
@@ -93,7 +93,7 @@ int main(int argc, char **argv) {
   } else {
     // Retrieve paths to images
     string filename = string(argv[2])+"/files.txt";
-    bool ok = LoadImages(filename, vFilenames);
+    bool ok = SD_SLAM::DatasetReader::LoadImages(filename, vFilenames);
     if (!ok) {
       cerr << "[ERROR] Couldn't find images, does " << filename << " exist?" << endl;
       return 1;
@@ -101,14 +101,17 @@ int main(int argc, char **argv) {
 
     nImages = vFilenames.size();
     cout << "[INFO] Sequence has " << nImages << " images" << endl;
+
+    // Decode images in background
+    reader = new SD_SLAM::DatasetReader(string(argv[2]), vFilenames);
   }
 
   // Create SLAM system. It initializes all system threads and gets ready to process frames.
   SD_SLAM::System SLAM(SD_SLAM::System::MONOCULAR, true);
 
-  // Check if a saved map is provided
+  // Check if a saved map is provided. It is loaded while the first frame is read
   if (argc == 4) {
-    SLAM.LoadTrajectory(string(argv[3]));
+    SLAM.LoadTrajectoryAsync(string(argv[3]));
   }
 
 #ifdef PANGOLIN
@@ -122,7 +125,8 @@ int main(int argc, char **argv) {
   SD_SLAM::Viewer* viewer = nullptr;
   std::thread* tviewer = nullptr;
 
-  if (useViewer) {
+  // With fast start, viewer is opened once the first frame is tracked
+  if (useViewer && !SD_SLAM::Config::FastStart()) {
     viewer = new SD_SLAM::Viewer(&SLAM, fdrawer, mdrawer);
     tviewer = new std::thread(&SD_SLAM::Viewer::Run, viewer);
   }
@@ -131,15 +135,18 @@ int main(int argc, char **argv) {
   // Main loop
   while (ni<nImages && !SLAM.StopRequested()) {
     if (live) {
-      *cap >> im_rgb;
-      cv::cvtColor(im_rgb, im, CV_RGB2GRAY);
+      if (!cap->Read(frame))
+        continue;
+      im = frame.image;
+      SLAM.SetTimestamp(frame.timestamp);
       fname = "";
     } else {
-      // Read image from file
-      fname = vFilenames[ni];
-      src = string(argv[2]) + "/" + fname;
-      cout << "[INFO] Reading Frame " << src << endl;
-      im = cv::imread(src, CV_LOAD_IMAGE_GRAYSCALE);
+      // Get decoded image
+      SD_SLAM::DatasetReader::Item item;
+      reader->Next(item);
+      fname = item.filename;
+      im = item.image;
+      cout << "[INFO] Reading Frame " << string(argv[2]) << "/" << fname << endl;
 
       if(im.empty()) {
         cerr << endl << "[ERROR] Failed to load image at: "  << string(argv[2]) << "/" << vFilenames[ni] << endl;
@@ -152,6 +159,13 @@ int main(int argc, char **argv) {
     // Pass the image to the SLAM system
     Eigen::Matrix4d pose = SLAM.TrackMonocular(im, fname);
 
+#ifdef PANGOLIN
+    if (useViewer && !viewer) {
+      viewer = new SD_SLAM::Viewer(&SLAM, fdrawer, mdrawer);
+      tviewer = new std::thread(&SD_SLAM::Viewer::Run, viewer);
+    }
+#endif
+
     // Show world pose
     ShowPose(pose);
 
@@ -161,11 +175,17 @@ int main(int argc, char **argv) {
     mdrawer->SetCurrentCameraPose(pose);
 #endif
 
+    // Tracking keeps no reference to the image, give the buffer back to the driver
+    if (live) {
+      im.release();
+      frame.hold.reset();
+    }
+
     ttracking.Stop();
     double delay = ttracking.GetTime();
 
-    // Wait to load the next frame
-    if(delay<freq)
+    // Wait to load the next frame (offline runs as fast as possible, live waits for the camera)
+    if(delay<freq && !live && !SD_SLAM::Config::InputOffline())
       usleep((freq-delay)*1e6);
 
 #ifdef PANGOLIN
@@ -177,13 +197,17 @@ int main(int argc, char **argv) {
   }
 
   // Stop all threads
+  if (reader)
+    delete reader;
+  if (cap)
+    delete cap;
   SLAM.Shutdown();
 
   // Save data
   SLAM.SaveTrajectory("trajectory.yaml", "trajectory");
 
 #ifdef PANGOLIN
-  if (useViewer) {
+  if (viewer) {
     viewer->RequestFinish();
     while (!viewer->isFinished())
       usleep(5000);
@@ -194,24 +218,3 @@ int main(int argc, char **argv) {
 
   return 0;
 }
-
-bool LoadImages(const string &strFile, vector<string> &vFilenames) {
-  ifstream f;
-  f.open(strFile.c_str());
-  if(!f.is_open())
-    return false;
-
-  while(!f.eof()) {
-    string s;
-    getline(f, s);
-    if(!s.empty()) {
-      stringstream ss;
-      string sRGB;
-      ss << s;
-      ss >> sRGB;
-      vFilenames.push_back(sRGB);
-    }
-  }
-
-  return true;
-}
@@ -29,6 +29,7 @@
 #include "Map.h"
 #include "Config.h"
 #include "extra/timer.h"
+#include "extra/dataset_reader.h"
 #ifdef PANGOLIN
 #include "ui/Viewer.h"
 #include "ui/FrameDrawer.h"
@@ -37,12 +38,10 @@
 
 using namespace std;
 
-bool LoadImages(const string &strAssociationFilename, vector<string> &vFilenamesRGB,
-                vector<string> &vFilenamesD);
-
 int main(int argc, char **argv) {
   vector<string> vFilenamesRGB;
   vector<string> vFilenamesD;
+  vector<double> vTimestamps;
   cv::Mat im, imD;
   int nImages, ni = 0;
   bool useViewer = true;
@@ -63,7 +62,7 @@ int main(int argc, char **argv) {
 
   // Retrieve paths to images
   string strAssociationFilename = string(argv[3]);
-  bool ok = LoadImages(strAssociationFilename, vFilenamesRGB, vFilenamesD);
+  bool ok = SD_SLAM::DatasetReader::LoadAssociations(strAssociationFilename, vTimestamps, vFilenamesRGB, vFilenamesD);
   if (!ok) {
     cerr << "[ERROR] Couldn't find images, does " << strAssociationFilename << " exist?" << endl;
     return 1;
@@ -81,12 +80,15 @@ int main(int argc, char **argv) {
 
   cout << "[INFO] Sequence has " << nImages << " images" << endl;
 
+  // Decode images and depthmaps in background
+  SD_SLAM::DatasetReader reader(string(argv[2]), vFilenamesRGB, vFilenamesD);
+
   // Create SLAM system. It initializes all system threads and gets ready to process frames.
   SD_SLAM::System SLAM(SD_SLAM::System::RGBD, true);
 
-  // Check if a saved map is provided
+  // Check if a saved map is provided. It is loaded while the first frame is read
   if (argc == 5) {
-    SLAM.LoadTrajectory(string(argv[4]));
+    SLAM.LoadTrajectoryAsync(string(argv[4]));
   }
 
 #ifdef PANGOLIN
@@ -100,7 +102,8 @@ int main(int argc, char **argv) {
   SD_SLAM::Viewer* viewer = nullptr;
   std::thread* tviewer = nullptr;
 
-  if (useViewer) {
+  // With fast start, viewer is opened once the first frame is tracked
+  if (useViewer && !SD_SLAM::Config::FastStart()) {
     viewer = new SD_SLAM::Viewer(&SLAM, fdrawer, mdrawer);
     tviewer = new std::thread(&SD_SLAM::Viewer::Run, viewer);
   }
@@ -108,11 +111,13 @@ int main(int argc, char **argv) {
 
   // Main loop
   while (ni<nImages && !SLAM.StopRequested()) {
-    // Read image and depthmap from file
+    // Get decoded image and depthmap
+    SD_SLAM::DatasetReader::Item item;
+    reader.Next(item);
     cout << "[INFO] Reading Frame " << string(argv[2])+"/"+vFilenamesRGB[ni] << endl;
-    fname = vFilenamesRGB[ni];
-    im = cv::imread(string(argv[2])+"/"+vFilenamesRGB[ni], CV_LOAD_IMAGE_GRAYSCALE);
-    imD = cv::imread(string(argv[2])+"/"+vFilenamesD[ni], CV_LOAD_IMAGE_UNCHANGED);
+    fname = item.filename;
+    im = item.image;
+    imD = item.depth;
 
     if(im.empty()) {
       cerr << endl << "[ERROR] Failed to load image at: " << string(argv[2]) << "/" << vFilenamesRGB[ni] << endl;
@@ -124,6 +129,13 @@ int main(int argc, char **argv) {
     // Pass the image to the SLAM system
     Eigen::Matrix4d pose = SLAM.TrackRGBD(im, imD, fname);
 
+#ifdef PANGOLIN
+    if (useViewer && !viewer) {
+      viewer = new SD_SLAM::Viewer(&SLAM, fdrawer, mdrawer);
+      tviewer = new std::thread(&SD_SLAM::Viewer::Run, viewer);
+    }
+#endif
+
     // Set data to UI
 #ifdef PANGOLIN
     fdrawer->Update(im, pose, tracker);
@@ -133,8 +145,8 @@ int main(int argc, char **argv) {
     ttracking.Stop();
     double delay = ttracking.GetTime();
 
-    // Wait to load the next frame
-    if(delay<freq)
+    // Wait to load the next frame (offline runs as fast as possible)
+    if(delay<freq && !SD_SLAM::Config::InputOffline())
       usleep((freq-delay)*1e6);
 
 #ifdef PANGOLIN
@@ -152,7 +164,7 @@ int main(int argc, char **argv) {
   SLAM.SaveTrajectory("trajectoryRGBD.yaml", "trajectoryRGBD");
 
 #ifdef PANGOLIN
-  if (useViewer) {
+  if (viewer) {
     viewer->RequestFinish();
     while (!viewer->isFinished())
       usleep(5000);
@@ -163,30 +175,3 @@ int main(int argc, char **argv) {
 
   return 0;
 }
-
-bool LoadImages(const string &strAssociationFilename, vector<string> &vFilenamesRGB,
-                vector<string> &vFilenamesD) {
-  ifstream fAssociation;
-  fAssociation.open(strAssociationFilename.c_str());
-  if(!fAssociation.is_open())
-    return false;
-
-  while(!fAssociation.eof()) {
-    string s;
-    getline(fAssociation, s);
-    if(!s.empty()) {
-      stringstream ss;
-      ss << s;
-      double t;
-      string sRGB, sD;
-      ss >> t;
-      ss >> sRGB;
-      vFilenamesRGB.push_back(sRGB);
-      ss >> t;
-      ss >> sD;
-      vFilenamesD.push_back(sD);
-    }
-  }
-
-  return true;
-}
@@ -0,0 +1,174 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_ROS_MAP_PUBLISHER_H_
+#define SD_SLAM_ROS_MAP_PUBLISHER_H_
+
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <ros/ros.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/PointField.h>
+#include "Map.h"
+
+// Publishes map points from map snapshots as PointCloud2 messages (x, y, z and id) in
+// base frame coordinates (X forward, Y left and Z up):
+//  - map_updates: points added or moved since the previous snapshot, removed ones with NaN position.
+//  - map: the whole map, latched, every period seconds and after each big change (loop closure).
+// Nothing is done while the snapshot version does not change, and message buffers keep
+// their memory between publishes.
+class MapPublisher {
+ public:
+  MapPublisher(ros::NodeHandle &n, const std::string &frame, double period, float minMove = 0.001f):
+      frame_(frame), period_(period), minMove2_(minMove*minMove), version_(0), bigChangeIdx_(-1),
+      generation_(0), seq_(0) {
+    updatesPub_ = n.advertise<sensor_msgs::PointCloud2>("/sdslam/map_updates", 10);
+    mapPub_ = n.advertise<sensor_msgs::PointCloud2>("/sdslam/map", 1, true);
+    InitCloud(updates_);
+    InitCloud(map_);
+  }
+
+  // Publish changes of snapshot if it is newer than the last one published
+  void Update(const std::shared_ptr<const SD_SLAM::Map::Snapshot> &snapshot, const ros::Time &stamp) {
+    if (!snapshot || snapshot->version == version_)
+      return;
+    version_ = snapshot->version;
+    generation_++;
+
+    const bool bigChange = snapshot->nBigChangeIdx != bigChangeIdx_;
+    bigChangeIdx_ = snapshot->nBigChangeIdx;
+
+    // Points of this snapshot not published yet or moved
+    changed_.clear();
+    const size_t N = snapshot->vMapPoints.size();
+    for (size_t i = 0; i < N; i++) {
+      const Eigen::Vector3f pos = ToBase(snapshot->vMapPoints[i]);
+      Entry &entry = published_[snapshot->vMapPointIds[i]];
+      if (entry.generation == 0 || (entry.pos-pos).squaredNorm() > minMove2_) {
+        entry.pos = pos;
+        changed_.push_back(i);
+      }
+      entry.generation = generation_;
+    }
+
+    // Points not in this snapshot were removed
+    removed_.clear();
+    for (auto it = published_.begin(); it != published_.end();) {
+      if (it->second.generation != generation_) {
+        removed_.push_back(it->first);
+        it = published_.erase(it);
+      } else {
+        it++;
+      }
+    }
+
+    if (!changed_.empty() || !removed_.empty()) {
+      const float nan = std::numeric_limits<float>::quiet_NaN();
+      Resize(updates_, changed_.size()+removed_.size(), stamp);
+      size_t n = 0;
+      for (size_t i : changed_)
+        SetPoint(updates_, n++, ToBase(snapshot->vMapPoints[i]), snapshot->vMapPointIds[i]);
+      for (long unsigned int id : removed_)
+        SetPoint(updates_, n++, Eigen::Vector3f(nan, nan, nan), id);
+      updatesPub_.publish(updates_);
+    }
+
+    if (bigChange || (period_ > 0 && (stamp-lastMap_).toSec() >= period_)) {
+      Resize(map_, N, stamp);
+      for (size_t i = 0; i < N; i++)
+        SetPoint(map_, i, ToBase(snapshot->vMapPoints[i]), snapshot->vMapPointIds[i]);
+      mapPub_.publish(map_);
+      lastMap_ = stamp;
+    }
+  }
+
+ private:
+  struct Entry {
+    Entry(): generation(0) {}
+    Eigen::Vector3f pos;
+    unsigned long generation;   // Last update where it was in the snapshot
+  };
+
+  static const uint32_t POINT_STEP = 16;
+
+  // Same axes as published poses
+  static inline Eigen::Vector3f ToBase(const Eigen::Vector3d &p) {
+    return Eigen::Vector3f(p(2), -p(0), -p(1));
+  }
+
+  void InitCloud(sensor_msgs::PointCloud2 &cloud) {
+    const char *names[4] = {"x", "y", "z", "id"};
+    cloud.header.frame_id = frame_;
+    cloud.height = 1;
+    cloud.fields.resize(4);
+    for (int i = 0; i < 4; i++) {
+      cloud.fields[i].name = names[i];
+      cloud.fields[i].offset = 4*i;
+      cloud.fields[i].datatype = i < 3 ? sensor_msgs::PointField::FLOAT32 : sensor_msgs::PointField::UINT32;
+      cloud.fields[i].count = 1;
+    }
+    cloud.is_bigendian = false;
+    cloud.point_step = POINT_STEP;
+    cloud.is_dense = false;
+  }
+
+  // Vector capacity is kept, so resizing does not allocate once the map stops growing
+  void Resize(sensor_msgs::PointCloud2 &cloud, size_t n, const ros::Time &stamp) {
+    cloud.header.stamp = stamp;
+    cloud.header.seq = ++seq_;
+    cloud.width = n;
+    cloud.row_step = n*POINT_STEP;
+    cloud.data.resize(cloud.row_step);
+  }
+
+  static inline void SetPoint(sensor_msgs::PointCloud2 &cloud, size_t i, const Eigen::Vector3f &p,
+                              long unsigned int id) {
+    uint8_t *dst = &cloud.data[i*POINT_STEP];
+    const float xyz[3] = {p(0), p(1), p(2)};
+    const uint32_t id32 = id;
+    memcpy(dst, xyz, sizeof(xyz));
+    memcpy(dst+12, &id32, sizeof(id32));
+  }
+
+  const std::string frame_;
+  const double period_;
+  const float minMove2_;
+
+  ros::Publisher updatesPub_;
+  ros::Publisher mapPub_;
+  sensor_msgs::PointCloud2 updates_;
+  sensor_msgs::PointCloud2 map_;
+
+  // Published positions by point id
+  std::unordered_map<long unsigned int, Entry> published_;
+  std::vector<size_t> changed_;
+  std::vector<long unsigned int> removed_;
+
+  unsigned long version_;
+  int bigChangeIdx_;
+  unsigned long generation_;
+  uint32_t seq_;
+  ros::Time lastMap_;
+};
+
+#endif  // SD_SLAM_ROS_MAP_PUBLISHER_H_
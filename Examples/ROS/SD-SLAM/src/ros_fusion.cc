@@ -25,9 +25,6 @@
 #include <opencv2/core/core.hpp>
 #include <ros/ros.h>
 #include <cv_bridge/cv_bridge.h>
-#include <message_filters/subscriber.h>
-#include <message_filters/time_synchronizer.h>
-#include <message_filters/sync_policies/approximate_time.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/Imu.h>
 #include "System.h"
@@ -37,18 +34,18 @@
 #include "ui/Viewer.h"
 #include "ui/FrameDrawer.h"
 #include "ui/MapDrawer.h"
+#include "map_publisher.h"
 
 using namespace std;
 
 class ImageReader {
  public:
-  ImageReader() {
-    channels_ = 0;
+  ImageReader(SD_SLAM::System *pSLAM) : pSLAM_(pSLAM) {
     updated_ = false;
   }
 
-  void ReadRGBIMU(const sensor_msgs::ImageConstPtr& msgRGB, const sensor_msgs::ImuConstPtr& msgIMU) {
-    // Copy the ros image message to cv::Mat.
+  void ReadRGB(const sensor_msgs::ImageConstPtr& msgRGB) {
+    // Share the ros image message buffer, it is not copied.
     cv_bridge::CvImageConstPtr cv_ptrRGB;
     try {
       cv_ptrRGB = cv_bridge::toCvShare(msgRGB);
@@ -57,29 +54,28 @@ class ImageReader {
       return;
     }
 
-    vector<double> imu;
-    imu.push_back(msgIMU->angular_velocity.x);
-    imu.push_back(msgIMU->angular_velocity.y);
-    imu.push_back(msgIMU->angular_velocity.z);
-    imu.push_back(msgIMU->linear_acceleration.x);
-    imu.push_back(msgIMU->linear_acceleration.y);
-    imu.push_back(msgIMU->linear_acceleration.z);
-
     ROS_INFO("Read new %dx%d image", cv_ptrRGB->image.cols, cv_ptrRGB->image.rows);
 
     {
       std::unique_lock<mutex> lock(imgMutex_);
-      cv_ptrRGB->image.copyTo(imgRGB_);
-      channels_ = imgRGB_.channels();
-      IMU_ = imu;
+      imgRGB_ = cv_ptrRGB;
+      timestamp_ = msgRGB->header.stamp.toSec();
       updated_ = true;
     }
   }
 
-  void GetData(cv::Mat &imgRGB, vector<double> &IMU) {
+  // Every IMU message is buffered, SLAM preintegrates them between images
+  void ReadIMU(const sensor_msgs::ImuConstPtr& msgIMU) {
+    Eigen::Vector3d w(msgIMU->angular_velocity.x, msgIMU->angular_velocity.y, msgIMU->angular_velocity.z);
+    Eigen::Vector3d a(msgIMU->linear_acceleration.x, msgIMU->linear_acceleration.y, msgIMU->linear_acceleration.z);
+    pSLAM_->AddIMUMeasurement(msgIMU->header.stamp.toSec(), w, a);
+  }
+
+  void GetData(cv_bridge::CvImageConstPtr &imgRGB, double &timestamp) {
     std::unique_lock<mutex> lock(imgMutex_);
-    imgRGB_.copyTo(imgRGB);
-    IMU = IMU_;
+    imgRGB = imgRGB_;
+    timestamp = timestamp_;
+    imgRGB_.reset();
     updated_ = false;
   }
 
@@ -87,15 +83,11 @@ class ImageReader {
     return updated_;
   }
 
-  int NumChannels() {
-    return channels_;
-  }
-
  private:
+  SD_SLAM::System *pSLAM_;
   bool updated_;
-  cv::Mat imgRGB_;
-  vector<double> IMU_;
-  int channels_;
+  cv_bridge::CvImageConstPtr imgRGB_;
+  double timestamp_;
   std::mutex imgMutex_;
 };
 
@@ -112,8 +104,6 @@ void ShowPose(const Eigen::Matrix4d &pose) {
 
 int main(int argc, char **argv) {
   vector<string> vFilenames;
-  cv::Mat im_rgb, im;
-  vector<double> imu;
   bool useViewer = true;
 
   ros::init(argc, argv, "Monocular");
@@ -152,28 +142,27 @@ int main(int argc, char **argv) {
   }
 
   ros::NodeHandle n;
-  ImageReader reader;
+  ImageReader reader(&SLAM);
+  MapPublisher mapPublisher(n, config.BaseFrame(), config.MapPeriod());
 
-  // Subscribe to topics
-  message_filters::Subscriber<sensor_msgs::Image> rgb_sub(n, config.CameraTopic(), 1);
-  message_filters::Subscriber<sensor_msgs::Imu> imu_sub(n, config.IMUTopic(), 1);
-  typedef message_filters::sync_policies::ApproximateTime<sensor_msgs::Image, sensor_msgs::Imu> sync_pol;
-  message_filters::Synchronizer<sync_pol> sync(sync_pol(10), rgb_sub, imu_sub);
-  sync.registerCallback(boost::bind(&ImageReader::ReadRGBIMU, &reader, _1, _2));
+  // Subscribe to topics, IMU queue holds samples received while an image is tracked
+  ros::Subscriber rgb_sub = n.subscribe(config.CameraTopic(), 1, &ImageReader::ReadRGB, &reader);
+  ros::Subscriber imu_sub = n.subscribe(config.IMUTopic(), 1000, &ImageReader::ReadIMU, &reader);
 
   ros::Rate r(30);
   while (ros::ok() && !SLAM.StopRequested()) {
     if (reader.HasNewImage()) {
-      // Get new image
-      if (reader.NumChannels() == 1) {
-        reader.GetData(im, imu);
-      } else {
-        reader.GetData(im_rgb, imu);
-        cv::cvtColor(im_rgb, im, CV_RGB2GRAY);
-      }
+      // Get new image, tracking is synchronous so the message buffer is used directly
+      cv_bridge::CvImageConstPtr img;
+      double timestamp;
+      reader.GetData(img, timestamp);
+
+      cv::Mat im = img->image;
+      if (im.channels() != 1)
+        cv::cvtColor(img->image, im, CV_RGB2GRAY);
 
-      // Pass the image and IMU data to the SLAM system
-      Eigen::Matrix4d pose = SLAM.TrackFusion(im, imu);
+      // Pass the image to the SLAM system, with IMU samples received up to its timestamp
+      Eigen::Matrix4d pose = SLAM.TrackFusion(im, timestamp);
 
       // Show world pose
       ShowPose(pose);
@@ -183,6 +172,9 @@ int main(int argc, char **argv) {
       mdrawer->SetCurrentCameraPose(pose);
     }
 
+    // Only points changed since last map update are sent
+    mapPublisher.Update(map->GetSnapshot(), ros::Time::now());
+
     ros::spinOnce();
     r.sleep();
 
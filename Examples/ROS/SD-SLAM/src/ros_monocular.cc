@@ -32,18 +32,23 @@
 #include "ui/Viewer.h"
 #include "ui/FrameDrawer.h"
 #include "ui/MapDrawer.h"
+#include "map_publisher.h"
 
 using namespace std;
 
+// Keep a ROS image alive while SLAM uses its buffer
+std::shared_ptr<const void> HoldImage(const cv_bridge::CvImageConstPtr &ptr) {
+  return std::shared_ptr<const void>(nullptr, [ptr](const void*) {});
+}
+
 class ImageReader {
  public:
   ImageReader() {
-    channels_ = 0;
     updated_ = false;
   }
 
   void ReadImage(const sensor_msgs::ImageConstPtr& msg) {
-    // Copy the ros image message to cv::Mat.
+    // Share the ros image message buffer, it is not copied.
     cv_bridge::CvImageConstPtr cv_ptr;
     try {
       cv_ptr = cv_bridge::toCvShare(msg);
@@ -56,30 +61,26 @@ class ImageReader {
 
     {
       std::unique_lock<mutex> lock(imgMutex_);
-      cv_ptr->image.copyTo(img_);
-      channels_ = img_.channels();
+      img_ = cv_ptr;
       updated_ = true;
     }
   }
 
-  void GetImage(cv::Mat &img) {
+  cv_bridge::CvImageConstPtr GetImage() {
     std::unique_lock<mutex> lock(imgMutex_);
-    img_.copyTo(img);
+    cv_bridge::CvImageConstPtr img = img_;
+    img_.reset();
     updated_ = false;
+    return img;
   }
 
   bool HasNewImage() {
     return updated_;
   }
 
-  int NumChannels() {
-    return channels_;
-  }
-
  private:
   bool updated_;
-  cv::Mat img_;
-  int channels_;
+  cv_bridge::CvImageConstPtr img_;
   std::mutex imgMutex_;
 };
 
@@ -96,7 +97,6 @@ void ShowPose(const Eigen::Matrix4d &pose) {
 
 int main(int argc, char **argv) {
   vector<string> vFilenames;
-  cv::Mat im_rgb, im;
   bool useViewer = true;
   std::string src = "";
 
@@ -142,32 +142,40 @@ int main(int argc, char **argv) {
 
   ros::NodeHandle n;
   ImageReader reader;
+  MapPublisher mapPublisher(n, config.BaseFrame(), config.MapPeriod());
 
   // Subscribe to topic
   ros::Subscriber sub = n.subscribe(config.CameraTopic(), 1, &ImageReader::ReadImage, &reader);
 
+  // Poses are computed in SLAM input thread, so camera never waits for tracking
+  SLAM.SetPoseCallback([&](const Eigen::Matrix4d &pose, const cv::Mat &img, double timestamp) {
+    // Show world pose
+    ShowPose(pose);
+
+    // Set data to UI
+    fdrawer->Update(img, pose, tracker);
+    mdrawer->SetCurrentCameraPose(pose);
+  });
+
   ros::Rate r(30);
   while (ros::ok()  && !SLAM.StopRequested()) {
     if (reader.HasNewImage()) {
       // Get new image
-      if (reader.NumChannels() == 1) {
-        reader.GetImage(im);
+      cv_bridge::CvImageConstPtr img = reader.GetImage();
+
+      // Pass the image to the SLAM system. Grayscale images are used straight from the message
+      if (img->image.channels() == 1) {
+        SLAM.SubmitSharedFrame(img->image, cv::Mat(), HoldImage(img), vector<double>(), 0.0, src);
       } else {
-        reader.GetImage(im_rgb);
-        cv::cvtColor(im_rgb, im, CV_RGB2GRAY);
+        cv::Mat im;
+        cv::cvtColor(img->image, im, CV_RGB2GRAY);
+        SLAM.SubmitSharedFrame(im, cv::Mat(), nullptr, vector<double>(), 0.0, src);
       }
-
-      // Pass the image to the SLAM system
-      Eigen::Matrix4d pose = SLAM.TrackMonocular(im, src);
-
-      // Show world pose
-      ShowPose(pose);
-
-      // Set data to UI
-      fdrawer->Update(im, pose, tracker);
-      mdrawer->SetCurrentCameraPose(pose);
     }
 
+    // Only points changed since last map update are sent
+    mapPublisher.Update(map->GetSnapshot(), ros::Time::now());
+
     ros::spinOnce();
     r.sleep();
 
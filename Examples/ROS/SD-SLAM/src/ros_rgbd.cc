@@ -35,21 +35,26 @@
 #include "ui/Viewer.h"
 #include "ui/FrameDrawer.h"
 #include "ui/MapDrawer.h"
+#include "map_publisher.h"
 #include <tf/tf.h>
 #include <tf/transform_broadcaster.h>
 #include <nav_msgs/Odometry.h>
 
 using namespace std;
 
+// Keep ROS images alive while SLAM uses their buffers
+std::shared_ptr<const void> HoldImages(const cv_bridge::CvImageConstPtr &ptrRGB, const cv_bridge::CvImageConstPtr &ptrD) {
+  return std::shared_ptr<const void>(nullptr, [ptrRGB, ptrD](const void*) {});
+}
+
 class ImageReader {
  public:
   ImageReader() {
-    channels_ = 0;
     updated_ = false;
   }
 
   void ReadRGBD(const sensor_msgs::ImageConstPtr& msgRGB, const sensor_msgs::ImageConstPtr& msgD) {
-    // Copy the ros image message to cv::Mat.
+    // Share the ros image message buffers, they are not copied.
     cv_bridge::CvImageConstPtr cv_ptrRGB;
     try {
       cv_ptrRGB = cv_bridge::toCvShare(msgRGB);
@@ -66,23 +71,24 @@ class ImageReader {
       return;
     }
 
-    this->image_timestamp = msgD->header.stamp;
-
     ROS_INFO("Read new %dx%d image", cv_ptrRGB->image.cols, cv_ptrRGB->image.rows);
 
     {
       std::unique_lock<mutex> lock(imgMutex_);
-      cv_ptrRGB->image.copyTo(imgRGB_);
-      cv_ptrD->image.copyTo(imgD_);
-      channels_ = imgRGB_.channels();
+      this->image_timestamp = msgD->header.stamp;
+      imgRGB_ = cv_ptrRGB;
+      imgD_ = cv_ptrD;
       updated_ = true;
     }
   }
 
-  void GetImage(cv::Mat &imgRGB, cv::Mat &imgD) {
+  void GetImage(cv_bridge::CvImageConstPtr &imgRGB, cv_bridge::CvImageConstPtr &imgD, ros::Time &timestamp) {
     std::unique_lock<mutex> lock(imgMutex_);
-    imgRGB_.copyTo(imgRGB);
-    imgD_.copyTo(imgD);
+    imgRGB = imgRGB_;
+    imgD = imgD_;
+    timestamp = image_timestamp;
+    imgRGB_.reset();
+    imgD_.reset();
     updated_ = false;
   }
 
@@ -90,17 +96,12 @@ class ImageReader {
     return updated_;
   }
 
-  int NumChannels() {
-    return channels_;
-  }
-
  public:
   ros::Time image_timestamp;
  private:
   bool updated_;
-  cv::Mat imgRGB_;
-  cv::Mat imgD_;
-  int channels_;
+  cv_bridge::CvImageConstPtr imgRGB_;
+  cv_bridge::CvImageConstPtr imgD_;
   std::mutex imgMutex_;
 };
 
@@ -207,7 +208,6 @@ void ShowPose(const Eigen::Matrix4d &pose) {
 
 int main(int argc, char **argv) {
   vector<string> vFilenames;
-  cv::Mat im_rgb, im, imD;
   bool useViewer = true;
 
   ros::init(argc, argv, "Monocular");
@@ -253,6 +253,7 @@ int main(int argc, char **argv) {
   ros::NodeHandle n;
   ImageReader reader;
   ROSPublisher publisher(config, n);
+  MapPublisher mapPublisher(n, config.BaseFrame(), config.MapPeriod());
 
   // Subscribe to topics
   message_filters::Subscriber<sensor_msgs::Image> rgb_sub(n, config.CameraTopic(), 1);
@@ -261,36 +262,42 @@ int main(int argc, char **argv) {
   message_filters::Synchronizer<sync_pol> sync(sync_pol(10), rgb_sub,depth_sub);
   sync.registerCallback(boost::bind(&ImageReader::ReadRGBD, &reader, _1, _2));
 
+  // Poses are computed in SLAM input thread, so camera never waits for tracking
+  SLAM.SetPoseCallback([&](const Eigen::Matrix4d &pose, const cv::Mat &img, double timestamp) {
+    // Publish camera pose as TF and PoseStamped
+    if (!config.UseImagesTimeStamps()) {
+        publisher.publish(pose);
+    } else {
+        publisher.publish(pose, ros::Time(timestamp));
+    }
+
+    // Show world pose
+    ShowPose(pose);
+
+    // Set data to UI
+    fdrawer->Update(img, pose, tracker);
+    mdrawer->SetCurrentCameraPose(pose);
+  });
+
   ros::Rate r(30);
   while (ros::ok() && !SLAM.StopRequested()) {
     if (reader.HasNewImage()) {
       // Get new image
-      if (reader.NumChannels() == 1) {
-        reader.GetImage(im, imD);
-      } else {
-        reader.GetImage(im_rgb, imD);
-        cv::cvtColor(im_rgb, im, CV_RGB2GRAY);
-      }
-
-      // Pass the image to the SLAM system
-      Eigen::Matrix4d pose = SLAM.TrackRGBD(im, imD);
-
-      // Publish camera pose as TF and PoseStamped
-      if (!config.UseImagesTimeStamps()) {
-          publisher.publish(pose);
-      } else {
-          publisher.publish(pose, reader.image_timestamp);
-      }
-
-
-      // Show world pose
-      ShowPose(pose);
-
-      // Set data to UI
-      fdrawer->Update(im, pose, tracker);
-      mdrawer->SetCurrentCameraPose(pose);
+      cv_bridge::CvImageConstPtr imgRGB, imgD;
+      ros::Time timestamp;
+      reader.GetImage(imgRGB, imgD, timestamp);
+
+      // Pass the image to the SLAM system. Message buffers are used without copying them
+      cv::Mat im = imgRGB->image;
+      if (im.channels() != 1)
+        cv::cvtColor(imgRGB->image, im, CV_RGB2GRAY);
+
+      SLAM.SubmitSharedFrame(im, imgD->image, HoldImages(imgRGB, imgD), vector<double>(), timestamp.toSec());
     }
 
+    // Only points changed since last map update are sent
+    mapPublisher.Update(map->GetSnapshot(), ros::Time::now());
+
     ros::spinOnce();
     r.sleep();
 
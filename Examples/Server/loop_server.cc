@@ -0,0 +1,133 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Loop closing server for clients with LoopClosing.Server set. Any number of clients (agents)
+// stream keyframes concurrently into one shared map, where loop detection, map merging,
+// essential graph and global BA run across all of them, and each one gets back the corrections
+// of its own keyframes. Settings must be the ones used by the clients.
+
+#include <iostream>
+#include <string>
+#include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include "System.h"
+#include "Config.h"
+#include "RemoteLoop.h"
+#include "extra/tcp_link.h"
+
+using namespace std;
+
+struct Agent {
+  SD_SLAM::TcpLink link;
+  unique_ptr<SD_SLAM::RemoteLoopServer> server;
+  thread worker;
+  atomic<bool> finished{false};
+};
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    cerr << endl << "Usage: ./loop_server mono|rgbd path_to_settings port [output.map]" << endl;
+    return 1;
+  }
+
+  const string sensor = string(argv[1]);
+  const bool rgbd = sensor == "rgbd";
+  if (!rgbd && sensor != "mono") {
+    cerr << "[ERROR] Unknown sensor " << sensor << endl;
+    return 1;
+  }
+
+  // Read parameters
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[2])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  // Settings are shared with the client, loops are closed here
+  config.SetLoopServer("");
+
+  const int port = atoi(argv[3]);
+  const string output = argc > 4 ? string(argv[4]) : string();
+
+  // Shared map of every agent, tracking is never used
+  SD_SLAM::System SLAM(rgbd ? SD_SLAM::System::RGBD : SD_SLAM::System::MONOCULAR, true);
+
+  SD_SLAM::TcpListener listener;
+  if (!listener.Listen(port)) {
+    cerr << "[ERROR] Couldn't listen on port " << port << endl;
+    return 1;
+  }
+  cout << "Waiting for agents on port " << port << endl;
+
+  // Map is saved each time the last connected agent leaves
+  mutex mutexAgents;
+  int nConnected = 0;
+  int nAgents = 0;
+  list<unique_ptr<Agent>> lAgents;
+
+  while (true) {
+    unique_ptr<Agent> agent(new Agent());
+    if (!listener.Accept(agent->link)) {
+      // Out of descriptors or similar, retry later
+      this_thread::sleep_for(chrono::milliseconds(100));
+      continue;
+    }
+
+    // Join agents already gone
+    for (auto it = lAgents.begin(); it != lAgents.end();) {
+      if ((*it)->finished) {
+        (*it)->worker.join();
+        it = lAgents.erase(it);
+      } else {
+        it++;
+      }
+    }
+
+    const int nAgent = nAgents++;
+    {
+      // Wait for a save in progress
+      unique_lock<mutex> lock(mutexAgents);
+      nConnected++;
+    }
+
+    cout << "Agent " << nAgent << " connected" << endl;
+    agent->server.reset(new SD_SLAM::RemoteLoopServer(SLAM.GetMap(), SLAM.GetTracker(), SLAM.GetLoopCloser(), rgbd,
+                                                      nAgent));
+
+    Agent* pAgent = agent.get();
+    pAgent->worker = thread([&, pAgent, nAgent]() {
+      if (!pAgent->server->Serve(pAgent->link))
+        cerr << "[WARNING] Agent " << nAgent << " sent an invalid message" << endl;
+
+      unique_lock<mutex> lock(mutexAgents);
+      cout << "Agent " << nAgent << " disconnected, " << SLAM.GetMap()->KeyFramesInMap() << " keyframes in map" << endl;
+      if (--nConnected == 0 && !output.empty() && !SLAM.SaveMap(output))
+        cerr << "[ERROR] Couldn't save " << output << endl;
+      pAgent->finished = true;
+    });
+    lAgents.push_back(std::move(agent));
+  }
+
+  return 0;
+}
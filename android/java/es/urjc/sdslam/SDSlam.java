@@ -0,0 +1,92 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+package es.urjc.sdslam;
+
+import android.hardware.HardwareBuffer;
+import java.nio.ByteBuffer;
+
+// Java side of libSD_SLAM.so (src/android/sdslam_jni.cc). Images are tracked without copies:
+// pass the Y plane of a camera Image or its HardwareBuffer. Poses (Tcw, row-major) are written
+// into a float[16] owned by the caller, so it can be reused for every frame.
+public class SDSlam implements AutoCloseable {
+  public static final int MONOCULAR = 0;
+  public static final int MONOCULAR_IMU = 2;
+
+  static {
+    System.loadLibrary("SD_SLAM");
+  }
+
+  private long handle;
+
+  public SDSlam(String settingsFile, int sensor) {
+    handle = nativeCreate(settingsFile, sensor);
+    if (handle == 0)
+      throw new IllegalArgumentException("Can't create SD-SLAM with " + settingsFile);
+  }
+
+  // Track the Y plane of an image (Image.getPlanes()[0]), it must be a direct buffer
+  public boolean track(ByteBuffer yPlane, int width, int height, int rowStride, double timestamp, float[] pose) {
+    return nativeTrackBuffer(handle, yPlane, width, height, rowStride, timestamp, pose);
+  }
+
+  // Track the luminance of a hardware buffer (Image.getHardwareBuffer())
+  public boolean track(HardwareBuffer buffer, double timestamp, float[] pose) {
+    return nativeTrackHardwareBuffer(handle, buffer, timestamp, pose);
+  }
+
+  public void addIMUMeasurement(double timestamp, float gx, float gy, float gz, float ax, float ay, float az) {
+    nativeAddIMUMeasurement(handle, timestamp, gx, gy, gz, ax, ay, az);
+  }
+
+  public int getTrackingState() {
+    return nativeGetTrackingState(handle);
+  }
+
+  // Battery state (e.g. from ACTION_POWER_CONNECTED/DISCONNECTED), mapping is not limited while charging
+  public void setCharging(boolean charging) {
+    nativeSetCharging(handle, charging);
+  }
+
+  // Thermal status (PowerManager.getCurrentThermalStatus()) lowers the duty cycle of mapping,
+  // from THERMAL_STATUS_NONE (no limit) to THERMAL_STATUS_CRITICAL and above (lowest)
+  public void setThermalStatus(int status) {
+    nativeSetThermalThrottle(handle, Math.min(Math.max(status, 0), 4) / 4.0);
+  }
+
+  // Stops all threads, the object can't be used after closing
+  @Override
+  public void close() {
+    if (handle != 0) {
+      nativeDestroy(handle);
+      handle = 0;
+    }
+  }
+
+  private static native long nativeCreate(String settingsFile, int sensor);
+  private static native void nativeDestroy(long handle);
+  private static native boolean nativeTrackBuffer(long handle, ByteBuffer yPlane, int width, int height,
+                                                  int rowStride, double timestamp, float[] pose);
+  private static native boolean nativeTrackHardwareBuffer(long handle, HardwareBuffer buffer, double timestamp,
+                                                          float[] pose);
+  private static native void nativeAddIMUMeasurement(long handle, double timestamp, float gx, float gy, float gz,
+                                                     float ax, float ay, float az);
+  private static native int nativeGetTrackingState(long handle);
+  private static native void nativeSetCharging(long handle, boolean charging);
+  private static native void nativeSetThermalThrottle(long handle, double throttle);
+}
@@ -0,0 +1,186 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CameraRig.h"
+#include <cmath>
+#include <thread>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "Frame.h"
+#include "Config.h"
+#include "Converter.h"
+
+using std::vector;
+
+namespace SD_SLAM {
+
+RigView::RigView(): mpCamera(nullptr), N(0) {
+}
+
+vector<size_t> RigView::GetFeaturesInArea(const float &x, const float &y, const float &r,
+                                          const int minLevel, const int maxLevel) const {
+  vector<size_t> vIndices;
+  GetFeaturesInArea(x, y, r, vIndices, minLevel, maxLevel);
+  return vIndices;
+}
+
+void RigView::GetFeaturesInArea(const float &x, const float &y, const float &r, vector<size_t> &vIndices,
+                                const int minLevel, const int maxLevel) const {
+  vIndices.clear();
+  const RigCamera *cam = mpCamera;
+  mGrid.ForEachCell(x, y, r, cam->mnMinX, cam->mnMinY, cam->mfGridElementWidthInv, cam->mfGridElementHeightInv,
+                    [&](const uint32_t* begin, const uint32_t* end) {
+    mFeatures.Select(begin, end, x, y, r, minLevel, maxLevel, vIndices);
+  });
+}
+
+CameraRig::CameraRig(int nFeatures, float scaleFactor, int nLevels, int thFAST) {
+  const vector<RigCameraParameters> &params = Config::RigCameras();
+
+  for (size_t i = 0; i < params.size(); i++) {
+    const CameraParameters &p = params[i].camera;
+    RigCamera *pCamera = new RigCamera();
+
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        pCamera->Tcb(r, c) = params[i].Tcb[r*4+c];
+
+    pCamera->K.setIdentity();
+    pCamera->K(0, 0) = p.fx;
+    pCamera->K(1, 1) = p.fy;
+    pCamera->K(0, 2) = p.cx;
+    pCamera->K(1, 2) = p.cy;
+    pCamera->fx = p.fx;
+    pCamera->fy = p.fy;
+    pCamera->cx = p.cx;
+    pCamera->cy = p.cy;
+
+    pCamera->DistCoef = cv::Mat(4, 1, CV_32F);
+    pCamera->DistCoef.at<float>(0) = p.k1;
+    pCamera->DistCoef.at<float>(1) = p.k2;
+    pCamera->DistCoef.at<float>(2) = p.p1;
+    pCamera->DistCoef.at<float>(3) = p.p2;
+    if (p.k3 != 0) {
+      pCamera->DistCoef.resize(5);
+      pCamera->DistCoef.at<float>(4) = p.k3;
+    }
+
+    ComputeImageBounds(pCamera, p.w, p.h);
+
+    pCamera->mpORBextractor = new ORBextractor(nFeatures, scaleFactor, nLevels, thFAST);
+    mvpCameras.push_back(pCamera);
+  }
+}
+
+CameraRig::~CameraRig() {
+  for (RigCamera *pCamera : mvpCameras) {
+    delete pCamera->mpORBextractor;
+    delete pCamera;
+  }
+}
+
+void CameraRig::ComputeImageBounds(RigCamera *pCamera, int width, int height) {
+  if (pCamera->DistCoef.at<float>(0) != 0.0) {
+    cv::Mat mat(4, 2, CV_32F);
+    mat.at<float>(0, 0) = 0.0;
+    mat.at<float>(0, 1) = 0.0;
+    mat.at<float>(1, 0) = width;
+    mat.at<float>(1, 1) = 0.0;
+    mat.at<float>(2, 0) = 0.0;
+    mat.at<float>(2, 1) = height;
+    mat.at<float>(3, 0) = width;
+    mat.at<float>(3, 1) = height;
+
+    // Undistort corners
+    mat = mat.reshape(2);
+    cv::Mat K = Converter::toCvMat(pCamera->K);
+    cv::undistortPoints(mat, mat, K, pCamera->DistCoef, cv::Mat(), K);
+    mat = mat.reshape(1);
+
+    pCamera->mnMinX = std::min(mat.at<float>(0, 0), mat.at<float>(2, 0));
+    pCamera->mnMaxX = std::max(mat.at<float>(1, 0), mat.at<float>(3, 0));
+    pCamera->mnMinY = std::min(mat.at<float>(0, 1), mat.at<float>(1, 1));
+    pCamera->mnMaxY = std::max(mat.at<float>(2, 1), mat.at<float>(3, 1));
+  } else {
+    pCamera->mnMinX = 0.0f;
+    pCamera->mnMaxX = width;
+    pCamera->mnMinY = 0.0f;
+    pCamera->mnMaxY = height;
+  }
+
+  pCamera->mfGridElementWidthInv = static_cast<float>(FRAME_GRID_COLS)/(pCamera->mnMaxX-pCamera->mnMinX);
+  pCamera->mfGridElementHeightInv = static_cast<float>(FRAME_GRID_ROWS)/(pCamera->mnMaxY-pCamera->mnMinY);
+}
+
+void CameraRig::Extract(size_t i, const cv::Mat &im, RigView &view) const {
+  const RigCamera *pCamera = mvpCameras[i];
+  vector<cv::KeyPoint> keys;
+  vector<cv::Mat> pyramid;
+
+  view.mpCamera = pCamera;
+  (*pCamera->mpORBextractor)(im, cv::Mat(), keys, view.mDescriptors, pyramid);
+  view.N = keys.size();
+
+  // Undistort keypoints
+  view.mvKeysUn = keys;
+  if (view.N > 0 && pCamera->DistCoef.at<float>(0) != 0.0) {
+    cv::Mat mat(view.N, 2, CV_32F);
+    for (int j = 0; j < view.N; j++) {
+      mat.at<float>(j, 0) = keys[j].pt.x;
+      mat.at<float>(j, 1) = keys[j].pt.y;
+    }
+
+    mat = mat.reshape(2);
+    cv::Mat K = Converter::toCvMat(pCamera->K);
+    cv::undistortPoints(mat, mat, K, pCamera->DistCoef, cv::Mat(), K);
+    mat = mat.reshape(1);
+
+    for (int j = 0; j < view.N; j++) {
+      view.mvKeysUn[j].pt.x = mat.at<float>(j, 0);
+      view.mvKeysUn[j].pt.y = mat.at<float>(j, 1);
+    }
+  }
+
+  view.mFeatures.Build(view.mvKeysUn, view.mDescriptors);
+  view.mGrid.Build(FRAME_GRID_COLS, FRAME_GRID_ROWS, view.N, [&](int j, int &posX, int &posY) {
+    posX = round((view.mvKeysUn[j].pt.x-pCamera->mnMinX)*pCamera->mfGridElementWidthInv);
+    posY = round((view.mvKeysUn[j].pt.y-pCamera->mnMinY)*pCamera->mfGridElementHeightInv);
+    return posX >= 0 && posX < FRAME_GRID_COLS && posY >= 0 && posY < FRAME_GRID_ROWS;
+  });
+
+  view.mvpMapPoints.assign(view.N, static_cast<MapPoint*>(nullptr));
+  view.mvbOutlier.assign(view.N, false);
+}
+
+void CameraRig::Extract(const vector<cv::Mat> &ims, vector<RigView> &views) const {
+  const size_t n = std::min(ims.size(), mvpCameras.size());
+  views.resize(n);
+  if (n == 0)
+    return;
+
+  // Each camera has its own extractor, first one runs in this thread
+  vector<std::thread> threads;
+  for (size_t i = 1; i < n; i++)
+    threads.emplace_back([this, &ims, &views, i]() { Extract(i, ims[i], views[i]); });
+
+  Extract(0, ims[0], views[0]);
+
+  for (std::thread &t : threads)
+    t.join();
+}
+
+}  // namespace SD_SLAM
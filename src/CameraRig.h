@@ -0,0 +1,99 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_CAMERARIG_H
+#define SD_SLAM_CAMERARIG_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Dense>
+#include "ORBextractor.h"
+#include "extra/feature_table.h"
+#include "extra/feature_grid.h"
+
+namespace SD_SLAM {
+
+class MapPoint;
+
+// Secondary camera of the rig
+struct RigCamera {
+  Eigen::Matrix4d Tcb;        // Transforms points from main camera to this camera
+  Eigen::Matrix3d K;
+  cv::Mat DistCoef;
+  float fx, fy, cx, cy;
+
+  // Undistorted image bounds and feature grid
+  float mnMinX, mnMaxX, mnMinY, mnMaxY;
+  float mfGridElementWidthInv, mfGridElementHeightInv;
+
+  ORBextractor* mpORBextractor;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+// Features seen by a secondary camera in one frame. They only constrain the pose of the
+// main camera, keyframes and map points are created from the main camera.
+class RigView {
+ public:
+  RigView();
+
+  // Same as Frame::GetFeaturesInArea
+  std::vector<size_t> GetFeaturesInArea(const float &x, const float &y, const float &r,
+                                        const int minLevel=-1, const int maxLevel=-1) const;
+  void GetFeaturesInArea(const float &x, const float &y, const float &r, std::vector<size_t> &vIndices,
+                         const int minLevel=-1, const int maxLevel=-1) const;
+
+ public:
+  const RigCamera* mpCamera;
+
+  int N;
+  std::vector<cv::KeyPoint> mvKeysUn;
+  cv::Mat mDescriptors;
+  FeatureTable mFeatures;
+  FeatureGrid mGrid;
+
+  // Matched MapPoints, outliers are flagged by pose optimization
+  std::vector<MapPoint*> mvpMapPoints;
+  std::vector<bool> mvbOutlier;
+};
+
+// Secondary cameras of a multi-camera rig, read from Config::RigCameras.
+// Their extractors use the ORB parameters of the main camera.
+class CameraRig {
+ public:
+  CameraRig(int nFeatures, float scaleFactor, int nLevels, int thFAST);
+  ~CameraRig();
+
+  inline size_t Size() const { return mvpCameras.size(); }
+  inline const RigCamera* GetCamera(size_t i) const { return mvpCameras[i]; }
+
+  // Extract features of image im taken by camera i
+  void Extract(size_t i, const cv::Mat &im, RigView &view) const;
+
+  // Extract features of every camera in parallel, ims[i] is taken by camera i
+  void Extract(const std::vector<cv::Mat> &ims, std::vector<RigView> &views) const;
+
+ private:
+  void ComputeImageBounds(RigCamera *pCamera, int width, int height);
+
+  std::vector<RigCamera*> mvpCameras;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_CAMERARIG_H
@@ -17,6 +17,8 @@
  *
  */
 
+#include <algorithm>
+#include <thread>
 #include <opencv2/core/core.hpp>
 #include "Config.h"
 #include "extra/log.h"
@@ -45,21 +47,110 @@ Config::Config() {
   kThDepth_ = 40.0;
   kDepthMapFactor_ = 1.0;
 
+  kThreads_ = 0;
+  kThreadAffinity_ = false;
+
+  kTrackingCore_ = -1;
+  kTrackingPriority_ = 0;
+  kMappingCore_ = -1;
+  kMappingNice_ = 0;
+  kLoopCore_ = -1;
+  kLoopNice_ = 0;
+
+  kTraceFile_ = "";
+  kTraceEvents_ = 65536;
+  kRecordFile_ = "";
+  kCheckpointFile_ = "";
+  kCheckpointPeriod_ = 10.0;
+  kMetricsPort_ = 0;
+  kFastStart_ = false;
+
+  kEnergyDutyCycle_ = 1.0;
+  kEnergyLoopBatch_ = 1;
+
   kNumFeatures_ = 1000;
   kScaleFactor_ = 2.0;
   kNumLevels_ = 5;
   kThresholdFAST_ = 20;
+  kThreadsORB_ = 1;
+  kBackendORB_ = 0;
+  kMaskFile_ = "";
+  kFirstLevelORB_ = 0;
+  kTargetFrameTime_ = 0.0;
+  kMinFeatures_ = 300;
+  kMaxFeatures_ = 2000;
+  kOverloadMode_ = false;
+
+  kInputQueueSize_ = 2;
+  kInputDropPolicy_ = 0;
+  kInputPipeline_ = false;
+  kInputOffline_ = false;
+  kInputTimestampClock_ = 0;
+  kStaticThreshold_ = 0.0;
+  kStaticMaxFrames_ = 30;
+
+  kAlignMaxLevel_ = 4;
+  kAlignMinLevel_ = 2;
+  kAlignIterations_ = 30;
+  kAlignPatchSize_ = 4;
+  kAlignBasin_ = 4.0;
+  kAlignStopResidual_ = 0.0;
+  kAlignCacheSize_ = 32;
+  kAlignReferences_ = 1;
+
+  kPyramidWindow_ = 0;
+
+  kVoxelSize_ = 0.25;
+  kFrustumPoints_ = false;
+  kPagingFile_ = "";
+  kTileSize_ = 5.0;
+  kPagingRadius_ = 2;
+  kCompressImages_ = false;
+  kVocabularyFile_ = "";
+  kVocabularyLevelsUp_ = 4;
+
+  kThreadsMapping_ = 1;
+  kMappingMaxLatency_ = 500.0;
+  kPipelinedMapping_ = false;
+
+  kRelocCandidates_ = 20;
+  kRelocTimeBudget_ = 20.0;
+  kRelocGate_ = false;
+
+  kLoopCandidates_ = 20;
+  kLoopProsac_ = false;
+  kThreadsLoop_ = 1;
+  kLoopRegion_ = 2;
+  kEssentialEdges_ = 10;
+  kLoopServer_ = "";
+  kLoopGateRadius_ = 0.0;
+  kLoopGateDrift_ = 0.1;
+
+  kThreadsBA_ = 1;
+  kWindowSize_ = 0;
+  kSupernodalSize_ = 50;
+  kPCGSize_ = 500;
+  kBackendBA_ = 0;
+  kPartitionSize_ = 0;
+  kPartitionRounds_ = 10;
+  kLocalBATargetTime_ = 0.0;
+  kLocalBAMaxFixed_ = 0;
+  kLocalBAMaxObservations_ = 0;
 
   kKeyFrameSize_ = 0.05;
   kKeyFrameLineWidth_ = 1.0;
   kGraphLineWidth_ = 0.9;
   kPointSize_ = 2.0;
+  kPointLOD_ = 100000;
   kCameraSize_ = 0.08;
   kCameraLineWidth_ = 3.0;
   kViewpointX_ = 0.0;
   kViewpointY_ = -0.7;
   kViewpointZ_ = -1.8;
   kViewpointF_ = 500.0;
+  kViewerFPS_ = 30.0;
+  kViewerOutput_ = "";
+  kViewerOutputFPS_ = 2.0;
 
   kCameraTopic_ = "/camera/rgb/image_raw";
   kDepthTopic_ = "/camera/depth/image_raw";
@@ -68,6 +159,7 @@ Config::Config() {
   kBaseFrame_ = "odom";
   kCameraFrame_ = "camera_link";
   kUseImagesTimeStamps_ = false;
+  kMapPeriod_ = 5.0;
 }
 
 bool Config::ReadParameters(std::string filename) {
@@ -104,23 +196,160 @@ bool Config::ReadParameters(std::string filename) {
   if (fs["ThDepth"].isNamed()) fs["ThDepth"] >> kThDepth_;
   if (fs["DepthMapFactor"].isNamed()) fs["DepthMapFactor"] >> kDepthMapFactor_;
 
+  // Shared thread pool
+  if (fs["System.nThreads"].isNamed()) fs["System.nThreads"] >> kThreads_;
+  if (fs["System.ThreadAffinity"].isNamed()) fs["System.ThreadAffinity"] >> kThreadAffinity_;
+
+  // Thread placement
+  if (fs["Threads.Tracking.Core"].isNamed()) fs["Threads.Tracking.Core"] >> kTrackingCore_;
+  if (fs["Threads.Tracking.Priority"].isNamed()) fs["Threads.Tracking.Priority"] >> kTrackingPriority_;
+  if (fs["Threads.Mapping.Core"].isNamed()) fs["Threads.Mapping.Core"] >> kMappingCore_;
+  if (fs["Threads.Mapping.Nice"].isNamed()) fs["Threads.Mapping.Nice"] >> kMappingNice_;
+  if (fs["Threads.Loop.Core"].isNamed()) fs["Threads.Loop.Core"] >> kLoopCore_;
+  if (fs["Threads.Loop.Nice"].isNamed()) fs["Threads.Loop.Nice"] >> kLoopNice_;
+
+  // Activity trace
+  if (fs["System.TraceFile"].isNamed()) fs["System.TraceFile"] >> kTraceFile_;
+  if (fs["System.TraceEvents"].isNamed()) fs["System.TraceEvents"] >> kTraceEvents_;
+  if (fs["System.RecordFile"].isNamed()) fs["System.RecordFile"] >> kRecordFile_;
+  if (fs["System.CheckpointFile"].isNamed()) fs["System.CheckpointFile"] >> kCheckpointFile_;
+  if (fs["System.CheckpointPeriod"].isNamed()) fs["System.CheckpointPeriod"] >> kCheckpointPeriod_;
+  if (fs["System.MetricsPort"].isNamed()) fs["System.MetricsPort"] >> kMetricsPort_;
+  if (fs["System.FastStart"].isNamed()) fs["System.FastStart"] >> kFastStart_;
+
+  // Energy policy
+  if (fs["Energy.DutyCycle"].isNamed()) fs["Energy.DutyCycle"] >> kEnergyDutyCycle_;
+  if (fs["Energy.LoopBatch"].isNamed()) fs["Energy.LoopBatch"] >> kEnergyLoopBatch_;
+
   // ORB Extractor
   if (fs["ORBextractor.nFeatures"].isNamed()) fs["ORBextractor.nFeatures"] >> kNumFeatures_;
   if (fs["ORBextractor.scaleFactor"].isNamed()) fs["ORBextractor.scaleFactor"] >> kScaleFactor_;
   if (fs["ORBextractor.nLevels"].isNamed()) fs["ORBextractor.nLevels"] >> kNumLevels_;
   if (fs["ORBextractor.thresholdFAST"].isNamed()) fs["ORBextractor.thresholdFAST"] >> kThresholdFAST_;
+  if (fs["ORBextractor.nThreads"].isNamed()) fs["ORBextractor.nThreads"] >> kThreadsORB_;
+  if (fs["ORBextractor.Backend"].isNamed()) fs["ORBextractor.Backend"] >> kBackendORB_;
+  if (fs["ORBextractor.Mask"].isNamed()) fs["ORBextractor.Mask"] >> kMaskFile_;
+  if (fs["ORBextractor.FirstLevel"].isNamed()) fs["ORBextractor.FirstLevel"] >> kFirstLevelORB_;
+  if (fs["ORBextractor.TargetFrameTime"].isNamed()) fs["ORBextractor.TargetFrameTime"] >> kTargetFrameTime_;
+  if (fs["ORBextractor.MinFeatures"].isNamed()) fs["ORBextractor.MinFeatures"] >> kMinFeatures_;
+  if (fs["ORBextractor.MaxFeatures"].isNamed()) fs["ORBextractor.MaxFeatures"] >> kMaxFeatures_;
+  if (fs["ORBextractor.OverloadMode"].isNamed()) fs["ORBextractor.OverloadMode"] >> kOverloadMode_;
+
+  // Input queue
+  if (fs["Input.QueueSize"].isNamed()) fs["Input.QueueSize"] >> kInputQueueSize_;
+  if (fs["Input.DropPolicy"].isNamed()) fs["Input.DropPolicy"] >> kInputDropPolicy_;
+  if (fs["Input.Pipeline"].isNamed()) fs["Input.Pipeline"] >> kInputPipeline_;
+  if (fs["Input.Offline"].isNamed()) fs["Input.Offline"] >> kInputOffline_;
+  if (fs["Input.TimestampClock"].isNamed()) fs["Input.TimestampClock"] >> kInputTimestampClock_;
+  if (fs["Input.StaticThreshold"].isNamed()) fs["Input.StaticThreshold"] >> kStaticThreshold_;
+  if (fs["Input.StaticMaxFrames"].isNamed()) fs["Input.StaticMaxFrames"] >> kStaticMaxFrames_;
+
+  // Camera rig
+  int nRigCameras = 0;
+  if (fs["Rig.Cameras"].isNamed()) fs["Rig.Cameras"] >> nRigCameras;
+  kRigCameras_.clear();
+  for (int i = 1; i <= nRigCameras; i++) {
+    std::string prefix = "Rig.Camera" + std::to_string(i) + ".";
+    RigCameraParameters rig;
+    rig.camera = camera_params_;
+
+    if (fs[prefix+"Width"].isNamed()) fs[prefix+"Width"] >> rig.camera.w;
+    if (fs[prefix+"Height"].isNamed()) fs[prefix+"Height"] >> rig.camera.h;
+    if (fs[prefix+"fx"].isNamed()) fs[prefix+"fx"] >> rig.camera.fx;
+    if (fs[prefix+"fy"].isNamed()) fs[prefix+"fy"] >> rig.camera.fy;
+    if (fs[prefix+"cx"].isNamed()) fs[prefix+"cx"] >> rig.camera.cx;
+    if (fs[prefix+"cy"].isNamed()) fs[prefix+"cy"] >> rig.camera.cy;
+    if (fs[prefix+"k1"].isNamed()) fs[prefix+"k1"] >> rig.camera.k1;
+    if (fs[prefix+"k2"].isNamed()) fs[prefix+"k2"] >> rig.camera.k2;
+    if (fs[prefix+"p1"].isNamed()) fs[prefix+"p1"] >> rig.camera.p1;
+    if (fs[prefix+"p2"].isNamed()) fs[prefix+"p2"] >> rig.camera.p2;
+    if (fs[prefix+"k3"].isNamed()) fs[prefix+"k3"] >> rig.camera.k3;
+    if (fs[prefix+"Tcb"].isNamed()) fs[prefix+"Tcb"] >> rig.Tcb;
+
+    if (rig.Tcb.size() != 16) {
+      LOGE("%sTcb must have 16 values (4x4 row major)", prefix.c_str());
+      return false;
+    }
+
+    kRigCameras_.push_back(rig);
+  }
+
+  // Image alignment
+  if (fs["ImageAlign.MaxLevel"].isNamed()) fs["ImageAlign.MaxLevel"] >> kAlignMaxLevel_;
+  if (fs["ImageAlign.MinLevel"].isNamed()) fs["ImageAlign.MinLevel"] >> kAlignMinLevel_;
+  if (fs["ImageAlign.Iterations"].isNamed()) fs["ImageAlign.Iterations"] >> kAlignIterations_;
+  if (fs["ImageAlign.PatchSize"].isNamed()) fs["ImageAlign.PatchSize"] >> kAlignPatchSize_;
+  if (fs["ImageAlign.Basin"].isNamed()) fs["ImageAlign.Basin"] >> kAlignBasin_;
+  if (fs["ImageAlign.StopResidual"].isNamed()) fs["ImageAlign.StopResidual"] >> kAlignStopResidual_;
+  if (fs["ImageAlign.CacheSize"].isNamed()) fs["ImageAlign.CacheSize"] >> kAlignCacheSize_;
+  if (fs["ImageAlign.References"].isNamed()) fs["ImageAlign.References"] >> kAlignReferences_;
+
+  // KeyFrames
+  if (fs["KeyFrame.PyramidWindow"].isNamed()) fs["KeyFrame.PyramidWindow"] >> kPyramidWindow_;
+
+  // Map
+  if (fs["Map.VoxelSize"].isNamed()) fs["Map.VoxelSize"] >> kVoxelSize_;
+  if (fs["Map.FrustumPoints"].isNamed()) fs["Map.FrustumPoints"] >> kFrustumPoints_;
+  if (fs["Map.PagingFile"].isNamed()) fs["Map.PagingFile"] >> kPagingFile_;
+  if (fs["Map.TileSize"].isNamed()) fs["Map.TileSize"] >> kTileSize_;
+  if (fs["Map.PagingRadius"].isNamed()) fs["Map.PagingRadius"] >> kPagingRadius_;
+  if (fs["Map.CompressImages"].isNamed()) fs["Map.CompressImages"] >> kCompressImages_;
+  if (fs["Map.Vocabulary"].isNamed()) fs["Map.Vocabulary"] >> kVocabularyFile_;
+  if (fs["Map.VocabularyLevelsUp"].isNamed()) fs["Map.VocabularyLevelsUp"] >> kVocabularyLevelsUp_;
+
+  // Local Mapping
+  if (fs["LocalMapping.nThreads"].isNamed()) fs["LocalMapping.nThreads"] >> kThreadsMapping_;
+  if (kThreadsMapping_ <= 0)
+    kThreadsMapping_ = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  if (fs["LocalMapping.MaxLatency"].isNamed()) fs["LocalMapping.MaxLatency"] >> kMappingMaxLatency_;
+  if (fs["LocalMapping.Pipelined"].isNamed()) fs["LocalMapping.Pipelined"] >> kPipelinedMapping_;
+
+  // Relocalization
+  if (fs["Relocalization.Candidates"].isNamed()) fs["Relocalization.Candidates"] >> kRelocCandidates_;
+  if (fs["Relocalization.TimeBudget"].isNamed()) fs["Relocalization.TimeBudget"] >> kRelocTimeBudget_;
+  if (fs["Relocalization.Gate"].isNamed()) fs["Relocalization.Gate"] >> kRelocGate_;
+
+  // Loop Closing
+  if (fs["LoopClosing.Candidates"].isNamed()) fs["LoopClosing.Candidates"] >> kLoopCandidates_;
+  if (fs["LoopClosing.Prosac"].isNamed()) fs["LoopClosing.Prosac"] >> kLoopProsac_;
+  if (fs["LoopClosing.nThreads"].isNamed()) fs["LoopClosing.nThreads"] >> kThreadsLoop_;
+  if (kThreadsLoop_ <= 0)
+    kThreadsLoop_ = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  if (fs["LoopClosing.Region"].isNamed()) fs["LoopClosing.Region"] >> kLoopRegion_;
+  if (fs["LoopClosing.EssentialEdges"].isNamed()) fs["LoopClosing.EssentialEdges"] >> kEssentialEdges_;
+  if (fs["LoopClosing.Server"].isNamed()) fs["LoopClosing.Server"] >> kLoopServer_;
+  if (fs["LoopClosing.GateRadius"].isNamed()) fs["LoopClosing.GateRadius"] >> kLoopGateRadius_;
+  if (fs["LoopClosing.GateDrift"].isNamed()) fs["LoopClosing.GateDrift"] >> kLoopGateDrift_;
+
+  // Optimizer
+  if (fs["Optimizer.nThreads"].isNamed()) fs["Optimizer.nThreads"] >> kThreadsBA_;
+  if (kThreadsBA_ <= 0)
+    kThreadsBA_ = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  if (fs["Optimizer.WindowSize"].isNamed()) fs["Optimizer.WindowSize"] >> kWindowSize_;
+  if (fs["Optimizer.SupernodalSize"].isNamed()) fs["Optimizer.SupernodalSize"] >> kSupernodalSize_;
+  if (fs["Optimizer.PCGSize"].isNamed()) fs["Optimizer.PCGSize"] >> kPCGSize_;
+  if (fs["Optimizer.Backend"].isNamed()) fs["Optimizer.Backend"] >> kBackendBA_;
+  if (fs["Optimizer.PartitionSize"].isNamed()) fs["Optimizer.PartitionSize"] >> kPartitionSize_;
+  if (fs["Optimizer.PartitionRounds"].isNamed()) fs["Optimizer.PartitionRounds"] >> kPartitionRounds_;
+  if (fs["Optimizer.LocalTargetTime"].isNamed()) fs["Optimizer.LocalTargetTime"] >> kLocalBATargetTime_;
+  if (fs["Optimizer.LocalMaxFixed"].isNamed()) fs["Optimizer.LocalMaxFixed"] >> kLocalBAMaxFixed_;
+  if (fs["Optimizer.LocalMaxObservations"].isNamed()) fs["Optimizer.LocalMaxObservations"] >> kLocalBAMaxObservations_;
 
   // UI
   if (fs["Viewer.KeyFrameSize"].isNamed()) fs["Viewer.KeyFrameSize"] >> kKeyFrameSize_;
   if (fs["Viewer.KeyFrameLineWidth"].isNamed()) fs["Viewer.KeyFrameLineWidth"] >> kKeyFrameLineWidth_;
   if (fs["Viewer.GraphLineWidth"].isNamed()) fs["Viewer.GraphLineWidth"] >> kGraphLineWidth_;
   if (fs["Viewer.PointSize"].isNamed()) fs["Viewer.PointSize"] >> kPointSize_;
+  if (fs["Viewer.PointLOD"].isNamed()) fs["Viewer.PointLOD"] >> kPointLOD_;
   if (fs["Viewer.CameraSize"].isNamed()) fs["Viewer.CameraSize"] >> kCameraSize_;
   if (fs["Viewer.CameraLineWidth"].isNamed()) fs["Viewer.CameraLineWidth"] >> kCameraLineWidth_;
   if (fs["Viewer.ViewpointX"].isNamed()) fs["Viewer.ViewpointX"] >> kViewpointX_;
   if (fs["Viewer.ViewpointY"].isNamed()) fs["Viewer.ViewpointY"] >> kViewpointY_;
   if (fs["Viewer.ViewpointZ"].isNamed()) fs["Viewer.ViewpointZ"] >> kViewpointZ_;
   if (fs["Viewer.ViewpointF"].isNamed()) fs["Viewer.ViewpointF"] >> kViewpointF_;
+  if (fs["Viewer.FPS"].isNamed()) fs["Viewer.FPS"] >> kViewerFPS_;
+  if (fs["Viewer.Output"].isNamed()) fs["Viewer.Output"] >> kViewerOutput_;
+  if (fs["Viewer.OutputFPS"].isNamed()) fs["Viewer.OutputFPS"] >> kViewerOutputFPS_;
 
   // ROS
   if (fs["ROS.CameraTopic"].isNamed()) fs["ROS.CameraTopic"] >> kCameraTopic_;
@@ -129,6 +358,7 @@ bool Config::ReadParameters(std::string filename) {
   if (fs["ROS.BaseFrame"].isNamed()) fs["ROS.BaseFrame"] >> kBaseFrame_;
   if (fs["ROS.CameraFrame"].isNamed()) fs["ROS.CameraFrame"] >> kCameraFrame_;
   if (fs["ROS.UseImagesTimeStamps"].isNamed()) fs["ROS.UseImagesTimeStamps"] >> kUseImagesTimeStamps_;
+  if (fs["ROS.MapPeriod"].isNamed()) fs["ROS.MapPeriod"] >> kMapPeriod_;
 
   fs.release();
 
@@ -156,4 +386,8 @@ void Config::SetUsePattern(bool use_pattern){
 	kUsePattern_ = use_pattern;
 }
 
+void Config::SetLoopServer(const std::string &address) {
+  kLoopServer_ = address;
+}
+
 }  // namespace SD_SLAM
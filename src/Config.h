@@ -22,6 +22,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 namespace SD_SLAM {
 
@@ -41,6 +42,12 @@ struct CameraParameters {
   double bf;
 };
 
+// Secondary camera of a multi-camera rig
+struct RigCameraParameters {
+  CameraParameters camera;
+  std::vector<double> Tcb;    // 4x4 row major, transforms points from main camera to this camera
+};
+
 class Config {
  public:
   // Singleton
@@ -56,6 +63,7 @@ class Config {
   void SetCameraIntrinsics(double w, double h, double fx, double fy, double cx, double cy);
   void SetCameraDistortion(double k1, double k2, double p1, double p2, double k3);
   void SetUsePattern(bool use_pattern);
+  void SetLoopServer(const std::string &address);
 
   // Get parameters
   static double Width() { return GetInstance().camera_params_.w; }
@@ -76,21 +84,111 @@ class Config {
   static double ThDepth() { return GetInstance().kThDepth_; }
   static double DepthMapFactor() { return GetInstance().kDepthMapFactor_; }
 
+  static int Threads() { return GetInstance().kThreads_; }
+  static bool ThreadAffinity() { return GetInstance().kThreadAffinity_; }
+
+  static int TrackingCore() { return GetInstance().kTrackingCore_; }
+  static int TrackingPriority() { return GetInstance().kTrackingPriority_; }
+  static int MappingCore() { return GetInstance().kMappingCore_; }
+  static int MappingNice() { return GetInstance().kMappingNice_; }
+  static int LoopCore() { return GetInstance().kLoopCore_; }
+  static int LoopNice() { return GetInstance().kLoopNice_; }
+
+  static std::string TraceFile() { return GetInstance().kTraceFile_; }
+  static int TraceEvents() { return GetInstance().kTraceEvents_; }
+  static std::string RecordFile() { return GetInstance().kRecordFile_; }
+  static std::string CheckpointFile() { return GetInstance().kCheckpointFile_; }
+  static double CheckpointPeriod() { return GetInstance().kCheckpointPeriod_; }
+  static int MetricsPort() { return GetInstance().kMetricsPort_; }
+  static bool FastStart() { return GetInstance().kFastStart_; }
+  static double EnergyDutyCycle() { return GetInstance().kEnergyDutyCycle_; }
+  static int EnergyLoopBatch() { return GetInstance().kEnergyLoopBatch_; }
+
   static int NumFeatures() { return GetInstance().kNumFeatures_; }
   static double ScaleFactor() { return GetInstance().kScaleFactor_; }
   static int NumLevels() { return GetInstance().kNumLevels_; }
   static int ThresholdFAST() { return GetInstance().kThresholdFAST_; }
+  static int ThreadsORB() { return GetInstance().kThreadsORB_; }
+  static int BackendORB() { return GetInstance().kBackendORB_; }
+  static std::string MaskFile() { return GetInstance().kMaskFile_; }
+  static int FirstLevelORB() { return GetInstance().kFirstLevelORB_; }
+  static double TargetFrameTime() { return GetInstance().kTargetFrameTime_; }
+  static int MinFeatures() { return GetInstance().kMinFeatures_; }
+  static int MaxFeatures() { return GetInstance().kMaxFeatures_; }
+  static bool OverloadMode() { return GetInstance().kOverloadMode_; }
+
+  static int InputQueueSize() { return GetInstance().kInputQueueSize_; }
+  static int InputDropPolicy() { return GetInstance().kInputDropPolicy_; }
+  static bool InputPipeline() { return GetInstance().kInputPipeline_; }
+  static bool InputOffline() { return GetInstance().kInputOffline_; }
+  static int InputTimestampClock() { return GetInstance().kInputTimestampClock_; }
+  static double StaticThreshold() { return GetInstance().kStaticThreshold_; }
+  static int StaticMaxFrames() { return GetInstance().kStaticMaxFrames_; }
+
+  static const std::vector<RigCameraParameters>& RigCameras() { return GetInstance().kRigCameras_; }
+
+  static int AlignMaxLevel() { return GetInstance().kAlignMaxLevel_; }
+  static int AlignMinLevel() { return GetInstance().kAlignMinLevel_; }
+  static int AlignIterations() { return GetInstance().kAlignIterations_; }
+  static int AlignPatchSize() { return GetInstance().kAlignPatchSize_; }
+  static double AlignBasin() { return GetInstance().kAlignBasin_; }
+  static double AlignStopResidual() { return GetInstance().kAlignStopResidual_; }
+  static int AlignCacheSize() { return GetInstance().kAlignCacheSize_; }
+  static int AlignReferences() { return GetInstance().kAlignReferences_; }
+
+  static int PyramidWindow() { return GetInstance().kPyramidWindow_; }
+
+  static double VoxelSize() { return GetInstance().kVoxelSize_; }
+  static bool FrustumPoints() { return GetInstance().kFrustumPoints_; }
+  static std::string PagingFile() { return GetInstance().kPagingFile_; }
+  static double TileSize() { return GetInstance().kTileSize_; }
+  static int PagingRadius() { return GetInstance().kPagingRadius_; }
+  static bool CompressImages() { return GetInstance().kCompressImages_; }
+  static std::string VocabularyFile() { return GetInstance().kVocabularyFile_; }
+  static int VocabularyLevelsUp() { return GetInstance().kVocabularyLevelsUp_; }
+
+  static int ThreadsMapping() { return GetInstance().kThreadsMapping_; }
+  static double MappingMaxLatency() { return GetInstance().kMappingMaxLatency_; }
+  static bool PipelinedMapping() { return GetInstance().kPipelinedMapping_; }
+
+  static int RelocCandidates() { return GetInstance().kRelocCandidates_; }
+  static double RelocTimeBudget() { return GetInstance().kRelocTimeBudget_; }
+  static bool RelocGate() { return GetInstance().kRelocGate_; }
+
+  static int LoopCandidates() { return GetInstance().kLoopCandidates_; }
+  static bool LoopProsac() { return GetInstance().kLoopProsac_; }
+  static int ThreadsLoop() { return GetInstance().kThreadsLoop_; }
+  static int LoopRegion() { return GetInstance().kLoopRegion_; }
+  static int EssentialEdges() { return GetInstance().kEssentialEdges_; }
+  static std::string LoopServer() { return GetInstance().kLoopServer_; }
+  static double LoopGateRadius() { return GetInstance().kLoopGateRadius_; }
+  static double LoopGateDrift() { return GetInstance().kLoopGateDrift_; }
+
+  static int ThreadsBA() { return GetInstance().kThreadsBA_; }
+  static int WindowSize() { return GetInstance().kWindowSize_; }
+  static int SupernodalSize() { return GetInstance().kSupernodalSize_; }
+  static int PCGSize() { return GetInstance().kPCGSize_; }
+  static int BackendBA() { return GetInstance().kBackendBA_; }
+  static int PartitionSize() { return GetInstance().kPartitionSize_; }
+  static int PartitionRounds() { return GetInstance().kPartitionRounds_; }
+  static double LocalBATargetTime() { return GetInstance().kLocalBATargetTime_; }
+  static int LocalBAMaxFixed() { return GetInstance().kLocalBAMaxFixed_; }
+  static int LocalBAMaxObservations() { return GetInstance().kLocalBAMaxObservations_; }
 
   static double KeyFrameSize() { return GetInstance().kKeyFrameSize_; }
   static double KeyFrameLineWidth() { return GetInstance().kKeyFrameLineWidth_; }
   static double GraphLineWidth() { return GetInstance().kGraphLineWidth_; }
   static double PointSize() { return GetInstance().kPointSize_; }
+  static int PointLOD() { return GetInstance().kPointLOD_; }
   static double CameraSize() { return GetInstance().kCameraSize_; }
   static double CameraLineWidth() { return GetInstance().kCameraLineWidth_; }
   static double ViewpointX() { return GetInstance().kViewpointX_; }
   static double ViewpointY() { return GetInstance().kViewpointY_; }
   static double ViewpointZ() { return GetInstance().kViewpointZ_; }
   static double ViewpointF() { return GetInstance().kViewpointF_; }
+  static double ViewerFPS() { return GetInstance().kViewerFPS_; }
+  static std::string ViewerOutput() { return GetInstance().kViewerOutput_; }
+  static double ViewerOutputFPS() { return GetInstance().kViewerOutputFPS_; }
 
   static std::string CameraTopic() { return GetInstance().kCameraTopic_; }
   static std::string DepthTopic() { return GetInstance().kDepthTopic_; }
@@ -98,6 +196,7 @@ class Config {
   static std::string BaseFrame() { return GetInstance().kBaseFrame_; }
   static std::string CameraFrame() { return GetInstance().kCameraFrame_; }
   static bool UseImagesTimeStamps() { return GetInstance().kUseImagesTimeStamps_; }
+  static double MapPeriod() { return GetInstance().kMapPeriod_; }
 
  private:
   Config();
@@ -109,23 +208,129 @@ class Config {
   double kThDepth_;
   double kDepthMapFactor_;
 
+  // Shared thread pool
+  int kThreads_;
+  bool kThreadAffinity_;
+
+  // Thread placement
+  int kTrackingCore_;
+  int kTrackingPriority_;
+  int kMappingCore_;
+  int kMappingNice_;
+  int kLoopCore_;
+  int kLoopNice_;
+
+  // Activity trace
+  std::string kTraceFile_;
+  int kTraceEvents_;
+
+  // Input recording
+  std::string kRecordFile_;
+  std::string kCheckpointFile_;
+  double kCheckpointPeriod_;
+  int kMetricsPort_;
+  bool kFastStart_;
+
+  // Energy policy
+  double kEnergyDutyCycle_;
+  int kEnergyLoopBatch_;
+
   // ORB Extractor
   int kNumFeatures_;
   double kScaleFactor_;
   int kNumLevels_;
   int kThresholdFAST_;
+  int kThreadsORB_;
+  int kBackendORB_;
+  std::string kMaskFile_;
+  int kFirstLevelORB_;
+  double kTargetFrameTime_;
+  int kMinFeatures_;
+  int kMaxFeatures_;
+  bool kOverloadMode_;
+
+  // Input queue (System::SubmitFrame)
+  int kInputQueueSize_;
+  int kInputDropPolicy_;
+  bool kInputPipeline_;
+  bool kInputOffline_;
+  int kInputTimestampClock_;
+  double kStaticThreshold_;
+  int kStaticMaxFrames_;
+
+  // Secondary cameras of the rig, main camera is not included
+  std::vector<RigCameraParameters> kRigCameras_;
+
+  // Image alignment
+  int kAlignMaxLevel_;
+  int kAlignMinLevel_;
+  int kAlignIterations_;
+  int kAlignPatchSize_;
+  double kAlignBasin_;
+  double kAlignStopResidual_;
+  int kAlignCacheSize_;
+  int kAlignReferences_;
+
+  // KeyFrames
+  int kPyramidWindow_;
+
+  // Map
+  double kVoxelSize_;
+  bool kFrustumPoints_;
+  std::string kPagingFile_;
+  double kTileSize_;
+  int kPagingRadius_;
+  bool kCompressImages_;
+  std::string kVocabularyFile_;
+  int kVocabularyLevelsUp_;
+
+  // Local Mapping
+  int kThreadsMapping_;
+  double kMappingMaxLatency_;
+  bool kPipelinedMapping_;
+
+  // Relocalization
+  int kRelocCandidates_;
+  double kRelocTimeBudget_;
+  bool kRelocGate_;
+
+  // Loop Closing
+  int kLoopCandidates_;
+  bool kLoopProsac_;
+  int kThreadsLoop_;
+  int kLoopRegion_;
+  int kEssentialEdges_;
+  std::string kLoopServer_;
+  double kLoopGateRadius_;
+  double kLoopGateDrift_;
+
+  // Optimizer
+  int kThreadsBA_;
+  int kWindowSize_;
+  int kSupernodalSize_;
+  int kPCGSize_;
+  int kBackendBA_;
+  int kPartitionSize_;
+  int kPartitionRounds_;
+  double kLocalBATargetTime_;
+  int kLocalBAMaxFixed_;
+  int kLocalBAMaxObservations_;
 
   // UI
   double kKeyFrameSize_;
   double kKeyFrameLineWidth_;
   double kGraphLineWidth_;
   double kPointSize_;
+  int kPointLOD_;
   double kCameraSize_;
   double kCameraLineWidth_;
   double kViewpointX_;
   double kViewpointY_;
   double kViewpointZ_;
   double kViewpointF_;
+  double kViewerFPS_;
+  std::string kViewerOutput_;
+  double kViewerOutputFPS_;
 
   // ROS
   std::string kCameraTopic_;
@@ -134,6 +339,7 @@ class Config {
   std::string kBaseFrame_;
   std::string kCameraFrame_;
   bool kUseImagesTimeStamps_;
+  double kMapPeriod_;
 };
 
 }  // namespace SD_SLAM
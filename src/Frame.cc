@@ -24,175 +24,414 @@
 
 #include "Frame.h"
 #include <thread>
+#include <algorithm>
+#include <limits>
 #include "ORBmatcher.h"
 #include "Converter.h"
+#include "extra/stats.h"
 
 using std::vector;
 
 namespace SD_SLAM {
 
-long unsigned int Frame::nNextId = 0;
-bool Frame::mbInitialComputations = true;
-float Frame::cx, Frame::cy, Frame::fx, Frame::fy, Frame::invfx, Frame::invfy;
-float Frame::mnMinX, Frame::mnMinY, Frame::mnMaxX, Frame::mnMaxY;
-float Frame::mfGridElementWidthInv, Frame::mfGridElementHeightInv;
-
-Frame::Frame() {
+Frame::Frame(): mpCamera(nullptr), mnScaleLevels(0), mfScaleFactor(1.0f), mfLogScaleFactor(0.0f), mvScaleFactors(nullptr),
+  mvInvScaleFactors(nullptr), mvLevelSigma2(nullptr), mvInvLevelSigma2(nullptr), mfDepthScale(1.0f), mbBorrowedDepth(false) {
   mTcw.setZero();
+  mTimeStamp = -1.0;
 }
 
-// Copy Constructor
-Frame::Frame(const Frame &frame): mpORBextractorLeft(frame.mpORBextractorLeft),
-  mK(frame.mK), mDistCoef(frame.mDistCoef.clone()), mbf(frame.mbf), mb(frame.mb), mThDepth(frame.mThDepth),
+// Copy Constructor. Image buffers are shared, they are never modified after extraction
+Frame::Frame(const Frame &frame): mpORBextractorLeft(frame.mpORBextractorLeft), mpCamera(frame.mpCamera),
+  mK(frame.mK), fx(frame.fx), fy(frame.fy), cx(frame.cx), cy(frame.cy), invfx(frame.invfx), invfy(frame.invfy),
+  mDistCoef(frame.mDistCoef), mbf(frame.mbf), mb(frame.mb), mThDepth(frame.mThDepth),
   N(frame.N), mvKeys(frame.mvKeys), mvKeysUn(frame.mvKeysUn), mvuRight(frame.mvuRight), mvDepth(frame.mvDepth),
-  mDescriptors(frame.mDescriptors.clone()), mvpMapPoints(frame.mvpMapPoints), mvbOutlier(frame.mvbOutlier),
-  mnId(frame.mnId), mpReferenceKF(frame.mpReferenceKF), mnScaleLevels(frame.mnScaleLevels),
+  mDescriptors(frame.mDescriptors), mFeatures(frame.mFeatures), mvpMapPoints(frame.mvpMapPoints),
+  mvbOutlier(frame.mvbOutlier), mvbRefined(frame.mvbRefined), mfGridElementWidthInv(frame.mfGridElementWidthInv),
+  mfGridElementHeightInv(frame.mfGridElementHeightInv), mGrid(frame.mGrid),
+  mnId(frame.mnId), mTimeStamp(frame.mTimeStamp), mpReferenceKF(frame.mpReferenceKF), mpPyramid(frame.mpPyramid),
+  mnScaleLevels(frame.mnScaleLevels),
   mfScaleFactor(frame.mfScaleFactor), mfLogScaleFactor(frame.mfLogScaleFactor), mvScaleFactors(frame.mvScaleFactors),
   mvInvScaleFactors(frame.mvInvScaleFactors), mvLevelSigma2(frame.mvLevelSigma2),
-  mvInvLevelSigma2(frame.mvInvLevelSigma2) {
-  for (int i = 0; i < FRAME_GRID_COLS; i++)
-    for (int j = 0; j < FRAME_GRID_ROWS; j++)
-      mGrid[i][j] = frame.mGrid[i][j];
-
+  mvInvLevelSigma2(frame.mvInvLevelSigma2), mnMinX(frame.mnMinX), mnMaxX(frame.mnMaxX), mnMinY(frame.mnMinY),
+  mnMaxY(frame.mnMaxY), mvImagePyramid(frame.mvImagePyramid), mDepthImage(frame.mDepthImage),
+  mRawDepth(frame.mRawDepth), mfDepthScale(frame.mfDepthScale), mbBorrowedDepth(frame.mbBorrowedDepth),
+  mvRigViews(frame.mvRigViews) {
   SetPose(frame.mTcw);
+}
 
-  // Copy pyramid
-  int size = frame.mvImagePyramid.size();
-  mvImagePyramid.resize(size);
-  for (int i = 0; i < size; i++)
-    mvImagePyramid[i] = frame.mvImagePyramid[i].clone();
+// Move Constructor
+Frame::Frame(Frame &&frame): Frame() {
+  *this = std::move(frame);
+}
 
-  mDepthImage = frame.mDepthImage.clone();
+// Member by member, so vectors are copied into the memory they already have
+Frame& Frame::operator=(const Frame &frame) {
+  if (this == &frame)
+    return *this;
+
+  mpORBextractorLeft = frame.mpORBextractorLeft;
+  mpCamera = frame.mpCamera;
+  mK = frame.mK;
+  fx = frame.fx;
+  fy = frame.fy;
+  cx = frame.cx;
+  cy = frame.cy;
+  invfx = frame.invfx;
+  invfy = frame.invfy;
+  mDistCoef = frame.mDistCoef;
+  mbf = frame.mbf;
+  mb = frame.mb;
+  mThDepth = frame.mThDepth;
+  N = frame.N;
+  mvKeys = frame.mvKeys;
+  mvKeysUn = frame.mvKeysUn;
+  mvuRight = frame.mvuRight;
+  mvDepth = frame.mvDepth;
+  mDescriptors = frame.mDescriptors;
+  mFeatures = frame.mFeatures;
+  mvpMapPoints = frame.mvpMapPoints;
+  mvbOutlier = frame.mvbOutlier;
+  mvbRefined = frame.mvbRefined;
+
+  mfGridElementWidthInv = frame.mfGridElementWidthInv;
+  mfGridElementHeightInv = frame.mfGridElementHeightInv;
+  mGrid = frame.mGrid;
+
+  mTcw = frame.mTcw;
+  mTwc = frame.mTwc;
+  mRcw = frame.mRcw;
+  mtcw = frame.mtcw;
+  mRwc = frame.mRwc;
+  mOw = frame.mOw;
+  mRcwT = frame.mRcwT;
+  mtcwT = frame.mtcwT;
+  mOwT = frame.mOwT;
+
+  mnId = frame.mnId;
+  mTimeStamp = frame.mTimeStamp;
+  mpReferenceKF = frame.mpReferenceKF;
+
+  mpPyramid = frame.mpPyramid;
+  mnScaleLevels = frame.mnScaleLevels;
+  mfScaleFactor = frame.mfScaleFactor;
+  mfLogScaleFactor = frame.mfLogScaleFactor;
+  mvScaleFactors = frame.mvScaleFactors;
+  mvInvScaleFactors = frame.mvInvScaleFactors;
+  mvLevelSigma2 = frame.mvLevelSigma2;
+  mvInvLevelSigma2 = frame.mvInvLevelSigma2;
+
+  mnMinX = frame.mnMinX;
+  mnMaxX = frame.mnMaxX;
+  mnMinY = frame.mnMinY;
+  mnMaxY = frame.mnMaxY;
+
+  mvImagePyramid = frame.mvImagePyramid;
+  mDepthImage = frame.mDepthImage;
+  mRawDepth = frame.mRawDepth;
+  mfDepthScale = frame.mfDepthScale;
+  mbBorrowedDepth = frame.mbBorrowedDepth;
+  mvRigViews = frame.mvRigViews;
+
+  return *this;
 }
 
+Frame& Frame::operator=(Frame &&frame) {
+  if (this == &frame)
+    return *this;
+
+  RecycleBuffers();
+
+  mpORBextractorLeft = frame.mpORBextractorLeft;
+  mpCamera = frame.mpCamera;
+  mK = frame.mK;
+  fx = frame.fx;
+  fy = frame.fy;
+  cx = frame.cx;
+  cy = frame.cy;
+  invfx = frame.invfx;
+  invfy = frame.invfy;
+  mDistCoef = std::move(frame.mDistCoef);
+  mbf = frame.mbf;
+  mb = frame.mb;
+  mThDepth = frame.mThDepth;
+  N = frame.N;
+  mvKeys = std::move(frame.mvKeys);
+  mvKeysUn = std::move(frame.mvKeysUn);
+  mvuRight = std::move(frame.mvuRight);
+  mvDepth = std::move(frame.mvDepth);
+  mDescriptors = std::move(frame.mDescriptors);
+  mFeatures = std::move(frame.mFeatures);
+  mvpMapPoints = std::move(frame.mvpMapPoints);
+  mvbOutlier = std::move(frame.mvbOutlier);
+  mvbRefined = std::move(frame.mvbRefined);
+
+  mfGridElementWidthInv = frame.mfGridElementWidthInv;
+  mfGridElementHeightInv = frame.mfGridElementHeightInv;
+  mGrid = std::move(frame.mGrid);
+
+  mTcw = frame.mTcw;
+  mTwc = frame.mTwc;
+  mRcw = frame.mRcw;
+  mtcw = frame.mtcw;
+  mRwc = frame.mRwc;
+  mOw = frame.mOw;
+  mRcwT = frame.mRcwT;
+  mtcwT = frame.mtcwT;
+  mOwT = frame.mOwT;
+
+  mnId = frame.mnId;
+  mTimeStamp = frame.mTimeStamp;
+  mpReferenceKF = frame.mpReferenceKF;
+
+  mpPyramid = std::move(frame.mpPyramid);
+  mnScaleLevels = frame.mnScaleLevels;
+  mfScaleFactor = frame.mfScaleFactor;
+  mfLogScaleFactor = frame.mfLogScaleFactor;
+  mvScaleFactors = frame.mvScaleFactors;
+  mvInvScaleFactors = frame.mvInvScaleFactors;
+  mvLevelSigma2 = frame.mvLevelSigma2;
+  mvInvLevelSigma2 = frame.mvInvLevelSigma2;
+
+  mnMinX = frame.mnMinX;
+  mnMaxX = frame.mnMaxX;
+  mnMinY = frame.mnMinY;
+  mnMaxY = frame.mnMaxY;
+
+  mvImagePyramid = std::move(frame.mvImagePyramid);
+  mDepthImage = std::move(frame.mDepthImage);
+  mRawDepth = std::move(frame.mRawDepth);
+  mfDepthScale = frame.mfDepthScale;
+  mbBorrowedDepth = frame.mbBorrowedDepth;
+  mvRigViews = std::move(frame.mvRigViews);
+
+  return *this;
+}
 
-Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, ORBextractor* extractor,
-  const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth) :
-  mpORBextractorLeft(extractor), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth) {
+Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, float depthScale, ORBextractor* extractor,
+  FrameCamera* camera, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth,
+  const cv::Mat &mask) :
+  mpORBextractorLeft(extractor), mpCamera(camera), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
+  mRawDepth(imDepth), mfDepthScale(depthScale), mbBorrowedDepth(false) {
   // Frame ID
-  mnId = nNextId++;
+  mnId = mpCamera->mnNextFrameId++;
+  mTimeStamp = -1.0;
+  SetCameraParameters(imGray.size());
+  TakeBuffers();
 
   mTcw.setZero();
 
   // Scale Level Info
-  mnScaleLevels = mpORBextractorLeft->GetLevels();
-  mfScaleFactor = mpORBextractorLeft->GetScaleFactor();
-  mfLogScaleFactor = log(mfScaleFactor);
-  mvScaleFactors = mpORBextractorLeft->GetScaleFactors();
-  mvInvScaleFactors = mpORBextractorLeft->GetInverseScaleFactors();
-  mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
-  mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
+  SetScalePyramid(mpORBextractorLeft->GetPyramid());
 
   // ORB extraction
-  ExtractORB(imGray);
+  ExtractORB(imGray, mask);
 
   N = mvKeys.size();
 
   if (mvKeys.empty())
     return;
 
-  UndistortKeyPoints();
+  UndistortKeyPoints(imGray.size());
 
   ComputeStereoFromRGBD(imDepth);
-  mDepthImage = imDepth.clone();
 
-  mvpMapPoints = vector<MapPoint*>(N, static_cast<MapPoint*>(NULL));
-  mvbOutlier = vector<bool>(N, false);
+  mvpMapPoints.assign(N, static_cast<MapPoint*>(NULL));
+  mvbOutlier.assign(N, false);
 
-  // This is done only for the first Frame
-  if (mbInitialComputations) {
-    ComputeImageBounds(imGray);
+  mb = mbf/fx;
 
-    mfGridElementWidthInv = static_cast<float>(FRAME_GRID_COLS)/static_cast<float>(mnMaxX-mnMinX);
-    mfGridElementHeightInv = static_cast<float>(FRAME_GRID_ROWS)/static_cast<float>(mnMaxY-mnMinY);
+  AssignFeaturesToGrid();
+}
 
-    fx = K(0, 0);
-    fy = K(1, 1);
-    cx = K(0, 2);
-    cy = K(1, 2);
-    invfx = 1.0f/fx;
-    invfy = 1.0f/fy;
 
-    mbInitialComputations = false;
-  }
+Frame::Frame(const cv::Mat &imLeft, const cv::Mat &imRight, ORBextractor* extractorLeft, ORBextractor* extractorRight,
+  FrameCamera* camera, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth,
+  const cv::Mat &mask) :
+  mpORBextractorLeft(extractorLeft), mpCamera(camera), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
+  mfDepthScale(1.0f), mbBorrowedDepth(false) {
+  // Frame ID
+  mnId = mpCamera->mnNextFrameId++;
+  mTimeStamp = -1.0;
+  SetCameraParameters(imLeft.size());
+  TakeBuffers();
+
+  mTcw.setZero();
+
+  // Scale Level Info
+  SetScalePyramid(mpORBextractorLeft->GetPyramid());
+
+  // ORB extraction, right image in another thread
+  vector<cv::KeyPoint> vKeysRight;
+  cv::Mat descRight;
+  vector<cv::Mat> vPyramidRight;
+  std::thread tRight([&]() {
+    (*extractorRight)(imRight, cv::Mat(), vKeysRight, descRight, vPyramidRight);
+  });
+  ExtractORB(imLeft, mask);
+  tRight.join();
+
+  N = mvKeys.size();
+
+  if (mvKeys.empty())
+    return;
+
+  UndistortKeyPoints(imLeft.size());
 
   mb = mbf/fx;
 
+  ComputeStereoMatches(vKeysRight, descRight, vPyramidRight);
+
+  mvpMapPoints.assign(N, static_cast<MapPoint*>(NULL));
+  mvbOutlier.assign(N, false);
+
   AssignFeaturesToGrid();
 }
 
-
-Frame::Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix3d &K,
-  cv::Mat &distCoef, const float &bf, const float &thDepth) :
-  mpORBextractorLeft(extractor), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth) {
+Frame::Frame(const cv::Mat &imGray, ORBextractor* extractor, FrameCamera* camera, const Eigen::Matrix3d &K,
+  cv::Mat &distCoef, const float &bf, const float &thDepth, const cv::Mat &mask) :
+  mpORBextractorLeft(extractor), mpCamera(camera), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
+  mfDepthScale(1.0f), mbBorrowedDepth(false) {
   // Frame ID
-  mnId=nNextId++;
+  mnId = mpCamera->mnNextFrameId++;
+  mTimeStamp = -1.0;
+  SetCameraParameters(imGray.size());
+  TakeBuffers();
 
   // Scale Level Info
-  mnScaleLevels = mpORBextractorLeft->GetLevels();
-  mfScaleFactor = mpORBextractorLeft->GetScaleFactor();
-  mfLogScaleFactor = log(mfScaleFactor);
-  mvScaleFactors = mpORBextractorLeft->GetScaleFactors();
-  mvInvScaleFactors = mpORBextractorLeft->GetInverseScaleFactors();
-  mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
-  mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
+  SetScalePyramid(mpORBextractorLeft->GetPyramid());
 
   // ORB extraction
-  ExtractORB(imGray);
+  ExtractORB(imGray, mask);
 
   N = mvKeys.size();
 
   if (mvKeys.empty())
     return;
 
-  UndistortKeyPoints();
+  UndistortKeyPoints(imGray.size());
 
   // Set no stereo information
-  mvuRight = vector<float>(N, -1);
-  mvDepth = vector<float>(N, -1);
+  mvuRight.assign(N, -1);
+  mvDepth.assign(N, -1);
 
-  mvpMapPoints = vector<MapPoint*>(N, static_cast<MapPoint*>(NULL));
-  mvbOutlier = vector<bool>(N, false);
+  mvpMapPoints.assign(N, static_cast<MapPoint*>(NULL));
+  mvbOutlier.assign(N, false);
 
-  // This is done only for the first Frame (or after a change in the calibration)
-  if (mbInitialComputations) {
-    ComputeImageBounds(imGray);
+  mb = mbf/fx;
 
-    mfGridElementWidthInv = static_cast<float>(FRAME_GRID_COLS)/static_cast<float>(mnMaxX-mnMinX);
-    mfGridElementHeightInv = static_cast<float>(FRAME_GRID_ROWS)/static_cast<float>(mnMaxY-mnMinY);
+  AssignFeaturesToGrid();
+}
 
-    fx = K(0, 0);
-    fy = K(1, 1);
-    cx = K(0, 2);
-    cy = K(1, 2);
-    invfx = 1.0f/fx;
-    invfy = 1.0f/fy;
+Frame::Frame(std::vector<cv::KeyPoint> &&keys, std::vector<cv::KeyPoint> &&keysUn, std::vector<float> &&uRight,
+  std::vector<float> &&depth, const cv::Mat &descriptors, const std::vector<cv::Mat> &pyramid,
+  const cv::Mat &imDepth, const cv::Size &imSize, ORBextractor* extractor, FrameCamera* camera,
+  const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth) :
+  mpORBextractorLeft(extractor), mpCamera(camera), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth),
+  mvKeys(std::move(keys)), mvKeysUn(std::move(keysUn)), mvuRight(std::move(uRight)), mvDepth(std::move(depth)),
+  mDescriptors(FeatureTable::AlignDescriptors(descriptors)), mvImagePyramid(pyramid), mDepthImage(imDepth),
+  mfDepthScale(1.0f), mbBorrowedDepth(false) {
+  // Frame ID
+  mnId = mpCamera->mnNextFrameId++;
+  mTimeStamp = -1.0;
+  SetCameraParameters(imSize);
 
-    mbInitialComputations = false;
-  }
+  mTcw.setZero();
+
+  // Scale Level Info
+  SetScalePyramid(mpORBextractorLeft->GetPyramid());
+
+  N = mvKeys.size();
+
+  mvpMapPoints.assign(N, static_cast<MapPoint*>(NULL));
+  mvbOutlier.assign(N, false);
 
   mb = mbf/fx;
 
   AssignFeaturesToGrid();
 }
 
+void Frame::TakeBuffers() {
+  std::unique_lock<std::mutex> lock(mpCamera->mMutexSpareBuffers);
+  vector<FrameBuffers> &spare = mpCamera->mvSpareBuffers;
+  if (spare.empty())
+    return;
+
+  FrameBuffers &buffers = spare.back();
+  mvKeys.swap(buffers.mvKeys);
+  mvKeysUn.swap(buffers.mvKeysUn);
+  mvuRight.swap(buffers.mvuRight);
+  mvDepth.swap(buffers.mvDepth);
+  mvpMapPoints.swap(buffers.mvpMapPoints);
+  mvbOutlier.swap(buffers.mvbOutlier);
+  mvbRefined.swap(buffers.mvbRefined);
+  mFeatures = std::move(buffers.mFeatures);
+  mGrid = std::move(buffers.mGrid);
+  mvImagePyramid.swap(buffers.mvImagePyramid);
+  spare.pop_back();
+}
+
+void Frame::RecycleBuffers() {
+  if (!mpCamera || mvKeys.capacity() == 0)
+    return;
+
+  // Pyramid levels are released, so the extractor sees them free
+  mvKeys.clear();
+  mvKeysUn.clear();
+  mvuRight.clear();
+  mvDepth.clear();
+  mvpMapPoints.clear();
+  mvbOutlier.clear();
+  mvbRefined.clear();
+  mvImagePyramid.clear();
+
+  std::unique_lock<std::mutex> lock(mpCamera->mMutexSpareBuffers);
+  vector<FrameBuffers> &spare = mpCamera->mvSpareBuffers;
+  if (spare.size() >= FrameCamera::MAX_SPARE_BUFFERS)
+    return;
+
+  spare.push_back(FrameBuffers());
+  FrameBuffers &buffers = spare.back();
+  buffers.mvKeys.swap(mvKeys);
+  buffers.mvKeysUn.swap(mvKeysUn);
+  buffers.mvuRight.swap(mvuRight);
+  buffers.mvDepth.swap(mvDepth);
+  buffers.mvpMapPoints.swap(mvpMapPoints);
+  buffers.mvbOutlier.swap(mvbOutlier);
+  buffers.mvbRefined.swap(mvbRefined);
+  buffers.mFeatures = std::move(mFeatures);
+  buffers.mGrid = std::move(mGrid);
+  buffers.mvImagePyramid.swap(mvImagePyramid);
+}
+
 void Frame::AssignFeaturesToGrid() {
-  int nReserve = 0.5f*N/(FRAME_GRID_COLS*FRAME_GRID_ROWS);
-  for (unsigned int i = 0; i < FRAME_GRID_COLS; i++)
-    for (unsigned int j = 0; j < FRAME_GRID_ROWS; j++)
-      mGrid[i][j].reserve(nReserve);
+  mFeatures.Build(mvKeysUn, mDescriptors);
 
-  for (int i = 0; i < N; i++) {
-    const cv::KeyPoint &kp = mvKeysUn[i];
+  mGrid.Build(FRAME_GRID_COLS, FRAME_GRID_ROWS, N, [this](int i, int &posX, int &posY) {
+    return PosInGrid(mvKeysUn[i], posX, posY);
+  });
+}
 
-    int nGridPosX, nGridPosY;
-    if (PosInGrid(kp, nGridPosX, nGridPosY))
-      mGrid[nGridPosX][nGridPosY].push_back(i);
-  }
+void Frame::ExtractORB(const cv::Mat &im, const cv::Mat &mask) {
+  ScopedSpan span(Statistics::ORB_EXTRACTION);
+  (*mpORBextractorLeft)(im, mask, mvKeys, mDescriptors, mvImagePyramid);
 }
 
-void Frame::ExtractORB(const cv::Mat &im) {
-  (*mpORBextractorLeft)(im, cv::Mat(), mvKeys, mDescriptors, mvImagePyramid);
+void Frame::ReleaseKeyFrameData(int level) {
+  int size = mvImagePyramid.size();
+  for (int i = 1; i < level && i < size; i++)
+    mvImagePyramid[i].release();
+  mDepthImage.release();
+  mRawDepth.release();
+  mbBorrowedDepth = false;
+}
+
+const cv::Mat &Frame::GetDepthImage() {
+  if (mDepthImage.empty() && !mRawDepth.empty()) {
+    mRawDepth.convertTo(mDepthImage, CV_32F, mfDepthScale);
+    mRawDepth.release();
+    mbBorrowedDepth = false;
+  }
+  return mDepthImage;
 }
 
 void Frame::SetPose(const Eigen::Matrix4d &Tcw) {
@@ -210,19 +449,23 @@ void Frame::UpdatePoseMatrices() {
   mTwc.setIdentity();
   mTwc.block<3, 3>(0, 0) = mRwc;
   mTwc.block<3, 1>(0, 3) = mOw;
+
+  mRcwT = mRcw.cast<TrackScalar>();
+  mtcwT = mtcw.cast<TrackScalar>();
+  mOwT = mOw.cast<TrackScalar>();
 }
 
 bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit) {
   pMP->mbTrackInView = false;
 
   // 3D in absolute coordinates
-  Eigen::Vector3d P = pMP->GetWorldPos();
+  const TrackVector3 P = pMP->GetWorldPos().cast<TrackScalar>();
 
   // 3D in camera coordinates
-  Eigen::Vector3d Pc = mRcw*P+mtcw;
-  const double PcX = Pc(0);
-  const double PcY = Pc(1);
-  const double PcZ = Pc(2);
+  const TrackVector3 Pc = mRcwT*P+mtcwT;
+  const TrackScalar PcX = Pc(0);
+  const TrackScalar PcY = Pc(1);
+  const TrackScalar PcZ = Pc(2);
 
   // Check positive depth
   if (PcZ < 0.0)
@@ -241,14 +484,14 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit) {
   // Check distance is in the scale invariance region of the MapPoint
   const float maxDistance = pMP->GetMaxDistanceInvariance();
   const float minDistance = pMP->GetMinDistanceInvariance();
-  Eigen::Vector3d PO = P-mOw;
+  const TrackVector3 PO = P-mOwT;
   const float dist = PO.norm();
 
   if (dist<minDistance || dist>maxDistance)
     return false;
 
   // Check viewing angle
-  Eigen::Vector3d Pn = pMP->GetNormal();
+  const TrackVector3 Pn = pMP->GetNormal().cast<TrackScalar>();
   const float viewCos = PO.dot(Pn)/dist;
 
   if (viewCos < viewingCosLimit)
@@ -268,58 +511,45 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit) {
   return true;
 }
 
-vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel, const int maxLevel) const {
-  vector<size_t> vIndices;
-  vIndices.reserve(N);
-
-  const int nMinCellX = std::max(0, static_cast<int>(floor((x-mnMinX-r)*mfGridElementWidthInv)));
-  if (nMinCellX >= FRAME_GRID_COLS)
-    return vIndices;
-
-  const int nMaxCellX = std::min(static_cast<int>(FRAME_GRID_COLS-1),
-                                 static_cast<int>(ceil((x-mnMinX+r)*mfGridElementWidthInv)));
-  if (nMaxCellX < 0)
-    return vIndices;
-
-  const int nMinCellY = std::max(0, static_cast<int>(floor((y-mnMinY-r)*mfGridElementHeightInv)));
-  if (nMinCellY >= FRAME_GRID_ROWS)
-    return vIndices;
-
-  const int nMaxCellY = std::min(static_cast<int>(FRAME_GRID_ROWS-1),
-                                 static_cast<int>(ceil((y-mnMinY+r)*mfGridElementHeightInv)));
-  if (nMaxCellY < 0)
-    return vIndices;
-
-  const bool bCheckLevels = (minLevel > 0) || (maxLevel >= 0);
-
-  for (int ix = nMinCellX; ix <= nMaxCellX; ix++) {
-    for (int iy = nMinCellY; iy <= nMaxCellY; iy++) {
-      const vector<size_t> vCell = mGrid[ix][iy];
-      if (vCell.empty())
-        continue;
-
-      for (size_t j = 0, jend=vCell.size(); j < jend; j++) {
-        const cv::KeyPoint &kpUn = mvKeysUn[vCell[j]];
-        if (bCheckLevels) {
-          if (kpUn.octave < minLevel)
-            continue;
-          if (maxLevel >= 0)
-            if (kpUn.octave > maxLevel)
-              continue;
-        }
-
-        const float distx = kpUn.pt.x-x;
-        const float disty = kpUn.pt.y-y;
-
-        if (fabs(distx) < r && fabs(disty) < r)
-          vIndices.push_back(vCell[j]);
-      }
-    }
+void Frame::isInFrustum(PointTable &points, float viewingCosLimit, vector<PointTable::Visible> &visible) {
+  PointTable::View view;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++)
+      view.R[3*i+j] = mRcw(i, j);
+    view.t[i] = mtcw(i);
+    view.O[i] = mOw(i);
   }
+  view.fx = fx;
+  view.fy = fy;
+  view.cx = cx;
+  view.cy = cy;
+  view.bf = mbf;
+  view.minX = mnMinX;
+  view.maxX = mnMaxX;
+  view.minY = mnMinY;
+  view.maxY = mnMaxY;
+  view.viewingCosLimit = viewingCosLimit;
+  view.scaleFactors = mvScaleFactors;
+  view.levels = mnScaleLevels;
+
+  points.Cull(view, visible);
+}
 
+vector<size_t> Frame::GetFeaturesInArea(const float &x, const float &y, const float &r, const int minLevel, const int maxLevel) const {
+  vector<size_t> vIndices;
+  GetFeaturesInArea(x, y, r, vIndices, minLevel, maxLevel);
   return vIndices;
 }
 
+void Frame::GetFeaturesInArea(const float &x, const float &y, const float &r, vector<size_t> &vIndices,
+                              const int minLevel, const int maxLevel) const {
+  vIndices.clear();
+  mGrid.ForEachCell(x, y, r, mnMinX, mnMinY, mfGridElementWidthInv, mfGridElementHeightInv,
+                    [&](const uint32_t* begin, const uint32_t* end) {
+    mFeatures.Select(begin, end, x, y, r, minLevel, maxLevel, vIndices);
+  });
+}
+
 bool Frame::PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY) {
   posX = round((kp.pt.x-mnMinX)*mfGridElementWidthInv);
   posY = round((kp.pt.y-mnMinY)*mfGridElementHeightInv);
@@ -332,50 +562,191 @@ bool Frame::PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY) {
 }
 
 
-void Frame::UndistortKeyPoints() {
+void Frame::UndistortKeyPoints(const cv::Size &imSize) {
   if (mDistCoef.at<float>(0) == 0.0) {
     mvKeysUn = mvKeys;
     return;
   }
 
-  if (N == 0) {
-    return;
-  }
+  // Tables only depend on calibration, build them for the first frame
+  if (mpCamera->mUndistortX.empty() || mpCamera->mUndistortX.size() != imSize)
+    ComputeUndistortMaps(imSize);
 
-  // Fill matrix with points
-  cv::Mat mat(N, 2, CV_32F);
+  mvKeysUn.resize(N);
   for (int i = 0; i < N; i++) {
-    mat.at<float>(i, 0) = mvKeys[i].pt.x;
-    mat.at<float>(i, 1) = mvKeys[i].pt.y;
+    mvKeysUn[i] = mvKeys[i];
+    mvKeysUn[i].pt = UndistortPoint(mvKeys[i].pt);
+  }
+}
+
+cv::Point2f Frame::UndistortPoint(const cv::Point2f &pt) const {
+  if (mDistCoef.at<float>(0) == 0.0)
+    return pt;
+
+  const int maxX = mpCamera->mUndistortX.cols-1;
+  const int maxY = mpCamera->mUndistortX.rows-1;
+
+  // Bilinear interpolation of undistorted coordinates
+  const float x = std::min(std::max(pt.x, 0.0f), static_cast<float>(maxX));
+  const float y = std::min(std::max(pt.y, 0.0f), static_cast<float>(maxY));
+  const int x0 = std::min(static_cast<int>(x), maxX-1);
+  const int y0 = std::min(static_cast<int>(y), maxY-1);
+  const float ax = x-x0;
+  const float ay = y-y0;
+
+  const float* ux0 = mpCamera->mUndistortX.ptr<float>(y0)+x0;
+  const float* ux1 = mpCamera->mUndistortX.ptr<float>(y0+1)+x0;
+  const float* uy0 = mpCamera->mUndistortY.ptr<float>(y0)+x0;
+  const float* uy1 = mpCamera->mUndistortY.ptr<float>(y0+1)+x0;
+
+  return cv::Point2f((1.0f-ay)*((1.0f-ax)*ux0[0]+ax*ux0[1]) + ay*((1.0f-ax)*ux1[0]+ax*ux1[1]),
+                     (1.0f-ay)*((1.0f-ax)*uy0[0]+ax*uy0[1]) + ay*((1.0f-ax)*uy1[0]+ax*uy1[1]));
+}
+
+int Frame::RefineMatchedKeyPoints() {
+  mvbRefined.clear();
+  if (mvImagePyramid.empty() || mvImagePyramid[0].empty())
+    return 0;
+
+  const cv::Mat &image = mvImagePyramid[0];
+  const cv::TermCriteria criteria(cv::TermCriteria::EPS+cv::TermCriteria::COUNT, 10, 0.01);
+  mvbRefined.assign(N, false);
+  int nRefined = 0;
+
+  // One pass per level, the search window grows with its scale
+  vector<cv::Point2f> vPoints;
+  vector<int> vIndices;
+  for (int level = 1; level < mnScaleLevels; level++) {
+    vPoints.clear();
+    vIndices.clear();
+    for (int i = 0; i < N; i++) {
+      if (mvpMapPoints[i] && !mvbOutlier[i] && mvKeys[i].octave == level) {
+        vPoints.push_back(mvKeys[i].pt);
+        vIndices.push_back(i);
+      }
+    }
+    if (vPoints.empty())
+      continue;
+
+    const float scale = mvScaleFactors[level];
+    const int win = cvCeil(scale);
+    cv::cornerSubPix(image, vPoints, cv::Size(win, win), cv::Size(-1, -1), criteria);
+
+    for (size_t k = 0; k < vPoints.size(); k++) {
+      const int i = vIndices[k];
+      const cv::Point2f d = vPoints[k]-mvKeys[i].pt;
+
+      // Corner was lost at full resolution, keep the coarse position
+      if (d.x*d.x+d.y*d.y > scale*scale)
+        continue;
+
+      const cv::Point2f ptUn = UndistortPoint(vPoints[k]);
+      if (mvuRight[i] >= 0)
+        mvuRight[i] += ptUn.x-mvKeysUn[i].pt.x;
+
+      mvKeys[i].pt = vPoints[k];
+      mvKeysUn[i].pt = ptUn;
+      mFeatures.SetPosition(i, ptUn.x, ptUn.y);
+      mvbRefined[i] = true;
+      nRefined++;
+    }
+  }
+
+  return nRefined;
+}
+
+void Frame::ComputeUndistortMaps(const cv::Size &imSize) {
+  const int ncols = imSize.width;
+  const int nrows = imSize.height;
+
+  // Undistort every pixel once
+  cv::Mat mat(ncols*nrows, 2, CV_32F);
+  for (int y = 0; y < nrows; y++) {
+    for (int x = 0; x < ncols; x++) {
+      float* row = mat.ptr<float>(y*ncols+x);
+      row[0] = x;
+      row[1] = y;
+    }
   }
 
-  // Undistort points
   mat = mat.reshape(2);
   cv::Mat mK_cv = Converter::toCvMat(mK);
   cv::undistortPoints(mat, mat, mK_cv, mDistCoef, cv::Mat(), mK_cv);
   mat = mat.reshape(1);
 
-  // Fill undistorted keypoint vector
-  mvKeysUn.resize(N);
-  for (int i = 0; i < N; i++) {
-    cv::KeyPoint kp = mvKeys[i];
-    kp.pt.x = mat.at<float>(i, 0);
-    kp.pt.y = mat.at<float>(i, 1);
-    mvKeysUn[i] = kp;
+  mpCamera->mUndistortX.create(nrows, ncols, CV_32F);
+  mpCamera->mUndistortY.create(nrows, ncols, CV_32F);
+  for (int y = 0; y < nrows; y++) {
+    float* ux = mpCamera->mUndistortX.ptr<float>(y);
+    float* uy = mpCamera->mUndistortY.ptr<float>(y);
+    for (int x = 0; x < ncols; x++) {
+      const float* row = mat.ptr<float>(y*ncols+x);
+      ux[x] = row[0];
+      uy[x] = row[1];
+    }
   }
+
+  // Fixed point maps for images
+  cv::initUndistortRectifyMap(mK_cv, mDistCoef, cv::Mat(), mK_cv, imSize, CV_16SC2, mpCamera->mRemapMap1, mpCamera->mRemapMap2);
 }
 
-void Frame::ComputeImageBounds(const cv::Mat &imLeft) {
+void Frame::SetScalePyramid(const std::shared_ptr<const ScalePyramid> &pyramid) {
+  mpPyramid = pyramid;
+  mnScaleLevels = pyramid->nLevels;
+  mfScaleFactor = pyramid->fScaleFactor;
+  mfLogScaleFactor = pyramid->fLogScaleFactor;
+  mvScaleFactors = pyramid->vScaleFactors.data();
+  mvInvScaleFactors = pyramid->vInvScaleFactors.data();
+  mvLevelSigma2 = pyramid->vLevelSigma2.data();
+  mvInvLevelSigma2 = pyramid->vInvLevelSigma2.data();
+}
+
+void Frame::SetCameraParameters(const cv::Size &imSize) {
+  FrameCamera &camera = *mpCamera;
+
+  // This is done only for the first Frame of the camera
+  if (camera.mbInitialComputations) {
+    ComputeImageBounds(imSize);
+
+    camera.mfGridElementWidthInv = static_cast<float>(FRAME_GRID_COLS)/static_cast<float>(camera.mnMaxX-camera.mnMinX);
+    camera.mfGridElementHeightInv = static_cast<float>(FRAME_GRID_ROWS)/static_cast<float>(camera.mnMaxY-camera.mnMinY);
+
+    camera.fx = mK(0, 0);
+    camera.fy = mK(1, 1);
+    camera.cx = mK(0, 2);
+    camera.cy = mK(1, 2);
+    camera.invfx = 1.0f/camera.fx;
+    camera.invfy = 1.0f/camera.fy;
+
+    camera.mbInitialComputations = false;
+  }
+
+  fx = camera.fx;
+  fy = camera.fy;
+  cx = camera.cx;
+  cy = camera.cy;
+  invfx = camera.invfx;
+  invfy = camera.invfy;
+
+  mnMinX = camera.mnMinX;
+  mnMaxX = camera.mnMaxX;
+  mnMinY = camera.mnMinY;
+  mnMaxY = camera.mnMaxY;
+  mfGridElementWidthInv = camera.mfGridElementWidthInv;
+  mfGridElementHeightInv = camera.mfGridElementHeightInv;
+}
+
+void Frame::ComputeImageBounds(const cv::Size &imSize) {
   if (mDistCoef.at<float>(0) != 0.0) {
     cv::Mat mat(4, 2, CV_32F);
     mat.at<float>(0, 0) = 0.0;
     mat.at<float>(0, 1) = 0.0;
-    mat.at<float>(1, 0) = imLeft.cols;
+    mat.at<float>(1, 0) = imSize.width;
     mat.at<float>(1, 1) = 0.0;
     mat.at<float>(2, 0) = 0.0;
-    mat.at<float>(2, 1) = imLeft.rows;
-    mat.at<float>(3, 0) = imLeft.cols;
-    mat.at<float>(3, 1) = imLeft.rows;
+    mat.at<float>(2, 1) = imSize.height;
+    mat.at<float>(3, 0) = imSize.width;
+    mat.at<float>(3, 1) = imSize.height;
 
     // Undistort corners
     mat = mat.reshape(2);
@@ -383,22 +754,194 @@ void Frame::ComputeImageBounds(const cv::Mat &imLeft) {
     cv::undistortPoints(mat, mat, mK_cv, mDistCoef, cv::Mat(), mK_cv);
     mat = mat.reshape(1);
 
-    mnMinX = std::min(mat.at<float>(0, 0), mat.at<float>(2, 0));
-    mnMaxX = std::max(mat.at<float>(1, 0), mat.at<float>(3, 0));
-    mnMinY = std::min(mat.at<float>(0, 1), mat.at<float>(1, 1));
-    mnMaxY = std::max(mat.at<float>(2, 1), mat.at<float>(3, 1));
+    mpCamera->mnMinX = std::min(mat.at<float>(0, 0), mat.at<float>(2, 0));
+    mpCamera->mnMaxX = std::max(mat.at<float>(1, 0), mat.at<float>(3, 0));
+    mpCamera->mnMinY = std::min(mat.at<float>(0, 1), mat.at<float>(1, 1));
+    mpCamera->mnMaxY = std::max(mat.at<float>(2, 1), mat.at<float>(3, 1));
 
   } else {
-    mnMinX = 0.0f;
-    mnMaxX = imLeft.cols;
-    mnMinY = 0.0f;
-    mnMaxY = imLeft.rows;
+    mpCamera->mnMinX = 0.0f;
+    mpCamera->mnMaxX = imSize.width;
+    mpCamera->mnMinY = 0.0f;
+    mpCamera->mnMaxY = imSize.height;
+  }
+}
+
+// Sum of absolute differences between two windows of radius w, once their central intensities are equalized
+static int PatchSAD(const cv::Mat &imL, int uL, const cv::Mat &imR, int uR, int v, int w) {
+  const int offset = static_cast<int>(imL.at<uchar>(v, uL)) - static_cast<int>(imR.at<uchar>(v, uR));
+  const int size = 2*w+1;
+
+  int sad = 0;
+  for (int y = v-w; y <= v+w; y++) {
+    const uchar* pL = imL.ptr<uchar>(y)+uL-w;
+    const uchar* pR = imR.ptr<uchar>(y)+uR-w;
+    for (int x = 0; x < size; x++)
+      sad += abs(static_cast<int>(pL[x])-static_cast<int>(pR[x])-offset);
+  }
+
+  return sad;
+}
+
+void Frame::ComputeStereoMatches(const vector<cv::KeyPoint> &keysRight, const cv::Mat &descRight,
+                                 const vector<cv::Mat> &pyramidRight) {
+  ScopedSpan span(Statistics::STEREO_MATCHING);
+
+  mvuRight.assign(N, -1);
+  mvDepth.assign(N, -1);
+
+  if (keysRight.empty())
+    return;
+
+  const int thOrbDist = (ORBmatcher::TH_HIGH+ORBmatcher::TH_LOW)/2;
+
+  // Right keypoints sorted by row, a row band is a contiguous range
+  vector<int> vRightOrder(keysRight.size());
+  for (size_t i = 0; i < vRightOrder.size(); i++)
+    vRightOrder[i] = i;
+  std::sort(vRightOrder.begin(), vRightOrder.end(), [&keysRight](int a, int b) {
+    return keysRight[a].pt.y < keysRight[b].pt.y;
+  });
+
+  vector<float> vRightRows(vRightOrder.size());
+  for (size_t i = 0; i < vRightOrder.size(); i++)
+    vRightRows[i] = keysRight[vRightOrder[i]].pt.y;
+
+  // Right keypoints are searched in a band of 2 pixels (scaled by their octave) around each row
+  const float maxBand = 2.0f*mvScaleFactors[mnScaleLevels-1];
+
+  // Points closer than the baseline are not matched
+  const float minZ = mb;
+  const float minD = 0;
+  const float maxD = mbf/minZ;
+
+  // SAD window and search radius
+  const int w = 5;
+  const int L = 5;
+
+  vector<std::pair<int, int> > vDistIdx;
+  vDistIdx.reserve(N);
+
+  for (int iL = 0; iL < N; iL++) {
+    const cv::KeyPoint &kpL = mvKeys[iL];
+    const int &levelL = kpL.octave;
+    const float &vL = kpL.pt.y;
+    const float &uL = kpL.pt.x;
+
+    const float minU = uL-maxD;
+    const float maxU = uL-minD;
+
+    if (maxU < 0)
+      continue;
+
+    const uchar* dL = mDescriptors.ptr<uchar>(iL);
+
+    // Best descriptor match in the row band
+    int bestDist = ORBmatcher::TH_HIGH;
+    int bestIdxR = -1;
+
+    auto itBegin = std::lower_bound(vRightRows.begin(), vRightRows.end(), vL-maxBand);
+    auto itEnd = std::upper_bound(itBegin, vRightRows.end(), vL+maxBand);
+    for (auto it = itBegin; it != itEnd; ++it) {
+      const int iR = vRightOrder[it-vRightRows.begin()];
+      const cv::KeyPoint &kpR = keysRight[iR];
+
+      if (kpR.octave < levelL-1 || kpR.octave > levelL+1)
+        continue;
+
+      if (fabs(kpR.pt.y-vL) > 2.0f*mvScaleFactors[kpR.octave])
+        continue;
+
+      const float &uR = kpR.pt.x;
+      if (uR < minU || uR > maxU)
+        continue;
+
+      const int dist = ORBmatcher::DescriptorDistance(dL, descRight.ptr<uchar>(iR));
+      if (dist < bestDist) {
+        bestDist = dist;
+        bestIdxR = iR;
+      }
+    }
+
+    if (bestDist >= thOrbDist)
+      continue;
+
+    // Refine with SAD search at the octave of the left keypoint
+    const cv::Mat &imL = mvImagePyramid[levelL];
+    const cv::Mat &imR = pyramidRight[levelL];
+    const float invScale = mvInvScaleFactors[levelL];
+    const int scaleduL = round(uL*invScale);
+    const int scaledvL = round(vL*invScale);
+    const int scaleduR0 = round(keysRight[bestIdxR].pt.x*invScale);
+
+    if (scaledvL-w < 0 || scaledvL+w >= imL.rows || scaleduL-w < 0 || scaleduL+w >= imL.cols)
+      continue;
+    if (scaleduR0-L-w < 0 || scaleduR0+L+w >= imR.cols)
+      continue;
+
+    int bestSAD = std::numeric_limits<int>::max();
+    int bestincR = 0;
+    int vSAD[2*L+1];
+    for (int incR = -L; incR <= L; incR++) {
+      const int sad = PatchSAD(imL, scaleduL, imR, scaleduR0+incR, scaledvL, w);
+      vSAD[incR+L] = sad;
+      if (sad < bestSAD) {
+        bestSAD = sad;
+        bestincR = incR;
+      }
+    }
+
+    if (bestincR == -L || bestincR == L)
+      continue;
+
+    // Sub-pixel match with a parabola fit
+    const float dist1 = vSAD[L+bestincR-1];
+    const float dist2 = vSAD[L+bestincR];
+    const float dist3 = vSAD[L+bestincR+1];
+    const float den = 2.0f*(dist1+dist3-2.0f*dist2);
+    if (den <= 0)
+      continue;
+
+    const float deltaR = (dist1-dist3)/den;
+    if (deltaR < -1 || deltaR > 1)
+      continue;
+
+    // Re-scaled coordinate
+    float bestuR = mvScaleFactors[levelL]*(static_cast<float>(scaleduR0+bestincR)+deltaR);
+
+    float disparity = uL-bestuR;
+    if (disparity >= minD && disparity < maxD) {
+      if (disparity <= 0) {
+        disparity = 0.01;
+        bestuR = uL-0.01;
+      }
+      mvDepth[iL] = mbf/disparity;
+      mvuRight[iL] = bestuR;
+      vDistIdx.push_back(std::make_pair(bestSAD, iL));
+    }
+  }
+
+  if (vDistIdx.empty())
+    return;
+
+  // Discard matches whose SAD is far from the median
+  std::sort(vDistIdx.begin(), vDistIdx.end());
+  const float median = vDistIdx[vDistIdx.size()/2].first;
+  const float thDist = 1.5f*1.4f*median;
+
+  for (int i = vDistIdx.size()-1; i >= 0; i--) {
+    if (vDistIdx[i].first < thDist)
+      break;
+    mvuRight[vDistIdx[i].second] = -1;
+    mvDepth[vDistIdx[i].second] = -1;
   }
 }
 
 void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth) {
-  mvuRight = vector<float>(N, -1);
-  mvDepth = vector<float>(N, -1);
+  mvuRight.assign(N, -1);
+  mvDepth.assign(N, -1);
+
+  const bool raw16 = imDepth.type() == CV_16U;
 
   for (int i = 0; i < N; i++) {
     const cv::KeyPoint &kp = mvKeys[i];
@@ -407,7 +950,8 @@ void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth) {
     const float &v = kp.pt.y;
     const float &u = kp.pt.x;
 
-    const float d = imDepth.at<float>(v, u);
+    // Scale is applied only to the sampled values
+    const float d = (raw16 ? imDepth.at<uint16_t>(v, u) : imDepth.at<float>(v, u))*mfDepthScale;
 
     if (d > 0) {
       mvDepth[i] = d;
@@ -431,6 +975,11 @@ Eigen::Vector3d Frame::UnprojectStereo(const int &i) {
 }
 
 void Frame::Undistort(const cv::Mat& im, cv::Mat& im_out) {
+  if (mpCamera && !mpCamera->mRemapMap1.empty() && mpCamera->mRemapMap1.size() == im.size()) {
+    cv::remap(im, im_out, mpCamera->mRemapMap1, mpCamera->mRemapMap2, cv::INTER_LINEAR);
+    return;
+  }
+
   cv::Mat mK_cv = Converter::toCvMat(mK);
   cv::undistort(im, im_out, mK_cv, mDistCoef);
 }
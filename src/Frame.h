@@ -26,11 +26,18 @@
 #define SD_SLAM_FRAME_H
 
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Dense>
 #include "MapPoint.h"
 #include "KeyFrame.h"
 #include "ORBextractor.h"
+#include "CameraRig.h"
+#include "extra/feature_table.h"
+#include "extra/feature_grid.h"
+#include "extra/point_table.h"
+#include "extra/precision.h"
 
 namespace SD_SLAM {
 
@@ -40,21 +47,97 @@ namespace SD_SLAM {
 class MapPoint;
 class KeyFrame;
 
+// Per-frame vectors of a replaced frame, cleared but keeping their capacity
+struct FrameBuffers {
+  std::vector<cv::KeyPoint> mvKeys;
+  std::vector<cv::KeyPoint> mvKeysUn;
+  std::vector<float> mvuRight;
+  std::vector<float> mvDepth;
+  std::vector<MapPoint*> mvpMapPoints;
+  std::vector<bool> mvbOutlier;
+  std::vector<bool> mvbRefined;
+  FeatureTable mFeatures;
+  FeatureGrid mGrid;
+  std::vector<cv::Mat> mvImagePyramid;
+};
+
+// Main camera of a system. Image bounds, grid and undistortion tables are computed with its
+// first frame and frame ids are counted per camera, so several systems can run in one process.
+struct FrameCamera {
+  FrameCamera(): mbInitialComputations(true), mnNextFrameId(0) {
+    mvSpareBuffers.reserve(MAX_SPARE_BUFFERS);
+  }
+
+  bool mbInitialComputations;
+  float fx, fy, cx, cy, invfx, invfy;
+
+  // Undistorted image bounds and feature grid
+  float mnMinX, mnMaxX, mnMinY, mnMaxY;
+  float mfGridElementWidthInv, mfGridElementHeightInv;
+
+  // Undistortion lookup tables. Undistorted coordinates of every pixel,
+  // interpolated for keypoints, and fixed point maps to remap whole images.
+  cv::Mat mUndistortX;
+  cv::Mat mUndistortY;
+  cv::Mat mRemapMap1;
+  cv::Mat mRemapMap2;
+
+  long unsigned int mnNextFrameId;
+
+  // Small ring of buffers of replaced frames, taken by the next frames of the camera so steady
+  // tracking doesn't allocate them again. Image and descriptor buffers are reused by the extractor
+  static const size_t MAX_SPARE_BUFFERS = 2;
+  std::vector<FrameBuffers> mvSpareBuffers;
+  std::mutex mMutexSpareBuffers;
+};
+
 class Frame {
  public:
   Frame();
 
-  // Copy constructor.
+  // Copy constructor. Image pyramid, depth image and descriptors are shared, not copied.
   Frame(const Frame &frame);
 
-  // Constructor for RGB-D cameras.
-  Frame(const cv::Mat &imGray, const cv::Mat &imDepth, ORBextractor* extractor, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+  // Move constructor and assignments. Assignments reuse the memory of this frame: copies keep
+  // its vector capacity and moves hand its vectors to the camera for the next frame.
+  Frame(Frame &&frame);
+  Frame& operator=(const Frame &frame);
+  Frame& operator=(Frame &&frame);
+
+  // Constructor for RGB-D cameras. Depthmap buffer (CV_16U or CV_32F) is kept raw, not copied,
+  // and multiplied by depthScale when sampled. Float depth image is built by GetDepthImage().
+  // Image constructors extract features only where mask is not zero (see ORBextractor).
+  Frame(const cv::Mat &imGray, const cv::Mat &imDepth, float depthScale, ORBextractor* extractor,
+        FrameCamera* camera, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth,
+        const cv::Mat &mask = cv::Mat());
+
+  // Constructor for rectified stereo cameras. Right image features are extracted in parallel with
+  // the left ones and matched along the same row to get their disparity.
+  Frame(const cv::Mat &imLeft, const cv::Mat &imRight, ORBextractor* extractorLeft, ORBextractor* extractorRight,
+        FrameCamera* camera, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth,
+        const cv::Mat &mask = cv::Mat());
 
   // Constructor for Monocular cameras.
-  Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+  Frame(const cv::Mat &imGray, ORBextractor* extractor, FrameCamera* camera, const Eigen::Matrix3d &K, cv::Mat &distCoef,
+        const float &bf, const float &thDepth, const cv::Mat &mask = cv::Mat());
+
+  // Constructor for already extracted features (loaded maps). Image size is only used for the
+  // initial computations, pyramid and depth image can be empty.
+  Frame(std::vector<cv::KeyPoint> &&keys, std::vector<cv::KeyPoint> &&keysUn, std::vector<float> &&uRight,
+        std::vector<float> &&depth, const cv::Mat &descriptors, const std::vector<cv::Mat> &pyramid,
+        const cv::Mat &imDepth, const cv::Size &imSize, ORBextractor* extractor, FrameCamera* camera,
+        const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
+
+  // Extract ORB on the image, where mask is not zero
+  void ExtractORB(const cv::Mat &im, const cv::Mat &mask);
+
+  // Release buffers only needed to create keyframes: depthmap and pyramid levels 1 to level-1.
+  // Level 0 is kept for relocalization. What is left is a tracking-only frame: keypoints,
+  // descriptors, grid and the levels image alignment uses.
+  void ReleaseKeyFrameData(int level);
 
-  // Extract ORB on the image
-  void ExtractORB(const cv::Mat &im);
+  // Depth image in meters (CV_32F), converted from the raw depthmap on first call
+  const cv::Mat &GetDepthImage();
 
   // Set the camera pose.
   void SetPose(const Eigen::Matrix4d &Tcw);
@@ -86,14 +169,32 @@ class Frame {
   // and fill variables of the MapPoint to be used by the tracking
   bool isInFrustum(MapPoint* pMP, float viewingCosLimit);
 
+  // Same test for all points of a table at once. Points in view are appended to visible,
+  // MapPoint variables are not filled.
+  void isInFrustum(PointTable &points, float viewingCosLimit, std::vector<PointTable::Visible> &visible);
+
   // Compute the cell of a keypoint (return false if outside the grid)
   bool PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY);
 
   std::vector<size_t> GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel=-1, const int maxLevel=-1) const;
 
+  // Same as above, writing into vIndices (cleared first) so its memory can be reused
+  void GetFeaturesInArea(const float &x, const float &y, const float &r, std::vector<size_t> &vIndices,
+                         const int minLevel=-1, const int maxLevel=-1) const;
+
   // Associate a "right" coordinate to a keypoint if there is valid depth in the depthmap.
   void ComputeStereoFromRGBD(const cv::Mat &imDepth);
 
+  // Search a match for each left keypoint in the right image along its row. Best descriptor match is
+  // refined with a SAD search and a parabola fit. If there is a match, depth and "right" coordinate are stored.
+  void ComputeStereoMatches(const std::vector<cv::KeyPoint> &keysRight, const cv::Mat &descRight,
+                            const std::vector<cv::Mat> &pyramidRight);
+
+  // Move matched inlier keypoints detected above level 0 to the subpixel corner of the full
+  // resolution image, within their detection scale. They are marked in mvbRefined. Returns the
+  // number of keypoints refined
+  int RefineMatchedKeyPoints();
+
   // Backprojects a keypoint (if stereo/depth info available) into 3D world coordinates.
   Eigen::Vector3d UnprojectStereo(const int &i);
 
@@ -104,14 +205,17 @@ class Frame {
   // Feature extractor.
   ORBextractor* mpORBextractorLeft;
 
+  // Camera that took the frame, shared by all frames of a system
+  FrameCamera* mpCamera;
+
   // Calibration matrix and OpenCV distortion parameters.
   Eigen::Matrix3d mK;
-  static float fx;
-  static float fy;
-  static float cx;
-  static float cy;
-  static float invfx;
-  static float invfy;
+  float fx;
+  float fy;
+  float cx;
+  float cy;
+  float invfx;
+  float invfy;
   cv::Mat mDistCoef;
 
   // Stereo baseline multiplied by fx.
@@ -137,62 +241,100 @@ class Frame {
   std::vector<float> mvuRight;
   std::vector<float> mvDepth;
 
-  // ORB descriptor, each row associated to a keypoint.
+  // ORB descriptor, each row associated to a keypoint. Rows are contiguous and 32-byte aligned,
+  // the block is shared with copies of the frame and its keyframe.
   cv::Mat mDescriptors;
 
+  // Undistorted coordinates, octaves and descriptors in contiguous arrays, for matching.
+  FeatureTable mFeatures;
+
   // MapPoints associated to keypoints, NULL pointer if no association.
   std::vector<MapPoint*> mvpMapPoints;
 
   // Flag to identify outlier associations.
   std::vector<bool> mvbOutlier;
 
+  // Keypoints refined at level 0 (see RefineMatchedKeyPoints), measured with its sigma. Empty if none
+  std::vector<bool> mvbRefined;
+
   // Keypoints are assigned to cells in a grid to reduce matching complexity when projecting MapPoints.
-  static float mfGridElementWidthInv;
-  static float mfGridElementHeightInv;
-  std::vector<std::size_t> mGrid[FRAME_GRID_COLS][FRAME_GRID_ROWS];
+  float mfGridElementWidthInv;
+  float mfGridElementHeightInv;
+  FeatureGrid mGrid;
 
   // Camera pose.
   Eigen::Matrix4d mTcw;
   Eigen::Matrix4d mTwc;
 
-  // Current and Next Frame id.
-  static long unsigned int nNextId;
+  // Current Frame id, counted by its camera.
   long unsigned int mnId;
 
+  // Sensor timestamp (s) given for this frame, negative if none
+  double mTimeStamp;
+
   // Reference Keyframe.
   KeyFrame* mpReferenceKF;
 
-  // Scale pyramid info.
+  // Scale pyramid info, shared by all frames and keyframes of the extractor. Arrays point to it.
+  std::shared_ptr<const ScalePyramid> mpPyramid;
   int mnScaleLevels;
   float mfScaleFactor;
   float mfLogScaleFactor;
-  std::vector<float> mvScaleFactors;
-  std::vector<float> mvInvScaleFactors;
-  std::vector<float> mvLevelSigma2;
-  std::vector<float> mvInvLevelSigma2;
+  const float* mvScaleFactors;
+  const float* mvInvScaleFactors;
+  const float* mvLevelSigma2;
+  const float* mvInvLevelSigma2;
+
+  // Undistorted Image Bounds (computed once per camera).
+  float mnMinX;
+  float mnMaxX;
+  float mnMinY;
+  float mnMaxY;
+
+  // Image pyramid and depth. Buffers are shared between copies and must be treated as read-only.
+  std::vector<cv::Mat> mvImagePyramid;
+  cv::Mat mDepthImage;
 
-  // Undistorted Image Bounds (computed once).
-  static float mnMinX;
-  static float mnMaxX;
-  static float mnMinY;
-  static float mnMaxY;
+  // Raw RGB-D depthmap and its scale to meters, only sampled at keypoints
+  cv::Mat mRawDepth;
+  float mfDepthScale;
 
-  static bool mbInitialComputations;
+  // mRawDepth is the caller's buffer, only valid while the frame is tracked. It is copied
+  // if the frame becomes a keyframe and released afterwards (see ReleaseKeyFrameData)
+  bool mbBorrowedDepth;
 
-  // Image pyramid
-  std::vector<cv::Mat> mvImagePyramid;
-  cv::Mat mDepthImage;
+  // Features of the secondary cameras of a rig, empty if there is no rig
+  std::vector<RigView> mvRigViews;
 
  private:
   // Undistort keypoints given OpenCV distortion parameters.
   // Only for the RGB-D case.
   // (called in the constructor).
-  void UndistortKeyPoints();
+  void UndistortKeyPoints(const cv::Size &imSize);
+
+  // Undistorted coordinates of a pixel
+  cv::Point2f UndistortPoint(const cv::Point2f &pt) const;
 
   // Computes image bounds for the undistorted image (called in the constructor).
-  void ComputeImageBounds(const cv::Mat &imLeft);
+  void ComputeImageBounds(const cv::Size &imSize);
+
+  // Computes undistortion lookup tables for keypoints and images (called in the constructor).
+  void ComputeUndistortMaps(const cv::Size &imSize);
+
+  // Copy camera parameters, computing them first if this is the first frame of the camera
+  // (called in the constructor).
+  void SetCameraParameters(const cv::Size &imSize);
+
+  // Reference scale info of pyramid
+  void SetScalePyramid(const std::shared_ptr<const ScalePyramid> &pyramid);
+
+  // Take the vectors of a replaced frame of the camera, if any (called in the constructor).
+  void TakeBuffers();
 
-  // Assign keypoints to the grid for speed up feature matching (called in the constructor).
+  // Hand the vectors of this frame, which is being replaced, to its camera.
+  void RecycleBuffers();
+
+  // Assign keypoints to the grid and fill the feature table for speed up feature matching (called in the constructor).
   void AssignFeaturesToGrid();
 
   // Rotation, translation and camera center
@@ -201,6 +343,11 @@ class Frame {
   Eigen::Matrix3d mRwc;
   Eigen::Vector3d mOw;  //  == mtwc
 
+  // Same pose in tracking precision, used by frustum tests
+  TrackMatrix3 mRcwT;
+  TrackVector3 mtcwT;
+  TrackVector3 mOwT;
+
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
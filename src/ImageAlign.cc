@@ -18,34 +18,176 @@
  */
 
 #include "ImageAlign.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#include "Config.h"
 #include "extra/timer.h"
 #include "extra/log.h"
+#include "extra/lie.h"
 
 using std::vector;
 using std::endl;
-using std::set;
 
 namespace SD_SLAM {
 
+const int ImageAlign::MIN_LEVEL = 2;
+const int ImageAlign::MAX_POINTS = 300;
+
+std::mutex ImageAlign::cache_mutex_;
+std::deque<std::shared_ptr<const AlignReference> > ImageAlign::cache_;
+
+#if defined(__SSE4_1__)
+static inline __m128 Load4(const uint8_t *p) {
+  int32_t v;
+  memcpy(&v, p, 4);
+  return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline float32x4_t Load4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  uint16x8_t w = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(v)));
+  return vcvtq_f32_u32(vmovl_u16(vget_low_u16(w)));
+}
+#endif
+
+// Bilinear interpolation of n consecutive pixels, row0 and row1 point to the top-left pixels
+static inline void InterpolateRow(const uint8_t *row0, const uint8_t *row1, float w_tl, float w_tr,
+                                  float w_bl, float w_br, int n, float *out) {
+  int i = 0;
+#if defined(__SSE4_1__)
+  const __m128 tl = _mm_set1_ps(w_tl), tr = _mm_set1_ps(w_tr);
+  const __m128 bl = _mm_set1_ps(w_bl), br = _mm_set1_ps(w_br);
+  for (; i+4 <= n; i += 4) {
+    __m128 v = _mm_add_ps(_mm_mul_ps(tl, Load4(row0+i)), _mm_mul_ps(tr, Load4(row0+i+1)));
+    v = _mm_add_ps(v, _mm_add_ps(_mm_mul_ps(bl, Load4(row1+i)), _mm_mul_ps(br, Load4(row1+i+1))));
+    _mm_storeu_ps(out+i, v);
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; i+4 <= n; i += 4) {
+    float32x4_t v = vmulq_n_f32(Load4(row0+i), w_tl);
+    v = vmlaq_n_f32(v, Load4(row0+i+1), w_tr);
+    v = vmlaq_n_f32(v, Load4(row1+i), w_bl);
+    v = vmlaq_n_f32(v, Load4(row1+i+1), w_br);
+    vst1q_f32(out+i, v);
+  }
+#endif
+  for (; i < n; i++)
+    out[i] = w_tl*row0[i] + w_tr*row0[i+1] + w_bl*row1[i] + w_br*row1[i+1];
+}
+
 ImageAlign::ImageAlign() {
   stop_ = false;
   chi2_ = 1e10;
   error_ = 1e10;
   n_meas_ = 0;
 
-  patch_size_ = 4;
-  max_level_ = 4;
-  min_level_ = 2;
-  max_its_ = 30;
+  patch_size_ = Config::AlignPatchSize();
+  finest_level_ = std::max(Config::AlignMinLevel(), MIN_LEVEL);
+  max_level_ = std::max(Config::AlignMaxLevel(), finest_level_);
+  min_level_ = finest_level_;
+  last_level_ = max_level_;
+  max_its_ = Config::AlignIterations();
+  basin_ = Config::AlignBasin();
+  stop_residual_ = Config::AlignStopResidual();
+  converged_ = true;
+  min_drop_ = 0.01;
+  min_step_ = 1e-10;
+
+  H_ref_solved_ = false;
+  n_skipped_ = 0;
+  ref_kf_ = nullptr;
+  n_joint_ = 0;
+
+  // Workspaces for the largest alignment, so reused engines do not allocate
+  points_.reserve(MAX_POINTS);
+  workspace_ = NewReference();
+  interp_buffer_.reserve((patch_size_+2)*(patch_size_+2));
 }
 
 ImageAlign::~ImageAlign() {
 }
 
+void ImageAlign::Reset() {
+  stop_ = false;
+  chi2_ = 1e10;
+  error_ = 1e10;
+  n_meas_ = 0;
+  H_ref_solved_ = false;
+  n_skipped_ = 0;
+  points_.clear();
+  ref_.reset();
+  ref_kf_ = nullptr;
+  n_joint_ = 0;
+}
+
+bool ImageAlign::PrepareWorkspace() {
+  if (points_.empty()) {
+    LOGE("No points to track!");
+    return false;
+  }
+
+  return true;
+}
+
+std::shared_ptr<AlignReference> ImageAlign::NewReference() const {
+  // Aligned operator new, make_shared ignores it
+  std::shared_ptr<AlignReference> ref(new AlignReference());
+  const int patch_area = patch_size_*patch_size_;
+  ref->points.reserve(MAX_POINTS);
+  ref->visible.reserve(MAX_POINTS);
+  ref->hessians.reserve(MAX_POINTS);
+  ref->patches.reserve(MAX_POINTS*patch_area);
+  ref->jacobians.reserve(MAX_POINTS*patch_area*6);
+  return ref;
+}
+
+void ImageAlign::SetReference(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale, int level) {
+  ref_.reset();
+  H_ref_solved_ = false;
+
+  // Same keyframe, pose and points as an alignment done before
+  if (ref_kf_ && Config::AlignCacheSize() > 0) {
+    std::shared_ptr<const AlignReference> cached = ref_kf_->GetAlignReference(level);
+    if (cached && cached->pose == pose && cached->scale == scale && cached->patch_size == patch_size_ &&
+        cached->points == points_) {
+      ref_ = cached;
+      return;
+    }
+  }
+
+  // Workspace is not reused once a keyframe keeps it
+  if (workspace_.use_count() > 1)
+    workspace_ = NewReference();
+
+  PrecomputePatches(src, pose, scale, *workspace_);
+  ref_ = workspace_;
+
+  if (ref_kf_ && Config::AlignCacheSize() > 0) {
+    ref_kf_->SetAlignReference(level, ref_);
+    Retain(ref_);
+  }
+}
+
+void ImageAlign::Retain(const std::shared_ptr<const AlignReference> &ref) {
+  std::unique_lock<std::mutex> lock(cache_mutex_);
+  cache_.push_back(ref);
+  while (static_cast<int>(cache_.size()) > Config::AlignCacheSize())
+    cache_.pop_front();
+}
+
 bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
-  int size, patch_area, counter;
+  int counter;
   float scale;
-  int max_points = 300;
+  int max_points = MAX_POINTS;
 
   cam_fx_ = CurrentFrame.fx;
   cam_fy_ = CurrentFrame.fy;
@@ -59,38 +201,41 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
     return false;
   }
 
-  // Save valid points seen in last frame
-  counter = 0;
-  for (int i = 0; i<LastFrame.N && counter<max_points; i++) {
-    MapPoint* pMP = LastFrame.mvpMapPoints[i];
-    if (!pMP || LastFrame.mvbOutlier[i])
-      continue;
+  // Save valid points seen in last frame, spread over the image
+  Reset();
+  candidates_.clear();
+  for (int i = 0; i < LastFrame.N; i++) {
+    if (LastFrame.mvpMapPoints[i] && !LastFrame.mvbOutlier[i])
+      candidates_.push_back(i);
+  }
+  SortPoints(LastFrame.mvKeysUn, candidates_, LastFrame.mvImagePyramid[MIN_LEVEL],
+             LastFrame.mvInvScaleFactors[MIN_LEVEL], order_);
 
-    Eigen::Vector3d p = pMP->GetWorldPos();
-    points_.push_back(p);
+  counter = 0;
+  for (size_t k = 0; k < order_.size() && counter<max_points; k++) {
+    MapPoint* pMP = LastFrame.mvpMapPoints[order_[k]];
+    points_.push_back(pMP->GetWorldPos().cast<TrackScalar>());
     counter++;
   }
 
-  size = points_.size();
-  if (size == 0) {
-    LOGE("No points to track!");
+  if (!PrepareWorkspace())
     return false;
-  }
-
-  patch_area = patch_size_*patch_size_;
-  patch_cache_ = cv::Mat(size, patch_area, CV_32F);
-  visible_pts_.resize(size, false);
-  jacobian_cache_.resize(Eigen::NoChange, size*patch_area);
 
   // Initial displacement between frames.
   Eigen::Matrix4d current_se3 = CurrentFrame.GetPose() * LastFrame.GetPoseInverse();
   Eigen::Matrix4d last_pose = LastFrame.GetPose();
 
-  for (int level = max_level_; level >= min_level_; level--) {
-    jacobian_cache_.setZero();
+  // Small predicted motions do not need the coarsest levels
+  const int start_level = StartLevel(CurrentFrame, PredictedMotion(current_se3, last_pose));
 
+  for (int level = start_level; level >= min_level_; level--) {
     scale = CurrentFrame.mvInvScaleFactors[level];
-    Optimize(CurrentFrame.mvImagePyramid[level], LastFrame.mvImagePyramid[level], last_pose, current_se3, scale);
+    SetReference(LastFrame.mvImagePyramid[level], last_pose, scale, level);
+    Optimize(CurrentFrame.mvImagePyramid[level], last_pose, current_se3, scale);
+
+    last_level_ = level;
+    if (StopAtLevel(level))
+      break;
   }
 
   Eigen::Matrix4d pose = current_se3 * last_pose;
@@ -104,14 +249,22 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
 }
 
 bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
-  int size, patch_area, counter;
+  Eigen::Matrix4d pose = CurrentFrame.GetPose();
+  if (!ComputePose(CurrentFrame, LastKF, pose, fast))
+    return false;
+
+  CurrentFrame.SetPose(pose);
+  return true;
+}
+
+bool ImageAlign::ComputePose(const Frame &CurrentFrame, KeyFrame *LastKF, Eigen::Matrix4d &pose, bool fast) {
   float scale;
   int max_points;
 
   if (fast)
     max_points = 100;
   else
-    max_points = 300;
+    max_points = MAX_POINTS;
 
   cam_fx_ = CurrentFrame.fx;
   cam_fy_ = CurrentFrame.fy;
@@ -126,45 +279,34 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
   }
 
   // Save valid points seen in last keyframe
-  const set<MapPoint*> mappoints = LastKF->GetMapPoints();
-  counter = 0;
-  for (auto it = mappoints.begin(); it != mappoints.end() && counter<max_points; it++) {
-    MapPoint* pMP = *it;
-    Eigen::Vector3d p = pMP->GetWorldPos();
-    points_.push_back(p);
-    counter++;
-  }
+  Reset();
+  ref_kf_ = LastKF;
+  AddKeyFramePoints(LastKF, max_points);
 
-  size = points_.size();
-  if (size == 0) {
-    LOGE("No points to track!");
+  if (!PrepareWorkspace())
     return false;
-  }
-
-  patch_area = patch_size_*patch_size_;
-  patch_cache_ = cv::Mat(size, patch_area, CV_32F);
-  visible_pts_.resize(size, false);
-  jacobian_cache_.resize(Eigen::NoChange, size*patch_area);
 
   // Initial displacement between frames.
-  Eigen::Matrix4d current_se3 = CurrentFrame.GetPose() * LastKF->GetPoseInverse();
+  Eigen::Matrix4d current_se3 = pose * LastKF->GetPoseInverse();
   Eigen::Matrix4d last_pose = LastKF->GetPose();
 
   for (int level = max_level_; level >= min_level_; level--) {
-    jacobian_cache_.setZero();
-
     scale = CurrentFrame.mvInvScaleFactors[level];
-    Optimize(CurrentFrame.mvImagePyramid[level], LastKF->mvImagePyramid[level], last_pose, current_se3, scale);
+    SetReference(LastKF->mvImagePyramid[level], last_pose, scale, level);
+    Optimize(CurrentFrame.mvImagePyramid[level], last_pose, current_se3, scale);
 
     // High error in max level means frames are not close, skip other levels
     if (fast && error_ > 0.01) {
       error_ = 1e10;
       return false;
     }
+
+    last_level_ = level;
+    if (StopAtLevel(level))
+      break;
   }
 
-  Eigen::Matrix4d pose = current_se3 * last_pose;
-  CurrentFrame.SetPose(pose);
+  pose = current_se3 * last_pose;
 
   if (!fast) {
     total.Stop();
@@ -175,8 +317,100 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
   return true;
 }
 
+// Adjoint of pose for twists with translation first: pose*Exp(x)*pose^-1 = Exp(Adjoint(pose)*x)
+static Eigen::Matrix<double, 6, 6> Adjoint(const Eigen::Matrix4d &pose) {
+  const Eigen::Matrix3d R = pose.block<3, 3>(0, 0);
+  const Eigen::Vector3d t = pose.block<3, 1>(0, 3);
+  Eigen::Matrix<double, 6, 6> adj;
+  adj.block<3, 3>(0, 0) = R;
+  adj.block<3, 3>(0, 3) = Lie::Hat(t)*R;
+  adj.block<3, 3>(3, 0).setZero();
+  adj.block<3, 3>(3, 3) = R;
+  return adj;
+}
+
+void ImageAlign::SwapJoint(JointReference &jr) {
+  points_.swap(jr.points);
+  workspace_.swap(jr.workspace);
+  ref_.swap(jr.ref);
+  std::swap(ref_kf_, jr.kf);
+}
+
+bool ImageAlign::ComputePose(Frame &CurrentFrame, const vector<KeyFrame*> &vpKFs) {
+  if (vpKFs.size() == 1)
+    return ComputePose(CurrentFrame, vpKFs[0]);
+
+  float scale;
+
+  cam_fx_ = CurrentFrame.fx;
+  cam_fy_ = CurrentFrame.fy;
+  cam_cx_ = CurrentFrame.cx;
+  cam_cy_ = CurrentFrame.cy;
+
+  Timer total(true);
+
+  if (static_cast<int>(CurrentFrame.mvImagePyramid.size()) <= max_level_) {
+    LOGE("Not enough pyramid levels");
+    return false;
+  }
+
+  // Save valid points seen in every keyframe, the budget of one alignment is split among them
+  Reset();
+  const int max_points = std::max(MAX_POINTS/static_cast<int>(vpKFs.size()), 1);
+  if (joint_.size() < vpKFs.size())
+    joint_.resize(vpKFs.size());
+
+  for (KeyFrame* pKF : vpKFs) {
+    JointReference &jr = joint_[n_joint_];
+    if (!jr.workspace)
+      jr.workspace = NewReference();
+    jr.kf = pKF;
+    jr.pose = pKF->GetPose();
+    jr.adj = Adjoint(jr.pose);
+    jr.ref.reset();
+
+    SwapJoint(jr);
+    points_.clear();
+    AddKeyFramePoints(pKF, max_points);
+    const bool empty = points_.empty();
+    SwapJoint(jr);
+
+    if (!empty)
+      n_joint_++;
+  }
+
+  if (n_joint_ == 0) {
+    LOGE("No points to track!");
+    return false;
+  }
+
+  Eigen::Matrix4d pose = CurrentFrame.GetPose();
+
+  for (int level = max_level_; level >= min_level_; level--) {
+    scale = CurrentFrame.mvInvScaleFactors[level];
+    for (size_t i = 0; i < n_joint_; i++) {
+      JointReference &jr = joint_[i];
+      SwapJoint(jr);
+      SetReference(ref_kf_->mvImagePyramid[level], jr.pose, scale, level);
+      SwapJoint(jr);
+    }
+    OptimizeJoint(CurrentFrame.mvImagePyramid[level], pose, scale);
+
+    last_level_ = level;
+    if (StopAtLevel(level))
+      break;
+  }
+
+  CurrentFrame.SetPose(pose);
+
+  total.Stop();
+  LOGD("Align time with %d keyframes is %.2fms", static_cast<int>(n_joint_), total.GetMsTime());
+  LOGD("Aligned: [%.4f, %.4f, %.4f]", pose(0, 3), pose(1, 3), pose(2, 3));
+
+  return true;
+}
+
 bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
-  int size, patch_area, counter;
   float scale;
   int max_points = 100;
 
@@ -191,25 +425,12 @@ bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
   }
 
   // Save valid points seen in last keyframe
-  const set<MapPoint*> mappoints = LastKF->GetMapPoints();
-  counter = 0;
-  for (auto it = mappoints.begin(); it != mappoints.end() && counter<max_points; it++) {
-    MapPoint* pMP = *it;
-    Eigen::Vector3d p = pMP->GetWorldPos();
-    points_.push_back(p);
-    counter++;
-  }
+  Reset();
+  ref_kf_ = LastKF;
+  AddKeyFramePoints(LastKF, max_points);
 
-  size = points_.size();
-  if (size == 0) {
-    LOGE("No points to track!");
+  if (!PrepareWorkspace())
     return false;
-  }
-
-  patch_area = patch_size_*patch_size_;
-  patch_cache_ = cv::Mat(size, patch_area, CV_32F);
-  visible_pts_.resize(size, false);
-  jacobian_cache_.resize(Eigen::NoChange, size*patch_area);
 
   // Initial displacement between frames.
   Eigen::Matrix4d current_se3 = Eigen::Matrix4d::Identity();
@@ -217,10 +438,10 @@ bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
 
   // Only last level
   int level = max_level_;
-  jacobian_cache_.setZero();
 
   scale = 1.0/CurrentKF->mvScaleFactors[level];
-  Optimize(CurrentKF->mvImagePyramid[level], LastKF->mvImagePyramid[level], last_pose, current_se3, scale);
+  SetReference(LastKF->mvImagePyramid[level], last_pose, scale, level);
+  Optimize(CurrentKF->mvImagePyramid[level], last_pose, current_se3, scale);
 
   // High error in max level means frames are not close, skip other levels
   if (error_ > 0.03) {
@@ -231,25 +452,139 @@ bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
   return true;
 }
 
-void ImageAlign::Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose,
+double ImageAlign::PredictedMotion(const Eigen::Matrix4d &se3, const Eigen::Matrix4d &last_pose) const {
+  const Eigen::Matrix4d pose = se3 * last_pose;
+  const size_t step = std::max<size_t>(points_.size()/32, 1);
+
+  double sum = 0.0;
+  int n = 0;
+  for (size_t i = 0; i < points_.size(); i += step) {
+    const Eigen::Vector3d pw = points_[i].cast<double>();
+    const Eigen::Vector3d p0 = last_pose.block<3, 3>(0, 0)*pw + last_pose.block<3, 1>(0, 3);
+    const Eigen::Vector3d p1 = pose.block<3, 3>(0, 0)*pw + pose.block<3, 1>(0, 3);
+    if (p0(2) <= 0 || p1(2) <= 0)
+      continue;
+
+    const double du = cam_fx_*(p1(0)/p1(2) - p0(0)/p0(2));
+    const double dv = cam_fy_*(p1(1)/p1(2) - p0(1)/p0(2));
+    sum += std::sqrt(du*du + dv*dv);
+    n++;
+  }
+
+  // Unknown motion, start from the top
+  if (n == 0)
+    return 1e10;
+  return sum/n;
+}
+
+int ImageAlign::StartLevel(const Frame &F, double motion) const {
+  if (basin_ <= 0)
+    return max_level_;
+
+  int level = min_level_;
+  while (level < max_level_ && motion*F.mvInvScaleFactors[level] > basin_)
+    level++;
+
+  // Prediction was not enough last time, leave a wider margin
+  if (!converged_ && level < max_level_)
+    level++;
+
+  return level;
+}
+
+void ImageAlign::SortPoints(const vector<cv::KeyPoint> &keys, const vector<int> &candidates,
+                            const cv::Mat &image, float scale, vector<int> &order) {
+  struct Candidate {
+    int idx;
+    int cell;
+    int rank;     // Position in its cell
+    int score;
+  };
+
+  // Grid cells of the original image
+  const int GRID = 8;
+  const float cellWidth = image.empty() ? 1.0f : image.cols/scale/GRID;
+  const float cellHeight = image.empty() ? 1.0f : image.rows/scale/GRID;
+
+  thread_local vector<Candidate> vCandidates;
+  vCandidates.resize(candidates.size());
+
+  for (size_t i = 0; i < candidates.size(); i++) {
+    const cv::Point2f &pt = keys[candidates[i]].pt;
+    Candidate &c = vCandidates[i];
+    c.idx = candidates[i];
+    const int cx = std::min(std::max(static_cast<int>(pt.x/cellWidth), 0), GRID-1);
+    const int cy = std::min(std::max(static_cast<int>(pt.y/cellHeight), 0), GRID-1);
+    c.cell = cy*GRID+cx;
+
+    // Absolute gradient, patches without texture do not constrain the pose
+    c.score = 0;
+    if (!image.empty()) {
+      const int x = std::min(std::max(static_cast<int>(pt.x*scale+0.5f), 1), image.cols-2);
+      const int y = std::min(std::max(static_cast<int>(pt.y*scale+0.5f), 1), image.rows-2);
+      const uint8_t *row = image.ptr<uint8_t>(y);
+      c.score = std::abs(row[x+1]-row[x-1]) + std::abs(image.ptr<uint8_t>(y+1)[x]-image.ptr<uint8_t>(y-1)[x]);
+    }
+  }
+
+  // Rank points within their cell by gradient
+  std::sort(vCandidates.begin(), vCandidates.end(), [](const Candidate &a, const Candidate &b) {
+    return a.cell != b.cell ? a.cell < b.cell : a.score > b.score;
+  });
+  for (size_t i = 0; i < vCandidates.size(); i++)
+    vCandidates[i].rank = (i > 0 && vCandidates[i].cell == vCandidates[i-1].cell) ? vCandidates[i-1].rank+1 : 0;
+
+  // Best point of every cell, then second ones...
+  std::sort(vCandidates.begin(), vCandidates.end(), [](const Candidate &a, const Candidate &b) {
+    return a.rank != b.rank ? a.rank < b.rank : a.score > b.score;
+  });
+
+  order.resize(vCandidates.size());
+  for (size_t i = 0; i < vCandidates.size(); i++)
+    order[i] = vCandidates[i].idx;
+}
+
+void ImageAlign::AddKeyFramePoints(KeyFrame *pKF, int max_points) {
+  // Keypoints were ordered when the keyframe was created, some have no point yet
+  const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
+  int counter = 0;
+  for (size_t k = 0; k < pKF->mvAlignOrder.size() && counter<max_points; k++) {
+    MapPoint* pMP = vpMapPoints[pKF->mvAlignOrder[k]];
+    if (!pMP || pMP->isBad())
+      continue;
+
+    points_.push_back(pMP->GetWorldPos().cast<TrackScalar>());
+    counter++;
+  }
+}
+
+void ImageAlign::Optimize(const cv::Mat &src, const Eigen::Matrix4d &last_pose,
                           Eigen::Matrix4d &se3, float scale) {
   Eigen::Matrix<double, 6, 1>  x;
   Eigen::Matrix4d se3_bk = se3;
   bool small = false;
+  converged_ = false;
 
   // Perform iterative estimation
   for (int i = 0; i < max_its_; i++) {
-    H_.setZero();
     Jres_.setZero();
 
     // compute initial error
     n_meas_ = 0;
-    double new_chi2 = ComputeResiduals(src, last_img, last_pose, se3, scale, i == 0);
+    double new_chi2 = ComputeResiduals(src, se3 * last_pose, scale)/n_meas_;
     if (n_meas_ == 0)
       stop_ = true;
 
-    // Solve linear system
-    x = H_.ldlt().solve(Jres_);
+    // Solve linear system, reference factorization is reused while every point is found
+    if (n_skipped_ == 0) {
+      if (!H_ref_solved_) {
+        H_ref_ldlt_.compute(ref_->H);
+        H_ref_solved_ = true;
+      }
+      x = H_ref_ldlt_.solve(Jres_);
+    } else {
+      x = H_.ldlt().solve(Jres_);
+    }
     if (static_cast<bool>(std::isnan(static_cast<double>(x[0])))) {
       // Matrix was singular and could not be computed
       stop_ = true;
@@ -258,65 +593,135 @@ void ImageAlign::Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eig
     // Check if error increased since last iteration
     if ((i > 0 && new_chi2 > chi2_) || stop_) {
       se3 = se3_bk;  // rollback
+      converged_ = !stop_;
       break;
     }
 
     // If error didn't decreased too much, stop optimization
-    if (i > 0 && new_chi2 > chi2_*0.99)
+    if (i > 0 && new_chi2 > chi2_*(1.0-min_drop_))
       small = true;
 
     // Update se3
     se3_bk = se3;
-    se3 = se3 * Exp(-x);
+    se3 = se3 * Lie::ExpSE3<double>(-x);
+
+    chi2_ = new_chi2;
+
+    // Stop when converged
+    error_ = AbsMax(x);
+    if (error_ <= min_step_ || small) {
+      converged_ = true;
+      break;
+    }
+  }
+}
+
+void ImageAlign::OptimizeJoint(const cv::Mat &src, Eigen::Matrix4d &pose, float scale) {
+  Eigen::Matrix<double, 6, 1>  x;
+  Eigen::Matrix<double, 6, 6>  H;
+  Eigen::Matrix<double, 6, 1>  b;
+  Eigen::Matrix4d pose_bk = pose;
+  bool small = false;
+  converged_ = false;
+
+  // Perform iterative estimation
+  for (int i = 0; i < max_its_; i++) {
+    H.setZero();
+    b.setZero();
+
+    // Reference update x is Adjoint(ref pose)*dx, with dx the update of pose
+    n_meas_ = 0;
+    double chi2 = 0.0;
+    for (size_t k = 0; k < n_joint_; k++) {
+      JointReference &jr = joint_[k];
+      SwapJoint(jr);
+      Jres_.setZero();
+      chi2 += ComputeResiduals(src, pose, scale);
+      SwapJoint(jr);
+
+      H.noalias() += jr.adj.transpose()*H_*jr.adj;
+      b.noalias() += jr.adj.transpose()*Jres_;
+    }
+    if (n_meas_ == 0)
+      stop_ = true;
+    const double new_chi2 = chi2/n_meas_;
+
+    x = H.ldlt().solve(b);
+    if (static_cast<bool>(std::isnan(static_cast<double>(x[0])))) {
+      // Matrix was singular and could not be computed
+      stop_ = true;
+    }
+
+    // Check if error increased since last iteration
+    if ((i > 0 && new_chi2 > chi2_) || stop_) {
+      pose = pose_bk;  // rollback
+      converged_ = !stop_;
+      break;
+    }
+
+    // If error didn't decreased too much, stop optimization
+    if (i > 0 && new_chi2 > chi2_*(1.0-min_drop_))
+      small = true;
+
+    // Update pose
+    pose_bk = pose;
+    pose = pose * Lie::ExpSE3<double>(-x);
 
     chi2_ = new_chi2;
 
     // Stop when converged
     error_ = AbsMax(x);
-    if (error_ <= 1e-10 || small)
+    if (error_ <= min_step_ || small) {
+      converged_ = true;
       break;
+    }
   }
 }
 
-double ImageAlign::ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose,
-                                    const Eigen::Matrix4d &se3, float scale, bool patches) {
-  Eigen::Vector2d p2d;
+double ImageAlign::ComputeResiduals(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale) {
+  TrackVector2 p2d;
   int half_patch, patch_area, border;
 
   half_patch = patch_size_/2;
   patch_area = patch_size_*patch_size_;
   border = half_patch+1;
 
-  // Compute patches only the first time
-  if (patches)
-    PrecomputePatches(last_img, last_pose, scale);
-
-  Eigen::Matrix4d pose = se3 * last_pose;
-  Eigen::Matrix3d R = pose.block<3, 3>(0, 0);
-  Eigen::Vector3d T = pose.block<3, 1>(0, 3);
+  TransformPoints(pose);
 
   float chi2 = 0.0;
   size_t counter = 0;
-  vector<bool>::iterator vit = visible_pts_.begin();
+  const AlignReference &ref = *ref_;
+  vector<bool>::const_iterator vit = ref.visible.begin();
 
-  // Check each point detected in last image
-  for (auto it=points_.begin(); it != points_.end(); it++, counter++, vit++) {
-    Eigen::Vector3d p = *it;
+  // Remove from reference Hessian the points not found in current image
+  H_ = ref.H;
+  n_skipped_ = 0;
 
+  interp_buffer_.resize(patch_size_);
+  float* row_buf = interp_buffer_.data();
+
+  // Check each point detected in last image
+  for (auto it=points_cam_.begin(); it != points_cam_.end(); it++, counter++, vit++) {
     // check if point is within image
     if (!*vit)
       continue;
 
     // Project in current frame with candidate pose and check if it fits within image
-    if(!Project(R, T, p, p2d))
+    if(!Project(*it, p2d)) {
+      H_ -= ref.hessians[counter];
+      n_skipped_++;
       continue;
+    }
 
     const float u_cur = p2d(0)*scale;
     const float v_cur = p2d(1)*scale;
     const int u_last_i = floorf(u_cur);
     const int v_last_i = floorf(v_cur);
-    if (u_last_i < 0 || v_last_i < 0 || u_last_i-border < 0 || v_last_i-border < 0 || u_last_i+border >= src.cols || v_last_i+border >= src.rows)
+    if (u_last_i < 0 || v_last_i < 0 || u_last_i-border < 0 || v_last_i-border < 0 || u_last_i+border >= src.cols || v_last_i+border >= src.rows) {
+      H_ -= ref.hessians[counter];
+      n_skipped_++;
       continue;
+    }
 
     // compute bilateral interpolation weights for the current image
     const float subpix_u_cur = u_cur-u_last_i;
@@ -326,53 +731,70 @@ double ImageAlign::ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img,
     const float w_last_bl = (1.0-subpix_u_cur) * subpix_v_cur;
     const float w_last_br = subpix_u_cur * subpix_v_cur;
 
-    float* patch_cache_ptr = reinterpret_cast<float*>(patch_cache_.data) + patch_area*counter;
-    size_t pixel_counter = 0;  // is used to compute the index of the cached jacobian
+    const float* patch_cache_ptr = ref.patches.data() + patch_area*counter;
+    const float* jac_ptr = ref.jacobians.data() + counter*patch_area*6;
+    Eigen::Matrix<float, 6, 1> Jres = Eigen::Matrix<float, 6, 1>::Zero();
 
+    const int x0 = u_last_i-half_patch;
     for (int y=v_last_i-half_patch; y < v_last_i+half_patch; y++) {
-      const uint8_t* row_ptr = src.ptr<uint8_t>(y);
-      const uint8_t* row_next_ptr = src.ptr<uint8_t>(y+1);
-      for (int x=u_last_i-half_patch; x < u_last_i+half_patch; x++, pixel_counter++, patch_cache_ptr++) {
-        // compute residual
-        const float intensity_cur = w_last_tl*row_ptr[x] + w_last_tr*row_ptr[x+1] + w_last_bl*row_next_ptr[x] + w_last_br*row_next_ptr[x+1];
-        const float res = intensity_cur - (*patch_cache_ptr);
+      // Interpolate the whole patch row at once
+      InterpolateRow(src.ptr<uint8_t>(y)+x0, src.ptr<uint8_t>(y+1)+x0,
+                     w_last_tl, w_last_tr, w_last_bl, w_last_br, patch_size_, row_buf);
 
-        float weight = 1.0;
-        chi2 += res*res*weight;
+      for (int x = 0; x < patch_size_; x++, patch_cache_ptr++, jac_ptr += 6) {
+        // compute residual
+        const float res = row_buf[x] - (*patch_cache_ptr);
+        chi2 += res*res;
         n_meas_++;
 
-        // Compute Jacobian, weighted Hessian and weighted "steepest descend images" (times error)
-        const Eigen::Matrix<double, 6, 1> J = jacobian_cache_.col(counter*patch_area + pixel_counter);
-        H_.noalias() += J*J.transpose()*weight;
-        Jres_.noalias() -= J*res*weight;
+        // "Steepest descend images" (times error), Hessian is precomputed
+        Jres.noalias() -= Eigen::Map<const Eigen::Matrix<float, 6, 1> >(jac_ptr)*res;
       }
     }
+
+    Jres_ += Jres.cast<double>();
   }
 
-  return chi2/n_meas_;
+  return chi2;
 }
 
-void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale) {
-  Eigen::Vector2d p2d;
+void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale, AlignReference &ref) {
+  TrackVector2 p2d;
   int half_patch, patch_area, border;
 
   half_patch = patch_size_/2;
   patch_area = patch_size_*patch_size_;
   border = half_patch+1;
 
-  Eigen::Matrix3d R = pose.block<3, 3>(0, 0);
-  Eigen::Vector3d T = pose.block<3, 1>(0, 3);
+  TransformPoints(pose);
+
+  // Buffers keep their capacity between calls. Jacobians of points out of the image are not used
+  const size_t size = points_.size();
+  ref.pose = pose;
+  ref.points = points_;
+  ref.scale = scale;
+  ref.patch_size = patch_size_;
+  ref.patches.resize(size*patch_area);
+  ref.jacobians.resize(size*patch_area*6);
+  ref.visible.assign(size, false);
+  ref.hessians.resize(size);
+  ref.H.setZero();
 
   size_t counter = 0;
   Eigen::Matrix<double, 2, 6> frame_jac;
-  vector<bool>::iterator vit = visible_pts_.begin();
+  vector<bool>::iterator vit = ref.visible.begin();
+
+  const int grid = patch_size_+2;
+  interp_buffer_.resize(grid*grid);
+  float* grid_buf = interp_buffer_.data();
 
   // Check each point detected in last image
-  for (auto it=points_.begin(); it != points_.end(); it++, counter++, vit++) {
-    Eigen::Vector3d p = *it;
+  for (auto it=points_cam_.begin(); it != points_cam_.end(); it++, counter++, vit++) {
+    const TrackVector3 &xyz = *it;
+    *vit = false;
 
     // Project in last frame and check if it fits within image
-    if(!Project(R, T, p, p2d))
+    if(!Project(xyz, p2d))
       continue;
 
     const float u_ref = p2d(0)*scale;
@@ -384,8 +806,7 @@ void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &po
     *vit = true;
 
     // Evaluate projection jacobian
-    Eigen::Vector3d xyz = R*p+T;
-    Jacobian3DToPlane(xyz, &frame_jac);
+    Jacobian3DToPlane(xyz.cast<double>(), &frame_jac);
 
     // compute bilateral interpolation weights for reference image
     const float subpix_u_ref = u_ref-u_first_i;
@@ -394,42 +815,55 @@ void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &po
     const float w_first_tr = subpix_u_ref * (1.0-subpix_v_ref);
     const float w_first_bl = (1.0-subpix_u_ref) * subpix_v_ref;
     const float w_first_br = subpix_u_ref * subpix_v_ref;
-    size_t pixel_counter = 0;
-    float* cache_ptr = reinterpret_cast<float*>(patch_cache_.data) + patch_area*counter;
-
-    for (int y=v_first_i-half_patch; y < v_first_i+half_patch; y++) {
-      const uint8_t* row_ptr = src.ptr<uint8_t>(y);
-      const uint8_t* row_prev_ptr = src.ptr<uint8_t>(y-1);
-      const uint8_t* row_next_ptr = src.ptr<uint8_t>(y+1);
-      const uint8_t* row_next2_ptr = src.ptr<uint8_t>(y+2);
-      for (int x=u_first_i-half_patch; x < u_first_i+half_patch; x++, cache_ptr++, pixel_counter++) {
+    float* cache_ptr = ref.patches.data() + patch_area*counter;
+    float* jac_ptr = ref.jacobians.data() + counter*patch_area*6;
+
+    // Interpolate the patch with a one pixel border, needed by gradients
+    const int x0 = u_first_i-half_patch-1;
+    const int y0 = v_first_i-half_patch-1;
+    for (int y = 0; y < grid; y++)
+      InterpolateRow(src.ptr<uint8_t>(y0+y)+x0, src.ptr<uint8_t>(y0+y+1)+x0,
+                     w_first_tl, w_first_tr, w_first_bl, w_first_br, grid, grid_buf+y*grid);
+
+    for (int y = 1; y <= patch_size_; y++) {
+      const float* row = grid_buf+y*grid;
+      for (int x = 1; x <= patch_size_; x++, cache_ptr++, jac_ptr += 6) {
         // precompute interpolated reference patch color
-        *cache_ptr = w_first_tl*row_ptr[x] + w_first_tr*row_ptr[x+1] + w_first_bl*row_next_ptr[x] + w_first_br*row_next_ptr[x+1];
+        *cache_ptr = row[x];
 
         // we use the inverse compositional: thereby we can take the gradient always at the same position
         // get gradient of warped image (~gradient at warped position)
-        float dx = 0.5f * ((w_first_tl*row_ptr[x+1] + w_first_tr*row_ptr[x+2] + w_first_bl*row_next_ptr[x+1] + w_first_br*row_next_ptr[x+2])
-                          -(w_first_tl*row_ptr[x-1] + w_first_tr*row_ptr[x] + w_first_bl*row_next_ptr[x-1] + w_first_br*row_next_ptr[x]));
-        float dy = 0.5f * ((w_first_tl*row_next_ptr[x] + w_first_tr*row_next_ptr[x+1] + w_first_bl*row_next2_ptr[x] + w_first_br*row_next2_ptr[x+1])
-                          -(w_first_tl*row_prev_ptr[x] + w_first_tr*row_prev_ptr[x+1] + w_first_bl*row_ptr[x] + w_first_br*row_ptr[x+1]));
+        const float dx = 0.5f*(row[x+1]-row[x-1]);
+        const float dy = 0.5f*(row[x+grid]-row[x-grid]);
 
         // cache the jacobian
-        jacobian_cache_.col(counter*patch_area + pixel_counter) = (dx*frame_jac.row(0) + dy*frame_jac.row(1))*(cam_fx_*scale);
+        Eigen::Map<Eigen::Matrix<float, 6, 1> > J(jac_ptr);
+        J = ((dx*frame_jac.row(0) + dy*frame_jac.row(1))*(cam_fx_*scale)).transpose().cast<float>();
       }
     }
+
+    // Hessian of the patch, it does not change while iterating
+    Eigen::Matrix<double, 6, 6> &Hp = ref.hessians[counter];
+    const Eigen::Matrix<double, 6, Eigen::Dynamic> Jp =
+      Eigen::Map<const Eigen::Matrix<float, 6, Eigen::Dynamic> >(ref.jacobians.data() + counter*patch_area*6, 6, patch_area).cast<double>();
+    Hp.noalias() = Jp*Jp.transpose();
+    ref.H += Hp;
   }
 }
 
-bool ImageAlign::Project(const Eigen::Matrix3d &R, const Eigen::Vector3d &T,
-                         const Eigen::Vector3d &p, Eigen::Vector2d &res) {
-  Eigen::Vector3d x3Dc = R*p+T;
+void ImageAlign::TransformPoints(const Eigen::Matrix4d &pose) {
+  const TrackMatrix3 R = pose.block<3, 3>(0, 0).cast<TrackScalar>();
+  const TrackVector3 T = pose.block<3, 1>(0, 3).cast<TrackScalar>();
+  Lie::TransformPoints(R, T, points_, points_cam_);
+}
 
-  const double invzc = 1.0/x3Dc(2);
+bool ImageAlign::Project(const TrackVector3 &x3Dc, TrackVector2 &res) {
+  const TrackScalar invzc = 1/x3Dc(2);
   if (invzc < 0)
     return false;
 
-  res(0) = cam_fx_*x3Dc(0)*invzc+cam_cx_;
-  res(1) = cam_fy_*x3Dc(1)*invzc+cam_cy_;
+  res(0) = static_cast<TrackScalar>(cam_fx_)*x3Dc(0)*invzc+static_cast<TrackScalar>(cam_cx_);
+  res(1) = static_cast<TrackScalar>(cam_fy_)*x3Dc(1)*invzc+static_cast<TrackScalar>(cam_cy_);
   return true;
 }
 
@@ -470,58 +904,4 @@ double ImageAlign::AbsMax(const Eigen::VectorXd &v) {
   return max;
 }
 
-Eigen::Matrix4d ImageAlign::Exp(const Eigen::Matrix<double, 6, 1> &update) {
-  Eigen::Vector3d upsilon = update.head<3>();
-  Eigen::Vector3d omega = update.tail<3>();
-
-  double theta;
-  Eigen::Quaterniond q = RotationExp(omega, &theta);
-  Eigen::Matrix3d Omega = RotationHat(omega);
-  Eigen::Matrix3d Omega_sq = Omega*Omega;
-  Eigen::Matrix3d V;
-
-  if (theta < 1e-10) {
-    V = q.toRotationMatrix();
-    // Note: That is an accurate expansion!
-  } else {
-    double theta_sq = theta*theta;
-    V = (Eigen::Matrix3d::Identity()
-         + (1-cos(theta))/(theta_sq)*Omega
-         + (theta-sin(theta))/(theta_sq*theta)*Omega_sq);
-  }
-
-  Eigen::Vector3d t = V*upsilon;
-  Eigen::Matrix3d rot = q.toRotationMatrix();
-  Eigen::Matrix4d res = Eigen::Matrix4d::Identity();
-  res.block<3, 3>(0, 0) = rot;
-  res.block<3, 1>(0, 3) = t;
-  return res;
-}
-
-Eigen::Quaterniond ImageAlign::RotationExp(const Eigen::Vector3d &omega, double *theta) {
-  *theta = omega.norm();
-  double half_theta = 0.5*(*theta);
-
-  double imag_factor;
-  double real_factor = cos(half_theta);
-  if ((*theta) < 1e-10) {
-    double theta_sq = (*theta)*(*theta);
-    double theta_po4 = theta_sq*theta_sq;
-    imag_factor = 0.5-0.0208333*theta_sq+0.000260417*theta_po4;
-  } else {
-    double sin_half_theta = sin(half_theta);
-    imag_factor = sin_half_theta/(*theta);
-  }
-
-  return Eigen::Quaterniond(real_factor, imag_factor*omega.x(), imag_factor*omega.y(), imag_factor*omega.z());
-}
-
-Eigen::Matrix3d ImageAlign::RotationHat(const Eigen::Vector3d &v) {
-  Eigen::Matrix3d Omega;
-  Omega <<  0, -v(2),  v(1)
-      ,  v(2),     0, -v(0)
-      , -v(1),  v(0),     0;
-  return Omega;
-}
-
 }  // namespace SD_SLAM
@@ -22,11 +22,34 @@
 
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <Eigen/Dense>
 #include "Frame.h"
+#include "extra/precision.h"
 
 namespace SD_SLAM {
 
+// Reference side of an alignment at one pyramid level: patches, jacobians and Hessians of the
+// points seen from the reference pose. Keyframes keep the last ones computed against them, so
+// aligning again against a keyframe skips this while its pose and points do not change.
+struct AlignReference {
+  Eigen::Matrix4d pose;                 // Reference pose (Tcw)
+  std::vector<TrackVector3> points;     // World points, in alignment order
+  float scale;                          // Pyramid level scale
+  int patch_size;
+  std::vector<float> patches;           // patch_area floats per point
+  std::vector<float> jacobians;         // 6 floats per patch pixel, contiguous
+  std::vector<bool> visible;            // Point inside reference image
+  std::vector<Eigen::Matrix<double, 6, 6>, Eigen::aligned_allocator<Eigen::Matrix<double, 6, 6> > > hessians;
+  Eigen::Matrix<double, 6, 6> H;        // Hessian of all visible points
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+// Direct image alignment. Objects can be reused for any number of alignments, workspaces are
+// kept between calls so they do not allocate once they are big enough.
 class ImageAlign {
  public:
   ImageAlign();
@@ -38,25 +61,109 @@ class ImageAlign {
   // Compute pose between a frame and a keyframe. Used to track last keyframe and in relocalization (Tracking)
   bool ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast = false);
 
+  // Same, starting from pose (Tcw) and returning the result in it. Frame is not modified, so
+  // several keyframes can be evaluated in parallel
+  bool ComputePose(const Frame &CurrentFrame, KeyFrame *LastKF, Eigen::Matrix4d &pose, bool fast = false);
+
+  // Compute pose between a frame and several keyframes at once (e.g. reference keyframe and its
+  // best covisibles). Points of each keyframe are compared with its own image and all of them
+  // constrain the pose in a single Gauss Newton, so it converges even if one keyframe shares
+  // little with the frame. Keyframes share the points of a single alignment. Used to track
+  // reference keyframe (Tracking)
+  bool ComputePose(Frame &CurrentFrame, const std::vector<KeyFrame*> &vpKFs);
+
   // Compute pose between two keyframes. Used to detect loops (LoopClosing)
   bool ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF);
 
   inline double GetError() { return error_; }
 
+  // Mean squared intensity residual of last optimized level
+  inline double GetResidual() { return chi2_; }
+
+  // Only align at the coarsest pyramid level, kept for next calls
+  inline void SetCoarseOnly(bool coarse = true) { min_level_ = coarse ? max_level_ : finest_level_; }
+
+  // True if last alignment was refined down to the finest level
+  inline bool Refined() const { return last_level_ <= finest_level_; }
+
+  // Finest pyramid level that can be used in alignment (see Config::AlignMinLevel)
+  static const int MIN_LEVEL;
+
+  // Max points used, workspaces are preallocated for them
+  static const int MAX_POINTS;
+
+  // Order candidate keypoints for alignment: points are spread over a grid of cells, taking
+  // in turns the point with highest gradient left in every cell, so any prefix of the order
+  // covers the whole image. Gradient is measured in image, a pyramid level with given scale
+  // (level size / original size). Keypoint coordinates are undistorted (as projections)
+  static void SortPoints(const std::vector<cv::KeyPoint> &keys, const std::vector<int> &candidates,
+                         const cv::Mat &image, float scale, std::vector<int> &order);
+
  private:
-  // Optimize using Gauss Newton strategy
-  void Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose, Eigen::Matrix4d &se3, float scale);
+  // Keyframe of a joint alignment, swapped with the single reference state while it is used
+  struct JointReference {
+    KeyFrame* kf;
+    Eigen::Matrix4d pose;                           // Keyframe pose (Tcw)
+    Eigen::Matrix<double, 6, 6> adj;                // Adjoint of pose
+    std::vector<TrackVector3> points;
+    std::shared_ptr<AlignReference> workspace;
+    std::shared_ptr<const AlignReference> ref;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Optimize using inverse compositional Gauss Newton. The Hessian is built once per
+  // level from reference jacobians and only corrected for points leaving the image
+  void Optimize(const cv::Mat &src, const Eigen::Matrix4d &last_pose, Eigen::Matrix4d &se3, float scale);
+
+  // Same against every joint reference. Updates of each one are moved to the frame pose
+  // (Tcw) with its adjoint, so their normal equations are added up
+  void OptimizeJoint(const cv::Mat &src, Eigen::Matrix4d &pose, float scale);
 
-  // Compute residual and jacobians
-  double ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose,
-                          const Eigen::Matrix4d &se3, float scale, bool patches);
+  // Compute residuals of points_ from pose (Tcw) and Jres_, H_ is the reference Hessian minus
+  // non visible points. Returns the sum of squared residuals, n_meas_ is increased
+  double ComputeResiduals(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale);
 
-  // Compute patches within a pyramid level
-  void PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale);
+  // Exchange points, workspace, reference and keyframe of jr with the current ones
+  void SwapJoint(JointReference &jr);
 
-  // Project point in image
-  bool Project(const Eigen::Matrix3d &R, const Eigen::Vector3d &T,
-               const Eigen::Vector3d &p, Eigen::Vector2d &res);
+  // Clear state and points of previous alignment
+  void Reset();
+
+  // Add up to max_points valid points of keyframe, in its alignment order
+  void AddKeyFramePoints(KeyFrame *pKF, int max_points);
+
+  // Returns false if there are no points
+  bool PrepareWorkspace();
+
+  // Reference with workspaces sized for MAX_POINTS
+  std::shared_ptr<AlignReference> NewReference() const;
+
+  // Set ref_ for a pyramid level of reference image src, taken from ref_kf_ if it has it
+  void SetReference(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale, int level);
+
+  // Compute patches, jacobians and reference Hessian within a pyramid level
+  void PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale, AlignReference &ref);
+
+  // Keep a keyframe reference alive, dropping the oldest ones beyond Config::AlignCacheSize()
+  static void Retain(const std::shared_ptr<const AlignReference> &ref);
+
+  // Mean image motion (pixels) of points_ from last_pose to se3*last_pose
+  double PredictedMotion(const Eigen::Matrix4d &se3, const Eigen::Matrix4d &last_pose) const;
+
+  // First level of a frame to frame alignment with given predicted motion
+  int StartLevel(const Frame &F, double motion) const;
+
+  // Last level optimized is good enough, skip finer ones
+  inline bool StopAtLevel(int level) const {
+    return stop_residual_ > 0 && level > min_level_ && chi2_ < stop_residual_;
+  }
+
+  // Transform points_ to camera coordinates of pose, all at once
+  void TransformPoints(const Eigen::Matrix4d &pose);
+
+  // Project point in camera coordinates in image
+  bool Project(const TrackVector3 &pc, TrackVector2 &res);
 
   // Jacobian of 3D point projection in frame coordinates to unit plane coordinates
   void Jacobian3DToPlane(const Eigen::Vector3d &p, Eigen::Matrix<double, 2, 6> *J);
@@ -64,15 +171,17 @@ class ImageAlign {
   // Get absolute max value of a vector
   double AbsMax(const Eigen::VectorXd &v);
 
-  // Exponential vector
-  Eigen::Matrix4d Exp(const Eigen::Matrix<double, 6, 1> &update);
-  Eigen::Quaterniond RotationExp(const Eigen::Vector3d &omega, double *theta);
-  Eigen::Matrix3d RotationHat(const Eigen::Vector3d &v);
-
   int patch_size_;    // Patch size
   int min_level_;     // Min search level
   int max_level_;     // Max search level
+  int finest_level_;  // Min search level when not coarse only
+  int last_level_;    // Last level optimized
   int max_its_;       // Max align iterations
+  double basin_;      // Max predicted motion (pixels) at start level
+  double stop_residual_;  // Residual to stop at a coarser level
+  bool converged_;    // Last level optimized converged
+  double min_drop_;   // Min relative residual drop to keep iterating
+  double min_step_;   // Min update step to keep iterating
 
   double chi2_;
   size_t  n_meas_;    // Number of measurements
@@ -84,12 +193,28 @@ class ImageAlign {
   double cam_cx_;
   double cam_cy_;
 
-  cv::Mat patch_cache_;                 // Cache for patches
-  std::vector<bool> visible_pts_;       // Visible points
-  std::vector<Eigen::Vector3d> points_; // Valid points
+  std::vector<float> interp_buffer_;    // Interpolated pixels of a patch (with border)
+  std::vector<TrackVector3> points_;    // Valid points
+  std::vector<TrackVector3> points_cam_;  // points_ in camera coordinates of current pose
+  std::vector<int> candidates_;         // Last frame points to order with SortPoints
+  std::vector<int> order_;
   Eigen::Matrix<double, 6, 6>  H_;      // Hessian approximation
+  Eigen::LDLT<Eigen::Matrix<double, 6, 6> > H_ref_ldlt_;  // Factorization of ref_->H
+  bool H_ref_solved_;                   // H_ref_ldlt_ is up to date
+  size_t n_skipped_;                    // Visible points not found in last iteration
   Eigen::Matrix<double, 6, 1>  Jres_;   // Store Jacobian residual
-  Eigen::Matrix<double, 6, Eigen::Dynamic, Eigen::ColMajor> jacobian_cache_;
+
+  std::shared_ptr<AlignReference> workspace_;   // Computed references, reused while nobody else holds it
+  std::shared_ptr<const AlignReference> ref_;   // Reference of the level being optimized
+  KeyFrame* ref_kf_;                            // Reference keyframe, null for frames
+
+  // Keyframes of last joint alignment, entries beyond n_joint_ keep their buffers
+  std::vector<JointReference, Eigen::aligned_allocator<JointReference> > joint_;
+  size_t n_joint_;
+
+  // Last keyframe references computed, oldest first
+  static std::mutex cache_mutex_;
+  static std::deque<std::shared_ptr<const AlignReference> > cache_;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -24,9 +24,9 @@
 
 #include "Initializer.h"
 #include <thread>
+#include <algorithm>
 #include "Optimizer.h"
 #include "ORBmatcher.h"
-#include "Converter.h"
 #include "extra/utils.h"
 
 using std::vector;
@@ -34,7 +34,12 @@ using std::list;
 
 namespace SD_SLAM {
 
-Initializer::Initializer(const Frame &ReferenceFrame, float sigma, int iterations) {
+const int Initializer::RANSAC_BATCH = 25;
+
+Initializer::Initializer(const Frame &ReferenceFrame, float sigma, int iterations, ThreadPool* pool, int nThreads) {
+  mpThreadPool = pool;
+  mnThreads = nThreads;
+
   mK = ReferenceFrame.mK;
 
   mvKeys1 = ReferenceFrame.mvKeysUn;
@@ -93,14 +98,24 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
   // Launch threads to compute in parallel a fundamental matrix and a homography
   vector<bool> vbMatchesInliersH, vbMatchesInliersF;
   float SH, SF;
-  cv::Mat H, F;
-
-  std::thread threadH(&Initializer::FindHomography, this, std::ref(vbMatchesInliersH), std::ref(SH), std::ref(H));
-  std::thread threadF(&Initializer::FindFundamental, this, std::ref(vbMatchesInliersF), std::ref(SF), std::ref(F));
-
-  // Wait until both threads have finished
-  threadH.join();
-  threadF.join();
+  Eigen::Matrix3f H, F;
+
+  if (mpThreadPool) {
+    // Both searches share the pool with their own hypothesis batches
+    ParallelFor(2, [&](int i) {
+      if (i == 0)
+        FindHomography(vbMatchesInliersH, SH, H);
+      else
+        FindFundamental(vbMatchesInliersF, SF, F);
+    });
+  } else {
+    std::thread threadH(&Initializer::FindHomography, this, std::ref(vbMatchesInliersH), std::ref(SH), std::ref(H));
+    std::thread threadF(&Initializer::FindFundamental, this, std::ref(vbMatchesInliersF), std::ref(SF), std::ref(F));
+
+    // Wait until both threads have finished
+    threadH.join();
+    threadF.join();
+  }
 
   // Compute ratio of scores
   float RH = SH/(SH+SF);
@@ -115,197 +130,212 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
 }
 
 
-void Initializer::FindHomography(vector<bool> &vbMatchesInliers, float &score, cv::Mat &H21) {
+void Initializer::FindHomography(vector<bool> &vbMatchesInliers, float &score, Eigen::Matrix3f &H21) {
   // Number of putative matches
   const int N = mvMatches12.size();
 
   // Normalize coordinates
-  vector<cv::Point2f> vPn1, vPn2;
-  cv::Mat T1, T2;
+  vector<Eigen::Vector2f> vPn1, vPn2;
+  Eigen::Matrix3f T1, T2;
   Normalize(mvKeys1, vPn1, T1);
   Normalize(mvKeys2, vPn2, T2);
-  cv::Mat T2inv = T2.inv();
+  const Eigen::Matrix3f T2inv = T2.inverse();
 
-  // Best Results variables
-  score = 0.0;
-  vbMatchesInliers = vector<bool>(N, false);
-
-  // Iteration variables
-  vector<cv::Point2f> vPn1i(8);
-  vector<cv::Point2f> vPn2i(8);
-  cv::Mat H21i, H12i;
-  vector<bool> vbCurrentInliers(N, false);
-  float currentScore;
+  // Best results of each batch of iterations
+  const int nBatches = (mMaxIterations+RANSAC_BATCH-1)/RANSAC_BATCH;
+  vector<float> vScores(nBatches, 0.0);
+  vector<Eigen::Matrix3f> vH21(nBatches);
+  vector<vector<bool> > vvbInliers(nBatches);
 
   // Perform all RANSAC iterations and save the solution with highest score
-  for (int it = 0; it<mMaxIterations; it++) {
-    // Select a minimum set
-    for (size_t j = 0; j < 8; j++) {
-      int idx = mvSets[it][j];
-
-      vPn1i[j] = vPn1[mvMatches12[idx].first];
-      vPn2i[j] = vPn2[mvMatches12[idx].second];
+  ParallelFor(nBatches, [&](int b) {
+    Eigen::Vector2f vPn1i[8];
+    Eigen::Vector2f vPn2i[8];
+    vector<bool> vbCurrentInliers(N, false);
+
+    const int itEnd = std::min(mMaxIterations, (b+1)*RANSAC_BATCH);
+    for (int it = b*RANSAC_BATCH; it < itEnd; it++) {
+      // Select a minimum set
+      for (size_t j = 0; j < 8; j++) {
+        int idx = mvSets[it][j];
+
+        vPn1i[j] = vPn1[mvMatches12[idx].first];
+        vPn2i[j] = vPn2[mvMatches12[idx].second];
+      }
+
+      Eigen::Matrix3f H21i = T2inv*ComputeH21(vPn1i, vPn2i)*T1;
+      Eigen::Matrix3f H12i = H21i.inverse();
+
+      float currentScore = CheckHomography(H21i, H12i, vbCurrentInliers, mSigma);
+
+      if (currentScore>vScores[b]) {
+        vH21[b] = H21i;
+        vvbInliers[b] = vbCurrentInliers;
+        vScores[b] = currentScore;
+      }
     }
+  });
 
-    cv::Mat Hn = ComputeH21(vPn1i, vPn2i);
-    H21i = T2inv*Hn*T1;
-    H12i = H21i.inv();
-
-    currentScore = CheckHomography(H21i, H12i, vbCurrentInliers, mSigma);
-
-    if (currentScore>score) {
-      H21 = H21i.clone();
-      vbMatchesInliers = vbCurrentInliers;
-      score = currentScore;
+  // Reduce in iteration order, so ties are resolved as in a serial search
+  score = 0.0;
+  vbMatchesInliers = vector<bool>(N, false);
+  for (int b = 0; b < nBatches; b++) {
+    if (vScores[b]>score) {
+      H21 = vH21[b];
+      vbMatchesInliers = vvbInliers[b];
+      score = vScores[b];
     }
   }
 }
 
 
-void Initializer::FindFundamental(vector<bool> &vbMatchesInliers, float &score, cv::Mat &F21) {
+void Initializer::FindFundamental(vector<bool> &vbMatchesInliers, float &score, Eigen::Matrix3f &F21) {
   // Number of putative matches
-  const int N = vbMatchesInliers.size();
+  const int N = mvMatches12.size();
 
   // Normalize coordinates
-  vector<cv::Point2f> vPn1, vPn2;
-  cv::Mat T1, T2;
+  vector<Eigen::Vector2f> vPn1, vPn2;
+  Eigen::Matrix3f T1, T2;
   Normalize(mvKeys1, vPn1, T1);
   Normalize(mvKeys2, vPn2, T2);
-  cv::Mat T2t = T2.t();
+  const Eigen::Matrix3f T2t = T2.transpose();
 
-  // Best Results variables
-  score = 0.0;
-  vbMatchesInliers = vector<bool>(N, false);
-
-  // Iteration variables
-  vector<cv::Point2f> vPn1i(8);
-  vector<cv::Point2f> vPn2i(8);
-  cv::Mat F21i;
-  vector<bool> vbCurrentInliers(N, false);
-  float currentScore;
+  // Best results of each batch of iterations
+  const int nBatches = (mMaxIterations+RANSAC_BATCH-1)/RANSAC_BATCH;
+  vector<float> vScores(nBatches, 0.0);
+  vector<Eigen::Matrix3f> vF21(nBatches);
+  vector<vector<bool> > vvbInliers(nBatches);
 
   // Perform all RANSAC iterations and save the solution with highest score
-  for (int it = 0; it<mMaxIterations; it++) {
-    // Select a minimum set
-    for (int j = 0; j < 8; j++) {
-      int idx = mvSets[it][j];
-
-      vPn1i[j] = vPn1[mvMatches12[idx].first];
-      vPn2i[j] = vPn2[mvMatches12[idx].second];
+  ParallelFor(nBatches, [&](int b) {
+    Eigen::Vector2f vPn1i[8];
+    Eigen::Vector2f vPn2i[8];
+    vector<bool> vbCurrentInliers(N, false);
+
+    const int itEnd = std::min(mMaxIterations, (b+1)*RANSAC_BATCH);
+    for (int it = b*RANSAC_BATCH; it < itEnd; it++) {
+      // Select a minimum set
+      for (int j = 0; j < 8; j++) {
+        int idx = mvSets[it][j];
+
+        vPn1i[j] = vPn1[mvMatches12[idx].first];
+        vPn2i[j] = vPn2[mvMatches12[idx].second];
+      }
+
+      Eigen::Matrix3f F21i = T2t*ComputeF21(vPn1i, vPn2i)*T1;
+
+      float currentScore = CheckFundamental(F21i, vbCurrentInliers, mSigma);
+
+      if (currentScore>vScores[b]) {
+        vF21[b] = F21i;
+        vvbInliers[b] = vbCurrentInliers;
+        vScores[b] = currentScore;
+      }
     }
+  });
 
-    cv::Mat Fn = ComputeF21(vPn1i, vPn2i);
-
-    F21i = T2t*Fn*T1;
-
-    currentScore = CheckFundamental(F21i, vbCurrentInliers, mSigma);
-
-    if (currentScore>score) {
-      F21 = F21i.clone();
-      vbMatchesInliers = vbCurrentInliers;
-      score = currentScore;
+  // Reduce in iteration order, so ties are resolved as in a serial search
+  score = 0.0;
+  vbMatchesInliers = vector<bool>(N, false);
+  for (int b = 0; b < nBatches; b++) {
+    if (vScores[b]>score) {
+      F21 = vF21[b];
+      vbMatchesInliers = vvbInliers[b];
+      score = vScores[b];
     }
   }
 }
 
+void Initializer::ParallelFor(int n, const std::function<void(int)> &f) {
+  if (mpThreadPool) {
+    mpThreadPool->ParallelFor(n, f, mnThreads);
+  } else {
+    for (int i = 0; i < n; i++)
+      f(i);
+  }
+}
 
-cv::Mat Initializer::ComputeH21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2) {
-  const int N = vP1.size();
 
-  cv::Mat A(2*N, 9, CV_32F);
+Eigen::Matrix3f Initializer::ComputeH21(const Eigen::Vector2f *vP1, const Eigen::Vector2f *vP2) {
+  // Accumulate normal matrix of the 16x9 DLT system, two rows per point
+  Eigen::Matrix<double, 9, 9> AtA;
+  AtA.setZero();
 
-  for (int i = 0; i < N; i++) {
-    const float u1 = vP1[i].x;
-    const float v1 = vP1[i].y;
-    const float u2 = vP2[i].x;
-    const float v2 = vP2[i].y;
-
-    A.at<float>(2*i, 0) = 0.0;
-    A.at<float>(2*i, 1) = 0.0;
-    A.at<float>(2*i, 2) = 0.0;
-    A.at<float>(2*i, 3) = -u1;
-    A.at<float>(2*i, 4) = -v1;
-    A.at<float>(2*i, 5) = -1;
-    A.at<float>(2*i, 6) = v2*u1;
-    A.at<float>(2*i, 7) = v2*v1;
-    A.at<float>(2*i, 8) = v2;
-
-    A.at<float>(2*i+1, 0) = u1;
-    A.at<float>(2*i+1, 1) = v1;
-    A.at<float>(2*i+1, 2) = 1;
-    A.at<float>(2*i+1, 3) = 0.0;
-    A.at<float>(2*i+1, 4) = 0.0;
-    A.at<float>(2*i+1, 5) = 0.0;
-    A.at<float>(2*i+1, 6) = -u2*u1;
-    A.at<float>(2*i+1, 7) = -u2*v1;
-    A.at<float>(2*i+1, 8) = -u2;
+  for (int i = 0; i < 8; i++) {
+    const double u1 = vP1[i](0);
+    const double v1 = vP1[i](1);
+    const double u2 = vP2[i](0);
+    const double v2 = vP2[i](1);
 
-  }
+    Eigen::Matrix<double, 9, 1> r1, r2;
+    r1 << 0.0, 0.0, 0.0, -u1, -v1, -1.0, v2*u1, v2*v1, v2;
+    r2 << u1, v1, 1.0, 0.0, 0.0, 0.0, -u2*u1, -u2*v1, -u2;
 
-  cv::Mat u, w, vt;
+    AtA.selfadjointView<Eigen::Lower>().rankUpdate(r1);
+    AtA.selfadjointView<Eigen::Lower>().rankUpdate(r2);
+  }
 
-  cv::SVDecomp(A, w, u, vt, cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+  // Eigenvalues are sorted in increasing order
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 9, 9> > es(AtA);
+  const Eigen::Matrix<double, 9, 1> h = es.eigenvectors().col(0);
 
-  return vt.row(8).reshape(0, 3);
+  Eigen::Matrix3f H;
+  H << h(0), h(1), h(2), h(3), h(4), h(5), h(6), h(7), h(8);
+  return H;
 }
 
-cv::Mat Initializer::ComputeF21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2) {
-  const int N = vP1.size();
+Eigen::Matrix3f Initializer::ComputeF21(const Eigen::Vector2f *vP1, const Eigen::Vector2f *vP2) {
+  Eigen::Matrix<double, 9, 9> AtA;
+  AtA.setZero();
 
-  cv::Mat A(N, 9, CV_32F);
+  for (int i = 0; i < 8; i++) {
+    const double u1 = vP1[i](0);
+    const double v1 = vP1[i](1);
+    const double u2 = vP2[i](0);
+    const double v2 = vP2[i](1);
 
-  for (int i = 0; i < N; i++) {
-    const float u1 = vP1[i].x;
-    const float v1 = vP1[i].y;
-    const float u2 = vP2[i].x;
-    const float v2 = vP2[i].y;
-
-    A.at<float>(i, 0) = u2*u1;
-    A.at<float>(i, 1) = u2*v1;
-    A.at<float>(i, 2) = u2;
-    A.at<float>(i, 3) = v2*u1;
-    A.at<float>(i, 4) = v2*v1;
-    A.at<float>(i, 5) = v2;
-    A.at<float>(i, 6) = u1;
-    A.at<float>(i, 7) = v1;
-    A.at<float>(i, 8) = 1;
-  }
-
-  cv::Mat u, w, vt;
+    Eigen::Matrix<double, 9, 1> r;
+    r << u2*u1, u2*v1, u2, v2*u1, v2*v1, v2, u1, v1, 1.0;
 
-  cv::SVDecomp(A, w, u, vt, cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+    AtA.selfadjointView<Eigen::Lower>().rankUpdate(r);
+  }
 
-  cv::Mat Fpre = vt.row(8).reshape(0, 3);
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 9, 9> > es(AtA);
+  const Eigen::Matrix<double, 9, 1> f = es.eigenvectors().col(0);
 
-  cv::SVDecomp(Fpre, w, u, vt, cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+  Eigen::Matrix3d Fpre;
+  Fpre << f(0), f(1), f(2), f(3), f(4), f(5), f(6), f(7), f(8);
 
-  w.at<float>(2) = 0;
+  // Enforce rank 2
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(Fpre, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  Eigen::Vector3d w = svd.singularValues();
+  w(2) = 0;
 
-  return  u*cv::Mat::diag(w)*vt;
+  return (svd.matrixU()*w.asDiagonal()*svd.matrixV().transpose()).cast<float>();
 }
 
-float Initializer::CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers, float sigma) {
+float Initializer::CheckHomography(const Eigen::Matrix3f &H21, const Eigen::Matrix3f &H12, vector<bool> &vbMatchesInliers, float sigma) {
   const int N = mvMatches12.size();
 
-  const float h11 = H21.at<float>(0, 0);
-  const float h12 = H21.at<float>(0, 1);
-  const float h13 = H21.at<float>(0, 2);
-  const float h21 = H21.at<float>(1, 0);
-  const float h22 = H21.at<float>(1, 1);
-  const float h23 = H21.at<float>(1, 2);
-  const float h31 = H21.at<float>(2, 0);
-  const float h32 = H21.at<float>(2, 1);
-  const float h33 = H21.at<float>(2, 2);
-
-  const float h11inv = H12.at<float>(0, 0);
-  const float h12inv = H12.at<float>(0, 1);
-  const float h13inv = H12.at<float>(0, 2);
-  const float h21inv = H12.at<float>(1, 0);
-  const float h22inv = H12.at<float>(1, 1);
-  const float h23inv = H12.at<float>(1, 2);
-  const float h31inv = H12.at<float>(2, 0);
-  const float h32inv = H12.at<float>(2, 1);
-  const float h33inv = H12.at<float>(2, 2);
+  const float h11 = H21(0, 0);
+  const float h12 = H21(0, 1);
+  const float h13 = H21(0, 2);
+  const float h21 = H21(1, 0);
+  const float h22 = H21(1, 1);
+  const float h23 = H21(1, 2);
+  const float h31 = H21(2, 0);
+  const float h32 = H21(2, 1);
+  const float h33 = H21(2, 2);
+
+  const float h11inv = H12(0, 0);
+  const float h12inv = H12(0, 1);
+  const float h13inv = H12(0, 2);
+  const float h21inv = H12(1, 0);
+  const float h22inv = H12(1, 1);
+  const float h23inv = H12(1, 2);
+  const float h31inv = H12(2, 0);
+  const float h32inv = H12(2, 1);
+  const float h33inv = H12(2, 2);
 
   vbMatchesInliers.resize(N);
 
@@ -367,18 +397,18 @@ float Initializer::CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vecto
   return score;
 }
 
-float Initializer::CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma) {
+float Initializer::CheckFundamental(const Eigen::Matrix3f &F21, vector<bool> &vbMatchesInliers, float sigma) {
   const int N = mvMatches12.size();
 
-  const float f11 = F21.at<float>(0, 0);
-  const float f12 = F21.at<float>(0, 1);
-  const float f13 = F21.at<float>(0, 2);
-  const float f21 = F21.at<float>(1, 0);
-  const float f22 = F21.at<float>(1, 1);
-  const float f23 = F21.at<float>(1, 2);
-  const float f31 = F21.at<float>(2, 0);
-  const float f32 = F21.at<float>(2, 1);
-  const float f33 = F21.at<float>(2, 2);
+  const float f11 = F21(0, 0);
+  const float f12 = F21(0, 1);
+  const float f13 = F21(0, 2);
+  const float f21 = F21(1, 0);
+  const float f22 = F21(1, 1);
+  const float f23 = F21(1, 2);
+  const float f31 = F21(2, 0);
+  const float f32 = F21(2, 1);
+  const float f33 = F21(2, 2);
 
   vbMatchesInliers.resize(N);
 
@@ -445,7 +475,7 @@ float Initializer::CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesI
   return score;
 }
 
-bool Initializer::ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, const Eigen::Matrix3d &K,
+bool Initializer::ReconstructF(vector<bool> &vbMatchesInliers, const Eigen::Matrix3f &F21, const Eigen::Matrix3d &K,
               Eigen::Matrix3d &R21, Eigen::Vector3d &t21, vector<cv::Point3f> &vP3D, vector<bool> &vbTriangulated, float minParallax, int minTriangulated) {
   int N = 0;
   for (size_t i = 0, iend = vbMatchesInliers.size() ; i < iend; i++)
@@ -453,7 +483,7 @@ bool Initializer::ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, con
       N++;
 
   // Compute Essential Matrix from Fundamental Matrix
-  cv::Mat E21 = Converter::toCvMat(K).t()*F21*Converter::toCvMat(K);
+  Eigen::Matrix3d E21 = K.transpose()*F21.cast<double>()*K;
 
   Eigen::Matrix3d R1, R2;
   Eigen::Vector3d t;
@@ -464,15 +494,27 @@ bool Initializer::ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, con
   Eigen::Vector3d t1 = t;
   Eigen::Vector3d t2 = -t;
 
-  // Reconstruct with the 4 hyphoteses and check
+  // Reconstruct with the 4 hyphoteses and check, they are independent
   vector<cv::Point3f> vP3D1, vP3D2, vP3D3, vP3D4;
   vector<bool> vbTriangulated1, vbTriangulated2, vbTriangulated3, vbTriangulated4;
   float parallax1,parallax2, parallax3, parallax4;
-
-  int nGood1 = CheckRT(R1, t1, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D1, 4.0*mSigma2, vbTriangulated1, parallax1);
-  int nGood2 = CheckRT(R2, t1, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D2, 4.0*mSigma2, vbTriangulated2, parallax2);
-  int nGood3 = CheckRT(R1, t2, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D3, 4.0*mSigma2, vbTriangulated3, parallax3);
-  int nGood4 = CheckRT(R2, t2, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D4, 4.0*mSigma2, vbTriangulated4, parallax4);
+  int nGood1, nGood2, nGood3, nGood4;
+
+  ParallelFor(4, [&](int i) {
+    switch (i) {
+      case 0:
+        nGood1 = CheckRT(R1, t1, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D1, 4.0*mSigma2, vbTriangulated1, parallax1);
+        break;
+      case 1:
+        nGood2 = CheckRT(R2, t1, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D2, 4.0*mSigma2, vbTriangulated2, parallax2);
+        break;
+      case 2:
+        nGood3 = CheckRT(R1, t2, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D3, 4.0*mSigma2, vbTriangulated3, parallax3);
+        break;
+      default:
+        nGood4 = CheckRT(R2, t2, mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3D4, 4.0*mSigma2, vbTriangulated4, parallax4);
+    }
+  });
 
   int maxGood = std::max(nGood1, std::max(nGood2, std::max(nGood3,nGood4)));
   int nMinGood = std::max(static_cast<int>(0.9*N), minTriangulated);
@@ -534,7 +576,7 @@ bool Initializer::ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, con
   return false;
 }
 
-bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, const Eigen::Matrix3d &K,
+bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, const Eigen::Matrix3f &H21, const Eigen::Matrix3d &K,
             Eigen::Matrix3d &R21, Eigen::Vector3d &t21, vector<cv::Point3f> &vP3D, vector<bool> &vbTriangulated, float minParallax, int minTriangulated) {
   int N = 0;
   for (size_t i = 0, iend = vbMatchesInliers.size() ; i < iend; i++)
@@ -545,18 +587,18 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
   // Motion and structure from motion in a piecewise planar environment.
   // International Journal of Pattern Recognition and Artificial Intelligence, 1988
 
-  cv::Mat invK = Converter::toCvMat(K).inv();
-  cv::Mat A = invK*H21*Converter::toCvMat(K);
+  Eigen::Matrix3d A = K.inverse()*H21.cast<double>()*K;
 
-  cv::Mat U, w,Vt,V;
-  cv::SVD::compute(A, w,U,Vt, cv::SVD::FULL_UV);
-  V=Vt.t();
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(A, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix3d &U = svd.matrixU();
+  const Eigen::Matrix3d &V = svd.matrixV();
+  const Eigen::Matrix3d Vt = V.transpose();
 
-  float s = cv::determinant(U)*cv::determinant(Vt);
+  float s = U.determinant()*Vt.determinant();
 
-  float d1 = w.at<float>(0);
-  float d2 = w.at<float>(1);
-  float d3 = w.at<float>(2);
+  float d1 = svd.singularValues()(0);
+  float d2 = svd.singularValues()(1);
+  float d3 = svd.singularValues()(2);
 
   if (d1/d2<1.00001 || d2/d3<1.00001) {
     return false;
@@ -588,7 +630,7 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
     Rp(2, 0) = stheta[i];
     Rp(2, 2)=ctheta;
 
-    Eigen::Matrix3d R = s*Converter::toMatrix3d(U)*Rp*Converter::toMatrix3d(Vt);
+    Eigen::Matrix3d R = s*U*Rp*Vt;
     vR.push_back(R);
 
     Eigen::Vector3d tp;
@@ -597,7 +639,7 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
     tp(2)=-x3[i];
     tp*=d1-d3;
 
-    Eigen::Vector3d t = Converter::toMatrix3d(U)*tp;
+    Eigen::Vector3d t = U*tp;
     vt.push_back(t/t.norm());
 
     Eigen::Vector3d np;
@@ -605,7 +647,7 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
     np(1) = 0;
     np(2)=x3[i];
 
-    Eigen::Vector3d n = Converter::toMatrix3d(V)*np;
+    Eigen::Vector3d n = V*np;
     if (n(2) < 0)
       n=-n;
     vn.push_back(n);
@@ -626,16 +668,16 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
     Rp(2, 0) = sphi[i];
     Rp(2, 2)=-cphi;
 
-    Eigen::Matrix3d R = s*Converter::toMatrix3d(U)*Rp*Converter::toMatrix3d(Vt);
+    Eigen::Matrix3d R = s*U*Rp*Vt;
     vR.push_back(R);
 
-    Eigen::Vector3d tp(3, 1, CV_32F);
+    Eigen::Vector3d tp;
     tp(0)=x1[i];
     tp(1) = 0;
     tp(2)=x3[i];
     tp*=d1+d3;
 
-    Eigen::Vector3d t = Converter::toMatrix3d(U)*tp;
+    Eigen::Vector3d t = U*tp;
     vt.push_back(t/t.norm());
 
     Eigen::Vector3d np;
@@ -643,35 +685,39 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
     np(1) = 0;
     np(2)=x3[i];
 
-    Eigen::Vector3d n = Converter::toMatrix3d(V)*np;
+    Eigen::Vector3d n = V*np;
     if (n(2) < 0)
       n=-n;
     vn.push_back(n);
   }
 
 
+  // Instead of applying the visibility constraints proposed in the Faugeras' paper (which could fail for points seen with low parallax)
+  // We reconstruct all hypotheses and check in terms of triangulated points and parallax.
+  // Hypotheses are independent, they are checked concurrently and compared in order
+  vector<vector<cv::Point3f> > vvP3D(8);
+  vector<vector<bool> > vvbTriangulated(8);
+  vector<float> vParallax(8);
+  vector<int> vGood(8);
+
+  ParallelFor(8, [&](int i) {
+    vGood[i] = CheckRT(vR[i], vt[i], mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vvP3D[i], 4.0*mSigma2,
+                       vvbTriangulated[i], vParallax[i]);
+  });
+
   int bestGood = 0;
   int secondBestGood = 0;
   int bestSolutionIdx = -1;
   float bestParallax = -1;
-  vector<cv::Point3f> bestP3D;
-  vector<bool> bestTriangulated;
 
-  // Instead of applying the visibility constraints proposed in the Faugeras' paper (which could fail for points seen with low parallax)
-  // We reconstruct all hypotheses and check in terms of triangulated points and parallax
   for (size_t i = 0; i<8; i++) {
-    float parallaxi;
-    vector<cv::Point3f> vP3Di;
-    vector<bool> vbTriangulatedi;
-    int nGood = CheckRT(vR[i], vt[i], mvKeys1, mvKeys2, mvMatches12, vbMatchesInliers, K, vP3Di, 4.0*mSigma2, vbTriangulatedi, parallaxi);
+    int nGood = vGood[i];
 
     if (nGood>bestGood) {
       secondBestGood = bestGood;
       bestGood = nGood;
       bestSolutionIdx = i;
-      bestParallax = parallaxi;
-      bestP3D = vP3Di;
-      bestTriangulated = vbTriangulatedi;
+      bestParallax = vParallax[i];
     } else if (nGood>secondBestGood) {
       secondBestGood = nGood;
     }
@@ -680,8 +726,8 @@ bool Initializer::ReconstructH(vector<bool> &vbMatchesInliers, cv::Mat &H21, con
   if (secondBestGood < 0.75*bestGood && bestParallax >= minParallax && bestGood>minTriangulated && bestGood > 0.9*N) {
     R21 = vR[bestSolutionIdx];
     t21 = vt[bestSolutionIdx];
-    vP3D = bestP3D;
-    vbTriangulated = bestTriangulated;
+    vP3D.swap(vvP3D[bestSolutionIdx]);
+    vbTriangulated.swap(vvbTriangulated[bestSolutionIdx]);
 
     return true;
   }
@@ -697,14 +743,12 @@ void Initializer::Triangulate(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2,
   A.row(2) = kp2.pt.x*P2.row(2)-P2.row(0);
   A.row(3) = kp2.pt.y*P2.row(2)-P2.row(1);
 
-  cv::Mat u, w, vt;
-  cv::SVD::compute(Converter::toCvMat(A), w, u, vt, cv::SVD::MODIFY_A| cv::SVD::FULL_UV);
-  cv::Mat x3D_cv = vt.row(3).t();
-  x3D_cv = x3D_cv.rowRange(0, 3)/x3D_cv.at<float>(3);
-  x3D = Converter::toVector3d(x3D_cv);
+  Eigen::JacobiSVD<Eigen::Matrix4d> svd(A, Eigen::ComputeFullV);
+  const Eigen::Vector4d x = svd.matrixV().col(3);
+  x3D = x.head<3>()/x(3);
 }
 
-void Initializer::Normalize(const vector<cv::KeyPoint> &vKeys, vector<cv::Point2f> &vNormalizedPoints, cv::Mat &T) {
+void Initializer::Normalize(const vector<cv::KeyPoint> &vKeys, vector<Eigen::Vector2f> &vNormalizedPoints, Eigen::Matrix3f &T) {
   float meanX = 0;
   float meanY = 0;
   const int N = vKeys.size();
@@ -723,11 +767,11 @@ void Initializer::Normalize(const vector<cv::KeyPoint> &vKeys, vector<cv::Point2
   float meanDevY = 0;
 
   for (int i = 0; i < N; i++) {
-    vNormalizedPoints[i].x = vKeys[i].pt.x - meanX;
-    vNormalizedPoints[i].y = vKeys[i].pt.y - meanY;
+    vNormalizedPoints[i](0) = vKeys[i].pt.x - meanX;
+    vNormalizedPoints[i](1) = vKeys[i].pt.y - meanY;
 
-    meanDevX += fabs(vNormalizedPoints[i].x);
-    meanDevY += fabs(vNormalizedPoints[i].y);
+    meanDevX += fabs(vNormalizedPoints[i](0));
+    meanDevY += fabs(vNormalizedPoints[i](1));
   }
 
   meanDevX = meanDevX/N;
@@ -737,15 +781,15 @@ void Initializer::Normalize(const vector<cv::KeyPoint> &vKeys, vector<cv::Point2
   float sY = 1.0/meanDevY;
 
   for (int i = 0; i < N; i++) {
-    vNormalizedPoints[i].x = vNormalizedPoints[i].x * sX;
-    vNormalizedPoints[i].y = vNormalizedPoints[i].y * sY;
+    vNormalizedPoints[i](0) = vNormalizedPoints[i](0) * sX;
+    vNormalizedPoints[i](1) = vNormalizedPoints[i](1) * sY;
   }
 
-  T = cv::Mat::eye(3, 3, CV_32F);
-  T.at<float>(0, 0) = sX;
-  T.at<float>(1, 1) = sY;
-  T.at<float>(0, 2) = -meanX*sX;
-  T.at<float>(1, 2) = -meanY*sY;
+  T.setIdentity();
+  T(0, 0) = sX;
+  T(1, 1) = sY;
+  T(0, 2) = -meanX*sX;
+  T(1, 2) = -meanY*sY;
 }
 
 
@@ -857,11 +901,12 @@ int Initializer::CheckRT(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, con
   return nGood;
 }
 
-void Initializer::DecomposeE(const cv::Mat &E, Eigen::Matrix3d &R1, Eigen::Matrix3d &R2, Eigen::Vector3d &t) {
-  cv::Mat u, w, vt;
-  cv::SVD::compute(E, w, u, vt);
+void Initializer::DecomposeE(const Eigen::Matrix3d &E, Eigen::Matrix3d &R1, Eigen::Matrix3d &R2, Eigen::Vector3d &t) {
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix3d &u = svd.matrixU();
+  const Eigen::Matrix3d vt = svd.matrixV().transpose();
 
-  t = Converter::toVector3d(u.col(2));
+  t = u.col(2);
   t=t/t.norm();
 
   Eigen::Matrix3d W;
@@ -870,11 +915,11 @@ void Initializer::DecomposeE(const cv::Mat &E, Eigen::Matrix3d &R1, Eigen::Matri
   W(1, 0)=1;
   W(2, 2)=1;
 
-  R1 = Converter::toMatrix3d(u)*W*Converter::toMatrix3d(vt);
+  R1 = u*W*vt;
   if (R1.determinant() < 0)
     R1=-R1;
 
-  R2 = Converter::toMatrix3d(u)*W.transpose()*Converter::toMatrix3d(vt);
+  R2 = u*W.transpose()*vt;
   if (R2.determinant() < 0)
     R2=-R2;
 }
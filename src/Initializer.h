@@ -25,9 +25,11 @@
 #ifndef SD_SLAM_INITIALIZER_H
 #define SD_SLAM_INITIALIZER_H
 
+#include <functional>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Dense>
 #include "Frame.h"
+#include "extra/thread_pool.h"
 
 namespace SD_SLAM {
 
@@ -37,7 +39,10 @@ class Initializer {
 
  public:
   // Fix the reference frame
-  Initializer(const Frame &ReferenceFrame, float sigma = 1.0, int iterations = 200);
+  // If a thread pool is given, RANSAC hypotheses are evaluated in parallel batches using up to
+  // nThreads of its threads. Results are identical to the serial path.
+  Initializer(const Frame &ReferenceFrame, float sigma = 1.0, int iterations = 200, ThreadPool* pool = nullptr,
+              int nThreads = 0);
 
   // Computes in parallel a fundamental matrix and a homography
   // Selects a model and tries to recover the motion and the structure from motion
@@ -45,31 +50,36 @@ class Initializer {
           Eigen::Matrix3d &R21, Eigen::Vector3d &t21, std::vector<cv::Point3f> &vP3D, std::vector<bool> &vbTriangulated);
 
  private:
-  void FindHomography(std::vector<bool> &vbMatchesInliers, float &score, cv::Mat &H21);
-  void FindFundamental(std::vector<bool> &vbInliers, float &score, cv::Mat &F21);
+  void FindHomography(std::vector<bool> &vbMatchesInliers, float &score, Eigen::Matrix3f &H21);
+  void FindFundamental(std::vector<bool> &vbInliers, float &score, Eigen::Matrix3f &F21);
 
-  cv::Mat ComputeH21(const std::vector<cv::Point2f> &vP1, const std::vector<cv::Point2f> &vP2);
-  cv::Mat ComputeF21(const std::vector<cv::Point2f> &vP1, const std::vector<cv::Point2f> &vP2);
+  // Minimal solvers on the 8 normalized points of a hypothesis, with fixed size types only.
+  // The null vector of the DLT system is the eigenvector of its 9x9 normal matrix with smallest eigenvalue
+  Eigen::Matrix3f ComputeH21(const Eigen::Vector2f *vP1, const Eigen::Vector2f *vP2);
+  Eigen::Matrix3f ComputeF21(const Eigen::Vector2f *vP1, const Eigen::Vector2f *vP2);
 
-  float CheckHomography(const cv::Mat &H21, const cv::Mat &H12, std::vector<bool> &vbMatchesInliers, float sigma);
+  float CheckHomography(const Eigen::Matrix3f &H21, const Eigen::Matrix3f &H12, std::vector<bool> &vbMatchesInliers, float sigma);
 
-  float CheckFundamental(const cv::Mat &F21, std::vector<bool> &vbMatchesInliers, float sigma);
+  float CheckFundamental(const Eigen::Matrix3f &F21, std::vector<bool> &vbMatchesInliers, float sigma);
 
-  bool ReconstructF(std::vector<bool> &vbMatchesInliers, cv::Mat &F21, const Eigen::Matrix3d &K,
+  // Run f(i) for i in [0, n), in parallel if a thread pool is available
+  void ParallelFor(int n, const std::function<void(int)> &f);
+
+  bool ReconstructF(std::vector<bool> &vbMatchesInliers, const Eigen::Matrix3f &F21, const Eigen::Matrix3d &K,
             Eigen::Matrix3d &R21, Eigen::Vector3d &t21, std::vector<cv::Point3f> &vP3D, std::vector<bool> &vbTriangulated, float minParallax, int minTriangulated);
 
-  bool ReconstructH(std::vector<bool> &vbMatchesInliers, cv::Mat &H21, const Eigen::Matrix3d &K,
+  bool ReconstructH(std::vector<bool> &vbMatchesInliers, const Eigen::Matrix3f &H21, const Eigen::Matrix3d &K,
             Eigen::Matrix3d &R21, Eigen::Vector3d &t21, std::vector<cv::Point3f> &vP3D, std::vector<bool> &vbTriangulated, float minParallax, int minTriangulated);
 
   void Triangulate(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const Eigen::Matrix<double, 3, 4> &P1, const Eigen::Matrix<double, 3, 4> &P2, Eigen::Vector3d &x3D);
 
-  void Normalize(const std::vector<cv::KeyPoint> &vKeys, std::vector<cv::Point2f> &vNormalizedPoints, cv::Mat &T);
+  void Normalize(const std::vector<cv::KeyPoint> &vKeys, std::vector<Eigen::Vector2f> &vNormalizedPoints, Eigen::Matrix3f &T);
 
   int CheckRT(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, const std::vector<cv::KeyPoint> &vKeys1,
               const std::vector<cv::KeyPoint> &vKeys2, const std::vector<Match> &vMatches12, std::vector<bool> &vbInliers,
               const Eigen::Matrix3d &K, std::vector<cv::Point3f> &vP3D, float th2, std::vector<bool> &vbGood, float &parallax);
 
-  void DecomposeE(const cv::Mat &E, Eigen::Matrix3d &R1, Eigen::Matrix3d &R2, Eigen::Vector3d &t);
+  void DecomposeE(const Eigen::Matrix3d &E, Eigen::Matrix3d &R1, Eigen::Matrix3d &R2, Eigen::Vector3d &t);
 
 
   // Keypoints from Reference Frame (Frame 1)
@@ -94,6 +104,13 @@ class Initializer {
   // Ransac sets
   std::vector<std::vector<size_t> > mvSets;
 
+  // Number of RANSAC iterations evaluated by each parallel task
+  static const int RANSAC_BATCH;
+
+  // Shared thread pool (not owned)
+  ThreadPool* mpThreadPool;
+  int mnThreads;
+
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
@@ -24,6 +24,9 @@
 
 #include "KeyFrame.h"
 #include "ORBmatcher.h"
+#include "Config.h"
+#include "ImageAlign.h"
+#include "extra/object_pool.h"
 
 using std::vector;
 using std::set;
@@ -34,91 +37,187 @@ using std::unique_lock;
 
 namespace SD_SLAM {
 
-long unsigned int KeyFrame::nNextId = 0;
+
+void* KeyFrame::operator new(size_t size) {
+  return ObjectPool<KeyFrame>::GetInstance().Allocate(size);
+}
+
+void KeyFrame::operator delete(void* p, size_t size) {
+  ObjectPool<KeyFrame>::GetInstance().Free(p, size);
+}
 
 KeyFrame::KeyFrame(Frame &F, Map *pMap):
   mnGridCols(FRAME_GRID_COLS), mnGridRows(FRAME_GRID_ROWS),
   mfGridElementWidthInv(F.mfGridElementWidthInv), mfGridElementHeightInv(F.mfGridElementHeightInv),
   mnTrackReferenceForFrame(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0),
-  mnLoopQuery(0), mnLoopWords(0), mnRelocQuery(0), mnRelocWords(0), mnBAGlobalForKF(0),
+  mbPosePrior(false), mnLoopQuery(0), mnLoopWords(0), mnRelocQuery(0), mnRelocWords(0), mnBAGlobalForKF(0),
   fx(F.fx), fy(F.fy), cx(F.cx), cy(F.cy), invfx(F.invfx), invfy(F.invfy),
   mbf(F.mbf), mb(F.mb), mThDepth(F.mThDepth), N(F.N), mvKeys(F.mvKeys), mvKeysUn(F.mvKeysUn),
-  mvuRight(F.mvuRight), mvDepth(F.mvDepth), mDescriptors(F.mDescriptors.clone()),
-  mnScaleLevels(F.mnScaleLevels), mfScaleFactor(F.mfScaleFactor),
-  mfLogScaleFactor(F.mfLogScaleFactor), mvScaleFactors(F.mvScaleFactors), mvLevelSigma2(F.mvLevelSigma2),
-  mvInvLevelSigma2(F.mvInvLevelSigma2), mnMinX(F.mnMinX), mnMinY(F.mnMinY), mnMaxX(F.mnMaxX),
-  mnMaxY(F.mnMaxY), mK(F.mK), mvpMapPoints(F.mvpMapPoints),
-  mbFirstConnection(true), mpParent(NULL), mbNotErase(false),
+  mvuRight(F.mvuRight), mvDepth(F.mvDepth), mDescriptors(F.mDescriptors), mbBoW(false),
+  mpPyramid(F.mpPyramid), mnScaleLevels(F.mnScaleLevels), mfScaleFactor(F.mfScaleFactor),
+  mfLogScaleFactor(F.mfLogScaleFactor), mvScaleFactors(mpPyramid->vScaleFactors),
+  mvLevelSigma2(mpPyramid->vLevelSigma2), mvInvLevelSigma2(mpPyramid->vInvLevelSigma2), mnMinX(F.mnMinX), mnMinY(F.mnMinY), mnMaxX(F.mnMaxX),
+  mnMaxY(F.mnMaxY), mK(F.mK), mvpMapPoints(F.mvpMapPoints), mGrid(F.mGrid),
+  mbFirstConnection(true), mpParent(NULL), mbEssentialValid(false), mnEssentialWeight(0), mbNotErase(false),
   mbToBeErased(false), mbBad(false), mHalfBaseline(F.mb/2), mpMap(pMap) {
-  mnId=nNextId++;
+  mnId = mpMap->NewKeyFrameId();
+  mTimeStamp = F.mTimeStamp;
 
-  mGrid.resize(mnGridCols);
-  for (int i = 0; i<mnGridCols; i++) {
-    mGrid[i].resize(mnGridRows);
-    for (int j = 0; j < mnGridRows; j++)
-      mGrid[i][j] = F.mGrid[i][j];
-  }
+  mFeatures.Build(mvKeysUn, mDescriptors);
 
   SetPose(F.mTcw);
 
-  // Copy pyramid
-  int size = F.mvImagePyramid.size();
-  mvImagePyramid.resize(size);
-  for (int i = 0; i < size; i++)
-    mvImagePyramid[i] = F.mvImagePyramid[i].clone();
+  // Share image buffers, they are read-only. 16-bit depth takes half the memory of meters.
+  // Depth borrowed from the input is copied, tracking frames don't keep it
+  mvImagePyramid = F.mvImagePyramid;
+  if (F.mRawDepth.type() == CV_16U && F.mDepthImage.empty()) {
+    mDepthImage = F.mbBorrowedDepth ? F.mRawDepth.clone() : F.mRawDepth;
+    mfDepthScale = F.mfDepthScale;
+  } else {
+    mDepthImage = F.GetDepthImage();
+    mfDepthScale = 1.0f;
+  }
+
+  // Alignment order of all keypoints, as points are added later
+  const int level = std::min(ImageAlign::MIN_LEVEL, static_cast<int>(mvImagePyramid.size())-1);
+  vector<int> vIndices(N);
+  for (int i = 0; i < N; i++)
+    vIndices[i] = i;
+  if (level >= 0)
+    ImageAlign::SortPoints(mvKeysUn, vIndices, mvImagePyramid[level], 1.0f/mvScaleFactors[level], mvAlignOrder);
+  else
+    mvAlignOrder = vIndices;
+}
+
+void KeyFrame::ReleasePyramidLevels(int level) {
+  ORBextractor::ReleaseLevels(mvImagePyramid, level);
+}
+
+cv::Mat KeyFrame::GetDepthImage() const {
+  if (mDepthImage.type() != CV_16U)
+    return mDepthImage;
+
+  cv::Mat depth;
+  mDepthImage.convertTo(depth, CV_32F, mfDepthScale);
+  return depth;
+}
+
+void KeyFrame::ComputeBoW(const ORBVocabulary* pVoc) {
+  if (mbBoW || pVoc->Empty())
+    return;
+
+  pVoc->Transform(mDescriptors, mBowVec, mFeatVec, Config::VocabularyLevelsUp());
+  mbBoW = true;
+}
+
+void KeyFrame::GetFeatureBytes(size_t &descriptors, size_t &features) {
+  descriptors = mDescriptors.total()*mDescriptors.elemSize();
+
+  features = (mvKeys.capacity()+mvKeysUn.capacity())*sizeof(cv::KeyPoint) +
+             (mvuRight.capacity()+mvDepth.capacity())*sizeof(float) + mFeatures.Bytes() + mGrid.Bytes() +
+             mBowVec.capacity()*sizeof(ORBVocabulary::BowVector::value_type) +
+             mFeatVec.capacity()*sizeof(ORBVocabulary::FeatureVector::value_type);
+  for (const auto &node : mFeatVec)
+    features += node.second.capacity()*sizeof(uint32_t);
 
-  mDepthImage = F.mDepthImage.clone();
+  SharedLock lock(mMutexFeatures);
+  features += mvpMapPoints.capacity()*sizeof(MapPoint*);
 }
 
 void KeyFrame::SetID(int n) {
   mnId = n;
-  nNextId = std::max(nNextId, mnId+1);
+  mpMap->ReserveKeyFrameId(mnId);
 }
 
 void KeyFrame::SetPose(const Eigen::Matrix4d &Tcw_) {
+  double data[POSE_WORDS];
+  Eigen::Map<Eigen::Matrix3d> Rcw(data+POSE_R);
+  Eigen::Map<Eigen::Vector3d> tcw(data+POSE_T);
+  Eigen::Map<Eigen::Vector3d> Ow(data+POSE_OW);
+  Rcw = Tcw_.block<3, 3>(0, 0);
+  tcw = Tcw_.block<3, 1>(0, 3);
+  Ow = -Rcw.transpose()*tcw;
+
   unique_lock<mutex> lock(mMutexPose);
+  mPoseLock.BeginWrite();
+  SeqLock::Store(mPose, data, sizeof(data));
+  mPoseLock.EndWrite();
 
-  Eigen::Matrix4d m = Tcw_; // Somehow it fixes problems with Eigen
-  Tcw = m;
+  // Alignment references were computed from the old pose
+  unique_lock<mutex> lockAlign(mMutexAlign);
+  mvAlignRefs.clear();
+}
 
-  Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
-  Eigen::Matrix3d Rwc = Rcw.transpose();
-  Eigen::Vector3d tcw = Tcw.block<3, 1>(0, 3);
-  Ow = -Rwc*tcw;
+std::shared_ptr<const AlignReference> KeyFrame::GetAlignReference(int level) {
+  unique_lock<mutex> lock(mMutexAlign);
+  if (level < 0 || level >= static_cast<int>(mvAlignRefs.size()))
+    return std::shared_ptr<const AlignReference>();
+  return mvAlignRefs[level].lock();
+}
+
+void KeyFrame::SetAlignReference(int level, const std::shared_ptr<const AlignReference> &ref) {
+  unique_lock<mutex> lock(mMutexAlign);
+  if (level >= static_cast<int>(mvAlignRefs.size()))
+    mvAlignRefs.resize(level+1);
+  mvAlignRefs[level] = ref;
+}
 
-  Twc.setIdentity();
-  Twc.block<3, 3>(0, 0) = Rwc;
-  Twc.block<3, 1>(0, 3) = Ow;
+void KeyFrame::ReadPose(int word, double *data, int n) const {
+  unsigned seq;
+  do {
+    seq = mPoseLock.BeginRead();
+    SeqLock::Load(data, &mPose[word], n*sizeof(double));
+  } while (mPoseLock.Retry(seq));
 }
 
 Eigen::Matrix4d KeyFrame::GetPose() {
-  unique_lock<mutex> lock(mMutexPose);
+  // Rcw and tcw only
+  double data[POSE_OW];
+  ReadPose(POSE_R, data, POSE_OW);
+
+  Eigen::Matrix4d Tcw = Eigen::Matrix4d::Identity();
+  Tcw.block<3, 3>(0, 0) = Eigen::Map<const Eigen::Matrix3d>(data+POSE_R);
+  Tcw.block<3, 1>(0, 3) = Eigen::Map<const Eigen::Vector3d>(data+POSE_T);
   return Tcw;
 }
 
 Eigen::Matrix4d KeyFrame::GetPoseInverse() {
-  unique_lock<mutex> lock(mMutexPose);
+  double data[POSE_WORDS];
+  ReadPose(POSE_R, data, POSE_WORDS);
+
+  Eigen::Matrix4d Twc = Eigen::Matrix4d::Identity();
+  Twc.block<3, 3>(0, 0) = Eigen::Map<const Eigen::Matrix3d>(data+POSE_R).transpose();
+  Twc.block<3, 1>(0, 3) = Eigen::Map<const Eigen::Vector3d>(data+POSE_OW);
   return Twc;
 }
 
 Eigen::Vector3d KeyFrame::GetCameraCenter() {
-  unique_lock<mutex> lock(mMutexPose);
+  Eigen::Vector3d Ow;
+  ReadPose(POSE_OW, Ow.data(), 3);
   return Ow;
 }
 
 Eigen::Matrix3d KeyFrame::GetRotation() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Tcw.block<3, 3>(0, 0);
+  Eigen::Matrix3d Rcw;
+  ReadPose(POSE_R, Rcw.data(), 9);
+  return Rcw;
 }
 
 Eigen::Vector3d KeyFrame::GetTranslation() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Tcw.block<3, 1>(0, 3);
+  Eigen::Vector3d tcw;
+  ReadPose(POSE_T, tcw.data(), 3);
+  return tcw;
+}
+
+void KeyFrame::GetPoses(const vector<KeyFrame*> &vpKFs, PoseVector &vTcw) {
+  vTcw.resize(vpKFs.size());
+  for (size_t i = 0; i < vpKFs.size(); i++)
+    vTcw[i] = vpKFs[i]->GetPose();
 }
 
 void KeyFrame::AddConnection(KeyFrame *pKF, const int &weight) {
   {
-    unique_lock<mutex> lock(mMutexConnections);
+    unique_lock<SharedMutex> lock(mMutexConnections);
     if (!mConnectedKeyFrameWeights.count(pKF))
       mConnectedKeyFrameWeights[pKF]=weight;
     else if (mConnectedKeyFrameWeights[pKF]!=weight)
@@ -130,8 +229,21 @@ void KeyFrame::AddConnection(KeyFrame *pKF, const int &weight) {
   UpdateBestCovisibles();
 }
 
+void KeyFrame::SetConnections(const map<KeyFrame*, int> &weights, KeyFrame* pParent) {
+  {
+    unique_lock<SharedMutex> lock(mMutexConnections);
+    mConnectedKeyFrameWeights = weights;
+    mbFirstConnection = false;
+  }
+
+  UpdateBestCovisibles();
+
+  if (pParent)
+    ChangeParent(pParent);
+}
+
 void KeyFrame::UpdateBestCovisibles() {
-  unique_lock<mutex> lock(mMutexConnections);
+  unique_lock<SharedMutex> lock(mMutexConnections);
   vector<std::pair<int,KeyFrame*> > vPairs;
   vPairs.reserve(mConnectedKeyFrameWeights.size());
   for (map<KeyFrame*, int>::iterator mit = mConnectedKeyFrameWeights.begin(), mend = mConnectedKeyFrameWeights.end(); mit != mend; mit++)
@@ -147,23 +259,30 @@ void KeyFrame::UpdateBestCovisibles() {
 
   mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
   mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
+  mbEssentialValid = false;
 }
 
 set<KeyFrame*> KeyFrame::GetConnectedKeyFrames() {
-  unique_lock<mutex> lock(mMutexConnections);
+  SharedLock lock(mMutexConnections);
   set<KeyFrame*> s;
   for (map<KeyFrame*, int>::iterator mit = mConnectedKeyFrameWeights.begin();mit != mConnectedKeyFrameWeights.end();mit++)
     s.insert(mit->first);
   return s;
 }
 
+void KeyFrame::GetConnectedIds(vector<unsigned long> &vIds) {
+  SharedLock lock(mMutexConnections);
+  for (map<KeyFrame*, int>::iterator mit = mConnectedKeyFrameWeights.begin();mit != mConnectedKeyFrameWeights.end();mit++)
+    vIds.push_back(mit->first->mnId);
+}
+
 vector<KeyFrame*> KeyFrame::GetVectorCovisibleKeyFrames() {
-  unique_lock<mutex> lock(mMutexConnections);
+  SharedLock lock(mMutexConnections);
   return mvpOrderedConnectedKeyFrames;
 }
 
 vector<KeyFrame*> KeyFrame::GetBestCovisibilityKeyFrames(const int &N) {
-  unique_lock<mutex> lock(mMutexConnections);
+  SharedLock lock(mMutexConnections);
   if ((int)mvpOrderedConnectedKeyFrames.size()<N)
     return mvpOrderedConnectedKeyFrames;
   else
@@ -171,7 +290,7 @@ vector<KeyFrame*> KeyFrame::GetBestCovisibilityKeyFrames(const int &N) {
 }
 
 vector<KeyFrame*> KeyFrame::GetCovisiblesByWeight(const int &w) {
-  unique_lock<mutex> lock(mMutexConnections);
+  SharedLock lock(mMutexConnections);
 
   if (mvpOrderedConnectedKeyFrames.empty())
     return vector<KeyFrame*>();
@@ -185,16 +304,42 @@ vector<KeyFrame*> KeyFrame::GetCovisiblesByWeight(const int &w) {
   }
 }
 
+vector<KeyFrame*> KeyFrame::GetEssentialCovisibles(const int &w) {
+  unique_lock<SharedMutex> lock(mMutexConnections);
+  if (mbEssentialValid && mnEssentialWeight == w)
+    return mvpEssentialCovisibles;
+
+  mvpEssentialCovisibles.clear();
+
+  // Same selection as GetCovisiblesByWeight
+  vector<int>::iterator it = upper_bound(mvOrderedWeights.begin(), mvOrderedWeights.end(), w,KeyFrame::weightComp);
+  if (!mvpOrderedConnectedKeyFrames.empty() && it != mvOrderedWeights.end()) {
+    const int n = it-mvOrderedWeights.begin();
+    for (int i = 0; i < n; i++) {
+      KeyFrame* pKFn = mvpOrderedConnectedKeyFrames[i];
+      if (pKFn && pKFn != mpParent && pKFn->mnId < mnId && !mspChildrens.count(pKFn) && !mspLoopEdges.count(pKFn))
+        mvpEssentialCovisibles.push_back(pKFn);
+    }
+  }
+
+  mnEssentialWeight = w;
+  mbEssentialValid = true;
+
+  return mvpEssentialCovisibles;
+}
+
 int KeyFrame::GetWeight(KeyFrame *pKF) {
-  unique_lock<mutex> lock(mMutexConnections);
-  if (mConnectedKeyFrameWeights.count(pKF))
-    return mConnectedKeyFrameWeights[pKF];
+  SharedLock lock(mMutexConnections);
+  // find, operator[] would insert under a shared lock
+  map<KeyFrame*, int>::const_iterator mit = mConnectedKeyFrameWeights.find(pKF);
+  if (mit != mConnectedKeyFrameWeights.end())
+    return mit->second;
   else
     return 0;
 }
 
 void KeyFrame::AddMapPoint(MapPoint *pMP, const size_t &idx) {
-  unique_lock<mutex> lock(mMutexFeatures);
+  unique_lock<SharedMutex> lock(mMutexFeatures);
   mvpMapPoints[idx]=pMP;
 }
 
@@ -220,7 +365,7 @@ int KeyFrame::AddMapPoint(MapPoint* pMP, const Eigen::Vector2d &pos) {
 }
 
 void KeyFrame::EraseMapPointMatch(const size_t &idx) {
-  unique_lock<mutex> lock(mMutexFeatures);
+  unique_lock<SharedMutex> lock(mMutexFeatures);
   mvpMapPoints[idx] = static_cast<MapPoint*>(NULL);
 }
 
@@ -236,7 +381,7 @@ void KeyFrame::ReplaceMapPointMatch(const size_t &idx, MapPoint* pMP) {
 }
 
 set<MapPoint*> KeyFrame::GetMapPoints() {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
   set<MapPoint*> s;
   for (size_t i = 0, iend = mvpMapPoints.size(); i < iend; i++) {
     if (!mvpMapPoints[i])
@@ -249,7 +394,7 @@ set<MapPoint*> KeyFrame::GetMapPoints() {
 }
 
 int KeyFrame::TrackedMapPoints(const int &minObs) {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
 
   int nPoints = 0;
   const bool bCheckObs = minObs > 0;
@@ -270,48 +415,80 @@ int KeyFrame::TrackedMapPoints(const int &minObs) {
 }
 
 vector<MapPoint*> KeyFrame::GetMapPointMatches() {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
   return mvpMapPoints;
 }
 
+void KeyFrame::GetMapPointMatches(ScratchVector<MapPoint*> &vpMapPoints) {
+  SharedLock lock(mMutexFeatures);
+  vpMapPoints.assign(mvpMapPoints.begin(), mvpMapPoints.end());
+}
+
 MapPoint* KeyFrame::GetMapPoint(const size_t &idx) {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
   return mvpMapPoints[idx];
 }
 
-void KeyFrame::UpdateConnections(bool checkID) {
-  map<KeyFrame*, int> KFcounter;
+void KeyFrame::ChangeCovisibility(KeyFrame* pKF1, KeyFrame* pKF2, int delta) {
+  if (pKF1 == pKF2)
+    return;
 
-  vector<MapPoint*> vpMP;
+  pKF1->AddCovisibility(pKF2, delta);
+  pKF2->AddCovisibility(pKF1, delta);
+}
 
-  {
-    unique_lock<mutex> lockMPs(mMutexFeatures);
-    vpMP = mvpMapPoints;
+void KeyFrame::AddCovisibility(KeyFrame* pKF, int delta) {
+  unique_lock<mutex> lock(mMutexCovisibility);
+  for (size_t i = 0, iend = mvCovisibilityCounts.size(); i < iend; i++) {
+    if (mvCovisibilityCounts[i].first == pKF) {
+      mvCovisibilityCounts[i].second += delta;
+
+      // Remove empty entries
+      if (mvCovisibilityCounts[i].second <= 0) {
+        mvCovisibilityCounts[i] = mvCovisibilityCounts.back();
+        mvCovisibilityCounts.pop_back();
+      }
+      return;
+    }
   }
 
-  //For all map points in keyframe check in which other keyframes are they seen
-  //Increase counter for those keyframes
-  for (vector<MapPoint*>::iterator vit=vpMP.begin(), vend=vpMP.end(); vit!=vend; vit++) {
-    MapPoint* pMP = *vit;
+  if (delta > 0)
+    mvCovisibilityCounts.push_back(std::make_pair(pKF, delta));
+}
+
+void KeyFrame::UpdateConnections(bool checkID) {
+  map<KeyFrame*, int> KFcounter;
 
-    if (!pMP)
-      continue;
+  if (checkID) {
+    vector<MapPoint*> vpMP;
 
-    if (pMP->isBad())
-      continue;
+    {
+      SharedLock lockMPs(mMutexFeatures);
+      vpMP = mvpMapPoints;
+    }
 
-    map<KeyFrame*, size_t> observations = pMP->GetObservations();
+    //For all map points in keyframe check in which other keyframes are they seen
+    //Increase counter for those keyframes
+    for (vector<MapPoint*>::iterator vit=vpMP.begin(), vend=vpMP.end(); vit!=vend; vit++) {
+      MapPoint* pMP = *vit;
 
-    for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
-      if (mit->first->mnId == mnId)
+      if (!pMP)
         continue;
 
-      // Use only KFs previous to current KF
-      if (checkID && mit->first->mnId > mnId)
+      if (pMP->isBad())
         continue;
 
-      KFcounter[mit->first]++;
+      // Use only KFs previous to current KF
+      pMP->ForEachObservation([&](KeyFrame* pKFi, size_t) {
+        if (pKFi->mnId < mnId)
+          KFcounter[pKFi]++;
+      });
     }
+  } else {
+    // Counters are maintained when observations change
+    unique_lock<mutex> lock(mMutexCovisibility);
+    for (size_t i = 0, iend = mvCovisibilityCounts.size(); i < iend; i++)
+      KFcounter.insert(mvCovisibilityCounts[i]);
   }
 
   // This should not happen
@@ -351,10 +528,11 @@ void KeyFrame::UpdateConnections(bool checkID) {
   }
 
   {
-    unique_lock<mutex> lockCon(mMutexConnections);
+    unique_lock<SharedMutex> lockCon(mMutexConnections);
     mConnectedKeyFrameWeights = KFcounter;
     mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
     mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
+    mbEssentialValid = false;
 
     if (mbFirstConnection && mnId != 0) {
       mpParent = mvpOrderedConnectedKeyFrames.front();
@@ -365,58 +543,62 @@ void KeyFrame::UpdateConnections(bool checkID) {
 }
 
 void KeyFrame::AddChild(KeyFrame *pKF) {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  unique_lock<SharedMutex> lockCon(mMutexConnections);
   mspChildrens.insert(pKF);
+  mbEssentialValid = false;
 }
 
 void KeyFrame::EraseChild(KeyFrame *pKF) {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  unique_lock<SharedMutex> lockCon(mMutexConnections);
   mspChildrens.erase(pKF);
+  mbEssentialValid = false;
 }
 
 void KeyFrame::ChangeParent(KeyFrame *pKF) {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  unique_lock<SharedMutex> lockCon(mMutexConnections);
   // Avoid linking to itself
   if (pKF->GetID() != GetID()) {
     mpParent = pKF;
     pKF->AddChild(this);
+    mbEssentialValid = false;
   }
 }
 
 set<KeyFrame*> KeyFrame::GetChilds() {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  SharedLock lockCon(mMutexConnections);
   return mspChildrens;
 }
 
 KeyFrame* KeyFrame::GetParent() {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  SharedLock lockCon(mMutexConnections);
   return mpParent;
 }
 
 bool KeyFrame::hasChild(KeyFrame *pKF) {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  SharedLock lockCon(mMutexConnections);
   return mspChildrens.count(pKF);
 }
 
 void KeyFrame::AddLoopEdge(KeyFrame *pKF) {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  unique_lock<SharedMutex> lockCon(mMutexConnections);
   mbNotErase = true;
   mspLoopEdges.insert(pKF);
+  mbEssentialValid = false;
 }
 
 set<KeyFrame*> KeyFrame::GetLoopEdges() {
-  unique_lock<mutex> lockCon(mMutexConnections);
+  SharedLock lockCon(mMutexConnections);
   return mspLoopEdges;
 }
 
 void KeyFrame::SetNotErase() {
-  unique_lock<mutex> lock(mMutexConnections);
+  unique_lock<SharedMutex> lock(mMutexConnections);
   mbNotErase = true;
 }
 
 void KeyFrame::SetErase() {
   {
-    unique_lock<mutex> lock(mMutexConnections);
+    unique_lock<SharedMutex> lock(mMutexConnections);
     if (mspLoopEdges.empty()) {
       mbNotErase = false;
     }
@@ -429,7 +611,7 @@ void KeyFrame::SetErase() {
 
 void KeyFrame::SetBadFlag() {
   {
-    unique_lock<mutex> lock(mMutexConnections);
+    unique_lock<SharedMutex> lock(mMutexConnections);
     if (mnId == 0)
       return;
     else if (mbNotErase) {
@@ -445,11 +627,13 @@ void KeyFrame::SetBadFlag() {
     if (mvpMapPoints[i])
       mvpMapPoints[i]->EraseObservation(this);
   {
-    unique_lock<mutex> lock(mMutexConnections);
-    unique_lock<mutex> lock1(mMutexFeatures);
+    unique_lock<SharedMutex> lock(mMutexConnections);
+    unique_lock<SharedMutex> lock1(mMutexFeatures);
 
     mConnectedKeyFrameWeights.clear();
     mvpOrderedConnectedKeyFrames.clear();
+    mvpEssentialCovisibles.clear();
+    mbEssentialValid = false;
 
     // Update Spanning Tree
     set<KeyFrame*> sParentCandidates;
@@ -508,14 +692,14 @@ void KeyFrame::SetBadFlag() {
 }
 
 bool KeyFrame::isBad() {
-  unique_lock<mutex> lock(mMutexConnections);
+  SharedLock lock(mMutexConnections);
   return mbBad;
 }
 
 void KeyFrame::EraseConnection(KeyFrame* pKF) {
   bool bUpdate = false;
   {
-    unique_lock<mutex> lock(mMutexConnections);
+    unique_lock<SharedMutex> lock(mMutexConnections);
     if (mConnectedKeyFrameWeights.count(pKF)) {
       mConnectedKeyFrameWeights.erase(pKF);
       bUpdate=true;
@@ -526,44 +710,20 @@ void KeyFrame::EraseConnection(KeyFrame* pKF) {
     UpdateBestCovisibles();
 }
 
-vector<size_t> KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r) const
-{
+vector<size_t> KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r) const {
   vector<size_t> vIndices;
-  vIndices.reserve(N);
-
-  const int nMinCellX = std::max(0,(int)floor((x-mnMinX-r)*mfGridElementWidthInv));
-  if (nMinCellX >= mnGridCols)
-    return vIndices;
-
-  const int nMaxCellX = std::min((int)mnGridCols-1,(int)ceil((x-mnMinX+r)*mfGridElementWidthInv));
-  if (nMaxCellX < 0)
-    return vIndices;
-
-  const int nMinCellY = std::max(0,(int)floor((y-mnMinY-r)*mfGridElementHeightInv));
-  if (nMinCellY >= mnGridRows)
-    return vIndices;
-
-  const int nMaxCellY = std::min((int)mnGridRows-1,(int)ceil((y-mnMinY+r)*mfGridElementHeightInv));
-  if (nMaxCellY < 0)
-    return vIndices;
-
-  for (int ix = nMinCellX; ix<=nMaxCellX; ix++) {
-    for (int iy = nMinCellY; iy<=nMaxCellY; iy++) {
-      const vector<size_t> vCell = mGrid[ix][iy];
-      for (size_t j = 0, jend=vCell.size(); j < jend; j++) {
-        const cv::KeyPoint &kpUn = mvKeysUn[vCell[j]];
-        const float distx = kpUn.pt.x-x;
-        const float disty = kpUn.pt.y-y;
-
-        if (fabs(distx)<r && fabs(disty)<r)
-          vIndices.push_back(vCell[j]);
-      }
-    }
-  }
-
+  GetFeaturesInArea(x, y, r, vIndices);
   return vIndices;
 }
 
+void KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r, vector<size_t> &vIndices) const {
+  vIndices.clear();
+  mGrid.ForEachCell(x, y, r, mnMinX, mnMinY, mfGridElementWidthInv, mfGridElementHeightInv,
+                    [&](const uint32_t* begin, const uint32_t* end) {
+    mFeatures.Select(begin, end, x, y, r, 0, -1, vIndices);
+  });
+}
+
 bool KeyFrame::IsInImage(const float &x, const float &y) const
 {
   return (x >= mnMinX && x<mnMaxX && y >= mnMinY && y<mnMaxY);
@@ -578,7 +738,7 @@ Eigen::Vector3d KeyFrame::UnprojectStereo(int i) {
     const float y = (v-cy)*z*invfy;
     Eigen::Vector3d x3Dc(x, y, z);
 
-    unique_lock<mutex> lock(mMutexPose);
+    const Eigen::Matrix4d Twc = GetPoseInverse();
     return Twc.block<3, 3>(0, 0)*x3Dc+Twc.block<3, 1>(0, 3);
   } else
     return Eigen::Vector3d::Zero();
@@ -586,13 +746,11 @@ Eigen::Vector3d KeyFrame::UnprojectStereo(int i) {
 
 float KeyFrame::ComputeSceneMedianDepth(const int q) {
   vector<MapPoint*> vpMapPoints;
-  Eigen::Matrix4d Tcw_;
   {
-    unique_lock<mutex> lock(mMutexFeatures);
-    unique_lock<mutex> lock2(mMutexPose);
+    SharedLock lock(mMutexFeatures);
     vpMapPoints = mvpMapPoints;
-    Tcw_ = Tcw;
   }
+  const Eigen::Matrix4d Tcw_ = GetPose();
 
   vector<float> vDepths;
   vDepths.reserve(N);
@@ -27,24 +27,38 @@
 
 #include <map>
 #include <mutex>
+#include <memory>
 #include "MapPoint.h"
 #include "ORBextractor.h"
 #include "Frame.h"
+#include "ORBVocabulary.h"
+#include "extra/feature_table.h"
+#include "extra/feature_grid.h"
+#include "extra/seqlock.h"
+#include "extra/shared_mutex.h"
+#include "extra/scratch_arena.h"
 
 namespace SD_SLAM {
 
 class Map;
 class MapPoint;
 class Frame;
+struct AlignReference;
 
 class KeyFrame {
  public:
   KeyFrame(Frame &F, Map* pMap);
 
+  // Allocated from a slab pool, as map points
+  static void* operator new(size_t size);
+  static void operator delete(void* p, size_t size);
+
   inline int GetID() const { return mnId; }
   void SetID(int n);
 
-  // Pose functions
+  typedef std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > PoseVector;
+
+  // Pose functions. Getters never block, they retry while SetPose is writing
   void SetPose(const Eigen::Matrix4d &Tcw);
   Eigen::Matrix4d GetPose();
   Eigen::Matrix4d GetPoseInverse();
@@ -52,17 +66,43 @@ class KeyFrame {
   Eigen::Matrix3d GetRotation();
   Eigen::Vector3d GetTranslation();
 
+  // Poses (Tcw) of a set of keyframes, e.g. a local window, in one pass
+  static void GetPoses(const std::vector<KeyFrame*> &vpKFs, PoseVector &vTcw);
+
   // Covisibility graph functions
   void AddConnection(KeyFrame* pKF, const int &weight);
   void EraseConnection(KeyFrame* pKF);
+  // Weights come from covisibility counters, unless checkID is set (only previous
+  // keyframes are used), which recounts shared MapPoints
   void UpdateConnections(bool checkID = false);
   void UpdateBestCovisibles();
+
+  // Add delta to the number of MapPoints observed by both keyframes.
+  // Called by MapPoint when its observations change
+  static void ChangeCovisibility(KeyFrame* pKF1, KeyFrame* pKF2, int delta);
+
+  // Set covisibility weights and spanning tree parent directly (loaded maps)
+  void SetConnections(const std::map<KeyFrame*, int> &weights, KeyFrame* pParent);
   std::set<KeyFrame *> GetConnectedKeyFrames();
+  // Append ids of connected keyframes to vIds (unsorted), no set is built
+  void GetConnectedIds(std::vector<unsigned long> &vIds);
   std::vector<KeyFrame* > GetVectorCovisibleKeyFrames();
   std::vector<KeyFrame*> GetBestCovisibilityKeyFrames(const int &N);
   std::vector<KeyFrame*> GetCovisiblesByWeight(const int &w);
+  // Previous covisibles with weight >= w that are not parent, children or loop edges
+  // (covisibility edges of the essential graph). Cached until connections change
+  std::vector<KeyFrame*> GetEssentialCovisibles(const int &w);
   int GetWeight(KeyFrame* pKF);
 
+  // Call f(pKF, weight) for each covisible keyframe, ordered by weight, without copying them.
+  // Connections lock is held shared, so f must not call methods of this keyframe
+  template <typename F>
+  void ForEachCovisible(F f) {
+    SharedLock lock(mMutexConnections);
+    for (size_t i = 0; i < mvpOrderedConnectedKeyFrames.size(); i++)
+      f(mvpOrderedConnectedKeyFrames[i], mvOrderedWeights[i]);
+  }
+
   // Spanning tree functions
   void AddChild(KeyFrame* pKF);
   void EraseChild(KeyFrame* pKF);
@@ -83,16 +123,56 @@ class KeyFrame {
   void ReplaceMapPointMatch(const size_t &idx, MapPoint* pMP);
   std::set<MapPoint*> GetMapPoints();
   std::vector<MapPoint*> GetMapPointMatches();
+  // Same, into a container of the calling thread scratch arena
+  void GetMapPointMatches(ScratchVector<MapPoint*> &vpMapPoints);
   int TrackedMapPoints(const int &minObs);
   MapPoint* GetMapPoint(const size_t &idx);
 
+  // Call f(idx, pMP) for each associated MapPoint (not null, may be bad) without copying them.
+  // Features lock is held shared, so f must not call methods of this keyframe
+  template <typename F>
+  void ForEachMapPoint(F f) {
+    SharedLock lock(mMutexFeatures);
+    for (size_t i = 0; i < mvpMapPoints.size(); i++) {
+      if (mvpMapPoints[i])
+        f(i, mvpMapPoints[i]);
+    }
+  }
+
   // KeyPoint functions
   std::vector<size_t> GetFeaturesInArea(const float &x, const float  &y, const float  &r) const;
+  void GetFeaturesInArea(const float &x, const float &y, const float &r, std::vector<size_t> &vIndices) const;
+
+  // Call f(begin, end) with the keypoint indices of each grid cell closer than r to line a*x+b*y+c = 0
+  template<typename Func>
+  inline void ForEachCellNearLine(float a, float b, float c, float r, Func f) const {
+    mGrid.ForEachCellNearLine(a, b, c, r, mnMinX, mnMinY, mfGridElementWidthInv, mfGridElementHeightInv, f);
+  }
   Eigen::Vector3d UnprojectStereo(int i);
 
   // Image
   bool IsInImage(const float &x, const float &y) const;
 
+  // Release pyramid levels finer than level. Released levels are left empty.
+  void ReleasePyramidLevels(int level);
+
+  // Depth image in meters (CV_32F), converted from the stored one if it is 16-bit. Empty if
+  // there is no depth or it is paged out
+  cv::Mat GetDepthImage() const;
+
+  // Image alignment reference computed against this keyframe at a pyramid level, null if
+  // none. References are dropped when the pose changes and kept alive by ImageAlign cache
+  std::shared_ptr<const AlignReference> GetAlignReference(int level);
+  void SetAlignReference(int level, const std::shared_ptr<const AlignReference> &ref);
+
+  // Quantize descriptors with the vocabulary. Called once, before the keyframe is in the map
+  void ComputeBoW(const ORBVocabulary* pVoc);
+  inline bool HasBoW() const { return mbBoW; }
+
+  // Memory of descriptors, and of keypoints, matches, grids and BoW vectors. Images are
+  // accounted by the pager, which may release them at any time
+  void GetFeatureBytes(size_t &descriptors, size_t &features);
+
   // Enable/Disable bad flag changes
   void SetNotErase();
   void SetErase();
@@ -114,9 +194,11 @@ class KeyFrame {
 
   // The following variables are accesed from only 1 thread or never change (no mutex needed).
  public:
-  static long unsigned int nNextId;
   long unsigned int mnId;
 
+  // Sensor timestamp (s) of the frame it was created from, negative if none
+  double mTimeStamp;
+
   // Grid (to speed up feature matching)
   const int mnGridCols;
   const int mnGridRows;
@@ -131,6 +213,11 @@ class KeyFrame {
   long unsigned int mnBALocalForKF;
   long unsigned int mnBAFixedForKF;
 
+  // Pose prior left by keyframes marginalized from the sliding window BA
+  bool mbPosePrior;
+  Eigen::Matrix4d mTcwPrior;
+  Eigen::Matrix<double, 6, 6> mPosePriorInfo;
+
   // Variables used by the keyframe database
   long unsigned int mnLoopQuery;
   int mnLoopWords;
@@ -155,15 +242,27 @@ class KeyFrame {
   const std::vector<cv::KeyPoint> mvKeysUn;
   const std::vector<float> mvuRight; // negative value for monocular points
   const std::vector<float> mvDepth; // negative value for monocular points
-  const cv::Mat mDescriptors;
+  const cv::Mat mDescriptors; // same block as the frame, not copied
+
+  // Undistorted coordinates, octaves and descriptors in contiguous arrays, for matching
+  FeatureTable mFeatures;
+
+  // Keypoints in the order ImageAlign uses their points (spread over the image, high gradient first)
+  std::vector<int> mvAlignOrder;
+
+  // Bag of words and features grouped by vocabulary node, valid if HasBoW()
+  ORBVocabulary::BowVector mBowVec;
+  ORBVocabulary::FeatureVector mFeatVec;
+  bool mbBoW;
 
-  // Scale
+  // Scale, shared with the frames of the extractor
+  const std::shared_ptr<const ScalePyramid> mpPyramid;
   const int mnScaleLevels;
   const float mfScaleFactor;
   const float mfLogScaleFactor;
-  const std::vector<float> mvScaleFactors;
-  const std::vector<float> mvLevelSigma2;
-  const std::vector<float> mvInvLevelSigma2;
+  const std::vector<float> &mvScaleFactors;
+  const std::vector<float> &mvLevelSigma2;
+  const std::vector<float> &mvInvLevelSigma2;
 
   // Image bounds and calibration
   const int mnMinX;
@@ -172,33 +271,44 @@ class KeyFrame {
   const int mnMaxY;
   Eigen::Matrix3d mK;
 
-  // Image pyramid
+  // Image pyramid (shared with the source frame, read-only). Depth is kept as the sensor gave
+  // it: CV_16U in sensor units, meters being mDepthImage*mfDepthScale, or CV_32F in meters
+  // (mfDepthScale is 1). Use GetDepthImage to read it in meters
   std::vector<cv::Mat> mvImagePyramid;
   cv::Mat mDepthImage;
+  float mfDepthScale;
 
   // The following variables need to be accessed trough a mutex to be thread safe.
  protected:
-  // SE3 Pose and camera center
-  Eigen::Matrix4d Tcw;
-  Eigen::Matrix4d Twc;
-  Eigen::Vector3d Ow;
+  // SE3 pose (Rcw, tcw) and camera center, as doubles in seqlock words
+  enum { POSE_R = 0, POSE_T = 9, POSE_OW = 12, POSE_WORDS = 15 };
+  SeqLock mPoseLock;
+  SeqLock::Word mPose[POSE_WORDS];
 
   // MapPoints associated to keypoints
   std::vector<MapPoint*> mvpMapPoints;
 
   // Grid over the image to speed up feature matching
-  std::vector< std::vector <std::vector<size_t> > > mGrid;
+  FeatureGrid mGrid;
 
   std::map<KeyFrame*, int> mConnectedKeyFrameWeights;
   std::vector<KeyFrame*> mvpOrderedConnectedKeyFrames;
   std::vector<int> mvOrderedWeights;
 
+  // Number of shared MapPoints with every other keyframe, kept up to date by MapPoint
+  std::vector<std::pair<KeyFrame*, int> > mvCovisibilityCounts;
+
   // Spanning Tree and Loop Edges
   bool mbFirstConnection;
   KeyFrame* mpParent;
   std::set<KeyFrame*> mspChildrens;
   std::set<KeyFrame*> mspLoopEdges;
 
+  // Cached result of GetEssentialCovisibles
+  bool mbEssentialValid;
+  int mnEssentialWeight;
+  std::vector<KeyFrame*> mvpEssentialCovisibles;
+
   // Bad flags
   bool mbNotErase;
   bool mbToBeErased;
@@ -208,12 +318,24 @@ class KeyFrame {
 
   Map* mpMap;
 
+  // Serializes pose writers, never taken by readers
   std::mutex mMutexPose;
-  std::mutex mMutexConnections;
-  std::mutex mMutexFeatures;
+  // Shared by readers, exclusive for changes
+  SharedMutex mMutexConnections;
+  SharedMutex mMutexFeatures;
 
- public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  // Only protects covisibility counters, no other lock is taken while holding it
+  std::mutex mMutexCovisibility;
+
+  // Alignment references by level (see GetAlignReference)
+  std::vector<std::weak_ptr<const AlignReference> > mvAlignRefs;
+  std::mutex mMutexAlign;
+
+ private:
+  void AddCovisibility(KeyFrame* pKF, int delta);
+
+  // Copy pose words, retrying while a writer is active
+  void ReadPose(int word, double *data, int n) const;
 };
 
 }  // namespace SD_SLAM
@@ -0,0 +1,217 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "KeyFrameDatabase.h"
+#include <algorithm>
+#include <cmath>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "KeyFrame.h"
+#include "Frame.h"
+#include "extra/scratch_arena.h"
+
+using std::vector;
+using std::set;
+using std::pair;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+const int KeyFrameDatabase::THUMB_WIDTH = 32;
+const int KeyFrameDatabase::THUMB_HEIGHT = 24;
+
+KeyFrameDatabase::KeyFrameDatabase() {
+}
+
+void KeyFrameDatabase::add(KeyFrame *pKF) {
+  if (pKF->mvImagePyramid.empty() || pKF->mvImagePyramid[0].empty())
+    return;
+
+  {
+    unique_lock<mutex> lock(mMutex);
+    if (mIndices.count(pKF))
+      return;
+  }
+
+  vector<float> desc;
+  ComputeDescriptor(pKF->mvImagePyramid[0], desc);
+  add(pKF, desc);
+}
+
+void KeyFrameDatabase::add(KeyFrame *pKF, const vector<float> &desc) {
+  if (desc.size() != static_cast<size_t>(THUMB_WIDTH*THUMB_HEIGHT))
+    return;
+
+  unique_lock<mutex> lock(mMutex);
+  if (mIndices.count(pKF))
+    return;
+
+  mIndices[pKF] = mvpKeyFrames.size();
+  mvpKeyFrames.push_back(pKF);
+  mvDescriptors.insert(mvDescriptors.end(), desc.begin(), desc.end());
+}
+
+void KeyFrameDatabase::erase(KeyFrame* pKF) {
+  unique_lock<mutex> lock(mMutex);
+  auto it = mIndices.find(pKF);
+  if (it == mIndices.end())
+    return;
+
+  // Move last row into the erased one
+  const size_t dim = THUMB_WIDTH*THUMB_HEIGHT;
+  size_t idx = it->second;
+  size_t last = mvpKeyFrames.size()-1;
+  if (idx != last) {
+    std::copy(mvDescriptors.begin()+last*dim, mvDescriptors.begin()+(last+1)*dim, mvDescriptors.begin()+idx*dim);
+    mvpKeyFrames[idx] = mvpKeyFrames[last];
+    mIndices[mvpKeyFrames[idx]] = idx;
+  }
+
+  mvpKeyFrames.pop_back();
+  mvDescriptors.resize(last*dim);
+  mIndices.erase(pKF);
+}
+
+void KeyFrameDatabase::clear() {
+  unique_lock<mutex> lock(mMutex);
+  mvpKeyFrames.clear();
+  mvDescriptors.clear();
+  mIndices.clear();
+}
+
+bool KeyFrameDatabase::GetDescriptor(KeyFrame* pKF, vector<float> &desc) {
+  const size_t dim = THUMB_WIDTH*THUMB_HEIGHT;
+
+  unique_lock<mutex> lock(mMutex);
+  auto it = mIndices.find(pKF);
+  if (it == mIndices.end())
+    return false;
+
+  desc.assign(mvDescriptors.begin()+it->second*dim, mvDescriptors.begin()+(it->second+1)*dim);
+  return true;
+}
+
+vector<KeyFrame*> KeyFrameDatabase::DetectLoopCandidates(KeyFrame* pKF, int k, const Gate &gate) {
+  // Discard current and connected keyframes
+  set<KeyFrame*> excluded = pKF->GetConnectedKeyFrames();
+  excluded.insert(pKF);
+
+  return DetectCandidates(pKF, excluded, k, gate);
+}
+
+vector<KeyFrame*> KeyFrameDatabase::DetectCandidates(KeyFrame* pKF, const set<KeyFrame*> &excluded, int k,
+                                                     const Gate &gate) {
+  vector<float> desc;
+
+  // Use stored descriptor, fine pyramid levels may have been released
+  if (!GetDescriptor(pKF, desc)) {
+    if (pKF->mvImagePyramid[0].empty())
+      return vector<KeyFrame*>();
+    ComputeDescriptor(pKF->mvImagePyramid[0], desc);
+  }
+
+  return Query(desc, excluded, k, gate);
+}
+
+vector<KeyFrame*> KeyFrameDatabase::DetectRelocalizationCandidates(Frame *F, int k, const Gate &gate) {
+  vector<float> desc;
+  ComputeDescriptor(F->mvImagePyramid[0], desc);
+
+  return Query(desc, set<KeyFrame*>(), k, gate);
+}
+
+void KeyFrameDatabase::ComputeDescriptor(const cv::Mat &im, vector<float> &desc) {
+  const int dim = THUMB_WIDTH*THUMB_HEIGHT;
+  cv::Mat thumb, blurred;
+
+  cv::resize(im, thumb, cv::Size(THUMB_WIDTH, THUMB_HEIGHT), 0, 0, cv::INTER_AREA);
+  cv::GaussianBlur(thumb, blurred, cv::Size(3, 3), 0.75);
+
+  desc.resize(dim);
+  float mean = 0.0;
+  for (int y = 0; y < THUMB_HEIGHT; y++) {
+    const uchar* row = blurred.ptr<uchar>(y);
+    for (int x = 0; x < THUMB_WIDTH; x++) {
+      desc[y*THUMB_WIDTH+x] = row[x];
+      mean += row[x];
+    }
+  }
+  mean /= dim;
+
+  // Zero mean and unit norm, so dot product is the normalized cross correlation
+  float norm = 0.0;
+  for (int i = 0; i < dim; i++) {
+    desc[i] -= mean;
+    norm += desc[i]*desc[i];
+  }
+
+  norm = sqrt(norm);
+  if (norm < 1e-6)
+    return;
+
+  for (int i = 0; i < dim; i++)
+    desc[i] /= norm;
+}
+
+vector<KeyFrame*> KeyFrameDatabase::Query(const vector<float> &desc, const set<KeyFrame*> &excluded, int k,
+                                          const Gate &gate) {
+  const int dim = THUMB_WIDTH*THUMB_HEIGHT;
+  const double r2 = gate.radius*gate.radius;
+  ScratchScope scratch;
+  ScratchVector<pair<float, KeyFrame*> > scores;
+
+  {
+    unique_lock<mutex> lock(mMutex);
+    scores.reserve(mvpKeyFrames.size());
+
+    const float* q = desc.data();
+    for (size_t i = 0; i < mvpKeyFrames.size(); i++) {
+      KeyFrame* pKF = mvpKeyFrames[i];
+      if (excluded.count(pKF))
+        continue;
+
+      // Implausible places are not scored
+      if (gate.Enabled() && (pKF->GetCameraCenter()-gate.center).squaredNorm() > r2)
+        continue;
+
+      const float* d = &mvDescriptors[i*dim];
+      float score = 0.0;
+      for (int j = 0; j < dim; j++)
+        score += q[j]*d[j];
+
+      scores.push_back(std::make_pair(score, pKF));
+    }
+  }
+
+  // Keep best k
+  size_t n = std::min(scores.size(), static_cast<size_t>(std::max(k, 0)));
+  std::partial_sort(scores.begin(), scores.begin()+n, scores.end(),
+                    [](const pair<float, KeyFrame*> &a, const pair<float, KeyFrame*> &b) { return a.first > b.first; });
+
+  vector<KeyFrame*> candidates;
+  candidates.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    if (!scores[i].second->isBad())
+      candidates.push_back(scores[i].second);
+  }
+
+  return candidates;
+}
+
+}  // namespace SD_SLAM
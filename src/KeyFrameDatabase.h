@@ -0,0 +1,92 @@
+/**
+ *
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_KEYFRAMEDATABASE_H
+#define SD_SLAM_KEYFRAMEDATABASE_H
+
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <Eigen/Dense>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+class KeyFrame;
+class Frame;
+
+// Appearance index over keyframes. Each keyframe is summarized by a small blurred,
+// zero-mean and normalized thumbnail, so queries are a dot product per keyframe.
+class KeyFrameDatabase {
+ public:
+  // Spatial gate from a pose prior: only keyframes whose camera center lies within radius of
+  // center are scored. Disabled if radius is negative
+  struct Gate {
+    Gate(): radius(-1.0) {}
+    Gate(const Eigen::Vector3d &c, double r): center(c), radius(r) {}
+
+    inline bool Enabled() const { return radius >= 0.0; }
+
+    Eigen::Vector3d center;
+    double radius;
+  };
+
+  KeyFrameDatabase();
+
+  void add(KeyFrame* pKF);
+  void add(KeyFrame* pKF, const std::vector<float> &desc);
+  void erase(KeyFrame* pKF);
+  void clear();
+
+  // Loop detection: best k keyframes not connected to pKF
+  std::vector<KeyFrame*> DetectLoopCandidates(KeyFrame* pKF, int k, const Gate &gate = Gate());
+
+  // Best k keyframes for pKF, skipping excluded ones
+  std::vector<KeyFrame*> DetectCandidates(KeyFrame* pKF, const std::set<KeyFrame*> &excluded, int k,
+                                          const Gate &gate = Gate());
+
+  // Relocalization: best k keyframes for frame F
+  std::vector<KeyFrame*> DetectRelocalizationCandidates(Frame* F, int k, const Gate &gate = Gate());
+
+  // Get stored descriptor of pKF. Returns false if it is not indexed
+  bool GetDescriptor(KeyFrame* pKF, std::vector<float> &desc);
+
+  // Compute global descriptor from the finest pyramid level
+  static void ComputeDescriptor(const cv::Mat &im, std::vector<float> &desc);
+
+  static const int THUMB_WIDTH;
+  static const int THUMB_HEIGHT;
+
+ protected:
+  // Return the k most similar keyframes, skipping excluded ones and those outside gate
+  std::vector<KeyFrame*> Query(const std::vector<float> &desc, const std::set<KeyFrame*> &excluded, int k,
+                               const Gate &gate = Gate());
+
+  // Keyframes and their descriptors, stored contiguously (row i belongs to mvpKeyFrames[i])
+  std::vector<KeyFrame*> mvpKeyFrames;
+  std::vector<float> mvDescriptors;
+  std::unordered_map<KeyFrame*, size_t> mIndices;
+
+  std::mutex mMutex;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_KEYFRAMEDATABASE_H
@@ -0,0 +1,299 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "KeyFramePager.h"
+#include <cmath>
+#include <algorithm>
+#include "KeyFrame.h"
+#include "extra/log.h"
+#include "extra/image_codec.h"
+
+using std::vector;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+KeyFramePager::KeyFramePager() : mbEnabled(false), mbCompress(false), mbMemory(false), mDepthStep(0.001f),
+                                 mnNextBlob(0), mTileSize(1.0), mRadius(1) {
+}
+
+bool KeyFramePager::Open(const std::string &filename, double tileSize, int radius, bool compress, float depthStep) {
+  unique_lock<mutex> lock(mMutex);
+  mbMemory = filename.empty();
+  if (mbMemory && !compress)
+    return false;
+
+  if (!mbMemory) {
+    mFile.open(filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!mFile.is_open()) {
+      LOGE("Can't open paging file %s", filename.c_str());
+      return false;
+    }
+  }
+
+  mFilename = filename;
+  mTileSize = tileSize;
+  mRadius = radius;
+  mbCompress = compress;
+  mDepthStep = depthStep;
+  mbEnabled = true;
+  return true;
+}
+
+void KeyFramePager::Add(KeyFrame* pKF) {
+  if (!mbEnabled)
+    return;
+
+  unique_lock<mutex> lock(mMutex);
+  Entry &entry = mEntries[pKF];
+  entry.resident = true;
+  entry.pins = 0;
+  entry.vLevelOffsets.assign(pKF->mvImagePyramid.size(), -1);
+  entry.nDepthOffset = -1;
+}
+
+void KeyFramePager::Erase(KeyFrame* pKF) {
+  if (!mbEnabled)
+    return;
+
+  // Space in the file is not reused, it is reclaimed when the map is cleared
+  unique_lock<mutex> lock(mMutex);
+  auto it = mEntries.find(pKF);
+  if (it == mEntries.end())
+    return;
+
+  if (mbMemory) {
+    for (int64_t offset : it->second.vLevelOffsets)
+      mBlobs.erase(offset);
+    mBlobs.erase(it->second.nDepthOffset);
+  }
+  mEntries.erase(it);
+}
+
+void KeyFramePager::Clear() {
+  if (!mbEnabled)
+    return;
+
+  unique_lock<mutex> lock(mMutex);
+  mEntries.clear();
+  mBlobs.clear();
+  if (!mbMemory) {
+    mFile.close();
+    mFile.open(mFilename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+  }
+}
+
+int KeyFramePager::TileDistance(const Eigen::Vector3d &a, const Eigen::Vector3d &b) const {
+  int d = 0;
+  for (int i = 0; i < 3; i++) {
+    int ta = static_cast<int>(std::floor(a(i)/mTileSize));
+    int tb = static_cast<int>(std::floor(b(i)/mTileSize));
+    d = std::max(d, std::abs(ta-tb));
+  }
+  return d;
+}
+
+void KeyFramePager::Update(const Eigen::Vector3d &position) {
+  if (!mbEnabled)
+    return;
+
+  unique_lock<mutex> lock(mMutex);
+  int nOut = 0, nIn = 0;
+  for (auto &kv : mEntries) {
+    KeyFrame* pKF = kv.first;
+    Entry &entry = kv.second;
+
+    // Poses change after BA and loop closure, tiles are computed from current ones
+    const bool bNear = TileDistance(pKF->GetCameraCenter(), position) <= mRadius;
+    if (entry.resident && !bNear && entry.pins == 0) {
+      PageOut(pKF, entry);
+      nOut++;
+    } else if (!entry.resident && bNear) {
+      PageIn(pKF, entry);
+      nIn++;
+    }
+  }
+
+  if (nOut > 0 || nIn > 0) {
+    LOGD("Paged out %d keyframes, paged in %d", nOut, nIn);
+  }
+}
+
+void KeyFramePager::Acquire(KeyFrame* pKF) {
+  if (!mbEnabled)
+    return;
+
+  unique_lock<mutex> lock(mMutex);
+  auto it = mEntries.find(pKF);
+  if (it == mEntries.end())
+    return;
+
+  if (!it->second.resident)
+    PageIn(pKF, it->second);
+  it->second.pins++;
+}
+
+void KeyFramePager::Release(KeyFrame* pKF) {
+  if (!mbEnabled)
+    return;
+
+  unique_lock<mutex> lock(mMutex);
+  auto it = mEntries.find(pKF);
+  if (it != mEntries.end() && it->second.pins > 0)
+    it->second.pins--;
+}
+
+size_t KeyFramePager::ResidentKeyFrames() {
+  unique_lock<mutex> lock(mMutex);
+  size_t n = 0;
+  for (const auto &kv : mEntries) {
+    if (kv.second.resident)
+      n++;
+  }
+  return n;
+}
+
+void KeyFramePager::GetImageBytes(KeyFrame* pKF, size_t &images, size_t &depth) {
+  unique_lock<mutex> lock(mMutex);
+  images = 0;
+  for (const cv::Mat &im : pKF->mvImagePyramid)
+    images += im.total()*im.elemSize();
+  depth = pKF->mDepthImage.total()*pKF->mDepthImage.elemSize();
+
+  // Compressed copies are kept while images are resident too
+  auto it = mEntries.find(pKF);
+  if (mbMemory && it != mEntries.end()) {
+    for (int64_t offset : it->second.vLevelOffsets) {
+      auto bit = mBlobs.find(offset);
+      if (bit != mBlobs.end())
+        images += bit->second.capacity();
+    }
+    auto bit = mBlobs.find(it->second.nDepthOffset);
+    if (bit != mBlobs.end())
+      depth += bit->second.capacity();
+  }
+}
+
+void KeyFramePager::PageOut(KeyFrame* pKF, Entry &entry) {
+  // Images are read-only, they are written the first time only. Levels released
+  // meanwhile are not restored
+  vector<cv::Mat> &pyramid = pKF->mvImagePyramid;
+  entry.vLevelOffsets.resize(pyramid.size(), -1);
+  for (size_t l = 0; l < pyramid.size(); l++) {
+    if (pyramid[l].empty())
+      entry.vLevelOffsets[l] = -1;
+    else if (entry.vLevelOffsets[l] < 0)
+      entry.vLevelOffsets[l] = WriteMat(pyramid[l], 0.0f);
+    pyramid[l].release();
+  }
+
+  if (pKF->mDepthImage.empty())
+    entry.nDepthOffset = -1;
+  else if (entry.nDepthOffset < 0)
+    entry.nDepthOffset = WriteMat(pKF->mDepthImage, mDepthStep);
+  pKF->mDepthImage.release();
+
+  entry.resident = false;
+}
+
+void KeyFramePager::PageIn(KeyFrame* pKF, Entry &entry) {
+  vector<cv::Mat> &pyramid = pKF->mvImagePyramid;
+  for (size_t l = 0; l < pyramid.size() && l < entry.vLevelOffsets.size(); l++) {
+    if (entry.vLevelOffsets[l] >= 0)
+      pyramid[l] = ReadMat(entry.vLevelOffsets[l]);
+  }
+
+  if (entry.nDepthOffset >= 0)
+    pKF->mDepthImage = ReadMat(entry.nDepthOffset);
+
+  entry.resident = true;
+}
+
+int64_t KeyFramePager::WriteMat(const cv::Mat &m, float step) {
+  if (mbCompress) {
+    vector<uint8_t> data;
+    CompressImage(m, step, data);
+
+    if (mbMemory) {
+      data.shrink_to_fit();
+      mBlobs[mnNextBlob].swap(data);
+      return mnNextBlob++;
+    }
+
+    mFile.seekp(0, std::ios::end);
+    int64_t offset = static_cast<int64_t>(mFile.tellp());
+    uint64_t size = data.size();
+    mFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    mFile.write(reinterpret_cast<const char*>(data.data()), data.size());
+    return offset;
+  }
+
+  mFile.seekp(0, std::ios::end);
+  int64_t offset = static_cast<int64_t>(mFile.tellp());
+
+  int32_t header[3] = {m.rows, m.cols, m.type()};
+  mFile.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+  // Images can be submatrices, rows are written contiguously
+  size_t row_size = m.cols*m.elemSize();
+  for (int r = 0; r < m.rows; r++)
+    mFile.write(reinterpret_cast<const char*>(m.ptr(r)), row_size);
+
+  return offset;
+}
+
+cv::Mat KeyFramePager::ReadMat(int64_t offset) {
+  if (mbMemory) {
+    auto it = mBlobs.find(offset);
+    if (it == mBlobs.end())
+      return cv::Mat();
+    return DecompressImage(it->second.data(), it->second.size());
+  }
+
+  mFile.seekg(offset);
+
+  if (mbCompress) {
+    uint64_t size = 0;
+    mFile.read(reinterpret_cast<char*>(&size), sizeof(size));
+    vector<uint8_t> data(mFile ? size : 0);
+    mFile.read(reinterpret_cast<char*>(data.data()), data.size());
+    cv::Mat m = DecompressImage(data.data(), data.size());
+    if (!mFile || m.empty()) {
+      LOGE("Can't read paged image at %ld", static_cast<long>(offset));
+      mFile.clear();
+      return cv::Mat();
+    }
+    return m;
+  }
+
+  int32_t header[3];
+  mFile.read(reinterpret_cast<char*>(header), sizeof(header));
+
+  cv::Mat m(header[0], header[1], header[2]);
+  mFile.read(reinterpret_cast<char*>(m.data), m.total()*m.elemSize());
+  if (!mFile) {
+    LOGE("Can't read paged image at %ld", static_cast<long>(offset));
+    mFile.clear();
+    return cv::Mat();
+  }
+
+  return m;
+}
+
+}  // namespace SD_SLAM
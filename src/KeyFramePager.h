@@ -0,0 +1,118 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_KEYFRAMEPAGER_H
+#define SD_SLAM_KEYFRAMEPAGER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include <mutex>
+#include <Eigen/Dense>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+class KeyFrame;
+
+// Pages keyframe images (pyramid and depth image) out to a swap file. Keyframes are grouped
+// in cubic tiles by camera center, images of keyframes in tiles farther than a radius from
+// the mapping position are written once to disk and released. They are read back when mapping
+// gets close again, or while a keyframe is acquired (relocalization, loop detection).
+// Paged images can be compressed (see CompressImage), then they can also be kept in memory
+// instead of a swap file.
+class KeyFramePager {
+ public:
+  KeyFramePager();
+
+  // Page to filename, which is truncated, or to memory if filename is empty (compress must be
+  // set then). Depth images are compressed with depthStep. Returns false if it can't be opened
+  bool Open(const std::string &filename, double tileSize, int radius, bool compress = false, float depthStep = 0.001f);
+
+  // Paging is enabled once at startup, it is not changed while threads are running
+  inline bool IsEnabled() const { return mbEnabled; }
+
+  void Add(KeyFrame* pKF);
+  void Erase(KeyFrame* pKF);
+  void Clear();
+
+  // Page out keyframes in tiles far from position and page in those around it
+  void Update(const Eigen::Vector3d &position);
+
+  // Load images of pKF if they were paged out. They are kept in memory until released
+  void Acquire(KeyFrame* pKF);
+  void Release(KeyFrame* pKF);
+
+  // Number of keyframes with images in memory
+  size_t ResidentKeyFrames();
+
+  // Bytes of the pyramid and depth image of pKF currently in memory, compressed or not
+  void GetImageBytes(KeyFrame* pKF, size_t &images, size_t &depth);
+
+ protected:
+  struct Entry {
+    bool resident;
+    int pins;
+    std::vector<int64_t> vLevelOffsets;   // -1 for empty levels
+    int64_t nDepthOffset;                 // -1 without depth image
+  };
+
+  // Write images not stored yet and release them
+  void PageOut(KeyFrame* pKF, Entry &entry);
+  void PageIn(KeyFrame* pKF, Entry &entry);
+
+  // Store image and return its offset in the file, or its key in memory
+  int64_t WriteMat(const cv::Mat &m, float step);
+  cv::Mat ReadMat(int64_t offset);
+
+  int TileDistance(const Eigen::Vector3d &a, const Eigen::Vector3d &b) const;
+
+  std::unordered_map<KeyFrame*, Entry> mEntries;
+
+  std::fstream mFile;
+  std::string mFilename;
+  bool mbEnabled;
+  bool mbCompress;
+  bool mbMemory;
+  float mDepthStep;
+
+  // Compressed images when there is no swap file
+  std::unordered_map<int64_t, std::vector<uint8_t> > mBlobs;
+  int64_t mnNextBlob;
+  double mTileSize;
+  int mRadius;
+
+  std::mutex mMutex;
+};
+
+// Keeps the images of a keyframe in memory while in scope
+class ScopedPage {
+ public:
+  ScopedPage(KeyFramePager* pPager, KeyFrame* pKF) : mpPager(pPager), mpKF(pKF) { mpPager->Acquire(mpKF); }
+  ~ScopedPage() { mpPager->Release(mpKF); }
+
+ private:
+  KeyFramePager* mpPager;
+  KeyFrame* mpKF;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_KEYFRAMEPAGER_H
@@ -23,12 +23,19 @@
  */
 
 #include "LocalMapping.h"
-#include <unistd.h>
 #include "LoopClosing.h"
 #include "ORBmatcher.h"
 #include "Optimizer.h"
-#include "Converter.h"
+#include "ImageAlign.h"
+#include "Config.h"
 #include "extra/log.h"
+#include "extra/timer.h"
+#include "extra/utils.h"
+#include "extra/lie.h"
+#include "extra/trace.h"
+#include "extra/stats.h"
+#include "extra/metrics.h"
+#include "extra/scratch_arena.h"
 
 using std::vector;
 using std::list;
@@ -39,24 +46,52 @@ using std::endl;
 
 namespace SD_SLAM {
 
-LocalMapping::LocalMapping(Map *pMap, const float bMonocular):
+LocalMapping::LocalMapping(Map *pMap, const float bMonocular, ThreadPool* pPool):
   mbMonocular(bMonocular), mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-  mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true) {
+  mbWakeUp(false), mbIdle(false), mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true),
+  mnBAMaxLocalKFs(0), mKeyFrameTime(0.0), mBATime(0.0), mbBAInProgress(false), mpPipelineKF(nullptr),
+  mbBARequested(false), mbBAFinish(false) {
 
   mpLoopCloser = nullptr;
   mpTracker = nullptr;
+  mpEnergy = nullptr;
+  mnLastBigChangeIdx = 0;
+
+  mpThreadPool = nullptr;
+  if (Config::ThreadsMapping() > 1)
+    mpThreadPool = pPool;
+
+  // Sliding window BA changes its window while keyframes are inserted, it is never pipelined
+  mbPipelined = Config::PipelinedMapping() && Config::WindowSize() == 0;
+}
+
+LocalMapping::~LocalMapping() {
 }
 
 void LocalMapping::SetLoopCloser(LoopClosing* pLoopCloser) {
   mpLoopCloser = pLoopCloser;
 }
 
+void LocalMapping::SetEnergyPolicy(EnergyPolicy* pEnergy) {
+  mpEnergy = pEnergy;
+}
+
 void LocalMapping::SetTracker(Tracking *pTracker) {
   mpTracker=pTracker;
 }
 
 void LocalMapping::Run() {
   mbFinished = false;
+  SetThreadPlacement(Config::MappingCore(), 0, Config::MappingNice());
+  Trace::SetThreadName("LocalMapping");
+  ScopedParticipant participant(mpMap->GetReclaimer());
+
+  // Local BA of pipelined mode runs on its own thread while this one is running
+  std::thread tBA;
+  if (mbPipelined) {
+    mbBAFinish = false;
+    tBA = std::thread(&LocalMapping::RunBA, this);
+  }
 
   while (1) {
     // Tracking will see that Local Mapping is busy
@@ -64,12 +99,18 @@ void LocalMapping::Run() {
 
     // Check if there are keyframes in the queue
     if (CheckNewKeyFrames()) {
+      Timer tkeyframe(true);
+
       // Insertion in Map
       ProcessNewKeyFrame();
 
       // Check recent MapPoints
       MapPointCulling();
 
+      // Bad points have left the recent list, no older pointer is kept from here
+      // but the point batch, applied before collecting
+      participant.Quiescent();
+
       // Triangulate new MapPoints
       CreateNewMapPoints();
 
@@ -78,26 +119,73 @@ void LocalMapping::Run() {
         SearchInNeighbors();
       }
 
-      mbAbortBA = false;
+      if (mbPipelined) {
+        // Previous keyframe is committed once its BA is done, before this one is optimized
+        CommitPipelined();
+
+        mPointBatch.Apply(mpThreadPool, Config::ThreadsMapping());
+
+        mpPipelineKF = mpCurrentKeyFrame;
+        if (!StartPipelinedBA())
+          CommitPipelined();
 
-      if (!CheckNewKeyFrames() && !stopRequested()) {
-        // Local BA
-        if (mpMap->KeyFramesInMap()>2)
-          Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame, &mbAbortBA, mpMap);
+        tkeyframe.Stop();
+        RecordKeyFrameTime(tkeyframe.GetMsTime());
+      } else {
+        mbAbortBA = false;
+
+        if (!CheckNewKeyFrames() && !stopRequested()) {
+          // Local BA
+          if (mpMap->KeyFramesInMap()>2) {
+            if (Config::WindowSize() > 0) {
+              SD_TRACE("LocalBundleAdjustment");
+              SetBAStarted(true);
+              ScopedSpan span(Statistics::LOCAL_BA);
+              WindowBundleAdjustment();
+              SetBAStarted(false);
+            } else {
+              LocalBundleAdjustment(mpCurrentKeyFrame, &mPointBatch);
+            }
+          }
 
-        // Check redundant local Keyframes
-        KeyFrameCulling();
+          // Check redundant local Keyframes
+          KeyFrameCulling(mpCurrentKeyFrame);
+        }
+
+        // Descriptors, normals and depths of new observations and optimized points
+        mPointBatch.Apply(mpThreadPool, Config::ThreadsMapping());
+
+        // Readers see the map once this keyframe is optimized
+        mpMap->PublishSnapshot();
+        Statistics::RecordLatency(Statistics::CAPTURE_TO_MAP, mpCurrentKeyFrame->mTimeStamp,
+                                  Config::InputTimestampClock());
+        UpdateMetrics();
+
+        tkeyframe.Stop();
+        RecordKeyFrameTime(tkeyframe.GetMsTime());
+
+        // Free culled points and keyframes no thread can reference anymore
+        mpMap->CollectGarbage();
+
+        if (mpLoopCloser)
+          mpLoopCloser->InsertKeyFrame(mpCurrentKeyFrame);
       }
 
-      if (mpLoopCloser)
-        mpLoopCloser->InsertKeyFrame(mpCurrentKeyFrame);
-    } else if (Stop()) {
-      // Safe area to stop
-      while (isStopped() && !CheckFinish()) {
-        usleep(3000);
+      // Keyframes are not accepted while resting, Tracking inserts fewer of them
+      if (mpEnergy)
+        mpEnergy->Rest(tkeyframe.GetMsTime());
+    } else {
+      // Pipelined keyframe is committed before sleeping or stopping
+      CommitPipelined();
+
+      if (Stop()) {
+        // Safe area to stop
+        while (isStopped() && !CheckFinish()) {
+          WaitForEvent();
+        }
+        if (CheckFinish())
+          break;
       }
-      if (CheckFinish())
-        break;
     }
 
     ResetIfRequested();
@@ -108,16 +196,118 @@ void LocalMapping::Run() {
     if (CheckFinish())
       break;
 
-    usleep(3000);
+    WaitForWork();
+  }
+
+  if (mbPipelined) {
+    CommitPipelined();
+    {
+      unique_lock<mutex> lock(mMutexPipeline);
+      mbBAFinish = true;
+      mCondPipeline.notify_all();
+    }
+    tBA.join();
   }
 
   SetFinish();
 }
 
+void LocalMapping::LocalBundleAdjustment(KeyFrame* pKF, MapPointBatch* pBatch) {
+  SD_TRACE("LocalBundleAdjustment");
+  SetBAStarted(true);
+
+  Optimizer::LocalBABudget budget;
+  budget.nMaxLocalKFs = mnBAMaxLocalKFs;
+  budget.nMaxFixedKFs = Config::LocalBAMaxFixed();
+  budget.nMaxObservations = Config::LocalBAMaxObservations();
+  Timer tba(true);
+  const int nLocalKFs = Optimizer::LocalBundleAdjustment(pKF, &mbAbortBA, mpMap, Config::ThreadsBA(), pBatch, &budget);
+  tba.Stop();
+  Statistics::Record(Statistics::LOCAL_BA, tba.GetMsTime());
+
+  SetBAStarted(false);
+  if (!mbAbortBA)
+    UpdateBABudget(nLocalKFs, tba.GetMsTime());
+}
+
+void LocalMapping::RunBA() {
+  Trace::SetThreadName("LocalBA");
+  ScopedParticipant participant(mpMap->GetReclaimer());
+
+  unique_lock<mutex> lock(mMutexPipeline);
+  while (1) {
+    // No pointer is kept between keyframes
+    participant.Quiescent();
+
+    mCondPipeline.wait(lock, [this] { return mbBARequested || mbBAFinish; });
+    if (mbBAFinish)
+      break;
+
+    KeyFrame* pKF = mpPipelineKF;
+    lock.unlock();
+
+    // Points are updated as they are written, a batch can't be shared with the mapping thread
+    LocalBundleAdjustment(pKF, nullptr);
+
+    lock.lock();
+    mbBARequested = false;
+    mCondPipeline.notify_all();
+
+    // Mapping thread may be sleeping with this keyframe to commit
+    lock.unlock();
+    WakeUp();
+    lock.lock();
+  }
+}
+
+bool LocalMapping::StartPipelinedBA() {
+  if (stopRequested() || mpMap->KeyFramesInMap() <= 2)
+    return false;
+
+  mbAbortBA = false;
+
+  unique_lock<mutex> lock(mMutexPipeline);
+  mbBARequested = true;
+  mCondPipeline.notify_all();
+  return true;
+}
+
+void LocalMapping::WaitPipelinedBA() {
+  unique_lock<mutex> lock(mMutexPipeline);
+  mCondPipeline.wait(lock, [this] { return !mbBARequested; });
+}
+
+void LocalMapping::CommitPipelined() {
+  if (!mpPipelineKF)
+    return;
+
+  WaitPipelinedBA();
+  KeyFrame* pKF = mpPipelineKF;
+  mpPipelineKF = nullptr;
+
+  // Check redundant local Keyframes
+  if (!stopRequested())
+    KeyFrameCulling(pKF);
+
+  mpMap->PublishSnapshot();
+  Statistics::RecordLatency(Statistics::CAPTURE_TO_MAP, pKF->mTimeStamp, Config::InputTimestampClock());
+  UpdateMetrics();
+
+  mpMap->CollectGarbage();
+
+  if (mpLoopCloser)
+    mpLoopCloser->InsertKeyFrame(pKF);
+}
+
 void LocalMapping::InsertKeyFrame(KeyFrame *pKF) {
   unique_lock<mutex> lock(mMutexNewKFs);
   mlNewKeyFrames.push_back(pKF);
-  mbAbortBA=true;
+  Metrics::Set(Metrics::LOCAL_MAPPING_QUEUE, mlNewKeyFrames.size());
+  mbIdle = false;
+  // Pipelined BA is not aborted, the keyframe is processed meanwhile
+  if (!mbPipelined)
+    mbAbortBA=true;
+  mCondNewKFs.notify_one();
 }
 
 
@@ -126,15 +316,51 @@ bool LocalMapping::CheckNewKeyFrames() {
   return(!mlNewKeyFrames.empty());
 }
 
+void LocalMapping::WakeUp() {
+  unique_lock<mutex> lock(mMutexNewKFs);
+  mbWakeUp = true;
+  mCondNewKFs.notify_one();
+}
+
+void LocalMapping::WaitForWork() {
+  unique_lock<mutex> lock(mMutexNewKFs);
+  if (mlNewKeyFrames.empty() && !mpPipelineKF) {
+    mbIdle = true;
+    mCondIdle.notify_all();
+  }
+  mCondNewKFs.wait(lock, [this] { return mbWakeUp || !mlNewKeyFrames.empty(); });
+  mbWakeUp = false;
+  mbIdle = false;
+}
+
+void LocalMapping::WaitForEvent() {
+  unique_lock<mutex> lock(mMutexNewKFs);
+  mbIdle = true;
+  mCondIdle.notify_all();
+  mCondNewKFs.wait(lock, [this] { return mbWakeUp; });
+  mbWakeUp = false;
+  mbIdle = false;
+}
+
+void LocalMapping::WaitUntilIdle() {
+  ScopedTrace trace("WaitLocalMappingIdle", "wait");
+  unique_lock<mutex> lock(mMutexNewKFs);
+  mCondIdle.wait(lock, [this] { return mbIdle; });
+}
+
 void LocalMapping::ProcessNewKeyFrame() {
+  SD_TRACE("ProcessNewKeyFrame");
   {
     unique_lock<mutex> lock(mMutexNewKFs);
     mpCurrentKeyFrame = mlNewKeyFrames.front();
     mlNewKeyFrames.pop_front();
+    Metrics::Set(Metrics::LOCAL_MAPPING_QUEUE, mlNewKeyFrames.size());
   }
 
-  // Associate MapPoints to the new keyframe and update normal and descriptor
-  const vector<MapPoint*> vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
+  // Associate MapPoints to the new keyframe, normal and descriptor are updated in batch
+  ScratchScope scratch;
+  ScratchVector<MapPoint*> vpMapPointMatches;
+  mpCurrentKeyFrame->GetMapPointMatches(vpMapPointMatches);
 
   for (size_t i = 0; i < vpMapPointMatches.size(); i++) {
     MapPoint* pMP = vpMapPointMatches[i];
@@ -142,10 +368,11 @@ void LocalMapping::ProcessNewKeyFrame() {
       if (!pMP->isBad()) {
         if (!pMP->IsInKeyFrame(mpCurrentKeyFrame)) {
           pMP->AddObservation(mpCurrentKeyFrame, i);
-          pMP->UpdateNormalAndDepth();
-          pMP->ComputeDistinctiveDescriptors();
+          mPointBatch.Add(pMP, true);
         } else { // this can only happen for new stereo points inserted by the Tracking
           mlpRecentAddedMapPoints.push_back(pMP);
+          // Created with the descriptor, normal and depth of this keyframe only
+          mPointBatch.Add(pMP, true);
         }
       }
     }
@@ -154,11 +381,32 @@ void LocalMapping::ProcessNewKeyFrame() {
   // Update links in the Covisibility Graph
   mpCurrentKeyFrame->UpdateConnections();
 
+  // Quantize descriptors before loop closing can use them
+  mpCurrentKeyFrame->ComputeBoW(mpMap->GetVocabulary());
+
   // Insert Keyframe in Map
   mpMap->AddKeyFrame(mpCurrentKeyFrame);
+
+  // Keyframes leaving the window only keep the levels used by image alignment
+  int window = Config::PyramidWindow();
+  if (window > 0) {
+    mlpPyramidKeyFrames.push_back(mpCurrentKeyFrame);
+    while (static_cast<int>(mlpPyramidKeyFrames.size()) > window) {
+      mlpPyramidKeyFrames.front()->ReleasePyramidLevels(ImageAlign::MIN_LEVEL);
+      mlpPyramidKeyFrames.pop_front();
+    }
+  }
+
+  // Keyframes far from the current one move their images to disk
+  mpMap->GetPager()->Update(mpCurrentKeyFrame->GetCameraCenter());
+
+  // Sliding window BA keeps newest keyframes, oldest ones are marginalized after BA
+  if (Config::WindowSize() > 0)
+    mlpWindowKeyFrames.push_back(mpCurrentKeyFrame);
 }
 
 void LocalMapping::MapPointCulling() {
+  SD_TRACE("MapPointCulling");
   // Check Recent Added MapPoints
   list<MapPoint*>::iterator lit = mlpRecentAddedMapPoints.begin();
   const unsigned long int nCurrentKFid = mpCurrentKeyFrame->mnId;
@@ -188,12 +436,57 @@ void LocalMapping::MapPointCulling() {
 }
 
 void LocalMapping::CreateNewMapPoints() {
+  SD_TRACE("CreateNewMapPoints");
   // Retrieve neighbor keyframes in covisibility graph
   int nn = 10;
   if (mbMonocular)
     nn=20;
   const vector<KeyFrame*> vpNeighKFs = mpCurrentKeyFrame->GetBestCovisibilityKeyFrames(nn);
 
+  // Search matches with epipolar restriction and triangulate, each neighbor is independent
+  vector<vector<NewPoint> > vvNewPoints(vpNeighKFs.size());
+  ParallelFor(vpNeighKFs.size(), [&](int i) {
+    TriangulateWithNeighbor(vpNeighKFs[i], vvNewPoints[i]);
+  });
+
+  // Create map points in neighbor order. A keypoint triangulated with several neighbors
+  // is only used by the first one, as it would already have a map point when matching the rest
+  ScratchScope scratch;
+  ScratchVector<bool> vbUsed(mpCurrentKeyFrame->N, false);
+  int nnew = 0;
+
+  for (size_t i = 0; i < vpNeighKFs.size(); i++) {
+    if (i > 0 && CheckNewKeyFrames())
+      return;
+
+    KeyFrame* pKF2 = vpNeighKFs[i];
+
+    for (const NewPoint &np : vvNewPoints[i]) {
+      if (vbUsed[np.idx1])
+        continue;
+      vbUsed[np.idx1] = true;
+
+      MapPoint* pMP = new MapPoint(np.x3D, mpCurrentKeyFrame, mpMap);
+
+      pMP->AddObservation(mpCurrentKeyFrame, np.idx1);
+      pMP->AddObservation(pKF2, np.idx2);
+
+      mpCurrentKeyFrame->AddMapPoint(pMP, np.idx1);
+      pKF2->AddMapPoint(pMP, np.idx2);
+
+      pMP->ComputeDistinctiveDescriptors();
+
+      pMP->UpdateNormalAndDepth();
+
+      mpMap->AddMapPoint(pMP);
+      mlpRecentAddedMapPoints.push_back(pMP);
+
+      nnew++;
+    }
+  }
+}
+
+void LocalMapping::TriangulateWithNeighbor(KeyFrame* pKF2, vector<NewPoint> &vNewPoints) {
   ORBmatcher matcher(0.6, false);
 
   Eigen::Matrix3d Rcw1 = mpCurrentKeyFrame->GetRotation();
@@ -213,213 +506,233 @@ void LocalMapping::CreateNewMapPoints() {
 
   const float ratioFactor = 1.5f*mpCurrentKeyFrame->mfScaleFactor;
 
-  int nnew = 0;
+  // Check first that baseline is not too short
+  Eigen::Vector3d Ow2 = pKF2->GetCameraCenter();
+  Eigen::Vector3d vBaseline = Ow2-Ow1;
+  const float baseline = vBaseline.norm();
 
-  // Search matches with epipolar restriction and triangulate
-  for (size_t i = 0; i < vpNeighKFs.size(); i++) {
-    if (i > 0 && CheckNewKeyFrames())
+  if (!mbMonocular) {
+    if (baseline<pKF2->mb)
       return;
+  } else {
+    const float medianDepthKF2 = pKF2->ComputeSceneMedianDepth(2);
+    const float ratioBaselineDepth = baseline/medianDepthKF2;
 
-    KeyFrame* pKF2 = vpNeighKFs[i];
+    if (ratioBaselineDepth < 0.01)
+      return;
+  }
+
+  // Compute Fundamental Matrix
+  Eigen::Matrix3d F12 = ComputeF12(mpCurrentKeyFrame, pKF2);
+
+  // Search matches that fullfil epipolar constraint
+  vector<std::pair<size_t, size_t> > vMatchedIndices;
+  matcher.SearchForTriangulation(mpCurrentKeyFrame, pKF2, F12, vMatchedIndices);
+
+  Eigen::Matrix3d Rcw2 = pKF2->GetRotation();
+  Eigen::Matrix3d Rwc2 = Rcw2.transpose();
+  Eigen::Vector3d tcw2 = pKF2->GetTranslation();
+  Eigen::Matrix<double, 3, 4> Tcw2;
+  Tcw2.block<3, 3>(0, 0) = Rcw2;
+  Tcw2.block<3, 1>(0, 3) = tcw2;
+
+  const float &fx2 = pKF2->fx;
+  const float &fy2 = pKF2->fy;
+  const float &cx2 = pKF2->cx;
+  const float &cy2 = pKF2->cy;
+  const float &invfx2 = pKF2->invfx;
+  const float &invfy2 = pKF2->invfy;
+
+  // Triangulate each match
+  const int nmatches = vMatchedIndices.size();
+  for (int ikp = 0; ikp<nmatches; ikp++) {
+    const int &idx1 = vMatchedIndices[ikp].first;
+    const int &idx2 = vMatchedIndices[ikp].second;
+
+    const cv::KeyPoint &kp1 = mpCurrentKeyFrame->mvKeysUn[idx1];
+    const float kp1_ur = mpCurrentKeyFrame->mvuRight[idx1];
+    bool bStereo1 = kp1_ur >= 0;
+
+    const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
+    const float kp2_ur = pKF2->mvuRight[idx2];
+    bool bStereo2 = kp2_ur >= 0;
+
+    // Check parallax between rays
+    Eigen::Vector3d xn1((kp1.pt.x-cx1)*invfx1, (kp1.pt.y-cy1)*invfy1, 1.0);
+    Eigen::Vector3d xn2((kp2.pt.x-cx2)*invfx2, (kp2.pt.y-cy2)*invfy2, 1.0);
+
+    Eigen::Vector3d ray1 = Rwc1*xn1;
+    Eigen::Vector3d ray2 = Rwc2*xn2;
+    const float cosParallaxRays = ray1.dot(ray2)/(ray1.norm()*ray2.norm());
+
+    float cosParallaxStereo = cosParallaxRays+1;
+    float cosParallaxStereo1 = cosParallaxStereo;
+    float cosParallaxStereo2 = cosParallaxStereo;
+
+    if (bStereo1)
+      cosParallaxStereo1 = cos(2*atan2(mpCurrentKeyFrame->mb/2, mpCurrentKeyFrame->mvDepth[idx1]));
+    else if (bStereo2)
+      cosParallaxStereo2 = cos(2*atan2(pKF2->mb/2,pKF2->mvDepth[idx2]));
+
+    cosParallaxStereo = std::min(cosParallaxStereo1, cosParallaxStereo2);
+
+    Eigen::Vector3d x3D;
+    if (cosParallaxRays<cosParallaxStereo && cosParallaxRays > 0 && (bStereo1 || bStereo2 || cosParallaxRays < 0.9998)) {
+      // Linear Triangulation Method
+      Eigen::Matrix4d A;
+      A.row(0) = xn1(0)*Tcw1.row(2)-Tcw1.row(0);
+      A.row(1) = xn1(1)*Tcw1.row(2)-Tcw1.row(1);
+      A.row(2) = xn2(0)*Tcw2.row(2)-Tcw2.row(0);
+      A.row(3) = xn2(1)*Tcw2.row(2)-Tcw2.row(1);
+
+      // Solution is the right singular vector of the smallest singular value
+      Eigen::JacobiSVD<Eigen::Matrix4d> svd(A, Eigen::ComputeFullV);
+      const Eigen::Vector4d x3Dh = svd.matrixV().col(3);
+
+      if (x3Dh(3) == 0)
+        continue;
+
+      // Euclidean coordinates
+      x3D = x3Dh.head<3>()/x3Dh(3);
 
-    // Check first that baseline is not too short
-    Eigen::Vector3d Ow2 = pKF2->GetCameraCenter();
-    Eigen::Vector3d vBaseline = Ow2-Ow1;
-    const float baseline = vBaseline.norm();
+    } else if (bStereo1 && cosParallaxStereo1<cosParallaxStereo2) {
+      x3D = mpCurrentKeyFrame->UnprojectStereo(idx1);
+    } else if (bStereo2 && cosParallaxStereo2<cosParallaxStereo1) {
+      x3D = pKF2->UnprojectStereo(idx2);
+    } else
+      continue; //No stereo and very low parallax
 
-    if (!mbMonocular) {
-      if (baseline<pKF2->mb)
+    Eigen::Vector3d x3Dt = x3D.transpose();
+
+    //Check triangulation in front of cameras
+    float z1 = Rcw1.row(2).dot(x3Dt)+tcw1(2);
+    if (z1 <= 0)
+      continue;
+
+    float z2 = Rcw2.row(2).dot(x3Dt)+tcw2(2);
+    if (z2 <= 0)
       continue;
-    } else {
-      const float medianDepthKF2 = pKF2->ComputeSceneMedianDepth(2);
-      const float ratioBaselineDepth = baseline/medianDepthKF2;
 
-      if (ratioBaselineDepth < 0.01)
+    //Check reprojection error in first keyframe
+    const float &sigmaSquare1 = mpCurrentKeyFrame->mvLevelSigma2[kp1.octave];
+    const float x1 = Rcw1.row(0).dot(x3Dt)+tcw1(0);
+    const float y1 = Rcw1.row(1).dot(x3Dt)+tcw1(1);
+    const float invz1 = 1.0/z1;
+
+    if (!bStereo1) {
+      float u1 = fx1*x1*invz1+cx1;
+      float v1 = fy1*y1*invz1+cy1;
+      float errX1 = u1 - kp1.pt.x;
+      float errY1 = v1 - kp1.pt.y;
+      if ((errX1*errX1+errY1*errY1)>5.991*sigmaSquare1)
+        continue;
+    } else {
+      float u1 = fx1*x1*invz1+cx1;
+      float u1_r = u1 - mpCurrentKeyFrame->mbf*invz1;
+      float v1 = fy1*y1*invz1+cy1;
+      float errX1 = u1 - kp1.pt.x;
+      float errY1 = v1 - kp1.pt.y;
+      float errX1_r = u1_r - kp1_ur;
+      if ((errX1*errX1+errY1*errY1+errX1_r*errX1_r)>7.8*sigmaSquare1)
         continue;
     }
 
-    // Compute Fundamental Matrix
-    Eigen::Matrix3d F12 = ComputeF12(mpCurrentKeyFrame, pKF2);
-
-    // Search matches that fullfil epipolar constraint
-    vector<std::pair<size_t, size_t> > vMatchedIndices;
-    matcher.SearchForTriangulation(mpCurrentKeyFrame, pKF2, F12, vMatchedIndices);
-
-    Eigen::Matrix3d Rcw2 = pKF2->GetRotation();
-    Eigen::Matrix3d Rwc2 = Rcw2.transpose();
-    Eigen::Vector3d tcw2 = pKF2->GetTranslation();
-    Eigen::Matrix<double, 3, 4> Tcw2;
-    Tcw2.block<3, 3>(0, 0) = Rcw2;
-    Tcw2.block<3, 1>(0, 3) = tcw2;
-
-    const float &fx2 = pKF2->fx;
-    const float &fy2 = pKF2->fy;
-    const float &cx2 = pKF2->cx;
-    const float &cy2 = pKF2->cy;
-    const float &invfx2 = pKF2->invfx;
-    const float &invfy2 = pKF2->invfy;
-
-    // Triangulate each match
-    const int nmatches = vMatchedIndices.size();
-    for (int ikp = 0; ikp<nmatches; ikp++) {
-      const int &idx1 = vMatchedIndices[ikp].first;
-      const int &idx2 = vMatchedIndices[ikp].second;
-
-      const cv::KeyPoint &kp1 = mpCurrentKeyFrame->mvKeysUn[idx1];
-      const float kp1_ur = mpCurrentKeyFrame->mvuRight[idx1];
-      bool bStereo1 = kp1_ur >= 0;
-
-      const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
-      const float kp2_ur = pKF2->mvuRight[idx2];
-      bool bStereo2 = kp2_ur >= 0;
-
-      // Check parallax between rays
-      Eigen::Vector3d xn1((kp1.pt.x-cx1)*invfx1, (kp1.pt.y-cy1)*invfy1, 1.0);
-      Eigen::Vector3d xn2((kp2.pt.x-cx2)*invfx2, (kp2.pt.y-cy2)*invfy2, 1.0);
-
-      Eigen::Vector3d ray1 = Rwc1*xn1;
-      Eigen::Vector3d ray2 = Rwc2*xn2;
-      const float cosParallaxRays = ray1.dot(ray2)/(ray1.norm()*ray2.norm());
-
-      float cosParallaxStereo = cosParallaxRays+1;
-      float cosParallaxStereo1 = cosParallaxStereo;
-      float cosParallaxStereo2 = cosParallaxStereo;
-
-      if (bStereo1)
-        cosParallaxStereo1 = cos(2*atan2(mpCurrentKeyFrame->mb/2, mpCurrentKeyFrame->mvDepth[idx1]));
-      else if (bStereo2)
-        cosParallaxStereo2 = cos(2*atan2(pKF2->mb/2,pKF2->mvDepth[idx2]));
-
-      cosParallaxStereo = std::min(cosParallaxStereo1, cosParallaxStereo2);
-
-      Eigen::Vector3d x3D;
-      if (cosParallaxRays<cosParallaxStereo && cosParallaxRays > 0 && (bStereo1 || bStereo2 || cosParallaxRays < 0.9998)) {
-        // Linear Triangulation Method
-        Eigen::Matrix4d A;
-        A.row(0) = xn1(0)*Tcw1.row(2)-Tcw1.row(0);
-        A.row(1) = xn1(1)*Tcw1.row(2)-Tcw1.row(1);
-        A.row(2) = xn2(0)*Tcw2.row(2)-Tcw2.row(0);
-        A.row(3) = xn2(1)*Tcw2.row(2)-Tcw2.row(1);
-
-        cv::Mat A_cv(4, 4, CV_32F);
-        cv::Mat w, u, vt;
-        A_cv = Converter::toCvMat(A);
-        cv::SVD::compute(A_cv, w, u, vt, cv::SVD::MODIFY_A| cv::SVD::FULL_UV);
-
-        cv::Mat x3D_cv = vt.row(3).t();
-
-        if (x3D_cv.at<float>(3) == 0)
-          continue;
-
-        // Euclidean coordinates
-        x3D_cv = x3D_cv.rowRange(0, 3)/x3D_cv.at<float>(3);
-        x3D = Converter::toVector3d(x3D_cv);
-
-      } else if (bStereo1 && cosParallaxStereo1<cosParallaxStereo2) {
-        x3D = mpCurrentKeyFrame->UnprojectStereo(idx1);
-      } else if (bStereo2 && cosParallaxStereo2<cosParallaxStereo1) {
-        x3D = pKF2->UnprojectStereo(idx2);
-      } else
-        continue; //No stereo and very low parallax
-
-      Eigen::Vector3d x3Dt = x3D.transpose();
-
-      //Check triangulation in front of cameras
-      float z1 = Rcw1.row(2).dot(x3Dt)+tcw1(2);
-      if (z1 <= 0)
+    //Check reprojection error in second keyframe
+    const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
+    const float x2 = Rcw2.row(0).dot(x3Dt)+tcw2(0);
+    const float y2 = Rcw2.row(1).dot(x3Dt)+tcw2(1);
+    const float invz2 = 1.0/z2;
+    if (!bStereo2) {
+      float u2 = fx2*x2*invz2+cx2;
+      float v2 = fy2*y2*invz2+cy2;
+      float errX2 = u2 - kp2.pt.x;
+      float errY2 = v2 - kp2.pt.y;
+      if ((errX2*errX2+errY2*errY2)>5.991*sigmaSquare2)
         continue;
-
-      float z2 = Rcw2.row(2).dot(x3Dt)+tcw2(2);
-      if (z2 <= 0)
+    } else {
+      float u2 = fx2*x2*invz2+cx2;
+      float u2_r = u2 - mpCurrentKeyFrame->mbf*invz2;
+      float v2 = fy2*y2*invz2+cy2;
+      float errX2 = u2 - kp2.pt.x;
+      float errY2 = v2 - kp2.pt.y;
+      float errX2_r = u2_r - kp2_ur;
+      if ((errX2*errX2+errY2*errY2+errX2_r*errX2_r)>7.8*sigmaSquare2)
         continue;
+    }
 
-      //Check reprojection error in first keyframe
-      const float &sigmaSquare1 = mpCurrentKeyFrame->mvLevelSigma2[kp1.octave];
-      const float x1 = Rcw1.row(0).dot(x3Dt)+tcw1(0);
-      const float y1 = Rcw1.row(1).dot(x3Dt)+tcw1(1);
-      const float invz1 = 1.0/z1;
-
-      if (!bStereo1) {
-        float u1 = fx1*x1*invz1+cx1;
-        float v1 = fy1*y1*invz1+cy1;
-        float errX1 = u1 - kp1.pt.x;
-        float errY1 = v1 - kp1.pt.y;
-        if ((errX1*errX1+errY1*errY1)>5.991*sigmaSquare1)
-          continue;
-      } else {
-        float u1 = fx1*x1*invz1+cx1;
-        float u1_r = u1 - mpCurrentKeyFrame->mbf*invz1;
-        float v1 = fy1*y1*invz1+cy1;
-        float errX1 = u1 - kp1.pt.x;
-        float errY1 = v1 - kp1.pt.y;
-        float errX1_r = u1_r - kp1_ur;
-        if ((errX1*errX1+errY1*errY1+errX1_r*errX1_r)>7.8*sigmaSquare1)
-          continue;
-      }
-
-      //Check reprojection error in second keyframe
-      const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
-      const float x2 = Rcw2.row(0).dot(x3Dt)+tcw2(0);
-      const float y2 = Rcw2.row(1).dot(x3Dt)+tcw2(1);
-      const float invz2 = 1.0/z2;
-      if (!bStereo2) {
-        float u2 = fx2*x2*invz2+cx2;
-        float v2 = fy2*y2*invz2+cy2;
-        float errX2 = u2 - kp2.pt.x;
-        float errY2 = v2 - kp2.pt.y;
-        if ((errX2*errX2+errY2*errY2)>5.991*sigmaSquare2)
-          continue;
-      } else {
-        float u2 = fx2*x2*invz2+cx2;
-        float u2_r = u2 - mpCurrentKeyFrame->mbf*invz2;
-        float v2 = fy2*y2*invz2+cy2;
-        float errX2 = u2 - kp2.pt.x;
-        float errY2 = v2 - kp2.pt.y;
-        float errX2_r = u2_r - kp2_ur;
-        if ((errX2*errX2+errY2*errY2+errX2_r*errX2_r)>7.8*sigmaSquare2)
-          continue;
-      }
+    //Check scale consistency
+    Eigen::Vector3d normal1 = x3D-Ow1;
+    float dist1 = normal1.norm();
 
-      //Check scale consistency
-      Eigen::Vector3d normal1 = x3D-Ow1;
-      float dist1 = normal1.norm();
+    Eigen::Vector3d normal2 = x3D-Ow2;
+    float dist2 = normal2.norm();
 
-      Eigen::Vector3d normal2 = x3D-Ow2;
-      float dist2 = normal2.norm();
+    if (dist1 == 0 || dist2 == 0)
+      continue;
 
-      if (dist1 == 0 || dist2 == 0)
-        continue;
+    const float ratioDist = dist2/dist1;
+    const float ratioOctave = mpCurrentKeyFrame->mvScaleFactors[kp1.octave]/pKF2->mvScaleFactors[kp2.octave];
 
-      const float ratioDist = dist2/dist1;
-      const float ratioOctave = mpCurrentKeyFrame->mvScaleFactors[kp1.octave]/pKF2->mvScaleFactors[kp2.octave];
+    /*if (fabs(ratioDist-ratioOctave)>ratioFactor)
+      continue;*/
+    if (ratioDist*ratioFactor<ratioOctave || ratioDist>ratioOctave*ratioFactor)
+      continue;
 
-      /*if (fabs(ratioDist-ratioOctave)>ratioFactor)
-        continue;*/
-      if (ratioDist*ratioFactor<ratioOctave || ratioDist>ratioOctave*ratioFactor)
-        continue;
+    // Triangulation is succesfull
+    NewPoint np;
+    np.idx1 = idx1;
+    np.idx2 = idx2;
+    np.x3D = x3D;
+    vNewPoints.push_back(np);
+  }
+}
 
-      // Triangulation is succesfull
-      MapPoint* pMP = new MapPoint(x3D, mpCurrentKeyFrame, mpMap);
+void LocalMapping::ParallelFor(int n, const std::function<void(int)> &f) {
+  if (mpThreadPool) {
+    mpThreadPool->ParallelFor(n, f, Config::ThreadsMapping());
+  } else {
+    for (int i = 0; i < n; i++)
+      f(i);
+  }
+}
 
-      pMP->AddObservation(mpCurrentKeyFrame, idx1);
-      pMP->AddObservation(pKF2, idx2);
+void LocalMapping::WindowBundleAdjustment() {
+  // Priors are expressed in the map frame before a loop correction, discard them
+  int nBigChangeIdx = mpMap->GetLastBigChangeIdx();
+  if (nBigChangeIdx != mnLastBigChangeIdx) {
+    for (KeyFrame* pKFi : mlpWindowKeyFrames)
+      pKFi->mbPosePrior = false;
+    mnLastBigChangeIdx = nBigChangeIdx;
+  }
 
-      mpCurrentKeyFrame->AddMapPoint(pMP, idx1);
-      pKF2->AddMapPoint(pMP, idx2);
+  // Culled keyframes leave the window with their priors
+  for (list<KeyFrame*>::iterator lit = mlpWindowKeyFrames.begin(); lit != mlpWindowKeyFrames.end();) {
+    if ((*lit)->isBad())
+      lit = mlpWindowKeyFrames.erase(lit);
+    else
+      lit++;
+  }
 
-      pMP->ComputeDistinctiveDescriptors();
+  // Only one keyframe is marginalized per BA, drop older ones if BA was skipped
+  const size_t window = Config::WindowSize();
+  while (mlpWindowKeyFrames.size() > window+1) {
+    mlpWindowKeyFrames.front()->mbPosePrior = false;
+    mlpWindowKeyFrames.pop_front();
+  }
 
-      pMP->UpdateNormalAndDepth();
+  KeyFrame* pKFMarg = nullptr;
+  if (mlpWindowKeyFrames.size() > window)
+    pKFMarg = mlpWindowKeyFrames.front();
 
-      mpMap->AddMapPoint(pMP);
-      mlpRecentAddedMapPoints.push_back(pMP);
+  vector<KeyFrame*> vpWindowKFs(mlpWindowKeyFrames.begin(), mlpWindowKeyFrames.end());
+  Optimizer::WindowBundleAdjustment(vpWindowKFs, pKFMarg, &mbAbortBA, mpMap, Config::ThreadsBA(), &mPointBatch);
 
-      nnew++;
-    }
-  }
+  if (pKFMarg)
+    mlpWindowKeyFrames.pop_front();
 }
 
 void LocalMapping::SearchInNeighbors() {
+  SD_TRACE("SearchInNeighbors");
   // Retrieve neighbor keyframes
   int nn = 10;
   if (mbMonocular)
@@ -444,25 +757,32 @@ void LocalMapping::SearchInNeighbors() {
   }
 
 
-  // Search matches by projection from current KF in target KFs
+  // Search matches by projection from current KF in target KFs. Searches only read the map,
+  // they run in parallel and matches are applied afterwards in target order
   ORBmatcher matcher;
   vector<MapPoint*> vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-  for (vector<KeyFrame*>::iterator vit=vpTargetKFs.begin(), vend=vpTargetKFs.end(); vit!=vend; vit++) {
-    KeyFrame* pKFi = *vit;
+  vector<vector<std::pair<MapPoint*, size_t> > > vvMatches(vpTargetKFs.size());
+  ParallelFor(vpTargetKFs.size(), [&](int i) {
+    ORBmatcher m;
+    m.SearchFuse(vpTargetKFs[i], vpMapPointMatches, vvMatches[i]);
+  });
 
-    matcher.Fuse(pKFi, vpMapPointMatches);
-  }
+  for (size_t i = 0; i < vpTargetKFs.size(); i++)
+    matcher.ApplyFuse(vpTargetKFs[i], vvMatches[i]);
 
   // Search matches by projection from target KFs in current KF
-  vector<MapPoint*> vpFuseCandidates;
+  ScratchScope scratch;
+  ScratchVector<MapPoint*> vpFuseCandidates;
   vpFuseCandidates.reserve(vpTargetKFs.size()*vpMapPointMatches.size());
 
+  ScratchVector<MapPoint*> vpMapPointsKFi;
+  vpMapPointsKFi.reserve(vpMapPointMatches.size());
   for (vector<KeyFrame*>::iterator vitKF=vpTargetKFs.begin(), vendKF=vpTargetKFs.end(); vitKF!=vendKF; vitKF++) {
     KeyFrame* pKFi = *vitKF;
 
-    vector<MapPoint*> vpMapPointsKFi = pKFi->GetMapPointMatches();
+    pKFi->GetMapPointMatches(vpMapPointsKFi);
 
-    for (vector<MapPoint*>::iterator vitMP=vpMapPointsKFi.begin(), vendMP=vpMapPointsKFi.end(); vitMP!=vendMP; vitMP++) {
+    for (ScratchVector<MapPoint*>::iterator vitMP=vpMapPointsKFi.begin(), vendMP=vpMapPointsKFi.end(); vitMP!=vendMP; vitMP++) {
       MapPoint* pMP = *vitMP;
       if (!pMP)
         continue;
@@ -473,17 +793,28 @@ void LocalMapping::SearchInNeighbors() {
     }
   }
 
-  matcher.Fuse(mpCurrentKeyFrame, vpFuseCandidates);
+  // Same for the candidates, split in blocks
+  const int BLOCK = 128;
+  const int nBlocks = (vpFuseCandidates.size()+BLOCK-1)/BLOCK;
+  vvMatches.assign(nBlocks, vector<std::pair<MapPoint*, size_t> >());
+  ParallelFor(nBlocks, [&](int b) {
+    ORBmatcher m;
+    const size_t first = b*BLOCK;
+    const size_t last = std::min(first+BLOCK, vpFuseCandidates.size());
+    vector<MapPoint*> vpBlock(vpFuseCandidates.begin()+first, vpFuseCandidates.begin()+last);
+    m.SearchFuse(mpCurrentKeyFrame, vpBlock, vvMatches[b]);
+  });
+
+  for (int b = 0; b < nBlocks; b++)
+    matcher.ApplyFuse(mpCurrentKeyFrame, vvMatches[b]);
 
   // Update points
   vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
   for (size_t i = 0, iend=vpMapPointMatches.size(); i < iend; i++) {
     MapPoint* pMP=vpMapPointMatches[i];
     if (pMP) {
-      if (!pMP->isBad()) {
-        pMP->ComputeDistinctiveDescriptors();
-        pMP->UpdateNormalAndDepth();
-      }
+      if (!pMP->isBad())
+        mPointBatch.Add(pMP, true);
     }
   }
 
@@ -500,7 +831,7 @@ Eigen::Matrix3d LocalMapping::ComputeF12(KeyFrame *&pKF1, KeyFrame *&pKF2) {
   Eigen::Matrix3d R12 = R1w*R2w.transpose();
   Eigen::Vector3d t12 = -R1w*R2w.transpose()*t2w+t1w;
 
-  Eigen::Matrix3d t12x = SkewSymmetricMatrix(t12);
+  Eigen::Matrix3d t12x = Lie::Hat(t12);
 
   Eigen::Matrix3d K1 = pKF1->mK;
   Eigen::Matrix3d K2 = pKF2->mK;
@@ -515,12 +846,15 @@ void LocalMapping::RequestStop() {
   mbStopRequested = true;
   unique_lock<mutex> lock2(mMutexNewKFs);
   mbAbortBA = true;
+  mbWakeUp = true;
+  mCondNewKFs.notify_one();
 }
 
 bool LocalMapping::Stop() {
   unique_lock<mutex> lock(mMutexStop);
   if (mbStopRequested && !mbNotStop) {
     mbStopped = true;
+    mCondStop.notify_all();
     LOGD("Local Mapping STOP");
     return true;
   }
@@ -538,16 +872,27 @@ bool LocalMapping::stopRequested() {
   return mbStopRequested;
 }
 
-void LocalMapping::Release() {
+void LocalMapping::WaitUntilStopped() {
+  ScopedTrace trace("WaitLocalMappingStop", "wait");
   unique_lock<mutex> lock(mMutexStop);
-  unique_lock<mutex> lock2(mMutexFinish);
-  if (mbFinished)
-    return;
-  mbStopped = false;
-  mbStopRequested = false;
-  for (list<KeyFrame*>::iterator lit = mlNewKeyFrames.begin(), lend = mlNewKeyFrames.end(); lit!=lend; lit++)
-    delete *lit;
-  mlNewKeyFrames.clear();
+  mCondStop.wait(lock, [this] { return mbStopped; });
+}
+
+void LocalMapping::Release() {
+  {
+    unique_lock<mutex> lock(mMutexStop);
+    unique_lock<mutex> lock2(mMutexFinish);
+    if (mbFinished)
+      return;
+    mbStopped = false;
+    mbStopRequested = false;
+    for (list<KeyFrame*>::iterator lit = mlNewKeyFrames.begin(), lend = mlNewKeyFrames.end(); lit!=lend; lit++)
+      delete *lit;
+    mlNewKeyFrames.clear();
+    Metrics::Set(Metrics::LOCAL_MAPPING_QUEUE, 0);
+  }
+
+  WakeUp();
 
   LOGD("Local Mapping RELEASE");
 }
@@ -563,110 +908,182 @@ void LocalMapping::SetAcceptKeyFrames(bool flag) {
 }
 
 bool LocalMapping::SetNotStop(bool flag) {
-  unique_lock<mutex> lock(mMutexStop);
+  {
+    unique_lock<mutex> lock(mMutexStop);
 
-  if (flag && mbStopped)
-    return false;
+    if (flag && mbStopped)
+      return false;
+
+    mbNotStop = flag;
+  }
 
-  mbNotStop = flag;
+  // A pending stop request can be served now
+  if (!flag)
+    WakeUp();
 
   return true;
 }
 
+double LocalMapping::KeyFrameTime() {
+  unique_lock<mutex> lock(mMutexLoad);
+  return mKeyFrameTime;
+}
+
+double LocalMapping::BATime() {
+  unique_lock<mutex> lock(mMutexLoad);
+  return mBATime;
+}
+
+double LocalMapping::BAElapsedTime() {
+  unique_lock<mutex> lock(mMutexLoad);
+  if (!mbBAInProgress)
+    return -1.0;
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-mBAStart).count();
+}
+
+void LocalMapping::UpdateMetrics() {
+  Metrics::Set(Metrics::KEYFRAMES, mpMap->KeyFramesInMap());
+  Metrics::Set(Metrics::MAPPOINTS, mpMap->MapPointsInMap());
+
+  // Memory report visits the whole map, refresh it once a second and only if it is exported
+  if (Config::MetricsPort() <= 0)
+    return;
+
+  const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (now - mLastMemoryMetrics < std::chrono::seconds(1))
+    return;
+  mLastMemoryMetrics = now;
+
+  const Map::MemoryReport report = mpMap->GetMemoryReport();
+  Metrics::Set(Metrics::MEMORY_KEYFRAMES, report.keyframes);
+  Metrics::Set(Metrics::MEMORY_MAPPOINTS, report.mappoints);
+  Metrics::Set(Metrics::MEMORY_IMAGES, report.images);
+  Metrics::Set(Metrics::MEMORY_DEPTH, report.depth);
+  Metrics::Set(Metrics::MEMORY_DESCRIPTORS, report.descriptors);
+  Metrics::Set(Metrics::MEMORY_FEATURES, report.features);
+  Metrics::Set(Metrics::MEMORY_VOCABULARY, report.vocabulary);
+  Metrics::Set(Metrics::MEMORY_OPTIMIZER, Optimizer::GetPeakGraphBytes());
+}
+
+void LocalMapping::RecordKeyFrameTime(double ms) {
+  unique_lock<mutex> lock(mMutexLoad);
+  mKeyFrameTime = mKeyFrameTime > 0 ? 0.8*mKeyFrameTime + 0.2*ms : ms;
+}
+
+void LocalMapping::UpdateBABudget(int nLocalKFs, double ms) {
+  const double target = Config::LocalBATargetTime();
+  if (target <= 0)
+    return;
+
+  // Last BA time and not the smoothed one, which would keep shrinking the window after it fits.
+  // Shrink fast when too slow, grow one keyframe at a time while the window is the limit
+  const int minKFs = 5;
+  int n = mnBAMaxLocalKFs;
+  if (ms > target)
+    n = std::max(minKFs, static_cast<int>(0.8*nLocalKFs));
+  else if (ms < 0.7*target && n > 0 && nLocalKFs >= n)
+    n++;
+
+  if (n != mnBAMaxLocalKFs) {
+    mnBAMaxLocalKFs = n;
+    LOGD("Local BA window set to %d keyframes (BA time %.2fms)", n, ms);
+  }
+}
+
+void LocalMapping::SetBAStarted(bool started) {
+  unique_lock<mutex> lock(mMutexLoad);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  // Only completed BAs are measured, interrupted ones would make it look shorter
+  if (!started && mbBAInProgress && !mbAbortBA) {
+    double ms = std::chrono::duration<double, std::milli>(now-mBAStart).count();
+    mBATime = mBATime > 0 ? 0.8*mBATime + 0.2*ms : ms;
+  }
+
+  mbBAInProgress = started;
+  mBAStart = now;
+}
+
 void LocalMapping::InterruptBA() {
   mbAbortBA = true;
 }
 
-void LocalMapping::KeyFrameCulling() {
+void LocalMapping::KeyFrameCulling(KeyFrame* pCurrentKF) {
+  SD_TRACE("KeyFrameCulling");
   // Check redundant keyframes (only local keyframes)
   // A keyframe is considered redundant if the 90% of the MapPoints it sees, are seen
   // in at least other 3 keyframes (in the same or finer scale)
   // We only consider close stereo points
-  vector<KeyFrame*> vpLocalKeyFrames = mpCurrentKeyFrame->GetVectorCovisibleKeyFrames();
+  vector<KeyFrame*> vpLocalKeyFrames = pCurrentKF->GetVectorCovisibleKeyFrames();
 
   for (vector<KeyFrame*>::iterator vit=vpLocalKeyFrames.begin(), vend=vpLocalKeyFrames.end(); vit!=vend; vit++) {
     KeyFrame* pKF = *vit;
-    if (pKF->mnId == 0)
+    // Newer keyframes (pipelined mode) are not optimized yet
+    if (pKF->mnId == 0 || pKF->mnId > pCurrentKF->mnId)
       continue;
-    const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
 
     int nObs = 3;
     const int thObs=nObs;
     int nRedundantObservations = 0;
     int nMPs = 0;
-    for (size_t i = 0, iend=vpMapPoints.size(); i < iend; i++) {
-      MapPoint* pMP = vpMapPoints[i];
-      if (pMP) {
-        if (!pMP->isBad()) {
-          if (!mbMonocular) {
-            if (pKF->mvDepth[i]>pKF->mThDepth || pKF->mvDepth[i] < 0)
-              continue;
-          }
-
-          nMPs++;
-          if (pMP->Observations()>thObs) {
-            const int &scaleLevel = pKF->mvKeysUn[i].octave;
-            const map<KeyFrame*, size_t> observations = pMP->GetObservations();
-            int nObs = 0;
-            for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
-              KeyFrame* pKFi = mit->first;
-              if (pKFi == pKF)
-                continue;
-              const int &scaleLeveli = pKFi->mvKeysUn[mit->second].octave;
-
-              if (scaleLeveli <= scaleLevel+1) {
-                nObs++;
-                if (nObs>=thObs)
-                  break;
-              }
-            }
-            if (nObs>=thObs) {
-              nRedundantObservations++;
-            }
-          }
-        }
+    pKF->ForEachMapPoint([&](size_t i, MapPoint* pMP) {
+      if (pMP->isBad())
+        return;
+      if (!mbMonocular) {
+        if (pKF->mvDepth[i]>pKF->mThDepth || pKF->mvDepth[i] < 0)
+          return;
       }
-    }
+
+      nMPs++;
+
+      // Observers in the same or finer scale are counted by the point, pKF included
+      const int &scaleLevel = pKF->mvKeysUn[i].octave;
+      if (pMP->ObservationsUpToLevel(scaleLevel+1)-1 >= thObs)
+        nRedundantObservations++;
+    });
 
     if (nRedundantObservations > 0.9*nMPs)
       pKF->SetBadFlag();
   }
 }
 
-Eigen::Matrix3d LocalMapping::SkewSymmetricMatrix(const Eigen::Vector3d &v) {
-  Eigen::Matrix3d m;
-  m << 0, -v(2), v(1), v(2), 0, -v(0), -v(1), v(0), 0;
-  return m;
-}
-
 void LocalMapping::RequestReset() {
   {
     unique_lock<mutex> lock(mMutexReset);
     mbResetRequested = true;
   }
 
-  while (1) {
-    {
-      unique_lock<mutex> lock2(mMutexReset);
-      if (!mbResetRequested)
-        break;
-    }
-    usleep(3000);
-  }
+  WakeUp();
+
+  unique_lock<mutex> lock(mMutexReset);
+  mCondReset.wait(lock, [this] { return !mbResetRequested; });
 }
 
 void LocalMapping::ResetIfRequested() {
   unique_lock<mutex> lock(mMutexReset);
   if (mbResetRequested) {
+    // Keyframes are about to be deleted, pipelined BA must be done with them
+    WaitPipelinedBA();
+    mpPipelineKF = nullptr;
+
     mlNewKeyFrames.clear();
+    Metrics::Set(Metrics::LOCAL_MAPPING_QUEUE, 0);
     mlpRecentAddedMapPoints.clear();
+    mPointBatch.Clear();
+    mlpPyramidKeyFrames.clear();
+    mlpWindowKeyFrames.clear();
     mbResetRequested=false;
+    mCondReset.notify_all();
   }
 }
 
 void LocalMapping::RequestFinish() {
-  unique_lock<mutex> lock(mMutexFinish);
-  mbFinishRequested = true;
+  {
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinishRequested = true;
+  }
+
+  WakeUp();
 }
 
 bool LocalMapping::CheckFinish() {
@@ -679,6 +1096,8 @@ void LocalMapping::SetFinish() {
   mbFinished = true;
   unique_lock<mutex> lock2(mMutexStop);
   mbStopped = true;
+  mCondStop.notify_all();
+  mCondFinish.notify_all();
 }
 
 bool LocalMapping::isFinished() {
@@ -686,4 +1105,9 @@ bool LocalMapping::isFinished() {
   return mbFinished;
 }
 
+void LocalMapping::WaitUntilFinished() {
+  unique_lock<mutex> lock(mMutexFinish);
+  mCondFinish.wait(lock, [this] { return mbFinished; });
+}
+
 }  // namespace SD_SLAM
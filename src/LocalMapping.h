@@ -26,10 +26,16 @@
 #define SD_SLAM_LOCALMAPPING_H
 
 #include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 #include "KeyFrame.h"
 #include "Map.h"
+#include "MapPoint.h"
 #include "LoopClosing.h"
 #include "Tracking.h"
+#include "extra/thread_pool.h"
+#include "extra/energy_policy.h"
 
 namespace SD_SLAM {
 
@@ -39,12 +45,17 @@ class Map;
 
 class LocalMapping {
  public:
-  LocalMapping(Map* pMap, const float bMonocular);
+  // Triangulation uses up to Config::ThreadsMapping() threads of the shared pool
+  LocalMapping(Map* pMap, const float bMonocular, ThreadPool* pPool = nullptr);
+  ~LocalMapping();
 
   void SetLoopCloser(LoopClosing* pLoopCloser);
 
   void SetTracker(Tracking* pTracker);
 
+  // Rest after each keyframe as the policy requires (not owned), null to run freely
+  void SetEnergyPolicy(EnergyPolicy* pEnergy);
+
   // Main function
   void Run();
 
@@ -66,41 +77,97 @@ class LocalMapping {
   void RequestFinish();
   bool isFinished();
 
+  // Block until Local Mapping has stopped (or finished)
+  void WaitUntilStopped();
+
+  // Block until Local Mapping thread has finished
+  void WaitUntilFinished();
+
+  // Block until every inserted keyframe is processed and the thread sleeps (or is stopped)
+  void WaitUntilIdle();
+
   int KeyframesInQueue(){
     std::unique_lock<std::mutex> lock(mMutexNewKFs);
     return mlNewKeyFrames.size();
   }
 
+  // Measured load, Tracking paces keyframe insertion with it.
+  // Mean time (ms) to process a keyframe and to run local BA, 0 until measured
+  double KeyFrameTime();
+  double BATime();
+
+  // Time (ms) the running local BA has taken, negative if there is none
+  double BAElapsedTime();
+
  protected:
   bool CheckNewKeyFrames();
   void ProcessNewKeyFrame();
+
+  // Wake up main loop to check stop, reset and finish requests
+  void WakeUp();
+
+  // Sleep until there are new keyframes or an event is signaled
+  void WaitForWork();
+
+  // Sleep until an event is signaled
+  void WaitForEvent();
+
+  // Point triangulated between current keyframe (idx1) and a neighbor (idx2)
+  struct NewPoint {
+    size_t idx1;
+    size_t idx2;
+    Eigen::Vector3d x3D;
+  };
+
   void CreateNewMapPoints();
 
+  // Match current keyframe against pKF2 and triangulate. Only reads keyframe data,
+  // so it can be run for several neighbors at once
+  void TriangulateWithNeighbor(KeyFrame* pKF2, std::vector<NewPoint> &vNewPoints);
+
+  // Run f(0..n-1) using thread pool if available
+  void ParallelFor(int n, const std::function<void(int)> &f);
+
   void MapPointCulling();
   void SearchInNeighbors();
 
-  void KeyFrameCulling();
+  void KeyFrameCulling(KeyFrame* pKF);
 
-  Eigen::Matrix3d ComputeF12(KeyFrame* &pKF1, KeyFrame* &pKF2);
+  // Covisibility local BA around pKF, with optimized points added to pBatch if given
+  void LocalBundleAdjustment(KeyFrame* pKF, MapPointBatch* pBatch);
+
+  // Pipelined mode. Local BA of mpPipelineKF runs in RunBA while the next keyframe is processed.
+  // CommitPipelined waits for it and then culls, publishes and hands the keyframe to Loop Closing
+  void RunBA();
+  // Returns false if there is no BA to run and the keyframe can be committed right away
+  bool StartPipelinedBA();
+  void WaitPipelinedBA();
+  void CommitPipelined();
 
-  Eigen::Matrix3d SkewSymmetricMatrix(const Eigen::Vector3d &v);
+  // Bundle adjustment over the sliding window, marginalizing its oldest keyframe
+  void WindowBundleAdjustment();
+
+  Eigen::Matrix3d ComputeF12(KeyFrame* &pKF1, KeyFrame* &pKF2);
 
   bool mbMonocular;
 
   void ResetIfRequested();
   bool mbResetRequested;
   std::mutex mMutexReset;
+  std::condition_variable mCondReset;
 
   bool CheckFinish();
   void SetFinish();
   bool mbFinishRequested;
   bool mbFinished;
   std::mutex mMutexFinish;
+  std::condition_variable mCondFinish;
 
   Map* mpMap;
 
   LoopClosing* mpLoopCloser;
   Tracking* mpTracker;
+  EnergyPolicy* mpEnergy;
 
   std::list<KeyFrame*> mlNewKeyFrames;
 
@@ -108,7 +175,28 @@ class LocalMapping {
 
   std::list<MapPoint*> mlpRecentAddedMapPoints;
 
+  // Existing points touched while processing the current keyframe, updated once at the end
+  MapPointBatch mPointBatch;
+
+  // Keyframes still keeping their full pyramid
+  std::list<KeyFrame*> mlpPyramidKeyFrames;
+
+  // Local keyframes of the covisibility based local BA (0 is all of them), adapted to
+  // Optimizer.LocalTargetTime
+  int mnBAMaxLocalKFs;
+  void UpdateBABudget(int nLocalKFs, double ms);
+
+  // Keyframes in the sliding window BA, oldest first
+  std::list<KeyFrame*> mlpWindowKeyFrames;
+  int mnLastBigChangeIdx;
+
   std::mutex mMutexNewKFs;
+  std::condition_variable mCondNewKFs;
+  bool mbWakeUp;
+
+  // Thread is sleeping with no pending keyframes
+  bool mbIdle;
+  std::condition_variable mCondIdle;
 
   bool mbAbortBA;
 
@@ -116,9 +204,34 @@ class LocalMapping {
   bool mbStopRequested;
   bool mbNotStop;
   std::mutex mMutexStop;
+  std::condition_variable mCondStop;
 
   bool mbAcceptKeyFrames;
   std::mutex mMutexAccept;
+
+  // Load measurements
+  void RecordKeyFrameTime(double ms);
+  void SetBAStarted(bool started);
+
+  double mKeyFrameTime;
+  double mBATime;
+  bool mbBAInProgress;
+  std::chrono::steady_clock::time_point mBAStart;
+  std::mutex mMutexLoad;
+
+  // Publish map size, and memory if metrics are exported, after each keyframe
+  void UpdateMetrics();
+  std::chrono::steady_clock::time_point mLastMemoryMetrics;
+
+  // Shared thread pool (not owned), null if serial
+  ThreadPool* mpThreadPool;
+
+  bool mbPipelined;
+  KeyFrame* mpPipelineKF;       // Keyframe in BA or waiting to be committed, set by Run
+  bool mbBARequested;
+  bool mbBAFinish;
+  std::mutex mMutexPipeline;
+  std::condition_variable mCondPipeline;
 };
 
 }  // namespace SD_SLAM
@@ -24,13 +24,24 @@
 
 #include "LoopClosing.h"
 #include <thread>
-#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <limits>
 #include "Sim3Solver.h"
 #include "Converter.h"
 #include "Optimizer.h"
 #include "ORBmatcher.h"
 #include "ImageAlign.h"
+#include "MapMerger.h"
+#include "KeyFrameDatabase.h"
+#include "Config.h"
 #include "extra/log.h"
+#include "extra/utils.h"
+#include "extra/trace.h"
+#include "extra/stats.h"
+#include "extra/metrics.h"
+#include "extra/timer.h"
+#include "extra/scratch_arena.h"
 
 using std::mutex;
 using std::unique_lock;
@@ -42,11 +53,18 @@ using std::list;
 
 namespace SD_SLAM {
 
-LoopClosing::LoopClosing(Map *pMap, const bool bFixScale):
+LoopClosing::LoopClosing(Map *pMap, const bool bFixScale, ThreadPool* pPool):
   mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-  mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
-  mbStopGBA(false), mpThreadGBA(NULL), mbFixScale(bFixScale), mnFullBAIdx(0) {
+  mbWakeUp(false), mbIdle(false), mpMatchedKF(NULL), mLastLoopKFid(0), mnLastMergeKFid(0), mdTravel(0.0), mbHasCenter(false), mbRunningGBA(false), mbFinishedGBA(true),
+  mbStopGBA(false), mpThreadGBA(NULL), mbFixScale(bFixScale), mpRemote(nullptr), mpEnergy(nullptr) {
   mnCovisibilityConsistencyTh = 3;
+
+  mpThreadPool = nullptr;
+  if (Config::ThreadsLoop() > 1)
+    mpThreadPool = pPool;
+}
+
+LoopClosing::~LoopClosing() {
 }
 
 void LoopClosing::SetTracker(Tracking *pTracker) {
@@ -57,30 +75,59 @@ void LoopClosing::SetLocalMapper(LocalMapping *pLocalMapper) {
   mpLocalMapper=pLocalMapper;
 }
 
+void LoopClosing::SetRemote(RemoteLoopClient* pRemote) {
+  mpRemote = pRemote;
+  if (mpRemote)
+    mpRemote->SetNotify([this] { WakeUp(); });
+}
+
+void LoopClosing::SetEnergyPolicy(EnergyPolicy* pEnergy) {
+  mpEnergy = pEnergy;
+}
+
 
 void LoopClosing::Run() {
   mbFinished =false;
+  SetThreadPlacement(Config::LoopCore(), 0, Config::LoopNice());
+  Trace::SetThreadName("LoopClosing");
+  ScopedParticipant participant(mpMap->GetReclaimer());
 
   while (1) {
+    participant.Quiescent();
+
     // Check if there are keyframes in the queue
     if (CheckNewKeyFrames()) {
-      // Detect loop candidates and check covisibility consistency
-      if (DetectLoop()) {
+      Timer twork(true);
+
+      // Detect loop candidates and check covisibility consistency (by the server if remote)
+      if (mpRemote) {
+        SendKeyFrame();
+      } else if (DetectLoop()) {
          // Compute similarity transformation [sR|t]
          // In the stereo/RGBD case s=1
          if (ComputeSim3()) {
            // Perform loop fusion and pose graph optimization
            CorrectLoop();
          }
+      } else if (DetectMerge()) {
+        // Place seen in another session, move this one to its coordinates
+        MergeSessions();
       }
+
+      twork.Stop();
+      if (mpEnergy)
+        mpEnergy->Rest(twork.GetMsTime());
     }
 
+    if (mpRemote)
+      ApplyRemoteCorrection();
+
     ResetIfRequested();
 
     if (CheckFinish())
       break;
 
-    usleep(5000);
+    WaitForWork();
   }
 
   SetFinish();
@@ -88,62 +135,121 @@ void LoopClosing::Run() {
 
 void LoopClosing::InsertKeyFrame(KeyFrame *pKF) {
   unique_lock<mutex> lock(mMutexLoopQueue);
-  if (pKF->mnId != 0)
+  if (pKF->mnId != 0) {
     mlpLoopKeyFrameQueue.push_back(pKF);
+    Metrics::Set(Metrics::LOOP_QUEUE, mlpLoopKeyFrameQueue.size());
+    mbIdle = false;
+    mCondLoopQueue.notify_one();
+  }
 }
 
 bool LoopClosing::CheckNewKeyFrames() {
   unique_lock<mutex> lock(mMutexLoopQueue);
-  return(!mlpLoopKeyFrameQueue.empty());
+  return !mlpLoopKeyFrameQueue.empty() && mlpLoopKeyFrameQueue.size() >= LoopBatch();
+}
+
+size_t LoopClosing::LoopBatch() const {
+  // Every keyframe is sent to the server, it rebuilds the map with them
+  if (!mpEnergy || mpRemote)
+    return 1;
+  return mpEnergy->LoopBatch();
+}
+
+void LoopClosing::WakeUp() {
+  unique_lock<mutex> lock(mMutexLoopQueue);
+  mbWakeUp = true;
+  mCondLoopQueue.notify_one();
+}
+
+void LoopClosing::WaitForWork() {
+  unique_lock<mutex> lock(mMutexLoopQueue);
+  // An incomplete batch waits for more keyframes, it is not pending work
+  if (mlpLoopKeyFrameQueue.size() < LoopBatch()) {
+    mbIdle = true;
+    mCondIdle.notify_all();
+  }
+  mCondLoopQueue.wait(lock, [this] {
+    return mbWakeUp || (!mlpLoopKeyFrameQueue.empty() && mlpLoopKeyFrameQueue.size() >= LoopBatch());
+  });
+  mbWakeUp = false;
+  mbIdle = false;
+}
+
+void LoopClosing::WaitUntilIdle() {
+  unique_lock<mutex> lock(mMutexLoopQueue);
+  mCondIdle.wait(lock, [this] { return mbIdle; });
 }
 
 bool LoopClosing::DetectLoop() {
+  SD_TRACE("DetectLoop");
   {
     unique_lock<mutex> lock(mMutexLoopQueue);
+    // Batched keyframes are skipped, loops are searched from the newest one
+    if (LoopBatch() > 1) {
+      while (mlpLoopKeyFrameQueue.size() > 1)
+        mlpLoopKeyFrameQueue.pop_front();
+    }
     mpCurrentKF = mlpLoopKeyFrameQueue.front();
     mlpLoopKeyFrameQueue.pop_front();
+    Metrics::Set(Metrics::LOOP_QUEUE, mlpLoopKeyFrameQueue.size());
     // Avoid that a keyframe can be erased while it is being process by this thread
     mpCurrentKF->SetNotErase();
   }
 
+  const Eigen::Vector3d center = mpCurrentKF->GetCameraCenter();
+  if (mbHasCenter)
+    mdTravel += (center-mLastCenter).norm();
+  mLastCenter = center;
+  mbHasCenter = true;
+
   //If the map contains less than 10 KF or less than 10 KF have passed from last loop detection
   if (mpCurrentKF->mnId<mLastLoopKFid+10) {
     mpCurrentKF->SetErase();
     return false;
   }
 
-  map<KeyFrame*, double> candidateKFs;
-  set<KeyFrame*> connectedKeyFrames = mpCurrentKF->GetConnectedKeyFrames();
-  vector<KeyFrame*> kfs = mpMap->GetAllKeyFrames();
-  double error, best_error = 1e10;
+  ScratchScope scratch;
+  ScratchMap<KeyFrame*, double> candidateKFs;
+  double best_error = 1e10;
+
+  // Retrieve most similar keyframes (connected ones are discarded)
+  // Candidates are restricted to where drift since last loop can have taken us
+  KeyFrameDatabase::Gate gate;
+  if (Config::LoopGateRadius() > 0)
+    gate = KeyFrameDatabase::Gate(center, Config::LoopGateRadius() + Config::LoopGateDrift()*mdTravel);
+
+  vector<KeyFrame*> kfs = mpMap->GetKeyFrameDatabase()->DetectLoopCandidates(mpCurrentKF, Config::LoopCandidates(), gate);
+
+  // Other sessions have their own coordinates, they are merged instead
+  const int nSession = mpMap->GetSession(mpCurrentKF);
+  kfs.erase(std::remove_if(kfs.begin(), kfs.end(), [&](KeyFrame* pKF) {
+    return mpMap->GetSession(pKF) != nSession;
+  }), kfs.end());
+
+  // Try to align keyframes, candidates are independent
+  ScratchVector<double> vErrors(kfs.size(), -1.0);
+  if (mvCandidateAligns.size() < kfs.size())
+    mvCandidateAligns.resize(kfs.size());
+  ParallelFor(kfs.size(), [&](int i) {
+    ScopedPage page(mpMap->GetPager(), kfs[i]);
+    ImageAlign &image_align = mvCandidateAligns[i];
+    if (image_align.ComputePose(mpCurrentKF, kfs[i]))
+      vErrors[i] = image_align.GetError();
+  });
 
   // Search candidates to be a loop
   for (size_t i = 0; i<kfs.size(); i++) {
-    KeyFrame* kf = kfs[i];
-
-    if (kf->mnId == mpCurrentKF->mnId)
-      continue;
-
-    // Discard connected keyframes
-    if (connectedKeyFrames.count(kf))
-      continue;
-
-    // Try to align keyframes
-    ImageAlign image_align;
-    if (!image_align.ComputePose(mpCurrentKF, kf)) {
-      i++; // Skip some keyframes
+    if (vErrors[i] < 0)
       continue;
-    }
 
-    error = image_align.GetError();
-    candidateKFs.insert(std::make_pair(kf, error));
+    candidateKFs.insert(std::make_pair(kfs[i], vErrors[i]));
 
-    if (error < best_error)
-      best_error = error;
+    if (vErrors[i] < best_error)
+      best_error = vErrors[i];
   }
 
   // Select only the best candidates with score lower than 1.5*best
-  vector<KeyFrame*> vpCandidateKFs;
+  ScratchVector<KeyFrame*> vpCandidateKFs;
   for (auto it=candidateKFs.begin(); it != candidateKFs.end(); it++) {
     if (it->second < best_error*1.5) {
       vpCandidateKFs.push_back(it->first);
@@ -164,21 +270,30 @@ bool LoopClosing::DetectLoop() {
   mvpEnoughConsistentCandidates.clear();
 
   vector<ConsistentGroup> vCurrentConsistentGroups;
-  vector<bool> vbConsistentGroup(mvConsistentGroups.size(), false);
+  ScratchVector<bool> vbConsistentGroup(mvConsistentGroups.size(), false);
+  vector<unsigned long> vCandidateGroup;
   for (size_t i = 0, iend=vpCandidateKFs.size(); i < iend; i++) {
     KeyFrame* pCandidateKF = vpCandidateKFs[i];
 
-    set<KeyFrame*> spCandidateGroup = pCandidateKF->GetConnectedKeyFrames();
-    spCandidateGroup.insert(pCandidateKF);
+    vCandidateGroup.clear();
+    pCandidateKF->GetConnectedIds(vCandidateGroup);
+    vCandidateGroup.push_back(pCandidateKF->mnId);
+    std::sort(vCandidateGroup.begin(), vCandidateGroup.end());
 
     bool bEnoughConsistent = false;
     bool bConsistentForSomeGroup = false;
     for (size_t iG = 0, iendG = mvConsistentGroups.size(); iG<iendG; iG++) {
-      set<KeyFrame*> sPreviousGroup = mvConsistentGroups[iG].first;
+      const vector<unsigned long> &vPreviousGroup = mvConsistentGroups[iG].first;
 
+      // Both are sorted, walk them together until a shared id is found
       bool bConsistent = false;
-      for (set<KeyFrame*>::iterator sit = spCandidateGroup.begin(), send = spCandidateGroup.end(); sit != send;sit++) {
-        if (sPreviousGroup.count(*sit)) {
+      vector<unsigned long>::const_iterator itC = vCandidateGroup.begin(), itP = vPreviousGroup.begin();
+      while (itC != vCandidateGroup.end() && itP != vPreviousGroup.end()) {
+        if (*itC < *itP) {
+          itC++;
+        } else if (*itP < *itC) {
+          itP++;
+        } else {
           bConsistent=true;
           bConsistentForSomeGroup=true;
           break;
@@ -189,8 +304,7 @@ bool LoopClosing::DetectLoop() {
         int nPreviousConsistency = mvConsistentGroups[iG].second;
         int nCurrentConsistency = nPreviousConsistency + 1;
         if (!vbConsistentGroup[iG]) {
-          ConsistentGroup cg = make_pair(spCandidateGroup,nCurrentConsistency);
-          vCurrentConsistentGroups.push_back(cg);
+          vCurrentConsistentGroups.push_back(std::make_pair(vCandidateGroup, nCurrentConsistency));
           vbConsistentGroup[iG]=true; //this avoid to include the same group more than once
         }
         if (nCurrentConsistency >= mnCovisibilityConsistencyTh && !bEnoughConsistent) {
@@ -201,14 +315,12 @@ bool LoopClosing::DetectLoop() {
     }
 
     // If the group is not consistent with any previous group insert with consistency counter set to zero
-    if (!bConsistentForSomeGroup) {
-      ConsistentGroup cg = make_pair(spCandidateGroup, 0);
-      vCurrentConsistentGroups.push_back(cg);
-    }
+    if (!bConsistentForSomeGroup)
+      vCurrentConsistentGroups.push_back(std::make_pair(vCandidateGroup, 0));
   }
 
   // Update Covisibility Consistent Groups
-  mvConsistentGroups = vCurrentConsistentGroups;
+  mvConsistentGroups.swap(vCurrentConsistentGroups);
 
   if (mvpEnoughConsistentCandidates.empty()) {
     mpCurrentKF->SetErase();
@@ -222,103 +334,155 @@ bool LoopClosing::DetectLoop() {
 }
 
 bool LoopClosing::ComputeSim3() {
+  SD_TRACE("ComputeSim3");
   // For each consistent loop candidate we try to compute a Sim3
   const int nInitialCandidates = mvpEnoughConsistentCandidates.size();
 
-  // We compute first ORB matches for each candidate
-  // If enough matches are found, we setup a Sim3Solver
-  ORBmatcher matcher(0.75, true);
-
-  vector<Sim3Solver*> vpSim3Solvers;
-  vpSim3Solvers.resize(nInitialCandidates);
-
-  vector<vector<MapPoint*> > vvpMapPointMatches;
-  vvpMapPointMatches.resize(nInitialCandidates);
-
-  vector<bool> vbDiscarded;
-  vbDiscarded.resize(nInitialCandidates);
-
-  bool bMatch = false;
-  int nCandidates = 0;
-
-  for (int i = 0; i<nInitialCandidates; i++) {
-    KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
+  vector<Sim3Solver*> vpSim3Solvers(nInitialCandidates, static_cast<Sim3Solver*>(NULL));
+  vector<vector<MapPoint*> > vvpMapPointMatches(nInitialCandidates);
+
+  // Not a vector<bool>, candidates are written from different threads
+  vector<char> vbDiscarded(nInitialCandidates, false);
+
+  // avoid that local mapping erase them while they are being processed in this thread
+  for (int i = 0; i<nInitialCandidates; i++)
+    mvpEnoughConsistentCandidates[i]->SetNotErase();
+
+  // We compute first ORB matches for each candidate. Without bag of words (no vocabulary) they
+  // are brute force, candidates are then matched in batches so each point of the current
+  // keyframe is compared with the whole batch in one pass
+  vector<int> vnMatches(nInitialCandidates, 0);
+  const int nBatch = mpCurrentKF->HasBoW() ? 1 : 4;
+  ParallelFor((nInitialCandidates+nBatch-1)/nBatch, [&](int b) {
+    ORBmatcher matcher(0.75, true);
+    vector<KeyFrame*> vpKFs;
+    vector<int> vIndices;
+    for (int i = b*nBatch; i < std::min(nInitialCandidates, (b+1)*nBatch); i++) {
+      if (!mvpEnoughConsistentCandidates[i]->isBad()) {
+        vpKFs.push_back(mvpEnoughConsistentCandidates[i]);
+        vIndices.push_back(i);
+      }
+    }
 
-    // avoid that local mapping erase it while it is being processed in this thread
-    pKF->SetNotErase();
+    if (nBatch == 1) {
+      if (!vpKFs.empty())
+        vnMatches[b] = matcher.SearchByBoW(mpCurrentKF, vpKFs[0], vvpMapPointMatches[b]);
+      return;
+    }
 
-    if (pKF->isBad()) {
-      vbDiscarded[i] = true;
-      continue;
+    vector<vector<MapPoint*> > vvMatches;
+    vector<int> vn;
+    matcher.SearchByPoints(mpCurrentKF, vpKFs, vvMatches, vn);
+    for (size_t k = 0; k < vIndices.size(); k++) {
+      vvpMapPointMatches[vIndices[k]] = std::move(vvMatches[k]);
+      vnMatches[vIndices[k]] = vn[k];
     }
+  });
 
-    int nmatches = matcher.SearchByPoints(mpCurrentKF, pKF, vvpMapPointMatches[i]);
-    if (nmatches<20) {
+  // If enough matches are found, we setup a Sim3Solver
+  ParallelFor(nInitialCandidates, [&](int i) {
+    if (vnMatches[i]<20) {
       vbDiscarded[i] = true;
-      continue;
     } else {
-      Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF,pKF, vvpMapPointMatches[i], mbFixScale);
-      pSolver->SetRansacParameters(0.99, 20, 300);
+      Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF, mvpEnoughConsistentCandidates[i], vvpMapPointMatches[i], mbFixScale);
+      pSolver->SetRansacParameters(0.99, 20, 300, Config::LoopProsac());
       vpSim3Solvers[i] = pSolver;
     }
+  });
 
-    nCandidates++;
-  }
+  // Successful candidate. If several succeed at the same time, the first one is kept
+  std::atomic<bool> bFound(false);
+  mutex mutexMatch;
+  int nMatchIdx = -1;
+  g2o::Sim3 gMatchScm;
+  vector<MapPoint*> vpMatchPoints;
 
-  // Perform alternatively RANSAC iterations for each candidate
-  // until one is succesful or all fail
-  while (nCandidates > 0 && !bMatch) {
-    for (int i = 0; i<nInitialCandidates; i++) {
-      if (vbDiscarded[i])
-        continue;
+  // Perform 5 Ransac Iterations on candidate i. Returns true once it is discarded
+  auto Iterate = [&](int i) {
+    KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
 
-      KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
+    vector<bool> vbInliers;
+    int nInliers;
+    bool bNoMore;
 
-      // Perform 5 Ransac Iterations
-      vector<bool> vbInliers;
-      int nInliers;
-      bool bNoMore;
+    Sim3Solver* pSolver = vpSim3Solvers[i];
+    Eigen::Matrix4d Scm  = pSolver->iterate(5,bNoMore, vbInliers,nInliers);
 
-      Sim3Solver* pSolver = vpSim3Solvers[i];
-      Eigen::Matrix4d Scm  = pSolver->iterate(5,bNoMore, vbInliers,nInliers);
+    // If Ransac reachs max. iterations discard keyframe
+    if (bNoMore)
+      vbDiscarded[i]=true;
 
-      // If Ransac reachs max. iterations discard keyframe
-      if (bNoMore) {
-        vbDiscarded[i]=true;
-        nCandidates--;
+    // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
+    if (!Scm.isZero()) {
+      vector<MapPoint*> vpMapPointMatches(vvpMapPointMatches[i].size(), static_cast<MapPoint*>(NULL));
+      for (size_t j = 0, jend=vbInliers.size(); j < jend; j++) {
+        if (vbInliers[j])
+           vpMapPointMatches[j]=vvpMapPointMatches[i][j];
       }
 
-      // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
-      if (!Scm.isZero()) {
-        vector<MapPoint*> vpMapPointMatches(vvpMapPointMatches[i].size(), static_cast<MapPoint*>(NULL));
-        for (size_t j = 0, jend=vbInliers.size(); j < jend; j++) {
-          if (vbInliers[j])
-             vpMapPointMatches[j]=vvpMapPointMatches[i][j];
+      Eigen::Matrix3d R = pSolver->GetEstimatedRotation();
+      Eigen::Vector3d t = pSolver->GetEstimatedTranslation();
+      const float s = pSolver->GetEstimatedScale();
+      ORBmatcher matcher(0.75, true);
+      matcher.SearchBySim3(mpCurrentKF, pKF, vpMapPointMatches, s, R, t, 7.5);
+
+      g2o::Sim3 gScm(R, t, s);
+      const int nInliers = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMapPointMatches, gScm, 10, mbFixScale);
+
+      // If optimization is succesful stop ransacs and continue
+      if (nInliers>=20) {
+        unique_lock<mutex> lock(mutexMatch);
+        if (nMatchIdx < 0 || i < nMatchIdx) {
+          nMatchIdx = i;
+          gMatchScm = gScm;
+          vpMatchPoints = vpMapPointMatches;
         }
+        bFound = true;
+      }
+    }
 
-        Eigen::Matrix3d R = pSolver->GetEstimatedRotation();
-        Eigen::Vector3d t = pSolver->GetEstimatedTranslation();
-        const float s = pSolver->GetEstimatedScale();
-        matcher.SearchBySim3(mpCurrentKF, pKF, vpMapPointMatches, s, R, t, 7.5);
+    return static_cast<bool>(vbDiscarded[i]);
+  };
 
-        g2o::Sim3 gScm(R, t, s);
-        const int nInliers = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMapPointMatches, gScm, 10, mbFixScale);
+  if (mpThreadPool) {
+    // Candidates are independent, each one runs until it succeeds, fails or another one succeeds
+    ParallelFor(nInitialCandidates, [&](int i) {
+      if (vbDiscarded[i])
+        return;
+      while (!bFound && !Iterate(i)) {
+      }
+    });
+  } else {
+    // Perform alternatively RANSAC iterations for each candidate
+    // until one is succesful or all fail
+    int nCandidates = std::count(vbDiscarded.begin(), vbDiscarded.end(), false);
+    while (nCandidates > 0 && !bFound) {
+      for (int i = 0; i<nInitialCandidates; i++) {
+        if (vbDiscarded[i])
+          continue;
 
-        // If optimization is succesful stop ransacs and continue
-        if (nInliers>=20) {
-          bMatch = true;
-          mpMatchedKF = pKF;
-          g2o::Sim3 gSmw(pKF->GetRotation(), pKF->GetTranslation(), 1.0);
-          mg2oScw = gScm*gSmw;
-          mScw = Converter::toMatrix4d(mg2oScw);
+        if (Iterate(i))
+          nCandidates--;
 
-          mvpCurrentMatchedPoints = vpMapPointMatches;
+        if (bFound)
           break;
-        }
       }
     }
   }
 
+  for (Sim3Solver* pSolver : vpSim3Solvers)
+    delete pSolver;
+
+  const bool bMatch = nMatchIdx >= 0;
+  if (bMatch) {
+    mpMatchedKF = mvpEnoughConsistentCandidates[nMatchIdx];
+    g2o::Sim3 gSmw(mpMatchedKF->GetRotation(), mpMatchedKF->GetTranslation(), 1.0);
+    mg2oScw = gMatchScm*gSmw;
+    mScw = Converter::toMatrix4d(mg2oScw);
+
+    mvpCurrentMatchedPoints = vpMatchPoints;
+  }
+
   if (!bMatch) {
     for (int i = 0; i<nInitialCandidates; i++)
        mvpEnoughConsistentCandidates[i]->SetErase();
@@ -345,6 +509,7 @@ bool LoopClosing::ComputeSim3() {
   }
 
   // Find more matches projecting with the computed Sim3
+  ORBmatcher matcher(0.75, true);
   matcher.SearchByProjection(mpCurrentKF, mScw, mvpLoopMapPoints, mvpCurrentMatchedPoints, 10);
 
   // If enough matches accept Loop
@@ -368,29 +533,19 @@ bool LoopClosing::ComputeSim3() {
 }
 
 void LoopClosing::CorrectLoop() {
+  SD_TRACE("CorrectLoop");
   LOGD("Loop detected!");
 
   // Send a stop signal to Local Mapping
   // Avoid new keyframes are inserted while correcting the loop
   mpLocalMapper->RequestStop();
 
-  // If a Global Bundle Adjustment is running, abort it
-  if (isRunningGBA()) {
-    unique_lock<mutex> lock(mMutexGBA);
-    mbStopGBA = true;
-
-    mnFullBAIdx++;
-
-    if (mpThreadGBA) {
-      mpThreadGBA->detach();
-      delete mpThreadGBA;
-    }
-  }
+  // If a Global Bundle Adjustment is running, stop it after its current iteration.
+  // Its best result so far is applied to the map, so the new one starts from there
+  StopGlobalBundleAdjustment();
 
   // Wait until Local Mapping has effectively stopped
-  while (!mpLocalMapper->isStopped()) {
-    usleep(1000);
-  }
+  mpLocalMapper->WaitUntilStopped();
 
   // Ensure current keyframe is updated
   mpCurrentKF->UpdateConnections();
@@ -405,7 +560,7 @@ void LoopClosing::CorrectLoop() {
 
   {
     // Get Map Mutex
-    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+    unique_lock<mutex> lock = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
 
     for (vector<KeyFrame*>::iterator vit = mvpCurrentConnectedKFs.begin(), vend = mvpCurrentConnectedKFs.end(); vit!=vend; vit++) {
       KeyFrame* pKFi = *vit;
@@ -429,13 +584,26 @@ void LoopClosing::CorrectLoop() {
       NonCorrectedSim3[pKFi]=g2oSiw;
     }
 
-    // Correct all MapPoints obsrved by current keyframe and neighbors, so that they align with the other side of the loop
-    for (KeyFrameAndPose::iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit != mend; mit++) {
+    // Correct all MapPoints obsrved by current keyframe and neighbors, so that they align with the other side of the loop.
+    // Each point is corrected once, with the first keyframe that observes it
+    struct PointCorrection {
+      MapPoint* pMP;
+      const g2o::Sim3* pSiw;
+      const g2o::Sim3* pCorrectedSwi;
+    };
+    vector<PointCorrection> vCorrections;
+    vector<KeyFrame*> vpCorrectedKFs;
+    vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3> > vCorrectedSwi;
+    vCorrectedSwi.reserve(CorrectedSim3.size());
+
+    for (KeyFrameAndPose::iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit != mend; mit++)
+      vCorrectedSwi.push_back(mit->second.inverse());
+
+    size_t k = 0;
+    for (KeyFrameAndPose::iterator mit=CorrectedSim3.begin(), mend=CorrectedSim3.end(); mit != mend; mit++, k++) {
       KeyFrame* pKFi = mit->first;
-      g2o::Sim3 g2oCorrectedSiw = mit->second;
-      g2o::Sim3 g2oCorrectedSwi = g2oCorrectedSiw.inverse();
-
-      g2o::Sim3 g2oSiw =NonCorrectedSim3[pKFi];
+      const g2o::Sim3 &g2oCorrectedSiw = mit->second;
+      const g2o::Sim3 &g2oSiw = NonCorrectedSim3[pKFi];
 
       vector<MapPoint*> vpMPsi = pKFi->GetMapPointMatches();
       for (size_t iMP = 0, endMPi = vpMPsi.size(); iMP<endMPi; iMP++) {
@@ -447,14 +615,14 @@ void LoopClosing::CorrectLoop() {
         if (pMPi->mnCorrectedByKF == mpCurrentKF->mnId)
           continue;
 
-        // Project with non-corrected pose and project back with corrected pose
-        Eigen::Vector3d P3Dw = pMPi->GetWorldPos();
-        Eigen::Vector3d CorrectedP3Dw = g2oCorrectedSwi.map(g2oSiw.map(P3Dw));
-
-        pMPi->SetWorldPos(CorrectedP3Dw);
         pMPi->mnCorrectedByKF = mpCurrentKF->mnId;
         pMPi->mnCorrectedReference = pKFi->mnId;
-        pMPi->UpdateNormalAndDepth();
+
+        PointCorrection c;
+        c.pMP = pMPi;
+        c.pSiw = &g2oSiw;
+        c.pCorrectedSwi = &vCorrectedSwi[k];
+        vCorrections.push_back(c);
       }
 
       // Update keyframe pose with corrected Sim3. First transform Sim3 to SE3 (scale translation)
@@ -465,10 +633,22 @@ void LoopClosing::CorrectLoop() {
       eigt *=(1./s); //[R t/s;0 1]
 
       pKFi->SetPose(Converter::toSE3(eigR,eigt));
+      vpCorrectedKFs.push_back(pKFi);
+    }
+
+    // Project with non-corrected pose and project back with corrected pose. Normals use corrected keyframes
+    ParallelForBlocks(vCorrections.size(), [&](size_t i) {
+      const PointCorrection &c = vCorrections[i];
+      Eigen::Vector3d P3Dw = c.pMP->GetWorldPos();
+      Eigen::Vector3d CorrectedP3Dw = c.pCorrectedSwi->map(c.pSiw->map(P3Dw));
+
+      c.pMP->SetWorldPos(CorrectedP3Dw);
+      c.pMP->UpdateNormalAndDepth();
+    });
 
-      // Make sure connections are updated
+    // Make sure connections are updated
+    for (KeyFrame* pKFi : vpCorrectedKFs)
       pKFi->UpdateConnections();
-    }
 
     // Start Loop Fusion
     // Update matched map points and replace if duplicated
@@ -512,7 +692,8 @@ void LoopClosing::CorrectLoop() {
   }
 
   // Optimize graph
-  Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale);
+  Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale,
+                                    mpThreadPool, Config::ThreadsLoop());
 
   mpMap->InformNewBigChange();
 
@@ -520,36 +701,176 @@ void LoopClosing::CorrectLoop() {
   mpMatchedKF->AddLoopEdge(mpCurrentKF);
   mpCurrentKF->AddLoopEdge(mpMatchedKF);
 
-  // Launch a new thread to perform Global Bundle Adjustment
+  mpMap->PublishSnapshot();
+
+  // Launch a new thread to perform Global Bundle Adjustment, or only around the loop.
+  // Essential graph already distributed the correction, the loop region is where
+  // reprojection errors remain
+  vector<KeyFrame*> vpRegionKFs;
+  if (Config::LoopRegion() > 0)
+    vpRegionKFs = GetLoopRegion(Config::LoopRegion());
+
   mbRunningGBA = true;
   mbFinishedGBA = false;
   mbStopGBA = false;
-  mpThreadGBA = new std::thread(&LoopClosing::RunGlobalBundleAdjustment, this, mpCurrentKF->mnId);
+  mpThreadGBA = new std::thread(&LoopClosing::RunGlobalBundleAdjustment, this, mpCurrentKF->mnId, vpRegionKFs);
 
   // Loop closed. Release Local Mapping.
   mpLocalMapper->Release();
 
   mLastLoopKFid = mpCurrentKF->mnId;
+  mdTravel = 0.0;
+  mbHasCenter = false;
 }
 
-void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap) {
-  ORBmatcher matcher(0.8);
+void LoopClosing::SendKeyFrame() {
+  KeyFrame* pKF;
+  {
+    unique_lock<mutex> lock(mMutexLoopQueue);
+    pKF = mlpLoopKeyFrameQueue.front();
+    mlpLoopKeyFrameQueue.pop_front();
+    Metrics::Set(Metrics::LOOP_QUEUE, mlpLoopKeyFrameQueue.size());
+    // Avoid that a keyframe can be erased while it is being encoded
+    pKF->SetNotErase();
+  }
+
+  if (!mpRemote->SendKeyFrame(pKF)) {
+    LOGE("Connection to loop closing server lost, closing loops locally");
+    mpRemote = nullptr;
+  }
 
-  for (KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit != mend;mit++) {
-    KeyFrame* pKF = mit->first;
+  pKF->SetErase();
+}
 
-    g2o::Sim3 g2oScw = mit->second;
-    Eigen::Matrix4d cvScw = Converter::toMatrix4d(g2oScw);
+void LoopClosing::ApplyRemoteCorrection() {
+  RemoteLoopClient::Correction correction;
+  if (!mpRemote->PopCorrection(correction))
+    return;
 
-    vector<MapPoint*> vpReplacePoints(mvpLoopMapPoints.size(), static_cast<MapPoint*>(NULL));
-    matcher.Fuse(pKF, cvScw, mvpLoopMapPoints, 4, vpReplacePoints);
+  SD_TRACE("ApplyRemoteCorrection");
+  LOGD("Applying correction %lu of loop closing server", correction.nSequence);
+
+  mpLocalMapper->RequestStop();
+  mpLocalMapper->WaitUntilStopped();
+
+  {
+    unique_lock<mutex> lockMap = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
+
+    // Tagged as a global BA result, with a value no keyframe id will reach
+    const unsigned long nTag = std::numeric_limits<unsigned long>::max() - correction.nSequence;
+
+    for (size_t i = 0; i < correction.vKeyFrameIds.size(); i++) {
+      KeyFrame* pKF = mpMap->GetKeyFrame(correction.vKeyFrameIds[i]);
+      if (!pKF || pKF->isBad())
+        continue;
+      pKF->mTcwGBA = correction.vKeyFramePoses[i];
+      pKF->mnBAGlobalForKF = nTag;
+    }
+
+    for (size_t i = 0; i < correction.vPointIds.size(); i++) {
+      MapPoint* pMP = mpMap->GetMapPoint(correction.vPointIds[i]);
+      if (!pMP || pMP->isBad())
+        continue;
+      pMP->mPosGBA = correction.vPointPositions[i];
+      pMP->mnBAGlobalForKF = nTag;
+    }
+
+    // Keyframes and points the server didn't know yet follow the corrected ones
+    ApplyGlobalCorrection(nTag);
+  }
+
+  mpRemote->SetApplied(correction.nSequence);
+  mpLocalMapper->Release();
+}
+
+void LoopClosing::StopGlobalBundleAdjustment() {
+  if (!mpThreadGBA)
+    return;
+
+  {
+    unique_lock<mutex> lock(mMutexGBA);
+    mbStopGBA = true;
+  }
+
+  mpThreadGBA->join();
+  delete mpThreadGBA;
+  mpThreadGBA = NULL;
+
+  // Applying the result released Local Mapping
+  mpLocalMapper->RequestStop();
+}
+
+bool LoopClosing::DetectMerge() {
+  // At most one attempt every 10 keyframes
+  if (mpCurrentKF->isBad() || mpCurrentKF->mnId < mnLastMergeKFid+10)
+    return false;
+
+  const vector<KeyFrame*> vpSessionKFs = mpMap->GetSessionKeyFrames(mpMap->GetSession(mpCurrentKF));
+  if (vpSessionKFs.size() >= mpMap->KeyFramesInMap())
+    return false;
+
+  // Similar keyframes in other sessions
+  const set<KeyFrame*> sSessionKFs(vpSessionKFs.begin(), vpSessionKFs.end());
+  return !mpMap->GetKeyFrameDatabase()->DetectCandidates(mpCurrentKF, sSessionKFs, Config::LoopCandidates()).empty();
+}
+
+void LoopClosing::MergeSessions() {
+  SD_TRACE("MergeSessions");
+  mnLastMergeKFid = mpCurrentKF->mnId;
+
+  // Same as a loop correction, keyframes must not change meanwhile
+  mpLocalMapper->RequestStop();
+  StopGlobalBundleAdjustment();
+  mpLocalMapper->WaitUntilStopped();
+
+  const int nSession = mpMap->GetSession(mpCurrentKF);
+  MapMerger merger(mpMap, mbFixScale, mpThreadPool, Config::ThreadsLoop());
+  if (merger.Merge(mpMap->GetSessionKeyFrames(nSession))) {
+    const int nOldSession = mpMap->GetSession(merger.GetMatchedKeyFrame());
+    LOGD("Map %d merged into map %d", nSession, nOldSession);
+
+    // Tracking was in the coordinates before merging
+    if (mpMap->JoinSessions(nSession, nOldSession)) {
+      unique_lock<mutex> lock = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
+      mpTracker->ForceRelocalization();
+    }
+
+    mpMap->PublishSnapshot();
+    mLastLoopKFid = mpCurrentKF->mnId;
+    mdTravel = 0.0;
+    mbHasCenter = false;
+  }
+
+  mpLocalMapper->Release();
+}
+
+void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap) {
+  vector<KeyFrameAndPose::const_iterator> vCorrected;
+  vCorrected.reserve(CorrectedPosesMap.size());
+  for (KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit != mend;mit++)
+    vCorrected.push_back(mit);
+
+  // Searches only read the keyframes and loop points, one keyframe per task
+  vector<vector<std::pair<size_t, size_t> > > vvMatches(vCorrected.size());
+  ParallelFor(vCorrected.size(), [&](int i) {
+    ORBmatcher matcher(0.8);
+    Eigen::Matrix4d cvScw = Converter::toMatrix4d(vCorrected[i]->second);
+    matcher.SearchFuse(vCorrected[i]->first, cvScw, mvpLoopMapPoints, 4, vvMatches[i]);
+  });
+
+  // Get Map Mutex, all keyframes are fused at once
+  ORBmatcher matcher(0.8);
+  unique_lock<mutex> lock = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
+  const int nLP = mvpLoopMapPoints.size();
+  vector<MapPoint*> vpReplacePoints(nLP);
+
+  for (size_t k = 0; k < vCorrected.size(); k++) {
+    std::fill(vpReplacePoints.begin(), vpReplacePoints.end(), static_cast<MapPoint*>(NULL));
+    matcher.ApplyFuse(vCorrected[k]->first, mvpLoopMapPoints, vvMatches[k], vpReplacePoints);
 
-    // Get Map Mutex
-    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
-    const int nLP = mvpLoopMapPoints.size();
     for (int i = 0; i<nLP; i++) {
       MapPoint* pRep = vpReplacePoints[i];
-      if (pRep) {
+      if (pRep && !pRep->isBad()) {
         pRep->Replace(mvpLoopMapPoints[i]);
       }
     }
@@ -563,30 +884,66 @@ void LoopClosing::RequestReset() {
     mbResetRequested = true;
   }
 
-  while (1) {
-    {
-    unique_lock<mutex> lock2(mMutexReset);
-    if (!mbResetRequested)
-      break;
-    }
-    usleep(5000);
-  }
+  WakeUp();
+
+  unique_lock<mutex> lock(mMutexReset);
+  mCondReset.wait(lock, [this] { return !mbResetRequested; });
 }
 
 void LoopClosing::ResetIfRequested() {
   unique_lock<mutex> lock(mMutexReset);
   if (mbResetRequested) {
     mlpLoopKeyFrameQueue.clear();
+    Metrics::Set(Metrics::LOOP_QUEUE, 0);
     mLastLoopKFid = 0;
+    mnLastMergeKFid = 0;
+    mdTravel = 0.0;
+    mbHasCenter = false;
     mbResetRequested=false;
+    mCondReset.notify_all();
+  }
+}
+
+vector<KeyFrame*> LoopClosing::GetLoopRegion(int nHops) {
+  // Breadth first search over the best covisible keyframes of both loop ends
+  set<KeyFrame*> sRegion;
+  vector<KeyFrame*> vpLevel;
+  vpLevel.push_back(mpCurrentKF);
+  vpLevel.push_back(mpMatchedKF);
+  sRegion.insert(vpLevel.begin(), vpLevel.end());
+
+  for (int i = 0; i < nHops && !vpLevel.empty(); i++) {
+    vector<KeyFrame*> vpNext;
+    for (KeyFrame* pKF : vpLevel) {
+      const vector<KeyFrame*> vpNeighs = pKF->GetBestCovisibilityKeyFrames(10);
+      for (KeyFrame* pKFi : vpNeighs) {
+        if (!pKFi->isBad() && sRegion.insert(pKFi).second)
+          vpNext.push_back(pKFi);
+      }
+    }
+    vpLevel.swap(vpNext);
   }
+
+  return vector<KeyFrame*>(sRegion.begin(), sRegion.end());
 }
 
-void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF) {
-  LOGD("Starting Global Bundle Adjustment");
+void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF, vector<KeyFrame*> vpRegionKFs) {
+  SetThreadPlacement(Config::LoopCore(), 0, Config::LoopNice());
+  Trace::SetThreadName("GlobalBA");
+  SD_TRACE("GlobalBundleAdjustment");
 
-  int idx =  mnFullBAIdx;
-  Optimizer::GlobalBundleAdjustemnt(mpMap, 10,&mbStopGBA,nLoopKF, false);
+  // Map points are used during the whole BA
+  ScopedParticipant participant(mpMap->GetReclaimer());
+
+  if (vpRegionKFs.empty()) {
+    LOGD("Starting Global Bundle Adjustment");
+    ScopedSpan span(Statistics::GLOBAL_BA);
+    Optimizer::GlobalBundleAdjustemnt(mpMap, 10,&mbStopGBA,nLoopKF, false, Config::ThreadsBA(), Config::BackendBA());
+  } else {
+    LOGD("Starting Bundle Adjustment over %d keyframes around the loop", static_cast<int>(vpRegionKFs.size()));
+    ScopedSpan span(Statistics::GLOBAL_BA);
+    Optimizer::RegionBundleAdjustment(vpRegionKFs, 10, &mbStopGBA, nLoopKF, Config::ThreadsBA());
+  }
 
   // Update all MapPoints and KeyFrames
   // Local Mapping was active during BA, that means that there might be new keyframes
@@ -594,92 +951,136 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF) {
   // We need to propagate the correction through the spanning tree
   {
     unique_lock<mutex> lock(mMutexGBA);
-    if (idx != mnFullBAIdx)
-      return;
 
-    if (!mbStopGBA) {
+    // Levenberg only keeps improving steps, an interrupted run is still better than its start
+    if (mbStopGBA) {
+      LOGD("Global Bundle Adjustment interrupted, applying partial result");
+    } else {
       LOGD("Global Bundle Adjustment finished");
-      LOGD("Updating map ...");
-      mpLocalMapper->RequestStop();
-      // Wait until Local Mapping has effectively stopped
+    }
+    LOGD("Updating map ...");
+    mpLocalMapper->RequestStop();
+    // Wait until Local Mapping has effectively stopped (or finished)
+    mpLocalMapper->WaitUntilStopped();
 
-      while (!mpLocalMapper->isStopped() && !mpLocalMapper->isFinished()) {
-        usleep(1000);
-      }
+    // Get Map Mutex
+    unique_lock<mutex> lockMap = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
 
-      // Get Map Mutex
-      unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
-
-      // Correct keyframes starting at map first keyframe
-      list<KeyFrame*> lpKFtoCheck(mpMap->mvpKeyFrameOrigins.begin(), mpMap->mvpKeyFrameOrigins.end());
-
-      while (!lpKFtoCheck.empty()) {
-        KeyFrame* pKF = lpKFtoCheck.front();
-        const set<KeyFrame*> sChilds = pKF->GetChilds();
-        Eigen::Matrix4d Twc = pKF->GetPoseInverse();
-        for (set<KeyFrame*>::const_iterator sit = sChilds.begin();sit != sChilds.end();sit++) {
-          KeyFrame* pChild = *sit;
-          if (pChild->mnBAGlobalForKF!=nLoopKF) {
-            Eigen::Matrix4d Tchildc = pChild->GetPose()*Twc;
-            pChild->mTcwGBA = Tchildc*pKF->mTcwGBA;
-            pChild->mnBAGlobalForKF=nLoopKF;
-          }
-          lpKFtoCheck.push_back(pChild);
-        }
+    ApplyGlobalCorrection(nLoopKF);
 
-        pKF->mTcwBefGBA = pKF->GetPose();
-        pKF->SetPose(pKF->mTcwGBA);
-        lpKFtoCheck.pop_front();
-      }
+    mpLocalMapper->Release();
 
-      // Correct MapPoints
-      const vector<MapPoint*> vpMPs = mpMap->GetAllMapPoints();
+    LOGD("Map updated!");
 
-      for (size_t i = 0; i < vpMPs.size(); i++) {
-        MapPoint* pMP = vpMPs[i];
+    mbFinishedGBA = true;
+    mbRunningGBA = false;
+    mCondGBA.notify_all();
+  }
+}
 
-        if (pMP->isBad())
-          continue;
+void LoopClosing::ApplyGlobalCorrection(unsigned long nLoopKF) {
+  // Correct keyframes starting at map first keyframe, one spanning tree level at a time.
+  // A child only reads its parent, so keyframes of a level are corrected in parallel
+  vector<KeyFrame*> vpLevel(mpMap->mvpKeyFrameOrigins.begin(), mpMap->mvpKeyFrameOrigins.end());
+  vector<vector<KeyFrame*> > vvpChilds;
+
+  // Origins outside an optimized region keep their pose
+  for (KeyFrame* pKF : vpLevel) {
+    if (pKF->mnBAGlobalForKF != nLoopKF) {
+      pKF->mTcwGBA = pKF->GetPose();
+      pKF->mnBAGlobalForKF = nLoopKF;
+    }
+  }
 
-        if (pMP->mnBAGlobalForKF==nLoopKF) {
-          // If optimized by Global BA, just update
-          pMP->SetWorldPos(pMP->mPosGBA);
-        } else {
-          // Update according to the correction of its reference keyframe
-          KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
+  while (!vpLevel.empty()) {
+    vvpChilds.assign(vpLevel.size(), vector<KeyFrame*>());
+
+    ParallelFor(vpLevel.size(), [&](int i) {
+      KeyFrame* pKF = vpLevel[i];
+      const set<KeyFrame*> sChilds = pKF->GetChilds();
+      Eigen::Matrix4d Twc = pKF->GetPoseInverse();
+      for (set<KeyFrame*>::const_iterator sit = sChilds.begin();sit != sChilds.end();sit++) {
+        KeyFrame* pChild = *sit;
+        if (pChild->mnBAGlobalForKF!=nLoopKF) {
+          Eigen::Matrix4d Tchildc = pChild->GetPose()*Twc;
+          pChild->mTcwGBA = Tchildc*pKF->mTcwGBA;
+          pChild->mnBAGlobalForKF=nLoopKF;
+        }
+        vvpChilds[i].push_back(pChild);
+      }
 
-          if (pRefKF->mnBAGlobalForKF!=nLoopKF)
-            continue;
+      pKF->mTcwBefGBA = pKF->GetPose();
+      pKF->SetPose(pKF->mTcwGBA);
+    });
 
-          // Map to non-corrected camera
-          Eigen::Matrix3d Rcw = pRefKF->mTcwBefGBA.block<3, 3>(0, 0);
-          Eigen::Vector3d tcw = pRefKF->mTcwBefGBA.block<3, 1>(0, 3);
-          Eigen::Vector3d Xc = Rcw*pMP->GetWorldPos()+tcw;
+    vpLevel.clear();
+    for (const vector<KeyFrame*> &vpChilds : vvpChilds)
+      vpLevel.insert(vpLevel.end(), vpChilds.begin(), vpChilds.end());
+  }
 
-          // Backproject using corrected camera
-          Eigen::Matrix4d Twc = pRefKF->GetPoseInverse();
-          Eigen::Matrix3d Rwc = Twc.block<3, 3>(0, 0);
-          Eigen::Vector3d twc = Twc.block<3, 1>(0, 3);
+  // Correct MapPoints
+  const vector<MapPoint*> vpMPs = mpMap->GetAllMapPoints();
 
-          pMP->SetWorldPos(Rwc*Xc+twc);
-        }
-      }
+  ParallelForBlocks(vpMPs.size(), [&](size_t i) {
+    MapPoint* pMP = vpMPs[i];
+
+    if (pMP->isBad())
+      return;
+
+    if (pMP->mnBAGlobalForKF==nLoopKF) {
+      // If optimized by Global BA, just update
+      pMP->SetWorldPos(pMP->mPosGBA);
+    } else {
+      // Update according to the correction of its reference keyframe
+      KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
 
-      mpMap->InformNewBigChange();
+      if (pRefKF->mnBAGlobalForKF!=nLoopKF)
+        return;
 
-      mpLocalMapper->Release();
+      // Map to non-corrected camera
+      Eigen::Matrix3d Rcw = pRefKF->mTcwBefGBA.block<3, 3>(0, 0);
+      Eigen::Vector3d tcw = pRefKF->mTcwBefGBA.block<3, 1>(0, 3);
+      Eigen::Vector3d Xc = Rcw*pMP->GetWorldPos()+tcw;
 
-      LOGD("Map updated!");
+      // Backproject using corrected camera
+      Eigen::Matrix4d Twc = pRefKF->GetPoseInverse();
+      Eigen::Matrix3d Rwc = Twc.block<3, 3>(0, 0);
+      Eigen::Vector3d twc = Twc.block<3, 1>(0, 3);
+
+      pMP->SetWorldPos(Rwc*Xc+twc);
     }
+  });
 
-    mbFinishedGBA = true;
-    mbRunningGBA = false;
+  mpMap->InformNewBigChange();
+  mpMap->PublishSnapshot();
+}
+
+void LoopClosing::ParallelFor(int n, const std::function<void(int)> &f) {
+  if (mpThreadPool) {
+    mpThreadPool->ParallelFor(n, f, Config::ThreadsLoop());
+  } else {
+    for (int i = 0; i < n; i++)
+      f(i);
   }
 }
 
+void LoopClosing::ParallelForBlocks(size_t n, const std::function<void(size_t)> &f) {
+  const size_t block = 256;
+  const int nBlocks = (n+block-1)/block;
+  ParallelFor(nBlocks, [&](int b) {
+    const size_t end = std::min(n, (b+1)*block);
+    for (size_t i = b*block; i < end; i++)
+      f(i);
+  });
+}
+
 void LoopClosing::RequestFinish() {
-  unique_lock<mutex> lock(mMutexFinish);
-  mbFinishRequested = true;
+  {
+    unique_lock<mutex> lock(mMutexFinish);
+    mbFinishRequested = true;
+  }
+
+  WakeUp();
 }
 
 bool LoopClosing::CheckFinish() {
@@ -690,6 +1091,7 @@ bool LoopClosing::CheckFinish() {
 void LoopClosing::SetFinish() {
   unique_lock<mutex> lock(mMutexFinish);
   mbFinished = true;
+  mCondFinish.notify_all();
 }
 
 bool LoopClosing::isFinished() {
@@ -697,5 +1099,15 @@ bool LoopClosing::isFinished() {
   return mbFinished;
 }
 
+void LoopClosing::WaitUntilFinished() {
+  unique_lock<mutex> lock(mMutexFinish);
+  mCondFinish.wait(lock, [this] { return mbFinished; });
+}
+
+void LoopClosing::WaitUntilFinishedGBA() {
+  unique_lock<mutex> lock(mMutexGBA);
+  mCondGBA.wait(lock, [this] { return !mbRunningGBA; });
+}
+
 
 }  // namespace SD_SLAM
@@ -27,10 +27,16 @@
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include "KeyFrame.h"
 #include "LocalMapping.h"
 #include "Map.h"
 #include "Tracking.h"
+#include "ImageAlign.h"
+#include "RemoteLoop.h"
+#include "extra/thread_pool.h"
+#include "extra/energy_policy.h"
 #include "extra/g2o/types/types_seven_dof_expmap.h"
 
 namespace SD_SLAM {
@@ -41,17 +47,28 @@ class LocalMapping;
 class LoopClosing {
  public:
 
-  typedef std::pair<std::set<KeyFrame*>, int> ConsistentGroup;
+  // Sorted ids of a candidate and its connected keyframes, and its consistency counter
+  typedef std::pair<std::vector<unsigned long>, int> ConsistentGroup;
   typedef std::map<KeyFrame*,g2o::Sim3, std::less<KeyFrame*>,
     Eigen::aligned_allocator<std::pair<const KeyFrame*, g2o::Sim3> > > KeyFrameAndPose;
 
  public:
-  LoopClosing(Map* pMap, const bool bFixScale);
+  // Map correction uses up to Config::ThreadsLoop() threads of the shared pool
+  LoopClosing(Map* pMap, const bool bFixScale, ThreadPool* pPool = nullptr);
+  ~LoopClosing();
 
   void SetTracker(Tracking* pTracker);
 
   void SetLocalMapper(LocalMapping* pLocalMapper);
 
+  // Forward keyframes to a loop closing server and apply its corrections instead of closing
+  // loops here. Must be set before Run. If the connection is lost, loops are closed locally
+  void SetRemote(RemoteLoopClient* pRemote);
+
+  // Batch loop detection and rest after each keyframe as the policy requires (not owned),
+  // null to run freely. Must be set before Run
+  void SetEnergyPolicy(EnergyPolicy* pEnergy);
+
   // Main function
   void Run();
 
@@ -59,8 +76,9 @@ class LoopClosing {
 
   void RequestReset();
 
-  // This function will run in a separate thread
-  void RunGlobalBundleAdjustment(unsigned long nLoopKF);
+  // This function will run in a separate thread. If vpRegionKFs is not empty, only
+  // this region is optimized and the correction is propagated to the rest of the map
+  void RunGlobalBundleAdjustment(unsigned long nLoopKF, std::vector<KeyFrame*> vpRegionKFs);
 
   bool isRunningGBA() {
     std::unique_lock<std::mutex> lock(mMutexGBA);
@@ -75,9 +93,30 @@ class LoopClosing {
 
   bool isFinished();
 
+  // Block until Loop Closing thread has finished
+  void WaitUntilFinished();
+
+  // Block until Global Bundle Adjustment is not running
+  void WaitUntilFinishedGBA();
+
+  // Block until every inserted keyframe is processed and the thread sleeps
+  void WaitUntilIdle();
+
  protected:
   bool CheckNewKeyFrames();
 
+  // Keyframes within nHops covisibility hops of the loop keyframes
+  std::vector<KeyFrame*> GetLoopRegion(int nHops);
+
+  // Wake up main loop to check reset and finish requests
+  void WakeUp();
+
+  // Sleep until there are new keyframes or an event is signaled
+  void WaitForWork();
+
+  // Keyframes to gather before detecting loops from the newest one, queue mutex must be locked
+  size_t LoopBatch() const;
+
   bool DetectLoop();
 
   bool ComputeSim3();
@@ -86,15 +125,42 @@ class LoopClosing {
 
   void CorrectLoop();
 
+  // Stop Global Bundle Adjustment if it is running, its result is applied
+  void StopGlobalBundleAdjustment();
+
+  // Move keyframes and points tagged with nLoopKF to their mTcwGBA and mPosGBA, and the rest
+  // with their spanning tree parent or reference keyframe. Map update mutex must be locked
+  void ApplyGlobalCorrection(unsigned long nLoopKF);
+
+  // Send next queued keyframe to the server
+  void SendKeyFrame();
+
+  // Apply last correction received from the server, if any
+  void ApplyRemoteCorrection();
+
+  // True if current keyframe looks like a keyframe of another session
+  bool DetectMerge();
+
+  // Align session of current keyframe with the one it overlaps and join them
+  void MergeSessions();
+
+  // Run f(0..n-1) using thread pool if available
+  void ParallelFor(int n, const std::function<void(int)> &f);
+
+  // Run f(i) for i in [0, n) in blocks, for cheap per item work
+  void ParallelForBlocks(size_t n, const std::function<void(size_t)> &f);
+
   void ResetIfRequested();
   bool mbResetRequested;
   std::mutex mMutexReset;
+  std::condition_variable mCondReset;
 
   bool CheckFinish();
   void SetFinish();
   bool mbFinishRequested;
   bool mbFinished;
   std::mutex mMutexFinish;
+  std::condition_variable mCondFinish;
 
   Map* mpMap;
   Tracking* mpTracker;
@@ -104,6 +170,12 @@ class LoopClosing {
   std::list<KeyFrame*> mlpLoopKeyFrameQueue;
 
   std::mutex mMutexLoopQueue;
+  std::condition_variable mCondLoopQueue;
+  bool mbWakeUp;
+
+  // Thread is sleeping with no pending keyframes
+  bool mbIdle;
+  std::condition_variable mCondIdle;
 
   // Loop detector parameters
   float mnCovisibilityConsistencyTh;
@@ -116,22 +188,37 @@ class LoopClosing {
   std::vector<KeyFrame*> mvpCurrentConnectedKFs;
   std::vector<MapPoint*> mvpCurrentMatchedPoints;
   std::vector<MapPoint*> mvpLoopMapPoints;
+  std::vector<ImageAlign, Eigen::aligned_allocator<ImageAlign> > mvCandidateAligns;  // Reused, one per candidate
   Eigen::Matrix4d mScw;
   g2o::Sim3 mg2oScw;
 
   long unsigned int mLastLoopKFid;
+  long unsigned int mnLastMergeKFid;
+
+  // Distance travelled since last loop, widens the loop candidate gate
+  double mdTravel;
+  Eigen::Vector3d mLastCenter;
+  bool mbHasCenter;
 
   // Variables related to Global Bundle Adjustment
   bool mbRunningGBA;
   bool mbFinishedGBA;
   bool mbStopGBA;
   std::mutex mMutexGBA;
+  std::condition_variable mCondGBA;
   std::thread* mpThreadGBA;
 
   // Fix scale in the stereo/RGB-D case
   bool mbFixScale;
 
-  int mnFullBAIdx;
+  // Parallel map correction with the shared pool (not owned), null if serial
+  ThreadPool* mpThreadPool;
+
+  // Loop closing server connection (not owned), null if loops are closed here
+  RemoteLoopClient* mpRemote;
+
+  // Power budget (not owned), null if not limited
+  EnergyPolicy* mpEnergy;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
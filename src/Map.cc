@@ -23,6 +23,10 @@
  */
 
 #include "Map.h"
+#include <algorithm>
+#include "Config.h"
+#include "extra/object_pool.h"
+#include "extra/log.h"
 
 using std::mutex;
 using std::unique_lock;
@@ -31,100 +35,391 @@ using std::set;
 
 namespace SD_SLAM {
 
-Map::Map():mnMaxKFid(0), mnBigChangeIdx(0) {
+Map::Map():mnActiveSession(0), mnNextSession(1), mPointIndex(Config::VoxelSize()), mnMaxKFid(0), mnNextKFid(0),
+  mnNextMPid(0), mnBigChangeIdx(0), mnChangeIdx(0), mnSnapshotVersion(0) {
+  std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+  snapshot->version = 0;
+  snapshot->nBigChangeIdx = 0;
+  mpSnapshot = snapshot;
+
+  if (!Config::PagingFile().empty() || Config::CompressImages()) {
+    // Raw depth units are kept exactly, float depth to 1 mm
+    float depthStep = 0.001f;
+    if (Config::DepthMapFactor() > 1e-5)
+      depthStep = std::min(depthStep, static_cast<float>(1.0/Config::DepthMapFactor()));
+    mPager.Open(Config::PagingFile(), Config::TileSize(), Config::PagingRadius(), Config::CompressImages(), depthStep);
+  }
+
+  if (!Config::VocabularyFile().empty())
+    mVocabulary.Load(Config::VocabularyFile());
+}
+
+// Set entry id of an id table, growing it if needed
+template <typename T>
+static void SetById(vector<T*> &table, long unsigned int id, T* p) {
+  if (id >= table.size()) {
+    if (!p)
+      return;
+    table.resize(std::max<size_t>(id+1, 2*table.size()), nullptr);
+  }
+  table[id] = p;
 }
 
-void Map::AddKeyFrame(KeyFrame *pKF) {
-  unique_lock<mutex> lock(mMutexMap);
+template <typename T>
+static T* GetById(const vector<T*> &table, long unsigned int id) {
+  return id < table.size() ? table[id] : nullptr;
+}
+
+void Map::AddKeyFrame(KeyFrame *pKF, int nSession) {
+  mKeyFrameDB.add(pKF);
+  mPager.Add(pKF);
+
+  unique_lock<SharedMutex> lock(mMutexMap);
   mspKeyFrames.insert(pKF);
+  SetById(mvpKeyFramesById, pKF->mnId, pKF);
+  if (pKF->mnId >= mvKeyFrameSessions.size())
+    mvKeyFrameSessions.resize(mvpKeyFramesById.size(), 0);
+  mvKeyFrameSessions[pKF->mnId] = nSession < 0 ? mnActiveSession : nSession;
+  mnChangeIdx++;
   if (pKF->mnId>mnMaxKFid)
     mnMaxKFid=pKF->mnId;
 }
 
 void Map::AddMapPoint(MapPoint *pMP) {
-  unique_lock<mutex> lock(mMutexMap);
+  unique_lock<SharedMutex> lock(mMutexMap);
   mspMapPoints.insert(pMP);
+  SetById(mvpMapPointsById, pMP->mnId, pMP);
+  mPointIndex.insert(pMP, pMP->GetWorldPos());
+  mnChangeIdx++;
+}
+
+void Map::AddMapPoints(const vector<MapPoint*> &vpMPs) {
+  if (vpMPs.empty())
+    return;
+
+  unique_lock<SharedMutex> lock(mMutexMap);
+  for (MapPoint* pMP : vpMPs) {
+    mspMapPoints.insert(pMP);
+    SetById(mvpMapPointsById, pMP->mnId, pMP);
+    mPointIndex.insert(pMP, pMP->GetWorldPos());
+  }
+  mnChangeIdx++;
 }
 
 void Map::EraseMapPoint(MapPoint *pMP) {
-  unique_lock<mutex> lock(mMutexMap);
-  mspMapPoints.erase(pMP);
+  {
+    unique_lock<SharedMutex> lock(mMutexMap);
+    if (!mspMapPoints.erase(pMP))
+      return;
+    if (GetById(mvpMapPointsById, pMP->mnId) == pMP)
+      SetById<MapPoint>(mvpMapPointsById, pMP->mnId, nullptr);
+    mPointIndex.erase(pMP);
+    // Before retiring it, so cached local maps are rebuilt before it is deleted
+    mnChangeIdx++;
+  }
 
-  // TODO: This only erase the pointer.
-  // Delete the MapPoint
+  // Other threads may still hold it, delete it later
+  mReclaimer.Retire(pMP, [](void* p) { delete static_cast<MapPoint*>(p); });
 }
 
 void Map::EraseKeyFrame(KeyFrame *pKF) {
-  unique_lock<mutex> lock(mMutexMap);
-  mspKeyFrames.erase(pKF);
+  mKeyFrameDB.erase(pKF);
+  mPager.Erase(pKF);
+
+  {
+    unique_lock<SharedMutex> lock(mMutexMap);
+    if (!mspKeyFrames.erase(pKF))
+      return;
+    if (GetById(mvpKeyFramesById, pKF->mnId) == pKF)
+      SetById<KeyFrame>(mvpKeyFramesById, pKF->mnId, nullptr);
+    mnChangeIdx++;
+  }
 
-  // TODO: This only erase the pointer.
-  // Delete the MapPoint
+  // Bad keyframes are still referenced by the trajectory and the spanning tree,
+  // only their images are released
+  mReclaimer.Retire(pKF, [](void* p) {
+    KeyFrame* pKFi = static_cast<KeyFrame*>(p);
+    pKFi->ReleasePyramidLevels(pKFi->mvImagePyramid.size());
+  });
+}
+
+void Map::UpdateMapPoint(MapPoint* pMP, const Eigen::Vector3d &pos) {
+  unique_lock<SharedMutex> lock(mMutexMap);
+  mPointIndex.update(pMP, pos);
+  mnChangeIdx++;
 }
 
 void Map::SetReferenceMapPoints(const vector<MapPoint *> &vpMPs) {
-  unique_lock<mutex> lock(mMutexMap);
+  unique_lock<SharedMutex> lock(mMutexMap);
   mvpReferenceMapPoints = vpMPs;
 }
 
 void Map::InformNewBigChange() {
-  unique_lock<mutex> lock(mMutexMap);
+  unique_lock<SharedMutex> lock(mMutexMap);
   mnBigChangeIdx++;
+  mnChangeIdx++;
 }
 
 int Map::GetLastBigChangeIdx() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return mnBigChangeIdx;
 }
 
+int Map::GetLastChangeIdx() {
+  SharedLock lock(mMutexMap);
+  return mnChangeIdx;
+}
+
 KeyFrame* Map::GetKeyFrame(int id) {
-  unique_lock<mutex> lock(mMutexMap);
-  for (auto it = mspKeyFrames.begin(); it != mspKeyFrames.end(); it++) {
-    if ((*it)->GetID() == id)
-      return *it;
-  }
+  if (id < 0)
+    return nullptr;
 
-  return nullptr;
+  SharedLock lock(mMutexMap);
+  return GetById(mvpKeyFramesById, id);
+}
+
+MapPoint* Map::GetMapPoint(long unsigned int id) {
+  SharedLock lock(mMutexMap);
+  return GetById(mvpMapPointsById, id);
 }
 
 void Map::UpdateConnections() {
-  unique_lock<mutex> lock(mMutexMap);
+  unique_lock<SharedMutex> lock(mMutexMap);
 
   for (auto it = mspKeyFrames.begin(); it != mspKeyFrames.end(); it++)
     (*it)->UpdateConnections(true);
 }
 
 vector<KeyFrame*> Map::GetAllKeyFrames() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return vector<KeyFrame*>(mspKeyFrames.begin(), mspKeyFrames.end());
 }
 
+void Map::CollectGarbage() {
+  if (mReclaimer.Collect() == 0)
+    return;
+
+  ObjectPool<MapPoint> &points = ObjectPool<MapPoint>::GetInstance();
+  if (2*points.Used() < points.Capacity()) {
+    size_t bytes = points.Trim();
+    if (bytes > 0)
+      LOGD("Released %lu bytes of map point pool", static_cast<unsigned long>(bytes));
+  }
+
+  ObjectPool<KeyFrame> &keyframes = ObjectPool<KeyFrame>::GetInstance();
+  if (2*keyframes.Used() < keyframes.Capacity()) {
+    size_t bytes = keyframes.Trim();
+    if (bytes > 0)
+      LOGD("Released %lu bytes of keyframe pool", static_cast<unsigned long>(bytes));
+  }
+}
+
+Map::MemoryReport Map::GetMemoryReport() {
+  MemoryReport report = MemoryReport();
+
+  const vector<KeyFrame*> vpKFs = GetAllKeyFrames();
+  const vector<MapPoint*> vpMPs = GetAllMapPoints();
+  report.nKeyFrames = vpKFs.size();
+  report.nMapPoints = vpMPs.size();
+
+  report.keyframes = ObjectPool<KeyFrame>::GetInstance().ReservedBytes();
+  for (KeyFrame* pKF : vpKFs) {
+    size_t images, depth, descriptors, features;
+    mPager.GetImageBytes(pKF, images, depth);
+    pKF->GetFeatureBytes(descriptors, features);
+    report.images += images;
+    report.depth += depth;
+    report.descriptors += descriptors;
+    report.features += features;
+  }
+
+  report.mappoints = ObjectPool<MapPoint>::GetInstance().ReservedBytes();
+  for (MapPoint* pMP : vpMPs)
+    report.mappoints += pMP->GetHeapBytes();
+
+  report.vocabulary = mVocabulary.Bytes();
+  report.total = report.keyframes + report.mappoints + report.images + report.depth +
+                 report.descriptors + report.features + report.vocabulary;
+
+  if (report.nKeyFrames > 0)
+    report.perKeyFrame = (report.keyframes + report.images + report.depth + report.descriptors +
+                          report.features)/report.nKeyFrames;
+  if (report.nMapPoints > 0)
+    report.perMapPoint = report.mappoints/report.nMapPoints;
+
+  return report;
+}
+
 vector<MapPoint*> Map::GetAllMapPoints() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return vector<MapPoint*>(mspMapPoints.begin(), mspMapPoints.end());
 }
 
+vector<MapPoint*> Map::GetMapPointsInFrustum(const MapPointIndex::Frustum &frustum) {
+  SharedLock lock(mMutexMap);
+  return mPointIndex.GetInFrustum(frustum);
+}
+
 long unsigned int Map::MapPointsInMap() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return mspMapPoints.size();
 }
 
 long unsigned int Map::KeyFramesInMap() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return mspKeyFrames.size();
 }
 
 vector<MapPoint*> Map::GetReferenceMapPoints() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return mvpReferenceMapPoints;
 }
 
+int Map::StartSession() {
+  unique_lock<SharedMutex> lock(mMutexMap);
+  mnActiveSession = mnNextSession++;
+  return mnActiveSession;
+}
+
+int Map::CreateSession() {
+  unique_lock<SharedMutex> lock(mMutexMap);
+  return mnNextSession++;
+}
+
+int Map::GetActiveSession() {
+  SharedLock lock(mMutexMap);
+  return mnActiveSession;
+}
+
+int Map::GetSession(KeyFrame* pKF) {
+  SharedLock lock(mMutexMap);
+  return pKF->mnId < mvKeyFrameSessions.size() ? mvKeyFrameSessions[pKF->mnId] : mnActiveSession;
+}
+
+void Map::ActivateSession(KeyFrame* pKF) {
+  unique_lock<SharedMutex> lock(mMutexMap);
+  if (pKF->mnId < mvKeyFrameSessions.size())
+    mnActiveSession = mvKeyFrameSessions[pKF->mnId];
+}
+
+vector<KeyFrame*> Map::GetSessionKeyFrames(int nSession) {
+  SharedLock lock(mMutexMap);
+  vector<KeyFrame*> vpKFs;
+  for (KeyFrame* pKF : mspKeyFrames) {
+    if (mvKeyFrameSessions[pKF->mnId] == nSession)
+      vpKFs.push_back(pKF);
+  }
+  return vpKFs;
+}
+
+long unsigned int Map::KeyFramesInSession(int nSession) {
+  SharedLock lock(mMutexMap);
+  return std::count_if(mspKeyFrames.begin(), mspKeyFrames.end(), [&](KeyFrame* pKF) {
+    return mvKeyFrameSessions[pKF->mnId] == nSession;
+  });
+}
+
+bool Map::JoinSessions(int nFrom, int nTo) {
+  unique_lock<SharedMutex> lock(mMutexMap);
+  std::replace(mvKeyFrameSessions.begin(), mvKeyFrameSessions.end(), nFrom, nTo);
+  if (mnActiveSession != nFrom)
+    return false;
+  mnActiveSession = nTo;
+  return true;
+}
+
 long unsigned int Map::GetMaxKFid() {
-  unique_lock<mutex> lock(mMutexMap);
+  SharedLock lock(mMutexMap);
   return mnMaxKFid;
 }
 
+long unsigned int Map::NewKeyFrameId() {
+  unique_lock<mutex> lock(mMutexPointCreation);
+  return mnNextKFid++;
+}
+
+long unsigned int Map::NewMapPointId() {
+  unique_lock<mutex> lock(mMutexPointCreation);
+  return mnNextMPid++;
+}
+
+void Map::ReserveKeyFrameId(long unsigned int nId) {
+  unique_lock<mutex> lock(mMutexPointCreation);
+  mnNextKFid = std::max(mnNextKFid, nId+1);
+}
+
+long unsigned int Map::NextKeyFrameId() {
+  unique_lock<mutex> lock(mMutexPointCreation);
+  return mnNextKFid;
+}
+
+void Map::PublishSnapshot() {
+  unique_lock<mutex> lock(mMutexSnapshot);
+
+  std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+  snapshot->version = ++mnSnapshotVersion;
+  snapshot->nBigChangeIdx = GetLastBigChangeIdx();
+
+  const vector<KeyFrame*> vpKFs = GetAllKeyFrames();
+  snapshot->vKeyFrameIds.reserve(vpKFs.size());
+  snapshot->vKeyFramePoses.reserve(vpKFs.size());
+
+  for (KeyFrame* pKF : vpKFs) {
+    if (pKF->isBad())
+      continue;
+
+    snapshot->vKeyFrameIds.push_back(pKF->mnId);
+    snapshot->vKeyFramePoses.push_back(pKF->GetPoseInverse());
+
+    // Covisibility graph
+    Eigen::Vector3d Ow = pKF->GetCameraCenter();
+    const vector<KeyFrame*> vCovKFs = pKF->GetCovisiblesByWeight(100);
+    for (KeyFrame* pKFi : vCovKFs) {
+      if (pKFi->mnId<pKF->mnId)
+        continue;
+      snapshot->vGraphEdges.push_back(Ow);
+      snapshot->vGraphEdges.push_back(pKFi->GetCameraCenter());
+    }
+
+    // Spanning tree
+    KeyFrame* pParent = pKF->GetParent();
+    if (pParent) {
+      snapshot->vGraphEdges.push_back(Ow);
+      snapshot->vGraphEdges.push_back(pParent->GetCameraCenter());
+    }
+
+    // Loops
+    const set<KeyFrame*> sLoopKFs = pKF->GetLoopEdges();
+    for (KeyFrame* pKFi : sLoopKFs) {
+      if (pKFi->mnId<pKF->mnId)
+        continue;
+      snapshot->vGraphEdges.push_back(Ow);
+      snapshot->vGraphEdges.push_back(pKFi->GetCameraCenter());
+    }
+  }
+
+  const vector<MapPoint*> vpMPs = GetAllMapPoints();
+  snapshot->vMapPointIds.reserve(vpMPs.size());
+  snapshot->vMapPoints.reserve(vpMPs.size());
+  for (MapPoint* pMP : vpMPs) {
+    if (!pMP->isBad()) {
+      snapshot->vMapPointIds.push_back(pMP->mnId);
+      snapshot->vMapPoints.push_back(pMP->GetWorldPos());
+    }
+  }
+
+  std::atomic_store(&mpSnapshot, std::shared_ptr<const Snapshot>(snapshot));
+}
+
+std::shared_ptr<const Map::Snapshot> Map::GetSnapshot() const {
+  return std::atomic_load(&mpSnapshot);
+}
+
 void Map::clear() {
+  mKeyFrameDB.clear();
+  mPager.Clear();
+  mReclaimer.Clear();
+
   for (set<MapPoint*>::iterator sit = mspMapPoints.begin(), send = mspMapPoints.end(); sit != send; sit++)
     delete *sit;
 
@@ -133,9 +428,24 @@ void Map::clear() {
 
   mspMapPoints.clear();
   mspKeyFrames.clear();
+  mvpMapPointsById.clear();
+  mvpKeyFramesById.clear();
+  mvKeyFrameSessions.clear();
+  mnActiveSession = 0;
+  mnNextSession = 1;
+  mPointIndex.clear();
   mnMaxKFid = 0;
+  {
+    unique_lock<mutex> lock(mMutexPointCreation);
+    mnNextKFid = 0;
+    mnNextMPid = 0;
+  }
+  mnChangeIdx++;
   mvpReferenceMapPoints.clear();
   mvpKeyFrameOrigins.clear();
+
+  // Readers must not see the old map anymore
+  PublishSnapshot();
 }
 
 }  // namespace SD_SLAM
@@ -27,8 +27,16 @@
 
 #include <set>
 #include <mutex>
+#include <memory>
+#include <atomic>
 #include "MapPoint.h"
 #include "KeyFrame.h"
+#include "KeyFrameDatabase.h"
+#include "KeyFramePager.h"
+#include "MapPointIndex.h"
+#include "ORBVocabulary.h"
+#include "extra/epoch_reclaimer.h"
+#include "extra/shared_mutex.h"
 
 namespace SD_SLAM {
 
@@ -37,52 +45,200 @@ class KeyFrame;
 
 class Map {
  public:
+  // Immutable copy of the map geometry. Readers don't lock anything and never see a
+  // partially optimized map, a new snapshot is published after each BA or loop correction.
+  struct Snapshot {
+    unsigned long version;
+    int nBigChangeIdx;                            // Big change index when it was built
+    std::vector<long unsigned int> vKeyFrameIds;
+    std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > vKeyFramePoses;  // Twc
+    std::vector<long unsigned int> vMapPointIds;
+    std::vector<Eigen::Vector3d> vMapPoints;
+    std::vector<Eigen::Vector3d> vGraphEdges;     // Pairs of camera centers (covisibility, spanning tree, loops)
+  };
+
+  // Memory used by the map, in bytes
+  struct MemoryReport {
+    size_t nKeyFrames;
+    size_t nMapPoints;
+    size_t keyframes;     // Keyframe pool
+    size_t mappoints;     // Map point pool and observations
+    size_t images;        // Keyframe pyramids in memory (paged out ones are not counted)
+    size_t depth;         // Keyframe depth images in memory
+    size_t descriptors;   // Keyframe descriptors
+    size_t features;      // Keypoints, grids, bag of words and point associations
+    size_t vocabulary;
+    size_t optimizer;     // Largest optimization graph, estimated (filled by System)
+    size_t total;
+    size_t perKeyFrame;   // Keyframe, images, descriptors and features per keyframe
+    size_t perMapPoint;
+  };
+
   Map();
 
-  void AddKeyFrame(KeyFrame* pKF);
+  // Keyframe joins nSession, or the active session if negative
+  void AddKeyFrame(KeyFrame* pKF, int nSession = -1);
   void AddMapPoint(MapPoint* pMP);
+  // Add several points taking the map lock once
+  void AddMapPoints(const std::vector<MapPoint*> &vpMPs);
   void EraseMapPoint(MapPoint* pMP);
   void EraseKeyFrame(KeyFrame* pKF);
+
+  // Keep spatial index current after a MapPoint moves
+  void UpdateMapPoint(MapPoint* pMP, const Eigen::Vector3d &pos);
   void SetReferenceMapPoints(const std::vector<MapPoint*> &vpMPs);
   void InformNewBigChange();
   int GetLastBigChangeIdx();
 
-  // Get KeyFrame by id
+  // Index incremented each time a keyframe or map point is added, moved or erased, or after a big change
+  int GetLastChangeIdx();
+
+  // Get KeyFrame or MapPoint by id, null if it is not in the map. Constant time
   KeyFrame* GetKeyFrame(int id);
+  MapPoint* GetMapPoint(long unsigned int id);
 
   // Update connected KeyFrames taking into account its order
   void UpdateConnections();
 
   std::vector<KeyFrame*> GetAllKeyFrames();
   std::vector<MapPoint*> GetAllMapPoints();
+
+  // Call f(pKF) or f(pMP) for each element without copying them. Map lock is held shared,
+  // so f must not call methods of the map
+  template <typename F>
+  void ForEachKeyFrame(F f) {
+    SharedLock lock(mMutexMap);
+    for (KeyFrame* pKF : mspKeyFrames)
+      f(pKF);
+  }
+
+  template <typename F>
+  void ForEachMapPoint(F f) {
+    SharedLock lock(mMutexMap);
+    for (MapPoint* pMP : mspMapPoints)
+      f(pMP);
+  }
   std::vector<MapPoint*> GetReferenceMapPoints();
 
+  // MapPoints projecting inside the image of a camera with pose Tcw
+  std::vector<MapPoint*> GetMapPointsInFrustum(const MapPointIndex::Frustum &frustum);
+
   long unsigned int MapPointsInMap();
   long unsigned  KeyFramesInMap();
 
+  // Keyframes are grouped in sessions, each one with its own coordinates. New keyframes go
+  // to the active session, the others are kept inactive until they are merged with it
+  int StartSession();
+
+  // New session that is not activated, for keyframes added with an explicit session
+  int CreateSession();
+  int GetActiveSession();
+  int GetSession(KeyFrame* pKF);
+
+  // Make the session of pKF the active one
+  void ActivateSession(KeyFrame* pKF);
+
+  std::vector<KeyFrame*> GetSessionKeyFrames(int nSession);
+  long unsigned int KeyFramesInSession(int nSession);
+
+  // Keyframes of nFrom, already moved to the coordinates of nTo, join it.
+  // Returns true if nFrom was the active session (nTo is active now)
+  bool JoinSessions(int nFrom, int nTo);
+
   long unsigned int GetMaxKFid();
 
+  // Ids of new keyframes and map points, unique in this map. They start again after clear
+  long unsigned int NewKeyFrameId();
+  long unsigned int NewMapPointId();
+
+  // Keyframe ids set explicitly (loaded maps) are not given again
+  void ReserveKeyFrameId(long unsigned int nId);
+
+  // Id of next keyframe
+  long unsigned int NextKeyFrameId();
+
+  // Build a new snapshot from current map and make it visible to readers
+  void PublishSnapshot();
+
+  // Last published snapshot (never null). It stays valid while the pointer is held
+  std::shared_ptr<const Snapshot> GetSnapshot() const;
+
+  // Appearance index, updated on keyframe insertion/removal
+  inline KeyFrameDatabase* GetKeyFrameDatabase() { return &mKeyFrameDB; }
+
+  // Memory of keyframes, map points and vocabulary. Optimizer field is left to 0
+  MemoryReport GetMemoryReport();
+
+  // Bag of words vocabulary, empty if none was loaded
+  inline const ORBVocabulary* GetVocabulary() const { return &mVocabulary; }
+
+  // Keyframe images far from the mapping position are paged to disk
+  inline KeyFramePager* GetPager() { return &mPager; }
+
+  // Erased MapPoints are deleted, and erased KeyFrames release their images, once
+  // every registered thread has passed two quiescent points
+  inline EpochReclaimer* GetReclaimer() { return &mReclaimer; }
+
+  // Reclaim retired points and keyframes no thread can reference, and return empty slabs
+  // of their pools when at least half of the slots are free
+  void CollectGarbage();
+
   void clear();
 
   std::vector<KeyFrame*> mvpKeyFrameOrigins;
 
   std::mutex mMutexMapUpdate;
 
-  // This avoid that two points are created simultaneously in separate threads (id conflict)
+  // This avoid that two keyframes or points are created simultaneously in separate threads (id conflict)
   std::mutex mMutexPointCreation;
 
  protected:
   std::set<MapPoint*> mspMapPoints;
   std::set<KeyFrame*> mspKeyFrames;
 
+  // Keyframes and MapPoints in the map indexed by id, null if erased. Ids are given
+  // sequentially, so tables are dense
+  std::vector<KeyFrame*> mvpKeyFramesById;
+  std::vector<MapPoint*> mvpMapPointsById;
+
+  // Session of each keyframe, indexed by id
+  std::vector<int> mvKeyFrameSessions;
+  int mnActiveSession;
+  int mnNextSession;
+
   std::vector<MapPoint*> mvpReferenceMapPoints;
 
+  MapPointIndex mPointIndex;
+
+  KeyFrameDatabase mKeyFrameDB;
+
+  ORBVocabulary mVocabulary;
+
+  KeyFramePager mPager;
+
+  EpochReclaimer mReclaimer;
+
   long unsigned int mnMaxKFid;
 
+  // Next keyframe and map point ids
+  long unsigned int mnNextKFid;
+  long unsigned int mnNextMPid;
+
   // Index related to a big change in the map (loop closure, global BA)
   int mnBigChangeIdx;
 
-  std::mutex mMutexMap;
+  // Index related to any change in map contents
+  int mnChangeIdx;
+
+  // Shared by readers, exclusive for changes in map contents
+  SharedMutex mMutexMap;
+
+  // Published snapshot, accessed with atomic shared_ptr operations
+  std::shared_ptr<const Snapshot> mpSnapshot;
+  unsigned long mnSnapshotVersion;
+
+  // Serializes publishers, so versions are published in order
+  std::mutex mMutexSnapshot;
 };
 
 }  // namespace SD_SLAM
@@ -0,0 +1,1161 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "MapFile.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <unordered_set>
+#include "Map.h"
+#include "Tracking.h"
+#include "KeyFrameDatabase.h"
+#include "Config.h"
+#include "extra/log.h"
+#include "extra/trace.h"
+#include "extra/utils.h"
+#include "extra/epoch_reclaimer.h"
+
+using std::vector;
+using std::string;
+using std::mutex;
+using std::unique_lock;
+using std::unordered_map;
+using std::unordered_set;
+
+namespace SD_SLAM {
+
+namespace {
+
+const char MAGIC[8] = {'S', 'D', 'S', 'L', 'A', 'M', 'M', 'P'};
+const char LOG_MAGIC[8] = {'S', 'D', 'S', 'L', 'A', 'M', 'C', 'K'};
+const size_t ALIGNMENT = 64;
+
+enum KeyFrameFlags {
+  KF_PARTIAL = 1,               // Only pose, parent, connections and loops. Only in checkpoint logs
+};
+
+enum SegmentFlags {
+  SEGMENT_RESET = 1,            // Map was cleared, previous segments are dropped
+};
+
+// All records are plain data with sizes multiple of 8 bytes, offsets are from file start
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t rgbd;
+  double fx, fy, cx, cy, k1, k2, p1, p2, k3;
+  int32_t width, height;
+  int32_t levels;
+  int32_t descriptor_size;
+  float scale_factor;
+  float padding;
+  uint64_t nkeyframes;
+  uint64_t nmappoints;
+  uint64_t keyframes_offset;    // Table of KeyFrameRecord
+  uint64_t mappoints_offset;    // MapPointRecord followed by its observations, one after another
+};
+
+struct KeyPointRecord {
+  float x, y, size, angle, response;
+  int32_t octave;
+};
+
+struct KeyFrameRecord {
+  uint64_t id;
+  int64_t parent;               // -1 if it has no parent
+  double pose[16];              // Tcw, column-major
+  uint32_t n;
+  uint32_t nconnections;
+  uint32_t nloops;
+  uint32_t nlevels;
+  uint32_t nthumb;
+  int32_t depth_rows, depth_cols;
+  uint32_t flags;
+  uint64_t keys_offset;
+  uint64_t keysun_offset;
+  uint64_t right_offset;
+  uint64_t depth_offset;
+  uint64_t descriptors_offset;
+  uint64_t connections_offset;
+  uint64_t loops_offset;
+  uint64_t thumb_offset;
+  uint64_t levels_offset;       // Table of LevelRecord
+  uint64_t depthimg_offset;     // 0 if there is no depth image
+};
+
+struct LevelRecord {
+  int32_t rows, cols;
+  uint64_t offset;              // 0 if level was released
+};
+
+struct ConnectionRecord {
+  uint64_t id;
+  int32_t weight;
+  int32_t padding;
+};
+
+struct MapPointRecord {
+  double pos[3];
+  uint64_t ref_kf;
+  uint8_t descriptor[32];
+  uint32_t nobs;
+  uint32_t padding;
+};
+
+struct ObservationRecord {
+  uint64_t kf;
+  uint32_t idx;
+  uint32_t padding;
+};
+
+// Checkpoint log segment. Offsets are from segment start, map data is a map file whose
+// offsets are from its header
+struct SegmentRecord {
+  char magic[8];                // Written once the rest of the segment is synced
+  uint64_t size;                // Whole segment, next one starts after it
+  uint64_t version;             // Snapshot version
+  uint64_t flags;
+  uint64_t nerased_keyframes;
+  uint64_t nerased_mappoints;
+  uint64_t erased_offset;       // Erased keyframe ids followed by erased map point ids
+  uint64_t mappoint_ids_offset; // Id of each map point of map data, in order
+  uint64_t map_offset;          // Header of map data
+};
+
+static_assert(sizeof(Header)%8 == 0 && sizeof(KeyFrameRecord)%8 == 0 && sizeof(MapPointRecord)%8 == 0 &&
+              sizeof(ObservationRecord)%8 == 0 && sizeof(KeyPointRecord)%8 == 0 && sizeof(SegmentRecord)%8 == 0,
+              "Map file records must be 8-byte multiples");
+
+// Write data at next aligned position and return its offset from base (aligned too)
+uint64_t WriteBlock(std::ofstream &f, uint64_t base, const void *data, size_t size) {
+  static const char zeros[ALIGNMENT] = {0};
+  uint64_t offset = static_cast<uint64_t>(f.tellp()) - base;
+  size_t pad = (ALIGNMENT - offset%ALIGNMENT) % ALIGNMENT;
+
+  f.write(zeros, pad);
+  if (size > 0)
+    f.write(static_cast<const char*>(data), size);
+
+  return offset + pad;
+}
+
+// Write image rows contiguously, images can be submatrices
+uint64_t WriteMat(std::ofstream &f, uint64_t base, const cv::Mat &m) {
+  uint64_t offset = WriteBlock(f, base, nullptr, 0);
+  size_t row_size = m.cols*m.elemSize();
+
+  for (int r = 0; r < m.rows; r++)
+    f.write(reinterpret_cast<const char*>(m.ptr(r)), row_size);
+
+  return offset;
+}
+
+template <typename T>
+uint64_t WriteVector(std::ofstream &f, uint64_t base, const vector<T> &v) {
+  return WriteBlock(f, base, v.data(), v.size()*sizeof(T));
+}
+
+void ToRecords(const vector<cv::KeyPoint> &keys, vector<KeyPointRecord> &records) {
+  records.resize(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    const cv::KeyPoint &kp = keys[i];
+    KeyPointRecord &r = records[i];
+    r.x = kp.pt.x;
+    r.y = kp.pt.y;
+    r.size = kp.size;
+    r.angle = kp.angle;
+    r.response = kp.response;
+    r.octave = kp.octave;
+  }
+}
+
+void FromRecords(const KeyPointRecord *records, size_t n, vector<cv::KeyPoint> &keys) {
+  keys.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    const KeyPointRecord &r = records[i];
+    keys[i] = cv::KeyPoint(r.x, r.y, r.size, r.angle, r.response, r.octave);
+  }
+}
+
+void InitHeader(Header &header, bool rgbd) {
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = MapFile::VERSION;
+  header.rgbd = rgbd ? 1 : 0;
+  header.fx = Config::fx();
+  header.fy = Config::fy();
+  header.cx = Config::cx();
+  header.cy = Config::cy();
+  header.k1 = Config::k1();
+  header.k2 = Config::k2();
+  header.p1 = Config::p1();
+  header.p2 = Config::p2();
+  header.k3 = Config::k3();
+  header.width = Config::Width();
+  header.height = Config::Height();
+  header.levels = Config::NumLevels();
+  header.descriptor_size = 32;
+  header.scale_factor = Config::ScaleFactor();
+}
+
+// Checks that count elements of elem bytes at offset are inside size bytes
+struct Bounds {
+  uint64_t size;
+
+  bool operator()(uint64_t offset, uint64_t count, uint64_t elem) const {
+    return offset <= size && (elem == 0 || count <= (size-offset)/elem);
+  }
+};
+
+bool ValidKeyFrame(const Bounds &valid, const char* base, const KeyFrameRecord &r, uint64_t descriptor_size) {
+  bool ok = valid(r.connections_offset, r.nconnections, sizeof(ConnectionRecord)) &&
+            valid(r.loops_offset, r.nloops, sizeof(uint64_t));
+  if (r.flags & KF_PARTIAL)
+    return ok;
+
+  ok = ok && valid(r.keys_offset, r.n, sizeof(KeyPointRecord)) && valid(r.keysun_offset, r.n, sizeof(KeyPointRecord)) &&
+       valid(r.right_offset, r.n, sizeof(float)) && valid(r.depth_offset, r.n, sizeof(float)) &&
+       valid(r.descriptors_offset, r.n, descriptor_size) && valid(r.thumb_offset, r.nthumb, sizeof(float)) &&
+       valid(r.levels_offset, r.nlevels, sizeof(LevelRecord));
+
+  if (ok) {
+    const LevelRecord* levels = reinterpret_cast<const LevelRecord*>(base + r.levels_offset);
+    for (uint32_t l = 0; l < r.nlevels && ok; l++)
+      ok = levels[l].rows >= 0 && levels[l].cols >= 0 &&
+           (levels[l].offset == 0 || valid(levels[l].offset, static_cast<uint64_t>(levels[l].rows)*levels[l].cols, 1));
+    if (r.depthimg_offset != 0)
+      ok = ok && r.depth_rows >= 0 && r.depth_cols >= 0 &&
+           valid(r.depthimg_offset, static_cast<uint64_t>(r.depth_rows)*r.depth_cols, sizeof(float));
+  }
+
+  return ok;
+}
+
+// Map the whole file read-only. Returns null if it can't be mapped
+void* MapWholeFile(const string &filename, size_t &size) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOGE("Failed to open file: %s", filename.c_str());
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    LOGE("File not valid: %s", filename.c_str());
+    close(fd);
+    return nullptr;
+  }
+
+  size = st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOGE("Failed to map file: %s", filename.c_str());
+    return nullptr;
+  }
+
+  return data;
+}
+
+// Flush written data of filename to disk
+bool SyncFile(const string &filename) {
+  int fd = open(filename.c_str(), O_WRONLY);
+  if (fd < 0)
+    return false;
+  bool ok = fdatasync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+// Writes a map file at the next aligned position of a stream, offsets are relative to it.
+// Keyframes are added first, then map points. Keyframes referenced by them (parent,
+// connections, loops and observations) are only kept if saved returns true for them.
+class MapWriter {
+ public:
+  MapWriter(std::ofstream &f, Map* pMap, bool rgbd, const std::function<bool(KeyFrame*)> &saved)
+      : mf(f), mpMap(pMap), mSaved(saved), mbKeyFramesDone(false) {
+    mnBase = WriteBlock(f, 0, nullptr, 0);
+    InitHeader(mHeader, rgbd);
+
+    // Header is rewritten at the end with the final offsets
+    f.write(reinterpret_cast<const char*>(&mHeader), sizeof(mHeader));
+  }
+
+  inline uint64_t Base() const { return mnBase; }
+  inline uint64_t KeyFrames() const { return mvRecords.size(); }
+  inline uint64_t MapPoints() const { return mHeader.nmappoints; }
+
+  // Write keyframe with pose Tcw. If full is not set, only pose, parent and graph edges are written
+  void AddKeyFrame(KeyFrame* pKF, const Eigen::Matrix4d &Tcw, bool full) {
+    std::ofstream &f = mf;
+    mvRecords.emplace_back();
+    KeyFrameRecord &r = mvRecords.back();
+    memset(&r, 0, sizeof(r));
+
+    r.id = pKF->mnId;
+    KeyFrame* pParent = pKF->GetParent();
+    r.parent = pParent && mSaved(pParent) ? static_cast<int64_t>(pParent->mnId) : -1;
+    memcpy(r.pose, Tcw.data(), sizeof(r.pose));
+    r.n = pKF->N;
+
+    // Covisibility graph
+    vector<ConnectionRecord> connections;
+    const std::set<KeyFrame*> sConnected = pKF->GetConnectedKeyFrames();
+    for (KeyFrame* pKFi : sConnected) {
+      if (!mSaved(pKFi))
+        continue;
+      ConnectionRecord c;
+      c.id = pKFi->mnId;
+      c.weight = pKF->GetWeight(pKFi);
+      c.padding = 0;
+      connections.push_back(c);
+    }
+    r.nconnections = connections.size();
+    r.connections_offset = WriteVector(f, mnBase, connections);
+
+    vector<uint64_t> loops;
+    const std::set<KeyFrame*> sLoops = pKF->GetLoopEdges();
+    for (KeyFrame* pKFi : sLoops) {
+      if (mSaved(pKFi))
+        loops.push_back(pKFi->mnId);
+    }
+    r.nloops = loops.size();
+    r.loops_offset = WriteVector(f, mnBase, loops);
+
+    if (!full) {
+      r.flags = KF_PARTIAL;
+      return;
+    }
+
+    ToRecords(pKF->mvKeys, mvKeys);
+    r.keys_offset = WriteVector(f, mnBase, mvKeys);
+    ToRecords(pKF->mvKeysUn, mvKeys);
+    r.keysun_offset = WriteVector(f, mnBase, mvKeys);
+    r.right_offset = WriteVector(f, mnBase, pKF->mvuRight);
+    r.depth_offset = WriteVector(f, mnBase, pKF->mvDepth);
+    r.descriptors_offset = WriteMat(f, mnBase, pKF->mDescriptors);
+
+    // Images may have been paged out
+    ScopedPage page(mpMap->GetPager(), pKF);
+
+    // Appearance descriptor, so loading doesn't need to read the images
+    mvThumb.clear();
+    if (!mpMap->GetKeyFrameDatabase()->GetDescriptor(pKF, mvThumb) && !pKF->mvImagePyramid.empty() && !pKF->mvImagePyramid[0].empty())
+      KeyFrameDatabase::ComputeDescriptor(pKF->mvImagePyramid[0], mvThumb);
+    r.nthumb = mvThumb.size();
+    r.thumb_offset = WriteVector(f, mnBase, mvThumb);
+
+    // Image pyramid
+    vector<LevelRecord> levels(pKF->mvImagePyramid.size());
+    for (size_t l = 0; l < levels.size(); l++) {
+      const cv::Mat &im = pKF->mvImagePyramid[l];
+      levels[l].rows = im.rows;
+      levels[l].cols = im.cols;
+      levels[l].offset = im.empty() ? 0 : WriteMat(f, mnBase, im);
+    }
+    r.nlevels = levels.size();
+    r.levels_offset = WriteVector(f, mnBase, levels);
+
+    if (mHeader.rgbd && !pKF->mDepthImage.empty()) {
+      const cv::Mat depth = pKF->GetDepthImage();
+      r.depth_rows = depth.rows;
+      r.depth_cols = depth.cols;
+      r.depthimg_offset = WriteMat(f, mnBase, depth);
+    }
+  }
+
+  // Write map point at pos. Returns false if it is not observed by saved keyframes
+  bool AddMapPoint(MapPoint* pMP, const Eigen::Vector3d &pos) {
+    EndKeyFrames();
+
+    KeyFrame* pRefKF = pMP->GetReferenceKeyFrame();
+    bool bRefFound = false;
+
+    mvObservations.clear();
+    const MapPoint::ObservationVector obs = pMP->GetObservations();
+    for (auto mit = obs.begin(); mit != obs.end(); mit++) {
+      if (!mSaved(mit->first))
+        continue;
+      ObservationRecord o;
+      o.kf = mit->first->mnId;
+      o.idx = mit->second;
+      o.padding = 0;
+      mvObservations.push_back(o);
+      bRefFound |= mit->first == pRefKF;
+    }
+
+    if (mvObservations.empty())
+      return false;
+
+    MapPointRecord r;
+    memset(&r, 0, sizeof(r));
+    r.pos[0] = pos(0);
+    r.pos[1] = pos(1);
+    r.pos[2] = pos(2);
+    r.ref_kf = bRefFound ? pRefKF->mnId : mvObservations[0].kf;
+    r.nobs = mvObservations.size();
+
+    cv::Mat desc = pMP->GetDescriptor();
+    if (desc.total()*desc.elemSize() == sizeof(r.descriptor))
+      memcpy(r.descriptor, desc.ptr(0), sizeof(r.descriptor));
+
+    mf.write(reinterpret_cast<const char*>(&r), sizeof(r));
+    mf.write(reinterpret_cast<const char*>(mvObservations.data()), mvObservations.size()*sizeof(ObservationRecord));
+    mHeader.nmappoints++;
+    return true;
+  }
+
+  // Write header, stream is left at the end
+  void Finish() {
+    EndKeyFrames();
+
+    std::streampos end = mf.tellp();
+    mf.seekp(mnBase);
+    mf.write(reinterpret_cast<const char*>(&mHeader), sizeof(mHeader));
+    mf.seekp(end);
+  }
+
+ private:
+  // Keyframe table, map points follow it
+  void EndKeyFrames() {
+    if (mbKeyFramesDone)
+      return;
+
+    mHeader.nkeyframes = mvRecords.size();
+    mHeader.keyframes_offset = WriteVector(mf, mnBase, mvRecords);
+    mHeader.mappoints_offset = WriteBlock(mf, mnBase, nullptr, 0);
+    mHeader.nmappoints = 0;
+    mbKeyFramesDone = true;
+  }
+
+  std::ofstream &mf;
+  Map* mpMap;
+  std::function<bool(KeyFrame*)> mSaved;
+  uint64_t mnBase;
+  Header mHeader;
+  bool mbKeyFramesDone;
+
+  vector<KeyFrameRecord> mvRecords;
+  vector<KeyPointRecord> mvKeys;
+  vector<float> mvThumb;
+  vector<ObservationRecord> mvObservations;
+};
+
+}  // namespace
+
+const uint32_t MapFile::VERSION = 1;
+
+MapFile::MapFile() {
+}
+
+MapFile::~MapFile() {
+  for (const Mapping &m : mvMappings)
+    munmap(m.data, m.size);
+}
+
+bool MapFile::IsMapFile(const string &filename) {
+  char magic[sizeof(MAGIC)];
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  if (!f.read(magic, sizeof(magic)))
+    return false;
+
+  return memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+bool MapFile::IsCheckpointFile(const string &filename) {
+  char magic[sizeof(LOG_MAGIC)];
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  if (!f.read(magic, sizeof(magic)))
+    return false;
+
+  return memcmp(magic, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0;
+}
+
+bool MapFile::Save(const string &filename, Map* pMap, bool rgbd) {
+  std::ofstream f(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!f.is_open()) {
+    LOGE("Failed to open file: %s", filename.c_str());
+    return false;
+  }
+
+  vector<KeyFrame*> vpAllKFs = pMap->GetAllKeyFrames();
+  vector<KeyFrame*> vpKFs;
+  vpKFs.reserve(vpAllKFs.size());
+  for (KeyFrame* pKF : vpAllKFs) {
+    if (!pKF->isBad())
+      vpKFs.push_back(pKF);
+  }
+  sort(vpKFs.begin(), vpKFs.end(), KeyFrame::lId);
+  std::set<KeyFrame*> sKFs(vpKFs.begin(), vpKFs.end());
+
+  MapWriter writer(f, pMap, rgbd, [&sKFs](KeyFrame* pKF) { return sKFs.count(pKF) > 0; });
+
+  for (KeyFrame* pKF : vpKFs)
+    writer.AddKeyFrame(pKF, pKF->GetPose(), true);
+
+  const vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
+  for (MapPoint* pMP : vpMPs) {
+    if (!pMP->isBad())
+      writer.AddMapPoint(pMP, pMP->GetWorldPos());
+  }
+
+  writer.Finish();
+  f.close();
+
+  if (!f) {
+    LOGE("Failed to write file: %s", filename.c_str());
+    return false;
+  }
+
+  LOGD("Map saved: %lu keyframes, %lu points", static_cast<unsigned long>(writer.KeyFrames()),
+       static_cast<unsigned long>(writer.MapPoints()));
+  return true;
+}
+
+bool MapFile::Load(const string &filename, Map* pMap, Tracking* pTracker, bool rgbd, unsigned long nIdOffset) {
+  size_t size = 0;
+  void* data = MapWholeFile(filename, size);
+  if (!data)
+    return false;
+
+  const char* base = static_cast<const char*>(data);
+  const Bounds valid = {size};
+  auto fail = [&](const char* msg) {
+    LOGE("%s: %s", msg, filename.c_str());
+    munmap(data, size);
+    return false;
+  };
+
+  if (size < sizeof(Header))
+    return fail("Map file not valid");
+
+  // Check header
+  Header header;
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+    return fail("Not a map file");
+  if (header.version != VERSION)
+    return fail("Unsupported map file version");
+  if ((header.rgbd != 0) != rgbd)
+    return fail("Map file was created with a different sensor");
+  if (header.levels != Config::NumLevels() || fabs(header.scale_factor-Config::ScaleFactor()) > 1e-5 || header.descriptor_size != 32)
+    return fail("Map file was created with different ORB parameters");
+  if (!valid(header.keyframes_offset, header.nkeyframes, sizeof(KeyFrameRecord)))
+    return fail("Map file is truncated");
+
+  if (fabs(header.fx-Config::fx()) > 1e-3 || fabs(header.fy-Config::fy()) > 1e-3 ||
+      fabs(header.cx-Config::cx()) > 1e-3 || fabs(header.cy-Config::cy()) > 1e-3) {
+    LOGE("Map file was created with different camera intrinsics");
+  }
+
+  const KeyFrameRecord* records = reinterpret_cast<const KeyFrameRecord*>(base + header.keyframes_offset);
+
+  // Validate everything before creating any object
+  unordered_map<uint64_t, uint32_t> ids;
+  for (uint64_t i = 0; i < header.nkeyframes; i++) {
+    const KeyFrameRecord &r = records[i];
+    if (r.flags != 0 || !ValidKeyFrame(valid, base, r, header.descriptor_size))
+      return fail("Map file keyframe not valid");
+
+    ids[r.id] = r.n;
+  }
+
+  uint64_t offset = header.mappoints_offset;
+  for (uint64_t i = 0; i < header.nmappoints; i++) {
+    if (!valid(offset, 1, sizeof(MapPointRecord)))
+      return fail("Map file is truncated");
+    const MapPointRecord* r = reinterpret_cast<const MapPointRecord*>(base + offset);
+    offset += sizeof(MapPointRecord);
+
+    if (!valid(offset, r->nobs, sizeof(ObservationRecord)) || r->nobs == 0 || !ids.count(r->ref_kf))
+      return fail("Map file point not valid");
+
+    const ObservationRecord* obs = reinterpret_cast<const ObservationRecord*>(base + offset);
+    for (uint32_t j = 0; j < r->nobs; j++) {
+      auto it = ids.find(obs[j].kf);
+      if (it == ids.end() || obs[j].idx >= it->second)
+        return fail("Map file observation not valid");
+    }
+    offset += r->nobs*sizeof(ObservationRecord);
+  }
+
+  // Create keyframes, descriptors and images reference the (read-only) mapping
+  const cv::Size imSize(header.width, header.height);
+  char* mbase = static_cast<char*>(data);
+  unordered_map<uint64_t, KeyFrame*> keyframes;
+  KeyFrame* pLastKF = nullptr;
+
+  for (uint64_t i = 0; i < header.nkeyframes; i++) {
+    const KeyFrameRecord &r = records[i];
+
+    vector<cv::KeyPoint> keys, keysUn;
+    FromRecords(reinterpret_cast<const KeyPointRecord*>(base + r.keys_offset), r.n, keys);
+    FromRecords(reinterpret_cast<const KeyPointRecord*>(base + r.keysun_offset), r.n, keysUn);
+
+    const float* right = reinterpret_cast<const float*>(base + r.right_offset);
+    const float* depth = reinterpret_cast<const float*>(base + r.depth_offset);
+    vector<float> vRight(right, right + r.n);
+    vector<float> vDepth(depth, depth + r.n);
+
+    cv::Mat descriptors(r.n, header.descriptor_size, CV_8U, mbase + r.descriptors_offset);
+
+    const LevelRecord* levels = reinterpret_cast<const LevelRecord*>(base + r.levels_offset);
+    vector<cv::Mat> pyramid(r.nlevels);
+    for (uint32_t l = 0; l < r.nlevels; l++) {
+      if (levels[l].offset != 0)
+        pyramid[l] = cv::Mat(levels[l].rows, levels[l].cols, CV_8U, mbase + levels[l].offset);
+    }
+
+    cv::Mat imDepth;
+    if (r.depthimg_offset != 0)
+      imDepth = cv::Mat(r.depth_rows, r.depth_cols, CV_32F, mbase + r.depthimg_offset);
+
+    Frame frame = pTracker->CreateFrame(std::move(keys), std::move(keysUn), std::move(vRight), std::move(vDepth),
+                                        descriptors, pyramid, imDepth, imSize);
+
+    Eigen::Matrix4d Tcw;
+    memcpy(Tcw.data(), r.pose, sizeof(r.pose));
+    frame.SetPose(Tcw);
+
+    KeyFrame* pKF = new KeyFrame(frame, pMap);
+    pKF->SetID(r.id + nIdOffset);
+
+    // Index with stored appearance descriptor before inserting it in the map
+    if (r.nthumb > 0) {
+      const float* thumb = reinterpret_cast<const float*>(base + r.thumb_offset);
+      pMap->GetKeyFrameDatabase()->add(pKF, vector<float>(thumb, thumb + r.nthumb));
+    }
+    pKF->ComputeBoW(pMap->GetVocabulary());
+    pMap->AddKeyFrame(pKF);
+
+    keyframes[r.id] = pKF;
+    if (!pLastKF || pKF->mnId > pLastKF->mnId)
+      pLastKF = pKF;
+  }
+
+  // Covisibility graph, spanning tree and loop edges
+  for (uint64_t i = 0; i < header.nkeyframes; i++) {
+    const KeyFrameRecord &r = records[i];
+    KeyFrame* pKF = keyframes[r.id];
+
+    const ConnectionRecord* connections = reinterpret_cast<const ConnectionRecord*>(base + r.connections_offset);
+    std::map<KeyFrame*, int> weights;
+    for (uint32_t j = 0; j < r.nconnections; j++) {
+      auto it = keyframes.find(connections[j].id);
+      if (it != keyframes.end() && it->second != pKF)
+        weights[it->second] = connections[j].weight;
+    }
+
+    KeyFrame* pParent = nullptr;
+    if (r.parent >= 0) {
+      auto it = keyframes.find(r.parent);
+      if (it != keyframes.end())
+        pParent = it->second;
+    }
+
+    pKF->SetConnections(weights, pParent);
+    if (!pParent)
+      pMap->mvpKeyFrameOrigins.push_back(pKF);
+
+    const uint64_t* loops = reinterpret_cast<const uint64_t*>(base + r.loops_offset);
+    for (uint32_t j = 0; j < r.nloops; j++) {
+      auto it = keyframes.find(loops[j]);
+      if (it != keyframes.end())
+        pKF->AddLoopEdge(it->second);
+    }
+  }
+
+  // Map points
+  offset = header.mappoints_offset;
+  for (uint64_t i = 0; i < header.nmappoints; i++) {
+    const MapPointRecord* r = reinterpret_cast<const MapPointRecord*>(base + offset);
+    const ObservationRecord* obs = reinterpret_cast<const ObservationRecord*>(base + offset + sizeof(MapPointRecord));
+    offset += sizeof(MapPointRecord) + r->nobs*sizeof(ObservationRecord);
+
+    // Reference keyframe must observe the point
+    KeyFrame* pRefKF = keyframes[obs[0].kf];
+    for (uint32_t j = 0; j < r->nobs; j++) {
+      if (obs[j].kf == r->ref_kf)
+        pRefKF = keyframes[r->ref_kf];
+    }
+
+    Eigen::Vector3d pos(r->pos[0], r->pos[1], r->pos[2]);
+    MapPoint* pMP = new MapPoint(pos, pRefKF, pMap);
+
+    for (uint32_t j = 0; j < r->nobs; j++) {
+      KeyFrame* pKF = keyframes[obs[j].kf];
+      pKF->AddMapPoint(pMP, obs[j].idx);
+      pMP->AddObservation(pKF, obs[j].idx);
+    }
+
+    pMP->SetDescriptor(cv::Mat(1, sizeof(r->descriptor), CV_8U, const_cast<uint8_t*>(r->descriptor)));
+    pMP->UpdateNormalAndDepth();
+    pMap->AddMapPoint(pMP);
+  }
+
+  if (pLastKF)
+    pTracker->SetReferenceKeyFrame(pLastKF);
+
+  Mapping m;
+  m.data = data;
+  m.size = size;
+  mvMappings.push_back(m);
+
+  LOGD("Map loaded: %lu keyframes, %lu points", static_cast<unsigned long>(header.nkeyframes),
+       static_cast<unsigned long>(header.nmappoints));
+  return true;
+}
+
+bool MapFile::Compact(const string &logname, const string &filename) {
+  size_t size = 0;
+  void* data = MapWholeFile(logname, size);
+  if (!data)
+    return false;
+
+  const char* base = static_cast<const char*>(data);
+  const Bounds valid = {size};
+
+  // Latest record of each keyframe and the full one with its features and images
+  struct KeyFrameEntry {
+    const char* base;
+    const KeyFrameRecord* r;
+    const char* fullBase;
+    const KeyFrameRecord* full;
+  };
+
+  unordered_map<uint64_t, KeyFrameEntry> keyframes;
+  unordered_map<uint64_t, const MapPointRecord*> points;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  uint64_t nsegments = 0;
+  uint64_t offset = 0;
+
+  while (valid(offset, 1, sizeof(SegmentRecord))) {
+    const SegmentRecord &seg = *reinterpret_cast<const SegmentRecord*>(base + offset);
+    if (memcmp(seg.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || seg.size < sizeof(SegmentRecord) || !valid(offset, seg.size, 1))
+      break;
+
+    const char* sbase = base + offset;
+    const Bounds svalid = {seg.size};
+    if (!svalid(seg.erased_offset, seg.nerased_keyframes + seg.nerased_mappoints, sizeof(uint64_t)) ||
+        !svalid(seg.map_offset, 1, sizeof(Header)))
+      break;
+
+    const char* mbase = sbase + seg.map_offset;
+    const Bounds mvalid = {seg.size - seg.map_offset};
+    const Header &h = *reinterpret_cast<const Header*>(mbase);
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION ||
+        !mvalid(h.keyframes_offset, h.nkeyframes, sizeof(KeyFrameRecord)) ||
+        !svalid(seg.mappoint_ids_offset, h.nmappoints, sizeof(uint64_t)) || h.nmappoints > seg.size)
+      break;
+
+    // Check the whole segment before applying it
+    const KeyFrameRecord* records = reinterpret_cast<const KeyFrameRecord*>(mbase + h.keyframes_offset);
+    bool ok = true;
+    for (uint64_t i = 0; i < h.nkeyframes && ok; i++)
+      ok = ValidKeyFrame(mvalid, mbase, records[i], h.descriptor_size);
+
+    vector<const MapPointRecord*> vpPoints;
+    vpPoints.reserve(h.nmappoints);
+    uint64_t poffset = h.mappoints_offset;
+    for (uint64_t i = 0; i < h.nmappoints && ok; i++) {
+      const MapPointRecord* r = reinterpret_cast<const MapPointRecord*>(mbase + poffset);
+      ok = mvalid(poffset, 1, sizeof(MapPointRecord)) && mvalid(poffset + sizeof(MapPointRecord), r->nobs, sizeof(ObservationRecord));
+      poffset += sizeof(MapPointRecord) + (ok ? r->nobs*sizeof(ObservationRecord) : 0);
+      vpPoints.push_back(r);
+    }
+
+    if (!ok)
+      break;
+
+    if (seg.flags & SEGMENT_RESET) {
+      keyframes.clear();
+      points.clear();
+    }
+
+    const uint64_t* erased = reinterpret_cast<const uint64_t*>(sbase + seg.erased_offset);
+    for (uint64_t i = 0; i < seg.nerased_keyframes; i++)
+      keyframes.erase(erased[i]);
+    for (uint64_t i = 0; i < seg.nerased_mappoints; i++)
+      points.erase(erased[seg.nerased_keyframes + i]);
+
+    for (uint64_t i = 0; i < h.nkeyframes; i++) {
+      const KeyFrameRecord &r = records[i];
+      auto it = keyframes.find(r.id);
+      if (it == keyframes.end()) {
+        // Features were written by an erased record
+        if (r.flags & KF_PARTIAL)
+          continue;
+        it = keyframes.insert(std::make_pair(r.id, KeyFrameEntry())).first;
+      }
+
+      it->second.base = mbase;
+      it->second.r = &r;
+      if (!(r.flags & KF_PARTIAL)) {
+        it->second.fullBase = mbase;
+        it->second.full = &r;
+      }
+    }
+
+    const uint64_t* ids = reinterpret_cast<const uint64_t*>(sbase + seg.mappoint_ids_offset);
+    for (uint64_t i = 0; i < h.nmappoints; i++)
+      points[ids[i]] = vpPoints[i];
+
+    header = h;
+    offset += seg.size;
+    nsegments++;
+  }
+
+  if (offset < size)
+    LOGE("Ignoring incomplete checkpoint at %lu: %s", static_cast<unsigned long>(offset), logname.c_str());
+
+  if (nsegments == 0) {
+    LOGE("No checkpoint found: %s", logname.c_str());
+    munmap(data, size);
+    return false;
+  }
+
+  std::ofstream f(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!f.is_open()) {
+    LOGE("Failed to open file: %s", filename.c_str());
+    munmap(data, size);
+    return false;
+  }
+
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  vector<uint64_t> vKFIds;
+  vKFIds.reserve(keyframes.size());
+  for (auto it = keyframes.begin(); it != keyframes.end(); it++)
+    vKFIds.push_back(it->first);
+  sort(vKFIds.begin(), vKFIds.end());
+
+  // Keyframes, features and images are copied from their full record
+  unordered_map<uint64_t, uint32_t> nkeys;
+  vector<KeyFrameRecord> records;
+  records.reserve(vKFIds.size());
+
+  for (uint64_t id : vKFIds) {
+    const KeyFrameEntry &e = keyframes[id];
+    const KeyFrameRecord &full = *e.full;
+    const char* fbase = e.fullBase;
+
+    KeyFrameRecord r = full;
+    r.parent = e.r->parent;
+    memcpy(r.pose, e.r->pose, sizeof(r.pose));
+    r.flags = 0;
+
+    r.keys_offset = WriteBlock(f, 0, fbase + full.keys_offset, full.n*sizeof(KeyPointRecord));
+    r.keysun_offset = WriteBlock(f, 0, fbase + full.keysun_offset, full.n*sizeof(KeyPointRecord));
+    r.right_offset = WriteBlock(f, 0, fbase + full.right_offset, full.n*sizeof(float));
+    r.depth_offset = WriteBlock(f, 0, fbase + full.depth_offset, full.n*sizeof(float));
+    r.descriptors_offset = WriteBlock(f, 0, fbase + full.descriptors_offset, full.n*static_cast<uint64_t>(header.descriptor_size));
+    r.thumb_offset = WriteBlock(f, 0, fbase + full.thumb_offset, full.nthumb*sizeof(float));
+
+    r.nconnections = e.r->nconnections;
+    r.connections_offset = WriteBlock(f, 0, e.base + e.r->connections_offset, r.nconnections*sizeof(ConnectionRecord));
+    r.nloops = e.r->nloops;
+    r.loops_offset = WriteBlock(f, 0, e.base + e.r->loops_offset, r.nloops*sizeof(uint64_t));
+
+    const LevelRecord* flevels = reinterpret_cast<const LevelRecord*>(fbase + full.levels_offset);
+    vector<LevelRecord> levels(flevels, flevels + full.nlevels);
+    for (LevelRecord &l : levels) {
+      if (l.offset != 0)
+        l.offset = WriteBlock(f, 0, fbase + l.offset, static_cast<uint64_t>(l.rows)*l.cols);
+    }
+    r.levels_offset = WriteVector(f, 0, levels);
+
+    if (full.depthimg_offset != 0)
+      r.depthimg_offset = WriteBlock(f, 0, fbase + full.depthimg_offset,
+                                     static_cast<uint64_t>(full.depth_rows)*full.depth_cols*sizeof(float));
+
+    records.push_back(r);
+    nkeys[id] = r.n;
+  }
+
+  header.nkeyframes = records.size();
+  header.keyframes_offset = WriteVector(f, 0, records);
+  header.mappoints_offset = WriteBlock(f, 0, nullptr, 0);
+  header.nmappoints = 0;
+
+  // Map points keep the observations of keyframes that were not erased
+  vector<uint64_t> vMPIds;
+  vMPIds.reserve(points.size());
+  for (auto it = points.begin(); it != points.end(); it++)
+    vMPIds.push_back(it->first);
+  sort(vMPIds.begin(), vMPIds.end());
+
+  vector<ObservationRecord> observations;
+  for (uint64_t id : vMPIds) {
+    const MapPointRecord* p = points[id];
+    const ObservationRecord* obs = reinterpret_cast<const ObservationRecord*>(p + 1);
+
+    observations.clear();
+    bool bRefFound = false;
+    for (uint32_t j = 0; j < p->nobs; j++) {
+      auto it = nkeys.find(obs[j].kf);
+      if (it == nkeys.end() || obs[j].idx >= it->second)
+        continue;
+      observations.push_back(obs[j]);
+      bRefFound |= obs[j].kf == p->ref_kf;
+    }
+
+    if (observations.empty())
+      continue;
+
+    MapPointRecord r = *p;
+    r.ref_kf = bRefFound ? p->ref_kf : observations[0].kf;
+    r.nobs = observations.size();
+
+    f.write(reinterpret_cast<const char*>(&r), sizeof(r));
+    f.write(reinterpret_cast<const char*>(observations.data()), observations.size()*sizeof(ObservationRecord));
+    header.nmappoints++;
+  }
+
+  f.seekp(0);
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  f.close();
+  munmap(data, size);
+
+  if (!f) {
+    LOGE("Failed to write file: %s", filename.c_str());
+    return false;
+  }
+
+  LOGD("Checkpoint log compacted: %lu segments, %lu keyframes, %lu points", static_cast<unsigned long>(nsegments),
+       static_cast<unsigned long>(header.nkeyframes), static_cast<unsigned long>(header.nmappoints));
+  return true;
+}
+
+MapCheckpointer::MapCheckpointer(const string &filename, Map* pMap, bool rgbd, double period):
+    mFilename(filename), mpMap(pMap), mbRgbd(rgbd), mPeriod(period), mbOpen(false), mbResetPending(false),
+    mnVersion(0), mnResetVersion(0), mbFinishRequested(false) {
+}
+
+void MapCheckpointer::Run() {
+  // Lowest priority, checkpoints must not delay tracking or mapping
+  SetThreadPlacement(-1, 0, 19);
+  Trace::SetThreadName("Checkpoint");
+
+  while (1) {
+    bool bFinish;
+    {
+      unique_lock<mutex> lock(mMutexFinish);
+      mCondFinish.wait_for(lock, std::chrono::duration<double>(mPeriod), [this] { return mbFinishRequested; });
+      bFinish = mbFinishRequested;
+    }
+
+    Checkpoint();
+
+    if (bFinish)
+      break;
+  }
+}
+
+void MapCheckpointer::RequestFinish() {
+  unique_lock<mutex> lock(mMutexFinish);
+  mbFinishRequested = true;
+  mCondFinish.notify_all();
+}
+
+void MapCheckpointer::Reset(const std::function<void()> &clear) {
+  unique_lock<mutex> lock(mMutexCheckpoint);
+  clear();
+
+  mKeyFrames.clear();
+  mPoints.clear();
+  mnResetVersion = mpMap->GetSnapshot()->version;
+  mbResetPending = mbOpen;
+}
+
+bool MapCheckpointer::Checkpoint() {
+  unique_lock<mutex> lock(mMutexCheckpoint);
+
+  std::shared_ptr<const Map::Snapshot> snapshot = mpMap->GetSnapshot();
+  if (snapshot->version <= std::max(mnVersion, mnResetVersion))
+    return true;
+
+  // Only registered while writing, so sleeping doesn't delay reclamation
+  ScopedParticipant participant(mpMap->GetReclaimer());
+
+  // Keyframes still in the map, by snapshot index
+  const size_t nKFs = snapshot->vKeyFrameIds.size();
+  vector<KeyFrame*> vpKFs(nKFs, nullptr);
+  vector<bool> vbNew(nKFs, false), vbChanged(nKFs, false);
+  unordered_map<unsigned long, size_t> indices;
+
+  for (size_t i = 0; i < nKFs; i++) {
+    const unsigned long id = snapshot->vKeyFrameIds[i];
+    KeyFrame* pKF = mpMap->GetKeyFrame(id);
+    if (!pKF || pKF->isBad())
+      continue;
+
+    vpKFs[i] = pKF;
+    indices[id] = i;
+
+    auto it = mKeyFrames.find(id);
+    if (it == mKeyFrames.end())
+      vbNew[i] = true;
+    else if (it->second != Pose(snapshot->vKeyFramePoses[i]))
+      vbChanged[i] = true;
+  }
+
+  // New keyframes add edges to their covisible keyframes, and observations to their points
+  unordered_set<unsigned long> sObserved;
+  for (size_t i = 0; i < nKFs; i++) {
+    if (!vbNew[i])
+      continue;
+
+    const std::set<KeyFrame*> sConnected = vpKFs[i]->GetConnectedKeyFrames();
+    for (KeyFrame* pKFi : sConnected) {
+      auto it = indices.find(pKFi->mnId);
+      if (it != indices.end())
+        vbChanged[it->second] = true;
+    }
+
+    const vector<MapPoint*> vpMPs = vpKFs[i]->GetMapPointMatches();
+    for (MapPoint* pMP : vpMPs) {
+      if (pMP && !pMP->isBad())
+        sObserved.insert(pMP->mnId);
+    }
+  }
+
+  auto saved = [&](KeyFrame* pKF) {
+    auto it = indices.find(pKF->mnId);
+    return it != indices.end() && vpKFs[it->second] == pKF;
+  };
+
+  std::ios::openmode mode = std::ios::binary | std::ios::in | std::ios::out;
+  if (!mbOpen)
+    mode |= std::ios::trunc;
+  std::ofstream f(mFilename.c_str(), mode);
+  if (!f.is_open()) {
+    LOGE("Failed to open checkpoint file: %s", mFilename.c_str());
+    return false;
+  }
+
+  f.seekp(0, std::ios::end);
+  const uint64_t start = f.tellp();
+
+  // Magic is left empty until the segment is synced
+  SegmentRecord seg;
+  memset(&seg, 0, sizeof(seg));
+  seg.version = snapshot->version;
+  seg.flags = mbResetPending ? SEGMENT_RESET : 0;
+  f.write(reinterpret_cast<const char*>(&seg), sizeof(seg));
+
+  MapWriter writer(f, mpMap, mbRgbd, saved);
+  seg.map_offset = writer.Base() - start;
+
+  for (size_t i = 0; i < nKFs; i++) {
+    if (vbNew[i] || vbChanged[i])
+      writer.AddKeyFrame(vpKFs[i], snapshot->vKeyFramePoses[i].inverse(), vbNew[i]);
+  }
+
+  vector<uint64_t> vPointIds;
+  vector<size_t> vPointIndices;
+  for (size_t i = 0; i < snapshot->vMapPointIds.size(); i++) {
+    const unsigned long id = snapshot->vMapPointIds[i];
+    auto it = mPoints.find(id);
+    if (it != mPoints.end() && it->second == snapshot->vMapPoints[i] && !sObserved.count(id))
+      continue;
+
+    MapPoint* pMP = mpMap->GetMapPoint(id);
+    if (!pMP || pMP->isBad())
+      continue;
+
+    if (writer.AddMapPoint(pMP, snapshot->vMapPoints[i])) {
+      vPointIds.push_back(id);
+      vPointIndices.push_back(i);
+    }
+  }
+
+  writer.Finish();
+  seg.mappoint_ids_offset = WriteVector(f, start, vPointIds);
+
+  // Everything written before and not in the map any more
+  vector<uint64_t> vErased;
+  for (auto it = mKeyFrames.begin(); it != mKeyFrames.end(); it++) {
+    if (!indices.count(it->first))
+      vErased.push_back(it->first);
+  }
+  seg.nerased_keyframes = vErased.size();
+
+  const unordered_set<unsigned long> sPoints(snapshot->vMapPointIds.begin(), snapshot->vMapPointIds.end());
+  for (auto it = mPoints.begin(); it != mPoints.end(); it++) {
+    if (!sPoints.count(it->first))
+      vErased.push_back(it->first);
+  }
+  seg.nerased_mappoints = vErased.size() - seg.nerased_keyframes;
+  seg.erased_offset = WriteVector(f, start, vErased);
+
+  // Next segment starts aligned
+  seg.size = WriteBlock(f, start, nullptr, 0);
+
+  f.flush();
+  bool ok = f && SyncFile(mFilename);
+  if (ok) {
+    memcpy(seg.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    f.seekp(start);
+    f.write(reinterpret_cast<const char*>(&seg), sizeof(seg));
+    f.flush();
+    ok = f && SyncFile(mFilename);
+  }
+  f.close();
+
+  if (!ok) {
+    // Drop the incomplete segment, so the next one is not hidden behind it
+    if (truncate(mFilename.c_str(), start) != 0) {
+      LOGE("Failed to truncate checkpoint file: %s", mFilename.c_str());
+    }
+    LOGE("Failed to write checkpoint file: %s", mFilename.c_str());
+    return false;
+  }
+
+  if (mbResetPending) {
+    mKeyFrames.clear();
+    mPoints.clear();
+  }
+
+  for (size_t i = 0; i < nKFs; i++) {
+    if (vbNew[i] || vbChanged[i])
+      mKeyFrames[snapshot->vKeyFrameIds[i]] = snapshot->vKeyFramePoses[i];
+  }
+  for (size_t i = 0; i < seg.nerased_keyframes; i++)
+    mKeyFrames.erase(vErased[i]);
+  for (size_t i = 0; i < vPointIds.size(); i++)
+    mPoints[vPointIds[i]] = snapshot->vMapPoints[vPointIndices[i]];
+  for (size_t i = seg.nerased_keyframes; i < vErased.size(); i++)
+    mPoints.erase(vErased[i]);
+
+  mnVersion = snapshot->version;
+  mbOpen = true;
+  mbResetPending = false;
+
+  LOGD("Checkpoint %lu: %lu keyframes, %lu points, %lu erased", mnVersion, static_cast<unsigned long>(writer.KeyFrames()),
+       static_cast<unsigned long>(writer.MapPoints()), static_cast<unsigned long>(vErased.size()));
+  return true;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_MAPFILE_H
+#define SD_SLAM_MAPFILE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+
+namespace SD_SLAM {
+
+class Map;
+class Tracking;
+
+// Versioned binary map file. KeyFrames store pose, keypoints, descriptors, image pyramid,
+// covisibility and spanning tree; MapPoints store position, descriptor and observations.
+// Files are loaded with mmap: descriptors and images reference the mapping directly, so
+// their pages are only read from disk when they are first used.
+class MapFile {
+ public:
+  static const uint32_t VERSION;
+
+  MapFile();
+
+  // Unmaps loaded files. Keyframes created from them must have been deleted.
+  ~MapFile();
+
+  // Save map to filename
+  static bool Save(const std::string &filename, Map* pMap, bool rgbd);
+
+  // Load file and add its keyframes and map points to map. Mapping is kept until destruction.
+  // Keyframe ids are shifted by nIdOffset, so several sessions can be loaded in the same map
+  bool Load(const std::string &filename, Map* pMap, Tracking* pTracker, bool rgbd, unsigned long nIdOffset = 0);
+
+  // Check if filename starts with the map file signature
+  static bool IsMapFile(const std::string &filename);
+
+  // Check if filename starts with the checkpoint log signature
+  static bool IsCheckpointFile(const std::string &filename);
+
+  // Write the map saved in a checkpoint log (see MapCheckpointer) as a map file. An incomplete
+  // last checkpoint is ignored
+  static bool Compact(const std::string &logname, const std::string &filename);
+
+ private:
+  struct Mapping {
+    void* data;
+    size_t size;
+  };
+
+  std::vector<Mapping> mvMappings;
+};
+
+// Background checkpoints of a map being built. Each checkpoint appends a segment to a log
+// file with the keyframes and map points inserted or changed since the previous one, in the
+// map file format, and the ids of the erased ones. Poses and positions are taken from the
+// last published snapshot, so a checkpoint never sees a partially optimized map, and nothing
+// is written if no new snapshot was published. Keyframe features and images never change, so
+// they are written once; later records only carry pose, spanning tree and graph edges.
+// A segment is only valid once it has been synced, a crash loses the last checkpoint at most.
+// The log is turned into a map file with MapFile::Compact.
+class MapCheckpointer {
+ public:
+  // Checkpoint every period seconds. Existing file is overwritten
+  MapCheckpointer(const std::string &filename, Map* pMap, bool rgbd, double period);
+
+  // Main function, a last checkpoint is written when finish is requested
+  void Run();
+
+  // Append changes since last checkpoint now. Returns false if the log can't be written
+  bool Checkpoint();
+
+  // Run clear (map reset) while no checkpoint is being written. Next checkpoint starts a new map
+  void Reset(const std::function<void()> &clear);
+
+  void RequestFinish();
+
+ private:
+  typedef Eigen::Matrix<double, 4, 4, Eigen::DontAlign> Pose;
+
+  std::string mFilename;
+  Map* mpMap;
+  bool mbRgbd;
+  double mPeriod;
+
+  bool mbOpen;                  // Log was created
+  bool mbResetPending;          // Next segment drops everything written before
+  unsigned long mnVersion;      // Snapshot version of last checkpoint
+  unsigned long mnResetVersion; // Snapshots up to this version belong to the cleared map
+
+  // Last values written
+  std::unordered_map<unsigned long, Pose> mKeyFrames;   // Twc
+  std::unordered_map<unsigned long, Eigen::Vector3d> mPoints;
+
+  // Held while a checkpoint is written
+  std::mutex mMutexCheckpoint;
+
+  bool mbFinishRequested;
+  std::mutex mMutexFinish;
+  std::condition_variable mCondFinish;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_MAPFILE_H
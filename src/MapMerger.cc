@@ -0,0 +1,264 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "MapMerger.h"
+#include <algorithm>
+#include "KeyFrame.h"
+#include "MapPoint.h"
+#include "KeyFrameDatabase.h"
+#include "Sim3Solver.h"
+#include "ORBmatcher.h"
+#include "Optimizer.h"
+#include "Converter.h"
+#include "Config.h"
+#include "extra/log.h"
+#include "extra/trace.h"
+
+using std::vector;
+using std::set;
+using std::pair;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+MapMerger::MapMerger(Map* pMap, bool bFixScale, ThreadPool* pool, int nThreads): mpMap(pMap), mbFixScale(bFixScale),
+  mpMatchedKF(nullptr), mnThreads(nThreads) {
+  mpThreadPool = nullptr;
+  if (nThreads > 1)
+    mpThreadPool = pool;
+}
+
+MapMerger::~MapMerger() {
+}
+
+bool MapMerger::Merge(const vector<KeyFrame*> &vpNewKFs) {
+  const set<KeyFrame*> sNewKFs(vpNewKFs.begin(), vpNewKFs.end());
+  if (sNewKFs.size() >= mpMap->KeyFramesInMap()) {
+    LOGE("No previous session to merge with");
+    return false;
+  }
+
+  // Place recognition candidates of every new keyframe, only in previous sessions
+  KeyFrameDatabase* pDB = mpMap->GetKeyFrameDatabase();
+  vector<pair<KeyFrame*, KeyFrame*> > vPairs;
+  for (KeyFrame* pKF : vpNewKFs) {
+    if (pKF->isBad())
+      continue;
+
+    vector<KeyFrame*> vpCandidates = pDB->DetectCandidates(pKF, sNewKFs, Config::LoopCandidates());
+    for (KeyFrame* pCandidate : vpCandidates)
+      vPairs.push_back(std::make_pair(pKF, pCandidate));
+  }
+
+  // Pairs are independent, verify all of them
+  const int nPairs = vPairs.size();
+  vector<Match> vMatches(nPairs);
+  vector<char> vbValid(nPairs, false);
+  ParallelFor(nPairs, [&](int i) {
+    vbValid[i] = ComputeSim3(vPairs[i].first, vPairs[i].second, vMatches[i]);
+  });
+
+  int nBest = -1;
+  for (int i = 0; i < nPairs; i++) {
+    if (vbValid[i] && (nBest < 0 || vMatches[i].nInliers > vMatches[nBest].nInliers))
+      nBest = i;
+  }
+
+  if (nBest < 0) {
+    LOGE("No overlap found between sessions (%d pairs tested)", nPairs);
+    return false;
+  }
+
+  const Match &best = vMatches[nBest];
+  mpMatchedKF = best.pOldKF;
+
+  // Pose of new keyframe in old world, and new world expressed in old one
+  g2o::Sim3 gSow(best.pOldKF->GetRotation(), best.pOldKF->GetTranslation(), 1.0);
+  g2o::Sim3 gSnw(best.pNewKF->GetRotation(), best.pNewKF->GetTranslation(), 1.0);
+  g2o::Sim3 gScw = best.gSno*gSow;
+  g2o::Sim3 gSon = gScw.inverse()*gSnw;
+
+  unique_lock<mutex> lock = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
+
+  Transform(vpNewKFs, gSon);
+
+  // Replace points matched by the best pair
+  for (size_t i = 0; i < best.vpMatches.size(); i++) {
+    MapPoint* pOldMP = best.vpMatches[i];
+    if (!pOldMP || pOldMP->isBad())
+      continue;
+
+    MapPoint* pNewMP = best.pNewKF->GetMapPoint(i);
+    if (pNewMP) {
+      if (pNewMP != pOldMP)
+        pNewMP->Replace(pOldMP);
+    } else {
+      best.pNewKF->AddMapPoint(pOldMP, i);
+      pOldMP->AddObservation(best.pNewKF, i);
+      pOldMP->ComputeDistinctiveDescriptors();
+    }
+  }
+
+  // Fuse around every verified pair. Projection uses the merged poses, so pairs
+  // not consistent with the best one fuse nothing and are not linked
+  int nLinks = 0, nFused = 0;
+  for (int i = 0; i < nPairs; i++) {
+    if (!vbValid[i])
+      continue;
+
+    const Match &match = vMatches[i];
+    int n = Fuse(match);
+    nFused += n;
+
+    if (i == nBest || n >= 20) {
+      match.pOldKF->AddLoopEdge(match.pNewKF);
+      match.pNewKF->AddLoopEdge(match.pOldKF);
+      nLinks++;
+    }
+  }
+
+  mpMap->InformNewBigChange();
+
+  LOGD("Sessions merged: scale %.3f, %d links, %d points fused", gSon.scale(), nLinks, nFused);
+  return true;
+}
+
+bool MapMerger::ComputeSim3(KeyFrame* pNewKF, KeyFrame* pOldKF, Match &match) {
+  if (pNewKF->isBad() || pOldKF->isBad())
+    return false;
+
+  ORBmatcher matcher(0.75, true);
+  vector<MapPoint*> vpMatches;
+  if (matcher.SearchByBoW(pNewKF, pOldKF, vpMatches) < 20)
+    return false;
+
+  Sim3Solver solver(pNewKF, pOldKF, vpMatches, mbFixScale);
+  solver.SetRansacParameters(0.99, 20, 300, Config::LoopProsac());
+
+  bool bNoMore = false;
+  while (!bNoMore) {
+    vector<bool> vbInliers;
+    int nInliers;
+    Eigen::Matrix4d Sno = solver.iterate(5, bNoMore, vbInliers, nInliers);
+    if (Sno.isZero())
+      continue;
+
+    // Guided matching and optimization with all correspondences
+    vector<MapPoint*> vpInliers(vpMatches.size(), static_cast<MapPoint*>(NULL));
+    for (size_t j = 0; j < vbInliers.size(); j++) {
+      if (vbInliers[j])
+        vpInliers[j] = vpMatches[j];
+    }
+
+    Eigen::Matrix3d R = solver.GetEstimatedRotation();
+    Eigen::Vector3d t = solver.GetEstimatedTranslation();
+    const float s = solver.GetEstimatedScale();
+    matcher.SearchBySim3(pNewKF, pOldKF, vpInliers, s, R, t, 7.5);
+
+    g2o::Sim3 gSno(R, t, s);
+    const int nOptInliers = Optimizer::OptimizeSim3(pNewKF, pOldKF, vpInliers, gSno, 10, mbFixScale);
+    if (nOptInliers >= 20) {
+      match.pNewKF = pNewKF;
+      match.pOldKF = pOldKF;
+      match.gSno = gSno;
+      match.vpMatches = vpInliers;
+      match.nInliers = nOptInliers;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void MapMerger::Transform(const vector<KeyFrame*> &vpNewKFs, const g2o::Sim3 &gSon) {
+  const g2o::Sim3 gSno = gSon.inverse();  // New world from old one
+  set<MapPoint*> sPoints;
+
+  for (KeyFrame* pKF : vpNewKFs) {
+    if (pKF->isBad())
+      continue;
+
+    for (MapPoint* pMP : pKF->GetMapPointMatches()) {
+      if (pMP && !pMP->isBad())
+        sPoints.insert(pMP);
+    }
+
+    // Sim3 to SE3 (scale translation)
+    g2o::Sim3 gScw = g2o::Sim3(pKF->GetRotation(), pKF->GetTranslation(), 1.0)*gSno;
+    Eigen::Matrix3d eigR = gScw.rotation().toRotationMatrix();
+    Eigen::Vector3d eigt = gScw.translation();
+    eigt *= (1./gScw.scale());
+    pKF->SetPose(Converter::toSE3(eigR, eigt));
+  }
+
+  const vector<MapPoint*> vpPoints(sPoints.begin(), sPoints.end());
+  ParallelFor(vpPoints.size(), [&](int i) {
+    vpPoints[i]->SetWorldPos(gSon.map(vpPoints[i]->GetWorldPos()));
+    vpPoints[i]->UpdateNormalAndDepth();
+  });
+}
+
+int MapMerger::Fuse(const Match &match) {
+  // Points seen around old keyframe
+  vector<KeyFrame*> vpOldKFs = match.pOldKF->GetVectorCovisibleKeyFrames();
+  vpOldKFs.push_back(match.pOldKF);
+
+  set<MapPoint*> sPoints;
+  for (KeyFrame* pKF : vpOldKFs) {
+    for (MapPoint* pMP : pKF->GetMapPointMatches()) {
+      if (pMP && !pMP->isBad())
+        sPoints.insert(pMP);
+    }
+  }
+  const vector<MapPoint*> vpPoints(sPoints.begin(), sPoints.end());
+
+  // Project them into new keyframe and neighbors
+  vector<KeyFrame*> vpNewKFs = match.pNewKF->GetVectorCovisibleKeyFrames();
+  vpNewKFs.push_back(match.pNewKF);
+
+  ORBmatcher matcher(0.8);
+  int nFused = 0;
+  for (KeyFrame* pKF : vpNewKFs) {
+    if (!pKF->isBad())
+      nFused += matcher.Fuse(pKF, vpPoints, 4.0);
+  }
+
+  // New links between sessions
+  for (KeyFrame* pKF : vpNewKFs) {
+    if (!pKF->isBad())
+      pKF->UpdateConnections();
+  }
+  for (KeyFrame* pKF : vpOldKFs) {
+    if (!pKF->isBad())
+      pKF->UpdateConnections();
+  }
+
+  return nFused;
+}
+
+void MapMerger::ParallelFor(int n, const std::function<void(int)> &f) {
+  if (mpThreadPool) {
+    mpThreadPool->ParallelFor(n, f, mnThreads);
+  } else {
+    for (int i = 0; i < n; i++)
+      f(i);
+  }
+}
+
+}  // namespace SD_SLAM
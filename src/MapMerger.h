@@ -0,0 +1,81 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_MAPMERGER_H
+#define SD_SLAM_MAPMERGER_H
+
+#include <vector>
+#include <set>
+#include "Map.h"
+#include "extra/thread_pool.h"
+#include "extra/g2o/types/types_seven_dof_expmap.h"
+
+namespace SD_SLAM {
+
+class KeyFrame;
+
+// Merges two sessions stored in the same map. Keyframes of the new session are matched
+// against the old one with the place recognition index, every candidate pair is verified
+// with a Sim3 (pairs run in parallel), and the new session is moved into the old frame with
+// the best one. Duplicated points are then fused and loop edges link both sessions.
+class MapMerger {
+ public:
+  // Uses up to nThreads threads of pool
+  MapMerger(Map* pMap, bool bFixScale, ThreadPool* pool, int nThreads);
+  ~MapMerger();
+
+  // Align keyframes in vpNewKFs (and their points) with the rest of the map.
+  // Returns false if no overlap was found, the new session is left unchanged.
+  bool Merge(const std::vector<KeyFrame*> &vpNewKFs);
+
+  // Old keyframe of the pair used to align sessions in the last merge
+  inline KeyFrame* GetMatchedKeyFrame() const { return mpMatchedKF; }
+
+ protected:
+  // Candidate pair verified with a Sim3 from new keyframe to old one
+  struct Match {
+    KeyFrame* pNewKF;
+    KeyFrame* pOldKF;
+    g2o::Sim3 gSno;
+    std::vector<MapPoint*> vpMatches;
+    int nInliers;
+  };
+
+  // Compute Sim3 between both keyframes. Returns false if it is not reliable
+  bool ComputeSim3(KeyFrame* pNewKF, KeyFrame* pOldKF, Match &match);
+
+  // Apply similarity Son (old from new world) to new session
+  void Transform(const std::vector<KeyFrame*> &vpNewKFs, const g2o::Sim3 &gSon);
+
+  // Fuse points seen around old keyframe into new keyframe and neighbors
+  int Fuse(const Match &match);
+
+  void ParallelFor(int n, const std::function<void(int)> &f);
+
+  Map* mpMap;
+  bool mbFixScale;
+  KeyFrame* mpMatchedKF;
+
+  // Shared thread pool (not owned), null if serial
+  ThreadPool* mpThreadPool;
+  int mnThreads;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_MAPMERGER_H
@@ -23,34 +23,48 @@
  */
 
 #include "MapPoint.h"
+#include <algorithm>
 #include "ORBmatcher.h"
+#include "extra/object_pool.h"
+#include "extra/thread_pool.h"
+#include "extra/scale_levels.h"
 
 using std::mutex;
 using std::unique_lock;
-using std::map;
 using std::vector;
 
 namespace SD_SLAM {
 
-long unsigned int MapPoint::nNextId = 0;
 mutex MapPoint::mGlobalMutex;
 
+void* MapPoint::operator new(size_t size) {
+  return ObjectPool<MapPoint>::GetInstance().Allocate(size);
+}
+
+void MapPoint::operator delete(void* p, size_t size) {
+  ObjectPool<MapPoint>::GetInstance().Free(p, size);
+}
+
 MapPoint::MapPoint(const Eigen::Vector3d &Pos, KeyFrame *pRefKF, Map* pMap):
   mnFirstKFid(pRefKF->mnId), nObs(0), mnTrackReferenceForFrame(0),
-  mnLastFrameSeen(0), mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
+  mnLastFrameSeen(0), mnBALocalForKF(0), mnFuseCandidateForKF(0), mnUpdateBatch(0), mnUpdateIdx(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
   mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(pRefKF), mnVisible(1), mnFound(1), mbBad(false),
   mpReplaced(static_cast<MapPoint*>(NULL)), mfMinDistance(0), mfMaxDistance(0), mpMap(pMap) {
   mWorldPos = Pos;
   mNormalVector.setZero();
-
-  // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
-  unique_lock<mutex> lock(mpMap->mMutexPointCreation);
-  mnId=nNextId++;
+  mbDescriptor = false;
+  mnDescriptorObs = 0;
+  mpDescriptorKF = nullptr;
+  std::fill(mnObsUpToLevel, mnObsUpToLevel+MAX_LEVELS, 0);
+  InitSnapshot();
+
+  // MapPoints can be created from Tracking and Local Mapping, map avoids conflicts with id.
+  mnId = mpMap->NewMapPointId();
 }
 
 MapPoint::MapPoint(const Eigen::Vector3d &Pos, Map* pMap, Frame* pFrame, const int &idxF):
   mnFirstKFid(-1), nObs(0), mnTrackReferenceForFrame(0), mnLastFrameSeen(0),
-  mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
+  mnBALocalForKF(0), mnFuseCandidateForKF(0), mnUpdateBatch(0), mnUpdateIdx(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
   mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(static_cast<KeyFrame*>(NULL)), mnVisible(1),
   mnFound(1), mbBad(false), mpReplaced(NULL), mpMap(pMap) {
   mWorldPos = Pos;
@@ -67,39 +81,83 @@ MapPoint::MapPoint(const Eigen::Vector3d &Pos, Map* pMap, Frame* pFrame, const i
   mfMaxDistance = dist*levelScaleFactor;
   mfMinDistance = mfMaxDistance/pFrame->mvScaleFactors[nLevels-1];
 
-  pFrame->mDescriptors.row(idxF).copyTo(mDescriptor);
+  memcpy(mDescriptor, pFrame->mFeatures.Descriptor(idxF), DESCRIPTOR_SIZE);
+  mbDescriptor = true;
+  mnDescriptorObs = 0;
+  mpDescriptorKF = nullptr;
+  std::fill(mnObsUpToLevel, mnObsUpToLevel+MAX_LEVELS, 0);
+  InitSnapshot();
 
-  // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
-  unique_lock<mutex> lock(mpMap->mMutexPointCreation);
-  mnId=nNextId++;
+  // MapPoints can be created from Tracking and Local Mapping, map avoids conflicts with id.
+  mnId = mpMap->NewMapPointId();
+}
+
+MapPoint::MapPoint(const Eigen::Vector3d &Pos, KeyFrame *pRefKF, Map* pMap, const int &idxF):
+  mnFirstKFid(pRefKF->mnId), nObs(0), mnTrackReferenceForFrame(0),
+  mnLastFrameSeen(0), mnBALocalForKF(0), mnFuseCandidateForKF(0), mnUpdateBatch(0), mnUpdateIdx(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
+  mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(pRefKF), mnVisible(1), mnFound(1), mbBad(false),
+  mpReplaced(static_cast<MapPoint*>(NULL)), mpMap(pMap) {
+  mWorldPos = Pos;
+  Eigen::Vector3d PC = Pos - pRefKF->GetCameraCenter();
+  const float dist = PC.norm();
+  mNormalVector = PC/dist;
+
+  const int level = pRefKF->mvKeysUn[idxF].octave;
+  const int nLevels = pRefKF->mnScaleLevels;
+  mfMaxDistance = dist*pRefKF->mvScaleFactors[level];
+  mfMinDistance = mfMaxDistance/pRefKF->mvScaleFactors[nLevels-1];
+
+  memcpy(mDescriptor, pRefKF->mFeatures.Descriptor(idxF), DESCRIPTOR_SIZE);
+  mbDescriptor = true;
+  mnDescriptorObs = 0;
+  mpDescriptorKF = nullptr;
+  std::fill(mnObsUpToLevel, mnObsUpToLevel+MAX_LEVELS, 0);
+  InitSnapshot();
+
+  // MapPoints can be created from Tracking and Local Mapping, map avoids conflicts with id.
+  mnId = mpMap->NewMapPointId();
 }
 
 void MapPoint::SetWorldPos(const Eigen::Vector3d &Pos) {
   unique_lock<mutex> lock2(mGlobalMutex);
-  unique_lock<mutex> lock(mMutexPos);
-  mWorldPos = Pos;
+  {
+    unique_lock<SharedMutex> lock(mMutexPos);
+    mWorldPos = Pos;
+    PublishPos();
+  }
+
+  // Position lock must be released before taking the map one
+  mpMap->UpdateMapPoint(this, Pos);
 }
 
 Eigen::Vector3d MapPoint::GetWorldPos() {
-  unique_lock<mutex> lock(mMutexPos);
-  return mWorldPos;
+  Eigen::Vector3d pos;
+  Read(SNAP_POS, pos.data(), sizeof(double)*3);
+  return pos;
 }
 
 Eigen::Vector3d MapPoint::GetNormal() {
-  unique_lock<mutex> lock(mMutexPos);
-  return mNormalVector;
+  Eigen::Vector3d normal;
+  Read(SNAP_NORMAL, normal.data(), sizeof(double)*3);
+  return normal;
 }
 
 KeyFrame* MapPoint::GetReferenceKeyFrame() {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
   return mpRefKF;
 }
 
 void MapPoint::AddObservation(KeyFrame* pKF, size_t idx) {
-  unique_lock<mutex> lock(mMutexFeatures);
-  if (mObservations.count(pKF))
+  unique_lock<SharedMutex> lock(mMutexFeatures);
+  if (FindObservation(pKF) >= 0)
     return;
-  mObservations[pKF]=idx;
+
+  // Update covisibility with the other observers
+  for (ObservationVector::iterator mit=mObservations.begin(), mend=mObservations.end(); mit != mend; mit++)
+    KeyFrame::ChangeCovisibility(pKF, mit->first, 1);
+
+  mObservations.push_back(Observation(pKF, idx));
+  CountObservation(pKF->mvKeysUn[idx].octave, 1);
 
   if (pKF->mvuRight[idx] >= 0)
     nObs+=2;
@@ -110,17 +168,22 @@ void MapPoint::AddObservation(KeyFrame* pKF, size_t idx) {
 void MapPoint::EraseObservation(KeyFrame* pKF) {
   bool bBad=false;
   {
-    unique_lock<mutex> lock(mMutexFeatures);
-    if (mObservations.count(pKF)) {
-      int idx = mObservations[pKF];
+    unique_lock<SharedMutex> lock(mMutexFeatures);
+    const int pos = FindObservation(pKF);
+    if (pos >= 0) {
+      int idx = mObservations[pos].second;
       if (pKF->mvuRight[idx] >= 0)
         nObs-=2;
       else
         nObs--;
 
-      mObservations.erase(pKF);
+      mObservations.erase(mObservations.begin()+pos);
+      CountObservation(pKF->mvKeysUn[idx].octave, -1);
+
+      for (ObservationVector::iterator mit=mObservations.begin(), mend=mObservations.end(); mit != mend; mit++)
+        KeyFrame::ChangeCovisibility(pKF, mit->first, -1);
 
-      if (mpRefKF==pKF)
+      if (mpRefKF==pKF && !mObservations.empty())
         mpRefKF = mObservations.begin()->first;
 
       // If only 2 observations or less, discard point
@@ -133,26 +196,41 @@ void MapPoint::EraseObservation(KeyFrame* pKF) {
     SetBadFlag();
 }
 
-map<KeyFrame*, size_t> MapPoint::GetObservations() {
-  unique_lock<mutex> lock(mMutexFeatures);
+MapPoint::ObservationVector MapPoint::GetObservations() {
+  SharedLock lock(mMutexFeatures);
   return mObservations;
 }
 
 int MapPoint::Observations() {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
   return nObs;
 }
 
+int MapPoint::ObservationsUpToLevel(int level) {
+  if (level < 0)
+    return 0;
+  SharedLock lock(mMutexFeatures);
+  return mnObsUpToLevel[std::min(level, MAX_LEVELS-1)];
+}
+
+void MapPoint::CountObservation(int level, int delta) {
+  for (int l = std::min(std::max(level, 0), MAX_LEVELS-1); l < MAX_LEVELS; l++)
+    mnObsUpToLevel[l] += delta;
+}
+
 void MapPoint::SetBadFlag() {
-  map<KeyFrame*, size_t> obs;
+  ObservationVector obs;
   {
-    unique_lock<mutex> lock1(mMutexFeatures);
-    unique_lock<mutex> lock2(mMutexPos);
+    unique_lock<SharedMutex> lock1(mMutexFeatures);
+    unique_lock<SharedMutex> lock2(mMutexPos);
     mbBad=true;
+    PublishBad();
     obs = mObservations;
     mObservations.clear();
+    std::fill(mnObsUpToLevel, mnObsUpToLevel+MAX_LEVELS, 0);
+    RemoveCovisibility(obs);
   }
-  for (map<KeyFrame*, size_t>::iterator mit=obs.begin(), mend=obs.end(); mit != mend; mit++) {
+  for (ObservationVector::iterator mit=obs.begin(), mend=obs.end(); mit != mend; mit++) {
     KeyFrame* pKF = mit->first;
     pKF->EraseMapPointMatch(mit->second);
   }
@@ -161,8 +239,8 @@ void MapPoint::SetBadFlag() {
 }
 
 MapPoint* MapPoint::GetReplaced() {
-  unique_lock<mutex> lock1(mMutexFeatures);
-  unique_lock<mutex> lock2(mMutexPos);
+  SharedLock lock1(mMutexFeatures);
+  SharedLock lock2(mMutexPos);
   return mpReplaced;
 }
 
@@ -171,19 +249,22 @@ void MapPoint::Replace(MapPoint* pMP) {
     return;
 
   int nvisible, nfound;
-  map<KeyFrame*, size_t> obs;
+  ObservationVector obs;
   {
-    unique_lock<mutex> lock1(mMutexFeatures);
-    unique_lock<mutex> lock2(mMutexPos);
+    unique_lock<SharedMutex> lock1(mMutexFeatures);
+    unique_lock<SharedMutex> lock2(mMutexPos);
     obs = mObservations;
     mObservations.clear();
+    std::fill(mnObsUpToLevel, mnObsUpToLevel+MAX_LEVELS, 0);
+    RemoveCovisibility(obs);
     mbBad=true;
+    PublishBad();
     nvisible = mnVisible;
     nfound = mnFound;
     mpReplaced = pMP;
   }
 
-  for (map<KeyFrame*, size_t>::iterator mit=obs.begin(), mend=obs.end(); mit != mend; mit++) {
+  for (ObservationVector::iterator mit=obs.begin(), mend=obs.end(); mit != mend; mit++) {
     // Replace measurement in keyframe
     KeyFrame* pKF = mit->first;
 
@@ -202,49 +283,96 @@ void MapPoint::Replace(MapPoint* pMP) {
 }
 
 bool MapPoint::isBad() {
-  unique_lock<mutex> lock(mMutexFeatures);
-  unique_lock<mutex> lock2(mMutexPos);
-  return mbBad;
+  uint64_t flags;
+  Read(SNAP_FLAGS, &flags, sizeof(flags));
+  return flags & FLAG_BAD;
 }
 
 void MapPoint::IncreaseVisible(int n) {
-  unique_lock<mutex> lock(mMutexFeatures);
+  unique_lock<SharedMutex> lock(mMutexFeatures);
   mnVisible+=n;
 }
 
 void MapPoint::IncreaseFound(int n) {
-  unique_lock<mutex> lock(mMutexFeatures);
+  unique_lock<SharedMutex> lock(mMutexFeatures);
   mnFound+=n;
 }
 
 float MapPoint::GetFoundRatio() {
-  unique_lock<mutex> lock(mMutexFeatures);
+  SharedLock lock(mMutexFeatures);
   return static_cast<float>(mnFound)/mnVisible;
 }
 
-void MapPoint::ComputeDistinctiveDescriptors() {
-  // Retrieve all observed descriptors
-  vector<cv::Mat> vDescriptors;
+void MapPoint::ComputeDistinctiveDescriptors(bool bForce) {
+  ObservationVector observations;
+  size_t nLastObs;
+  KeyFrame* pLastKF;
 
-  map<KeyFrame*, size_t> observations;
+  {
+    SharedLock lock1(mMutexFeatures);
+    if (mbBad)
+      return;
+    observations = mObservations;
+    nLastObs = mnDescriptorObs;
+    pLastKF = mpDescriptorKF;
+  }
+
+  ComputeDescriptor(observations, nLastObs, pLastKF, bForce);
+}
 
+void MapPoint::UpdateDescriptorNormalAndDepth(const CameraCenters *pCenters) {
+  ObservationVector observations;
+  size_t nLastObs;
+  KeyFrame* pLastKF;
+  KeyFrame* pRefKF;
+  Eigen::Vector3d Pos;
+
+  // Observations are copied once for both
   {
-    unique_lock<mutex> lock1(mMutexFeatures);
+    SharedLock lock1(mMutexFeatures);
+    SharedLock lock2(mMutexPos);
     if (mbBad)
       return;
     observations = mObservations;
+    nLastObs = mnDescriptorObs;
+    pLastKF = mpDescriptorKF;
+    pRefKF = mpRefKF;
+    Pos = mWorldPos;
   }
 
+  ComputeDescriptor(observations, nLastObs, pLastKF, false);
+  ComputeNormalAndDepth(observations, pRefKF, Pos, pCenters);
+}
+
+void MapPoint::ComputeDescriptor(const ObservationVector &observations, size_t nLastObs, KeyFrame* pLastKF, bool bForce) {
   if (observations.empty())
     return;
 
-  vDescriptors.reserve(observations.size());
+  // Median descriptor barely changes with few more observations. Recompute it while there are
+  // few of them, when they changed by a quarter or when its keyframe does not observe it anymore
+  const size_t nObs = observations.size();
+  bool bLastFound = false;
+  for (const Observation &obs : observations)
+    bLastFound |= obs.first == pLastKF;
+  if (!bForce && pLastKF && bLastFound && nLastObs >= 4) {
+    const size_t diff = nObs > nLastObs ? nObs-nLastObs : nLastObs-nObs;
+    if (4*diff < nLastObs)
+      return;
+  }
+
+  // Retrieve all observed descriptors, no copies
+  vector<const uchar*> vDescriptors;
+  vector<KeyFrame*> vKFs;
+  vDescriptors.reserve(nObs);
+  vKFs.reserve(nObs);
 
-  for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+  for (ObservationVector::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
     KeyFrame* pKF = mit->first;
 
-    if (!pKF->isBad())
-      vDescriptors.push_back(pKF->mDescriptors.row(mit->second));
+    if (!pKF->isBad()) {
+      vDescriptors.push_back(pKF->mFeatures.Descriptor(mit->second));
+      vKFs.push_back(pKF);
+    }
   }
 
   if (vDescriptors.empty())
@@ -253,23 +381,25 @@ void MapPoint::ComputeDistinctiveDescriptors() {
   // Compute distances between them
   const size_t N = vDescriptors.size();
 
-  float Distances[N][N];
+  vector<int> vDistances(N*N);
   for (size_t i = 0; i < N; i++) {
-    Distances[i][i] = 0;
+    vDistances[i*N+i] = 0;
     for (size_t j = i+1; j < N; j++) {
       int distij = ORBmatcher::DescriptorDistance(vDescriptors[i], vDescriptors[j]);
-      Distances[i][j]=distij;
-      Distances[j][i]=distij;
+      vDistances[i*N+j] = distij;
+      vDistances[j*N+i] = distij;
     }
   }
 
   // Take the descriptor with least median distance to the rest
   int BestMedian = INT_MAX;
   int BestIdx = 0;
+  vector<int> vDists(N);
+  const size_t nMedian = 0.5*(N-1);
   for (size_t i = 0; i < N; i++) {
-    vector<int> vDists(Distances[i],Distances[i]+N);
-    sort(vDists.begin(), vDists.end());
-    int median = vDists[0.5*(N-1)];
+    std::copy(vDistances.begin()+i*N, vDistances.begin()+(i+1)*N, vDists.begin());
+    std::nth_element(vDists.begin(), vDists.begin()+nMedian, vDists.end());
+    int median = vDists[nMedian];
 
     if (median<BestMedian) {
       BestMedian = median;
@@ -278,36 +408,69 @@ void MapPoint::ComputeDistinctiveDescriptors() {
   }
 
   {
-    unique_lock<mutex> lock(mMutexFeatures);
-    mDescriptor = vDescriptors[BestIdx].clone();
+    unique_lock<SharedMutex> lock(mMutexFeatures);
+    memcpy(mDescriptor, vDescriptors[BestIdx], DESCRIPTOR_SIZE);
+    mbDescriptor = true;
+    mnDescriptorObs = nObs;
+    mpDescriptorKF = vKFs[BestIdx];
+    PublishDescriptor();
   }
 }
 
 cv::Mat MapPoint::GetDescriptor() {
-  unique_lock<mutex> lock(mMutexFeatures);
-  return mDescriptor.clone();
+  uchar desc[DESCRIPTOR_SIZE];
+  if (!GetDescriptor(desc))
+    return cv::Mat();
+
+  return cv::Mat(1, DESCRIPTOR_SIZE, CV_8U, desc).clone();
+}
+
+bool MapPoint::GetDescriptor(uchar *desc) {
+  // Flags and descriptor are contiguous, read both at once
+  uint64_t words[SNAP_WORDS-SNAP_FLAGS];
+  Read(SNAP_FLAGS, words, sizeof(words));
+  if (!(words[0] & FLAG_DESC))
+    return false;
+
+  memcpy(desc, &words[1], DESCRIPTOR_SIZE);
+  return true;
+}
+
+void MapPoint::SetDescriptor(const cv::Mat &descriptor) {
+  unique_lock<SharedMutex> lock(mMutexFeatures);
+  mbDescriptor = !descriptor.empty() && descriptor.isContinuous() &&
+                 descriptor.total()*descriptor.elemSize() == DESCRIPTOR_SIZE;
+  if (mbDescriptor)
+    memcpy(mDescriptor, descriptor.data, DESCRIPTOR_SIZE);
+  PublishDescriptor();
+}
+
+size_t MapPoint::GetHeapBytes() {
+  SharedLock lock(mMutexFeatures);
+  return mObservations.heap_bytes();
 }
 
 int MapPoint::GetIndexInKeyFrame(KeyFrame *pKF) {
-  unique_lock<mutex> lock(mMutexFeatures);
-  if (mObservations.count(pKF))
-    return mObservations[pKF];
+  SharedLock lock(mMutexFeatures);
+  const int pos = FindObservation(pKF);
+  if (pos >= 0)
+    return mObservations[pos].second;
   else
     return -1;
 }
 
 bool MapPoint::IsInKeyFrame(KeyFrame *pKF) {
-  unique_lock<mutex> lock(mMutexFeatures);
-  return (mObservations.count(pKF));
+  SharedLock lock(mMutexFeatures);
+  return FindObservation(pKF) >= 0;
 }
 
-void MapPoint::UpdateNormalAndDepth() {
-  map<KeyFrame*, size_t> observations;
+void MapPoint::UpdateNormalAndDepth(const CameraCenters *pCenters) {
+  ObservationVector observations;
   KeyFrame* pRefKF;
   Eigen::Vector3d Pos;
   {
-    unique_lock<mutex> lock1(mMutexFeatures);
-    unique_lock<mutex> lock2(mMutexPos);
+    SharedLock lock1(mMutexFeatures);
+    SharedLock lock2(mMutexPos);
     if (mbBad)
       return;
     observations = mObservations;
@@ -315,75 +478,219 @@ void MapPoint::UpdateNormalAndDepth() {
     Pos = mWorldPos;
   }
 
+  ComputeNormalAndDepth(observations, pRefKF, Pos, pCenters);
+}
+
+void MapPoint::ComputeNormalAndDepth(const ObservationVector &observations, KeyFrame* pRefKF, const Eigen::Vector3d &Pos,
+                                     const CameraCenters *pCenters) {
   if (observations.empty())
     return;
 
+  auto center = [pCenters](KeyFrame* pKF) -> Eigen::Vector3d {
+    if (pCenters) {
+      CameraCenters::const_iterator it = pCenters->find(pKF);
+      if (it != pCenters->end())
+        return it->second;
+    }
+    return pKF->GetCameraCenter();
+  };
+
   Eigen::Vector3d normal(0, 0, 0);
   int n = 0;
-  for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
-    KeyFrame* pKF = mit->first;
-    Eigen::Vector3d Owi = pKF->GetCameraCenter();
-    Eigen::Vector3d normali = mWorldPos - Owi;
+  for (ObservationVector::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+    Eigen::Vector3d Owi = center(mit->first);
+    Eigen::Vector3d normali = Pos - Owi;
     normal = normal + normali/normali.norm();
     n++;
   }
 
-  Eigen::Vector3d PC = Pos - pRefKF->GetCameraCenter();
+  Eigen::Vector3d PC = Pos - center(pRefKF);
   const float dist = PC.norm();
-  const int level = pRefKF->mvKeysUn[observations[pRefKF]].octave;
+  size_t refIdx = 0;
+  for (const Observation &obs : observations) {
+    if (obs.first == pRefKF)
+      refIdx = obs.second;
+  }
+  const int level = pRefKF->mvKeysUn[refIdx].octave;
   const float levelScaleFactor =  pRefKF->mvScaleFactors[level];
   const int nLevels = pRefKF->mnScaleLevels;
 
   {
-    unique_lock<mutex> lock3(mMutexPos);
+    unique_lock<SharedMutex> lock3(mMutexPos);
     mfMaxDistance = dist*levelScaleFactor;
     mfMinDistance = mfMaxDistance/pRefKF->mvScaleFactors[nLevels-1];
     mNormalVector = normal/n;
+    PublishNormalAndDepth();
   }
 }
 
 float MapPoint::GetMinDistanceInvariance() {
-  unique_lock<mutex> lock(mMutexPos);
-  return 0.8f*mfMinDistance;
+  float dist[2];
+  Read(SNAP_DIST, dist, sizeof(dist));
+  return 0.8f*dist[0];
 }
 
 float MapPoint::GetMaxDistanceInvariance() {
-  unique_lock<mutex> lock(mMutexPos);
-  return 1.2f*mfMaxDistance;
+  float dist[2];
+  Read(SNAP_DIST, dist, sizeof(dist));
+  return 1.2f*dist[1];
 }
 
 int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF) {
-  float ratio;
-  {
-    unique_lock<mutex> lock(mMutexPos);
-    ratio = mfMaxDistance/currentDist;
+  float dist[2];
+  Read(SNAP_DIST, dist, sizeof(dist));
+  return PredictLevel(dist[1], currentDist, pKF->mvScaleFactors.data(), pKF->mnScaleLevels);
+}
+
+int MapPoint::PredictScale(const float &currentDist, Frame* pF) {
+  float dist[2];
+  Read(SNAP_DIST, dist, sizeof(dist));
+  return PredictLevel(dist[1], currentDist, pF->mvScaleFactors, pF->mnScaleLevels);
+}
+
+void MapPoint::RemoveCovisibility(const ObservationVector &obs) {
+  for (ObservationVector::const_iterator mit1=obs.begin(), mend=obs.end(); mit1 != mend; mit1++) {
+    for (ObservationVector::const_iterator mit2=mit1+1; mit2 != mend; mit2++)
+      KeyFrame::ChangeCovisibility(mit1->first, mit2->first, -1);
+  }
+}
+
+int MapPoint::FindObservation(KeyFrame* pKF) const {
+  for (size_t i = 0; i < mObservations.size(); i++) {
+    if (mObservations[i].first == pKF)
+      return i;
   }
+  return -1;
+}
 
-  int nScale = ceil(log(ratio)/pKF->mfLogScaleFactor);
-  if (nScale < 0)
-    nScale = 0;
-  else if (nScale>=pKF->mnScaleLevels)
-    nScale = pKF->mnScaleLevels-1;
+void MapPoint::InitSnapshot() {
+  for (int i = 0; i < SNAP_WORDS; i++)
+    mSnapshot[i].store(0, std::memory_order_relaxed);
 
-  return nScale;
+  PublishPos();
+  PublishNormalAndDepth();
+  PublishDescriptor();
 }
 
-int MapPoint::PredictScale(const float &currentDist, Frame* pF) {
-  float ratio;
-  {
-    unique_lock<mutex> lock(mMutexPos);
-    ratio = mfMaxDistance/currentDist;
+void MapPoint::Publish(int word, const void *data, size_t bytes) {
+  unique_lock<mutex> lock(mMutexSnapshot);
+  mSeqLock.BeginWrite();
+  SeqLock::Store(&mSnapshot[word], data, bytes);
+  mSeqLock.EndWrite();
+}
+
+void MapPoint::PublishPos() {
+  Publish(SNAP_POS, mWorldPos.data(), sizeof(double)*3);
+}
+
+void MapPoint::PublishNormalAndDepth() {
+  // Normal and distances are contiguous
+  uint64_t words[SNAP_FLAGS-SNAP_NORMAL];
+  float dist[2] = {mfMinDistance, mfMaxDistance};
+  memcpy(words, mNormalVector.data(), sizeof(double)*3);
+  memcpy(&words[SNAP_DIST-SNAP_NORMAL], dist, sizeof(dist));
+  Publish(SNAP_NORMAL, words, sizeof(words));
+}
+
+void MapPoint::PublishBad() {
+  unique_lock<mutex> lock(mMutexSnapshot);
+  uint64_t flags = mSnapshot[SNAP_FLAGS].load(std::memory_order_relaxed);
+  if (mbBad)
+    flags |= FLAG_BAD;
+  else
+    flags &= ~static_cast<uint64_t>(FLAG_BAD);
+
+  mSeqLock.BeginWrite();
+  mSnapshot[SNAP_FLAGS].store(flags, std::memory_order_relaxed);
+  mSeqLock.EndWrite();
+}
+
+void MapPoint::PublishDescriptor() {
+  // Flags and descriptor are updated together
+  unique_lock<mutex> lock(mMutexSnapshot);
+  uint64_t words[SNAP_WORDS-SNAP_FLAGS] = {0};
+  words[0] = mSnapshot[SNAP_FLAGS].load(std::memory_order_relaxed);
+  if (mbDescriptor) {
+    words[0] |= FLAG_DESC;
+    memcpy(&words[1], mDescriptor, DESCRIPTOR_SIZE);
+  } else {
+    words[0] &= ~static_cast<uint64_t>(FLAG_DESC);
   }
 
-  int nScale = ceil(log(ratio)/pF->mfLogScaleFactor);
-  if (nScale < 0)
-    nScale = 0;
-  else if (nScale>=pF->mnScaleLevels)
-    nScale = pF->mnScaleLevels-1;
+  mSeqLock.BeginWrite();
+  SeqLock::Store(&mSnapshot[SNAP_FLAGS], words, sizeof(words));
+  mSeqLock.EndWrite();
+}
+
+void MapPoint::Read(int word, void *data, size_t bytes) {
+  unsigned seq;
+  do {
+    seq = mSeqLock.BeginRead();
+    SeqLock::Load(data, &mSnapshot[word], bytes);
+  } while (mSeqLock.Retry(seq));
+}
+
+std::atomic<long unsigned int> MapPointBatch::nNextId(1);
+
+MapPointBatch::MapPointBatch() {
+  mnId = nNextId++;
+}
+
+void MapPointBatch::Add(MapPoint* pMP, bool bObservations) {
+  if (pMP->mnUpdateBatch == mnId) {
+    if (bObservations)
+      mvbObservations[pMP->mnUpdateIdx] = true;
+    return;
+  }
 
-  return nScale;
+  pMP->mnUpdateBatch = mnId;
+  pMP->mnUpdateIdx = mvpMapPoints.size();
+  mvpMapPoints.push_back(pMP);
+  mvbObservations.push_back(bObservations);
 }
 
+void MapPointBatch::Apply(ThreadPool* pPool, int nThreads) {
+  // Blocks of points, a single update is too small to be a task
+  const int BLOCK = 32;
+  const int N = mvpMapPoints.size();
+  const int nBlocks = (N+BLOCK-1)/BLOCK;
+
+  // Snapshot of observer centers, each keyframe is seen by many points of the batch
+  mCenters.clear();
+  for (MapPoint* pMP : mvpMapPoints) {
+    if (pMP->isBad())
+      continue;
+    for (const MapPoint::Observation &obs : pMP->GetObservations()) {
+      std::pair<MapPoint::CameraCenters::iterator, bool> res = mCenters.emplace(obs.first, Eigen::Vector3d());
+      if (res.second)
+        res.first->second = obs.first->GetCameraCenter();
+    }
+  }
+
+  auto update = [&](int b) {
+    const int end = std::min(N, (b+1)*BLOCK);
+    for (int i = b*BLOCK; i < end; i++) {
+      if (mvbObservations[i])
+        mvpMapPoints[i]->UpdateDescriptorNormalAndDepth(&mCenters);
+      else
+        mvpMapPoints[i]->UpdateNormalAndDepth(&mCenters);
+    }
+  };
+
+  if (pPool && nBlocks > 1) {
+    pPool->ParallelFor(nBlocks, update, nThreads);
+  } else {
+    for (int b = 0; b < nBlocks; b++)
+      update(b);
+  }
+
+  Clear();
+}
 
+void MapPointBatch::Clear() {
+  mvpMapPoints.clear();
+  mvbObservations.clear();
+  mnId = nNextId++;
+}
 
 }  // namespace SD_SLAM
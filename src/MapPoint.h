@@ -26,35 +26,82 @@
 #define SD_SLAM_MAPPOINT_H
 
 #include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
 #include <opencv2/core/core.hpp>
 #include <Eigen/Dense>
 #include "KeyFrame.h"
 #include "Frame.h"
 #include "Map.h"
+#include "extra/seqlock.h"
+#include "extra/shared_mutex.h"
+#include "extra/small_vector.h"
 
 namespace SD_SLAM {
 
 class KeyFrame;
 class Map;
 class Frame;
+class ThreadPool;
 
+// Position, normal, distances, bad flag and descriptor are also kept in a snapshot
+// protected by a sequence lock, so their getters never block nor allocate.
 class MapPoint {
  public:
+  static const int DESCRIPTOR_SIZE = 32;
+
+  // Scale levels with their own observation counter, coarser ones share the last
+  static const int MAX_LEVELS = 16;
+
+  // Keyframe observing the point and index of the keypoint in it. Most points have few
+  // observations, they are kept inline in insertion order
+  typedef std::pair<KeyFrame*, size_t> Observation;
+  typedef SmallVector<Observation, 8> ObservationVector;
+
+  // Camera centers of keyframes, read once to update many points
+  typedef std::unordered_map<KeyFrame*, Eigen::Vector3d> CameraCenters;
+
   MapPoint(const Eigen::Vector3d &Pos, KeyFrame* pRefKF, Map* pMap);
   MapPoint(const Eigen::Vector3d &Pos,  Map* pMap, Frame* pFrame, const int &idxF);
 
+  // Point measured at keypoint idxF of pRefKF. Descriptor, normal and depth are taken from
+  // that keypoint, so it can be tracked before they are recomputed from its observations
+  MapPoint(const Eigen::Vector3d &Pos, KeyFrame* pRefKF, Map* pMap, const int &idxF);
+
+  // Allocated from a slab pool, so points created together are close in memory.
+  // Slots are aligned as Eigen members require
+  static void* operator new(size_t size);
+  static void operator delete(void* p, size_t size);
+
   void SetWorldPos(const Eigen::Vector3d &Pos);
   Eigen::Vector3d GetWorldPos();
 
   Eigen::Vector3d GetNormal();
   KeyFrame* GetReferenceKeyFrame();
 
-  std::map<KeyFrame*, size_t> GetObservations();
+  ObservationVector GetObservations();
   int Observations();
 
+  // Keyframes observing the point at given scale level or a finer one, kept up to date
+  // as observations are added and erased
+  int ObservationsUpToLevel(int level);
+
+  // Call f(pKF, idx) for each observation without copying them. Features lock is held shared,
+  // so f must not call methods of this point
+  template <typename F>
+  void ForEachObservation(F f) {
+    SharedLock lock(mMutexFeatures);
+    for (const Observation &obs : mObservations)
+      f(obs.first, obs.second);
+  }
+
   void AddObservation(KeyFrame* pKF, size_t idx);
   void EraseObservation(KeyFrame* pKF);
 
+  // Memory allocated by the point besides the object itself
+  size_t GetHeapBytes();
+
   int GetIndexInKeyFrame(KeyFrame* pKF);
   bool IsInKeyFrame(KeyFrame* pKF);
 
@@ -71,11 +118,21 @@ class MapPoint {
     return mnFound;
   }
 
-  void ComputeDistinctiveDescriptors();
+  // Take the observed descriptor with least median distance to the rest. It is only recomputed
+  // if observations changed significantly since last time, or if bForce is set.
+  void ComputeDistinctiveDescriptors(bool bForce = false);
 
   cv::Mat GetDescriptor();
+  void SetDescriptor(const cv::Mat &descriptor);
+
+  // Copy descriptor into desc (DESCRIPTOR_SIZE bytes). Returns false if not computed yet
+  bool GetDescriptor(uchar *desc);
 
-  void UpdateNormalAndDepth();
+  // If pCenters is given, observer centers are taken from it. Keyframes missing there are read
+  void UpdateNormalAndDepth(const CameraCenters *pCenters = nullptr);
+
+  // ComputeDistinctiveDescriptors and UpdateNormalAndDepth, copying observations once
+  void UpdateDescriptorNormalAndDepth(const CameraCenters *pCenters = nullptr);
 
   float GetMinDistanceInvariance();
   float GetMaxDistanceInvariance();
@@ -84,7 +141,6 @@ class MapPoint {
 
  public:
   long unsigned int mnId;
-  static long unsigned int nNextId;
   long int mnFirstKFid;
   int nObs;
 
@@ -101,6 +157,8 @@ class MapPoint {
   // Variables used by local mapping
   long unsigned int mnBALocalForKF;
   long unsigned int mnFuseCandidateForKF;
+  long unsigned int mnUpdateBatch;   // Last MapPointBatch it was added to, and its position there
+  size_t mnUpdateIdx;
 
   // Variables used by loop closing
   long unsigned int mnLoopPointForKF;
@@ -117,13 +175,21 @@ class MapPoint {
    Eigen::Vector3d mWorldPos;
 
    // Keyframes observing the point and associated index in keyframe
-   std::map<KeyFrame*, size_t> mObservations;
+   ObservationVector mObservations;
+
+   // Observations at each level or finer, cumulative so a query is a single read
+   unsigned short mnObsUpToLevel[MAX_LEVELS];
 
    // Mean viewing direction
    Eigen::Vector3d mNormalVector;
 
-   // Best descriptor to fast matching
-   cv::Mat mDescriptor;
+   // Best descriptor to fast matching, valid if mbDescriptor
+   uchar mDescriptor[DESCRIPTOR_SIZE];
+   bool mbDescriptor;
+
+   // Observations when the descriptor was computed and keyframe it was taken from
+   size_t mnDescriptorObs;
+   KeyFrame* mpDescriptorKF;
 
    // Reference KeyFrame
    KeyFrame* mpRefKF;
@@ -142,11 +208,77 @@ class MapPoint {
 
    Map* mpMap;
 
-   std::mutex mMutexPos;
-   std::mutex mMutexFeatures;
+   // Shared by readers, exclusive for changes
+   SharedMutex mMutexPos;
+   SharedMutex mMutexFeatures;
+
+ private:
+   // Snapshot layout in words
+   enum { SNAP_POS = 0, SNAP_NORMAL = 3, SNAP_DIST = 6, SNAP_FLAGS = 7, SNAP_DESC = 8, SNAP_WORDS = 12 };
+   enum { FLAG_BAD = 1, FLAG_DESC = 2 };
+
+   // Remove covisibility between every pair of keyframes in obs
+   void RemoveCovisibility(const ObservationVector &obs);
+
+   // Descriptor, and normal and depth, from a copy of the observations
+   void ComputeDescriptor(const ObservationVector &observations, size_t nLastObs, KeyFrame* pLastKF, bool bForce);
+   void ComputeNormalAndDepth(const ObservationVector &observations, KeyFrame* pRefKF, const Eigen::Vector3d &Pos,
+                              const CameraCenters *pCenters);
 
+   // Position of pKF in mObservations or -1. Called with features lock held
+   int FindObservation(KeyFrame* pKF) const;
+
+   // Add delta to level counters of an observation at given level. Called with features lock held
+   void CountObservation(int level, int delta);
+
+   // Initialize snapshot from current values
+   void InitSnapshot();
+
+   // Update snapshot words. Called with the lock of the modified values held
+   void Publish(int word, const void *data, size_t bytes);
+   void PublishPos();
+   void PublishNormalAndDepth();
+   void PublishBad();
+   void PublishDescriptor();
+
+   // Copy snapshot words, retrying while a writer is active
+   void Read(int word, void *data, size_t bytes);
+
+   SeqLock mSeqLock;
+   SeqLock::Word mSnapshot[SNAP_WORDS];
+
+   // Serializes snapshot writers, never taken by readers
+   std::mutex mMutexSnapshot;
+};
+
+// Points whose descriptor, normal and depth must be recomputed. Each point is added once
+// however many times it is touched, and all of them are updated together in parallel.
+// Observer camera centers are read once per keyframe for the whole batch.
+class MapPointBatch {
  public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  MapPointBatch();
+
+  // If bObservations, observations changed and the descriptor is also recomputed.
+  // Otherwise only the position moved
+  void Add(MapPoint* pMP, bool bObservations);
+
+  inline size_t Size() const { return mvpMapPoints.size(); }
+
+  // Update all points, bad ones are skipped, and empty the batch
+  void Apply(ThreadPool* pPool, int nThreads);
+
+  void Clear();
+
+ private:
+  std::vector<MapPoint*> mvpMapPoints;
+  std::vector<bool> mvbObservations;
+
+  // Centers of the keyframes observing the points, taken when the batch is applied
+  MapPoint::CameraCenters mCenters;
+
+  // Points with this id in mnUpdateBatch are in the batch
+  long unsigned int mnId;
+  static std::atomic<long unsigned int> nNextId;
 };
 
 }  // namespace SD_SLAM
@@ -0,0 +1,164 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "MapPointIndex.h"
+#include <cmath>
+
+using std::vector;
+
+namespace SD_SLAM {
+
+// Bits used by each cell coordinate in the hash key
+static const int KEY_BITS = 21;
+static const int64_t KEY_OFFSET = int64_t(1) << (KEY_BITS-1);
+static const int64_t KEY_MASK = (int64_t(1) << KEY_BITS)-1;
+
+MapPointIndex::MapPointIndex(float voxelSize): mfVoxelSize(voxelSize), mfInvVoxelSize(1.0/voxelSize) {
+}
+
+void MapPointIndex::insert(MapPoint* pMP, const Eigen::Vector3d &pos) {
+  if (mPointCells.count(pMP)) {
+    update(pMP, pos);
+    return;
+  }
+
+  int64_t key = Key(pos);
+  mCells[key].push_back(Entry{pMP, pos.cast<float>()});
+  mPointCells[pMP] = key;
+}
+
+void MapPointIndex::erase(MapPoint* pMP) {
+  auto it = mPointCells.find(pMP);
+  if (it == mPointCells.end())
+    return;
+
+  auto cit = mCells.find(it->second);
+  if (cit != mCells.end()) {
+    Cell &cell = cit->second;
+    for (size_t i = 0; i < cell.size(); i++) {
+      if (cell[i].pMP == pMP) {
+        cell[i] = cell.back();
+        cell.pop_back();
+        break;
+      }
+    }
+
+    if (cell.empty())
+      mCells.erase(cit);
+  }
+
+  mPointCells.erase(it);
+}
+
+void MapPointIndex::clear() {
+  mCells.clear();
+  mPointCells.clear();
+}
+
+void MapPointIndex::update(MapPoint* pMP, const Eigen::Vector3d &pos) {
+  auto it = mPointCells.find(pMP);
+  if (it == mPointCells.end())
+    return;
+
+  int64_t key = Key(pos);
+  if (key == it->second) {
+    // Same cell, only refresh position
+    Cell &cell = mCells[key];
+    for (size_t i = 0; i < cell.size(); i++) {
+      if (cell[i].pMP == pMP) {
+        cell[i].pos = pos.cast<float>();
+        break;
+      }
+    }
+    return;
+  }
+
+  erase(pMP);
+  mCells[key].push_back(Entry{pMP, pos.cast<float>()});
+  mPointCells[pMP] = key;
+}
+
+vector<MapPoint*> MapPointIndex::GetInFrustum(const Frustum &frustum) const {
+  vector<MapPoint*> vpMPs;
+
+  const Eigen::Matrix3d Rcw = frustum.Tcw.block<3, 3>(0, 0);
+  const Eigen::Vector3d tcw = frustum.Tcw.block<3, 1>(0, 3);
+
+  // Side planes through the camera center, a point is inside if n·Pc >= 0
+  Eigen::Vector3d normals[4];
+  normals[0] << frustum.fx, 0, frustum.cx-frustum.minX;
+  normals[1] << -frustum.fx, 0, frustum.maxX-frustum.cx;
+  normals[2] << 0, frustum.fy, frustum.cy-frustum.minY;
+  normals[3] << 0, -frustum.fy, frustum.maxY-frustum.cy;
+  for (int i = 0; i < 4; i++)
+    normals[i].normalize();
+
+  // Radius of the sphere containing a cell
+  const double radius = 0.5*sqrt(3.0)*mfVoxelSize;
+
+  for (auto it = mCells.begin(); it != mCells.end(); it++) {
+    // Discard cells completely outside
+    Eigen::Vector3d Pc = Rcw*CellCenter(it->first)+tcw;
+    if (Pc(2) < -radius)
+      continue;
+    if (frustum.maxDepth > 0 && Pc(2) > frustum.maxDepth+radius)
+      continue;
+
+    bool outside = false;
+    for (int i = 0; i < 4 && !outside; i++)
+      outside = normals[i].dot(Pc) < -radius;
+    if (outside)
+      continue;
+
+    // Check each point of the cell
+    const Cell &cell = it->second;
+    for (size_t i = 0; i < cell.size(); i++) {
+      Eigen::Vector3d P = Rcw*cell[i].pos.cast<double>()+tcw;
+      if (P(2) <= 0.0)
+        continue;
+      if (frustum.maxDepth > 0 && P(2) > frustum.maxDepth)
+        continue;
+
+      const double invz = 1.0/P(2);
+      const double u = frustum.fx*P(0)*invz+frustum.cx;
+      const double v = frustum.fy*P(1)*invz+frustum.cy;
+      if (u < frustum.minX || u > frustum.maxX || v < frustum.minY || v > frustum.maxY)
+        continue;
+
+      vpMPs.push_back(cell[i].pMP);
+    }
+  }
+
+  return vpMPs;
+}
+
+int64_t MapPointIndex::Key(const Eigen::Vector3d &pos) const {
+  int64_t x = static_cast<int64_t>(floor(pos(0)*mfInvVoxelSize))+KEY_OFFSET;
+  int64_t y = static_cast<int64_t>(floor(pos(1)*mfInvVoxelSize))+KEY_OFFSET;
+  int64_t z = static_cast<int64_t>(floor(pos(2)*mfInvVoxelSize))+KEY_OFFSET;
+  return ((x & KEY_MASK) << (2*KEY_BITS)) | ((y & KEY_MASK) << KEY_BITS) | (z & KEY_MASK);
+}
+
+Eigen::Vector3d MapPointIndex::CellCenter(int64_t key) const {
+  double x = static_cast<double>(((key >> (2*KEY_BITS)) & KEY_MASK)-KEY_OFFSET);
+  double y = static_cast<double>(((key >> KEY_BITS) & KEY_MASK)-KEY_OFFSET);
+  double z = static_cast<double>((key & KEY_MASK)-KEY_OFFSET);
+  return Eigen::Vector3d(x+0.5, y+0.5, z+0.5)*mfVoxelSize;
+}
+
+}  // namespace SD_SLAM
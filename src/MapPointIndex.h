@@ -0,0 +1,78 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_MAPPOINTINDEX_H
+#define SD_SLAM_MAPPOINTINDEX_H
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <Eigen/Dense>
+
+namespace SD_SLAM {
+
+class MapPoint;
+
+// Voxel hash over MapPoint positions. Each point is stored in the cell containing its
+// last known position, so frustum queries only visit cells that may be in view.
+// Not thread safe, Map guards it with its own mutex.
+class MapPointIndex {
+ public:
+  // Pinhole camera used in frustum queries
+  struct Frustum {
+    Eigen::Matrix4d Tcw;
+    float fx, fy, cx, cy;
+    float minX, maxX, minY, maxY;
+    float maxDepth;       // Ignored if <= 0
+  };
+
+  explicit MapPointIndex(float voxelSize = 0.25);
+
+  void insert(MapPoint* pMP, const Eigen::Vector3d &pos);
+  void erase(MapPoint* pMP);
+  void clear();
+
+  // Move pMP to the cell of its new position. Unknown points are ignored
+  void update(MapPoint* pMP, const Eigen::Vector3d &pos);
+
+  // Points whose indexed position projects inside the image with positive depth
+  std::vector<MapPoint*> GetInFrustum(const Frustum &frustum) const;
+
+  inline size_t size() const { return mPointCells.size(); }
+
+ protected:
+  struct Entry {
+    MapPoint* pMP;
+    Eigen::Vector3f pos;
+  };
+
+  typedef std::vector<Entry> Cell;
+
+  int64_t Key(const Eigen::Vector3d &pos) const;
+  Eigen::Vector3d CellCenter(int64_t key) const;
+
+  float mfVoxelSize;
+  float mfInvVoxelSize;
+
+  std::unordered_map<int64_t, Cell> mCells;
+  std::unordered_map<MapPoint*, int64_t> mPointCells;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_MAPPOINTINDEX_H
@@ -0,0 +1,383 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "MapStream.h"
+#include <string.h>
+#include <cmath>
+#include <algorithm>
+#include <unordered_set>
+
+using std::vector;
+using std::pair;
+
+namespace SD_SLAM {
+
+namespace {
+
+const char MAGIC[4] = {'S', 'D', 'M', 'S'};
+
+// Quaternion components are quantized to 16 bits
+const double QUATERNION_SCALE = 32767.0;
+
+inline int32_t Quantize(double v, double scale) {
+  const double q = std::round(v*scale);
+  return static_cast<int32_t>(std::max(std::min(q, 2147483647.0), -2147483647.0));
+}
+
+inline void PutVarint(vector<uint8_t> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<uint8_t>(v) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(v));
+}
+
+inline void PutZigzag(vector<uint8_t> &out, int64_t v) {
+  PutVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+// Sorted ids, each one as the difference with the previous one
+inline void PutIds(vector<uint8_t> &out, const vector<unsigned long> &ids) {
+  PutVarint(out, ids.size());
+  unsigned long last = 0;
+  for (unsigned long id : ids) {
+    PutVarint(out, id-last);
+    last = id;
+  }
+}
+
+class Reader {
+ public:
+  Reader(const uint8_t *data, size_t size): p_(data), end_(data+size) {}
+
+  inline bool Bytes(void *dst, size_t n) {
+    if (static_cast<size_t>(end_-p_) < n)
+      return false;
+    memcpy(dst, p_, n);
+    p_ += n;
+    return true;
+  }
+
+  inline bool Varint(uint64_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p_ == end_)
+        return false;
+      const uint8_t b = *p_++;
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  inline bool Zigzag(int64_t &v) {
+    uint64_t u;
+    if (!Varint(u))
+      return false;
+    v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+    return true;
+  }
+
+  // Count of elements, each one taking at least min_size bytes
+  inline bool Count(uint64_t &n, size_t min_size) {
+    return Varint(n) && n <= static_cast<uint64_t>(end_-p_)/min_size;
+  }
+
+  bool Ids(vector<unsigned long> &ids) {
+    uint64_t n, delta;
+    if (!Count(n, 1))
+      return false;
+    ids.resize(n);
+    unsigned long last = 0;
+    for (uint64_t i = 0; i < n; i++) {
+      if (!Varint(delta))
+        return false;
+      last += delta;
+      ids[i] = last;
+    }
+    return true;
+  }
+
+  inline bool Done() const { return p_ == end_; }
+
+ private:
+  const uint8_t *p_;
+  const uint8_t *end_;
+};
+
+}  // namespace
+
+const uint8_t MapStream::VERSION = 1;
+
+MapStream::MapStream(double resolution): mResolution(resolution), mbFull(true), mnVersion(0), mnBigChangeIdx(0) {
+}
+
+void MapStream::Reset() {
+  mbFull = true;
+}
+
+bool MapStream::Encode(const Map::Snapshot &snapshot, vector<uint8_t> &msg) {
+  msg.clear();
+  if (!mbFull && snapshot.version <= mnVersion)
+    return false;
+
+  uint8_t flags = 0;
+  if (mbFull) {
+    flags |= FULL;
+    mKeyFrames.clear();
+    mPoints.clear();
+  }
+  if (snapshot.nBigChangeIdx != mnBigChangeIdx)
+    flags |= BIG_CHANGE;
+
+  // Receiver gets resolution as float, quantize with the same value
+  const float resolution = mResolution;
+  const double scale = 1.0/resolution;
+
+  // Keyframes changed since last message, with deltas from the values sent then
+  vector<pair<unsigned long, KeyFrameState> > vKFUpdates;
+  std::unordered_set<unsigned long> sKFIds;
+  for (size_t i = 0; i < snapshot.vKeyFrameIds.size(); i++) {
+    const unsigned long id = snapshot.vKeyFrameIds[i];
+    const Eigen::Matrix4d &Twc = snapshot.vKeyFramePoses[i];
+    sKFIds.insert(id);
+
+    // Keep w positive, q and -q are the same rotation
+    Eigen::Quaterniond q(Twc.block<3, 3>(0, 0));
+    q.normalize();
+    if (q.w() < 0)
+      q.coeffs() = -q.coeffs();
+
+    KeyFrameState state;
+    for (int j = 0; j < 3; j++)
+      state(j) = Quantize(Twc(j, 3), scale);
+    for (int j = 0; j < 4; j++)
+      state(3+j) = Quantize(q.coeffs()(j), QUATERNION_SCALE);
+
+    auto it = mKeyFrames.find(id);
+    if (it == mKeyFrames.end()) {
+      vKFUpdates.push_back(std::make_pair(id, state));
+      mKeyFrames[id] = state;
+    } else if (it->second != state) {
+      vKFUpdates.push_back(std::make_pair(id, KeyFrameState(state-it->second)));
+      it->second = state;
+    }
+  }
+
+  vector<unsigned long> vKFErased;
+  for (auto it = mKeyFrames.begin(); it != mKeyFrames.end();) {
+    if (!sKFIds.count(it->first)) {
+      vKFErased.push_back(it->first);
+      it = mKeyFrames.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  // Same for map points
+  vector<pair<unsigned long, PointState> > vMPUpdates;
+  std::unordered_set<unsigned long> sMPIds;
+  for (size_t i = 0; i < snapshot.vMapPointIds.size(); i++) {
+    const unsigned long id = snapshot.vMapPointIds[i];
+    const Eigen::Vector3d &pos = snapshot.vMapPoints[i];
+    sMPIds.insert(id);
+
+    PointState state;
+    for (int j = 0; j < 3; j++)
+      state(j) = Quantize(pos(j), scale);
+
+    auto it = mPoints.find(id);
+    if (it == mPoints.end()) {
+      vMPUpdates.push_back(std::make_pair(id, state));
+      mPoints[id] = state;
+    } else if (it->second != state) {
+      vMPUpdates.push_back(std::make_pair(id, PointState(state-it->second)));
+      it->second = state;
+    }
+  }
+
+  vector<unsigned long> vMPErased;
+  for (auto it = mPoints.begin(); it != mPoints.end();) {
+    if (!sMPIds.count(it->first)) {
+      vMPErased.push_back(it->first);
+      it = mPoints.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  mnVersion = snapshot.version;
+  mnBigChangeIdx = snapshot.nBigChangeIdx;
+  mbFull = false;
+
+  if (!flags && vKFUpdates.empty() && vKFErased.empty() && vMPUpdates.empty() && vMPErased.empty())
+    return false;
+
+  // Ids are delta encoded, so they are written in order
+  std::sort(vKFErased.begin(), vKFErased.end());
+  std::sort(vMPErased.begin(), vMPErased.end());
+  std::sort(vKFUpdates.begin(), vKFUpdates.end(),
+            [](const pair<unsigned long, KeyFrameState> &a, const pair<unsigned long, KeyFrameState> &b) {
+    return a.first < b.first;
+  });
+  std::sort(vMPUpdates.begin(), vMPUpdates.end(),
+            [](const pair<unsigned long, PointState> &a, const pair<unsigned long, PointState> &b) {
+    return a.first < b.first;
+  });
+
+  msg.reserve(16 + 4*(vKFErased.size()+vMPErased.size()) + 16*vKFUpdates.size() + 8*vMPUpdates.size());
+  msg.insert(msg.end(), MAGIC, MAGIC+4);
+  msg.push_back(VERSION);
+  msg.push_back(flags);
+  const uint8_t *pres = reinterpret_cast<const uint8_t*>(&resolution);
+  msg.insert(msg.end(), pres, pres+sizeof(float));
+  PutVarint(msg, snapshot.version);
+
+  PutIds(msg, vKFErased);
+  PutVarint(msg, vKFUpdates.size());
+  unsigned long last = 0;
+  for (const auto &u : vKFUpdates) {
+    PutVarint(msg, u.first-last);
+    last = u.first;
+    for (int j = 0; j < 7; j++)
+      PutZigzag(msg, u.second(j));
+  }
+
+  PutIds(msg, vMPErased);
+  PutVarint(msg, vMPUpdates.size());
+  last = 0;
+  for (const auto &u : vMPUpdates) {
+    PutVarint(msg, u.first-last);
+    last = u.first;
+    for (int j = 0; j < 3; j++)
+      PutZigzag(msg, u.second(j));
+  }
+
+  return true;
+}
+
+MapStreamReader::MapStreamReader(): mnFlags(0) {
+}
+
+bool MapStreamReader::Apply(const uint8_t *data, size_t size) {
+  Reader reader(data, size);
+
+  char magic[4];
+  uint8_t version, flags;
+  float resolution;
+  uint64_t nversion;
+  if (!reader.Bytes(magic, 4) || memcmp(magic, MAGIC, 4) != 0)
+    return false;
+  if (!reader.Bytes(&version, 1) || version != MapStream::VERSION)
+    return false;
+  if (!reader.Bytes(&flags, 1) || !reader.Bytes(&resolution, sizeof(float)) || !(resolution > 0.0f))
+    return false;
+  if (!reader.Varint(nversion))
+    return false;
+
+  // Parse whole message before changing anything
+  vector<unsigned long> vKFErased, vMPErased;
+  vector<pair<unsigned long, KeyFrameState> > vKFUpdates;
+  vector<pair<unsigned long, PointState> > vMPUpdates;
+  uint64_t n, delta;
+  int64_t v;
+  unsigned long last;
+
+  if (!reader.Ids(vKFErased) || !reader.Count(n, 8))
+    return false;
+  vKFUpdates.resize(n);
+  last = 0;
+  for (auto &u : vKFUpdates) {
+    if (!reader.Varint(delta))
+      return false;
+    last += delta;
+    u.first = last;
+    for (int j = 0; j < 7; j++) {
+      if (!reader.Zigzag(v))
+        return false;
+      u.second(j) = static_cast<int32_t>(v);
+    }
+  }
+
+  if (!reader.Ids(vMPErased) || !reader.Count(n, 4))
+    return false;
+  vMPUpdates.resize(n);
+  last = 0;
+  for (auto &u : vMPUpdates) {
+    if (!reader.Varint(delta))
+      return false;
+    last += delta;
+    u.first = last;
+    for (int j = 0; j < 3; j++) {
+      if (!reader.Zigzag(v))
+        return false;
+      u.second(j) = static_cast<int32_t>(v);
+    }
+  }
+
+  if (!reader.Done())
+    return false;
+
+  // Apply changes
+  mnFlags = flags;
+  if (flags & MapStream::FULL) {
+    mKeyFrames.clear();
+    mPoints.clear();
+    mKeyFrameStates.clear();
+    mPointStates.clear();
+  }
+
+  for (unsigned long id : vKFErased) {
+    mKeyFrames.erase(id);
+    mKeyFrameStates.erase(id);
+  }
+  for (unsigned long id : vMPErased) {
+    mPoints.erase(id);
+    mPointStates.erase(id);
+  }
+
+  for (const auto &u : vKFUpdates) {
+    auto it = mKeyFrameStates.find(u.first);
+    KeyFrameState state = u.second;
+    if (it != mKeyFrameStates.end())
+      state += it->second;
+    mKeyFrameStates[u.first] = state;
+
+    Eigen::Quaterniond q(state(6)/QUATERNION_SCALE, state(3)/QUATERNION_SCALE, state(4)/QUATERNION_SCALE,
+                         state(5)/QUATERNION_SCALE);
+    q.normalize();
+    Eigen::Matrix4d Twc = Eigen::Matrix4d::Identity();
+    Twc.block<3, 3>(0, 0) = q.toRotationMatrix();
+    Twc.block<3, 1>(0, 3) = state.head<3>().cast<double>()*resolution;
+    mKeyFrames[u.first] = Twc;
+  }
+
+  for (const auto &u : vMPUpdates) {
+    auto it = mPointStates.find(u.first);
+    PointState state = u.second;
+    if (it != mPointStates.end())
+      state += it->second;
+    mPointStates[u.first] = state;
+    mPoints[u.first] = state.cast<double>()*resolution;
+  }
+
+  return true;
+}
+
+}  // namespace SD_SLAM
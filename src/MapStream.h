@@ -0,0 +1,107 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_MAPSTREAM_H
+#define SD_SLAM_MAPSTREAM_H
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include "Map.h"
+
+namespace SD_SLAM {
+
+// Binary stream of map changes for remote viewers. Each message holds the keyframes and
+// map points inserted, moved or erased since the previous one, computed from published map
+// snapshots, so encoding never locks the map. Positions are quantized and sent as varint
+// deltas from the last value sent for the same element, ids are sorted and delta encoded.
+//
+// Message layout:
+//   magic "SDMS", version (u8), flags (u8), resolution (f32), snapshot version (varint)
+//   erased keyframes:  count, id deltas
+//   updated keyframes: count, then id delta, position (3) and quaternion xyzw (4) deltas
+//   erased points:     count, id deltas
+//   updated points:    count, then id delta and position (3) deltas
+// Counts and ids are unsigned varints, value deltas are zigzag varints.
+//
+// Each receiver needs its own MapStream, fed with Map::GetSnapshot() whenever it wants an update.
+class MapStream {
+ public:
+  static const uint8_t VERSION;
+
+  enum Flags {
+    FULL = 1,        // Receiver must drop its state first
+    BIG_CHANGE = 2,  // Loop closure or global BA since previous message
+  };
+
+  // Positions are sent with resolution map units (1 mm by default)
+  explicit MapStream(double resolution = 0.001);
+
+  // Encode changes between last encoded snapshot and this one into msg.
+  // Returns false, leaving msg empty, if snapshot is not newer or nothing changed
+  bool Encode(const Map::Snapshot &snapshot, std::vector<uint8_t> &msg);
+
+  // Next message sends the whole map (new receiver)
+  void Reset();
+
+ private:
+  typedef Eigen::Matrix<int32_t, 7, 1> KeyFrameState;  // Position and quaternion
+  typedef Eigen::Matrix<int32_t, 3, 1> PointState;
+
+  double mResolution;
+  bool mbFull;
+  unsigned long mnVersion;
+  int mnBigChangeIdx;
+
+  // Last values sent
+  std::unordered_map<unsigned long, KeyFrameState> mKeyFrames;
+  std::unordered_map<unsigned long, PointState> mPoints;
+};
+
+// Rebuilds the map sent by a MapStream
+class MapStreamReader {
+ public:
+  MapStreamReader();
+
+  // Apply a message. Returns false if it is malformed, state is unchanged in that case
+  bool Apply(const uint8_t *data, size_t size);
+
+  // Flags of last applied message
+  inline uint8_t GetFlags() const { return mnFlags; }
+
+  // Keyframe poses (Twc) and map point positions
+  std::unordered_map<unsigned long, Eigen::Matrix4d, std::hash<unsigned long>, std::equal_to<unsigned long>,
+                     Eigen::aligned_allocator<std::pair<const unsigned long, Eigen::Matrix4d> > > mKeyFrames;
+  std::unordered_map<unsigned long, Eigen::Vector3d> mPoints;
+
+ private:
+  typedef Eigen::Matrix<int32_t, 7, 1> KeyFrameState;
+  typedef Eigen::Matrix<int32_t, 3, 1> PointState;
+
+  uint8_t mnFlags;
+
+  // Quantized values, deltas are applied to them
+  std::unordered_map<unsigned long, KeyFrameState> mKeyFrameStates;
+  std::unordered_map<unsigned long, PointState> mPointStates;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_MAPSTREAM_H
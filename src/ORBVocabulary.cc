@@ -0,0 +1,272 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ORBVocabulary.h"
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "ORBmatcher.h"
+#include "MapPoint.h"
+#include "extra/log.h"
+
+using std::vector;
+using std::string;
+using std::pair;
+
+namespace SD_SLAM {
+
+namespace {
+
+const char MAGIC[8] = {'S', 'D', 'V', 'O', 'C', 'A', 'B', 'U'};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t branching;
+  uint32_t levels;
+  uint32_t nodes;
+};
+
+}  // namespace
+
+const uint32_t ORBVocabulary::VERSION = 1;
+
+ORBVocabulary::ORBVocabulary(): mnBranching(0), mnLevels(0), mnWords(0) {
+}
+
+bool ORBVocabulary::Load(const string &filename) {
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  if (!f.is_open()) {
+    LOGE("Can't open vocabulary %s", filename.c_str());
+    return false;
+  }
+
+  char magic[8];
+  bool ok;
+  if (f.read(magic, 8) && memcmp(magic, MAGIC, 8) == 0) {
+    f.seekg(0);
+    ok = LoadBinary(f);
+  } else {
+    f.close();
+    ok = LoadText(filename);
+  }
+
+  if (!ok) {
+    LOGE("Wrong vocabulary file %s", filename.c_str());
+    mnWords = 0;
+    return false;
+  }
+
+  BuildTree();
+  return true;
+}
+
+bool ORBVocabulary::LoadBinary(std::istream &f) {
+  Header header;
+  if (!f.read(reinterpret_cast<char*>(&header), sizeof(Header)) || header.version != VERSION || header.nodes == 0)
+    return false;
+
+  const size_t n = header.nodes;
+  mnBranching = header.branching;
+  mnLevels = header.levels;
+  mvParents.resize(n);
+  mvWordIds.resize(n);
+  mvWeights.resize(n);
+  mvDescriptors.resize(n*MapPoint::DESCRIPTOR_SIZE);
+
+  f.read(reinterpret_cast<char*>(mvParents.data()), n*sizeof(uint32_t));
+  f.read(reinterpret_cast<char*>(mvWordIds.data()), n*sizeof(int32_t));
+  f.read(reinterpret_cast<char*>(mvWeights.data()), n*sizeof(float));
+  f.read(reinterpret_cast<char*>(mvDescriptors.data()), mvDescriptors.size());
+  if (!f)
+    return false;
+
+  mnWords = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0 && mvParents[i] >= i)
+      return false;
+    if (mvWordIds[i] >= 0)
+      mnWords++;
+  }
+
+  return true;
+}
+
+bool ORBVocabulary::LoadText(const string &filename) {
+  std::ifstream f(filename.c_str());
+  string line;
+  if (!std::getline(f, line))
+    return false;
+
+  // Header: branching, levels, scoring and weighting (only TF-IDF and L1 are supported)
+  std::stringstream ss(line);
+  int scoring, weighting;
+  if (!(ss >> mnBranching >> mnLevels >> scoring >> weighting) || mnBranching <= 0 || mnLevels <= 0)
+    return false;
+
+  mvParents.assign(1, 0);
+  mvWordIds.assign(1, -1);
+  mvWeights.assign(1, 0.0f);
+  mvDescriptors.assign(MapPoint::DESCRIPTOR_SIZE, 0);
+  mnWords = 0;
+
+  // One node per line: parent, leaf flag, descriptor bytes and weight
+  while (std::getline(f, line)) {
+    if (line.empty())
+      continue;
+
+    std::stringstream ns(line);
+    uint32_t parent;
+    int leaf;
+    if (!(ns >> parent >> leaf) || parent >= mvParents.size())
+      return false;
+
+    for (int i = 0; i < MapPoint::DESCRIPTOR_SIZE; i++) {
+      int v;
+      if (!(ns >> v))
+        return false;
+      mvDescriptors.push_back(static_cast<uint8_t>(v));
+    }
+
+    float weight;
+    if (!(ns >> weight))
+      return false;
+
+    mvParents.push_back(parent);
+    mvWeights.push_back(weight);
+    mvWordIds.push_back(leaf ? mnWords++ : -1);
+  }
+
+  return mnWords > 0;
+}
+
+bool ORBVocabulary::Save(const string &filename) const {
+  std::ofstream f(filename.c_str(), std::ios::binary);
+  if (!f.is_open())
+    return false;
+
+  Header header;
+  memcpy(header.magic, MAGIC, 8);
+  header.version = VERSION;
+  header.branching = mnBranching;
+  header.levels = mnLevels;
+  header.nodes = mvParents.size();
+
+  f.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+  f.write(reinterpret_cast<const char*>(mvParents.data()), mvParents.size()*sizeof(uint32_t));
+  f.write(reinterpret_cast<const char*>(mvWordIds.data()), mvWordIds.size()*sizeof(int32_t));
+  f.write(reinterpret_cast<const char*>(mvWeights.data()), mvWeights.size()*sizeof(float));
+  f.write(reinterpret_cast<const char*>(mvDescriptors.data()), mvDescriptors.size());
+
+  return static_cast<bool>(f);
+}
+
+size_t ORBVocabulary::Bytes() const {
+  return mvParents.capacity()*sizeof(uint32_t) + mvWordIds.capacity()*sizeof(int32_t) +
+         mvWeights.capacity()*sizeof(float) + mvDescriptors.capacity() +
+         (mvChildOffsets.capacity()+mvChildren.capacity())*sizeof(uint32_t);
+}
+
+void ORBVocabulary::BuildTree() {
+  const size_t n = mvParents.size();
+
+  // Count children, then place them in node order (parents always come first)
+  mvChildOffsets.assign(n+1, 0);
+  for (size_t i = 1; i < n; i++)
+    mvChildOffsets[mvParents[i]+1]++;
+  for (size_t i = 0; i < n; i++)
+    mvChildOffsets[i+1] += mvChildOffsets[i];
+
+  vector<uint32_t> next(mvChildOffsets.begin(), mvChildOffsets.end()-1);
+  mvChildren.resize(n > 0 ? n-1 : 0);
+  for (size_t i = 1; i < n; i++)
+    mvChildren[next[mvParents[i]]++] = i;
+}
+
+void ORBVocabulary::Transform(const cv::Mat &descriptors, BowVector &bow, FeatureVector &feat, int levelsUp) const {
+  bow.clear();
+  feat.clear();
+  if (Empty() || descriptors.empty())
+    return;
+
+  const int featLevel = mnLevels-levelsUp;
+  vector<pair<uint32_t, float> > vWords;
+  vector<pair<uint32_t, uint32_t> > vNodes;
+  vWords.reserve(descriptors.rows);
+  vNodes.reserve(descriptors.rows);
+
+  for (int i = 0; i < descriptors.rows; i++) {
+    const uchar* d = descriptors.ptr<uchar>(i);
+
+    // Go down choosing the closest child
+    uint32_t node = 0;
+    uint32_t featNode = 0;
+    int level = 0;
+    while (mvChildOffsets[node] != mvChildOffsets[node+1]) {
+      uint32_t best = 0;
+      int bestDist = 257;
+      for (uint32_t c = mvChildOffsets[node]; c < mvChildOffsets[node+1]; c++) {
+        const uint32_t child = mvChildren[c];
+        const int dist = ORBmatcher::DescriptorDistance(d, &mvDescriptors[child*MapPoint::DESCRIPTOR_SIZE]);
+        if (dist < bestDist) {
+          bestDist = dist;
+          best = child;
+        }
+      }
+
+      node = best;
+      level++;
+      if (level <= featLevel)
+        featNode = node;
+    }
+
+    if (mvWordIds[node] < 0)
+      continue;
+
+    const float weight = mvWeights[node];
+    if (weight > 0)
+      vWords.push_back(std::make_pair(static_cast<uint32_t>(mvWordIds[node]), weight));
+    vNodes.push_back(std::make_pair(featNode, static_cast<uint32_t>(i)));
+  }
+
+  // Merge repeated words and L1 normalize
+  std::sort(vWords.begin(), vWords.end());
+  float sum = 0.0f;
+  for (const auto &w : vWords) {
+    if (!bow.empty() && bow.back().first == w.first)
+      bow.back().second += w.second;
+    else
+      bow.push_back(w);
+    sum += w.second;
+  }
+  if (sum > 0) {
+    for (auto &w : bow)
+      w.second /= sum;
+  }
+
+  // Group features by node, indices stay sorted
+  std::sort(vNodes.begin(), vNodes.end());
+  for (const auto &n : vNodes) {
+    if (feat.empty() || feat.back().first != n.first)
+      feat.push_back(std::make_pair(n.first, vector<uint32_t>()));
+    feat.back().second.push_back(n.second);
+  }
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_ORBVOCABULARY_H
+#define SD_SLAM_ORBVOCABULARY_H
+
+#include <stdint.h>
+#include <string>
+#include <iosfwd>
+#include <vector>
+#include <utility>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Hierarchical k-means tree of ORB descriptors (bag of words). Leaves are words, weighted
+// with their inverse document frequency. Nodes are stored in flat arrays, children of each
+// node are contiguous.
+class ORBVocabulary {
+ public:
+  // Words of a descriptor set and their L1 normalized weights, sorted by word
+  typedef std::vector<std::pair<uint32_t, float> > BowVector;
+
+  // Feature indices grouped by the tree node some levels above their word, sorted by node
+  typedef std::vector<std::pair<uint32_t, std::vector<uint32_t> > > FeatureVector;
+
+  static const uint32_t VERSION;
+
+  ORBVocabulary();
+
+  // Load binary vocabulary, or DBoW2 text vocabulary (ORBvoc.txt) if it lacks the binary signature
+  bool Load(const std::string &filename);
+
+  // Save in binary format, much faster to load than text
+  bool Save(const std::string &filename) const;
+
+  inline bool Empty() const { return mnWords == 0; }
+  inline int Words() const { return mnWords; }
+
+  // Memory of the tree
+  size_t Bytes() const;
+
+  // Quantize descriptors (one per row). Features are grouped by their ancestor levelsUp
+  // levels above the word
+  void Transform(const cv::Mat &descriptors, BowVector &bow, FeatureVector &feat, int levelsUp) const;
+
+ private:
+  bool LoadBinary(std::istream &f);
+  bool LoadText(const std::string &filename);
+
+  // Build children tables from parents
+  void BuildTree();
+
+  int mnBranching;
+  int mnLevels;
+  int mnWords;
+
+  // Node i: parent, word id (-1 if not a leaf), weight and descriptor. Node 0 is the root
+  std::vector<uint32_t> mvParents;
+  std::vector<int32_t> mvWordIds;
+  std::vector<float> mvWeights;
+  std::vector<uint8_t> mvDescriptors;
+
+  // Children of node i are mvChildren[mvChildOffsets[i]..mvChildOffsets[i+1])
+  std::vector<uint32_t> mvChildOffsets;
+  std::vector<uint32_t> mvChildren;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_ORBVOCABULARY_H
@@ -63,7 +63,18 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include "extra/feature_table.h"
 #include "extra/timer.h"
+#include "extra/log.h"
+#if CV_MAJOR_VERSION >= 3
+#include <opencv2/core/ocl.hpp>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace cv;
 using namespace std;
@@ -74,72 +85,186 @@ const int PATCH_SIZE = 31;
 const int HALF_PATCH_SIZE = 15;
 const int EDGE_THRESHOLD = 19;
 
+// End of each row of the circular patch used for orientation, symmetric in u and v:
+// umax[v] = round(sqrt(HALF_PATCH_SIZE^2 - v^2)) up to 45 degrees, mirrored above
+constexpr int UMAX[HALF_PATCH_SIZE+1] = {15, 15, 15, 15, 14, 14, 14, 13, 13, 12, 11, 10, 9, 8, 6, 3};
 
-static float IC_Angle(const Mat& image, Point2f pt,  const vector<int> & u_max) {
-  int m_01 = 0, m_10 = 0;
 
-  const uchar* center = &image.at<uchar> (cvRound(pt.y), cvRound(pt.x));
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline int HorizontalSum(int32x4_t v) {
+#if defined(__aarch64__)
+  return vaddvq_s32(v);
+#else
+  int32x2_t s = vadd_s32(vget_low_s32(v), vget_high_s32(v));
+  return vget_lane_s32(vpadd_s32(s, s), 0);
+#endif
+}
+
+// Moments of 8 consecutive columns starting at u0, plus and minus point to the two lines
+static inline void AccumulateMoments(const uchar *plus, const uchar *minus, int u0, int32x4_t &m10,
+                                     int32x4_t &vsum) {
+  static const int16_t offsets[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+  uint8x8_t p = vld1_u8(plus), m = vld1_u8(minus);
+  int16x8_t s = vreinterpretq_s16_u16(vaddl_u8(p, m));
+  int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(p, m));
+  int16x8_t u = vaddq_s16(vld1q_s16(offsets), vdupq_n_s16(u0));
+  m10 = vmlal_s16(m10, vget_low_s16(s), vget_low_s16(u));
+  m10 = vmlal_s16(m10, vget_high_s16(s), vget_high_s16(u));
+  vsum = vpadalq_s16(vsum, d);
+}
+#endif
 
-  // Treat the center line differently, v = 0
-  for (int u = -HALF_PATCH_SIZE; u <= HALF_PATCH_SIZE; ++u)
-    m_10 += u * center[u];
+// Moments of the two lines at distance V of the center, and recursively of closer lines.
+// Row bounds are compile-time constants, so the compiler unrolls every row
+template <int V>
+struct PatchRows {
+  static inline void Accumulate(const uchar* center, int step, int &m_01, int &m_10) {
+    PatchRows<V-1>::Accumulate(center, step, m_01, m_10);
 
-  // Go line by line in the circuI853lar patch
-  int step = (int)image.step1();
-  for (int v = 1; v <= HALF_PATCH_SIZE; ++v) {
-    // Proceed over the two lines
+    const uchar* plus = center + V*step;
+    const uchar* minus = center - V*step;
     int v_sum = 0;
-    int d = u_max[v];
-    for (int u = -d; u <= d; ++u) {
-      int val_plus = center[u + v*step], val_minus = center[u - v*step];
+    int u = -UMAX[V];
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t m10 = vdupq_n_s32(0), vsum = vdupq_n_s32(0);
+    for (; u+8 <= UMAX[V]+1; u += 8)
+      AccumulateMoments(plus + u, minus + u, u, m10, vsum);
+    m_10 += HorizontalSum(m10);
+    v_sum += HorizontalSum(vsum);
+#endif
+    for (; u <= UMAX[V]; ++u) {
+      int val_plus = plus[u], val_minus = minus[u];
       v_sum += (val_plus - val_minus);
       m_10 += u * (val_plus + val_minus);
     }
-    m_01 += v * v_sum;
+    m_01 += V * v_sum;
+  }
+};
+
+template <>
+struct PatchRows<0> {
+  static inline void Accumulate(const uchar* center, int, int &, int &m_10) {
+    // Treat the center line differently, v = 0
+    for (int u = -HALF_PATCH_SIZE; u <= HALF_PATCH_SIZE; ++u)
+      m_10 += u * center[u];
+  }
+};
+
+#if defined(__AVX2__)
+// Column weights of every row of the circular patch, for u = -15..16: u for m_10 and v for
+// m_01 inside the row, 0 outside (the last column is always outside)
+struct PatchWeights {
+  PatchWeights() {
+    for (int v = 0; v <= HALF_PATCH_SIZE; v++) {
+      for (int i = 0; i < 32; i++) {
+        const int u = i-HALF_PATCH_SIZE;
+        const bool inside = std::abs(u) <= UMAX[v];
+        wu[v][i] = inside ? u : 0;
+        wv[v][i] = inside ? v : 0;
+      }
+    }
+  }
+
+  alignas(32) int16_t wu[HALF_PATCH_SIZE+1][32];
+  alignas(32) int16_t wv[HALF_PATCH_SIZE+1][32];
+};
+
+static const PatchWeights kPatchWeights;
+
+static inline int HorizontalSum(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+// Weighted sum of 16 columns of both lines (sums for m_10, differences for m_01)
+static inline void AccumulateMoments(__m128i plus, __m128i minus, const int16_t *wu, const int16_t *wv,
+                                     __m256i &m10, __m256i &m01) {
+  const __m256i p = _mm256_cvtepu8_epi16(plus), m = _mm256_cvtepu8_epi16(minus);
+  m10 = _mm256_add_epi32(m10, _mm256_madd_epi16(_mm256_add_epi16(p, m), _mm256_load_si256((const __m256i*)wu)));
+  m01 = _mm256_add_epi32(m01, _mm256_madd_epi16(_mm256_sub_epi16(p, m), _mm256_load_si256((const __m256i*)wv)));
+}
+
+// Same moments as PatchRows, one whole row of 32 columns per step. Integer sums do not
+// depend on their order, so results are identical
+static inline void PatchMoments(const uchar* center, int step, int &m_01, int &m_10) {
+  __m256i m10 = _mm256_setzero_si256(), m01 = _mm256_setzero_si256();
+
+  // Center line has no mirrored line
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i row = _mm256_loadu_si256((const __m256i*)(center-HALF_PATCH_SIZE));
+  AccumulateMoments(_mm256_castsi256_si128(row), _mm256_castsi256_si128(zero),
+                    kPatchWeights.wu[0], kPatchWeights.wv[0], m10, m01);
+  AccumulateMoments(_mm256_extracti128_si256(row, 1), _mm256_castsi256_si128(zero),
+                    kPatchWeights.wu[0]+16, kPatchWeights.wv[0]+16, m10, m01);
+
+  for (int v = 1; v <= HALF_PATCH_SIZE; v++) {
+    const __m256i plus = _mm256_loadu_si256((const __m256i*)(center + v*step - HALF_PATCH_SIZE));
+    const __m256i minus = _mm256_loadu_si256((const __m256i*)(center - v*step - HALF_PATCH_SIZE));
+    AccumulateMoments(_mm256_castsi256_si128(plus), _mm256_castsi256_si128(minus),
+                      kPatchWeights.wu[v], kPatchWeights.wv[v], m10, m01);
+    AccumulateMoments(_mm256_extracti128_si256(plus, 1), _mm256_extracti128_si256(minus, 1),
+                      kPatchWeights.wu[v]+16, kPatchWeights.wv[v]+16, m10, m01);
   }
 
+  m_10 = HorizontalSum(m10);
+  m_01 = HorizontalSum(m01);
+}
+#endif
+
+static float IC_Angle(const Mat& image, Point2f pt) {
+  int m_01 = 0, m_10 = 0;
+
+  const uchar* center = &image.at<uchar> (cvRound(pt.y), cvRound(pt.x));
+
+  // Go line by line in the circular patch
+#if defined(__AVX2__)
+  PatchMoments(center, (int)image.step1(), m_01, m_10);
+#else
+  PatchRows<HALF_PATCH_SIZE>::Accumulate(center, (int)image.step1(), m_01, m_10);
+#endif
+
   return fastAtan2((float)m_01, (float)m_10);
 }
 
 
-const float factorPI = (float)(CV_PI/180.f);
-static void computeOrbDescriptor(const KeyPoint& kpt,
-                 const Mat& img, const Point* pattern,
-                 uchar* desc) {
-  float angle = (float)kpt.angle*factorPI;
-  float a = (float)cos(angle), b = (float)sin(angle);
+// Tests are sampled with the pattern rotated to the closest of ANGLE_BINS orientations, so
+// there is no trigonometry per keypoint. offsets has the first points of the 256 tests of
+// each bin followed by their second points, as image offsets from the keypoint
+static void computeOrbDescriptor(const KeyPoint& kpt, const Mat& img, const int* offsets, uchar* desc) {
+  int bin = cvRound(kpt.angle*(ORBextractor::ANGLE_BINS/360.f));
+  if (bin >= ORBextractor::ANGLE_BINS)
+    bin -= ORBextractor::ANGLE_BINS;
+  const int* a = offsets + bin*512;
+  const int* b = a + 256;
 
   const uchar* center = &img.at<uchar>(cvRound(kpt.pt.y), cvRound(kpt.pt.x));
-  const int step = (int)img.step;
-
-  #define GET_VALUE(idx) \
-    center[cvRound(pattern[idx].x*b + pattern[idx].y*a)*step + \
-         cvRound(pattern[idx].x*a - pattern[idx].y*b)]
-
-
-  for (int i = 0; i < 32; ++i, pattern += 16) {
-    int t0, t1, val;
-    t0 = GET_VALUE(0); t1 = GET_VALUE(1);
-    val = t0 < t1;
-    t0 = GET_VALUE(2); t1 = GET_VALUE(3);
-    val |= (t0 < t1) << 1;
-    t0 = GET_VALUE(4); t1 = GET_VALUE(5);
-    val |= (t0 < t1) << 2;
-    t0 = GET_VALUE(6); t1 = GET_VALUE(7);
-    val |= (t0 < t1) << 3;
-    t0 = GET_VALUE(8); t1 = GET_VALUE(9);
-    val |= (t0 < t1) << 4;
-    t0 = GET_VALUE(10); t1 = GET_VALUE(11);
-    val |= (t0 < t1) << 5;
-    t0 = GET_VALUE(12); t1 = GET_VALUE(13);
-    val |= (t0 < t1) << 6;
-    t0 = GET_VALUE(14); t1 = GET_VALUE(15);
-    val |= (t0 < t1) << 7;
 
-    desc[i] = (uchar)val;
+#if defined(__AVX2__)
+  // 8 tests per byte are gathered at once. Each pixel is read as the high byte of a 32 bit
+  // word, so no byte past the sampled one is touched
+  const int* base = reinterpret_cast<const int*>(center-3);
+  for (int i = 0; i < 32; ++i) {
+    const __m256i t0 = _mm256_srli_epi32(_mm256_i32gather_epi32(base, _mm256_loadu_si256((const __m256i*)(a+8*i)), 1), 24);
+    const __m256i t1 = _mm256_srli_epi32(_mm256_i32gather_epi32(base, _mm256_loadu_si256((const __m256i*)(b+8*i)), 1), 24);
+    desc[i] = (uchar)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(t1, t0)));
   }
+#else
+  for (int i = 0; i < 32; ++i, a += 8, b += 8) {
+    int val;
+    val = center[a[0]] < center[b[0]];
+    val |= (center[a[1]] < center[b[1]]) << 1;
+    val |= (center[a[2]] < center[b[2]]) << 2;
+    val |= (center[a[3]] < center[b[3]]) << 3;
+    val |= (center[a[4]] < center[b[4]]) << 4;
+    val |= (center[a[5]] < center[b[5]]) << 5;
+    val |= (center[a[6]] < center[b[6]]) << 6;
+    val |= (center[a[7]] < center[b[7]]) << 7;
 
-  #undef GET_VALUE
+    desc[i] = (uchar)val;
+  }
+#endif
 }
 
 
@@ -403,8 +528,76 @@ static int bit_pattern_31_[256*4] =
   -1,-6, 0,-11/*mean (0.127148), correlation (0.547401)*/
 };
 
-ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels, int _thFAST):
-  nfeatures(_nfeatures), scaleFactor(_scaleFactor), nlevels(_nlevels), thFAST(_thFAST) {
+#if CV_MAJOR_VERSION >= 3
+// Pyramid and blur through OpenCV transparent API, which runs them with OpenCL
+class OpenCLBackend : public ORBbackend {
+ public:
+  void ComputePyramid(const cv::Mat &image, const std::vector<float> &invScaleFactors, int border,
+                      std::vector<cv::Mat> &imagePyramid) override {
+    const int nlevels = invScaleFactors.size();
+    levels_.resize(nlevels);
+
+    // Frames keep the pyramid, so it goes to a new host buffer every time
+    vector<Size> sizes(nlevels);
+    for (int level = 0; level < nlevels; ++level) {
+      float scale = invScaleFactors[level];
+      sizes[level] = Size(cvRound((float)image.cols*scale), cvRound((float)image.rows*scale));
+    }
+    Mat buffer;
+    ORBextractor::AllocatePyramid(sizes, border, buffer, imagePyramid);
+
+    image.copyTo(levels_[0]);
+    for (int level = 0; level < nlevels; ++level) {
+      if (level != 0)
+        resize(levels_[level-1], levels_[level], sizes[level], 0, 0, INTER_LINEAR);
+
+      copyMakeBorder(levels_[level], bordered_, border, border, border, border, BORDER_REFLECT_101);
+
+      Mat whole = imagePyramid[level];
+      whole.adjustROI(border, border, border, border);
+      bordered_.copyTo(whole);
+    }
+  }
+
+  void BlurPyramid(const std::vector<cv::Mat> &imagePyramid, std::vector<cv::Mat> &blurred) override {
+    blurred.resize(imagePyramid.size());
+    for (size_t level = 0; level < imagePyramid.size(); ++level) {
+      imagePyramid[level].copyTo(src_);
+      GaussianBlur(src_, dst_, Size(7, 7), 2, 2, BORDER_REFLECT_101);
+      dst_.copyTo(blurred[level]);
+    }
+  }
+
+ private:
+  // Device buffers, reused between frames
+  std::vector<UMat> levels_;
+  UMat bordered_;
+  UMat src_;
+  UMat dst_;
+};
+#endif
+
+ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels, int _thFAST, ThreadPool* _pool,
+                           int _nthreads, int _backend):
+  mvRotatedPattern(RotatedPattern()), nfeatures(_nfeatures), scaleFactor(_scaleFactor), nlevels(_nlevels),
+  thFAST(_thFAST), mnNextOutput(0), mpThreadPool(nullptr), mnThreads(1), mpBackend(nullptr) {
+  if (_pool && _nthreads > 1) {
+    mpThreadPool = _pool;
+    mnThreads = _nthreads;
+  }
+
+  if (_backend == BACKEND_OPENCL) {
+#if CV_MAJOR_VERSION >= 3
+    if (cv::ocl::haveOpenCL()) {
+      cv::ocl::setUseOpenCL(true);
+      mpBackend = new OpenCLBackend();
+    }
+#endif
+    if (!mpBackend) {
+      LOGE("OpenCL is not available, ORB extraction runs on CPU");
+    }
+  }
+
   mvScaleFactor.resize(nlevels);
   mvLevelSigma2.resize(nlevels);
   mvScaleFactor[0]=1.0f;
@@ -420,46 +613,70 @@ ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels, int
     mvInvScaleFactor[i]=1.0f/mvScaleFactor[i];
     mvInvLevelSigma2[i]=1.0f/mvLevelSigma2[i];
   }
+  mpPyramid = std::make_shared<ScalePyramid>(nlevels, scaleFactor);
 
-  mnFeaturesPerLevel.resize(nlevels);
-  float factor = 1.0f / scaleFactor;
-  float nDesiredFeaturesPerScale = nfeatures*(1 - factor)/(1 - (float)pow((double)factor, (double)nlevels));
+  mnTargetFeatures = nfeatures;
+  mnFirstLevel = 0;
+  DistributeFeatures();
 
-  int sumFeatures = 0;
-  for ( int level = 0; level < nlevels-1; level++ ) {
-    mnFeaturesPerLevel[level] = cvRound(nDesiredFeaturesPerScale);
-    sumFeatures += mnFeaturesPerLevel[level];
-    nDesiredFeaturesPerScale *= factor;
-  }
-  mnFeaturesPerLevel[nlevels-1] = std::max(nfeatures - sumFeatures, 0);
+  mvLevelBuffers.resize(nlevels);
+  mvBlurredPyramid.resize(nlevels);
+
+}
+
+const vector<Point> &ORBextractor::RotatedPattern() {
+  // Rotate pattern for every angle bin, rounding as in cvRound. Computed once for all extractors
+  static const vector<Point> pattern = [] {
+    const Point* pattern0 = (const Point*)bit_pattern_31_;
+    vector<Point> rotatedPattern(ANGLE_BINS*512);
+    for (int bin = 0; bin < ANGLE_BINS; bin++) {
+      const float angle = bin*(float)(2*CV_PI/ANGLE_BINS);
+      const float a = cos(angle), b = sin(angle);
+      Point* rotated = &rotatedPattern[bin*512];
+      for (int i = 0; i < 256; i++) {
+        for (int j = 0; j < 2; j++) {
+          const Point &p = pattern0[2*i+j];
+          rotated[j*256+i] = Point(cvRound(p.x*a - p.y*b), cvRound(p.x*b + p.y*a));
+        }
+      }
+    }
+    return rotatedPattern;
+  }();
+  return pattern;
+}
 
-  const int npoints = 512;
-  const Point* pattern0 = (const Point*)bit_pattern_31_;
-  std::copy(pattern0, pattern0 + npoints, std::back_inserter(pattern));
+ORBextractor::~ORBextractor() {
+  if (mpBackend)
+    delete mpBackend;
+}
 
-  //This is for orientation
-  // pre-compute the end of a row in a circular patch
-  umax.resize(HALF_PATCH_SIZE + 1);
+// Buffer held only by its owner, so it can be written again
+static inline bool IsUnshared(const Mat &m) {
+  return m.u && m.u->refcount == 1;
+}
 
-  int v, v0, vmax = cvFloor(HALF_PATCH_SIZE * sqrt(2.f) / 2 + 1);
-  int vmin = cvCeil(HALF_PATCH_SIZE * sqrt(2.f) / 2);
-  const double hp2 = HALF_PATCH_SIZE*HALF_PATCH_SIZE;
-  for (v = 0; v <= vmax; ++v)
-    umax[v] = cvRound(sqrt(hp2 - v * v));
+ORBextractor::OutputBuffers &ORBextractor::AcquireOutputBuffers() {
+  for (size_t i = 0; i < mvOutputBuffers.size(); i++) {
+    OutputBuffers &out = mvOutputBuffers[i];
+    if ((out.descriptors.empty() || IsUnshared(out.descriptors)) &&
+        (out.pyramid.empty() || IsUnshared(out.pyramid)))
+      return out;
+  }
 
-  // Make sure we are symmetric
-  for (v = HALF_PATCH_SIZE, v0 = 0; v >= vmin; --v) {
-    while (umax[v0] == umax[v0 + 1])
-      ++v0;
-    umax[v] = v0;
-    ++v0;
+  if (mvOutputBuffers.size() < MAX_OUTPUT_BUFFERS) {
+    mvOutputBuffers.push_back(OutputBuffers());
+    return mvOutputBuffers.back();
   }
+
+  OutputBuffers &out = mvOutputBuffers[mnNextOutput];
+  mnNextOutput = (mnNextOutput+1)%mvOutputBuffers.size();
+  return out;
 }
 
-static void computeOrientation(const Mat& image, vector<KeyPoint>& keypoints, const vector<int>& umax) {
+static void computeOrientation(const Mat& image, vector<KeyPoint>& keypoints) {
   for (vector<KeyPoint>::iterator keypoint = keypoints.begin(),
      keypointEnd = keypoints.end(); keypoint != keypointEnd; ++keypoint) {
-    keypoint->angle = IC_Angle(image, keypoint->pt, umax);
+    keypoint->angle = IC_Angle(image, keypoint->pt);
   }
 }
 
@@ -467,169 +684,268 @@ void ORBextractor::ComputeKeyPoints(vector<std::vector<KeyPoint>> &allKeypoints,
   allKeypoints.resize(nlevels);
 
   float imageRatio = (float)imagePyramid[0].cols/imagePyramid[0].rows;
+  const int firstLevel = mnFirstLevel;
 
-  for (int level = 0; level < nlevels; ++level) {
-    const int nDesiredFeatures = mnFeaturesPerLevel[level];
-
-    const int levelCols = sqrt((float)nDesiredFeatures/(5*imageRatio));
-    const int levelRows = imageRatio*levelCols;
-
-    const int minBorderX = EDGE_THRESHOLD;
-    const int minBorderY = minBorderX;
-    const int maxBorderX = imagePyramid[level].cols-EDGE_THRESHOLD;
-    const int maxBorderY = imagePyramid[level].rows-EDGE_THRESHOLD;
-
-    const int W = maxBorderX - minBorderX;
-    const int H = maxBorderY - minBorderY;
-    const int cellW = ceil((float)W/levelCols);
-    const int cellH = ceil((float)H/levelRows);
-
-    const int nCells = levelRows*levelCols;
-    const int nfeaturesCell = ceil((float)nDesiredFeatures/nCells);
-
-    vector<vector<vector<KeyPoint> > > cellKeyPoints(levelRows, vector<vector<KeyPoint> >(levelCols));
-
-    vector<vector<int> > nToRetain(levelRows, vector<int>(levelCols, 0));
-    vector<vector<int> > nTotal(levelRows, vector<int>(levelCols, 0));
-    vector<vector<bool> > bNoMore(levelRows, vector<bool>(levelCols, false));
-    vector<int> iniXCol(levelCols);
-    vector<int> iniYRow(levelRows);
-    int nNoMore = 0;
-    int nToDistribute = 0;
+  // Levels are independent, each one writes only its own keypoints
+  ParallelFor(nlevels, [&](int level) {
+    if (level < firstLevel) {
+      allKeypoints[level].clear();
+      return;
+    }
 
+    const Mat mask = mvMaskPyramid.empty() ? Mat() : mvMaskPyramid[level];
+    ComputeKeyPointsLevel(level, imagePyramid[level], mask, imageRatio, allKeypoints[level]);
 
-    float hY = cellH + 6;
+    // and compute orientations
+    computeOrientation(imagePyramid[level], allKeypoints[level]);
 
-    for (int i = 0; i<levelRows; i++) {
-      const float iniY = minBorderY + i*cellH - 3;
-      iniYRow[i] = iniY;
+    // Blur the level for descriptors while it is still in cache. Border is isolated to
+    // ignore the pixels around the level view
+    if (!mpBackend && !allKeypoints[level].empty())
+      GaussianBlur(imagePyramid[level], mvBlurredPyramid[level], Size(7, 7), 2, 2,
+                   BORDER_REFLECT_101 | BORDER_ISOLATED);
+  });
+}
 
-      if (i == levelRows-1) {
-        hY = maxBorderY+3-iniY;
-        if (hY <= 0)
-          continue;
-      }
+void ORBextractor::ComputeKeyPointsLevel(int level, const cv::Mat &image, const cv::Mat &mask, float imageRatio,
+                                         vector<KeyPoint> &keypoints) {
+  const int nDesiredFeatures = mnFeaturesPerLevel[level];
 
-      float hX = cellW + 6;
+  const int levelCols = sqrt((float)nDesiredFeatures/(5*imageRatio));
+  const int levelRows = imageRatio*levelCols;
 
-      for (int j = 0; j < levelCols; j++) {
-        float iniX;
+  const int minBorderX = EDGE_THRESHOLD;
+  const int minBorderY = minBorderX;
+  const int maxBorderX = image.cols-EDGE_THRESHOLD;
+  const int maxBorderY = image.rows-EDGE_THRESHOLD;
 
-        if (i == 0) {
-          iniX = minBorderX + j*cellW - 3;
-          iniXCol[j] = iniX;
-        } else {
-          iniX = iniXCol[j];
-        }
+  const int W = maxBorderX - minBorderX;
+  const int H = maxBorderY - minBorderY;
+  const int cellW = ceil((float)W/levelCols);
+  const int cellH = ceil((float)H/levelRows);
 
+  const int nCells = levelRows*levelCols;
+  const int nfeaturesCell = ceil((float)nDesiredFeatures/nCells);
 
-        if (j == levelCols-1) {
-          hX = maxBorderX+3-iniX;
-          if (hX <= 0)
-            continue;
-        }
+  // Buffers are kept between extractions, so nothing is allocated once they are warm
+  LevelBuffers &buffers = mvLevelBuffers[level];
+  buffers.rows.resize(levelRows);
 
-        Mat cellImage = imagePyramid[level].rowRange(iniY, iniY+hY).colRange(iniX, iniX+hX);
+  // Extract FAST once per row of cells, over the whole width. Each row only writes its own
+  // buffer. Corners are in level coordinates
+  auto detectRow = [&](int i) {
+    vector<KeyPoint> &rowKeys = buffers.rows[i];
+    rowKeys.clear();
 
-        cellKeyPoints[i][j].reserve(nfeaturesCell*5);
+    const int iniY = minBorderY + i*cellH - 3;
+    const int iniX = minBorderX - 3;
+    int hY = cellH + 6;
 
-        FAST(cellImage, cellKeyPoints[i][j], thFAST, true);
+    if (i == levelRows-1) {
+      hY = maxBorderY+3-iniY;
+      if (hY <= 0)
+        return;
+    }
 
-        const int nKeys = cellKeyPoints[i][j].size();
-        nTotal[i][j] = nKeys;
+    // Rows fully masked are not searched
+    if (!mask.empty() && countNonZero(mask.rowRange(iniY, iniY+hY).colRange(iniX, maxBorderX+3)) == 0)
+      return;
 
-        if (nKeys>nfeaturesCell) {
-          nToRetain[i][j] = nfeaturesCell;
-          bNoMore[i][j] = false;
-        } else {
-          nToRetain[i][j] = nKeys;
-          nToDistribute += nfeaturesCell-nKeys;
-          bNoMore[i][j] = true;
-          nNoMore++;
-        }
+    Mat rowImage = image.rowRange(iniY, iniY+hY).colRange(iniX, maxBorderX+3);
+    FAST(rowImage, rowKeys, thFAST, true);
 
-      }
+    for (size_t k = 0, kend = rowKeys.size(); k < kend; k++) {
+      rowKeys[k].pt.x += iniX;
+      rowKeys[k].pt.y += iniY;
     }
 
-    // Retain by score
-
-    while (nToDistribute > 0 && nNoMore<nCells) {
-      int nNewFeaturesCell = nfeaturesCell + ceil((float)nToDistribute/(nCells-nNoMore));
-      nToDistribute = 0;
-
-      for (int i = 0; i<levelRows; i++) {
-        for (int j = 0; j < levelCols; j++) {
-          if (!bNoMore[i][j]) {
-            if (nTotal[i][j]>nNewFeaturesCell) {
-              nToRetain[i][j] = nNewFeaturesCell;
-              bNoMore[i][j] = false;
-            } else {
-              nToRetain[i][j] = nTotal[i][j];
-              nToDistribute += nNewFeaturesCell-nTotal[i][j];
-              bNoMore[i][j] = true;
-              nNoMore++;
-            }
-          }
-        }
-      }
+    // Masked corners are dropped before budgeting, so they take no share of it
+    if (!mask.empty()) {
+      rowKeys.erase(std::remove_if(rowKeys.begin(), rowKeys.end(), [&mask](const KeyPoint &kp) {
+        return mask.at<uchar>(static_cast<int>(kp.pt.y), static_cast<int>(kp.pt.x)) == 0;
+      }), rowKeys.end());
     }
+  };
+
+  // Only the finest level is worth splitting
+  if (level == 0) {
+    ParallelFor(levelRows, detectRow);
+  } else {
+    for (int i = 0; i < levelRows; i++)
+      detectRow(i);
+  }
+
+  // Bucket corners into a flat array sorted by cell (counting sort)
+  auto cellOf = [&](int i, const KeyPoint &kp) {
+    return i*levelCols + std::min(static_cast<int>((kp.pt.x-minBorderX)/cellW), levelCols-1);
+  };
+
+  buffers.start.assign(nCells+1, 0);
+  for (int i = 0; i < levelRows; i++) {
+    for (const KeyPoint &kp : buffers.rows[i])
+      buffers.start[cellOf(i, kp)+1]++;
+  }
+  for (int c = 0; c < nCells; c++)
+    buffers.start[c+1] += buffers.start[c];
+
+  buffers.cells.resize(buffers.start[nCells]);
+  buffers.next.assign(buffers.start.begin(), buffers.start.end()-1);
+  for (int i = 0; i < levelRows; i++) {
+    for (const KeyPoint &kp : buffers.rows[i])
+      buffers.cells[buffers.next[cellOf(i, kp)]++] = kp;
+  }
 
-    vector<KeyPoint> & keypoints = allKeypoints[level];
-    keypoints.reserve(nDesiredFeatures*2);
+  // Split the budget in a single pass over cells sorted by number of corners: cells with
+  // few corners keep all of them and their share goes to the remaining cells
+  buffers.order.resize(nCells);
+  for (int c = 0; c < nCells; c++)
+    buffers.order[c] = c;
+  std::sort(buffers.order.begin(), buffers.order.end(), [&](int c1, int c2) {
+    const int n1 = buffers.start[c1+1]-buffers.start[c1], n2 = buffers.start[c2+1]-buffers.start[c2];
+    return n1 < n2 || (n1 == n2 && c1 < c2);
+  });
+
+  buffers.retain.resize(nCells);
+  int nRemaining = nfeaturesCell*nCells;
+  for (int k = 0; k < nCells; k++) {
+    const int c = buffers.order[k];
+    const int nCellsLeft = nCells-k;
+    const int quota = (nRemaining+nCellsLeft-1)/nCellsLeft;
+    buffers.retain[c] = std::min(buffers.start[c+1]-buffers.start[c], quota);
+    nRemaining -= buffers.retain[c];
+  }
 
-    const int scaledPatchSize = PATCH_SIZE*mvScaleFactor[level];
+  // Retain by score
+  auto betterResponse = [](const KeyPoint &k1, const KeyPoint &k2) { return k1.response > k2.response; };
+  const int scaledPatchSize = PATCH_SIZE*mvScaleFactor[level];
 
-    // Retain by score and transform coordinates
-    for (int i = 0; i<levelRows; i++) {
-      for (int j = 0; j < levelCols; j++) {
-        vector<KeyPoint> &keysCell = cellKeyPoints[i][j];
-        KeyPointsFilter::retainBest(keysCell,nToRetain[i][j]);
-        if ((int)keysCell.size()>nToRetain[i][j])
-          keysCell.resize(nToRetain[i][j]);
+  keypoints.clear();
+  keypoints.reserve(nDesiredFeatures*2);
 
+  for (int c = 0; c < nCells; c++) {
+    vector<KeyPoint>::iterator first = buffers.cells.begin()+buffers.start[c];
+    vector<KeyPoint>::iterator last = buffers.cells.begin()+buffers.start[c+1];
+    const int nRetain = buffers.retain[c];
+    if (last-first > nRetain)
+      std::nth_element(first, first+nRetain, last, betterResponse);
 
-        for (size_t k = 0, kend=keysCell.size(); k<kend; k++) {
-          keysCell[k].pt.x+=iniXCol[j];
-          keysCell[k].pt.y+=iniYRow[i];
-          keysCell[k].octave=level;
-          keysCell[k].size = scaledPatchSize;
-          keypoints.push_back(keysCell[k]);
-        }
-      }
+    for (vector<KeyPoint>::iterator it = first; it != first+nRetain; ++it) {
+      keypoints.push_back(*it);
+      keypoints.back().octave = level;
+      keypoints.back().size = scaledPatchSize;
     }
+  }
 
-    if ((int)keypoints.size()>nDesiredFeatures) {
-      KeyPointsFilter::retainBest(keypoints,nDesiredFeatures);
-      keypoints.resize(nDesiredFeatures);
-    }
+  if ((int)keypoints.size()>nDesiredFeatures) {
+    std::nth_element(keypoints.begin(), keypoints.begin()+nDesiredFeatures, keypoints.end(), betterResponse);
+    keypoints.resize(nDesiredFeatures);
   }
+}
 
-  // and compute orientations
-  for (int level = 0; level < nlevels; ++level)
-    computeOrientation(imagePyramid[level], allKeypoints[level], umax);
+void ORBextractor::ParallelFor(int n, const std::function<void(int)> &f) {
+  if (mpThreadPool) {
+    mpThreadPool->ParallelFor(n, f, mnThreads);
+  } else {
+    for (int i = 0; i < n; i++)
+      f(i);
+  }
 }
 
 static void computeDescriptors(const Mat& image, vector<KeyPoint>& keypoints, Mat& descriptors,
-                 const vector<Point>& pattern) {
+                 const int* offsets) {
   descriptors = Mat::zeros((int)keypoints.size(), 32, CV_8UC1);
 
   for (size_t i = 0; i < keypoints.size(); i++)
-    computeOrbDescriptor(keypoints[i], image, &pattern[0], descriptors.ptr((int)i));
+    computeOrbDescriptor(keypoints[i], image, offsets, descriptors.ptr((int)i));
+}
+
+void ORBextractor::SetNumFeatures(int n) {
+  mnTargetFeatures = std::max(n, nlevels);
+}
+
+void ORBextractor::SetFirstLevel(int level) {
+  mnFirstLevel = std::min(std::max(level, 0), nlevels-1);
+}
+
+void ORBextractor::SetMask(const cv::Mat &mask) {
+  mvStaticMaskPyramid.clear();
+  if (!mask.empty())
+    ComputeMaskPyramid(mask.clone(), mvStaticMaskPyramid);
+}
+
+void ORBextractor::ComputeMaskPyramid(const cv::Mat &mask, vector<cv::Mat> &maskPyramid) {
+  assert(mask.type() == CV_8UC1);
+
+  // Same level sizes as ComputePyramid, nearest pixel keeps the mask binary
+  maskPyramid.resize(nlevels);
+  maskPyramid[0] = mask;
+  for (int level = 1; level < nlevels; ++level) {
+    float scale = mvInvScaleFactor[level];
+    Size sz(cvRound((float)mask.cols*scale), cvRound((float)mask.rows*scale));
+    resize(mask, maskPyramid[level], sz, 0, 0, INTER_NEAREST);
+  }
+}
+
+void ORBextractor::DistributeFeatures() {
+  mnFeaturesPerLevel.resize(nlevels);
+  float factor = 1.0f / scaleFactor;
+  float nDesiredFeaturesPerScale = nfeatures*(1 - factor)/(1 - (float)pow((double)factor, (double)nlevels));
+
+  int sumFeatures = 0;
+  for ( int level = 0; level < nlevels-1; level++ ) {
+    mnFeaturesPerLevel[level] = cvRound(nDesiredFeaturesPerScale);
+    sumFeatures += mnFeaturesPerLevel[level];
+    nDesiredFeaturesPerScale *= factor;
+  }
+  mnFeaturesPerLevel[nlevels-1] = std::max(nfeatures - sumFeatures, 0);
 }
 
 void ORBextractor::operator()(InputArray _image, InputArray _mask, vector<KeyPoint>& _keypoints,
-                              OutputArray _descriptors, vector<cv::Mat> &imagePyramid) {
+                              cv::Mat &_descriptors, vector<cv::Mat> &imagePyramid) {
   if (_image.empty())
     return;
 
+  // Apply new budget between extractions, never while levels are processed
+  int target = mnTargetFeatures;
+  if (target != nfeatures) {
+    nfeatures = target;
+    DistributeFeatures();
+  }
+
   Mat image = _image.getMat();
   assert(image.type() == CV_8UC1 );
 
+  // Image mask is combined with the static one at level 0, static pyramid is reused otherwise
+  Mat mask = _mask.getMat();
+  if (!mask.empty() && mask.size() != image.size()) {
+    LOGE("Mask size does not match image, it is ignored");
+    mask.release();
+  }
+  if (!mvStaticMaskPyramid.empty() && mvStaticMaskPyramid[0].size() != image.size()) {
+    LOGE("Static mask size does not match image, it is ignored");
+    mvStaticMaskPyramid.clear();
+  }
+
+  if (mask.empty()) {
+    mvMaskPyramid = mvStaticMaskPyramid;
+  } else {
+    if (!mvStaticMaskPyramid.empty()) {
+      Mat combined;
+      bitwise_and(mask, mvStaticMaskPyramid[0], combined);
+      mask = combined;
+    }
+    ComputeMaskPyramid(mask, mvMaskPyramid);
+  }
+
   // Pre-compute the scale pyramid
+  OutputBuffers &out = AcquireOutputBuffers();
   imagePyramid.resize(nlevels);
-  ComputePyramid(image, imagePyramid);
+  if (mpBackend)
+    mpBackend->ComputePyramid(image, mvInvScaleFactor, EDGE_THRESHOLD, imagePyramid);
+  else
+    ComputePyramid(image, out.pyramid, imagePyramid);
 
-  vector < vector<KeyPoint> > allKeypoints;
+  vector<vector<KeyPoint> > &allKeypoints = mvAllKeypoints;
   ComputeKeyPoints(allKeypoints, imagePyramid);
 
   Mat descriptors;
@@ -637,33 +953,46 @@ void ORBextractor::operator()(InputArray _image, InputArray _mask, vector<KeyPoi
   int nkeypoints = 0;
   for (int level = 0; level < nlevels; ++level)
     nkeypoints += (int)allKeypoints[level].size();
-  if ( nkeypoints == 0 )
-    _descriptors.release();
-  else {
-    _descriptors.create(nkeypoints, 32, CV_8U);
-    descriptors = _descriptors.getMat();
-  }
+  // Rows of the slot block if it is large enough and no frame or keyframe still holds it,
+  // else a new block with room for the requested features
+  if (nkeypoints > 0 && (!IsUnshared(out.descriptors) || out.descriptors.rows < nkeypoints))
+    out.descriptors = FeatureTable::AllocateDescriptors(std::max(nkeypoints, nfeatures));
+  _descriptors = nkeypoints > 0 ? out.descriptors.rowRange(0, nkeypoints) : Mat();
+  descriptors = _descriptors;
 
   _keypoints.clear();
   _keypoints.reserve(nkeypoints);
 
-  int offset = 0;
-  for (int level = 0; level < nlevels; ++level) {
+  vector<int> offsets(nlevels, 0);
+  for (int level = 1; level < nlevels; ++level)
+    offsets[level] = offsets[level-1] + (int)allKeypoints[level-1].size();
+
+  // Blur all levels at once when offloaded, CPU levels were blurred with keypoints
+  if (mpBackend && nkeypoints > 0)
+    mpBackend->BlurPyramid(imagePyramid, mvBlurredPyramid);
+
+  // Each level writes its own descriptor rows
+  ParallelFor(nlevels, [&](int level) {
     vector<KeyPoint>& keypoints = allKeypoints[level];
     int nkeypointsLevel = (int)keypoints.size();
 
     if (nkeypointsLevel == 0)
-      continue;
-
-    // preprocess the resized image
-    Mat workingMat = imagePyramid[level].clone();
-    GaussianBlur(workingMat, workingMat, Size(7, 7), 2, 2, BORDER_REFLECT_101);
+      return;
 
     // Compute the descriptors
-    Mat desc = descriptors.rowRange(offset, offset + nkeypointsLevel);
-    computeDescriptors(workingMat, keypoints, desc, pattern);
+    Mat desc = descriptors.rowRange(offsets[level], offsets[level] + nkeypointsLevel);
+    // Pattern offsets only change with the image step
+    const Mat &image = mvBlurredPyramid[level];
+    LevelBuffers &buffers = mvLevelBuffers[level];
+    const int step = (int)image.step;
+    if (buffers.step != step) {
+      buffers.offsets.resize(mvRotatedPattern.size());
+      for (size_t i = 0; i < mvRotatedPattern.size(); i++)
+        buffers.offsets[i] = mvRotatedPattern[i].y*step + mvRotatedPattern[i].x;
+      buffers.step = step;
+    }
 
-    offset += nkeypointsLevel;
+    computeDescriptors(image, keypoints, desc, buffers.offsets.data());
 
     // Scale keypoint coordinates
     if (level != 0) {
@@ -672,18 +1001,25 @@ void ORBextractor::operator()(InputArray _image, InputArray _mask, vector<KeyPoi
          keypointEnd = keypoints.end(); keypoint != keypointEnd; ++keypoint)
         keypoint->pt *= scale;
     }
-    // And add the keypoints to the output
-    _keypoints.insert(_keypoints.end(), keypoints.begin(), keypoints.end());
-  }
+  });
+
+  // And add the keypoints to the output
+  for (int level = 0; level < nlevels; ++level)
+    _keypoints.insert(_keypoints.end(), allKeypoints[level].begin(), allKeypoints[level].end());
 }
 
-void ORBextractor::ComputePyramid(cv::Mat image, vector<cv::Mat> &imagePyramid) {
+void ORBextractor::ComputePyramid(cv::Mat image, cv::Mat &buffer, vector<cv::Mat> &imagePyramid) {
+  vector<Size> sizes(nlevels);
   for (int level = 0; level < nlevels; ++level) {
     float scale = mvInvScaleFactor[level];
-    Size sz(cvRound((float)image.cols*scale), cvRound((float)image.rows*scale));
-    Size wholeSize(sz.width + EDGE_THRESHOLD*2, sz.height + EDGE_THRESHOLD*2);
-    Mat temp(wholeSize, image.type()), masktemp;
-    imagePyramid[level] = temp(Rect(EDGE_THRESHOLD, EDGE_THRESHOLD, sz.width, sz.height));
+    sizes[level] = Size(cvRound((float)image.cols*scale), cvRound((float)image.rows*scale));
+  }
+  AllocatePyramid(sizes, EDGE_THRESHOLD, buffer, imagePyramid);
+
+  for (int level = 0; level < nlevels; ++level) {
+    const Size &sz = sizes[level];
+    Mat temp = imagePyramid[level];
+    temp.adjustROI(EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD);
 
     // Compute the resized image
     if ( level != 0 ) {
@@ -696,7 +1032,81 @@ void ORBextractor::ComputePyramid(cv::Mat image, vector<cv::Mat> &imagePyramid)
                BORDER_REFLECT_101);
     }
   }
+}
+
+void ORBextractor::AllocatePyramid(const vector<Size> &sizes, int border, Mat &buffer, vector<Mat> &levels) {
+  // Shelf packing: levels get smaller, each one goes to the first shelf with room left. With
+  // usual scale factors the buffer is about 15% larger than the levels. Levels start at 16 bytes
+  struct Shelf {
+    int y, height, x;
+  };
+  const int ALIGN = 16;
+  const int n = sizes.size();
+  vector<Shelf> shelves;
+  vector<Rect> rects(n);
+  int width = 0, height = 0;
+  for (int i = 0; i < n; i++) {
+    const int w = sizes[i].width + 2*border;
+    const int h = sizes[i].height + 2*border;
+    width = std::max(width, (w+63)/64*64);
+
+    size_t s = 0;
+    while (s < shelves.size() && (shelves[s].height < h || shelves[s].x+w > width))
+      s++;
+    if (s == shelves.size()) {
+      shelves.push_back({height, h, 0});
+      height += h;
+    }
+
+    rects[i] = Rect(shelves[s].x+border, shelves[s].y+border, sizes[i].width, sizes[i].height);
+    shelves[s].x += (w+ALIGN-1)/ALIGN*ALIGN;
+  }
+
+  // Views of the last pyramid are being replaced, they don't count as holders
+  levels.assign(n, Mat());
+  if (!IsUnshared(buffer) || buffer.rows != height || buffer.cols != width || buffer.type() != CV_8U)
+    buffer = Mat(height, width, CV_8U);
+
+  for (int i = 0; i < n; i++)
+    levels[i] = buffer(rects[i]);
+}
+
+void ORBextractor::ReleaseLevels(vector<Mat> &pyramid, int first) {
+  const int n = pyramid.size();
+  first = std::min(std::max(first, 0), n);
+
+  bool shared = false;
+  for (int i = 0; i < first; i++) {
+    for (int j = first; j < n && !shared; j++)
+      shared = pyramid[i].u && pyramid[i].u == pyramid[j].u;
+    pyramid[i].release();
+  }
 
+  if (!shared)
+    return;
+
+  // Copy remaining levels with the border all of them have
+  int border = EDGE_THRESHOLD;
+  vector<Size> sizes;
+  for (int i = first; i < n; i++) {
+    Size whole;
+    Point ofs;
+    pyramid[i].locateROI(whole, ofs);
+    border = std::min(border, std::min(std::min(ofs.x, ofs.y), std::min(whole.width-ofs.x-pyramid[i].cols,
+                                                                         whole.height-ofs.y-pyramid[i].rows)));
+    sizes.push_back(pyramid[i].size());
+  }
+
+  Mat buffer;
+  vector<Mat> levels;
+  AllocatePyramid(sizes, border, buffer, levels);
+  for (int i = first; i < n; i++) {
+    Mat src = pyramid[i], dst = levels[i-first];
+    src.adjustROI(border, border, border, border);
+    dst.adjustROI(border, border, border, border);
+    src.copyTo(dst);
+    pyramid[i] = dst(Rect(border, border, sizes[i-first].width, sizes[i-first].height));
+  }
 }
 
 }  // namespace SD_SLAM
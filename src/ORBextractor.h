@@ -27,23 +27,80 @@
 
 #include <vector>
 #include <list>
+#include <functional>
+#include <atomic>
+#include <memory>
 #include <opencv/cv.h>
+#include "extra/thread_pool.h"
+#include "extra/scale_levels.h"
 
 namespace SD_SLAM {
 
+// Image processing stages of the extractor that can be offloaded to an accelerator.
+// FAST selection per cell, orientation and descriptors always run on the CPU from
+// these images, so every backend gives the same keypoint distribution.
+class ORBbackend {
+ public:
+  virtual ~ORBbackend() {}
+
+  // Compute the scale pyramid. Levels are views of images with a border of border pixels
+  virtual void ComputePyramid(const cv::Mat &image, const std::vector<float> &invScaleFactors, int border,
+                              std::vector<cv::Mat> &imagePyramid) = 0;
+
+  // Gaussian blurred copy of each level, used to compute descriptors
+  virtual void BlurPyramid(const std::vector<cv::Mat> &imagePyramid, std::vector<cv::Mat> &blurred) = 0;
+};
+
 class ORBextractor {
  public:
   enum {HARRIS_SCORE = 0, FAST_SCORE=1 };
+  enum {BACKEND_CPU = 0, BACKEND_OPENCL = 1};
+
+  // Orientations of the precomputed descriptor patterns (12 degrees each)
+  static const int ANGLE_BINS = 30;
 
-  ORBextractor(int nfeatures, float scaleFactor, int nlevels, int thFAST);
+  // If nthreads > 1, pyramid levels and level 0 cells are processed in parallel.
+  // Results are identical to the serial path.
+  // If the requested backend is not available, the CPU is used.
+  ORBextractor(int nfeatures, float scaleFactor, int nlevels, int thFAST, ThreadPool* pool = nullptr, int nthreads = 1,
+               int backend = BACKEND_CPU);
 
-  ~ORBextractor(){}
+  ~ORBextractor();
 
   // Compute the ORB features and descriptors on an image.
   // ORB are dispersed on the image using an octree.
-  // Mask is ignored in the current implementation.
+  // If mask is not empty (CV_8U, image size), features are only extracted where it and the
+  // static mask are not zero. Cells left without corners give their share of features to the rest.
+  // Descriptors are a new contiguous block with rows aligned to 32 bytes (see FeatureTable).
   void operator()(cv::InputArray image, cv::InputArray mask, std::vector<cv::KeyPoint>& keypoints,
-                  cv::OutputArray descriptors, std::vector<cv::Mat> &imagePyramid);
+                  cv::Mat &descriptors, std::vector<cv::Mat> &imagePyramid);
+
+  // Change the number of features extracted per image. It can be called from any thread,
+  // it takes effect in the next extraction. Features per level keep the same distribution.
+  void SetNumFeatures(int n);
+
+  // Skip keypoint extraction in levels finer than level (0 extracts all of them). It can be
+  // called from any thread, it takes effect in the next extraction. The pyramid is still
+  // computed at full resolution
+  void SetFirstLevel(int level);
+
+  // Mask applied to every image (see operator()), e.g. parts of the robot seen by the camera.
+  // Empty disables it. It must not be called during an extraction
+  void SetMask(const cv::Mat &mask);
+
+  // Allocate the levels of a pyramid (sizes without border) in one buffer, each one with
+  // border pixels around it, so the whole pyramid is a single allocation. Levels are views of
+  // buffer, which is reused if its layout matches and nothing else holds it
+  static void AllocatePyramid(const std::vector<cv::Size> &sizes, int border, cv::Mat &buffer,
+                              std::vector<cv::Mat> &levels);
+
+  // Release levels of pyramid finer than first. Levels left that share a buffer with released
+  // ones are copied (with their border) to a buffer of their own, so that memory is freed
+  static void ReleaseLevels(std::vector<cv::Mat> &pyramid, int first);
+
+  int inline GetNumFeatures() {
+    return mnTargetFeatures;
+  }
 
   int inline GetLevels() {
     return nlevels;
@@ -69,10 +126,54 @@ class ORBextractor {
     return mvInvLevelSigma2;
   }
 
+  // Scale info referenced by frames
+  inline const std::shared_ptr<const ScalePyramid> &GetPyramid() const {
+    return mpPyramid;
+  }
+
+  // Thread pool used to parallelize extraction, null if serial
+  inline ThreadPool* GetThreadPool() {
+    return mpThreadPool;
+  }
+
+  // Max number of pool threads used at once
+  inline int GetThreads() const {
+    return mnThreads;
+  }
+
  protected:
-  void ComputePyramid(cv::Mat image, std::vector<cv::Mat> &imagePyramid);
+  // Split nfeatures among levels, decreasing with the scale factor
+  void DistributeFeatures();
+
+  // Levels are views of buffer (see AllocatePyramid) with a border of EDGE_THRESHOLD pixels
+  void ComputePyramid(cv::Mat image, cv::Mat &buffer, std::vector<cv::Mat> &imagePyramid);
   void ComputeKeyPoints(std::vector<std::vector<cv::KeyPoint> >& allKeypoints, std::vector<cv::Mat> &imagePyramid);
-  std::vector<cv::Point> pattern;
+  void ComputeKeyPointsLevel(int level, const cv::Mat &image, const cv::Mat &mask, float imageRatio,
+                             std::vector<cv::KeyPoint> &keypoints);
+
+  // Scale mask (level 0) to every level of maskPyramid
+  void ComputeMaskPyramid(const cv::Mat &mask, std::vector<cv::Mat> &maskPyramid);
+
+  // Run f(i) for i in [0, n), in parallel if a thread pool is available
+  void ParallelFor(int n, const std::function<void(int)> &f);
+
+  // Keypoint selection buffers of a level, reused between extractions
+  struct LevelBuffers {
+    LevelBuffers(): step(0) {}
+    std::vector<std::vector<cv::KeyPoint> > rows;   // FAST corners of each row of cells
+    std::vector<cv::KeyPoint> cells;                // Corners sorted by cell
+    std::vector<int> start;                         // First corner of each cell in cells
+    std::vector<int> next;
+    std::vector<int> order;                         // Cells sorted by number of corners
+    std::vector<int> retain;                        // Corners retained in each cell
+    std::vector<int> offsets;                       // mvRotatedPattern as offsets for step
+    int step;
+  };
+
+  // BRIEF pattern rotated for each angle bin, with the first points of the 256 tests
+  // followed by their second points. Shared by all extractors
+  static const std::vector<cv::Point> &RotatedPattern();
+  const std::vector<cv::Point> &mvRotatedPattern;
 
   int nfeatures;
   double scaleFactor;
@@ -81,12 +182,52 @@ class ORBextractor {
 
   std::vector<int> mnFeaturesPerLevel;
 
-  std::vector<int> umax;
+  // Requested number of features, applied at next extraction
+  std::atomic<int> mnTargetFeatures;
+
+  // First level with keypoints
+  std::atomic<int> mnFirstLevel;
 
   std::vector<float> mvScaleFactor;
   std::vector<float> mvInvScaleFactor;
   std::vector<float> mvLevelSigma2;
   std::vector<float> mvInvLevelSigma2;
+  std::shared_ptr<const ScalePyramid> mpPyramid;
+
+  std::vector<LevelBuffers> mvLevelBuffers;
+
+  // Blurred levels used for descriptors, only valid during an extraction. Buffers are reused
+  std::vector<cv::Mat> mvBlurredPyramid;
+
+  // Bordered pyramid levels and descriptor rows handed out by recent extractions. Frames and
+  // keyframes share them, a slot is reused once no one else holds its buffers
+  struct OutputBuffers {
+    cv::Mat pyramid;
+    cv::Mat descriptors;
+  };
+  static const size_t MAX_OUTPUT_BUFFERS = 4;
+
+  // Slot for next extraction: a free one, a new one or the oldest one, whose shared buffers are
+  // replaced when used
+  OutputBuffers &AcquireOutputBuffers();
+
+  std::vector<OutputBuffers> mvOutputBuffers;
+  size_t mnNextOutput;
+
+  // Keypoints of each level, only valid during an extraction. Buffers are reused
+  std::vector<std::vector<cv::KeyPoint> > mvAllKeypoints;
+
+  // Static mask of each level, empty if not set. Mask of each level used by current
+  // extraction, static one combined with the image one
+  std::vector<cv::Mat> mvStaticMaskPyramid;
+  std::vector<cv::Mat> mvMaskPyramid;
+
+  // Shared thread pool (not owned), null if serial
+  ThreadPool* mpThreadPool;
+  int mnThreads;
+
+  // Accelerated image stages, null for the CPU path
+  ORBbackend* mpBackend;
 };
 
 }  // namespace SD_SLAM
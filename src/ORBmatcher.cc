@@ -26,8 +26,15 @@
 #include <limits.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/features2d/features2d.hpp>
-#include <stdint-gcc.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 #include "extra/timer.h"
+#include "extra/scratch_arena.h"
 
 using namespace std;
 
@@ -35,39 +42,315 @@ namespace SD_SLAM {
 
 const int ORBmatcher::TH_HIGH = 100;
 const int ORBmatcher::TH_LOW = 50;
-const int ORBmatcher::HISTO_LENGTH = 30;
+const int ORBmatcher::HISTO_LENGTH = RotationHistogram::LENGTH;
 
-ORBmatcher::ORBmatcher(float nnratio, bool checkOri): mfNNratio(nnratio), mbCheckOrientation(checkOri) {
+const int RotationHistogram::LENGTH;
+
+RotationHistogram &RotationHistogram::Workspace() {
+  static thread_local RotationHistogram histogram;
+  histogram.Clear();
+  return histogram;
+}
+
+RotationHistogram::RotationHistogram() {
+  entries_.reserve(500);
+  Clear();
+}
+
+void RotationHistogram::Clear() {
+  std::fill(counts_, counts_+LENGTH, 0);
+  entries_.clear();
+}
+
+void RotationHistogram::Add(float rot, int idx) {
+  const float factor = 1.0f/LENGTH;
+  if (rot < 0.0)
+    rot+=360.0f;
+  int bin = round(rot*factor);
+  if (bin==LENGTH)
+    bin = 0;
+  assert(bin >= 0 && bin<LENGTH);
+
+  counts_[bin]++;
+  entries_.push_back(Entry{bin, idx});
+}
+
+void RotationHistogram::ComputeThreeMaxima(int &ind1, int &ind2, int &ind3) const {
+  int max1 = 0;
+  int max2 = 0;
+  int max3 = 0;
+  ind1 = ind2 = ind3 = -1;
+
+  for (int i = 0; i<LENGTH; i++) {
+    const int s = counts_[i];
+    if (s>max1) {
+      max3 = max2;
+      max2 = max1;
+      max1 = s;
+      ind3=ind2;
+      ind2=ind1;
+      ind1=i;
+    } else if (s>max2) {
+      max3 = max2;
+      max2 = s;
+      ind3=ind2;
+      ind2=i;
+    } else if (s>max3) {
+      max3 = s;
+      ind3=i;
+    }
+  }
+
+  if (max2 < 0.1f*(float)max1) {
+    ind2=-1;
+    ind3=-1;
+  } else if (max3 < 0.1f*(float)max1) {
+    ind3=-1;
+  }
+}
+
+// Hamming distance between two 256 bit descriptors. bAligned tells b is 32-byte aligned
+static inline int HammingDistance(const uchar *a, const uchar *b, bool bAligned = false) {
+#if defined(__AVX512VPOPCNTDQ__) && defined(__AVX512VL__)
+  __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+  __m256i vb = bAligned ? _mm256_load_si256(reinterpret_cast<const __m256i*>(b)) :
+                         _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+  __m256i cnt = _mm256_popcnt_epi64(_mm256_xor_si256(va, vb));
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1));
+  return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+#elif defined(__AVX2__)
+  // Nibble lookup popcount, summed with SAD
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+  __m256i vb = bAligned ? _mm256_load_si256(reinterpret_cast<const __m256i*>(b)) :
+                         _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+  __m256i v = _mm256_xor_si256(va, vb);
+  __m256i lo = _mm256_and_si256(v, low_mask);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+  __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+  cnt = _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1));
+  return _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint8x16_t c0 = vcntq_u8(veorq_u8(vld1q_u8(a), vld1q_u8(b)));
+  uint8x16_t c1 = vcntq_u8(veorq_u8(vld1q_u8(a+16), vld1q_u8(b+16)));
+  uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vaddq_u8(c0, c1))));
+  return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#else
+  uint64_t va, vb;
+  int dist = 0;
+  for (int i = 0; i < 32; i += 8) {
+    memcpy(&va, a+i, 8);
+    memcpy(&vb, b+i, 8);
+    dist += __builtin_popcountll(va ^ vb);
+  }
+  return dist;
+#endif
+}
+
+const size_t ORBmatcher::PARALLEL_BLOCK = 64;
+
+ORBmatcher::ORBmatcher(float nnratio, bool checkOri): mfNNratio(nnratio), mbCheckOrientation(checkOri),
+  mpThreadPool(nullptr), mnThreads(1) {
+}
+
+void ORBmatcher::SetThreadPool(ThreadPool* pool, int nThreads) {
+  mpThreadPool = pool;
+  mnThreads = nThreads;
 }
 
 int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoints, const float th) {
   int nmatches = 0;
 
-  const bool bFactor = th!=1.0;
+  // Serial path, each match is visible to the next points
+  if (!mpThreadPool || mnThreads <= 1 || vpMapPoints.size() < 2*PARALLEL_BLOCK) {
+    for (size_t iMP = 0; iMP<vpMapPoints.size(); iMP++) {
+      int bestIdx = SearchLocalPoint(F, vpMapPoints[iMP], th);
+      if (bestIdx >= 0) {
+        F.mvpMapPoints[bestIdx]=vpMapPoints[iMP];
+        nmatches++;
+      }
+    }
+
+    return nmatches;
+  }
+
+  // Search best keypoint of each point in parallel, frame is not modified
+  vector<int> vBestIdx(vpMapPoints.size(), -1);
+  vector<int> vBestDist(vpMapPoints.size(), 256);
+  const int nBlocks = (vpMapPoints.size()+PARALLEL_BLOCK-1)/PARALLEL_BLOCK;
+  mpThreadPool->ParallelFor(nBlocks, [&](int b) {
+    const size_t end = std::min(vpMapPoints.size(), static_cast<size_t>((b+1)*PARALLEL_BLOCK));
+    for (size_t iMP = b*PARALLEL_BLOCK; iMP < end; iMP++)
+      vBestIdx[iMP] = SearchLocalPoint(F, vpMapPoints[iMP], th, &vBestDist[iMP]);
+  }, mnThreads);
+
+  // A keypoint claimed by several points goes to the closest descriptor (first one if tied)
+  vector<int> vOwner(F.N, -1);
+  for (size_t iMP = 0; iMP<vpMapPoints.size(); iMP++) {
+    const int bestIdx = vBestIdx[iMP];
+    if (bestIdx < 0)
+      continue;
+
+    int &owner = vOwner[bestIdx];
+    if (owner < 0 || vBestDist[iMP] < vBestDist[owner])
+      owner = iMP;
+  }
+
+  for (int idx = 0; idx < F.N; idx++) {
+    if (vOwner[idx] >= 0) {
+      F.mvpMapPoints[idx]=vpMapPoints[vOwner[idx]];
+      nmatches++;
+    }
+  }
+
+  // Points that lost their keypoint search again among the remaining ones, in order
+  for (size_t iMP = 0; iMP<vpMapPoints.size(); iMP++) {
+    const int bestIdx = vBestIdx[iMP];
+    if (bestIdx < 0 || vOwner[bestIdx] == static_cast<int>(iMP))
+      continue;
+
+    const int idx = SearchLocalPoint(F, vpMapPoints[iMP], th);
+    if (idx >= 0) {
+      F.mvpMapPoints[idx]=vpMapPoints[iMP];
+      nmatches++;
+    }
+  }
+
+  return nmatches;
+}
+
+int ORBmatcher::SearchLocalPoint(const Frame &F, MapPoint* pMP, const float th, int *pBestDist) {
+  if (!pMP->mbTrackInView)
+    return -1;
+
+  if (pMP->isBad())
+    return -1;
+
+  const int &nPredictedLevel = pMP->mnTrackScaleLevel;
+
+  // The size of the window will depend on the viewing direction
+  float r = RadiusByViewingCos(pMP->mTrackViewCos);
+
+  if (th!=1.0)
+    r*=th;
+
+  // Called once per point, buffers are kept between calls
+  static thread_local vector<size_t> vIndices;
+  static thread_local vector<int> vDistances;
+  F.GetFeaturesInArea(pMP->mTrackProjX,pMP->mTrackProjY, r*F.mvScaleFactors[nPredictedLevel], vIndices, nPredictedLevel-1,nPredictedLevel);
+
+  if (vIndices.empty())
+    return -1;
+
+  uchar MPdescriptor[MapPoint::DESCRIPTOR_SIZE];
+  if (!pMP->GetDescriptor(MPdescriptor))
+    return -1;
+
+  DescriptorDistances(MPdescriptor, F.mFeatures, vIndices, vDistances);
+
+  int bestDist=256;
+  int bestLevel= -1;
+  int bestDist2=256;
+  int bestLevel2 = -1;
+  int bestIdx =-1 ;
+
+  // Get best and second matches with near keypoints
+  for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
+    const size_t idx = *vit;
+
+    if (F.mvpMapPoints[idx])
+      if (F.mvpMapPoints[idx]->Observations() > 0)
+        continue;
+
+    if (F.mvuRight[idx] > 0) {
+      const float er = fabs(pMP->mTrackProjXR-F.mvuRight[idx]);
+      if (er>r*F.mvScaleFactors[nPredictedLevel])
+        continue;
+    }
+
+    const int dist = vDistances[vit-vIndices.begin()];
+
+    if (dist<bestDist) {
+      bestDist2=bestDist;
+      bestDist=dist;
+      bestLevel2 = bestLevel;
+      bestLevel = F.mFeatures.Octave(idx);
+      bestIdx=idx;
+    } else if (dist<bestDist2) {
+      bestLevel2 = F.mFeatures.Octave(idx);
+      bestDist2=dist;
+    }
+  }
+
+  // Apply ratio to second match (only if best and second are in the same scale level)
+  if (bestDist>TH_HIGH)
+    return -1;
+
+  if (bestLevel==bestLevel2 && bestDist>mfNNratio*bestDist2)
+    return -1;
+
+  if (pBestDist)
+    *pBestDist = bestDist;
+  return bestIdx;
+}
+
+int ORBmatcher::SearchByProjection(RigView &view, Frame &F, const vector<MapPoint*> &vpMapPoints, const float th) {
+  const RigCamera* pCamera = view.mpCamera;
+  if (!pCamera || view.N == 0)
+    return 0;
+
+  const Eigen::Matrix4d Tcw = pCamera->Tcb*F.GetPose();
+  const Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
+  const Eigen::Vector3d tcw = Tcw.block<3, 1>(0, 3);
+  const Eigen::Vector3d Ow = -Rcw.transpose()*tcw;
+
+  int nmatches = 0;
+
+  vector<size_t> vIndices;
+  vector<int> vDistances;
 
   for (size_t iMP = 0; iMP<vpMapPoints.size(); iMP++) {
     MapPoint* pMP = vpMapPoints[iMP];
-    if (!pMP->mbTrackInView)
+    if (!pMP || pMP->isBad())
       continue;
 
-    if (pMP->isBad())
+    // Check that it projects inside the image of this camera
+    const Eigen::Vector3d P = pMP->GetWorldPos();
+    const Eigen::Vector3d Pc = Rcw*P+tcw;
+    if (Pc(2) < 0.0f)
       continue;
 
-    const int &nPredictedLevel = pMP->mnTrackScaleLevel;
+    const float invz = 1.0f/Pc(2);
+    const float u = pCamera->fx*Pc(0)*invz+pCamera->cx;
+    const float v = pCamera->fy*Pc(1)*invz+pCamera->cy;
+    if (u<pCamera->mnMinX || u>pCamera->mnMaxX || v<pCamera->mnMinY || v>pCamera->mnMaxY)
+      continue;
 
-    // The size of the window will depend on the viewing direction
-    float r = RadiusByViewingCos(pMP->mTrackViewCos);
+    // Check distance and viewing angle as Frame::isInFrustum
+    const Eigen::Vector3d PO = P-Ow;
+    const float dist = PO.norm();
+    if (dist<pMP->GetMinDistanceInvariance() || dist>pMP->GetMaxDistanceInvariance())
+      continue;
 
-    if (bFactor)
-      r*=th;
+    const float viewCos = PO.dot(pMP->GetNormal())/dist;
+    if (viewCos<0.5)
+      continue;
 
-    const vector<size_t> vIndices =
-        F.GetFeaturesInArea(pMP->mTrackProjX,pMP->mTrackProjY, r*F.mvScaleFactors[nPredictedLevel],nPredictedLevel-1,nPredictedLevel);
+    const int nPredictedLevel = pMP->PredictScale(dist, &F);
+    const float r = RadiusByViewingCos(viewCos)*th*F.mvScaleFactors[nPredictedLevel];
 
+    view.GetFeaturesInArea(u, v, r, vIndices, nPredictedLevel-1, nPredictedLevel);
     if (vIndices.empty())
       continue;
 
-    const cv::Mat MPdescriptor = pMP->GetDescriptor();
+    uchar MPdescriptor[MapPoint::DESCRIPTOR_SIZE];
+    if (!pMP->GetDescriptor(MPdescriptor))
+      continue;
+
+    DescriptorDistances(MPdescriptor, view.mFeatures, vIndices, vDistances);
 
     int bestDist=256;
     int bestLevel= -1;
@@ -76,31 +359,20 @@ int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoint
     int bestIdx =-1 ;
 
     // Get best and second matches with near keypoints
-    for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
-      const size_t idx = *vit;
-
-      if (F.mvpMapPoints[idx])
-        if (F.mvpMapPoints[idx]->Observations() > 0)
-          continue;
-
-      if (F.mvuRight[idx] > 0) {
-        const float er = fabs(pMP->mTrackProjXR-F.mvuRight[idx]);
-        if (er>r*F.mvScaleFactors[nPredictedLevel])
-          continue;
-      }
-
-      const cv::Mat &d = F.mDescriptors.row(idx);
-
-      const int dist = DescriptorDistance(MPdescriptor,d);
+    for (size_t j = 0; j < vIndices.size(); j++) {
+      const size_t idx = vIndices[j];
+      if (view.mvpMapPoints[idx])
+        continue;
 
+      const int dist = vDistances[j];
       if (dist<bestDist) {
         bestDist2=bestDist;
         bestDist=dist;
         bestLevel2 = bestLevel;
-        bestLevel = F.mvKeysUn[idx].octave;
+        bestLevel = view.mFeatures.Octave(idx);
         bestIdx=idx;
       } else if (dist<bestDist2) {
-        bestLevel2 = F.mvKeysUn[idx].octave;
+        bestLevel2 = view.mFeatures.Octave(idx);
         bestDist2=dist;
       }
     }
@@ -110,7 +382,7 @@ int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoint
       if (bestLevel==bestLevel2 && bestDist>mfNNratio*bestDist2)
         continue;
 
-      F.mvpMapPoints[bestIdx]=pMP;
+      view.mvpMapPoints[bestIdx]=pMP;
       nmatches++;
     }
   }
@@ -163,6 +435,9 @@ int ORBmatcher::SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, co
 
   int nmatches = 0;
 
+  vector<size_t> vIndices;
+  vector<int> vDistances;
+
   // For each Candidate MapPoint Project and Match
   for (int iMP = 0, iendMP=vpPoints.size(); iMP<iendMP; iMP++) {
     MapPoint* pMP = vpPoints[iMP];
@@ -213,13 +488,17 @@ int ORBmatcher::SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, co
     // Search in a radius
     const float radius = th*pKF->mvScaleFactors[nPredictedLevel];
 
-    const vector<size_t> vIndices = pKF->GetFeaturesInArea(u, v, radius);
+    pKF->GetFeaturesInArea(u, v, radius, vIndices);
 
     if (vIndices.empty())
       continue;
 
     // Match to the most similar keypoint in the radius
-    const cv::Mat dMP = pMP->GetDescriptor();
+    uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+    if (!pMP->GetDescriptor(dMP))
+      continue;
+
+    DescriptorDistances(dMP, pKF->mFeatures, vIndices, vDistances);
 
     int bestDist = 256;
     int bestIdx = -1;
@@ -228,14 +507,12 @@ int ORBmatcher::SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, co
       if (vpMatched[idx])
         continue;
 
-      const int &kpLevel= pKF->mvKeysUn[idx].octave;
+      const int &kpLevel= pKF->mFeatures.Octave(idx);
 
       if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
-      const cv::Mat &dKF = pKF->mDescriptors.row(idx);
-
-      const int dist = DescriptorDistance(dMP,dKF);
+      const int dist = vDistances[vit-vIndices.begin()];
 
       if (dist<bestDist) {
         bestDist = dist;
@@ -253,41 +530,40 @@ int ORBmatcher::SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, co
   return nmatches;
 }
 
-int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f> &vbPrevMatched, vector<int> &vnMatches12, int windowSize) {
+int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f> &vbPrevMatched, vector<int> &vnMatches12,
+                                        int windowSize, vector<bool> *pvbPrevTracked, int trackWindow) {
   int nmatches = 0;
+  ScratchScope scratch;
   vnMatches12 = vector<int>(F1.mvKeysUn.size(),-1);
 
-  vector<int> rotHist[HISTO_LENGTH];
-  for (int i = 0; i<HISTO_LENGTH; i++)
-    rotHist[i].reserve(500);
-  const float factor = 1.0f/HISTO_LENGTH;
+  RotationHistogram &rotHist = RotationHistogram::Workspace();
 
-  vector<int> vMatchedDistance(F2.mvKeysUn.size(),INT_MAX);
-  vector<int> vnMatches21(F2.mvKeysUn.size(),-1);
+  ScratchVector<int> vMatchedDistance(F2.mvKeysUn.size(),INT_MAX);
+  ScratchVector<int> vnMatches21(F2.mvKeysUn.size(),-1);
 
-  for (size_t i1 = 0, iend1=F1.mvKeysUn.size(); i1<iend1; i1++) {
-    cv::KeyPoint kp1 = F1.mvKeysUn[i1];
-    int level1 = kp1.octave;
-    if (level1 > 0)
-      continue;
+  vector<size_t> vIndices2;
+  vector<int> vDistances;
+
+  if (pvbPrevTracked)
+    pvbPrevTracked->resize(F1.mvKeysUn.size(), false);
 
-    vector<size_t> vIndices2 = F2.GetFeaturesInArea(vbPrevMatched[i1].x, vbPrevMatched[i1].y, windowSize,level1,level1);
+  // Best and second best distances of F2 features of the same level in a window
+  int bestDist, bestDist2, bestIdx2;
+  auto search = [&](size_t i1, float r, int level) {
+    bestDist = INT_MAX;
+    bestDist2 = INT_MAX;
+    bestIdx2 = -1;
 
+    F2.GetFeaturesInArea(vbPrevMatched[i1].x, vbPrevMatched[i1].y, r, vIndices2, level, level);
     if (vIndices2.empty())
-      continue;
+      return false;
 
-    cv::Mat d1 = F1.mDescriptors.row(i1);
-
-    int bestDist = INT_MAX;
-    int bestDist2 = INT_MAX;
-    int bestIdx2 = -1;
+    DescriptorDistances(F1.mFeatures.Descriptor(i1), F2.mFeatures, vIndices2, vDistances);
 
     for (vector<size_t>::iterator vit=vIndices2.begin(); vit!=vIndices2.end(); vit++) {
       size_t i2 = *vit;
 
-      cv::Mat d2 = F2.mDescriptors.row(i2);
-
-      int dist = DescriptorDistance(d1,d2);
+      int dist = vDistances[vit-vIndices2.begin()];
 
       if (vMatchedDistance[i2]<=dist)
         continue;
@@ -301,61 +577,86 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
       }
     }
 
-    if (bestDist<=TH_LOW) {
-      if (bestDist<(float)bestDist2*mfNNratio) {
-        if (vnMatches21[bestIdx2] >= 0) {
-          vnMatches12[vnMatches21[bestIdx2]]=-1;
-          nmatches--;
-        }
-        vnMatches12[i1]=bestIdx2;
-        vnMatches21[bestIdx2]=i1;
-        vMatchedDistance[bestIdx2]=bestDist;
-        nmatches++;
+    return bestDist<=TH_LOW && bestDist<(float)bestDist2*mfNNratio;
+  };
 
-        if (mbCheckOrientation) {
-          float rot = F1.mvKeysUn[i1].angle-F2.mvKeysUn[bestIdx2].angle;
-          if (rot < 0.0)
-            rot+=360.0f;
-          int bin = round(rot*factor);
-          if (bin==HISTO_LENGTH)
-            bin = 0;
-          assert(bin >= 0 && bin<HISTO_LENGTH);
-          rotHist[bin].push_back(i1);
-        }
+  for (size_t i1 = 0, iend1=F1.mvKeysUn.size(); i1<iend1; i1++) {
+    cv::KeyPoint kp1 = F1.mvKeysUn[i1];
+    int level1 = kp1.octave;
+    if (level1 > 0)
+      continue;
+
+    // Features matched in previous frame barely move, full window only if they are lost
+    bool bFound = pvbPrevTracked && (*pvbPrevTracked)[i1] && search(i1, trackWindow, level1);
+    if (!bFound)
+      bFound = search(i1, windowSize, level1);
+
+    if (bFound) {
+      if (vnMatches21[bestIdx2] >= 0) {
+        vnMatches12[vnMatches21[bestIdx2]]=-1;
+        nmatches--;
       }
-    }
+      vnMatches12[i1]=bestIdx2;
+      vnMatches21[bestIdx2]=i1;
+      vMatchedDistance[bestIdx2]=bestDist;
+      nmatches++;
 
+      if (mbCheckOrientation) {
+        rotHist.Add(F1.mvKeysUn[i1].angle-F2.mvKeysUn[bestIdx2].angle, i1);
+      }
+    }
   }
 
   if (mbCheckOrientation) {
-    int ind1=-1;
-    int ind2=-1;
-    int ind3=-1;
-
-    ComputeThreeMaxima(rotHist,HISTO_LENGTH, ind1, ind2, ind3);
-
-    for (int i = 0; i<HISTO_LENGTH; i++) {
-      if (i == ind1 || i == ind2 || i == ind3)
-        continue;
-      for (size_t j = 0, jend=rotHist[i].size(); j < jend; j++) {
-        int idx1 = rotHist[i][j];
-        if (vnMatches12[idx1] >= 0) {
-          vnMatches12[idx1]=-1;
-          nmatches--;
-        }
+    rotHist.ForEachOutlier([&](int idx1) {
+      if (vnMatches12[idx1] >= 0) {
+        vnMatches12[idx1]=-1;
+        nmatches--;
       }
-    }
+    });
 
   }
 
   //Update prev matched
-  for (size_t i1 = 0, iend1=vnMatches12.size(); i1<iend1; i1++)
+  for (size_t i1 = 0, iend1=vnMatches12.size(); i1<iend1; i1++) {
     if (vnMatches12[i1] >= 0)
       vbPrevMatched[i1]=F2.mvKeysUn[vnMatches12[i1]].pt;
+    if (pvbPrevTracked)
+      (*pvbPrevTracked)[i1] = vnMatches12[i1] >= 0;
+  }
 
   return nmatches;
 }
 
+// Indices of candidates closer to line a*x+b*y+c = 0 than their threshold, given as squared
+// distance times a^2+b^2 (same test as CheckDistEpipolarLine, without the division)
+static void EpipolarInliers(float a, float b, float c, const vector<float> &vX, const vector<float> &vY,
+                            const vector<float> &vTh, const vector<uint32_t> &vCandidates, vector<size_t> &vIndices) {
+  const size_t n = vCandidates.size();
+  vIndices.clear();
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256 va = _mm256_set1_ps(a);
+  const __m256 vb = _mm256_set1_ps(b);
+  const __m256 vc = _mm256_set1_ps(c);
+  for (; i+8 <= n; i += 8) {
+    const __m256 num = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(va, _mm256_loadu_ps(&vX[i])),
+                                                   _mm256_mul_ps(vb, _mm256_loadu_ps(&vY[i]))), vc);
+    int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_mul_ps(num, num), _mm256_loadu_ps(&vTh[i]), _CMP_LT_OQ));
+    while (mask) {
+      const int j = __builtin_ctz(mask);
+      vIndices.push_back(vCandidates[i+j]);
+      mask &= mask-1;
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    const float num = a*vX[i]+b*vY[i]+c;
+    if (num*num < vTh[i])
+      vIndices.push_back(vCandidates[i]);
+  }
+}
+
 int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eigen::Matrix3d &F12,
                      vector<pair<size_t, size_t> > &vMatchedPairs) {
   //Compute epipole in second image
@@ -369,17 +670,24 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
 
   // Find matches between not tracked keypoints
   int nmatches = 0;
-  vector<bool> vbMatched2(pKF2->N, false);
-  vector<int> vMatches12(pKF1->N,-1);
+  ScratchScope scratch;
+  ScratchVector<int> vMatches12(pKF1->N,-1);
 
-  vector<int> rotHist[HISTO_LENGTH];
-  for (int i = 0; i<HISTO_LENGTH; i++)
-    rotHist[i].reserve(500);
+  RotationHistogram &rotHist = RotationHistogram::Workspace();
 
-  const float factor = 1.0f/HISTO_LENGTH;
+  ScratchVector<MapPoint*> vpMapPoints1, vpMapPoints2;
+  pKF1->GetMapPointMatches(vpMapPoints1);
+  pKF2->GetMapPointMatches(vpMapPoints2);
 
-  const vector<MapPoint*> vpMapPoints1 = pKF1->GetMapPointMatches();
-  const vector<MapPoint*> vpMapPoints2 = pKF2->GetMapPointMatches();
+  // Candidates are keypoints of KF2 without MapPoint in the grid cells along the epipolar line,
+  // within the distance allowed at the coarsest level. They are tested in blocks, first the
+  // epipolar distance at their own level and then the descriptor distance of the inliers
+  const FeatureTable &features2 = pKF2->mFeatures;
+  const float maxDist = sqrt(3.84f*pKF2->mvLevelSigma2.back());
+  static thread_local vector<uint32_t> vCandidates;
+  static thread_local vector<float> vX, vY, vTh;
+  static thread_local vector<size_t> vIndices;
+  static thread_local vector<int> vDistances;
 
   for (int idx1 = 0; idx1<pKF1->N; idx1++) {
     MapPoint* pMP1 = vpMapPoints1[idx1];
@@ -390,30 +698,48 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
 
     const bool bStereo1 = pKF1->mvuRight[idx1] >= 0;
     const cv::KeyPoint &kp1 = pKF1->mvKeysUn[idx1];
-    const cv::Mat &d1 = pKF1->mDescriptors.row(idx1);
+    const uchar* d1 = pKF1->mFeatures.Descriptor(idx1);
+
+    // Epipolar line in second image l = x1'F12 = [a b c]
+    const float a = kp1.pt.x*F12(0, 0)+kp1.pt.y*F12(1, 0)+F12(2, 0);
+    const float b = kp1.pt.x*F12(0, 1)+kp1.pt.y*F12(1, 1)+F12(2, 1);
+    const float c = kp1.pt.x*F12(0, 2)+kp1.pt.y*F12(1, 2)+F12(2, 2);
+    const float den = a*a+b*b;
+    if (den == 0)
+      continue;
+
+    vCandidates.clear();
+    vX.clear();
+    vY.clear();
+    vTh.clear();
+    pKF2->ForEachCellNearLine(a, b, c, maxDist, [&](const uint32_t* begin, const uint32_t* end) {
+      for (const uint32_t* it = begin; it != end; it++) {
+        const uint32_t idx2 = *it;
+        if (vpMapPoints2[idx2])
+          continue;
+        vCandidates.push_back(idx2);
+        vX.push_back(features2.X(idx2));
+        vY.push_back(features2.Y(idx2));
+        vTh.push_back(3.84f*pKF2->mvLevelSigma2[features2.Octave(idx2)]*den);
+      }
+    });
+
+    EpipolarInliers(a, b, c, vX, vY, vTh, vCandidates, vIndices);
+    DescriptorDistances(d1, features2, vIndices, vDistances);
 
     int bestDist = TH_LOW;
     int bestIdx2 = -1;
 
-    for (int idx2 = 0; idx2<pKF2->N; idx2++) {
-      MapPoint* pMP2 = vpMapPoints2[idx2];
+    // Cells are not visited in index order, ties go to the highest index as in a sequential scan
+    for (size_t i = 0, iend = vIndices.size(); i < iend; i++) {
+      const int idx2 = vIndices[i];
+      const int dist = vDistances[i];
 
-      // If we have already matched or there is a MapPoint skip
-      if (vbMatched2[idx2] || pMP2)
+      if (dist>bestDist || (dist == bestDist && idx2 < bestIdx2))
         continue;
 
       const bool bStereo2 = pKF2->mvuRight[idx2] >= 0;
-
       const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
-      if (!CheckDistEpipolarLine(kp1, kp2, F12, pKF2))
-        continue;
-
-      const cv::Mat &d2 = pKF2->mDescriptors.row(idx2);
-
-      const int dist = DescriptorDistance(d1,d2);
-
-      if (dist>TH_LOW || dist>bestDist)
-        continue;
 
       if (!bStereo1 && !bStereo2) {
         const float distex = ex-kp2.pt.x;
@@ -432,33 +758,16 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
       nmatches++;
 
       if (mbCheckOrientation) {
-        float rot = kp1.angle-kp2.angle;
-        if (rot < 0.0)
-          rot+=360.0f;
-        int bin = round(rot*factor);
-        if (bin==HISTO_LENGTH)
-          bin = 0;
-        assert(bin >= 0 && bin<HISTO_LENGTH);
-        rotHist[bin].push_back(idx1);
+        rotHist.Add(kp1.angle-kp2.angle, idx1);
       }
     }
   }
 
   if (mbCheckOrientation) {
-    int ind1=-1;
-    int ind2=-1;
-    int ind3=-1;
-
-    ComputeThreeMaxima(rotHist,HISTO_LENGTH, ind1, ind2, ind3);
-
-    for (int i = 0; i<HISTO_LENGTH; i++) {
-      if (i == ind1 || i == ind2 || i == ind3)
-        continue;
-      for (size_t j = 0, jend=rotHist[i].size(); j < jend; j++) {
-        vMatches12[rotHist[i][j]]=-1;
-        nmatches--;
-      }
-    }
+    rotHist.ForEachOutlier([&](int idx) {
+      vMatches12[idx]=-1;
+      nmatches--;
+    });
 
   }
 
@@ -475,6 +784,13 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
 }
 
 int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const float th) {
+  vector<pair<MapPoint*, size_t> > vMatches;
+  SearchFuse(pKF, vpMapPoints, vMatches, th);
+  return ApplyFuse(pKF, vMatches);
+}
+
+int ORBmatcher::SearchFuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints,
+                           vector<pair<MapPoint*, size_t> > &vMatches, const float th) {
   Eigen::Matrix3d Rcw = pKF->GetRotation();
   Eigen::Vector3d tcw = pKF->GetTranslation();
 
@@ -486,10 +802,13 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
 
   Eigen::Vector3d Ow = pKF->GetCameraCenter();
 
-  int nFused = 0;
+  vMatches.clear();
 
   const int nMPs = vpMapPoints.size();
 
+  vector<size_t> vIndices;
+  vector<int> vDistances;
+
   for (int i = 0; i<nMPs; i++) {
     MapPoint* pMP = vpMapPoints[i];
 
@@ -539,31 +858,33 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
     // Search in a radius
     const float radius = th*pKF->mvScaleFactors[nPredictedLevel];
 
-    const vector<size_t> vIndices = pKF->GetFeaturesInArea(u, v, radius);
+    pKF->GetFeaturesInArea(u, v, radius, vIndices);
 
     if (vIndices.empty())
       continue;
 
     // Match to the most similar keypoint in the radius
 
-    const cv::Mat dMP = pMP->GetDescriptor();
+    uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+    if (!pMP->GetDescriptor(dMP))
+      continue;
+
+    DescriptorDistances(dMP, pKF->mFeatures, vIndices, vDistances);
 
     int bestDist = 256;
     int bestIdx = -1;
     for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
       const size_t idx = *vit;
 
-      const cv::KeyPoint &kp = pKF->mvKeysUn[idx];
-
-      const int &kpLevel= kp.octave;
+      const int kpLevel = pKF->mFeatures.Octave(idx);
 
       if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
       if (pKF->mvuRight[idx] >= 0) {
         // Check reprojection error in stereo
-        const float &kpx = kp.pt.x;
-        const float &kpy = kp.pt.y;
+        const float kpx = pKF->mFeatures.X(idx);
+        const float kpy = pKF->mFeatures.Y(idx);
         const float &kpr = pKF->mvuRight[idx];
         const float ex = u-kpx;
         const float ey = v-kpy;
@@ -573,8 +894,8 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
         if (e2*pKF->mvInvLevelSigma2[kpLevel]>7.8)
           continue;
       } else {
-        const float &kpx = kp.pt.x;
-        const float &kpy = kp.pt.y;
+        const float kpx = pKF->mFeatures.X(idx);
+        const float kpy = pKF->mFeatures.Y(idx);
         const float ex = u-kpx;
         const float ey = v-kpy;
         const float e2 = ex*ex+ey*ey;
@@ -583,9 +904,7 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
           continue;
       }
 
-      const cv::Mat &dKF = pKF->mDescriptors.row(idx);
-
-      const int dist = DescriptorDistance(dMP,dKF);
+      const int dist = vDistances[vit-vIndices.begin()];
 
       if (dist<bestDist) {
         bestDist = dist;
@@ -593,28 +912,50 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
       }
     }
 
+    if (bestDist<=TH_LOW)
+      vMatches.push_back(make_pair(pMP, static_cast<size_t>(bestIdx)));
+  }
+
+  return vMatches.size();
+}
+
+int ORBmatcher::ApplyFuse(KeyFrame *pKF, const vector<pair<MapPoint*, size_t> > &vMatches) {
+  int nFused = 0;
+
+  for (const pair<MapPoint*, size_t> &match : vMatches) {
+    MapPoint* pMP = match.first;
+
+    // Previous matches may have replaced the point or added it to the keyframe
+    if (pMP->isBad() || pMP->IsInKeyFrame(pKF))
+      continue;
+
     // If there is already a MapPoint replace otherwise add new measurement
-    if (bestDist<=TH_LOW) {
-      MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-      if (pMPinKF) {
-        if (!pMPinKF->isBad()) {
-          if (pMPinKF->Observations()>pMP->Observations())
-            pMP->Replace(pMPinKF);
-          else
-            pMPinKF->Replace(pMP);
-        }
-      } else {
-        pMP->AddObservation(pKF,bestIdx);
-        pKF->AddMapPoint(pMP,bestIdx);
+    MapPoint* pMPinKF = pKF->GetMapPoint(match.second);
+    if (pMPinKF) {
+      if (!pMPinKF->isBad()) {
+        if (pMPinKF->Observations()>pMP->Observations())
+          pMP->Replace(pMPinKF);
+        else
+          pMPinKF->Replace(pMP);
       }
-      nFused++;
+    } else {
+      pMP->AddObservation(pKF, match.second);
+      pKF->AddMapPoint(pMP, match.second);
     }
+    nFused++;
   }
 
   return nFused;
 }
 
 int ORBmatcher::Fuse(KeyFrame *pKF, const Eigen::Matrix4d &Scw, const vector<MapPoint *> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint) {
+  vector<pair<size_t, size_t> > vMatches;
+  SearchFuse(pKF, Scw, vpPoints, th, vMatches);
+  return ApplyFuse(pKF, vpPoints, vMatches, vpReplacePoint);
+}
+
+int ORBmatcher::SearchFuse(KeyFrame *pKF, const Eigen::Matrix4d &Scw, const vector<MapPoint *> &vpPoints, float th,
+                           vector<pair<size_t, size_t> > &vMatches) {
   // Get Calibration Parameters for later projection
   const float &fx = pKF->fx;
   const float &fy = pKF->fy;
@@ -631,10 +972,13 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const Eigen::Matrix4d &Scw, const vector<Map
   // Set of MapPoints already found in the KeyFrame
   const set<MapPoint*> spAlreadyFound = pKF->GetMapPoints();
 
-  int nFused = 0;
+  vMatches.clear();
 
   const int nPoints = vpPoints.size();
 
+  vector<size_t> vIndices;
+  vector<int> vDistances;
+
   // For each candidate MapPoint project and match
   for (int iMP = 0; iMP<nPoints; iMP++) {
     MapPoint* pMP = vpPoints[iMP];
@@ -686,27 +1030,29 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const Eigen::Matrix4d &Scw, const vector<Map
     // Search in a radius
     const float radius = th*pKF->mvScaleFactors[nPredictedLevel];
 
-    const vector<size_t> vIndices = pKF->GetFeaturesInArea(u, v, radius);
+    pKF->GetFeaturesInArea(u, v, radius, vIndices);
 
     if (vIndices.empty())
       continue;
 
     // Match to the most similar keypoint in the radius
 
-    const cv::Mat dMP = pMP->GetDescriptor();
+    uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+    if (!pMP->GetDescriptor(dMP))
+      continue;
+
+    DescriptorDistances(dMP, pKF->mFeatures, vIndices, vDistances);
 
     int bestDist = INT_MAX;
     int bestIdx = -1;
     for (vector<size_t>::const_iterator vit=vIndices.begin(); vit!=vIndices.end(); vit++) {
       const size_t idx = *vit;
-      const int &kpLevel = pKF->mvKeysUn[idx].octave;
+      const int &kpLevel = pKF->mFeatures.Octave(idx);
 
       if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
-      const cv::Mat &dKF = pKF->mDescriptors.row(idx);
-
-      int dist = DescriptorDistance(dMP,dKF);
+      int dist = vDistances[vit-vIndices.begin()];
 
       if (dist<bestDist) {
         bestDist = dist;
@@ -714,18 +1060,34 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const Eigen::Matrix4d &Scw, const vector<Map
       }
     }
 
+    if (bestDist<=TH_LOW)
+      vMatches.push_back(make_pair(static_cast<size_t>(iMP), static_cast<size_t>(bestIdx)));
+  }
+
+  return vMatches.size();
+}
+
+int ORBmatcher::ApplyFuse(KeyFrame *pKF, const vector<MapPoint*> &vpPoints, const vector<pair<size_t, size_t> > &vMatches,
+                          vector<MapPoint *> &vpReplacePoint) {
+  int nFused = 0;
+
+  for (const pair<size_t, size_t> &match : vMatches) {
+    MapPoint* pMP = vpPoints[match.first];
+
+    // Previous matches may have replaced the point or added it to the keyframe
+    if (pMP->isBad() || pMP->IsInKeyFrame(pKF))
+      continue;
+
     // If there is already a MapPoint replace otherwise add new measurement
-    if (bestDist<=TH_LOW) {
-      MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-      if (pMPinKF) {
-        if (!pMPinKF->isBad())
-          vpReplacePoint[iMP] = pMPinKF;
-      } else {
-        pMP->AddObservation(pKF,bestIdx);
-        pKF->AddMapPoint(pMP,bestIdx);
-      }
-      nFused++;
+    MapPoint* pMPinKF = pKF->GetMapPoint(match.second);
+    if (pMPinKF) {
+      if (!pMPinKF->isBad())
+        vpReplacePoint[match.first] = pMPinKF;
+    } else {
+      pMP->AddObservation(pKF, match.second);
+      pKF->AddMapPoint(pMP, match.second);
     }
+    nFused++;
   }
 
   return nFused;
@@ -751,14 +1113,16 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
   Eigen::Matrix3d sR21 = (1.0/s12)*R12.transpose();
   Eigen::Vector3d t21 = -sR21*t12;
 
-  const vector<MapPoint*> vpMapPoints1 = pKF1->GetMapPointMatches();
+  ScratchScope scratch;
+  ScratchVector<MapPoint*> vpMapPoints1, vpMapPoints2;
+  pKF1->GetMapPointMatches(vpMapPoints1);
   const int N1 = vpMapPoints1.size();
 
-  const vector<MapPoint*> vpMapPoints2 = pKF2->GetMapPointMatches();
+  pKF2->GetMapPointMatches(vpMapPoints2);
   const int N2 = vpMapPoints2.size();
 
-  vector<bool> vbAlreadyMatched1(N1, false);
-  vector<bool> vbAlreadyMatched2(N2, false);
+  ScratchVector<bool> vbAlreadyMatched1(N1, false);
+  ScratchVector<bool> vbAlreadyMatched2(N2, false);
 
   for (int i = 0; i < N1; i++) {
     MapPoint* pMP = vpMatches12[i];
@@ -770,8 +1134,11 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
     }
   }
 
-  vector<int> vnMatch1(N1, -1);
-  vector<int> vnMatch2(N2, -1);
+  ScratchVector<int> vnMatch1(N1, -1);
+  ScratchVector<int> vnMatch2(N2, -1);
+
+  vector<size_t> vIndices;
+  vector<int> vDistances;
 
   // Transform from KF1 to KF2 and search
   for (int i1 = 0; i1<N1; i1++) {
@@ -816,27 +1183,29 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
     // Search in a radius
     const float radius = th*pKF2->mvScaleFactors[nPredictedLevel];
 
-    const vector<size_t> vIndices = pKF2->GetFeaturesInArea(u, v, radius);
+    pKF2->GetFeaturesInArea(u, v, radius, vIndices);
 
     if (vIndices.empty())
       continue;
 
     // Match to the most similar keypoint in the radius
-    const cv::Mat dMP = pMP->GetDescriptor();
+    uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+    if (!pMP->GetDescriptor(dMP))
+      continue;
+
+    DescriptorDistances(dMP, pKF2->mFeatures, vIndices, vDistances);
 
     int bestDist = INT_MAX;
     int bestIdx = -1;
     for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
       const size_t idx = *vit;
 
-      const cv::KeyPoint &kp = pKF2->mvKeysUn[idx];
+      const int kpLevel = pKF2->mFeatures.Octave(idx);
 
-      if (kp.octave<nPredictedLevel-1 || kp.octave>nPredictedLevel)
+      if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
-      const cv::Mat &dKF = pKF2->mDescriptors.row(idx);
-
-      const int dist = DescriptorDistance(dMP,dKF);
+      const int dist = vDistances[vit-vIndices.begin()];
 
       if (dist<bestDist) {
         bestDist = dist;
@@ -892,27 +1261,29 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
     // Search in a radius of 2.5*sigma(ScaleLevel)
     const float radius = th*pKF1->mvScaleFactors[nPredictedLevel];
 
-    const vector<size_t> vIndices = pKF1->GetFeaturesInArea(u, v, radius);
+    pKF1->GetFeaturesInArea(u, v, radius, vIndices);
 
     if (vIndices.empty())
       continue;
 
     // Match to the most similar keypoint in the radius
-    const cv::Mat dMP = pMP->GetDescriptor();
+    uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+    if (!pMP->GetDescriptor(dMP))
+      continue;
+
+    DescriptorDistances(dMP, pKF1->mFeatures, vIndices, vDistances);
 
     int bestDist = INT_MAX;
     int bestIdx = -1;
     for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
       const size_t idx = *vit;
 
-      const cv::KeyPoint &kp = pKF1->mvKeysUn[idx];
+      const int kpLevel = pKF1->mFeatures.Octave(idx);
 
-      if (kp.octave<nPredictedLevel-1 || kp.octave>nPredictedLevel)
+      if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
-      const cv::Mat &dKF = pKF1->mDescriptors.row(idx);
-
-      const int dist = DescriptorDistance(dMP,dKF);
+      const int dist = vDistances[vit-vIndices.begin()];
 
       if (dist<bestDist) {
         bestDist = dist;
@@ -943,14 +1314,12 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
   return nFound;
 }
 
-int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono) {
+int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono,
+                                   const Eigen::Matrix<double, 6, 6> *pPoseCov) {
   int nmatches = 0;
 
   // Rotation Histogram (to check rotation consistency)
-  vector<int> rotHist[HISTO_LENGTH];
-  for (int i = 0; i<HISTO_LENGTH; i++)
-    rotHist[i].reserve(500);
-  const float factor = 1.0f/HISTO_LENGTH;
+  RotationHistogram &rotHist = RotationHistogram::Workspace();
 
   Eigen::Matrix3d Rcw = CurrentFrame.GetPose().block<3, 3>(0, 0);
   Eigen::Vector3d tcw = CurrentFrame.GetPose().block<3, 1>(0, 3);
@@ -965,6 +1334,9 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
   const bool bForward = tlc(2) > CurrentFrame.mb && !bMono;
   const bool bBackward = -tlc(2) > CurrentFrame.mb && !bMono;
 
+  vector<size_t> vIndices2;
+  vector<int> vDistances;
+
   for (int i = 0; i<LastFrame.N; i++) {
     MapPoint* pMP = LastFrame.mvpMapPoints[i];
 
@@ -993,20 +1365,28 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
 
         // Search in a window. Size depends on scale
         float radius = th*CurrentFrame.mvScaleFactors[nLastOctave];
-
-        vector<size_t> vIndices2;
+        // With a pose prior, 95% bound of the projection plus one pixel of noise per scale
+        if (pPoseCov) {
+          const float sigma = ProjectionSigma(x3Dc, CurrentFrame.fx, CurrentFrame.fy, *pPoseCov);
+          const float scale = CurrentFrame.mvScaleFactors[nLastOctave];
+          radius = std::min(2.45f*sqrt(sigma*sigma + scale*scale), 2*radius);
+        }
 
         if (bForward)
-          vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, nLastOctave);
+          CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, nLastOctave);
         else if (bBackward)
-          vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, 0, nLastOctave);
+          CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, 0, nLastOctave);
         else
-          vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, nLastOctave-1, nLastOctave+1);
+          CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, nLastOctave-1, nLastOctave+1);
 
         if (vIndices2.empty())
           continue;
 
-        const cv::Mat dMP = pMP->GetDescriptor();
+        uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+        if (!pMP->GetDescriptor(dMP))
+          continue;
+
+        DescriptorDistances(dMP, CurrentFrame.mFeatures, vIndices2, vDistances);
 
         int bestDist = 256;
         int bestIdx2 = -1;
@@ -1024,9 +1404,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
               continue;
           }
 
-          const cv::Mat &d = CurrentFrame.mDescriptors.row(i2);
-
-          const int dist = DescriptorDistance(dMP,d);
+          const int dist = vDistances[vit-vIndices2.begin()];
 
           if (dist<bestDist) {
             bestDist=dist;
@@ -1039,14 +1417,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
           nmatches++;
 
           if (mbCheckOrientation) {
-            float rot = LastFrame.mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
-            if (rot < 0.0)
-              rot+=360.0f;
-            int bin = round(rot*factor);
-            if (bin==HISTO_LENGTH)
-              bin = 0;
-            assert(bin >= 0 && bin<HISTO_LENGTH);
-            rotHist[bin].push_back(bestIdx2);
+            rotHist.Add(LastFrame.mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle, bestIdx2);
           }
         }
       }
@@ -1055,20 +1426,10 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
 
   //Apply rotation consistency
   if (mbCheckOrientation) {
-    int ind1=-1;
-    int ind2=-1;
-    int ind3=-1;
-
-    ComputeThreeMaxima(rotHist,HISTO_LENGTH, ind1, ind2, ind3);
-
-    for (int i = 0; i<HISTO_LENGTH; i++) {
-      if (i != ind1 && i != ind2 && i != ind3) {
-        for (size_t j = 0, jend=rotHist[i].size(); j < jend; j++) {
-          CurrentFrame.mvpMapPoints[rotHist[i][j]] = static_cast<MapPoint*>(NULL);
-          nmatches--;
-        }
-      }
-    }
+    rotHist.ForEachOutlier([&](int idx) {
+      CurrentFrame.mvpMapPoints[idx] = static_cast<MapPoint*>(NULL);
+      nmatches--;
+    });
   }
 
   return nmatches;
@@ -1078,10 +1439,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
   int nmatches = 0;
 
   // Rotation Histogram (to check rotation consistency)
-  vector<int> rotHist[HISTO_LENGTH];
-  for (int i = 0; i<HISTO_LENGTH; i++)
-    rotHist[i].reserve(500);
-  const float factor = 1.0f/HISTO_LENGTH;
+  RotationHistogram &rotHist = RotationHistogram::Workspace();
 
   Eigen::Matrix3d Rcw = CurrentFrame.GetPose().block<3, 3>(0, 0);
   Eigen::Vector3d tcw = CurrentFrame.GetPose().block<3, 1>(0, 3);
@@ -1098,6 +1456,10 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
   const bool bBackward = -tlc(2)>CurrentFrame.mb && !bMono;
 
   const vector<MapPoint*> vpMapPointMatches = pKF->GetMapPointMatches();
+
+  vector<size_t> vIndices2;
+  vector<int> vDistances;
+
   for (size_t i = 0; i < vpMapPointMatches.size(); i++) {
     MapPoint* pMP = vpMapPointMatches[i];
     if (pMP) {
@@ -1126,19 +1488,21 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
         // Search in a window. Size depends on scale
         float radius = th*CurrentFrame.mvScaleFactors[nLastOctave];
 
-        vector<size_t> vIndices2;
-
         if (bForward)
-          vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, nLastOctave);
+          CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, nLastOctave);
         else if (bBackward)
-          vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, 0, nLastOctave);
+          CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, 0, nLastOctave);
         else
-          vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, nLastOctave-1, nLastOctave+1);
+          CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, nLastOctave-1, nLastOctave+1);
 
         if (vIndices2.empty())
           continue;
 
-        const cv::Mat dMP = pMP->GetDescriptor();
+        uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+        if (!pMP->GetDescriptor(dMP))
+          continue;
+
+        DescriptorDistances(dMP, CurrentFrame.mFeatures, vIndices2, vDistances);
 
         int bestDist = 256;
         int bestIdx2 = -1;
@@ -1156,9 +1520,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
               continue;
           }
 
-          const cv::Mat &d = CurrentFrame.mDescriptors.row(i2);
-
-          const int dist = DescriptorDistance(dMP,d);
+          const int dist = vDistances[vit-vIndices2.begin()];
 
           if (dist<bestDist) {
             bestDist=dist;
@@ -1171,14 +1533,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
           nmatches++;
 
           if (mbCheckOrientation) {
-            float rot = pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
-            if (rot < 0.0)
-              rot+=360.0f;
-            int bin = round(rot*factor);
-            if (bin==HISTO_LENGTH)
-              bin = 0;
-            assert(bin >= 0 && bin<HISTO_LENGTH);
-            rotHist[bin].push_back(bestIdx2);
+            rotHist.Add(pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle, bestIdx2);
           }
         }
       }
@@ -1187,44 +1542,63 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
 
   //Apply rotation consistency
   if (mbCheckOrientation) {
-    int ind1=-1;
-    int ind2=-1;
-    int ind3=-1;
-
-    ComputeThreeMaxima(rotHist,HISTO_LENGTH, ind1, ind2, ind3);
-
-    for (int i = 0; i<HISTO_LENGTH; i++) {
-      if (i != ind1 && i != ind2 && i != ind3) {
-        for (size_t j = 0, jend=rotHist[i].size(); j < jend; j++) {
-          CurrentFrame.mvpMapPoints[rotHist[i][j]] = static_cast<MapPoint*>(NULL);
-          nmatches--;
-        }
-      }
-    }
+    rotHist.ForEachOutlier([&](int idx) {
+      CurrentFrame.mvpMapPoints[idx] = static_cast<MapPoint*>(NULL);
+      nmatches--;
+    });
   }
 
   return nmatches;
 }
 
 int ORBmatcher::SearchByPoints(KeyFrame* currentKF, KeyFrame* pKF, vector<MapPoint*> &matches) {
-  int nmatches = 0;
+  vector<vector<MapPoint*> > vvMatches;
+  vector<int> vnMatches;
+  SearchByPoints(currentKF, vector<KeyFrame*>(1, pKF), vvMatches, vnMatches);
+  matches = std::move(vvMatches[0]);
+  return vnMatches[0];
+}
 
-  // Rotation Histogram (to check rotation consistency)
-  vector<int> rotHist[HISTO_LENGTH];
-  for (int i = 0; i<HISTO_LENGTH; i++)
-    rotHist[i].reserve(500);
-  const float factor = 1.0f/HISTO_LENGTH;
+void ORBmatcher::SearchByPoints(KeyFrame* currentKF, const vector<KeyFrame*> &vpKFs,
+                                vector<vector<MapPoint*> > &vvMatches, vector<int> &vnMatches) {
+  ScratchScope scratch;
+  const size_t nKFs = vpKFs.size();
+  const int D = FeatureTable::DESCRIPTOR_SIZE;
+
+  // Points of every keyframe are checked once here, not once per comparison
+  vector<vector<MapPoint*> > vvpMapPoints2(nKFs);
+  ScratchVector<uint32_t> vPackedKF, vPackedIdx;
+  for (size_t k = 0; k < nKFs; k++) {
+    vvpMapPoints2[k] = vpKFs[k]->GetMapPointMatches();
+    for (size_t idx2 = 0; idx2 < vvpMapPoints2[k].size(); idx2++) {
+      MapPoint* pMP2 = vvpMapPoints2[k][idx2];
+      if (pMP2 && !pMP2->isBad()) {
+        vPackedKF.push_back(k);
+        vPackedIdx.push_back(idx2);
+      }
+    }
+  }
+
+  const size_t nPacked = vPackedKF.size();
+  cv::Mat packed = FeatureTable::AllocateDescriptors(nPacked);
+  for (size_t j = 0; j < nPacked; j++)
+    memcpy(packed.ptr<uchar>(j), vpKFs[vPackedKF[j]]->mDescriptors.ptr<uchar>(vPackedIdx[j]), D);
+  const uchar* desc2 = packed.empty() ? nullptr : packed.ptr<uchar>();
 
   const vector<cv::KeyPoint> &vKeysUn1 = currentKF->mvKeysUn;
-  const vector<MapPoint*> vpMapPoints1 = currentKF->GetMapPointMatches();
+  ScratchVector<MapPoint*> vpMapPoints1;
+  currentKF->GetMapPointMatches(vpMapPoints1);
   const cv::Mat &Descriptors1 = currentKF->mDescriptors;
 
-  const vector<cv::KeyPoint> &vKeysUn2 = pKF->mvKeysUn;
-  const vector<MapPoint*> vpMapPoints2 = pKF->GetMapPointMatches();
-  const cv::Mat &Descriptors2 = pKF->mDescriptors;
+  vvMatches.assign(nKFs, vector<MapPoint*>(vpMapPoints1.size(), static_cast<MapPoint*>(NULL)));
+  vnMatches.assign(nKFs, 0);
 
-  matches = vector<MapPoint*>(vpMapPoints1.size(), static_cast<MapPoint*>(NULL));
-  vector<bool> vbMatched2(vpMapPoints2.size(), false);
+  // Packed rows already matched, and best two distances of each keyframe for current point
+  ScratchVector<bool> vbMatched2(nPacked, false);
+  ScratchVector<int> vBestDist1(nKFs), vBestDist2(nKFs), vBestIdx(nKFs);
+
+  // Rotation difference and index of the matches of each keyframe
+  vector<vector<std::pair<float, int> > > vvRotations(nKFs);
 
   for (size_t idx1 = 0; idx1<vpMapPoints1.size(); idx1++) {
     MapPoint* pMP1 = vpMapPoints1[idx1];
@@ -1234,71 +1608,152 @@ int ORBmatcher::SearchByPoints(KeyFrame* currentKF, KeyFrame* pKF, vector<MapPoi
     if (pMP1->isBad())
       continue;
 
-    const cv::Mat &d1 = Descriptors1.row(idx1);
+    const uchar* d1 = Descriptors1.ptr<uchar>(idx1);
 
-    int bestDist1=256;
-    int bestIdx2 =-1 ;
-    int bestDist2=256;
+    std::fill(vBestDist1.begin(), vBestDist1.end(), 256);
+    std::fill(vBestDist2.begin(), vBestDist2.end(), 256);
+    std::fill(vBestIdx.begin(), vBestIdx.end(), -1);
 
-    for (size_t idx2 = 0; idx2<vpMapPoints2.size(); idx2++) {
-      MapPoint* pMP2 = vpMapPoints2[idx2];
-      if (!pMP2 || vbMatched2[idx2])
+    for (size_t j = 0; j < nPacked; j++) {
+      if (vbMatched2[j])
         continue;
 
-      if (pMP2->isBad())
-        continue;
-
-      const cv::Mat &d2 = Descriptors2.row(idx2);
-
-      int dist = DescriptorDistance(d1,d2);
+      const int dist = HammingDistance(d1, desc2 + j*D, true);
+      const uint32_t k = vPackedKF[j];
 
-      if (dist<bestDist1) {
-        bestDist2=bestDist1;
-        bestDist1=dist;
-        bestIdx2=idx2;
-      } else if (dist<bestDist2) {
-        bestDist2=dist;
+      if (dist<vBestDist1[k]) {
+        vBestDist2[k]=vBestDist1[k];
+        vBestDist1[k]=dist;
+        vBestIdx[k]=j;
+      } else if (dist<vBestDist2[k]) {
+        vBestDist2[k]=dist;
       }
     }
 
-    if (bestDist1<TH_LOW) {
-      if (static_cast<float>(bestDist1)<mfNNratio*static_cast<float>(bestDist2)) {
-        matches[idx1] = vpMapPoints2[bestIdx2];
-        vbMatched2[bestIdx2] = true;
-
-        if (mbCheckOrientation){
-          float rot = vKeysUn1[idx1].angle-vKeysUn2[bestIdx2].angle;
-          if (rot < 0.0)
-            rot+=360.0f;
-          int bin = round(rot*factor);
-          if (bin==HISTO_LENGTH)
-            bin = 0;
-          assert(bin >= 0 && bin<HISTO_LENGTH);
-          rotHist[bin].push_back(idx1);
-        }
-        nmatches++;
-      }
+    for (size_t k = 0; k < nKFs; k++) {
+      if (vBestDist1[k]>=TH_LOW || static_cast<float>(vBestDist1[k])>=mfNNratio*static_cast<float>(vBestDist2[k]))
+        continue;
+
+      const int j = vBestIdx[k];
+      const int idx2 = vPackedIdx[j];
+      vvMatches[k][idx1] = vvpMapPoints2[k][idx2];
+      vbMatched2[j] = true;
+
+      if (mbCheckOrientation)
+        vvRotations[k].push_back(std::make_pair(vKeysUn1[idx1].angle-vpKFs[k]->mvKeysUn[idx2].angle, idx1));
+      vnMatches[k]++;
     }
   }
 
   //Apply rotation consistency
   if (mbCheckOrientation) {
-    int ind1=-1;
-    int ind2=-1;
-    int ind3=-1;
+    for (size_t k = 0; k < nKFs; k++) {
+      RotationHistogram &rotHist = RotationHistogram::Workspace();
+      for (const std::pair<float, int> &r : vvRotations[k])
+        rotHist.Add(r.first, r.second);
+
+      rotHist.ForEachOutlier([&](int idx) {
+        vvMatches[k][idx] = static_cast<MapPoint*>(NULL);
+        vnMatches[k]--;
+      });
+    }
+  }
+}
 
-    ComputeThreeMaxima(rotHist,HISTO_LENGTH, ind1, ind2, ind3);
+int ORBmatcher::SearchByBoW(KeyFrame* currentKF, KeyFrame* pKF, vector<MapPoint*> &matches) {
+  if (!currentKF->HasBoW() || !pKF->HasBoW())
+    return SearchByPoints(currentKF, pKF, matches);
 
-    for (int i = 0; i<HISTO_LENGTH; i++) {
-      if (i == ind1 || i == ind2 || i == ind3)
+  ScratchScope scratch;
+  int nmatches = 0;
+
+  // Rotation Histogram (to check rotation consistency)
+  RotationHistogram &rotHist = RotationHistogram::Workspace();
+
+  const vector<cv::KeyPoint> &vKeysUn1 = currentKF->mvKeysUn;
+  ScratchVector<MapPoint*> vpMapPoints1, vpMapPoints2;
+  currentKF->GetMapPointMatches(vpMapPoints1);
+  const cv::Mat &Descriptors1 = currentKF->mDescriptors;
+  const ORBVocabulary::FeatureVector &vFeatVec1 = currentKF->mFeatVec;
+
+  const vector<cv::KeyPoint> &vKeysUn2 = pKF->mvKeysUn;
+  pKF->GetMapPointMatches(vpMapPoints2);
+  const cv::Mat &Descriptors2 = pKF->mDescriptors;
+  const ORBVocabulary::FeatureVector &vFeatVec2 = pKF->mFeatVec;
+
+  matches = vector<MapPoint*>(vpMapPoints1.size(), static_cast<MapPoint*>(NULL));
+  ScratchVector<bool> vbMatched2(vpMapPoints2.size(), false);
+
+  // Both feature vectors are sorted by node, walk them together
+  auto f1it = vFeatVec1.begin();
+  auto f2it = vFeatVec2.begin();
+  while (f1it != vFeatVec1.end() && f2it != vFeatVec2.end()) {
+    if (f1it->first < f2it->first) {
+      f1it++;
+      continue;
+    } else if (f2it->first < f1it->first) {
+      f2it++;
+      continue;
+    }
+
+    const vector<uint32_t> &vIndices2 = f2it->second;
+    for (uint32_t idx1 : f1it->second) {
+      MapPoint* pMP1 = vpMapPoints1[idx1];
+      if (!pMP1)
         continue;
-      for (size_t j = 0, jend=rotHist[i].size(); j < jend; j++) {
-        matches[rotHist[i][j]] = static_cast<MapPoint*>(NULL);
-        nmatches--;
+
+      if (pMP1->isBad())
+        continue;
+
+      const uchar* d1 = Descriptors1.ptr<uchar>(idx1);
+
+      int bestDist1=256;
+      int bestIdx2 =-1 ;
+      int bestDist2=256;
+
+      for (uint32_t idx2 : vIndices2) {
+        MapPoint* pMP2 = vpMapPoints2[idx2];
+        if (!pMP2 || vbMatched2[idx2])
+          continue;
+
+        if (pMP2->isBad())
+          continue;
+
+        int dist = DescriptorDistance(d1, Descriptors2.ptr<uchar>(idx2));
+
+        if (dist<bestDist1) {
+          bestDist2=bestDist1;
+          bestDist1=dist;
+          bestIdx2=idx2;
+        } else if (dist<bestDist2) {
+          bestDist2=dist;
+        }
+      }
+
+      if (bestDist1<TH_LOW) {
+        if (static_cast<float>(bestDist1)<mfNNratio*static_cast<float>(bestDist2)) {
+          matches[idx1] = vpMapPoints2[bestIdx2];
+          vbMatched2[bestIdx2] = true;
+
+          if (mbCheckOrientation){
+            rotHist.Add(vKeysUn1[idx1].angle-vKeysUn2[bestIdx2].angle, idx1);
+          }
+          nmatches++;
+        }
       }
     }
+
+    f1it++;
+    f2it++;
   }
 
+  //Apply rotation consistency
+  if (mbCheckOrientation) {
+    rotHist.ForEachOutlier([&](int idx) {
+      matches[idx] = static_cast<MapPoint*>(NULL);
+      nmatches--;
+    });
+  }
 
   return nmatches;
 }
@@ -1311,13 +1766,13 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
   Eigen::Vector3d Ow = -Rcw.transpose()*tcw;
 
   // Rotation Histogram (to check rotation consistency)
-  vector<int> rotHist[HISTO_LENGTH];
-  for (int i = 0; i<HISTO_LENGTH; i++)
-    rotHist[i].reserve(500);
-  const float factor = 1.0f/HISTO_LENGTH;
+  RotationHistogram &rotHist = RotationHistogram::Workspace();
 
   const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
 
+  vector<size_t> vIndices2;
+  vector<int> vDistances;
+
   for (size_t i = 0, iend=vpMPs.size(); i < iend; i++) {
     MapPoint* pMP = vpMPs[i];
 
@@ -1355,12 +1810,16 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
         // Search in a window
         const float radius = th*CurrentFrame.mvScaleFactors[nPredictedLevel];
 
-        const vector<size_t> vIndices2 = CurrentFrame.GetFeaturesInArea(u, v, radius, nPredictedLevel-1, nPredictedLevel+1);
+        CurrentFrame.GetFeaturesInArea(u, v, radius, vIndices2, nPredictedLevel-1, nPredictedLevel+1);
 
         if (vIndices2.empty())
           continue;
 
-        const cv::Mat dMP = pMP->GetDescriptor();
+        uchar dMP[MapPoint::DESCRIPTOR_SIZE];
+        if (!pMP->GetDescriptor(dMP))
+          continue;
+
+        DescriptorDistances(dMP, CurrentFrame.mFeatures, vIndices2, vDistances);
 
         int bestDist = 256;
         int bestIdx2 = -1;
@@ -1370,9 +1829,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
           if (CurrentFrame.mvpMapPoints[i2])
             continue;
 
-          const cv::Mat &d = CurrentFrame.mDescriptors.row(i2);
-
-          const int dist = DescriptorDistance(dMP,d);
+          const int dist = vDistances[vit-vIndices2.begin()];
 
           if (dist<bestDist) {
             bestDist=dist;
@@ -1385,14 +1842,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
           nmatches++;
 
           if (mbCheckOrientation) {
-            float rot = pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
-            if (rot < 0.0)
-              rot+=360.0f;
-            int bin = round(rot*factor);
-            if (bin==HISTO_LENGTH)
-              bin = 0;
-            assert(bin >= 0 && bin<HISTO_LENGTH);
-            rotHist[bin].push_back(bestIdx2);
+            rotHist.Add(pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle, bestIdx2);
           }
         }
 
@@ -1401,75 +1851,64 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
   }
 
   if (mbCheckOrientation) {
-    int ind1=-1;
-    int ind2=-1;
-    int ind3=-1;
-
-    ComputeThreeMaxima(rotHist,HISTO_LENGTH, ind1, ind2, ind3);
-
-    for (int i = 0; i<HISTO_LENGTH; i++) {
-      if (i != ind1 && i != ind2 && i != ind3) {
-        for (size_t j = 0, jend=rotHist[i].size(); j < jend; j++) {
-          CurrentFrame.mvpMapPoints[rotHist[i][j]]=NULL;
-          nmatches--;
-        }
-      }
-    }
+    rotHist.ForEachOutlier([&](int idx) {
+      CurrentFrame.mvpMapPoints[idx]=NULL;
+      nmatches--;
+    });
   }
 
   return nmatches;
 }
 
-void ORBmatcher::ComputeThreeMaxima(vector<int>* histo, const int L, int &ind1, int &ind2, int &ind3) {
-  int max1 = 0;
-  int max2 = 0;
-  int max3 = 0;
+float ORBmatcher::ProjectionSigma(const Eigen::Vector3d &x3Dc, float fx, float fy, const Eigen::Matrix<double, 6, 6> &cov) {
+  const double invz = 1.0/x3Dc(2);
 
-  for (int i = 0; i<L; i++) {
-    const int s = histo[i].size();
-    if (s>max1) {
-      max3 = max2;
-      max2 = max1;
-      max1 = s;
-      ind3=ind2;
-      ind2=ind1;
-      ind1=i;
-    } else if (s>max2) {
-      max3 = max2;
-      max2 = s;
-      ind3=ind2;
-      ind2=i;
-    } else if (s>max3) {
-      max3 = s;
-      ind3=i;
-    }
-  }
+  // d(u,v)/dx3Dc
+  Eigen::Matrix<double, 2, 3> Jp;
+  Jp << fx*invz, 0.0, -fx*x3Dc(0)*invz*invz,
+        0.0, fy*invz, -fy*x3Dc(1)*invz*invz;
 
-  if (max2 < 0.1f*(float)max1) {
-    ind2=-1;
-    ind3=-1;
-  } else if (max3 < 0.1f*(float)max1) {
-    ind3=-1;
-  }
-}
+  // dx3Dc/d[rho, phi] = [I, -[x3Dc]x]
+  Eigen::Matrix<double, 3, 6> Jx;
+  Jx.block<3, 3>(0, 0).setIdentity();
+  Jx.block<3, 3>(0, 3) << 0.0, x3Dc(2), -x3Dc(1),
+                          -x3Dc(2), 0.0, x3Dc(0),
+                          x3Dc(1), -x3Dc(0), 0.0;
+
+  const Eigen::Matrix<double, 2, 6> J = Jp*Jx;
+  const Eigen::Matrix2d S = J*cov*J.transpose();
 
+  // Largest eigenvalue of S
+  const double m = 0.5*(S(0, 0)+S(1, 1));
+  const double d = 0.5*(S(0, 0)-S(1, 1));
+  return sqrt(m + sqrt(d*d + S(0, 1)*S(0, 1)));
+}
 
-// Bit set count operation from
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
 int ORBmatcher::DescriptorDistance(const cv::Mat &a, const cv::Mat &b) {
-  const int *pa = a.ptr<int32_t>();
-  const int *pb = b.ptr<int32_t>();
+  return HammingDistance(a.ptr<uchar>(), b.ptr<uchar>());
+}
 
-  int dist = 0;
+int ORBmatcher::DescriptorDistance(const uchar *a, const uchar *b) {
+  return HammingDistance(a, b);
+}
 
-  for (int i = 0; i<8; i++, pa++, pb++) {
-    unsigned  int v = *pa ^ *pb;
-    v = v - ((v >> 1) & 0x55555555);
-    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-    dist += (((v + (v >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24;
+void ORBmatcher::DescriptorDistances(const uchar *a, const FeatureTable &features, const vector<size_t> &indices, vector<int> &distances) {
+  const size_t n = indices.size();
+  distances.resize(n);
+
+  // Table rows are aligned when they come from the extractor or a map file
+  const uchar* desc = features.Descriptors();
+  const size_t step = features.DescriptorStep();
+  const bool bAligned = step%FeatureTable::DESCRIPTOR_ALIGNMENT == 0 &&
+                        reinterpret_cast<size_t>(desc)%FeatureTable::DESCRIPTOR_ALIGNMENT == 0;
+
+  if (bAligned) {
+    for (size_t i = 0; i < n; i++)
+      distances[i] = HammingDistance(a, desc + indices[i]*step, true);
+  } else {
+    for (size_t i = 0; i < n; i++)
+      distances[i] = HammingDistance(a, desc + indices[i]*step);
   }
-
-  return dist;
 }
 
 }  // namespace SD_SLAM
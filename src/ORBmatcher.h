@@ -32,29 +32,100 @@
 #include "MapPoint.h"
 #include "KeyFrame.h"
 #include "Frame.h"
+#include "extra/thread_pool.h"
 
 namespace SD_SLAM {
 
+// Histogram of rotation differences between matched keypoints, used to discard matches not
+// consistent with the main rotations. Matches are kept in one flat array with their bin
+class RotationHistogram {
+ public:
+  static const int LENGTH = 30;
+
+  // Empty histogram of the calling thread. Memory is reused by every search
+  static RotationHistogram &Workspace();
+
+  RotationHistogram();
+
+  void Clear();
+
+  // Add match idx with rotation difference rot (degrees)
+  void Add(float rot, int idx);
+
+  // Three bins with most matches. Second and third are -1 if they have less than 10% of the first
+  void ComputeThreeMaxima(int &ind1, int &ind2, int &ind3) const;
+
+  // Call f(idx) for every match outside the three maxima
+  template <typename F>
+  void ForEachOutlier(F f) const {
+    int ind1, ind2, ind3;
+    ComputeThreeMaxima(ind1, ind2, ind3);
+    for (const Entry &e : entries_) {
+      if (e.bin != ind1 && e.bin != ind2 && e.bin != ind3)
+        f(e.idx);
+    }
+  }
+
+ private:
+  struct Entry {
+    int bin;
+    int idx;
+  };
+
+  int counts_[LENGTH];
+  std::vector<Entry> entries_;
+};
+
 class ORBmatcher {
  public:
   ORBmatcher(float nnratio = 0.6, bool checkOri=true);
 
+  // Use up to nThreads threads of pool in local map search (serial by default)
+  void SetThreadPool(ThreadPool* pool, int nThreads);
+
   // Computes the Hamming distance between two ORB descriptors
   static int DescriptorDistance(const cv::Mat &a, const cv::Mat &b);
+  static int DescriptorDistance(const uchar *a, const uchar *b);
+
+  // Computes the Hamming distance between one descriptor and the given features of a table
+  static void DescriptorDistances(const uchar *a, const FeatureTable &features, const std::vector<size_t> &indices,
+                                  std::vector<int> &distances);
+
+  // Standard deviation (pixels) of the projection of a point in camera coordinates, given the
+  // pose covariance (see MotionModel::PoseCovariance). Largest axis of the uncertainty ellipse
+  static float ProjectionSigma(const Eigen::Vector3d &x3Dc, float fx, float fy, const Eigen::Matrix<double, 6, 6> &cov);
 
   // Search matches between Frame keypoints and projected MapPoints. Returns number of matches
-  // Used to track the local map (Tracking)
+  // Used to track the local map (Tracking). With a thread pool, points are searched in parallel
+  // and a keypoint claimed by several of them goes to the one with lowest descriptor distance,
+  // the others search again for a free keypoint
   int SearchByProjection(Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3);
 
+  // Search matches between keypoints of a secondary rig camera and MapPoints, projected with the
+  // pose of the main camera frame F. Returns number of matches. Used to track the local map (Tracking)
+  int SearchByProjection(RigView &view, Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3);
+
   // Project MapPoints tracked in last frame into the current frame and search matches.
-  // Used to track from previous frame (Tracking)
-  int SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono);
+  // If pPoseCov is given (covariance of current pose, see MotionModel::PoseCovariance), the
+  // radius of each point is its projected uncertainty, up to 2*th. Used to track from previous frame (Tracking)
+  int SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono,
+                         const Eigen::Matrix<double, 6, 6> *pPoseCov = NULL);
   int SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const float th, const bool bMono);
 
   // Compare matched points in both keyframes.
   // Used to search loops (LoopClosing)
   int SearchByPoints(KeyFrame* currentKF, KeyFrame* pKF, std::vector<MapPoint*> &matches);
 
+  // SearchByPoints against every keyframe in vpKFs in a single pass. Descriptors of their valid
+  // points are packed in one aligned block, and each point of currentKF is compared with the
+  // whole block. Matches and their count are the same as one SearchByPoints call per keyframe
+  void SearchByPoints(KeyFrame* currentKF, const std::vector<KeyFrame*> &vpKFs,
+                      std::vector<std::vector<MapPoint*> > &vvMatches, std::vector<int> &vnMatches);
+
+  // Same as SearchByPoints, but only features under the same vocabulary node are compared.
+  // Falls back to SearchByPoints if a keyframe has no bag of words
+  int SearchByBoW(KeyFrame* currentKF, KeyFrame* pKF, std::vector<MapPoint*> &matches);
+
   // Project MapPoints seen in KeyFrame into the Frame and search matches.
   // Used in relocalisation (Tracking)
   int SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const std::set<MapPoint*> &sAlreadyFound, const float th, const int ORBdist);
@@ -63,8 +134,11 @@ class ORBmatcher {
   // Used in loop detection (Loop Closing)
    int SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, const std::vector<MapPoint*> &vpPoints, std::vector<MapPoint*> &vpMatched, int th);
 
-  // Matching for the Map Initialization (only used in the monocular case)
-  int SearchForInitialization(Frame &F1, Frame &F2, std::vector<cv::Point2f> &vbPrevMatched, std::vector<int> &vnMatches12, int windowSize=10);
+  // Matching for the Map Initialization (only used in the monocular case). vbPrevMatched has the last
+  // position of F1 features. If pvbPrevTracked is given, features it marks as matched in previous frame
+  // are searched within trackWindow first, and only those not found there use windowSize. Both are updated
+  int SearchForInitialization(Frame &F1, Frame &F2, std::vector<cv::Point2f> &vbPrevMatched, std::vector<int> &vnMatches12,
+                              int windowSize=10, std::vector<bool> *pvbPrevTracked=nullptr, int trackWindow=3);
 
   // Matching to triangulate new MapPoints. Check Epipolar Constraint.
   int SearchForTriangulation(KeyFrame *pKF1, KeyFrame* pKF2, const Eigen::Matrix3d &F12,
@@ -77,23 +151,44 @@ class ORBmatcher {
   // Project MapPoints into KeyFrame and search for duplicated MapPoints.
   int Fuse(KeyFrame* pKF, const std::vector<MapPoint *> &vpMapPoints, const float th=3.0);
 
+  // Fuse split in two steps. Search only reads pKF and the points, so searches in different keyframes
+  // (or with different points) can run in parallel. Matches (point, keypoint index) are then applied
+  // serially, checking again that they are still valid.
+  int SearchFuse(KeyFrame* pKF, const std::vector<MapPoint *> &vpMapPoints,
+                 std::vector<std::pair<MapPoint*, size_t> > &vMatches, const float th=3.0);
+  int ApplyFuse(KeyFrame* pKF, const std::vector<std::pair<MapPoint*, size_t> > &vMatches);
+
   // Project MapPoints into KeyFrame using a given Sim3 and search for duplicated MapPoints.
   int Fuse(KeyFrame* pKF, const Eigen::Matrix4d &Scw, const std::vector<MapPoint*> &vpPoints, float th, std::vector<MapPoint *> &vpReplacePoint);
 
+  // Sim3 Fuse split in two steps as above, matches are (index in vpPoints, keypoint index).
+  // Apply adds the new observations and returns the keyframe points to be replaced
+  int SearchFuse(KeyFrame* pKF, const Eigen::Matrix4d &Scw, const std::vector<MapPoint*> &vpPoints, float th,
+                 std::vector<std::pair<size_t, size_t> > &vMatches);
+  int ApplyFuse(KeyFrame* pKF, const std::vector<MapPoint*> &vpPoints, const std::vector<std::pair<size_t, size_t> > &vMatches,
+                std::vector<MapPoint *> &vpReplacePoint);
+
  public:
   static const int TH_LOW;
   static const int TH_HIGH;
   static const int HISTO_LENGTH;
 
  protected:
+  // Best keypoint of F for a local map point, -1 if none. F is not modified.
+  // pBestDist receives its descriptor distance if given
+  int SearchLocalPoint(const Frame &F, MapPoint* pMP, const float th, int *pBestDist = nullptr);
+
   bool CheckDistEpipolarLine(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const Eigen::Matrix3d &F12, const KeyFrame *pKF);
 
   float RadiusByViewingCos(const float &viewCos);
 
-  void ComputeThreeMaxima(std::vector<int>* histo, const int L, int &ind1, int &ind2, int &ind3);
-
   float mfNNratio;
   bool mbCheckOrientation;
+
+  // Parallel local map search, null if serial
+  static const size_t PARALLEL_BLOCK;
+  ThreadPool* mpThreadPool;
+  int mnThreads;
 };
 
 }  // namespace SD_SLAM
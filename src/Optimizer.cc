@@ -24,14 +24,28 @@
 
 #include "Optimizer.h"
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
 #include <Eigen/StdVector>
 #include "Converter.h"
+#include "Config.h"
+#include "extra/stats.h"
+#include "extra/metrics.h"
+#include "extra/log.h"
+#include "extra/pose_optimizer.h"
+#include "extra/sim3_optimizer.h"
+#include "extra/ba_backend.h"
+#include "extra/scratch_arena.h"
 #include "extra/g2o/core/block_solver.h"
+#include "extra/g2o/core/graph_arena.h"
 #include "extra/g2o/core/optimization_algorithm_levenberg.h"
 #include "extra/g2o/solvers/linear_solver_eigen.h"
+#include "extra/g2o/solvers/linear_solver_supernodal.h"
+#include "extra/g2o/solvers/linear_solver_pcg.h"
 #include "extra/g2o/types/types_six_dof_expmap.h"
 #include "extra/g2o/core/robust_kernel_impl.h"
-#include "extra/g2o/solvers/linear_solver_dense.h"
 #include "extra/g2o/types/types_seven_dof_expmap.h"
 
 using std::map;
@@ -43,27 +57,185 @@ using std::unique_lock;
 
 namespace SD_SLAM {
 
-void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust) {
+// Sparse solver for the reduced camera system. Large problems are factorized with dense
+// supernodes, small ones with the simplicial solver, which has less overhead
+template <typename MatrixType>
+static g2o::LinearSolver<MatrixType>* CreateLinearSolver(size_t nKFs) {
+  if (Config::SupernodalSize() > 0 && nKFs >= static_cast<size_t>(Config::SupernodalSize()))
+    return new g2o::LinearSolverSupernodal<MatrixType>();
+  else
+    return new g2o::LinearSolverEigen<MatrixType>();
+}
+
+// Largest graph optimized so far, see RecordGraphBytes
+static std::atomic<size_t> gPeakGraphBytes(0);
+
+// Estimate the memory of a graph from its size: vertices and edges, plus a 6x6 Hessian block
+// per edge (Schur complement fill-in is not counted)
+static void RecordGraphBytes(const g2o::SparseOptimizer &optimizer) {
+  const size_t bytes = optimizer.vertices().size()*sizeof(g2o::VertexSBAPointXYZ) +
+                       optimizer.edges().size()*(sizeof(g2o::EdgeSE3ProjectXYZ)+sizeof(Eigen::Matrix<double, 6, 6>));
+  size_t peak = gPeakGraphBytes.load();
+  while (bytes > peak && !gPeakGraphBytes.compare_exchange_weak(peak, bytes)) {}
+}
+
+size_t Optimizer::GetPeakGraphBytes() {
+  return gPeakGraphBytes.load();
+}
+
+// Device backend, created on first use. Null if it isn't available
+static BAbackend* GetBAbackend(int nBackend) {
+  if (nBackend != Optimizer::BA_BACKEND_CUDA)
+    return nullptr;
+
+  static BAbackend* backend = [] () -> BAbackend* {
+    BAbackend* b = nullptr;
+#ifdef USE_CUDA
+    b = CreateCudaBAbackend();
+#endif
+    if (!b)
+      LOGE("CUDA bundle adjustment is not available, using CPU");
+    return b;
+  }();
+  return backend;
+}
+
+// Solve the problem BundleAdjustment would build on the device and write back the result
+// the same way. Returns false if it was not solved, nothing is changed then
+static bool DeviceBundleAdjustment(BAbackend* pBackend, const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
+                                   int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                   const set<KeyFrame*> *psFixedKFs, MapPointBatch* pBatch) {
+  BAProblem problem;
+  problem.bRobust = bRobust;
+
+  std::unordered_map<KeyFrame*, int> kfIndices;
+  vector<KeyFrame*> vpProblemKFs;
+  for (KeyFrame* pKF : vpKFs) {
+    if (pKF->isBad())
+      continue;
+
+    kfIndices[pKF] = vpProblemKFs.size();
+    vpProblemKFs.push_back(pKF);
+
+    const Eigen::Matrix4d Tcw = pKF->GetPose();
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 4; c++)
+        problem.vPoses.push_back(Tcw(r, c));
+    problem.vCalib.insert(problem.vCalib.end(), {pKF->fx, pKF->fy, pKF->cx, pKF->cy, pKF->mbf});
+    problem.vFixed.push_back(pKF->mnId == 0 || (psFixedKFs && psFixedKFs->count(pKF)));
+  }
+
+  vector<MapPoint*> vpProblemMPs;
+  for (MapPoint* pMP : vpMP) {
+    if (pMP->isBad())
+      continue;
+
+    const size_t nObs = problem.vObservations.size();
+    const MapPoint::ObservationVector observations = pMP->GetObservations();
+    for (MapPoint::ObservationVector::const_iterator mit=observations.begin(); mit!=observations.end(); mit++) {
+      std::unordered_map<KeyFrame*, int>::const_iterator kit = kfIndices.find(mit->first);
+      if (kit == kfIndices.end())
+        continue;
+
+      KeyFrame* pKF = mit->first;
+      const cv::KeyPoint &kpUn = pKF->mvKeysUn[mit->second];
+      BAProblem::Observation o;
+      o.nKF = kit->second;
+      o.nPoint = vpProblemMPs.size();
+      o.u = kpUn.pt.x;
+      o.v = kpUn.pt.y;
+      o.ur = pKF->mvuRight[mit->second];
+      o.invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
+      problem.vObservations.push_back(o);
+    }
+
+    if (problem.vObservations.size() == nObs)
+      continue;
+
+    const Eigen::Vector3d pos = pMP->GetWorldPos();
+    problem.vPoints.insert(problem.vPoints.end(), {pos(0), pos(1), pos(2)});
+    vpProblemMPs.push_back(pMP);
+  }
+
+  const int nIt = pBackend->Solve(problem, nIterations, pbStopFlag);
+  if (nIt < 0)
+    return false;
+  Metrics::Add(Metrics::GLOBAL_BA_ITERATIONS, nIt);
+
+  for (size_t i = 0; i < vpProblemKFs.size(); i++) {
+    KeyFrame* pKF = vpProblemKFs[i];
+    Eigen::Matrix4d Tcw = Eigen::Matrix4d::Identity();
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 4; c++)
+        Tcw(r, c) = problem.vPoses[12*i + 4*r + c];
+
+    if (nLoopKF == 0) {
+      pKF->SetPose(Tcw);
+    } else {
+      pKF->mTcwGBA = Tcw;
+      pKF->mnBAGlobalForKF = nLoopKF;
+    }
+  }
+
+  for (size_t i = 0; i < vpProblemMPs.size(); i++) {
+    MapPoint* pMP = vpProblemMPs[i];
+    const Eigen::Vector3d pos(problem.vPoints[3*i], problem.vPoints[3*i+1], problem.vPoints[3*i+2]);
+    if (nLoopKF == 0) {
+      pMP->SetWorldPos(pos);
+      pBatch->Add(pMP, false);
+    } else {
+      pMP->mPosGBA = pos;
+      pMP->mnBAGlobalForKF = nLoopKF;
+    }
+  }
+
+  return true;
+}
+
+void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                       int nThreads, int nBackend, MapPointBatch* pBatch) {
   vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
   vector<MapPoint*> vpMP = pMap->GetAllMapPoints();
-  BundleAdjustment(vpKFs, vpMP,nIterations,pbStopFlag, nLoopKF, bRobust);
+  BundleAdjustment(vpKFs, vpMP,nIterations,pbStopFlag, nLoopKF, bRobust, nThreads, NULL, NULL, nBackend, pBatch);
 }
 
 
 void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
-                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust) {
+                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust, int nThreads,
+                 const set<KeyFrame*> *psFixedKFs, BAPoses *pPoses, int nBackend, MapPointBatch* pBatch) {
+  // Normals and depths of moved points are updated together once all of them are written
+  MapPointBatch batch;
+  MapPointBatch* pUpdates = pBatch ? pBatch : &batch;
+
+  // Pose priors are only supported by g2o
+  BAbackend* pBackend = GetBAbackend(nBackend);
+  if (pBackend && !pPoses &&
+      DeviceBundleAdjustment(pBackend, vpKFs, vpMP, nIterations, pbStopFlag, nLoopKF, bRobust, psFixedKFs, pUpdates)) {
+    batch.Apply(nullptr, 0);
+    return;
+  }
+
   vector<bool> vbNotIncludedMP;
   vbNotIncludedMP.resize(vpMP.size());
 
+  // Graph vertices, edges and kernels are taken from a per-thread arena, reused between calls.
+  // The scope must outlive the optimizer, which deletes them
+  static thread_local g2o::GraphArena arena;
+  g2o::ScopedGraphArena arenaScope(arena);
   g2o::SparseOptimizer optimizer;
   g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-  linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+  // Very large maps are solved iteratively, the reduced camera system is never built
+  if (Config::PCGSize() > 0 && vpKFs.size() >= static_cast<size_t>(Config::PCGSize()))
+    linearSolver = new g2o::LinearSolverPCG<g2o::BlockSolver_6_3::PoseMatrixType>();
+  else
+    linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3::PoseMatrixType>(vpKFs.size());
 
   g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
   g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
   optimizer.setAlgorithm(solver);
+  optimizer.setNumThreads(nThreads);
 
   if (pbStopFlag)
     optimizer.setForceStopFlag(pbStopFlag);
@@ -76,12 +248,20 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     if (pKF->isBad())
       continue;
     g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-    vSE3->setEstimate(Converter::toSE3Quat(pKF->GetPose()));
+    vSE3->setEstimate(Converter::toSE3Quat(pPoses ? pPoses->vTcw[i] : pKF->GetPose()));
     vSE3->setId(pKF->mnId);
-    vSE3->setFixed(pKF->mnId == 0);
+    vSE3->setFixed(pKF->mnId == 0 || (psFixedKFs && psFixedKFs->count(pKF)));
     optimizer.addVertex(vSE3);
     if (pKF->mnId>maxKFid)
       maxKFid=pKF->mnId;
+
+    if (pPoses && pPoses->vRho[i] > 0 && !vSE3->fixed()) {
+      g2o::EdgeSE3Prior* e = new g2o::EdgeSE3Prior();
+      e->setVertex(0, vSE3);
+      e->setMeasurement(Converter::toSE3Quat(pPoses->vTarget[i]));
+      e->setInformation(Eigen::Matrix<double, 6, 6>::Identity()*pPoses->vRho[i]);
+      optimizer.addEdge(e);
+    }
   }
 
   const float thHuber2D = sqrt(5.99);
@@ -99,14 +279,14 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     vPoint->setMarginalized(true);
     optimizer.addVertex(vPoint);
 
-     const map<KeyFrame*, size_t> observations = pMP->GetObservations();
+     const MapPoint::ObservationVector observations = pMP->GetObservations();
 
     int nEdges = 0;
     //SET EDGES
-    for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++) {
+    for (MapPoint::ObservationVector::const_iterator mit=observations.begin(); mit!=observations.end(); mit++) {
 
       KeyFrame* pKF = mit->first;
-      if (pKF->isBad() || pKF->mnId>maxKFid)
+      if (pKF->isBad() || pKF->mnId>maxKFid || !optimizer.vertex(pKF->mnId))
         continue;
 
       nEdges++;
@@ -176,8 +356,9 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
   }
 
   // Optimize!
+  RecordGraphBytes(optimizer);
   optimizer.initializeOptimization();
-  optimizer.optimize(nIterations);
+  Metrics::Add(Metrics::GLOBAL_BA_ITERATIONS, optimizer.optimize(nIterations));
 
   // Recover optimized data
 
@@ -188,7 +369,9 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
       continue;
     g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(pKF->mnId));
     g2o::SE3Quat SE3quat = vSE3->estimate();
-    if (nLoopKF == 0) {
+    if (pPoses) {
+      pPoses->vTcw[i] = Converter::toMatrix4d(SE3quat);
+    } else if (nLoopKF == 0) {
       pKF->SetPose(Converter::toMatrix4d(SE3quat));
     } else {
       pKF->mTcwGBA = Converter::toMatrix4d(SE3quat);
@@ -207,222 +390,367 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
       continue;
     g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(pMP->mnId+maxKFid+1));
 
-    if (nLoopKF == 0) {
+    if (pPoses) {
       pMP->SetWorldPos(vPoint->estimate());
-      pMP->UpdateNormalAndDepth();
+    } else if (nLoopKF == 0) {
+      pMP->SetWorldPos(vPoint->estimate());
+      pUpdates->Add(pMP, false);
     } else {
       pMP->mPosGBA = vPoint->estimate();
       pMP->mnBAGlobalForKF = nLoopKF;
     }
   }
 
+  batch.Apply(nullptr, 0);
 }
 
-int Optimizer::PoseOptimization(Frame *pFrame) {
-  g2o::SparseOptimizer optimizer;
-  g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
+void Optimizer::RegionBundleAdjustment(const vector<KeyFrame*> &vpKFs, int nIterations, bool* pbStopFlag,
+                                       const unsigned long nLoopKF, int nThreads) {
+  set<KeyFrame*> sRegion(vpKFs.begin(), vpKFs.end());
 
-  linearSolver = new g2o::LinearSolverDense<g2o::BlockSolver_6_3::PoseMatrixType>();
+  // MapPoints seen in the region
+  set<MapPoint*> sMPs;
+  for (KeyFrame* pKF : vpKFs) {
+    if (pKF->isBad())
+      continue;
+    const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+    for (MapPoint* pMP : vpMPs) {
+      if (pMP && !pMP->isBad())
+        sMPs.insert(pMP);
+    }
+  }
 
-  g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
+  // Keyframes outside the region observing those points are fixed
+  set<KeyFrame*> sFixed;
+  for (MapPoint* pMP : sMPs) {
+    pMP->ForEachObservation([&](KeyFrame* pKFi, size_t) {
+      if (!pKFi->isBad() && !sRegion.count(pKFi))
+        sFixed.insert(pKFi);
+    });
+  }
 
-  g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-  optimizer.setAlgorithm(solver);
+  vector<KeyFrame*> vpAllKFs(vpKFs.begin(), vpKFs.end());
+  vpAllKFs.insert(vpAllKFs.end(), sFixed.begin(), sFixed.end());
+  vector<MapPoint*> vpMPs(sMPs.begin(), sMPs.end());
 
-  int nInitialCorrespondences = 0;
+  BundleAdjustment(vpAllKFs, vpMPs, nIterations, pbStopFlag, nLoopKF, true, nThreads, &sFixed);
+}
 
-  // Set Frame vertex
-  g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
-  vSE3->setEstimate(Converter::toSE3Quat(pFrame->GetPose()));
-  vSE3->setId(0);
-  vSE3->setFixed(false);
-  optimizer.addVertex(vSE3);
+void Optimizer::PartitionedBundleAdjustment(Map* pMap, int nPartitionSize, int nRounds, int nIterations,
+                                            ThreadPool* pPool, int nThreads) {
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
 
-  // Set MapPoint vertices
-  const int N = pFrame->N;
+  // Information of the consensus priors, about the one of a few well observed points
+  const double rho = 1e4;
 
-  vector<g2o::EdgeSE3ProjectXYZOnlyPose*> vpEdgesMono;
-  vector<size_t> vnIndexEdgeMono;
-  vpEdgesMono.reserve(N);
-  vnIndexEdgeMono.reserve(N);
+  vector<KeyFrame*> vpKFs;
+  for (KeyFrame* pKF : pMap->GetAllKeyFrames()) {
+    if (!pKF->isBad())
+      vpKFs.push_back(pKF);
+  }
+  std::sort(vpKFs.begin(), vpKFs.end(), KeyFrame::lId);
+  const int nKFs = vpKFs.size();
+  if (nKFs == 0)
+    return;
+
+  std::unordered_map<KeyFrame*, int> kfIndex;
+  for (int i = 0; i < nKFs; i++)
+    kfIndex[vpKFs[i]] = i;
+
+  // Partitions grown breadth first over the covisibility graph from the oldest free keyframe.
+  // Keyframes queued when a partition is full are left for the next ones
+  vector<int> vOwner(nKFs, -1);
+  vector<vector<int> > vPartitionKFs;
+  for (int i = 0; i < nKFs; i++) {
+    if (vOwner[i] >= 0)
+      continue;
 
-  vector<g2o::EdgeStereoSE3ProjectXYZOnlyPose*> vpEdgesStereo;
-  vector<size_t> vnIndexEdgeStereo;
-  vpEdgesStereo.reserve(N);
-  vnIndexEdgeStereo.reserve(N);
+    const int p = vPartitionKFs.size();
+    vPartitionKFs.push_back(vector<int>());
+    vector<int> &owned = vPartitionKFs.back();
+    std::deque<int> queue(1, i);
+    vOwner[i] = p;
+    while (!queue.empty() && static_cast<int>(owned.size()) < nPartitionSize) {
+      const int k = queue.front();
+      queue.pop_front();
+      owned.push_back(k);
+
+      for (KeyFrame* pKFn : vpKFs[k]->GetVectorCovisibleKeyFrames()) {
+        std::unordered_map<KeyFrame*, int>::const_iterator it = kfIndex.find(pKFn);
+        if (it != kfIndex.end() && vOwner[it->second] < 0) {
+          vOwner[it->second] = p;
+          queue.push_back(it->second);
+        }
+      }
+    }
+    for (int k : queue)
+      vOwner[k] = -1;
+  }
+  const int nPartitions = vPartitionKFs.size();
 
-  const float deltaMono = sqrt(5.991);
-  const float deltaStereo = sqrt(7.815);
+  // Each point goes to the partition of its reference keyframe (or of any observer), which also
+  // gets the other keyframes observing it. Keyframes in several partitions are separators
+  vector<vector<MapPoint*> > vPartitionMPs(nPartitions);
+  vector<set<int> > vPartitionMembers(nPartitions);
+  for (MapPoint* pMP : pMap->GetAllMapPoints()) {
+    if (pMP->isBad())
+      continue;
 
+    int p = -1;
+    std::unordered_map<KeyFrame*, int>::const_iterator it = kfIndex.find(pMP->GetReferenceKeyFrame());
+    if (it != kfIndex.end())
+      p = vOwner[it->second];
+    vector<int> vObservers;
+    pMP->ForEachObservation([&](KeyFrame* pKFi, size_t) {
+      std::unordered_map<KeyFrame*, int>::const_iterator itObs = kfIndex.find(pKFi);
+      if (itObs != kfIndex.end())
+        vObservers.push_back(itObs->second);
+    });
+    if (vObservers.empty())
+      continue;
+    if (p < 0)
+      p = vOwner[vObservers[0]];
 
-  {
-  unique_lock<mutex> lock(MapPoint::mGlobalMutex);
+    vPartitionMPs[p].push_back(pMP);
+    vPartitionMembers[p].insert(vObservers.begin(), vObservers.end());
+  }
 
-  for (int i = 0; i < N; i++) {
-    MapPoint* pMP = pFrame->mvpMapPoints[i];
-    if (pMP) {
-      // Monocular observation
-      if (pFrame->mvuRight[i] < 0) {
-        nInitialCorrespondences++;
-        pFrame->mvbOutlier[i] = false;
+  // Keyframes of each partition, owned ones included even if they observe none of its points
+  vector<vector<int> > vMembers(nPartitions);
+  vector<int> vCopies(nKFs, 0);
+  for (int p = 0; p < nPartitions; p++) {
+    vPartitionMembers[p].insert(vPartitionKFs[p].begin(), vPartitionKFs[p].end());
+    vMembers[p].assign(vPartitionMembers[p].begin(), vPartitionMembers[p].end());
+    for (int k : vMembers[p])
+      vCopies[k]++;
+  }
 
-        Eigen::Matrix<double, 2, 1> obs;
-        const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-        obs << kpUn.pt.x, kpUn.pt.y;
+  // Consensus pose of separators and scaled dual of each of their copies
+  vector<g2o::SE3Quat, Eigen::aligned_allocator<g2o::SE3Quat> > vZ(nKFs);
+  for (int k = 0; k < nKFs; k++)
+    vZ[k] = Converter::toSE3Quat(vpKFs[k]->GetPose());
+
+  vector<vector<KeyFrame*> > vpMemberKFs(nPartitions);
+  vector<BAPoses> vPoses(nPartitions);
+  vector<vector<Vector6d, Eigen::aligned_allocator<Vector6d> > > vDuals(nPartitions);
+  for (int p = 0; p < nPartitions; p++) {
+    const size_t n = vMembers[p].size();
+    vpMemberKFs[p].resize(n);
+    vPoses[p].vTcw.resize(n);
+    vPoses[p].vTarget.resize(n);
+    vPoses[p].vRho.assign(n, 0.0);
+    vDuals[p].assign(n, Vector6d::Zero());
+    for (size_t j = 0; j < n; j++) {
+      const int k = vMembers[p][j];
+      vpMemberKFs[p][j] = vpKFs[k];
+      vPoses[p].vTcw[j] = vpKFs[k]->GetPose();
+      if (vCopies[k] > 1)
+        vPoses[p].vRho[j] = rho;
+    }
+  }
 
-        g2o::EdgeSE3ProjectXYZOnlyPose* e = new g2o::EdgeSE3ProjectXYZOnlyPose();
+  LOGD("Partitioned BA: %d keyframes in %d partitions", nKFs, nPartitions);
 
-        e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-        e->setMeasurement(obs);
-        const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
-        e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
+  for (int round = 0; round < nRounds; round++) {
+    // Separator copies are pulled towards the consensus, shifted by their dual
+    for (int p = 0; p < nPartitions; p++) {
+      for (size_t j = 0; j < vMembers[p].size(); j++) {
+        if (vPoses[p].vRho[j] > 0)
+          vPoses[p].vTarget[j] = Converter::toMatrix4d(g2o::SE3Quat::exp(-vDuals[p][j])*vZ[vMembers[p][j]]);
+      }
+    }
 
-        g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-        e->setRobustKernel(rk);
-        rk->setDelta(deltaMono);
+    // Partitions share no points, so they can write them concurrently
+    pPool->ParallelFor(nPartitions, [&](int p) {
+      BundleAdjustment(vpMemberKFs[p], vPartitionMPs[p], nIterations, NULL, 0, true, 1, NULL, &vPoses[p]);
+    }, nThreads);
+
+    // Consensus is the mean of the copies plus their duals, in the tangent space of the previous one
+    vector<Vector6d, Eigen::aligned_allocator<Vector6d> > vSum(nKFs, Vector6d::Zero());
+    for (int p = 0; p < nPartitions; p++) {
+      for (size_t j = 0; j < vMembers[p].size(); j++) {
+        const int k = vMembers[p][j];
+        const g2o::SE3Quat x = Converter::toSE3Quat(vPoses[p].vTcw[j]);
+        if (vCopies[k] > 1)
+          vSum[k] += (x*vZ[k].inverse()).log() + vDuals[p][j];
+        else
+          vZ[k] = x;
+      }
+    }
 
-        e->fx = pFrame->fx;
-        e->fy = pFrame->fy;
-        e->cx = pFrame->cx;
-        e->cy = pFrame->cy;
-        Eigen::Vector3d Xw = pMP->GetWorldPos();
-        e->Xw[0] = Xw(0);
-        e->Xw[1] = Xw(1);
-        e->Xw[2] = Xw(2);
+    double maxResidual = 0.0;
+    for (int k = 0; k < nKFs; k++) {
+      if (vCopies[k] > 1)
+        vZ[k] = g2o::SE3Quat::exp(vSum[k]/vCopies[k])*vZ[k];
+    }
+    for (int p = 0; p < nPartitions; p++) {
+      for (size_t j = 0; j < vMembers[p].size(); j++) {
+        const int k = vMembers[p][j];
+        if (vCopies[k] <= 1)
+          continue;
+        const Vector6d r = (Converter::toSE3Quat(vPoses[p].vTcw[j])*vZ[k].inverse()).log();
+        vDuals[p][j] += r;
+        maxResidual = std::max(maxResidual, r.norm());
+      }
+    }
 
-        optimizer.addEdge(e);
+    LOGD("Partitioned BA round %d: max separator residual %f", round, maxResidual);
+  }
 
-        vpEdgesMono.push_back(e);
-        vnIndexEdgeMono.push_back(i);
-      } else  {  // Stereo observation
-        nInitialCorrespondences++;
-        pFrame->mvbOutlier[i] = false;
+  unique_lock<mutex> lock = TraceLock(pMap->mMutexMapUpdate, "MapUpdate");
 
-        //SET EDGE
-        Eigen::Matrix<double, 3, 1> obs;
-        const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-        const float &kp_ur = pFrame->mvuRight[i];
-        obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
+  for (int k = 0; k < nKFs; k++)
+    vpKFs[k]->SetPose(Converter::toMatrix4d(vZ[k]));
 
-        g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = new g2o::EdgeStereoSE3ProjectXYZOnlyPose();
+  MapPointBatch batch;
+  for (int p = 0; p < nPartitions; p++) {
+    for (MapPoint* pMP : vPartitionMPs[p])
+      batch.Add(pMP, false);
+  }
+  batch.Apply(pPool, nThreads);
+}
 
-        e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-        e->setMeasurement(obs);
-        const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
-        Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
-        e->setInformation(Info);
+int Optimizer::PoseOptimization(Frame *pFrame, int nIterations) {
+  ScopedSpan span(Statistics::POSE_OPTIMIZATION);
 
-        g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
-        e->setRobustKernel(rk);
-        rk->setDelta(deltaStereo);
-
-        e->fx = pFrame->fx;
-        e->fy = pFrame->fy;
-        e->cx = pFrame->cx;
-        e->cy = pFrame->cy;
-        e->bf = pFrame->mbf;
-        Eigen::Vector3d Xw = pMP->GetWorldPos();
-        e->Xw[0] = Xw(0);
-        e->Xw[1] = Xw(1);
-        e->Xw[2] = Xw(2);
+  // Reused between calls, avoids allocating a graph per frame
+  static thread_local PoseOptimizer optimizer;
+  optimizer.Clear(pFrame->fx, pFrame->fy, pFrame->cx, pFrame->cy, pFrame->mbf);
 
-        optimizer.addEdge(e);
+  int nInitialCorrespondences = 0;
 
-        vpEdgesStereo.push_back(e);
-        vnIndexEdgeStereo.push_back(i);
-      }
+  const int N = pFrame->N;
+
+  ScratchScope scratch;
+  ScratchVector<size_t> vnIndexEdge;
+  vnIndexEdge.reserve(N);
+
+  // View and keypoint of each rig observation
+  ScratchVector<std::pair<size_t, int> > vRigEdges;
+
+  const float deltaMono = sqrt(5.991);
+  const float deltaStereo = sqrt(7.815);
+
+  {
+  unique_lock<mutex> lock(MapPoint::mGlobalMutex);
+
+  for (int i = 0; i < N; i++) {
+    MapPoint* pMP = pFrame->mvpMapPoints[i];
+    if (pMP) {
+      nInitialCorrespondences++;
+      pFrame->mvbOutlier[i] = false;
+
+      // Monocular observation if ur is negative, stereo otherwise
+      const FeatureTable &features = pFrame->mFeatures;
+      const float &kp_ur = pFrame->mvuRight[i];
+      const bool bRefined = !pFrame->mvbRefined.empty() && pFrame->mvbRefined[i];
+      const float invSigma2 = pFrame->mvInvLevelSigma2[bRefined ? 0 : features.Octave(i)];
+      const float delta = kp_ur < 0 ? deltaMono : deltaStereo;
+
+      optimizer.AddObservation(pMP->GetWorldPos(), features.X(i), features.Y(i), kp_ur, invSigma2, delta);
+      vnIndexEdge.push_back(i);
     }
+  }
 
+  // Secondary rig cameras, their observations follow the ones of the frame
+  for (size_t v = 0; v < pFrame->mvRigViews.size(); v++) {
+    RigView &view = pFrame->mvRigViews[v];
+    const RigCamera* pCamera = view.mpCamera;
+    const int camera = optimizer.AddCamera(pCamera->fx, pCamera->fy, pCamera->cx, pCamera->cy, pCamera->Tcb);
+
+    for (int i = 0; i < view.N; i++) {
+      MapPoint* pMP = view.mvpMapPoints[i];
+      if (pMP) {
+        nInitialCorrespondences++;
+        view.mvbOutlier[i] = false;
+
+        const float invSigma2 = pFrame->mvInvLevelSigma2[view.mFeatures.Octave(i)];
+        optimizer.AddObservation(pMP->GetWorldPos(), view.mFeatures.X(i), view.mFeatures.Y(i), -1, invSigma2,
+                                 deltaMono, camera);
+        vRigEdges.push_back(std::make_pair(v, i));
+      }
+    }
   }
   }
 
-
   if (nInitialCorrespondences<3)
     return 0;
 
-  // We perform 4 optimizations, after each optimization we classify observation as inlier/outlier
+  // Up to 4 optimizations, after each optimization we classify observation as inlier/outlier
   // At the next optimization, outliers are not included, but at the end they can be classified as inliers again.
+  // Each round starts from the previous result and stops once updates are negligible. If a round
+  // leaves the inliers unchanged, the next robust round has nothing left to do, so it goes
+  // straight to the final round without robust kernel, or finishes if that one was done.
   const float chi2Mono[4]={5.991, 5.991, 5.991, 5.991};
   const float chi2Stereo[4]={7.815, 7.815, 7.815, 7.815};
-  const int its[4]={10, 10, 10, 10};
+  const int its[4]={nIterations, nIterations, nIterations, nIterations};
+  const double minUpdate = 1e-6;
 
+  g2o::SE3Quat Tcw = Converter::toSE3Quat(pFrame->GetPose());
   int nBad = 0;
-  for (size_t it = 0; it<4; it++) {
-
-    vSE3->setEstimate(Converter::toSE3Quat(pFrame->GetPose()));
-    optimizer.initializeOptimization(0);
-    optimizer.optimize(its[it]);
+  bool bRobust = true;
+  for (int it = 0; it<4; it++) {
+    optimizer.Optimize(Tcw, its[it], minUpdate);
 
     nBad = 0;
-    for (size_t i = 0, iend=vpEdgesMono.size(); i < iend; i++) {
-      g2o::EdgeSE3ProjectXYZOnlyPose* e = vpEdgesMono[i];
-
-      const size_t idx = vnIndexEdgeMono[i];
-
-      if (pFrame->mvbOutlier[idx]) {
-        e->computeError();
-      }
-
-      const float chi2 = e->chi2();
-
-      if (chi2>chi2Mono[it]) {
-        pFrame->mvbOutlier[idx]=true;
-        e->setLevel(1);
+    bool bChanged = false;
+    for (size_t i = 0, iend=vnIndexEdge.size(); i < iend; i++) {
+      const size_t idx = vnIndexEdge[i];
+      const float chi2 = optimizer.Chi2(i, Tcw);
+      const float th = optimizer.IsStereo(i) ? chi2Stereo[it] : chi2Mono[it];
+      const bool bOutlier = chi2>th;
+
+      bChanged |= optimizer.IsInlier(i) == bOutlier;
+      pFrame->mvbOutlier[idx]=bOutlier;
+      optimizer.SetInlier(i, !bOutlier);
+      if (bOutlier)
         nBad++;
-      } else {
-        pFrame->mvbOutlier[idx]=false;
-        e->setLevel(0);
-      }
-
-      if (it==2)
-        e->setRobustKernel(0);
     }
 
-    for (size_t i = 0, iend=vpEdgesStereo.size(); i < iend; i++) {
-      g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = vpEdgesStereo[i];
-
-      const size_t idx = vnIndexEdgeStereo[i];
-
-      if (pFrame->mvbOutlier[idx]) {
-        e->computeError();
-      }
-
-      const float chi2 = e->chi2();
+    for (size_t i = 0, iend=vRigEdges.size(); i < iend; i++) {
+      const size_t e = vnIndexEdge.size()+i;
+      const bool bOutlier = optimizer.Chi2(e, Tcw)>chi2Mono[it];
 
-      if (chi2>chi2Stereo[it]) {
-        pFrame->mvbOutlier[idx]=true;
-        e->setLevel(1);
+      bChanged |= optimizer.IsInlier(e) == bOutlier;
+      pFrame->mvRigViews[vRigEdges[i].first].mvbOutlier[vRigEdges[i].second] = bOutlier;
+      optimizer.SetInlier(e, !bOutlier);
+      if (bOutlier)
         nBad++;
-      } else {
-        e->setLevel(0);
-        pFrame->mvbOutlier[idx]=false;
-      }
-
-      if (it==2)
-        e->setRobustKernel(0);
     }
 
-    if (optimizer.edges().size()<10)
+    if (optimizer.Size()<10)
       break;
+
+    if (bRobust && (it==2 || !bChanged)) {
+      optimizer.SetRobust(false);
+      bRobust = false;
+      it = std::max(it, 2);
+    } else if (!bChanged) {
+      break;
+    }
   }
 
   // Recover optimized pose and return number of inliers
-  g2o::VertexSE3Expmap* vSE3_recov = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(0));
-  g2o::SE3Quat SE3quat_recov = vSE3_recov->estimate();
-  pFrame->SetPose(Converter::toMatrix4d(SE3quat_recov));
+  pFrame->SetPose(Converter::toMatrix4d(Tcw));
 
   return nInitialCorrespondences-nBad;
 }
 
-void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap) {
+int Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap, int nThreads,
+                                     MapPointBatch* pBatch, const LocalBABudget *pBudget) {
+  const LocalBABudget budget = pBudget ? *pBudget : LocalBABudget();
+
   // Local KeyFrames: First Breath Search from Current Keyframe
   list<KeyFrame*> lLocalKeyFrames;
 
   lLocalKeyFrames.push_back(pKF);
   pKF->mnBALocalForKF = pKF->mnId;
 
+  // Covisibles are sorted by weight, the ones left out become fixed if they see local points
   const vector<KeyFrame*> vNeighKFs = pKF->GetVectorCovisibleKeyFrames();
   for (int i = 0, iend=vNeighKFs.size(); i < iend; i++) {
+    if (budget.nMaxLocalKFs > 0 && static_cast<int>(lLocalKeyFrames.size()) >= budget.nMaxLocalKFs)
+      break;
     KeyFrame* pKFi = vNeighKFs[i];
     pKFi->mnBALocalForKF = pKF->mnId;
     if (!pKFi->isBad())
@@ -447,28 +775,57 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
   // Fixed Keyframes. Keyframes that see Local MapPoints but that are not Local Keyframes
   list<KeyFrame*> lFixedCameras;
   for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
-    map<KeyFrame*, size_t> observations = (*lit)->GetObservations();
-    for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
-      KeyFrame* pKFi = mit->first;
-
+    (*lit)->ForEachObservation([&](KeyFrame* pKFi, size_t) {
       if (pKFi->mnBALocalForKF!=pKF->mnId && pKFi->mnBAFixedForKF!=pKF->mnId) {
         pKFi->mnBAFixedForKF=pKF->mnId;
         if (!pKFi->isBad())
           lFixedCameras.push_back(pKFi);
       }
+    });
+  }
+
+  // Keep the fixed keyframes observing more local points, the rest are left out of the problem
+  if (budget.nMaxFixedKFs > 0 && static_cast<int>(lFixedCameras.size()) > budget.nMaxFixedKFs) {
+    std::unordered_map<KeyFrame*, int> nObs;
+    for (KeyFrame* pKFi : lFixedCameras)
+      nObs[pKFi] = 0;
+    for (MapPoint* pMP : lLocalMapPoints) {
+      pMP->ForEachObservation([&](KeyFrame* pKFi, size_t) {
+        std::unordered_map<KeyFrame*, int>::iterator it = nObs.find(pKFi);
+        if (it != nObs.end())
+          it->second++;
+      });
     }
+
+    vector<KeyFrame*> vFixed(lFixedCameras.begin(), lFixedCameras.end());
+    std::sort(vFixed.begin(), vFixed.end(), [&nObs](KeyFrame* a, KeyFrame* b) {
+      const int na = nObs[a], nb = nObs[b];
+      return na > nb || (na == nb && a->mnId < b->mnId);
+    });
+    for (size_t i = budget.nMaxFixedKFs; i < vFixed.size(); i++)
+      vFixed[i]->mnBAFixedForKF = 0;
+    vFixed.resize(budget.nMaxFixedKFs);
+    lFixedCameras.assign(vFixed.begin(), vFixed.end());
   }
 
+  // Keyframes with a vertex in the problem
+  auto InProblem = [pKF](KeyFrame* pKFi) {
+    return pKFi->mnBALocalForKF == pKF->mnId || pKFi->mnBAFixedForKF == pKF->mnId;
+  };
+
   // Setup optimizer
+  static thread_local g2o::GraphArena arena;
+  g2o::ScopedGraphArena arenaScope(arena);
   g2o::SparseOptimizer optimizer;
   g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-  linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+  linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3::PoseMatrixType>(lLocalKeyFrames.size());
 
   g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
   g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
   optimizer.setAlgorithm(solver);
+  optimizer.setNumThreads(nThreads);
 
   if (pbStopFlag)
     optimizer.setForceStopFlag(pbStopFlag);
@@ -500,24 +857,25 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
   }
 
   // Set MapPoint vertices
+  ScratchScope scratch;
   const int nExpectedSize = (lLocalKeyFrames.size()+lFixedCameras.size())*lLocalMapPoints.size();
 
-  vector<g2o::EdgeSE3ProjectXYZ*> vpEdgesMono;
+  ScratchVector<g2o::EdgeSE3ProjectXYZ*> vpEdgesMono;
   vpEdgesMono.reserve(nExpectedSize);
 
-  vector<KeyFrame*> vpEdgeKFMono;
+  ScratchVector<KeyFrame*> vpEdgeKFMono;
   vpEdgeKFMono.reserve(nExpectedSize);
 
-  vector<MapPoint*> vpMapPointEdgeMono;
+  ScratchVector<MapPoint*> vpMapPointEdgeMono;
   vpMapPointEdgeMono.reserve(nExpectedSize);
 
-  vector<g2o::EdgeStereoSE3ProjectXYZ*> vpEdgesStereo;
+  ScratchVector<g2o::EdgeStereoSE3ProjectXYZ*> vpEdgesStereo;
   vpEdgesStereo.reserve(nExpectedSize);
 
-  vector<KeyFrame*> vpEdgeKFStereo;
+  ScratchVector<KeyFrame*> vpEdgeKFStereo;
   vpEdgeKFStereo.reserve(nExpectedSize);
 
-  vector<MapPoint*> vpMapPointEdgeStereo;
+  ScratchVector<MapPoint*> vpMapPointEdgeStereo;
   vpMapPointEdgeStereo.reserve(nExpectedSize);
 
   const float thHuberMono = sqrt(5.991);
@@ -532,13 +890,22 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     vPoint->setMarginalized(true);
     optimizer.addVertex(vPoint);
 
-    const map<KeyFrame*, size_t> observations = pMP->GetObservations();
+    MapPoint::ObservationVector observations = pMP->GetObservations();
+
+    // Subsample observations, local keyframes first so every local point keeps a local observation
+    size_t nObservations = observations.size();
+    if (budget.nMaxObservations > 0 && nObservations > static_cast<size_t>(budget.nMaxObservations)) {
+      std::stable_partition(observations.begin(), observations.end(), [pKF](const MapPoint::Observation &obs) {
+        return obs.first->mnBALocalForKF == pKF->mnId;
+      });
+      nObservations = budget.nMaxObservations;
+    }
 
     //Set edges
-    for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+    for (MapPoint::ObservationVector::const_iterator mit=observations.begin(), mend=observations.begin()+nObservations; mit != mend; mit++) {
       KeyFrame* pKFi = mit->first;
 
-      if (!pKFi->isBad()) {
+      if (!pKFi->isBad() && InProblem(pKFi)) {
         const cv::KeyPoint &kpUn = pKFi->mvKeysUn[mit->second];
 
         // Monocular observation
@@ -603,10 +970,11 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
 
   if (pbStopFlag)
     if (*pbStopFlag)
-      return;
+      return lLocalKeyFrames.size();
 
+  RecordGraphBytes(optimizer);
   optimizer.initializeOptimization();
-  optimizer.optimize(5);
+  Metrics::Add(Metrics::LOCAL_BA_ITERATIONS, optimizer.optimize(5));
 
   bool bDoMore= true;
 
@@ -648,11 +1016,11 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
   // Optimize again without the outliers
 
   optimizer.initializeOptimization(0);
-  optimizer.optimize(10);
+  Metrics::Add(Metrics::LOCAL_BA_ITERATIONS, optimizer.optimize(10));
 
   }
 
-  vector<std::pair<KeyFrame*,MapPoint*> > vToErase;
+  ScratchVector<std::pair<KeyFrame*,MapPoint*> > vToErase;
   vToErase.reserve(vpEdgesMono.size()+vpEdgesStereo.size());
 
   // Check inlier observations
@@ -683,7 +1051,7 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
   }
 
   // Get Map Mutex
-  unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+  unique_lock<mutex> lock = TraceLock(pMap->mMutexMapUpdate, "MapUpdate");
 
   if (!vToErase.empty()) {
     for (size_t i = 0; i < vToErase.size(); i++) {
@@ -704,27 +1072,491 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     pKF->SetPose(Converter::toMatrix4d(SE3quat));
   }
 
-  //Points
+  //Points. Without pBatch, normals and depths are updated here all together
+  MapPointBatch batch;
+  MapPointBatch* pUpdates = pBatch ? pBatch : &batch;
   for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
     MapPoint* pMP = *lit;
     g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(pMP->mnId+maxKFid+1));
     pMP->SetWorldPos(vPoint->estimate());
-    pMP->UpdateNormalAndDepth();
+    pUpdates->Add(pMP, false);
+  }
+  batch.Apply(nullptr, 0);
+
+  return lLocalKeyFrames.size();
+}
+
+
+// Accumulate Hessian blocks of an inlier observation. Returns false if it is an outlier
+template <typename EdgeType>
+static bool AddObservationHessian(EdgeType* e, const double th, const map<int, int> &indices, Eigen::Matrix3d &Hll,
+                                  vector<std::pair<int, Eigen::Matrix<double, 6, 9> >,
+                                  Eigen::aligned_allocator<std::pair<int, Eigen::Matrix<double, 6, 9> > > > &vBlocks) {
+  e->computeError();
+  if (e->level() != 0 || e->chi2() > th || !e->isDepthPositive())
+    return false;
+
+  e->linearizeOplus();
+  const auto &Jl = e->jacobianOplusXi();
+  const auto &Jp = e->jacobianOplusXj();
+  Hll += Jl.transpose()*e->information()*Jl;
+
+  // Fixed keyframes only add point information
+  auto it = indices.find(e->vertex(1)->id());
+  if (it == indices.end())
+    return true;
+
+  // Hpp and Hpl stacked side by side
+  Eigen::Matrix<double, 6, 9> block;
+  block.leftCols<6>() = Jp.transpose()*e->information()*Jp;
+  block.rightCols<3>() = Jp.transpose()*e->information()*Jl;
+  vBlocks.push_back(std::make_pair(it->second, block));
+  return true;
+}
+
+// Inverse of a positive semidefinite matrix, ignoring its null space
+static Eigen::MatrixXd PseudoInverse(const Eigen::MatrixXd &A) {
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> es(A);
+  const Eigen::VectorXd &vals = es.eigenvalues();
+  const double th = 1e-9*std::max(vals.cwiseAbs().maxCoeff(), 1e-12);
+
+  Eigen::VectorXd inv = Eigen::VectorXd::Zero(vals.size());
+  for (int i = 0; i < vals.size(); i++) {
+    if (vals(i) > th)
+      inv(i) = 1.0/vals(i);
+  }
+
+  return es.eigenvectors()*inv.asDiagonal()*es.eigenvectors().transpose();
+}
+
+void Optimizer::WindowBundleAdjustment(const vector<KeyFrame*> &vpWindowKFs, KeyFrame* pKFMarg, bool* pbStopFlag,
+                                       Map* pMap, int nThreads, MapPointBatch* pBatch) {
+  // Window keyframes, oldest first. Current keyframe is the last one
+  vector<KeyFrame*> vpKFs;
+  vpKFs.reserve(vpWindowKFs.size());
+  for (KeyFrame* pKFi : vpWindowKFs) {
+    if (!pKFi->isBad())
+      vpKFs.push_back(pKFi);
+  }
+
+  if (vpKFs.size() < 2)
+    return;
+
+  KeyFrame* pKF = vpKFs.back();
+  bool bPriors = false;
+  for (KeyFrame* pKFi : vpKFs) {
+    pKFi->mnBALocalForKF = pKF->mnId;
+    if (pKFi->mbPosePrior)
+      bPriors = true;
+  }
+
+  // MapPoints seen at least twice inside the window. Points with a single observation
+  // add no information to the poses
+  list<MapPoint*> lLocalMapPoints;
+  for (KeyFrame* pKFi : vpKFs) {
+    vector<MapPoint*> vpMPs = pKFi->GetMapPointMatches();
+    for (MapPoint* pMP : vpMPs) {
+      if (!pMP || pMP->isBad() || pMP->mnBALocalForKF == pKF->mnId)
+        continue;
+
+      int nObs = 0;
+      pMP->ForEachObservation([&](KeyFrame* pKFi, size_t) {
+        if (pKFi->mnBALocalForKF == pKF->mnId)
+          nObs++;
+      });
+
+      pMP->mnBALocalForKF = pKF->mnId;
+      if (nObs >= 2)
+        lLocalMapPoints.push_back(pMP);
+    }
+  }
+
+  // Setup optimizer
+  static thread_local g2o::GraphArena arena;
+  g2o::ScopedGraphArena arenaScope(arena);
+  g2o::SparseOptimizer optimizer;
+  g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
+
+  linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3::PoseMatrixType>(vpKFs.size());
+
+  g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
+
+  g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+  optimizer.setAlgorithm(solver);
+  optimizer.setNumThreads(nThreads);
+
+  if (pbStopFlag)
+    optimizer.setForceStopFlag(pbStopFlag);
+
+  unsigned long maxKFid = 0;
+
+  // Set KeyFrame vertices. Without priors the gauge is fixed by the oldest keyframe
+  static thread_local KeyFrame::PoseVector vTcw;
+  KeyFrame::GetPoses(vpKFs, vTcw);
+
+  map<int, int> indices;
+  for (size_t i = 0; i < vpKFs.size(); i++) {
+    KeyFrame* pKFi = vpKFs[i];
+    g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
+    vSE3->setEstimate(Converter::toSE3Quat(vTcw[i]));
+    vSE3->setId(pKFi->mnId);
+    vSE3->setFixed(pKFi->mnId == 0 || (!bPriors && i == 0));
+    optimizer.addVertex(vSE3);
+    if (pKFi->mnId>maxKFid)
+      maxKFid=pKFi->mnId;
+
+    if (vSE3->fixed())
+      continue;
+
+    int k = indices.size();
+    indices[pKFi->mnId] = k;
+
+    // Prior left by marginalized keyframes
+    if (pKFi->mbPosePrior) {
+      g2o::EdgeSE3Prior* e = new g2o::EdgeSE3Prior();
+      e->setVertex(0, vSE3);
+      e->setMeasurement(Converter::toSE3Quat(pKFi->mTcwPrior));
+      e->setInformation(pKFi->mPosePriorInfo);
+      optimizer.addEdge(e);
+    }
+  }
+
+  // Set MapPoint vertices
+  ScratchScope scratch;
+  const int nExpectedSize = vpKFs.size()*lLocalMapPoints.size();
+
+  ScratchVector<g2o::EdgeSE3ProjectXYZ*> vpEdgesMono;
+  vpEdgesMono.reserve(nExpectedSize);
+
+  ScratchVector<KeyFrame*> vpEdgeKFMono;
+  vpEdgeKFMono.reserve(nExpectedSize);
+
+  ScratchVector<MapPoint*> vpMapPointEdgeMono;
+  vpMapPointEdgeMono.reserve(nExpectedSize);
+
+  ScratchVector<g2o::EdgeStereoSE3ProjectXYZ*> vpEdgesStereo;
+  vpEdgesStereo.reserve(nExpectedSize);
+
+  ScratchVector<KeyFrame*> vpEdgeKFStereo;
+  vpEdgeKFStereo.reserve(nExpectedSize);
+
+  ScratchVector<MapPoint*> vpMapPointEdgeStereo;
+  vpMapPointEdgeStereo.reserve(nExpectedSize);
+
+  const float thHuberMono = sqrt(5.991);
+  const float thHuberStereo = sqrt(7.815);
+
+  for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
+    MapPoint* pMP = *lit;
+    g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
+    vPoint->setEstimate(pMP->GetWorldPos());
+    int id = pMP->mnId+maxKFid+1;
+    vPoint->setId(id);
+    vPoint->setMarginalized(true);
+    optimizer.addVertex(vPoint);
+
+    const MapPoint::ObservationVector observations = pMP->GetObservations();
+
+    // Set edges, only with window keyframes
+    for (MapPoint::ObservationVector::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+      KeyFrame* pKFi = mit->first;
+
+      if (pKFi->mnBALocalForKF != pKF->mnId || pKFi->isBad())
+        continue;
+
+      const cv::KeyPoint &kpUn = pKFi->mvKeysUn[mit->second];
+      const float &invSigma2 = pKFi->mvInvLevelSigma2[kpUn.octave];
+
+      // Monocular observation
+      if (pKFi->mvuRight[mit->second] < 0) {
+        Eigen::Matrix<double, 2, 1> obs;
+        obs << kpUn.pt.x, kpUn.pt.y;
+
+        g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
+
+        e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
+        e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFi->mnId)));
+        e->setMeasurement(obs);
+        e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
+
+        g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
+        e->setRobustKernel(rk);
+        rk->setDelta(thHuberMono);
+
+        e->fx = pKFi->fx;
+        e->fy = pKFi->fy;
+        e->cx = pKFi->cx;
+        e->cy = pKFi->cy;
+
+        optimizer.addEdge(e);
+        vpEdgesMono.push_back(e);
+        vpEdgeKFMono.push_back(pKFi);
+        vpMapPointEdgeMono.push_back(pMP);
+      } else {
+        // Stereo observation
+        Eigen::Matrix<double, 3, 1> obs;
+        const float kp_ur = pKFi->mvuRight[mit->second];
+        obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
+
+        g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
+
+        e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
+        e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFi->mnId)));
+        e->setMeasurement(obs);
+        e->setInformation(Eigen::Matrix3d::Identity()*invSigma2);
+
+        g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
+        e->setRobustKernel(rk);
+        rk->setDelta(thHuberStereo);
+
+        e->fx = pKFi->fx;
+        e->fy = pKFi->fy;
+        e->cx = pKFi->cx;
+        e->cy = pKFi->cy;
+        e->bf = pKFi->mbf;
+
+        optimizer.addEdge(e);
+        vpEdgesStereo.push_back(e);
+        vpEdgeKFStereo.push_back(pKFi);
+        vpMapPointEdgeStereo.push_back(pMP);
+      }
+    }
+  }
+
+  if (pbStopFlag)
+    if (*pbStopFlag)
+      return;
+
+  RecordGraphBytes(optimizer);
+  optimizer.initializeOptimization();
+  Metrics::Add(Metrics::LOCAL_BA_ITERATIONS, optimizer.optimize(5));
+
+  bool bDoMore = true;
+
+  if (pbStopFlag)
+    if (*pbStopFlag)
+      bDoMore = false;
+
+  if (bDoMore) {
+    // Check inlier observations
+    for (size_t i = 0, iend=vpEdgesMono.size(); i < iend; i++) {
+      g2o::EdgeSE3ProjectXYZ* e = vpEdgesMono[i];
+      if (e->chi2()>5.991 || !e->isDepthPositive())
+        e->setLevel(1);
+      e->setRobustKernel(0);
+    }
+
+    for (size_t i = 0, iend=vpEdgesStereo.size(); i < iend; i++) {
+      g2o::EdgeStereoSE3ProjectXYZ* e = vpEdgesStereo[i];
+      if (e->chi2()>7.815 || !e->isDepthPositive())
+        e->setLevel(1);
+      e->setRobustKernel(0);
+    }
+
+    // Optimize again without the outliers
+    optimizer.initializeOptimization(0);
+    Metrics::Add(Metrics::LOCAL_BA_ITERATIONS, optimizer.optimize(10));
+  }
+
+  ScratchVector<std::pair<KeyFrame*,MapPoint*> > vToErase;
+  vToErase.reserve(vpEdgesMono.size()+vpEdgesStereo.size());
+
+  // Check inlier observations
+  for (size_t i = 0, iend=vpEdgesMono.size(); i < iend; i++) {
+    g2o::EdgeSE3ProjectXYZ* e = vpEdgesMono[i];
+    MapPoint* pMP = vpMapPointEdgeMono[i];
+
+    if (pMP->isBad())
+      continue;
+
+    if (e->chi2()>5.991 || !e->isDepthPositive())
+      vToErase.push_back(std::make_pair(vpEdgeKFMono[i], pMP));
+  }
+
+  for (size_t i = 0, iend=vpEdgesStereo.size(); i < iend; i++) {
+    g2o::EdgeStereoSE3ProjectXYZ* e = vpEdgesStereo[i];
+    MapPoint* pMP = vpMapPointEdgeStereo[i];
+
+    if (pMP->isBad())
+      continue;
+
+    if (e->chi2()>7.815 || !e->isDepthPositive())
+      vToErase.push_back(std::make_pair(vpEdgeKFStereo[i], pMP));
   }
+
+  // Marginalize oldest keyframe. Points are eliminated first (Schur complement), then the
+  // keyframe itself. Resulting information is kept as a pose prior per remaining keyframe
+  if (pKFMarg && pKFMarg->mnBALocalForKF == pKF->mnId && !indices.empty()) {
+    const int K = indices.size();
+    Eigen::MatrixXd S = Eigen::MatrixXd::Zero(6*K, 6*K);
+
+    for (KeyFrame* pKFi : vpKFs) {
+      auto it = indices.find(pKFi->mnId);
+      if (it != indices.end() && pKFi->mbPosePrior)
+        S.block<6, 6>(6*it->second, 6*it->second) += pKFi->mPosePriorInfo;
+    }
+
+    vector<std::pair<int, Eigen::Matrix<double, 6, 9> >,
+           Eigen::aligned_allocator<std::pair<int, Eigen::Matrix<double, 6, 9> > > > vBlocks;
+
+    for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
+      g2o::OptimizableGraph::Vertex* vPoint = optimizer.vertex((*lit)->mnId+maxKFid+1);
+      Eigen::Matrix3d Hll = Eigen::Matrix3d::Zero();
+      vBlocks.clear();
+
+      for (g2o::HyperGraph::Edge* pEdge : vPoint->edges()) {
+        if (g2o::EdgeSE3ProjectXYZ* e = dynamic_cast<g2o::EdgeSE3ProjectXYZ*>(pEdge))
+          AddObservationHessian(e, 5.991, indices, Hll, vBlocks);
+        else if (g2o::EdgeStereoSE3ProjectXYZ* e = dynamic_cast<g2o::EdgeStereoSE3ProjectXYZ*>(pEdge))
+          AddObservationHessian(e, 7.815, indices, Hll, vBlocks);
+      }
+
+      // Skip points without depth information
+      Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(Hll);
+      if (vBlocks.empty() || es.eigenvalues()(0) <= 1e-9*std::max(es.eigenvalues()(2), 1e-12))
+        continue;
+
+      const Eigen::Matrix3d HllInv = Hll.inverse();
+      for (size_t a = 0; a < vBlocks.size(); a++) {
+        const int ka = vBlocks[a].first;
+        S.block<6, 6>(6*ka, 6*ka) += vBlocks[a].second.leftCols<6>();
+
+        const Eigen::Matrix<double, 6, 3> HplInv = vBlocks[a].second.rightCols<3>()*HllInv;
+        for (size_t b = 0; b < vBlocks.size(); b++) {
+          const int kb = vBlocks[b].first;
+          S.block<6, 6>(6*ka, 6*kb) -= HplInv*vBlocks[b].second.rightCols<3>().transpose();
+        }
+      }
+    }
+
+    // Eliminate keyframe. If it was fixed, the remaining poses are just conditioned on it
+    vector<KeyFrame*> vpRemaining;
+    vector<int> vIdx;
+    for (KeyFrame* pKFi : vpKFs) {
+      auto it = indices.find(pKFi->mnId);
+      if (pKFi != pKFMarg && it != indices.end()) {
+        vpRemaining.push_back(pKFi);
+        vIdx.push_back(it->second);
+      }
+    }
+
+    const int R = vIdx.size();
+    Eigen::MatrixXd P(6*R, 6*R);
+    for (int a = 0; a < R; a++)
+      for (int b = 0; b < R; b++)
+        P.block<6, 6>(6*a, 6*b) = S.block<6, 6>(6*vIdx[a], 6*vIdx[b]);
+
+    auto itm = indices.find(pKFMarg->mnId);
+    if (itm != indices.end() && R > 0) {
+      const int km = itm->second;
+      Eigen::MatrixXd SRm(6*R, 6);
+      for (int a = 0; a < R; a++)
+        SRm.block<6, 6>(6*a, 0) = S.block<6, 6>(6*vIdx[a], 6*km);
+
+      const Eigen::Matrix<double, 6, 6> Smm = S.block<6, 6>(6*km, 6*km);
+      P -= SRm*PseudoInverse(Smm)*SRm.transpose();
+    }
+
+    // Joint prior is dense, keep for each keyframe its marginal information
+    if (R > 0) {
+      const Eigen::MatrixXd Cov = PseudoInverse(P);
+      for (int a = 0; a < R; a++) {
+        const Eigen::Matrix<double, 6, 6> Ca = Cov.block<6, 6>(6*a, 6*a);
+        if (Ca.trace() <= 0)
+          continue;
+
+        KeyFrame* pKFi = vpRemaining[a];
+        g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(pKFi->mnId));
+        pKFi->mTcwPrior = Converter::toMatrix4d(vSE3->estimate());
+        pKFi->mPosePriorInfo = PseudoInverse(Ca);
+        pKFi->mbPosePrior = true;
+      }
+    }
+
+    pKFMarg->mbPosePrior = false;
+  }
+
+  // Get Map Mutex
+  unique_lock<mutex> lock = TraceLock(pMap->mMutexMapUpdate, "MapUpdate");
+
+  if (!vToErase.empty()) {
+    for (size_t i = 0; i < vToErase.size(); i++) {
+      KeyFrame* pKFi = vToErase[i].first;
+      MapPoint* pMPi = vToErase[i].second;
+      pKFi->EraseMapPointMatch(pMPi);
+      pMPi->EraseObservation(pKFi);
+    }
+  }
+
+  // Recover optimized data
+
+  //Keyframes
+  for (KeyFrame* pKFi : vpKFs) {
+    g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(pKFi->mnId));
+    pKFi->SetPose(Converter::toMatrix4d(vSE3->estimate()));
+  }
+
+  //Points. Without pBatch, normals and depths are updated here all together
+  MapPointBatch batch;
+  MapPointBatch* pUpdates = pBatch ? pBatch : &batch;
+  for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
+    MapPoint* pMP = *lit;
+    g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(pMP->mnId+maxKFid+1));
+    pMP->SetWorldPos(vPoint->estimate());
+    pUpdates->Add(pMP, false);
+  }
+  batch.Apply(nullptr, 0);
+}
+
+// Run f(i) for i in [0, n) in blocks, in the pool if given
+static void ParallelForBlocks(ThreadPool* pPool, int nThreads, size_t n, const std::function<void(size_t)> &f) {
+  if (!pPool) {
+    for (size_t i = 0; i < n; i++)
+      f(i);
+    return;
+  }
+
+  const size_t block = 256;
+  const int nBlocks = (n+block-1)/block;
+  pPool->ParallelFor(nBlocks, [&](int b) {
+    const size_t end = std::min(n, (b+1)*block);
+    for (size_t i = b*block; i < end; i++)
+      f(i);
+  }, nThreads);
 }
 
+// Essential graph edge from vertex i to vertex j
+struct EssentialEdge {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  int nIDi;
+  int nIDj;
+  g2o::Sim3 Sji;
+  double information;  // Scale of identity information
+};
+
+typedef vector<EssentialEdge, Eigen::aligned_allocator<EssentialEdge> > EssentialEdges;
 
 void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                      const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                      const LoopClosing::KeyFrameAndPose &CorrectedSim3,
-                     const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale) {
-  // Setup optimizer
+                     const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale,
+                     ThreadPool* pPool, int nThreads) {
+  // Setup optimizer. With fixed scale the graph is SE3, with 6x6 blocks and no Sim3 in the inner loop
+  static thread_local g2o::GraphArena arena;
+  g2o::ScopedGraphArena arenaScope(arena);
   g2o::SparseOptimizer optimizer;
   optimizer.setVerbose(false);
-  g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
-       new g2o::LinearSolverEigen<g2o::BlockSolver_7_3::PoseMatrixType>();
-  g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
-  g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+  g2o::OptimizationAlgorithmLevenberg* solver;
+  if (bFixScale) {
+    g2o::BlockSolver_6_3::LinearSolverType * linearSolver =
+         CreateLinearSolver<g2o::BlockSolver_6_3::PoseMatrixType>(pMap->KeyFramesInMap());
+    solver = new g2o::OptimizationAlgorithmLevenberg(new g2o::BlockSolver_6_3(linearSolver));
+  } else {
+    g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+         CreateLinearSolver<g2o::BlockSolver_7_3::PoseMatrixType>(pMap->KeyFramesInMap());
+    solver = new g2o::OptimizationAlgorithmLevenberg(new g2o::BlockSolver_7_3(linearSolver));
+  }
 
   solver->setUserLambdaInit(1e-16);
   optimizer.setAlgorithm(solver);
@@ -736,48 +1568,81 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
   vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3> > vScw(nMaxKFid+1);
   vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3> > vCorrectedSwc(nMaxKFid+1);
-  vector<g2o::VertexSim3Expmap*> vpVertices(nMaxKFid+1);
 
   const int minFeat = 100;
+  const int nMaxCovisibleEdges = Config::EssentialEdges();
 
-  // Set KeyFrame vertices
-  for (size_t i = 0, iend=vpKFs.size(); i < iend; i++) {
+  // Initial poses
+  vector<char> vbValid(vpKFs.size());
+  ParallelForBlocks(pPool, nThreads, vpKFs.size(), [&](size_t i) {
     KeyFrame* pKF = vpKFs[i];
-    if (pKF->isBad())
-      continue;
-    g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
-
-    const int nIDi = pKF->mnId;
+    vbValid[i] = !pKF->isBad();
+    if (!vbValid[i])
+      return;
 
     LoopClosing::KeyFrameAndPose::const_iterator it = CorrectedSim3.find(pKF);
 
     if (it!=CorrectedSim3.end()) {
-      vScw[nIDi] = it->second;
-      VSim3->setEstimate(it->second);
+      vScw[pKF->mnId] = it->second;
     } else {
       Eigen::Matrix<double, 3, 3> Rcw = pKF->GetRotation();
       Eigen::Matrix<double, 3, 1> tcw = pKF->GetTranslation();
-      g2o::Sim3 Siw(Rcw, tcw, 1.0);
-      vScw[nIDi] = Siw;
-      VSim3->setEstimate(Siw);
+      vScw[pKF->mnId] = g2o::Sim3(Rcw, tcw, 1.0);
     }
+  });
 
-    if (pKF==pLoopKF)
-      VSim3->setFixed(true);
+  // Set KeyFrame vertices
+  for (size_t i = 0, iend=vpKFs.size(); i < iend; i++) {
+    KeyFrame* pKF = vpKFs[i];
+    if (!vbValid[i])
+      continue;
 
-    VSim3->setId(nIDi);
-    VSim3->setMarginalized(false);
-    VSim3->_fix_scale = bFixScale;
+    const int nIDi = pKF->mnId;
+    g2o::OptimizableGraph::Vertex* v;
 
-    optimizer.addVertex(VSim3);
+    if (bFixScale) {
+      g2o::VertexSE3Expmap* VSE3 = new g2o::VertexSE3Expmap();
+      VSE3->setEstimate(g2o::SE3Quat(vScw[nIDi].rotation(), vScw[nIDi].translation()));
+      v = VSE3;
+    } else {
+      g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+      VSim3->setEstimate(vScw[nIDi]);
+      VSim3->_fix_scale = false;
+      v = VSim3;
+    }
+
+    if (pKF==pLoopKF)
+      v->setFixed(true);
 
-    vpVertices[nIDi]=VSim3;
+    v->setId(nIDi);
+    v->setMarginalized(false);
+
+    optimizer.addVertex(v);
   }
 
 
   set<std::pair<long unsigned int,long unsigned int> > sInsertedEdges;
 
-  const Eigen::Matrix<double, 7, 7> matLambda = Eigen::Matrix<double, 7, 7>::Identity();
+  // Relative pose edge from vertex i to vertex j, with scaled identity information
+  auto AddEdge = [&](int nIDi, int nIDj, const g2o::Sim3 &Sji, double information) {
+    g2o::OptimizableGraph::Edge* e;
+    if (bFixScale) {
+      g2o::EdgeSE3* eSE3 = new g2o::EdgeSE3();
+      eSE3->setMeasurement(g2o::SE3Quat(Sji.rotation(), Sji.translation()));
+      eSE3->information().setIdentity();
+      eSE3->information() *= information;
+      e = eSE3;
+    } else {
+      g2o::EdgeSim3* eSim3 = new g2o::EdgeSim3();
+      eSim3->setMeasurement(Sji);
+      eSim3->information().setIdentity();
+      eSim3->information() *= information;
+      e = eSim3;
+    }
+    e->setVertex(1, optimizer.vertex(nIDj));
+    e->setVertex(0, optimizer.vertex(nIDi));
+    optimizer.addEdge(e);
+  };
 
   // Set Loop edges
   for (map<KeyFrame *, set<KeyFrame *> >::const_iterator mit = LoopConnections.begin(), mend=LoopConnections.end(); mit != mend; mit++) {
@@ -793,60 +1658,40 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
         continue;
 
       const g2o::Sim3 Sjw = vScw[nIDj];
-      const g2o::Sim3 Sji = Sjw * Swi;
-
-      g2o::EdgeSim3* e = new g2o::EdgeSim3();
-      e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-      e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-      e->setMeasurement(Sji);
-
-      e->information() = matLambda;
-
-      optimizer.addEdge(e);
+      AddEdge(nIDi, nIDj, Sjw * Swi, 1.0);
 
       sInsertedEdges.insert(std::make_pair(std::min(nIDi,nIDj), std::max(nIDi,nIDj)));
     }
   }
 
-  // Set normal edges
-  for (size_t i = 0, iend=vpKFs.size(); i < iend; i++) {
+  // Non-corrected pose of a keyframe
+  auto GetSw = [&](KeyFrame* pKFj) -> g2o::Sim3 {
+    LoopClosing::KeyFrameAndPose::const_iterator it = NonCorrectedSim3.find(pKFj);
+    if (it != NonCorrectedSim3.end())
+      return it->second;
+    else
+      return vScw[pKFj->mnId];
+  };
+
+  // Normal edges of every keyframe are collected in parallel. Graph is only read here,
+  // edges are inserted afterwards in keyframe order
+  vector<EssentialEdges> vEdges(vpKFs.size());
+  ParallelForBlocks(pPool, nThreads, vpKFs.size(), [&](size_t i) {
     KeyFrame* pKF = vpKFs[i];
+    EssentialEdges &edges = vEdges[i];
 
     const int nIDi = pKF->mnId;
-
-    g2o::Sim3 Swi;
-
-    LoopClosing::KeyFrameAndPose::const_iterator iti = NonCorrectedSim3.find(pKF);
-
-    if (iti != NonCorrectedSim3.end())
-      Swi = (iti->second).inverse();
-    else
-      Swi = vScw[nIDi].inverse();
-
-    KeyFrame* pParentKF = pKF->GetParent();
+    const g2o::Sim3 Swi = GetSw(pKF).inverse();
 
     // Spanning tree edge
+    KeyFrame* pParentKF = pKF->GetParent();
     if (pParentKF) {
-      int nIDj = pParentKF->mnId;
-
-      g2o::Sim3 Sjw;
-
-      LoopClosing::KeyFrameAndPose::const_iterator itj = NonCorrectedSim3.find(pParentKF);
-
-      if (itj != NonCorrectedSim3.end())
-        Sjw = itj->second;
-      else
-        Sjw = vScw[nIDj];
-
-      g2o::Sim3 Sji = Sjw * Swi;
-
-      g2o::EdgeSim3* e = new g2o::EdgeSim3();
-      e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-      e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-      e->setMeasurement(Sji);
-
-      e->information() = matLambda;
-      optimizer.addEdge(e);
+      EssentialEdge edge;
+      edge.nIDi = nIDi;
+      edge.nIDj = pParentKF->mnId;
+      edge.Sji = GetSw(pParentKF) * Swi;
+      edge.information = 1.0;
+      edges.push_back(edge);
     }
 
     // Loop edges
@@ -854,61 +1699,60 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
     for (set<KeyFrame*>::const_iterator sit = sLoopEdges.begin(), send = sLoopEdges.end(); sit != send; sit++) {
       KeyFrame* pLKF = *sit;
       if (pLKF->mnId<pKF->mnId) {
-        g2o::Sim3 Slw;
-
-        LoopClosing::KeyFrameAndPose::const_iterator itl = NonCorrectedSim3.find(pLKF);
-
-        if (itl!=NonCorrectedSim3.end())
-          Slw = itl->second;
-        else
-          Slw = vScw[pLKF->mnId];
-
-        g2o::Sim3 Sli = Slw * Swi;
-        g2o::EdgeSim3* el = new g2o::EdgeSim3();
-        el->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pLKF->mnId)));
-        el->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-        el->setMeasurement(Sli);
-        el->information() = matLambda;
-        optimizer.addEdge(el);
+        EssentialEdge edge;
+        edge.nIDi = nIDi;
+        edge.nIDj = pLKF->mnId;
+        edge.Sji = GetSw(pLKF) * Swi;
+        edge.information = 1.0;
+        edges.push_back(edge);
       }
     }
 
-    // Covisibility graph edges
-    const vector<KeyFrame*> vpConnectedKFs = pKF->GetCovisiblesByWeight(minFeat);
+    // Covisibility graph edges, strongest first. Revisited places would connect a keyframe to
+    // every older one seen there, so only the strongest nMaxCovisibleEdges are kept and the
+    // weight of the dropped ones is spread over them, keeping the total information
+    const size_t nFirstCovisible = edges.size();
+    int nKeptWeight = 0, nTotalWeight = 0;
+    const vector<KeyFrame*> vpConnectedKFs = pKF->GetEssentialCovisibles(minFeat);
     for (vector<KeyFrame*>::const_iterator vit=vpConnectedKFs.begin(); vit!=vpConnectedKFs.end(); vit++) {
       KeyFrame* pKFn = *vit;
-      if (pKFn && pKFn!=pParentKF && !pKF->hasChild(pKFn) && !sLoopEdges.count(pKFn)) {
-        if (!pKFn->isBad() && pKFn->mnId<pKF->mnId) {
-          if (sInsertedEdges.count(std::make_pair(std::min(pKF->mnId,pKFn->mnId), std::max(pKF->mnId,pKFn->mnId))))
-            continue;
-
-          g2o::Sim3 Snw;
-
-          LoopClosing::KeyFrameAndPose::const_iterator itn = NonCorrectedSim3.find(pKFn);
+      if (pKFn->isBad())
+        continue;
+      if (sInsertedEdges.count(std::make_pair(std::min(pKF->mnId,pKFn->mnId), std::max(pKF->mnId,pKFn->mnId))))
+        continue;
 
-          if (itn!=NonCorrectedSim3.end())
-            Snw = itn->second;
-          else
-            Snw = vScw[pKFn->mnId];
+      const int weight = pKF->GetWeight(pKFn);
+      nTotalWeight += weight;
+      if (nMaxCovisibleEdges > 0 && static_cast<int>(edges.size()-nFirstCovisible) >= nMaxCovisibleEdges)
+        continue;
 
-          g2o::Sim3 Sni = Snw * Swi;
+      EssentialEdge edge;
+      edge.nIDi = nIDi;
+      edge.nIDj = pKFn->mnId;
+      edge.Sji = GetSw(pKFn) * Swi;
+      edge.information = 1.0;
+      edges.push_back(edge);
+      nKeptWeight += weight;
+    }
 
-          g2o::EdgeSim3* en = new g2o::EdgeSim3();
-          en->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFn->mnId)));
-          en->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-          en->setMeasurement(Sni);
-          en->information() = matLambda;
-          optimizer.addEdge(en);
-        }
-      }
+    if (nKeptWeight > 0 && nTotalWeight > nKeptWeight) {
+      const double scale = static_cast<double>(nTotalWeight)/nKeptWeight;
+      for (size_t j = nFirstCovisible; j < edges.size(); j++)
+        edges[j].information = scale;
     }
+  });
+
+  for (size_t i = 0, iend=vEdges.size(); i < iend; i++) {
+    for (const EssentialEdge &edge : vEdges[i])
+      AddEdge(edge.nIDi, edge.nIDj, edge.Sji, edge.information);
   }
 
   // Optimize!
+  RecordGraphBytes(optimizer);
   optimizer.initializeOptimization();
   optimizer.optimize(20);
 
-  unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+  unique_lock<mutex> lock = TraceLock(pMap->mMutexMapUpdate, "MapUpdate");
 
   // SE3 Pose Recovering. Sim3:[sR t;0 1] -> SE3:[R t/s;0 1]
   for (size_t i = 0; i < vpKFs.size(); i++) {
@@ -916,8 +1760,13 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
     const int nIDi = pKFi->mnId;
 
-    g2o::VertexSim3Expmap* VSim3 = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(nIDi));
-    g2o::Sim3 CorrectedSiw =  VSim3->estimate();
+    g2o::Sim3 CorrectedSiw;
+    if (bFixScale) {
+      const g2o::SE3Quat Tiw = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(nIDi))->estimate();
+      CorrectedSiw = g2o::Sim3(Tiw.rotation(), Tiw.translation(), 1.0);
+    } else {
+      CorrectedSiw = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(nIDi))->estimate();
+    }
     vCorrectedSwc[nIDi]=CorrectedSiw.inverse();
     Eigen::Matrix3d eigR = CorrectedSiw.rotation().toRotationMatrix();
     Eigen::Vector3d eigt = CorrectedSiw.translation();
@@ -956,19 +1805,9 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 }
 
 int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &vpMatches1, g2o::Sim3 &g2oS12, const float th2, const bool bFixScale) {
-  g2o::SparseOptimizer optimizer;
-  g2o::BlockSolverX::LinearSolverType * linearSolver;
-
-  linearSolver = new g2o::LinearSolverDense<g2o::BlockSolverX::PoseMatrixType>();
-
-  g2o::BlockSolverX * solver_ptr = new g2o::BlockSolverX(linearSolver);
-
-  g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-  optimizer.setAlgorithm(solver);
-
-  // Calibration
-  Eigen::Matrix3d K1 = pKF1->mK;
-  Eigen::Matrix3d K2 = pKF2->mK;
+  // Two keyframes and fixed points, a fixed size problem does not need a generic graph
+  Sim3Optimizer optimizer;
+  optimizer.Clear(pKF1->mK, pKF2->mK, bFixScale);
 
   // Camera poses
   Eigen::Matrix3d R1w = pKF1->GetRotation();
@@ -976,37 +1815,15 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
   Eigen::Matrix3d R2w = pKF2->GetRotation();
   Eigen::Vector3d t2w = pKF2->GetTranslation();
 
-  // Set Sim3 vertex
-  g2o::VertexSim3Expmap * vSim3 = new g2o::VertexSim3Expmap();
-  vSim3->_fix_scale=bFixScale;
-  vSim3->setEstimate(g2oS12);
-  vSim3->setId(0);
-  vSim3->setFixed(false);
-  vSim3->_principle_point1[0] = K1(0, 2);
-  vSim3->_principle_point1[1] = K1(1, 2);
-  vSim3->_focal_length1[0] = K1(0, 0);
-  vSim3->_focal_length1[1] = K1(1, 1);
-  vSim3->_principle_point2[0] = K2(0, 2);
-  vSim3->_principle_point2[1] = K2(1, 2);
-  vSim3->_focal_length2[0] = K2(0, 0);
-  vSim3->_focal_length2[1] = K2(1, 1);
-  optimizer.addVertex(vSim3);
-
-  // Set MapPoint vertices
   const int N = vpMatches1.size();
-  const vector<MapPoint*> vpMapPoints1 = pKF1->GetMapPointMatches();
-  vector<g2o::EdgeSim3ProjectXYZ*> vpEdges12;
-  vector<g2o::EdgeInverseSim3ProjectXYZ*> vpEdges21;
-  vector<size_t> vnIndexEdge;
-
-  vnIndexEdge.reserve(2*N);
-  vpEdges12.reserve(2*N);
-  vpEdges21.reserve(2*N);
+  ScratchScope scratch;
+  ScratchVector<MapPoint*> vpMapPoints1;
+  pKF1->GetMapPointMatches(vpMapPoints1);
+  ScratchVector<size_t> vnIndexEdge;
+  vnIndexEdge.reserve(N);
 
   const float deltaHuber = sqrt(th2);
 
-  int nCorrespondences = 0;
-
   for (int i = 0; i < N; i++) {
     if (!vpMatches1[i])
       continue;
@@ -1014,94 +1831,37 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
     MapPoint* pMP1 = vpMapPoints1[i];
     MapPoint* pMP2 = vpMatches1[i];
 
-    const int id1 = 2*i+1;
-    const int id2 = 2*(i+1);
-
     const int i2 = pMP2->GetIndexInKeyFrame(pKF2);
 
-    if (pMP1 && pMP2) {
-      if (!pMP1->isBad() && !pMP2->isBad() && i2 >= 0) {
-        g2o::VertexSBAPointXYZ* vPoint1 = new g2o::VertexSBAPointXYZ();
-        Eigen::Vector3d P3D1w = pMP1->GetWorldPos();
-        Eigen::Vector3d P3D1c = R1w*P3D1w + t1w;
-        vPoint1->setEstimate(P3D1c);
-        vPoint1->setId(id1);
-        vPoint1->setFixed(true);
-        optimizer.addVertex(vPoint1);
-
-        g2o::VertexSBAPointXYZ* vPoint2 = new g2o::VertexSBAPointXYZ();
-        Eigen::Vector3d P3D2w = pMP2->GetWorldPos();
-        Eigen::Vector3d P3D2c = R2w*P3D2w + t2w;
-        vPoint2->setEstimate(P3D2c);
-        vPoint2->setId(id2);
-        vPoint2->setFixed(true);
-        optimizer.addVertex(vPoint2);
-      } else
-        continue;
-    } else
+    if (!pMP1 || pMP1->isBad() || pMP2->isBad() || i2 < 0)
       continue;
 
-    nCorrespondences++;
+    const Eigen::Vector3d P3D1c = R1w*pMP1->GetWorldPos() + t1w;
+    const Eigen::Vector3d P3D2c = R2w*pMP2->GetWorldPos() + t2w;
 
-    // Set edge x1 = S12*X2
-    Eigen::Matrix<double, 2, 1> obs1;
+    // Observations x1 = S12*X2 and x2 = S21*X1
     const cv::KeyPoint &kpUn1 = pKF1->mvKeysUn[i];
-    obs1 << kpUn1.pt.x, kpUn1.pt.y;
-
-    g2o::EdgeSim3ProjectXYZ* e12 = new g2o::EdgeSim3ProjectXYZ();
-    e12->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id2)));
-    e12->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-    e12->setMeasurement(obs1);
-    const float &invSigmaSquare1 = pKF1->mvInvLevelSigma2[kpUn1.octave];
-    e12->setInformation(Eigen::Matrix2d::Identity()*invSigmaSquare1);
-
-    g2o::RobustKernelHuber* rk1 = new g2o::RobustKernelHuber;
-    e12->setRobustKernel(rk1);
-    rk1->setDelta(deltaHuber);
-    optimizer.addEdge(e12);
-
-    // Set edge x2 = S21*X1
-    Eigen::Matrix<double, 2, 1> obs2;
     const cv::KeyPoint &kpUn2 = pKF2->mvKeysUn[i2];
-    obs2 << kpUn2.pt.x, kpUn2.pt.y;
-
-    g2o::EdgeInverseSim3ProjectXYZ* e21 = new g2o::EdgeInverseSim3ProjectXYZ();
 
-    e21->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id1)));
-    e21->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
-    e21->setMeasurement(obs2);
-    float invSigmaSquare2 = pKF2->mvInvLevelSigma2[kpUn2.octave];
-    e21->setInformation(Eigen::Matrix2d::Identity()*invSigmaSquare2);
-
-    g2o::RobustKernelHuber* rk2 = new g2o::RobustKernelHuber;
-    e21->setRobustKernel(rk2);
-    rk2->setDelta(deltaHuber);
-    optimizer.addEdge(e21);
-
-    vpEdges12.push_back(e12);
-    vpEdges21.push_back(e21);
+    optimizer.AddCorrespondence(P3D1c, Eigen::Vector2d(kpUn1.pt.x, kpUn1.pt.y), pKF1->mvInvLevelSigma2[kpUn1.octave],
+                                P3D2c, Eigen::Vector2d(kpUn2.pt.x, kpUn2.pt.y), pKF2->mvInvLevelSigma2[kpUn2.octave],
+                                deltaHuber);
     vnIndexEdge.push_back(i);
   }
 
+  const int nCorrespondences = vnIndexEdge.size();
+
   // Optimize!
-  optimizer.initializeOptimization();
-  optimizer.optimize(5);
+  optimizer.Optimize(g2oS12, 5);
 
   // Check inliers
   int nBad = 0;
-  for (size_t i = 0; i < vpEdges12.size(); i++) {
-    g2o::EdgeSim3ProjectXYZ* e12 = vpEdges12[i];
-    g2o::EdgeInverseSim3ProjectXYZ* e21 = vpEdges21[i];
-    if (!e12 || !e21)
-      continue;
-
-    if (e12->chi2()>th2 || e21->chi2()>th2) {
-      size_t idx = vnIndexEdge[i];
-      vpMatches1[idx] = static_cast<MapPoint*>(NULL);
-      optimizer.removeEdge(e12);
-      optimizer.removeEdge(e21);
-      vpEdges12[i] = static_cast<g2o::EdgeSim3ProjectXYZ*>(NULL);
-      vpEdges21[i] = static_cast<g2o::EdgeInverseSim3ProjectXYZ*>(NULL);
+  double chi2_1, chi2_2;
+  for (size_t i = 0; i < optimizer.Size(); i++) {
+    optimizer.Chi2(i, g2oS12, chi2_1, chi2_2);
+    if (chi2_1>th2 || chi2_2>th2) {
+      vpMatches1[vnIndexEdge[i]] = static_cast<MapPoint*>(NULL);
+      optimizer.SetInlier(i, false);
       nBad++;
     }
   }
@@ -1116,28 +1876,20 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
     return 0;
 
   // Optimize again only with inliers
-
-  optimizer.initializeOptimization();
-  optimizer.optimize(nMoreIterations);
+  optimizer.Optimize(g2oS12, nMoreIterations);
 
   int nIn = 0;
-  for (size_t i = 0; i < vpEdges12.size(); i++) {
-    g2o::EdgeSim3ProjectXYZ* e12 = vpEdges12[i];
-    g2o::EdgeInverseSim3ProjectXYZ* e21 = vpEdges21[i];
-    if (!e12 || !e21)
+  for (size_t i = 0; i < optimizer.Size(); i++) {
+    if (!vpMatches1[vnIndexEdge[i]])
       continue;
 
-    if (e12->chi2()>th2 || e21->chi2()>th2) {
-      size_t idx = vnIndexEdge[i];
-      vpMatches1[idx] = static_cast<MapPoint*>(NULL);
-    } else
+    optimizer.Chi2(i, g2oS12, chi2_1, chi2_2);
+    if (chi2_1>th2 || chi2_2>th2)
+      vpMatches1[vnIndexEdge[i]] = static_cast<MapPoint*>(NULL);
+    else
       nIn++;
   }
 
-  // Recover optimized Sim3
-  g2o::VertexSim3Expmap* vSim3_recov = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(0));
-  g2oS12= vSim3_recov->estimate();
-
   return nIn;
 }
 
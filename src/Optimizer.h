@@ -38,24 +38,76 @@ class LoopClosing;
 
 class Optimizer {
  public:
+  // Solver of BundleAdjustment: g2o on the CPU or the CUDA backend (see extra/ba_backend.h),
+  // which falls back to g2o if it isn't built or the problem can't be solved on the device
+  enum {BA_BACKEND_CPU = 0, BA_BACKEND_CUDA = 1};
+
+  // Size limits of LocalBundleAdjustment, 0 is unlimited
+  struct LocalBABudget {
+    LocalBABudget(): nMaxLocalKFs(0), nMaxFixedKFs(0), nMaxObservations(0) {}
+
+    int nMaxLocalKFs;       // Optimized covisible keyframes, the most covisible ones are kept
+    int nMaxFixedKFs;       // Fixed keyframes, the ones observing more local points are kept
+    int nMaxObservations;   // Observations per point, local keyframes come first
+  };
+
+  // Keyframe poses of a BundleAdjustment kept out of the map (see PartitionedBundleAdjustment).
+  // vTcw has one pose per keyframe given to BA, the initial estimate replaced by the result.
+  // Keyframes with vRho[i] > 0 are pulled towards vTarget[i] with that information. Points are
+  // written to the map, their normal and depth are not updated
+  struct BAPoses {
+    std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > vTcw;
+    std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > vTarget;
+    std::vector<double> vRho;
+  };
+
   void static BundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
                  int nIterations = 5, bool *pbStopFlag=NULL, const unsigned long nLoopKF = 0,
-                 const bool bRobust = true);
+                 const bool bRobust = true, int nThreads = 1, const std::set<KeyFrame*> *psFixedKFs = NULL,
+                 BAPoses *pPoses = NULL, int nBackend = BA_BACKEND_CPU, MapPointBatch* pBatch = NULL);
+  // If pBatch is given, normals and depths of moved points are updated later through it
   void static GlobalBundleAdjustemnt(Map* pMap, int nIterations=5, bool *pbStopFlag=NULL,
-                     const unsigned long nLoopKF = 0, const bool bRobust = true);
-  void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap);
-  int static PoseOptimization(Frame* pFrame);
+                     const unsigned long nLoopKF = 0, const bool bRobust = true, int nThreads = 1,
+                     int nBackend = BA_BACKEND_CPU, MapPointBatch* pBatch = NULL);
+  // BA over vpKFs and the points they observe. Other keyframes observing those points are fixed,
+  // so the cost depends on the size of the region and not on the size of the map
+  void static RegionBundleAdjustment(const std::vector<KeyFrame*> &vpKFs, int nIterations=5, bool *pbStopFlag=NULL,
+                     const unsigned long nLoopKF = 0, int nThreads = 1);
+  // Global BA for maps too large to be solved at once. Keyframes are split in partitions of
+  // nPartitionSize grown over the covisibility graph, each one with the points whose reference
+  // keyframe it owns and every keyframe observing them. Partitions are solved in parallel with
+  // BundleAdjustment and keyframes shared by several ones are reconciled with nRounds of
+  // consensus ADMM. Only for maps not being modified (offline)
+  void static PartitionedBundleAdjustment(Map* pMap, int nPartitionSize, int nRounds, int nIterations,
+                     ThreadPool* pPool, int nThreads = 0);
+  // nThreads is the number of threads used by the solver (only with OpenMP).
+  // If pBatch is given, normals and depths of moved points are updated later through it.
+  // If pBudget is given, the problem is bounded by its limits.
+  // Returns the number of local keyframes optimized (including pKF)
+  int static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap, int nThreads = 1,
+                                   MapPointBatch* pBatch = NULL, const LocalBABudget *pBudget = NULL);
+  // Sliding window BA over vpWindowKFs (oldest first, current last) using only their observations.
+  // If pKFMarg is given, it is marginalized into pose priors of the remaining keyframes
+  void static WindowBundleAdjustment(const std::vector<KeyFrame*> &vpWindowKFs, KeyFrame* pKFMarg,
+                                     bool *pbStopFlag, Map *pMap, int nThreads = 1,
+                                     MapPointBatch* pBatch = NULL);
+  // Up to nIterations per round and 4 rounds of outlier rejection, rounds end early once converged
+  int static PoseOptimization(Frame* pFrame, int nIterations = 10);
 
-  // if bFixScale is true, 6DoF optimization (stereo, rgbd), 7DoF otherwise (mono)
+  // if bFixScale is true, 6DoF optimization on an SE3 pose graph (stereo, rgbd), 7DoF Sim3 otherwise (mono).
+  // If pPool is given, edges are computed in parallel with up to nThreads threads
   void static OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                      const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                      const LoopClosing::KeyFrameAndPose &CorrectedSim3,
                      const std::map<KeyFrame *, std::set<KeyFrame *> > &LoopConnections,
-                     const bool &bFixScale);
+                     const bool &bFixScale, ThreadPool* pPool = nullptr, int nThreads = 0);
 
   // if bFixScale is true, optimize SE3 (stereo, rgbd), Sim3 otherwise (mono)
   static int OptimizeSim3(KeyFrame* pKF1, KeyFrame* pKF2, std::vector<MapPoint *> &vpMatches1,
               g2o::Sim3 &g2oS12, const float th2, const bool bFixScale);
+
+  // Estimated memory of the largest BA or essential graph built so far
+  static size_t GetPeakGraphBytes();
 };
 
 }  // namespace SD_SLAM
@@ -18,6 +18,8 @@
  */
 
 #include "PatternDetector.h"
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "MapPoint.h"
 #include "Converter.h"
 #include "extra/log.h"
@@ -27,6 +29,13 @@ using std::pair;
 
 namespace SD_SLAM {
 
+namespace {
+
+// Widest image used to search the pattern, larger levels are only used to refine corners
+const int MAX_SEARCH_WIDTH = 400;
+
+}  // namespace
+
 PatternDetector::PatternDetector() {
   // Pattern internal rows and cols
   cb_rows_ = 4; 
@@ -37,8 +46,6 @@ PatternDetector::~PatternDetector() {
 }
 
 bool PatternDetector::Detect(const Frame &frame) {
-  vector<cv::Point> imgPoints;
-
   if(SearchPattern(frame, imgPoints1_))
     if (GetRT(frame, imgPoints1_, RT_))
       return true;
@@ -47,12 +54,11 @@ bool PatternDetector::Detect(const Frame &frame) {
 }
 
 bool PatternDetector::SearchPattern(const Frame &frame, vector<cv::Point2d>& pixels) {
-  vector<cv::Point> imgPoints;
-  const cv::Mat &img = frame.mvImagePyramid[0];
+  vector<cv::Point2f> imgPoints;
 
   pixels.clear();
 
-  if(SearchChessboard(img, imgPoints)) {
+  if(SearchPyramid(frame, imgPoints)) {
     // Save extremes (clockwise order)
     pixels.push_back(imgPoints[0]);
     pixels.push_back(imgPoints[cb_cols_-1]);
@@ -121,9 +127,74 @@ void PatternDetector::SetCellSizeH(double s_cell_h){
 	cell_h = s_cell_h;
 }
 
-bool PatternDetector::SearchChessboard(const cv::Mat &img, vector<cv::Point> &candidate) {
+bool PatternDetector::SearchChessboard(const cv::Mat &img, vector<cv::Point2f> &candidate) {
   const cv::Size patternsize(cb_cols_, cb_rows_);
-  return cv::findChessboardCorners(img, patternsize, candidate);
+  // Fast check discards images without pattern before the expensive search
+  const int flags = cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK;
+  return cv::findChessboardCorners(img, patternsize, candidate, flags);
+}
+
+bool PatternDetector::SearchPyramid(const Frame &frame, vector<cv::Point2f> &corners) {
+  const vector<cv::Mat> &pyramid = frame.mvImagePyramid;
+  if (pyramid.empty() || pyramid[0].empty())
+    return false;
+
+  // Coarsest level needed to get an image narrower than MAX_SEARCH_WIDTH
+  int level = 0;
+  while (level+1 < static_cast<int>(pyramid.size()) && !pyramid[level+1].empty() &&
+         pyramid[level].cols > MAX_SEARCH_WIDTH)
+    level++;
+
+  const cv::Mat &coarse = pyramid[level];
+  const float scale = frame.mvScaleFactors[level];
+
+  // Search around the last detection first, then in the whole image
+  bool found = false;
+  if (last_roi_.area() > 0) {
+    cv::Rect roi(cvFloor(last_roi_.x/scale), cvFloor(last_roi_.y/scale),
+                 cvCeil(last_roi_.width/scale), cvCeil(last_roi_.height/scale));
+    roi &= cv::Rect(0, 0, coarse.cols, coarse.rows);
+    if (roi.area() > 0 && SearchChessboard(coarse(roi), corners)) {
+      for (cv::Point2f &p : corners) {
+        p.x += roi.x;
+        p.y += roi.y;
+      }
+      found = true;
+    }
+  }
+
+  if (!found && !SearchChessboard(coarse, corners)) {
+    last_roi_ = cv::Rect();
+    return false;
+  }
+
+  // Corners in level 0
+  for (cv::Point2f &p : corners)
+    p *= scale;
+
+  // Refine corners in level 0, only inside the pattern
+  const int win = std::max(3, cvRound(scale)+2);
+  cv::Rect bounds = cv::boundingRect(corners);
+  cv::Rect roi(bounds.x-2*win, bounds.y-2*win, bounds.width+4*win, bounds.height+4*win);
+  roi &= cv::Rect(0, 0, pyramid[0].cols, pyramid[0].rows);
+
+  for (cv::Point2f &p : corners) {
+    p.x -= roi.x;
+    p.y -= roi.y;
+  }
+  cv::cornerSubPix(pyramid[0](roi), corners, cv::Size(win, win), cv::Size(-1, -1),
+                   cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01));
+  for (cv::Point2f &p : corners) {
+    p.x += roi.x;
+    p.y += roi.y;
+  }
+
+  // Next search is limited to the pattern area expanded by half its size, the camera
+  // should not move much between frames
+  last_roi_ = cv::Rect(bounds.x-bounds.width/2, bounds.y-bounds.height/2, 2*bounds.width, 2*bounds.height);
+  last_roi_ &= cv::Rect(0, 0, pyramid[0].cols, pyramid[0].rows);
+
+  return true;
 }
 
 void PatternDetector::Get3DPoints(const Frame &frame, const vector<cv::Point2d>& pixels, 
@@ -47,7 +47,11 @@ class PatternDetector {
 
  private:
   // Search chessboard in image
-  bool SearchChessboard(const cv::Mat &img, std::vector<cv::Point> &candidate);
+  bool SearchChessboard(const cv::Mat &img, std::vector<cv::Point2f> &candidate);
+
+  // Search chessboard in a coarse pyramid level, inside the last detection if any, and
+  // refine corners in level 0
+  bool SearchPyramid(const Frame &frame, std::vector<cv::Point2f> &corners);
 
   // Get 3D position for each 2D pixel
   void Get3DPoints(const Frame &frame, const std::vector<cv::Point2d>& pixels,
@@ -64,6 +68,8 @@ class PatternDetector {
 
   int cb_rows_;
   int cb_cols_;
+
+  cv::Rect last_roi_;     // Last detection in level 0, empty if the pattern was not found
   
   double cell_w = 0.0283;  // Cell size (m)
   double cell_h = 0.0283;  // Cell size (m)
@@ -58,7 +58,9 @@
 
 #include <vector>
 #include <cmath>
+#include <cfloat>
 #include <algorithm>
+#include "ORBmatcher.h"
 #include "extra/utils.h"
 #include "extra/log.h"
 
@@ -69,14 +71,16 @@ using std::endl;
 namespace SD_SLAM {
 
 PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches):
-  pws(0), us(0), alphas(0), pcs(0), maximum_number_of_correspondences(0), number_of_correspondences(0), mnInliersi(0),
-  mnIterations(0), mnBestInliers(0), N(0) {
+  maximum_number_of_correspondences(0), number_of_correspondences(0), mnInliersi(0),
+  mnIterations(0), mnBestInliers(0), N(0), mbProsac(false) {
   mvpMapPointMatches = vpMapPointMatches;
   mvP2D.reserve(F.mvpMapPoints.size());
   mvSigma2.reserve(F.mvpMapPoints.size());
   mvP3Dw.reserve(F.mvpMapPoints.size());
   mvKeyPointIndices.reserve(F.mvpMapPoints.size());
   mvAllIndices.reserve(F.mvpMapPoints.size());
+  mvDistances.reserve(F.mvpMapPoints.size());
+  bool bDistances = !F.mDescriptors.empty();
 
   int idx = 0;
   for (size_t i = 0, iend=vpMapPointMatches.size(); i < iend; i++) {
@@ -95,11 +99,23 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
         mvKeyPointIndices.push_back(i);
         mvAllIndices.push_back(idx);
 
+        // Quality for ordered sampling
+        if (bDistances) {
+          uchar d[MapPoint::DESCRIPTOR_SIZE];
+          if (pMP->GetDescriptor(d))
+            mvDistances.push_back(ORBmatcher::DescriptorDistance(F.mFeatures.Descriptor(i), d));
+          else
+            bDistances = false;
+        }
+
         idx++;
       }
     }
   }
 
+  if (!bDistances)
+    mvDistances.clear();
+
   // Set camera calibration parameters
   fu = F.fx;
   fv = F.fy;
@@ -110,14 +126,11 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
 }
 
 PnPsolver::~PnPsolver() {
-  delete [] pws;
-  delete [] us;
-  delete [] alphas;
-  delete [] pcs;
 }
 
 
-void PnPsolver::SetRansacParameters(double probability, int minInliers, int maxIterations, int minSet, float epsilon, float th2) {
+void PnPsolver::SetRansacParameters(double probability, int minInliers, int maxIterations, int minSet, float epsilon, float th2,
+                                    bool bProsac) {
   mRansacProb = probability;
   mRansacMinInliers = minInliers;
   mRansacMaxIts = maxIterations;
@@ -152,6 +165,13 @@ void PnPsolver::SetRansacParameters(double probability, int minInliers, int maxI
   mvMaxError.resize(mvSigma2.size());
   for (size_t i = 0; i<mvSigma2.size(); i++)
     mvMaxError[i] = mvSigma2[i]*th2;
+
+  // Ordered sampling needs the quality of every correspondence
+  mbProsac = false;
+  if (bProsac && !mvDistances.empty()) {
+    mProsac.Init(mvDistances, mRansacMinSet, mRansacMaxIts);
+    mbProsac = mProsac.IsValid();
+  }
 }
 
 cv::Mat PnPsolver::find(vector<bool> &vbInliers, int &nInliers) {
@@ -172,6 +192,7 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
   }
 
   vector<size_t> vAvailableIndices;
+  vector<size_t> vSet;
 
   int nCurrentIterations = 0;
   while (mnIterations<mRansacMaxIts || nCurrentIterations<nIterations) {
@@ -179,40 +200,47 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
     mnIterations++;
     reset_correspondences();
 
-    vAvailableIndices = mvAllIndices;
-
     // Get min set of points
-    for (short i = 0; i < mRansacMinSet; ++i) {
-      int randi = Random(0, vAvailableIndices.size()-1);
+    if (mbProsac) {
+      mProsac.Sample(vSet);
+      for (short i = 0; i < mRansacMinSet; ++i) {
+        int idx = vSet[i];
+        add_correspondence(mvP3Dw[idx].x, mvP3Dw[idx].y, mvP3Dw[idx].z, mvP2D[idx].x, mvP2D[idx].y);
+      }
+    } else {
+      vAvailableIndices = mvAllIndices;
+
+      for (short i = 0; i < mRansacMinSet; ++i) {
+        int randi = Random(0, vAvailableIndices.size()-1);
 
-      int idx = vAvailableIndices[randi];
+        int idx = vAvailableIndices[randi];
 
-      add_correspondence(mvP3Dw[idx].x, mvP3Dw[idx].y, mvP3Dw[idx].z, mvP2D[idx].x, mvP2D[idx].y);
+        add_correspondence(mvP3Dw[idx].x, mvP3Dw[idx].y, mvP3Dw[idx].z, mvP2D[idx].x, mvP2D[idx].y);
 
-      vAvailableIndices[randi] = vAvailableIndices.back();
-      vAvailableIndices.pop_back();
+        vAvailableIndices[randi] = vAvailableIndices.back();
+        vAvailableIndices.pop_back();
+      }
     }
 
     // Compute camera pose
     compute_pose(mRi, mti);
 
-    // Check inliers
-    CheckInliers();
-
-    if (mnInliersi >= mRansacMinInliers) {
-      // If it is the best solution so far, save it
-      if (mnInliersi>mnBestInliers) {
-        mvbBestInliers = mvbInliersi;
-        mnBestInliers = mnInliersi;
-
-        cv::Mat Rcw(3, 3, CV_64F, mRi);
-        cv::Mat tcw(3, 1, CV_64F, mti);
-        Rcw.convertTo(Rcw, CV_32F);
-        tcw.convertTo(tcw, CV_32F);
-        mBestTcw = cv::Mat::eye(4, 4, CV_32F);
-        Rcw.copyTo(mBestTcw.rowRange(0, 3).colRange(0, 3));
-        tcw.copyTo(mBestTcw.rowRange(0, 3).col(3));
-      }
+    // Check inliers. Only a new best solution is useful, refinement of the
+    // previous best one has already failed
+    CheckInliers(std::max(mRansacMinInliers, mnBestInliers+1));
+
+    if (mnInliersi >= mRansacMinInliers && mnInliersi>mnBestInliers) {
+      // Best solution so far, save it
+      mvbBestInliers = mvbInliersi;
+      mnBestInliers = mnInliersi;
+
+      cv::Mat Rcw(3, 3, CV_64F, mRi);
+      cv::Mat tcw(3, 1, CV_64F, mti);
+      Rcw.convertTo(Rcw, CV_32F);
+      tcw.convertTo(tcw, CV_32F);
+      mBestTcw = cv::Mat::eye(4, 4, CV_32F);
+      Rcw.copyTo(mBestTcw.rowRange(0, 3).colRange(0, 3));
+      tcw.copyTo(mBestTcw.rowRange(0, 3).col(3));
 
       if (Refine()) {
         nInliers = mnRefinedInliers;
@@ -223,7 +251,6 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
         }
         return mRefinedTcw.clone();
       }
-
     }
   }
 
@@ -286,10 +313,14 @@ bool PnPsolver::Refine() {
 }
 
 
-void PnPsolver::CheckInliers() {
+void PnPsolver::CheckInliers(int nMinInliers) {
   mnInliersi = 0;
 
   for (int i = 0; i < N; i++) {
+    // Stop if remaining points are not enough
+    if (mnInliersi+N-i < nMinInliers)
+      return;
+
     cv::Point3f P3Dw = mvP3Dw[i];
     cv::Point2f P2D = mvP2D[i];
 
@@ -317,16 +348,11 @@ void PnPsolver::CheckInliers() {
 
 void PnPsolver::set_maximum_number_of_correspondences(int n) {
   if (maximum_number_of_correspondences < n) {
-  if (pws != 0) delete [] pws;
-  if (us != 0) delete [] us;
-  if (alphas != 0) delete [] alphas;
-  if (pcs != 0) delete [] pcs;
-
   maximum_number_of_correspondences = n;
-  pws = new double[3 * maximum_number_of_correspondences];
-  us = new double[2 * maximum_number_of_correspondences];
-  alphas = new double[4 * maximum_number_of_correspondences];
-  pcs = new double[3 * maximum_number_of_correspondences];
+  pws.resize(3 * maximum_number_of_correspondences);
+  us.resize(2 * maximum_number_of_correspondences);
+  alphas.resize(4 * maximum_number_of_correspondences);
+  pcs.resize(3 * maximum_number_of_correspondences);
   }
 }
 
@@ -357,85 +383,80 @@ void PnPsolver::choose_control_points(void) {
 
 
   // Take C1, C2, and C3 from PCA on the reference points:
-  CvMat * PW0 = cvCreateMat(number_of_correspondences, 3, CV_64F);
-
-  double pw0tpw0[3 * 3], dc[3], uct[3 * 3];
-  CvMat PW0tPW0 = cvMat(3, 3, CV_64F, pw0tpw0);
-  CvMat DC    = cvMat(3, 1, CV_64F, dc);
-  CvMat UCt   = cvMat(3, 3, CV_64F, uct);
-
-  for (int i = 0; i < number_of_correspondences; i++)
-  for (int j = 0; j < 3; j++)
-    PW0->data.db[3 * i + j] = pws[3 * i + j] - cws[0][j];
-
-  cvMulTransposed(PW0, &PW0tPW0, 1);
-  cvSVD(&PW0tPW0, &DC, &UCt, 0, CV_SVD_MODIFY_A | CV_SVD_U_T);
+  Eigen::Matrix3d PW0tPW0 = Eigen::Matrix3d::Zero();
+  for (int i = 0; i < number_of_correspondences; i++) {
+  Eigen::Vector3d pw0(pws[3 * i] - cws[0][0], pws[3 * i + 1] - cws[0][1], pws[3 * i + 2] - cws[0][2]);
+  PW0tPW0.noalias() += pw0 * pw0.transpose();
+  }
 
-  cvReleaseMat(&PW0);
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(PW0tPW0, Eigen::ComputeFullU);
+  const Eigen::Vector3d &dc = svd.singularValues();
+  const Eigen::Matrix3d &uc_ = svd.matrixU();
 
   for (int i = 1; i < 4; i++) {
-  double k = sqrt(dc[i - 1] / number_of_correspondences);
+  double k = sqrt(dc(i - 1) / number_of_correspondences);
   for (int j = 0; j < 3; j++)
-    cws[i][j] = cws[0][j] + k * uct[3 * (i - 1) + j];
+    cws[i][j] = cws[0][j] + k * uc_(j, i - 1);
   }
 }
 
 void PnPsolver::compute_barycentric_coordinates(void) {
-  double cc[3 * 3], cc_inv[3 * 3];
-  CvMat CC   = cvMat(3, 3, CV_64F, cc);
-  CvMat CC_inv = cvMat(3, 3, CV_64F, cc_inv);
+  Eigen::Matrix3d CC;
 
   for (int i = 0; i < 3; i++)
   for (int j = 1; j < 4; j++)
-    cc[3 * i + j - 1] = cws[j][i] - cws[0][i];
+    CC(i, j - 1) = cws[j][i] - cws[0][i];
+
+  // Pseudo-inverse, control points may be degenerated for planar scenes
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(CC, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Vector3d &w = svd.singularValues();
+  Eigen::Vector3d winv = Eigen::Vector3d::Zero();
+  for (int i = 0; i < 3; i++) {
+  if (w(i) > w(0) * DBL_EPSILON)
+    winv(i) = 1.0 / w(i);
+  }
+  const Eigen::Matrix3d CC_inv = svd.matrixV() * winv.asDiagonal() * svd.matrixU().transpose();
 
-  cvInvert(&CC, &CC_inv, CV_SVD);
-  double * ci = cc_inv;
   for (int i = 0; i < number_of_correspondences; i++) {
-  double * pi = pws + 3 * i;
-  double * a = alphas + 4 * i;
+  const double * pi = &pws[3 * i];
+  double * a = &alphas[4 * i];
 
   for (int j = 0; j < 3; j++)
     a[1 + j] =
-	ci[3 * j  ] * (pi[0] - cws[0][0]) +
-	ci[3 * j + 1] * (pi[1] - cws[0][1]) +
-	ci[3 * j + 2] * (pi[2] - cws[0][2]);
+	CC_inv(j, 0) * (pi[0] - cws[0][0]) +
+	CC_inv(j, 1) * (pi[1] - cws[0][1]) +
+	CC_inv(j, 2) * (pi[2] - cws[0][2]);
   a[0] = 1.0f - a[1] - a[2] - a[3];
   }
 }
 
-void PnPsolver::fill_M(CvMat * M,
-		  const int row, const double * as, const double u, const double v) {
-  double * M1 = M->data.db + row * 12;
-  double * M2 = M1 + 12;
-
+void PnPsolver::fill_M(Matrix2x12d &M, const double * as, const double u, const double v) {
   for (int i = 0; i < 4; i++) {
-  M1[3 * i  ] = as[i] * fu;
-  M1[3 * i + 1] = 0.0;
-  M1[3 * i + 2] = as[i] * (uc - u);
+  M(0, 3 * i  ) = as[i] * fu;
+  M(0, 3 * i + 1) = 0.0;
+  M(0, 3 * i + 2) = as[i] * (uc - u);
 
-  M2[3 * i  ] = 0.0;
-  M2[3 * i + 1] = as[i] * fv;
-  M2[3 * i + 2] = as[i] * (vc - v);
+  M(1, 3 * i  ) = 0.0;
+  M(1, 3 * i + 1) = as[i] * fv;
+  M(1, 3 * i + 2) = as[i] * (vc - v);
   }
 }
 
-void PnPsolver::compute_ccs(const double * betas, const double * ut) {
+void PnPsolver::compute_ccs(const double * betas, const Kernel &ut) {
   for (int i = 0; i < 4; i++)
   ccs[i][0] = ccs[i][1] = ccs[i][2] = 0.0f;
 
   for (int i = 0; i < 4; i++) {
-  const double * v = ut + 12 * (11 - i);
   for (int j = 0; j < 4; j++)
     for (int k = 0; k < 3; k++)
-	ccs[j][k] += betas[i] * v[3 * j + k];
+	ccs[j][k] += betas[i] * ut(3 * j + k, i);
   }
 }
 
 void PnPsolver::compute_pcs(void) {
   for (int i = 0; i < number_of_correspondences; i++) {
-  double * a = alphas + 4 * i;
-  double * pc = pcs + 3 * i;
+  const double * a = &alphas[4 * i];
+  double * pc = &pcs[3 * i];
 
   for (int j = 0; j < 3; j++)
     pc[j] = a[0] * ccs[0][j] + a[1] * ccs[1][j] + a[2] * ccs[2][j] + a[3] * ccs[3][j];
@@ -446,40 +467,38 @@ double PnPsolver::compute_pose(double R[3][3], double t[3]) {
   choose_control_points();
   compute_barycentric_coordinates();
 
-  CvMat * M = cvCreateMat(2 * number_of_correspondences, 12, CV_64F);
-
-  for (int i = 0; i < number_of_correspondences; i++)
-  fill_M(M, 2 * i, alphas + 4 * i, us[2 * i], us[2 * i + 1]);
+  // Accumulate MtM directly, two rows of M per correspondence
+  Matrix12d MtM = Matrix12d::Zero();
+  Matrix2x12d Mi;
 
-  double mtm[12 * 12], d[12], ut[12 * 12];
-  CvMat MtM = cvMat(12, 12, CV_64F, mtm);
-  CvMat D   = cvMat(12,  1, CV_64F, d);
-  CvMat Ut  = cvMat(12, 12, CV_64F, ut);
+  for (int i = 0; i < number_of_correspondences; i++) {
+  fill_M(Mi, &alphas[4 * i], us[2 * i], us[2 * i + 1]);
+  MtM.noalias() += Mi.transpose() * Mi;
+  }
 
-  cvMulTransposed(M, &MtM, 1);
-  cvSVD(&MtM, &D, &Ut, 0, CV_SVD_MODIFY_A | CV_SVD_U_T);
-  cvReleaseMat(&M);
+  // MtM is symmetric, eigenvalues are sorted in increasing order
+  Eigen::SelfAdjointEigenSolver<Matrix12d> eig(MtM);
+  const Kernel ut = eig.eigenvectors().leftCols<4>();
 
-  double l_6x10[6 * 10], rho[6];
-  CvMat L_6x10 = cvMat(6, 10, CV_64F, l_6x10);
-  CvMat Rho  = cvMat(6,  1, CV_64F, rho);
+  Matrix6x10d L_6x10;
+  Vector6d Rho;
 
-  compute_L_6x10(ut, l_6x10);
-  compute_rho(rho);
+  compute_L_6x10(ut, L_6x10);
+  compute_rho(Rho);
 
   double Betas[4][4], rep_errors[4];
   double Rs[4][3][3], ts[4][3];
 
-  find_betas_approx_1(&L_6x10, &Rho, Betas[1]);
-  gauss_newton(&L_6x10, &Rho, Betas[1]);
+  find_betas_approx_1(L_6x10, Rho, Betas[1]);
+  gauss_newton(L_6x10, Rho, Betas[1]);
   rep_errors[1] = compute_R_and_t(ut, Betas[1], Rs[1], ts[1]);
 
-  find_betas_approx_2(&L_6x10, &Rho, Betas[2]);
-  gauss_newton(&L_6x10, &Rho, Betas[2]);
+  find_betas_approx_2(L_6x10, Rho, Betas[2]);
+  gauss_newton(L_6x10, Rho, Betas[2]);
   rep_errors[2] = compute_R_and_t(ut, Betas[2], Rs[2], ts[2]);
 
-  find_betas_approx_3(&L_6x10, &Rho, Betas[3]);
-  gauss_newton(&L_6x10, &Rho, Betas[3]);
+  find_betas_approx_3(L_6x10, Rho, Betas[3]);
+  gauss_newton(L_6x10, Rho, Betas[3]);
   rep_errors[3] = compute_R_and_t(ut, Betas[3], Rs[3], ts[3]);
 
   int N = 1;
@@ -515,7 +534,7 @@ double PnPsolver::reprojection_error(const double R[3][3], const double t[3]) {
   double sum2 = 0.0;
 
   for (int i = 0; i < number_of_correspondences; i++) {
-  double * pw = pws + 3 * i;
+  const double * pw = &pws[3 * i];
   double Xc = dot(R[0], pw) + t[0];
   double Yc = dot(R[1], pw) + t[1];
   double inv_Zc = 1.0 / (dot(R[2], pw) + t[2]);
@@ -536,8 +555,8 @@ void PnPsolver::estimate_R_and_t(double R[3][3], double t[3]) {
   pw0[0] = pw0[1] = pw0[2] = 0.0;
 
   for (int i = 0; i < number_of_correspondences; i++) {
-  const double * pc = pcs + 3 * i;
-  const double * pw = pws + 3 * i;
+  const double * pc = &pcs[3 * i];
+  const double * pw = &pws[3 * i];
 
   for (int j = 0; j < 3; j++) {
     pc0[j] += pc[j];
@@ -549,29 +568,22 @@ void PnPsolver::estimate_R_and_t(double R[3][3], double t[3]) {
   pw0[j] /= number_of_correspondences;
   }
 
-  double abt[3 * 3], abt_d[3], abt_u[3 * 3], abt_v[3 * 3];
-  CvMat ABt   = cvMat(3, 3, CV_64F, abt);
-  CvMat ABt_D = cvMat(3, 1, CV_64F, abt_d);
-  CvMat ABt_U = cvMat(3, 3, CV_64F, abt_u);
-  CvMat ABt_V = cvMat(3, 3, CV_64F, abt_v);
-
-  cvSetZero(&ABt);
+  Eigen::Matrix3d ABt = Eigen::Matrix3d::Zero();
   for (int i = 0; i < number_of_correspondences; i++) {
-  double * pc = pcs + 3 * i;
-  double * pw = pws + 3 * i;
+  const double * pc = &pcs[3 * i];
+  const double * pw = &pws[3 * i];
 
-  for (int j = 0; j < 3; j++) {
-    abt[3 * j  ] += (pc[j] - pc0[j]) * (pw[0] - pw0[0]);
-    abt[3 * j + 1] += (pc[j] - pc0[j]) * (pw[1] - pw0[1]);
-    abt[3 * j + 2] += (pc[j] - pc0[j]) * (pw[2] - pw0[2]);
-  }
+  Eigen::Vector3d a(pc[0] - pc0[0], pc[1] - pc0[1], pc[2] - pc0[2]);
+  Eigen::Vector3d b(pw[0] - pw0[0], pw[1] - pw0[1], pw[2] - pw0[2]);
+  ABt.noalias() += a * b.transpose();
   }
 
-  cvSVD(&ABt, &ABt_D, &ABt_U, &ABt_V, CV_SVD_MODIFY_A);
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(ABt, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix3d Rm = svd.matrixU() * svd.matrixV().transpose();
 
   for (int i = 0; i < 3; i++)
   for (int j = 0; j < 3; j++)
-    R[i][j] = dot(abt_u + 3 * i, abt_v + 3 * j);
+    R[i][j] = Rm(i, j);
 
   const double det =
   R[0][0] * R[1][1] * R[2][2] + R[0][1] * R[1][2] * R[2][0] + R[0][2] * R[1][0] * R[2][1] -
@@ -608,7 +620,7 @@ void PnPsolver::solve_for_sign(void) {
   }
 }
 
-double PnPsolver::compute_R_and_t(const double * ut, const double * betas,
+double PnPsolver::compute_R_and_t(const Kernel &ut, const double * betas,
 			   double R[3][3], double t[3]) {
   compute_ccs(betas, ut);
   compute_pcs();
@@ -623,20 +635,15 @@ double PnPsolver::compute_R_and_t(const double * ut, const double * betas,
 // betas10    = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_1 = [B11 B12   B13     B14]
 
-void PnPsolver::find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::find_betas_approx_1(const Matrix6x10d &L_6x10, const Vector6d &Rho,
 			     double * betas) {
-  double l_6x4[6 * 4], b4[4];
-  CvMat L_6x4 = cvMat(6, 4, CV_64F, l_6x4);
-  CvMat B4  = cvMat(4, 1, CV_64F, b4);
+  Eigen::Matrix<double, 6, 4> L_6x4;
+  L_6x4.col(0) = L_6x10.col(0);
+  L_6x4.col(1) = L_6x10.col(1);
+  L_6x4.col(2) = L_6x10.col(3);
+  L_6x4.col(3) = L_6x10.col(6);
 
-  for (int i = 0; i < 6; i++) {
-  cvmSet(&L_6x4, i, 0, cvmGet(L_6x10, i, 0));
-  cvmSet(&L_6x4, i, 1, cvmGet(L_6x10, i, 1));
-  cvmSet(&L_6x4, i, 2, cvmGet(L_6x10, i, 3));
-  cvmSet(&L_6x4, i, 3, cvmGet(L_6x10, i, 6));
-  }
-
-  cvSolve(&L_6x4, Rho, &B4, CV_SVD);
+  Eigen::Vector4d b4 = L_6x4.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Rho);
 
   if (b4[0] < 0) {
   betas[0] = sqrt(-b4[0]);
@@ -654,19 +661,11 @@ void PnPsolver::find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho,
 // betas10    = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_2 = [B11 B12 B22              ]
 
-void PnPsolver::find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::find_betas_approx_2(const Matrix6x10d &L_6x10, const Vector6d &Rho,
 			     double * betas) {
-  double l_6x3[6 * 3], b3[3];
-  CvMat L_6x3  = cvMat(6, 3, CV_64F, l_6x3);
-  CvMat B3   = cvMat(3, 1, CV_64F, b3);
+  Eigen::Matrix<double, 6, 3> L_6x3 = L_6x10.leftCols<3>();
 
-  for (int i = 0; i < 6; i++) {
-  cvmSet(&L_6x3, i, 0, cvmGet(L_6x10, i, 0));
-  cvmSet(&L_6x3, i, 1, cvmGet(L_6x10, i, 1));
-  cvmSet(&L_6x3, i, 2, cvmGet(L_6x10, i, 2));
-  }
-
-  cvSolve(&L_6x3, Rho, &B3, CV_SVD);
+  Eigen::Vector3d b3 = L_6x3.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Rho);
 
   if (b3[0] < 0) {
   betas[0] = sqrt(-b3[0]);
@@ -685,21 +684,11 @@ void PnPsolver::find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho,
 // betas10    = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_3 = [B11 B12 B22 B13 B23          ]
 
-void PnPsolver::find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::find_betas_approx_3(const Matrix6x10d &L_6x10, const Vector6d &Rho,
 			     double * betas) {
-  double l_6x5[6 * 5], b5[5];
-  CvMat L_6x5 = cvMat(6, 5, CV_64F, l_6x5);
-  CvMat B5  = cvMat(5, 1, CV_64F, b5);
-
-  for (int i = 0; i < 6; i++) {
-  cvmSet(&L_6x5, i, 0, cvmGet(L_6x10, i, 0));
-  cvmSet(&L_6x5, i, 1, cvmGet(L_6x10, i, 1));
-  cvmSet(&L_6x5, i, 2, cvmGet(L_6x10, i, 2));
-  cvmSet(&L_6x5, i, 3, cvmGet(L_6x10, i, 3));
-  cvmSet(&L_6x5, i, 4, cvmGet(L_6x10, i, 4));
-  }
+  Eigen::Matrix<double, 6, 5> L_6x5 = L_6x10.leftCols<5>();
 
-  cvSolve(&L_6x5, Rho, &B5, CV_SVD);
+  Eigen::Matrix<double, 5, 1> b5 = L_6x5.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Rho);
 
   if (b5[0] < 0) {
   betas[0] = sqrt(-b5[0]);
@@ -713,13 +702,14 @@ void PnPsolver::find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho,
   betas[3] = 0.0;
 }
 
-void PnPsolver::compute_L_6x10(const double * ut, double * l_6x10) {
+void PnPsolver::compute_L_6x10(const Kernel &ut, Matrix6x10d &l_6x10) {
   const double * v[4];
 
-  v[0] = ut + 12 * 11;
-  v[1] = ut + 12 * 10;
-  v[2] = ut + 12 *  9;
-  v[3] = ut + 12 *  8;
+  // Columns of a column-major kernel are contiguous
+  v[0] = ut.col(0).data();
+  v[1] = ut.col(1).data();
+  v[2] = ut.col(2).data();
+  v[3] = ut.col(3).data();
 
   double dv[4][6][3];
 
@@ -739,22 +729,20 @@ void PnPsolver::compute_L_6x10(const double * ut, double * l_6x10) {
   }
 
   for (int i = 0; i < 6; i++) {
-  double * row = l_6x10 + 10 * i;
-
-  row[0] =    dot(dv[0][i], dv[0][i]);
-  row[1] = 2.0f * dot(dv[0][i], dv[1][i]);
-  row[2] =    dot(dv[1][i], dv[1][i]);
-  row[3] = 2.0f * dot(dv[0][i], dv[2][i]);
-  row[4] = 2.0f * dot(dv[1][i], dv[2][i]);
-  row[5] =    dot(dv[2][i], dv[2][i]);
-  row[6] = 2.0f * dot(dv[0][i], dv[3][i]);
-  row[7] = 2.0f * dot(dv[1][i], dv[3][i]);
-  row[8] = 2.0f * dot(dv[2][i], dv[3][i]);
-  row[9] =    dot(dv[3][i], dv[3][i]);
+  l_6x10(i, 0) =    dot(dv[0][i], dv[0][i]);
+  l_6x10(i, 1) = 2.0f * dot(dv[0][i], dv[1][i]);
+  l_6x10(i, 2) =    dot(dv[1][i], dv[1][i]);
+  l_6x10(i, 3) = 2.0f * dot(dv[0][i], dv[2][i]);
+  l_6x10(i, 4) = 2.0f * dot(dv[1][i], dv[2][i]);
+  l_6x10(i, 5) =    dot(dv[2][i], dv[2][i]);
+  l_6x10(i, 6) = 2.0f * dot(dv[0][i], dv[3][i]);
+  l_6x10(i, 7) = 2.0f * dot(dv[1][i], dv[3][i]);
+  l_6x10(i, 8) = 2.0f * dot(dv[2][i], dv[3][i]);
+  l_6x10(i, 9) =    dot(dv[3][i], dv[3][i]);
   }
 }
 
-void PnPsolver::compute_rho(double * rho) {
+void PnPsolver::compute_rho(Vector6d &rho) {
   rho[0] = dist2(cws[0], cws[1]);
   rho[1] = dist2(cws[0], cws[2]);
   rho[2] = dist2(cws[0], cws[3]);
@@ -763,18 +751,19 @@ void PnPsolver::compute_rho(double * rho) {
   rho[5] = dist2(cws[2], cws[3]);
 }
 
-void PnPsolver::compute_A_and_b_gauss_newton(const double * l_6x10, const double * rho,
-					double betas[4], CvMat * A, CvMat * b) {
+void PnPsolver::compute_A_and_b_gauss_newton(const Matrix6x10d &l_6x10, const Vector6d &rho,
+					const double betas[4], Eigen::Matrix<double, 6, 4> &A, Vector6d &b) {
   for (int i = 0; i < 6; i++) {
-  const double * rowL = l_6x10 + i * 10;
-  double * rowA = A->data.db + i * 4;
+  double rowL[10];
+  for (int j = 0; j < 10; j++)
+    rowL[j] = l_6x10(i, j);
 
-  rowA[0] = 2 * rowL[0] * betas[0] +   rowL[1] * betas[1] +   rowL[3] * betas[2] +   rowL[6] * betas[3];
-  rowA[1] =   rowL[1] * betas[0] + 2 * rowL[2] * betas[1] +   rowL[4] * betas[2] +   rowL[7] * betas[3];
-  rowA[2] =   rowL[3] * betas[0] +   rowL[4] * betas[1] + 2 * rowL[5] * betas[2] +   rowL[8] * betas[3];
-  rowA[3] =   rowL[6] * betas[0] +   rowL[7] * betas[1] +   rowL[8] * betas[2] + 2 * rowL[9] * betas[3];
+  A(i, 0) = 2 * rowL[0] * betas[0] +   rowL[1] * betas[1] +   rowL[3] * betas[2] +   rowL[6] * betas[3];
+  A(i, 1) =   rowL[1] * betas[0] + 2 * rowL[2] * betas[1] +   rowL[4] * betas[2] +   rowL[7] * betas[3];
+  A(i, 2) =   rowL[3] * betas[0] +   rowL[4] * betas[1] + 2 * rowL[5] * betas[2] +   rowL[8] * betas[3];
+  A(i, 3) =   rowL[6] * betas[0] +   rowL[7] * betas[1] +   rowL[8] * betas[2] + 2 * rowL[9] * betas[3];
 
-  cvmSet(b, i, 0, rho[i] -
+  b(i) = rho[i] -
 	   (
 	  rowL[0] * betas[0] * betas[0] +
 	  rowL[1] * betas[0] * betas[1] +
@@ -786,117 +775,29 @@ void PnPsolver::compute_A_and_b_gauss_newton(const double * l_6x10, const double
 	  rowL[7] * betas[1] * betas[3] +
 	  rowL[8] * betas[2] * betas[3] +
 	  rowL[9] * betas[3] * betas[3]
-	  ));
+	  );
   }
 }
 
-void PnPsolver::gauss_newton(const CvMat * L_6x10, const CvMat * Rho,
+void PnPsolver::gauss_newton(const Matrix6x10d &L_6x10, const Vector6d &Rho,
 			double betas[4]) {
   const int iterations_number = 5;
 
-  double a[6*4], b[6], x[4];
-  CvMat A = cvMat(6, 4, CV_64F, a);
-  CvMat B = cvMat(6, 1, CV_64F, b);
-  CvMat X = cvMat(4, 1, CV_64F, x);
+  Eigen::Matrix<double, 6, 4> A;
+  Vector6d B;
 
   for (int k = 0; k < iterations_number; k++) {
-  compute_A_and_b_gauss_newton(L_6x10->data.db, Rho->data.db,
-				 betas, &A, &B);
-  qr_solve(&A, &B, &X);
-
-  for (int i = 0; i < 4; i++)
-    betas[i] += x[i];
-  }
-}
-
-void PnPsolver::qr_solve(CvMat * A, CvMat * b, CvMat * X) {
-  static int max_nr = 0;
-  static double * A1, * A2;
-
-  const int nr = A->rows;
-  const int nc = A->cols;
+  compute_A_and_b_gauss_newton(L_6x10, Rho, betas, A, B);
 
-  if (max_nr != 0 && max_nr < nr) {
-  delete [] A1;
-  delete [] A2;
-  }
-  if (max_nr < nr) {
-  max_nr = nr;
-  A1 = new double[nr];
-  A2 = new double[nr];
-  }
-
-  double * pA = A->data.db, * ppAkk = pA;
-  for (int k = 0; k < nc; k++) {
-  double * ppAik = ppAkk, eta = fabs(*ppAik);
-  for (int i = k + 1; i < nr; i++) {
-    double elt = fabs(*ppAik);
-    if (eta < elt) eta = elt;
-    ppAik += nc;
-  }
-
-  if (eta == 0) {
-    A1[k] = A2[k] = 0.0;
+  // Least squares step
+  Eigen::Vector4d x = A.householderQr().solve(B);
+  if (!x.allFinite()) {
     LOGE("A is singular, this shouldn't happen");
     return;
-  } else {
-    double * ppAik = ppAkk, sum = 0.0, inv_eta = 1. / eta;
-    for (int i = k; i < nr; i++) {
-	*ppAik *= inv_eta;
-	sum += *ppAik * *ppAik;
-	ppAik += nc;
-    }
-    double sigma = sqrt(sum);
-    if (*ppAkk < 0)
-	sigma = -sigma;
-    *ppAkk += sigma;
-    A1[k] = sigma * *ppAkk;
-    A2[k] = -eta * sigma;
-    for (int j = k + 1; j < nc; j++) {
-	double * ppAik = ppAkk, sum = 0;
-	for (int i = k; i < nr; i++) {
-	  sum += *ppAik * ppAik[j - k];
-	  ppAik += nc;
-	}
-	double tau = sum / A1[k];
-	ppAik = ppAkk;
-	for (int i = k; i < nr; i++) {
-	  ppAik[j - k] -= tau * *ppAik;
-	  ppAik += nc;
-	}
-    }
-  }
-  ppAkk += nc + 1;
   }
 
-  // b <- Qt b
-  double * ppAjj = pA, * pb = b->data.db;
-  for (int j = 0; j < nc; j++) {
-  double * ppAij = ppAjj, tau = 0;
-  for (int i = j; i < nr; i++)	{
-    tau += *ppAij * pb[i];
-    ppAij += nc;
-  }
-  tau /= A1[j];
-  ppAij = ppAjj;
-  for (int i = j; i < nr; i++) {
-    pb[i] -= tau * *ppAij;
-    ppAij += nc;
-  }
-  ppAjj += nc + 1;
-  }
-
-  // X = R-1 b
-  double * pX = X->data.db;
-  pX[nc - 1] = pb[nc - 1] / A2[nc - 1];
-  for (int i = nc - 2; i >= 0; i--) {
-  double * ppAij = pA + i * nc + (i + 1), sum = 0;
-
-  for (int j = i + 1; j < nc; j++) {
-    sum += *ppAij * pX[j];
-    ppAij++;
-  }
-  pX[i] = (pb[i] - sum) / A2[i];
+  for (int i = 0; i < 4; i++)
+    betas[i] += x[i];
   }
 }
 
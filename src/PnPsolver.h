@@ -57,8 +57,10 @@
 
 #include <vector>
 #include <opencv2/core/core.hpp>
+#include <Eigen/Dense>
 #include "MapPoint.h"
 #include "Frame.h"
+#include "extra/prosac.h"
 
 namespace SD_SLAM {
 
@@ -68,15 +70,18 @@ class PnPsolver {
 
   ~PnPsolver();
 
+  // If bProsac is set, minimal sets are sampled with PROSAC ordered by descriptor distance
   void SetRansacParameters(double probability = 0.99, int minInliers = 8 , int maxIterations = 300, int minSet = 4, float epsilon = 0.4,
-               float th2 = 5.991);
+               float th2 = 5.991, bool bProsac = false);
 
   cv::Mat find(std::vector<bool> &vbInliers, int &nInliers);
 
   cv::Mat iterate(int nIterations, bool &bNoMore, std::vector<bool> &vbInliers, int &nInliers);
 
  private:
-  void CheckInliers();
+  // Count inliers of current estimation. Verification stops as soon as nMinInliers
+  // can not be reached, leaving mnInliersi below it
+  void CheckInliers(int nMinInliers = 0);
   bool Refine();
 
   // Functions from the original EPnP code
@@ -94,30 +99,37 @@ class PnPsolver {
   void print_pose(const double R[3][3], const double t[3]);
   double reprojection_error(const double R[3][3], const double t[3]);
 
+  // Fixed-size EPnP types. Kernel holds the 4 right singular vectors of M with
+  // smallest singular values, in increasing order
+  typedef Eigen::Matrix<double, 12, 12> Matrix12d;
+  typedef Eigen::Matrix<double, 2, 12> Matrix2x12d;
+  typedef Eigen::Matrix<double, 12, 4> Kernel;
+  typedef Eigen::Matrix<double, 6, 10> Matrix6x10d;
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
   void choose_control_points(void);
   void compute_barycentric_coordinates(void);
-  void fill_M(CvMat * M, const int row, const double * alphas, const double u, const double v);
-  void compute_ccs(const double * betas, const double * ut);
+  void fill_M(Matrix2x12d &M, const double * alphas, const double u, const double v);
+  void compute_ccs(const double * betas, const Kernel &ut);
   void compute_pcs(void);
 
   void solve_for_sign(void);
 
-  void find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void qr_solve(CvMat * A, CvMat * b, CvMat * X);
+  void find_betas_approx_1(const Matrix6x10d &L_6x10, const Vector6d &Rho, double * betas);
+  void find_betas_approx_2(const Matrix6x10d &L_6x10, const Vector6d &Rho, double * betas);
+  void find_betas_approx_3(const Matrix6x10d &L_6x10, const Vector6d &Rho, double * betas);
 
   double dot(const double * v1, const double * v2);
   double dist2(const double * p1, const double * p2);
 
-  void compute_rho(double * rho);
-  void compute_L_6x10(const double * ut, double * l_6x10);
+  void compute_rho(Vector6d &rho);
+  void compute_L_6x10(const Kernel &ut, Matrix6x10d &l_6x10);
 
-  void gauss_newton(const CvMat * L_6x10, const CvMat * Rho, double current_betas[4]);
-  void compute_A_and_b_gauss_newton(const double * l_6x10, const double * rho,
-				  double cb[4], CvMat * A, CvMat * b);
+  void gauss_newton(const Matrix6x10d &L_6x10, const Vector6d &Rho, double current_betas[4]);
+  void compute_A_and_b_gauss_newton(const Matrix6x10d &l_6x10, const Vector6d &rho,
+				  const double cb[4], Eigen::Matrix<double, 6, 4> &A, Vector6d &b);
 
-  double compute_R_and_t(const double * ut, const double * betas,
+  double compute_R_and_t(const Kernel &ut, const double * betas,
 			 double R[3][3], double t[3]);
 
   void estimate_R_and_t(double R[3][3], double t[3]);
@@ -130,7 +142,8 @@ class PnPsolver {
 
   double uc, vc, fu, fv;
 
-  double * pws, * us, * alphas, * pcs;
+  // Workspaces, only reallocated when the number of correspondences grows
+  std::vector<double> pws, us, alphas, pcs;
   int maximum_number_of_correspondences;
   int number_of_correspondences;
 
@@ -173,6 +186,13 @@ class PnPsolver {
   // Indices for random selection [0 .. N-1]
   std::vector<size_t> mvAllIndices;
 
+  // Descriptor distance of each correspondence, empty if not available
+  std::vector<float> mvDistances;
+
+  // Sampler for ordered selection
+  bool mbProsac;
+  ProsacSampler mProsac;
+
   // RANSAC probability
   double mRansacProb;
 
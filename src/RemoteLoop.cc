@@ -0,0 +1,725 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "RemoteLoop.h"
+#include <string.h>
+#include <cmath>
+#include "Map.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+#include "Tracking.h"
+#include "LoopClosing.h"
+#include "KeyFrameDatabase.h"
+#include "Config.h"
+#include "extra/image_codec.h"
+#include "extra/log.h"
+
+using std::vector;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+namespace {
+
+const char MAGIC[4] = {'S', 'D', 'L', 'C'};
+const uint8_t VERSION = 1;
+
+enum MessageType { MSG_HELLO = 1, MSG_KEYFRAME = 2, MSG_CORRECTION = 3 };
+
+const int DESCRIPTOR_SIZE = 32;
+
+// Depth images are sent with 1 mm steps
+const float DEPTH_STEP = 0.001f;
+
+struct KeyPointRecord {
+  float x, y, size, angle, response;
+  int32_t octave;
+};
+
+struct PointRecord {
+  uint64_t id;
+  double pos[3];
+  uint8_t descriptor[DESCRIPTOR_SIZE];
+};
+
+struct HelloRecord {
+  uint32_t rgbd;
+  uint32_t levels;
+  uint32_t width;
+  uint32_t height;
+  float scale_factor;
+  float fx, fy, cx, cy;
+};
+
+typedef Eigen::Matrix<double, 4, 4, Eigen::DontAlign> Pose;
+
+template <typename T>
+inline void Put(vector<uint8_t> &out, const T &v) {
+  const uint8_t *p = reinterpret_cast<const uint8_t*>(&v);
+  out.insert(out.end(), p, p+sizeof(T));
+}
+
+inline void PutBytes(vector<uint8_t> &out, const void *data, size_t size) {
+  const uint8_t *p = static_cast<const uint8_t*>(data);
+  out.insert(out.end(), p, p+size);
+}
+
+template <typename T>
+inline void PutVector(vector<uint8_t> &out, const vector<T> &v) {
+  Put<uint32_t>(out, v.size());
+  PutBytes(out, v.data(), v.size()*sizeof(T));
+}
+
+inline void PutHeader(vector<uint8_t> &out, MessageType type) {
+  out.clear();
+  PutBytes(out, MAGIC, sizeof(MAGIC));
+  Put<uint8_t>(out, VERSION);
+  Put<uint8_t>(out, type);
+}
+
+void PutKeyPoints(vector<uint8_t> &out, const vector<cv::KeyPoint> &keys) {
+  for (const cv::KeyPoint &kp : keys) {
+    KeyPointRecord r;
+    r.x = kp.pt.x;
+    r.y = kp.pt.y;
+    r.size = kp.size;
+    r.angle = kp.angle;
+    r.response = kp.response;
+    r.octave = kp.octave;
+    Put(out, r);
+  }
+}
+
+// Bounds checked reads, any failure leaves the reader failed
+class Reader {
+ public:
+  Reader(const uint8_t *data, size_t size): p_(data), end_(data+size) {}
+
+  inline bool Bytes(void *dst, size_t n) {
+    if (static_cast<size_t>(end_-p_) < n)
+      return false;
+    memcpy(dst, p_, n);
+    p_ += n;
+    return true;
+  }
+
+  template <typename T>
+  inline bool Get(T &v) {
+    return Bytes(&v, sizeof(T));
+  }
+
+  // Vector of count elements, count must fit in the remaining bytes
+  template <typename T>
+  inline bool Vector(vector<T> &v) {
+    uint32_t n;
+    if (!Get(n) || static_cast<size_t>(end_-p_)/sizeof(T) < n)
+      return false;
+    v.resize(n);
+    return Bytes(v.data(), n*sizeof(T));
+  }
+
+  // Pointer to the next n bytes
+  inline const uint8_t* Skip(size_t n) {
+    if (static_cast<size_t>(end_-p_) < n)
+      return nullptr;
+    const uint8_t *p = p_;
+    p_ += n;
+    return p;
+  }
+
+  inline bool Done() const { return p_ == end_; }
+
+ private:
+  const uint8_t *p_;
+  const uint8_t *end_;
+};
+
+bool GetKeyPoints(Reader &reader, uint32_t n, vector<cv::KeyPoint> &keys) {
+  keys.resize(n);
+  for (uint32_t i = 0; i < n; i++) {
+    KeyPointRecord r;
+    if (!reader.Get(r))
+      return false;
+    keys[i] = cv::KeyPoint(r.x, r.y, r.size, r.angle, r.response, r.octave);
+  }
+  return true;
+}
+
+// Compressed image with its size, empty images are sent as size 0
+void PutImage(vector<uint8_t> &out, const cv::Mat &im, float step, vector<uint8_t> &buffer) {
+  buffer.clear();
+  if (!im.empty())
+    CompressImage(im, step, buffer);
+  PutVector(out, buffer);
+}
+
+bool GetImage(Reader &reader, cv::Mat &im) {
+  uint32_t n;
+  if (!reader.Get(n))
+    return false;
+  if (n == 0) {
+    im = cv::Mat();
+    return true;
+  }
+
+  const uint8_t *data = reader.Skip(n);
+  if (!data)
+    return false;
+  im = DecompressImage(data, n);
+  return !im.empty();
+}
+
+// Check magic and version, returns message type or 0
+uint8_t GetHeader(Reader &reader) {
+  char magic[4];
+  uint8_t version, type;
+  if (!reader.Bytes(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+    return 0;
+  if (!reader.Get(version) || version != VERSION || !reader.Get(type))
+    return 0;
+  return type;
+}
+
+HelloRecord LocalHello(bool rgbd) {
+  HelloRecord r;
+  r.rgbd = rgbd ? 1 : 0;
+  r.levels = Config::NumLevels();
+  r.width = Config::Width();
+  r.height = Config::Height();
+  r.scale_factor = Config::ScaleFactor();
+  r.fx = Config::fx();
+  r.fy = Config::fy();
+  r.cx = Config::cx();
+  r.cy = Config::cy();
+  return r;
+}
+
+}  // namespace
+
+RemoteLoopClient::RemoteLoopClient(Map* pMap, bool rgbd): mpMap(pMap), mbRgbd(rgbd), mnApplied(0), mbPending(false) {
+}
+
+bool RemoteLoopClient::Connect(const std::string &address) {
+  if (!mLink.Connect(address))
+    return false;
+
+  vector<uint8_t> msg;
+  PutHeader(msg, MSG_HELLO);
+  Put(msg, LocalHello(mbRgbd));
+  return mLink.Send(msg);
+}
+
+bool RemoteLoopClient::SendKeyFrame(KeyFrame* pKF) {
+  // Parents go first, so the server can always place a keyframe relative to its parent
+  vector<KeyFrame*> vpChain;
+  for (KeyFrame* p = pKF; p && !mSentKeyFrames.count(p->mnId); p = p->GetParent())
+    vpChain.push_back(p);
+
+  vector<uint8_t> msg;
+  for (auto it = vpChain.rbegin(); it != vpChain.rend(); it++) {
+    KeyFrame* p = *it;
+    if (p->isBad())
+      continue;
+
+    EncodeKeyFrame(p, msg);
+    if (!mLink.Send(msg))
+      return false;
+    mSentKeyFrames.insert(p->mnId);
+  }
+
+  return true;
+}
+
+void RemoteLoopClient::EncodeKeyFrame(KeyFrame* pKF, vector<uint8_t> &msg) {
+  PutHeader(msg, MSG_KEYFRAME);
+  Put<uint64_t>(msg, mnApplied);
+
+  // Erased since previous message
+  vector<uint64_t> vErased;
+  for (auto it = mSentKeyFrames.begin(); it != mSentKeyFrames.end();) {
+    KeyFrame* p = mpMap->GetKeyFrame(*it);
+    if (!p || p->isBad()) {
+      vErased.push_back(*it);
+      it = mSentKeyFrames.erase(it);
+    } else {
+      it++;
+    }
+  }
+  PutVector(msg, vErased);
+
+  vErased.clear();
+  for (auto it = mSentPoints.begin(); it != mSentPoints.end();) {
+    MapPoint* p = mpMap->GetMapPoint(*it);
+    if (!p || p->isBad()) {
+      vErased.push_back(*it);
+      it = mSentPoints.erase(it);
+    } else {
+      it++;
+    }
+  }
+  PutVector(msg, vErased);
+
+  // Current pose of parent and covisibles already sent (parent one is needed to place pKF)
+  KeyFrame* pParent = pKF->GetParent();
+  vector<KeyFrame*> vpUpdated = pKF->GetVectorCovisibleKeyFrames();
+  if (pParent)
+    vpUpdated.push_back(pParent);
+
+  vector<uint64_t> vIds;
+  vector<Pose> vPoses;
+  for (KeyFrame* p : vpUpdated) {
+    if (!mSentKeyFrames.count(p->mnId) || p->isBad())
+      continue;
+    vIds.push_back(p->mnId);
+    vPoses.push_back(p->GetPose());
+  }
+  PutVector(msg, vIds);
+  for (const Pose &T : vPoses)
+    PutBytes(msg, T.data(), sizeof(double)*16);
+
+  // Keyframe
+  const Eigen::Matrix4d Tcw = pKF->GetPose();
+  Put<uint64_t>(msg, pKF->mnId);
+  Put<int64_t>(msg, pParent && mSentKeyFrames.count(pParent->mnId) ? static_cast<int64_t>(pParent->mnId) : -1);
+  PutBytes(msg, Tcw.data(), sizeof(double)*16);
+
+  Put<uint32_t>(msg, pKF->N);
+  PutKeyPoints(msg, pKF->mvKeys);
+  PutKeyPoints(msg, pKF->mvKeysUn);
+  if (mbRgbd) {
+    PutBytes(msg, pKF->mvuRight.data(), pKF->N*sizeof(float));
+    PutBytes(msg, pKF->mvDepth.data(), pKF->N*sizeof(float));
+  }
+  for (int i = 0; i < pKF->N; i++)
+    PutBytes(msg, pKF->mDescriptors.ptr(i), DESCRIPTOR_SIZE);
+
+  {
+    // Images may have been paged out
+    ScopedPage page(mpMap->GetPager(), pKF);
+
+    vector<float> vThumb;
+    if (!mpMap->GetKeyFrameDatabase()->GetDescriptor(pKF, vThumb) && !pKF->mvImagePyramid.empty() &&
+        !pKF->mvImagePyramid[0].empty())
+      KeyFrameDatabase::ComputeDescriptor(pKF->mvImagePyramid[0], vThumb);
+    PutVector(msg, vThumb);
+
+    // Loop candidates are verified aligning pyramids
+    vector<uint8_t> buffer;
+    Put<uint32_t>(msg, pKF->mvImagePyramid.size());
+    for (const cv::Mat &im : pKF->mvImagePyramid)
+      PutImage(msg, im, 0.0f, buffer);
+    PutImage(msg, mbRgbd ? pKF->GetDepthImage() : cv::Mat(), DEPTH_STEP, buffer);
+  }
+
+  // Observations and current position of observed points
+  const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+  vector<uint32_t> vObsIdx;
+  vector<PointRecord> vPoints;
+  for (size_t i = 0; i < vpMPs.size(); i++) {
+    MapPoint* pMP = vpMPs[i];
+    if (!pMP || pMP->isBad())
+      continue;
+
+    vObsIdx.push_back(i);
+
+    PointRecord r;
+    memset(&r, 0, sizeof(r));
+    r.id = pMP->mnId;
+    const Eigen::Vector3d pos = pMP->GetWorldPos();
+    r.pos[0] = pos(0);
+    r.pos[1] = pos(1);
+    r.pos[2] = pos(2);
+    pMP->GetDescriptor(r.descriptor);
+    vPoints.push_back(r);
+
+    mSentPoints.insert(pMP->mnId);
+  }
+  PutVector(msg, vObsIdx);
+  PutVector(msg, vPoints);
+}
+
+void RemoteLoopClient::Run() {
+  vector<uint8_t> msg;
+
+  while (mLink.Receive(msg, -1) > 0) {
+    Reader reader(msg.data(), msg.size());
+    if (GetHeader(reader) != MSG_CORRECTION) {
+      LOGE("Invalid message from loop closing server");
+      break;
+    }
+
+    Correction c;
+    uint64_t sequence;
+    vector<uint64_t> vKFIds, vPointIds;
+    bool ok = reader.Get(sequence) && reader.Vector(vKFIds);
+    c.nSequence = sequence;
+    c.vKeyFrameIds.assign(vKFIds.begin(), vKFIds.end());
+    c.vKeyFramePoses.resize(vKFIds.size());
+    for (size_t i = 0; ok && i < vKFIds.size(); i++)
+      ok = reader.Bytes(c.vKeyFramePoses[i].data(), sizeof(double)*16);
+
+    ok = ok && reader.Vector(vPointIds);
+    c.vPointIds.assign(vPointIds.begin(), vPointIds.end());
+    c.vPointPositions.resize(vPointIds.size());
+    for (size_t i = 0; ok && i < vPointIds.size(); i++)
+      ok = reader.Bytes(c.vPointPositions[i].data(), sizeof(double)*3);
+
+    if (!ok || !reader.Done()) {
+      LOGE("Invalid correction from loop closing server");
+      break;
+    }
+
+    LOGD("Correction %lu received: %d keyframes, %d points", c.nSequence,
+         static_cast<int>(c.vKeyFrameIds.size()), static_cast<int>(c.vPointIds.size()));
+
+    {
+      unique_lock<mutex> lock(mMutexCorrection);
+      mPending = std::move(c);
+      mbPending = true;
+    }
+
+    if (mNotify)
+      mNotify();
+  }
+
+  mLink.Close();
+}
+
+void RemoteLoopClient::SetNotify(const std::function<void()> &notify) {
+  mNotify = notify;
+}
+
+bool RemoteLoopClient::PopCorrection(Correction &correction) {
+  unique_lock<mutex> lock(mMutexCorrection);
+  if (!mbPending)
+    return false;
+  correction = std::move(mPending);
+  mbPending = false;
+  return true;
+}
+
+void RemoteLoopClient::SetApplied(unsigned long nSequence) {
+  mnApplied = nSequence;
+}
+
+void RemoteLoopClient::RequestFinish() {
+  mLink.Close();
+}
+
+RemoteLoopServer::RemoteLoopServer(Map* pMap, Tracking* pTracker, LoopClosing* pLoopCloser, bool rgbd, int nAgent):
+  mpMap(pMap), mpTracker(pTracker), mpLoopCloser(pLoopCloser), mbRgbd(rgbd), mnAgent(nAgent), mbHello(false),
+  mnSequence(0), mbFinishRequested(false) {
+  mnBigChangeIdx = mpMap->GetLastBigChangeIdx();
+}
+
+bool RemoteLoopServer::Serve(TcpLink &link) {
+  ScopedParticipant participant(mpMap->GetReclaimer());
+  vector<uint8_t> msg;
+
+  while (1) {
+    {
+      unique_lock<mutex> lock(mMutexFinish);
+      if (mbFinishRequested)
+        break;
+    }
+
+    participant.Quiescent();
+
+    // Wake up periodically to send corrections of a global BA
+    const int r = link.Receive(msg, 100);
+    if (r < 0) {
+      LOGD("Agent %d disconnected", mnAgent);
+      break;
+    }
+
+    if (r > 0 && !Apply(msg)) {
+      LOGE("Invalid message from agent %d", mnAgent);
+      link.Close();
+      return false;
+    }
+
+    if (mbHello && !SendCorrection(link)) {
+      LOGD("Agent %d disconnected", mnAgent);
+      break;
+    }
+  }
+
+  return true;
+}
+
+void RemoteLoopServer::RequestFinish() {
+  unique_lock<mutex> lock(mMutexFinish);
+  mbFinishRequested = true;
+}
+
+bool RemoteLoopServer::Apply(const vector<uint8_t> &msg) {
+  Reader reader(msg.data(), msg.size());
+  const uint8_t type = GetHeader(reader);
+  const size_t header = sizeof(MAGIC)+2;
+
+  if (type == MSG_HELLO)
+    return ApplyHello(msg.data()+header, msg.size()-header);
+  if (type == MSG_KEYFRAME && mbHello)
+    return ApplyKeyFrame(msg.data()+header, msg.size()-header);
+  return false;
+}
+
+bool RemoteLoopServer::ApplyHello(const uint8_t *data, size_t size) {
+  Reader reader(data, size);
+  HelloRecord r;
+  if (!reader.Get(r) || !reader.Done())
+    return false;
+
+  const HelloRecord local = LocalHello(mbRgbd);
+  if ((r.rgbd != 0) != mbRgbd || r.levels != local.levels || r.width != local.width || r.height != local.height ||
+      fabs(r.scale_factor-local.scale_factor) > 1e-5) {
+    LOGE("Agent %d uses a different sensor, image size or ORB parameters", mnAgent);
+    return false;
+  }
+
+  if (fabs(r.fx-local.fx) > 1e-3 || fabs(r.fy-local.fy) > 1e-3 || fabs(r.cx-local.cx) > 1e-3 || fabs(r.cy-local.cy) > 1e-3) {
+    LOGE("Agent %d uses different camera intrinsics", mnAgent);
+  }
+
+  mbHello = true;
+  return true;
+}
+
+bool RemoteLoopServer::ApplyKeyFrame(const uint8_t *data, size_t size) {
+  Reader reader(data, size);
+
+  // Parse and validate the whole message before changing the map
+  uint64_t sequence;
+  vector<uint64_t> vErasedKFs, vErasedPoints, vUpdatedIds;
+  if (!reader.Get(sequence) || !reader.Vector(vErasedKFs) || !reader.Vector(vErasedPoints) || !reader.Vector(vUpdatedIds))
+    return false;
+
+  vector<Pose> vUpdatedPoses(vUpdatedIds.size());
+  for (Pose &T : vUpdatedPoses) {
+    if (!reader.Bytes(T.data(), sizeof(double)*16))
+      return false;
+  }
+
+  uint64_t id;
+  int64_t parent;
+  Pose Tcw;
+  uint32_t N;
+  if (!reader.Get(id) || !reader.Get(parent) || !reader.Bytes(Tcw.data(), sizeof(double)*16) || !reader.Get(N))
+    return false;
+
+  // Already known (resent parent), only erasures and updates are applied
+  const bool bKnown = mKeyFrameIds.count(id) > 0;
+
+  vector<cv::KeyPoint> vKeys, vKeysUn;
+  if (!GetKeyPoints(reader, N, vKeys) || !GetKeyPoints(reader, N, vKeysUn))
+    return false;
+
+  vector<float> vRight, vDepth;
+  if (mbRgbd) {
+    vRight.resize(N);
+    vDepth.resize(N);
+    if (!reader.Bytes(vRight.data(), N*sizeof(float)) || !reader.Bytes(vDepth.data(), N*sizeof(float)))
+      return false;
+  } else {
+    vRight.assign(N, -1.0f);
+    vDepth.assign(N, -1.0f);
+  }
+
+  cv::Mat descriptors(N, DESCRIPTOR_SIZE, CV_8U);
+  if (!reader.Bytes(descriptors.data, N*DESCRIPTOR_SIZE))
+    return false;
+
+  vector<float> vThumb;
+  uint32_t nLevels;
+  if (!reader.Vector(vThumb) || !reader.Get(nLevels) || nLevels > static_cast<uint32_t>(Config::NumLevels()))
+    return false;
+
+  vector<cv::Mat> vPyramid(nLevels);
+  for (cv::Mat &im : vPyramid) {
+    if (!GetImage(reader, im))
+      return false;
+  }
+
+  cv::Mat imDepth;
+  vector<uint32_t> vObsIdx;
+  vector<PointRecord> vPoints;
+  if (!GetImage(reader, imDepth) || !reader.Vector(vObsIdx) || !reader.Vector(vPoints) || !reader.Done())
+    return false;
+  if (vObsIdx.size() != vPoints.size())
+    return false;
+  for (uint32_t idx : vObsIdx) {
+    if (idx >= N)
+      return false;
+  }
+
+  // Keyframe is built and its words computed before locking, so other agents are not blocked.
+  // It is not in the map until it is added below
+  KeyFrame* pKF = nullptr;
+  if (!bKnown) {
+    Frame frame = mpTracker->CreateFrame(std::move(vKeys), std::move(vKeysUn), std::move(vRight), std::move(vDepth),
+                                         descriptors, vPyramid, imDepth, cv::Size(Config::Width(), Config::Height()));
+    pKF = new KeyFrame(frame, mpMap);
+    pKF->ComputeBoW(mpMap->GetVocabulary());
+  }
+
+  unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+
+  for (uint64_t idErased : vErasedPoints) {
+    MapPoint* pMP = GetMapPoint(idErased);
+    if (pMP)
+      pMP->SetBadFlag();
+    mPointIds.erase(idErased);
+  }
+
+  for (uint64_t idErased : vErasedKFs) {
+    KeyFrame* pKFi = GetKeyFrame(idErased);
+    if (pKFi)
+      pKFi->SetBadFlag();
+    mKeyFrameIds.erase(idErased);
+  }
+
+  KeyFrame* pParent = parent >= 0 ? GetKeyFrame(parent) : nullptr;
+
+  // A message older than last correction is in the previous coordinates: its updates are
+  // dropped and the keyframe keeps its pose relative to the parent. Tsc maps client
+  // coordinates to server ones
+  const bool bStale = sequence != mnSequence;
+  Eigen::Matrix4d Tsc = Eigen::Matrix4d::Identity();
+  for (size_t i = 0; i < vUpdatedIds.size(); i++) {
+    if (bStale) {
+      if (pParent && static_cast<int64_t>(vUpdatedIds[i]) == parent)
+        Tsc = pParent->GetPoseInverse()*Eigen::Matrix4d(vUpdatedPoses[i]);
+    } else {
+      KeyFrame* pKFi = GetKeyFrame(vUpdatedIds[i]);
+      if (pKFi)
+        pKFi->SetPose(vUpdatedPoses[i]);
+    }
+  }
+
+  if (bKnown)
+    return true;
+
+  // Tsc is rigid, its inverse is cheap
+  Eigen::Matrix4d Tcs = Eigen::Matrix4d::Identity();
+  Tcs.block<3, 3>(0, 0) = Tsc.block<3, 3>(0, 0).transpose();
+  Tcs.block<3, 1>(0, 3) = -Tcs.block<3, 3>(0, 0)*Tsc.block<3, 1>(0, 3);
+  pKF->SetPose(Eigen::Matrix4d(Tcw)*Tcs);
+
+  // Keyframes without parent start a map with its own coordinates, the rest join the session
+  // of their parent (which may have been merged with another agent's one)
+  const int nSession = pParent ? mpMap->GetSession(pParent) : mpMap->CreateSession();
+  if (!vThumb.empty())
+    mpMap->GetKeyFrameDatabase()->add(pKF, vThumb);
+  mpMap->AddKeyFrame(pKF, nSession);
+  if (!pParent)
+    mpMap->mvpKeyFrameOrigins.push_back(pKF);
+  mKeyFrameIds[id] = pKF->mnId;
+
+  // New points are referenced to this keyframe, the only one sure to observe them here
+  vector<MapPoint*> vpNew;
+  for (size_t i = 0; i < vPoints.size(); i++) {
+    const PointRecord &r = vPoints[i];
+    const Eigen::Vector3d pos = Tsc.block<3, 3>(0, 0)*Eigen::Vector3d(r.pos[0], r.pos[1], r.pos[2]) + Tsc.block<3, 1>(0, 3);
+
+    MapPoint* pMP = nullptr;
+    auto it = mPointIds.find(r.id);
+    if (it == mPointIds.end()) {
+      pMP = new MapPoint(pos, pKF, mpMap);
+      pMP->SetDescriptor(cv::Mat(1, DESCRIPTOR_SIZE, CV_8U, const_cast<uint8_t*>(r.descriptor)));
+      mpMap->AddMapPoint(pMP);
+      mPointIds[r.id] = pMP->mnId;
+      vpNew.push_back(pMP);
+    } else {
+      // Fused or erased here
+      pMP = mpMap->GetMapPoint(it->second);
+      if (!pMP || pMP->isBad())
+        continue;
+      if (!bStale)
+        pMP->SetWorldPos(pos);
+    }
+
+    pKF->AddMapPoint(pMP, vObsIdx[i]);
+    pMP->AddObservation(pKF, vObsIdx[i]);
+  }
+
+  for (MapPoint* pMP : vpNew)
+    pMP->UpdateNormalAndDepth();
+
+  pKF->UpdateConnections();
+  mpLoopCloser->InsertKeyFrame(pKF);
+
+  return true;
+}
+
+bool RemoteLoopServer::SendCorrection(TcpLink &link) {
+  if (mpMap->GetLastBigChangeIdx() == mnBigChangeIdx)
+    return true;
+
+  vector<uint8_t> msg;
+  {
+    // Never send a correction half applied
+    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+    mnBigChangeIdx = mpMap->GetLastBigChangeIdx();
+    mnSequence++;
+
+    PutHeader(msg, MSG_CORRECTION);
+    Put<uint64_t>(msg, mnSequence);
+
+    vector<uint64_t> vIds;
+    vector<Pose> vPoses;
+    for (const auto &ids : mKeyFrameIds) {
+      KeyFrame* pKF = mpMap->GetKeyFrame(ids.second);
+      if (!pKF || pKF->isBad())
+        continue;
+      vIds.push_back(ids.first);
+      vPoses.push_back(pKF->GetPose());
+    }
+    PutVector(msg, vIds);
+    for (const Pose &T : vPoses)
+      PutBytes(msg, T.data(), sizeof(double)*16);
+
+    vIds.clear();
+    vector<double> vPositions;
+    for (const auto &ids : mPointIds) {
+      MapPoint* pMP = mpMap->GetMapPoint(ids.second);
+      if (!pMP || pMP->isBad())
+        continue;
+      const Eigen::Vector3d pos = pMP->GetWorldPos();
+      vIds.push_back(ids.first);
+      vPositions.insert(vPositions.end(), pos.data(), pos.data()+3);
+    }
+    PutVector(msg, vIds);
+    PutBytes(msg, vPositions.data(), vPositions.size()*sizeof(double));
+  }
+
+  LOGD("Sending correction %lu to agent %d (%lu bytes)", mnSequence, mnAgent, static_cast<unsigned long>(msg.size()));
+  return link.Send(msg);
+}
+
+KeyFrame* RemoteLoopServer::GetKeyFrame(unsigned long nClientId) {
+  auto it = mKeyFrameIds.find(nClientId);
+  return it != mKeyFrameIds.end() ? mpMap->GetKeyFrame(it->second) : nullptr;
+}
+
+MapPoint* RemoteLoopServer::GetMapPoint(unsigned long nClientId) {
+  auto it = mPointIds.find(nClientId);
+  return it != mPointIds.end() ? mpMap->GetMapPoint(it->second) : nullptr;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,152 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_REMOTELOOP_H
+#define SD_SLAM_REMOTELOOP_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_set>
+#include <unordered_map>
+#include <Eigen/Dense>
+#include "extra/tcp_link.h"
+
+namespace SD_SLAM {
+
+class Map;
+class KeyFrame;
+class MapPoint;
+class Tracking;
+class LoopClosing;
+
+// Loop closing on a remote server (LoopClosing.Server). The client streams every keyframe
+// LocalMapping hands to LoopClosing: features, thumbnail, image pyramid, map point
+// observations, and the current pose of its covisibles and position of its points. The server
+// rebuilds the map and runs loop detection, essential graph and global BA on it. After each
+// big change it sends back the poses of its keyframes and positions of its points, which the
+// client applies and propagates through the spanning tree to the keyframes created meanwhile
+// (as after a global BA). Messages use the client ids, the server maps them to its own.
+//
+// Messages start with magic "SDLC", version (u8) and type (u8); values are raw little endian.
+// Keyframes are sent with the sequence of the last correction applied by the client. Older
+// sequences mean the message is in the coordinates before a correction: the server then places
+// the new keyframe and points relative to its parent and ignores the updates of the rest.
+class RemoteLoopClient {
+ public:
+  struct Correction {
+    unsigned long nSequence;
+    std::vector<unsigned long> vKeyFrameIds;
+    std::vector<Eigen::Matrix<double, 4, 4, Eigen::DontAlign> > vKeyFramePoses;  // Tcw
+    std::vector<unsigned long> vPointIds;
+    std::vector<Eigen::Vector3d> vPointPositions;
+  };
+
+  RemoteLoopClient(Map* pMap, bool rgbd);
+
+  // Connect to server ("host:port") and send the camera and ORB parameters
+  bool Connect(const std::string &address);
+
+  // Send keyframe (its parent first if it wasn't sent) and the ids erased since last call.
+  // Returns false if the connection is lost
+  bool SendKeyFrame(KeyFrame* pKF);
+
+  // Receive corrections until finished, calling notify after each one
+  void Run();
+
+  // Called from Run when a correction arrives
+  void SetNotify(const std::function<void()> &notify);
+
+  // Take last received correction. Only the newest one is kept, it holds the whole map
+  bool PopCorrection(Correction &correction);
+
+  // Following keyframes are in the coordinates of this correction
+  void SetApplied(unsigned long nSequence);
+
+  void RequestFinish();
+
+ private:
+  // Encode pKF, the poses of its sent covisibles and its points into msg
+  void EncodeKeyFrame(KeyFrame* pKF, std::vector<uint8_t> &msg);
+
+  Map* mpMap;
+  bool mbRgbd;
+  TcpLink mLink;
+
+  // Ids already sent, erased ones are reported to the server once
+  std::unordered_set<unsigned long> mSentKeyFrames;
+  std::unordered_set<unsigned long> mSentPoints;
+  unsigned long mnApplied;
+
+  std::function<void()> mNotify;
+  bool mbPending;
+  Correction mPending;
+  std::mutex mMutexCorrection;
+};
+
+// Server side of one client (agent): adds its keyframes to the map of a System created with
+// loop closing, whose tracking is not used, and sends back its corrections. Several agents
+// share the map, each one served from its own thread: keyframes are decoded concurrently and
+// only their insertion is serialized. Each agent starts its own sessions, so its keyframes are
+// merged with the other agents' ones when loop closing finds a place seen by both.
+class RemoteLoopServer {
+ public:
+  RemoteLoopServer(Map* pMap, Tracking* pTracker, LoopClosing* pLoopCloser, bool rgbd, int nAgent);
+
+  // Serve a connected client until it disconnects or RequestFinish is called.
+  // Returns false on a protocol error
+  bool Serve(TcpLink &link);
+
+  void RequestFinish();
+
+ private:
+  bool Apply(const std::vector<uint8_t> &msg);
+  bool ApplyHello(const uint8_t *data, size_t size);
+  bool ApplyKeyFrame(const uint8_t *data, size_t size);
+
+  // Send poses and positions of this agent if loop closing changed the map since last one
+  bool SendCorrection(TcpLink &link);
+
+  // Keyframe or point of this agent with client id, null if unknown or erased here
+  KeyFrame* GetKeyFrame(unsigned long nClientId);
+  MapPoint* GetMapPoint(unsigned long nClientId);
+
+  Map* mpMap;
+  Tracking* mpTracker;
+  LoopClosing* mpLoopCloser;
+  bool mbRgbd;
+  int mnAgent;
+
+  bool mbHello;
+  unsigned long mnSequence;
+  int mnBigChangeIdx;
+
+  // Client id to map id of keyframes and points of this agent. Points fused or erased here
+  // are kept, so they are not created again
+  std::unordered_map<unsigned long, unsigned long> mKeyFrameIds;
+  std::unordered_map<unsigned long, unsigned long> mPointIds;
+
+  bool mbFinishRequested;
+  std::mutex mMutexFinish;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_REMOTELOOP_H
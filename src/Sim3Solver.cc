@@ -24,6 +24,9 @@
 
 #include "Sim3Solver.h"
 #include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 #include <opencv2/core/core.hpp>
 #include "ORBmatcher.h"
 #include "extra/utils.h"
@@ -34,7 +37,7 @@ using std::vector;
 namespace SD_SLAM {
 
 Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *> &vpMatched12, const bool bFixScale):
-  mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale) {
+  mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale), mbProsac(false) {
   mpKF1 = pKF1;
   mpKF2 = pKF2;
 
@@ -48,6 +51,8 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
   mvnIndices1.reserve(mN1);
   mvX3Dc1.reserve(mN1);
   mvX3Dc2.reserve(mN1);
+  mK1 = pKF1->mK;
+  mK2 = pKF2->mK;
 
   Eigen::Matrix3d Rcw1 = pKF1->GetRotation();
   Eigen::Vector3d tcw1 = pKF1->GetTranslation();
@@ -55,6 +60,8 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
   Eigen::Vector3d tcw2 = pKF2->GetTranslation();
 
   mvAllIndices.reserve(mN1);
+  mvDistances.reserve(mN1);
+  bool bDistances = true;
 
   size_t idx = 0;
   for (int i1 = 0; i1<mN1; i1++) {
@@ -80,9 +87,6 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
       const float sigmaSquare1 = pKF1->mvLevelSigma2[kp1.octave];
       const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
 
-      mvnMaxError1.push_back(9.210*sigmaSquare1);
-      mvnMaxError2.push_back(9.210*sigmaSquare2);
-
       mvpMapPoints1.push_back(pMP1);
       mvpMapPoints2.push_back(pMP2);
       mvnIndices1.push_back(i1);
@@ -95,21 +99,27 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
       Eigen::Vector3d pos2 = Rcw2*X3D2w+tcw2;
       mvX3Dc2.push_back(pos2);
 
+      AddProjection(pos1, pos2, 9.210*sigmaSquare1, 9.210*sigmaSquare2);
+
+      // Quality for ordered sampling
+      uchar d1[MapPoint::DESCRIPTOR_SIZE], d2[MapPoint::DESCRIPTOR_SIZE];
+      if (pMP1->GetDescriptor(d1) && pMP2->GetDescriptor(d2))
+        mvDistances.push_back(ORBmatcher::DescriptorDistance(d1, d2));
+      else
+        bDistances = false;
+
       mvAllIndices.push_back(idx);
       idx++;
     }
   }
 
-  mK1 = pKF1->mK;
-  mK2 = pKF2->mK;
-
-  FromCameraToImage(mvX3Dc1, mvP1im1, mK1);
-  FromCameraToImage(mvX3Dc2, mvP2im2, mK2);
+  if (!bDistances)
+    mvDistances.clear();
 
   SetRansacParameters();
 }
 
-void Sim3Solver::SetRansacParameters(double probability, int minInliers, int maxIterations) {
+void Sim3Solver::SetRansacParameters(double probability, int minInliers, int maxIterations, bool bProsac) {
   mRansacProb = probability;
   mRansacMinInliers = minInliers;
   mRansacMaxIts = maxIterations;
@@ -132,6 +142,13 @@ void Sim3Solver::SetRansacParameters(double probability, int minInliers, int max
   mRansacMaxIts = std::max(1, std::min(nIterations, mRansacMaxIts));
 
   mnIterations = 0;
+
+  // Ordered sampling needs the quality of every correspondence
+  mbProsac = false;
+  if (bProsac && !mvDistances.empty()) {
+    mProsac.Init(mvDistances, 3, mRansacMaxIts);
+    mbProsac = mProsac.IsValid();
+  }
 }
 
 Eigen::Matrix4d Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInliers, int &nInliers) {
@@ -145,6 +162,7 @@ Eigen::Matrix4d Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool>
   }
 
   vector<size_t> vAvailableIndices;
+  vector<size_t> vSet;
 
   Eigen::Matrix3d P3Dc1i;
   Eigen::Matrix3d P3Dc2i;
@@ -154,24 +172,33 @@ Eigen::Matrix4d Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool>
     nCurrentIterations++;
     mnIterations++;
 
-    vAvailableIndices = mvAllIndices;
-
     // Get min set of points
-    for (short i = 0; i < 3; ++i) {
-      int randi = Random(0, vAvailableIndices.size()-1);
+    if (mbProsac) {
+      mProsac.Sample(vSet);
+      for (short i = 0; i < 3; ++i) {
+        P3Dc1i.col(i) = mvX3Dc1[vSet[i]];
+        P3Dc2i.col(i) = mvX3Dc2[vSet[i]];
+      }
+    } else {
+      vAvailableIndices = mvAllIndices;
 
-      int idx = vAvailableIndices[randi];
+      for (short i = 0; i < 3; ++i) {
+        int randi = Random(0, vAvailableIndices.size()-1);
 
-      P3Dc1i.col(i) = mvX3Dc1[idx];
-      P3Dc2i.col(i) = mvX3Dc2[idx];
+        int idx = vAvailableIndices[randi];
 
-      vAvailableIndices[randi] = vAvailableIndices.back();
-      vAvailableIndices.pop_back();
+        P3Dc1i.col(i) = mvX3Dc1[idx];
+        P3Dc2i.col(i) = mvX3Dc2[idx];
+
+        vAvailableIndices[randi] = vAvailableIndices.back();
+        vAvailableIndices.pop_back();
+      }
     }
 
     ComputeSim3(P3Dc1i, P3Dc2i);
 
-    CheckInliers();
+    // Hypotheses that can not reach the best one are abandoned early
+    CheckInliers(mnBestInliers);
 
     if (mnInliersi >= mnBestInliers) {
       mvbBestInliers = mvbInliersi;
@@ -318,25 +345,113 @@ void Sim3Solver::ComputeSim3(const Eigen::Matrix3d &P1, const Eigen::Matrix3d &P
 }
 
 
-void Sim3Solver::CheckInliers() {
-  vector<Eigen::Vector2d> vP1im2, vP2im1;
-  Project(mvX3Dc2, vP2im1, mT12i, mK1);
-  Project(mvX3Dc1, vP1im2, mT21i, mK2);
+void Sim3Solver::AddProjection(const Eigen::Vector3d &X3Dc1, const Eigen::Vector3d &X3Dc2, double maxError1, double maxError2) {
+  for (int k = 0; k < 3; k++) {
+    mvX1[k].push_back(X3Dc1(k));
+    mvX2[k].push_back(X3Dc2(k));
+  }
+
+  mvU1.push_back(mK1(0, 0)*X3Dc1(0)/X3Dc1(2)+mK1(0, 2));
+  mvV1.push_back(mK1(1, 1)*X3Dc1(1)/X3Dc1(2)+mK1(1, 2));
+  mvU2.push_back(mK2(0, 0)*X3Dc2(0)/X3Dc2(2)+mK2(0, 2));
+  mvV2.push_back(mK2(1, 1)*X3Dc2(1)/X3Dc2(2)+mK2(1, 2));
+
+  mvMaxError1.push_back(maxError1);
+  mvMaxError2.push_back(maxError2);
+}
+
+void Sim3Solver::CheckInliers(int nMinInliers) {
+  const Eigen::Matrix3d R12 = mT12i.block<3, 3>(0, 0);
+  const Eigen::Vector3d t12 = mT12i.block<3, 1>(0, 3);
+  const Eigen::Matrix3d R21 = mT21i.block<3, 3>(0, 0);
+  const Eigen::Vector3d t21 = mT21i.block<3, 1>(0, 3);
+  const double fx1 = mK1(0, 0), fy1 = mK1(1, 1), cx1 = mK1(0, 2), cy1 = mK1(1, 2);
+  const double fx2 = mK2(0, 0), fy2 = mK2(1, 1), cx2 = mK2(0, 2), cy2 = mK2(1, 2);
+  const int n = mvU1.size();
 
   mnInliersi = 0;
+  int i = 0;
+
+#if defined(__AVX__)
+  __m256d R12v[3][3], t12v[3], R21v[3][3], t21v[3];
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) {
+      R12v[r][c] = _mm256_set1_pd(R12(r, c));
+      R21v[r][c] = _mm256_set1_pd(R21(r, c));
+    }
+    t12v[r] = _mm256_set1_pd(t12(r));
+    t21v[r] = _mm256_set1_pd(t21(r));
+  }
 
-  for (size_t i = 0; i<mvP1im1.size(); i++) {
-    Eigen::Vector2d dist1 = mvP1im1[i]-vP2im1[i];
-    Eigen::Vector2d dist2 = vP1im2[i]-mvP2im2[i];
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d fx1v = _mm256_set1_pd(fx1), fy1v = _mm256_set1_pd(fy1);
+  const __m256d cx1v = _mm256_set1_pd(cx1), cy1v = _mm256_set1_pd(cy1);
+  const __m256d fx2v = _mm256_set1_pd(fx2), fy2v = _mm256_set1_pd(fy2);
+  const __m256d cx2v = _mm256_set1_pd(cx2), cy2v = _mm256_set1_pd(cy2);
+
+  for (; i+4 <= n; i += 4) {
+    // Stop if remaining points are not enough
+    if (mnInliersi+n-i < nMinInliers)
+      return;
+
+    __m256d X1[3], X2[3];
+    for (int k = 0; k < 3; k++) {
+      X1[k] = _mm256_loadu_pd(&mvX1[k][i]);
+      X2[k] = _mm256_loadu_pd(&mvX2[k][i]);
+    }
 
-    const float err1 = dist1.dot(dist1);
-    const float err2 = dist2.dot(dist2);
+    // Points of keyframe 2 in keyframe 1 and viceversa
+    __m256d X21[3], X12[3];
+    for (int r = 0; r < 3; r++) {
+      X21[r] = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(R12v[r][0], X2[0]), _mm256_mul_pd(R12v[r][1], X2[1])),
+                             _mm256_add_pd(_mm256_mul_pd(R12v[r][2], X2[2]), t12v[r]));
+      X12[r] = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(R21v[r][0], X1[0]), _mm256_mul_pd(R21v[r][1], X1[1])),
+                             _mm256_add_pd(_mm256_mul_pd(R21v[r][2], X1[2]), t21v[r]));
+    }
 
-    if (err1<mvnMaxError1[i] && err2<mvnMaxError2[i]) {
-      mvbInliersi[i]=true;
+    const __m256d invz1 = _mm256_div_pd(one, X21[2]);
+    const __m256d du1 = _mm256_sub_pd(_mm256_loadu_pd(&mvU1[i]),
+                                      _mm256_add_pd(_mm256_mul_pd(fx1v, _mm256_mul_pd(X21[0], invz1)), cx1v));
+    const __m256d dv1 = _mm256_sub_pd(_mm256_loadu_pd(&mvV1[i]),
+                                      _mm256_add_pd(_mm256_mul_pd(fy1v, _mm256_mul_pd(X21[1], invz1)), cy1v));
+    const __m256d err1 = _mm256_add_pd(_mm256_mul_pd(du1, du1), _mm256_mul_pd(dv1, dv1));
+
+    const __m256d invz2 = _mm256_div_pd(one, X12[2]);
+    const __m256d du2 = _mm256_sub_pd(_mm256_loadu_pd(&mvU2[i]),
+                                      _mm256_add_pd(_mm256_mul_pd(fx2v, _mm256_mul_pd(X12[0], invz2)), cx2v));
+    const __m256d dv2 = _mm256_sub_pd(_mm256_loadu_pd(&mvV2[i]),
+                                      _mm256_add_pd(_mm256_mul_pd(fy2v, _mm256_mul_pd(X12[1], invz2)), cy2v));
+    const __m256d err2 = _mm256_add_pd(_mm256_mul_pd(du2, du2), _mm256_mul_pd(dv2, dv2));
+
+    // Ordered comparisons, points behind the camera (inf or nan) are outliers
+    const __m256d inlier = _mm256_and_pd(_mm256_cmp_pd(err1, _mm256_loadu_pd(&mvMaxError1[i]), _CMP_LT_OQ),
+                                         _mm256_cmp_pd(err2, _mm256_loadu_pd(&mvMaxError2[i]), _CMP_LT_OQ));
+    const int mask = _mm256_movemask_pd(inlier);
+    for (int k = 0; k < 4; k++)
+      mvbInliersi[i+k] = (mask >> k) & 1;
+    mnInliersi += __builtin_popcount(mask);
+  }
+#endif
+
+  // Remaining points (all of them without AVX)
+  for (; i < n; i++) {
+    if (mnInliersi+n-i < nMinInliers)
+      return;
+
+    const Eigen::Vector3d X21 = R12*Eigen::Vector3d(mvX2[0][i], mvX2[1][i], mvX2[2][i])+t12;
+    const double invz1 = 1.0/X21(2);
+    const double du1 = mvU1[i]-(fx1*X21(0)*invz1+cx1);
+    const double dv1 = mvV1[i]-(fy1*X21(1)*invz1+cy1);
+
+    const Eigen::Vector3d X12 = R21*Eigen::Vector3d(mvX1[0][i], mvX1[1][i], mvX1[2][i])+t21;
+    const double invz2 = 1.0/X12(2);
+    const double du2 = mvU2[i]-(fx2*X12(0)*invz2+cx2);
+    const double dv2 = mvV2[i]-(fy2*X12(1)*invz2+cy2);
+
+    const bool bIn = du1*du1+dv1*dv1 < mvMaxError1[i] && du2*du2+dv2*dv2 < mvMaxError2[i];
+    mvbInliersi[i] = bIn;
+    if (bIn)
       mnInliersi++;
-    } else
-      mvbInliersi[i]=false;
   }
 }
 
@@ -353,43 +468,4 @@ float Sim3Solver::GetEstimatedScale() {
   return mBestScale;
 }
 
-void Sim3Solver::Project(const vector<Eigen::Vector3d> &vP3Dw, vector<Eigen::Vector2d> &vP2D, const Eigen::Matrix4d &Tcw, const Eigen::Matrix3d &K) {
-  Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
-  Eigen::Vector3d tcw = Tcw.block<3, 1>(0, 3);
-  const float fx = K(0, 0);
-  const float fy = K(1, 1);
-  const float cx = K(0, 2);
-  const float cy = K(1, 2);
-
-  vP2D.clear();
-  vP2D.reserve(vP3Dw.size());
-
-  for (size_t i = 0, iend=vP3Dw.size(); i < iend; i++) {
-    Eigen::Vector3d P3Dc = Rcw*vP3Dw[i]+tcw;
-    const float invz = 1/(P3Dc(2));
-    const float x = P3Dc(0)*invz;
-    const float y = P3Dc(1)*invz;
-
-    vP2D.push_back(Eigen::Vector2d(fx*x+cx, fy*y+cy));
-  }
-}
-
-void Sim3Solver::FromCameraToImage(const vector<Eigen::Vector3d> &vP3Dc, vector<Eigen::Vector2d> &vP2D, const Eigen::Matrix3d &K) {
-  const float fx = K(0, 0);
-  const float fy = K(1, 1);
-  const float cx = K(0, 2);
-  const float cy = K(1, 2);
-
-  vP2D.clear();
-  vP2D.reserve(vP3Dc.size());
-
-  for (size_t i = 0, iend=vP3Dc.size(); i < iend; i++) {
-    const float invz = 1/(vP3Dc[i](2));
-    const float x = vP3Dc[i](0)*invz;
-    const float y = vP3Dc[i](1)*invz;
-
-    vP2D.push_back(Eigen::Vector2d(fx*x+cx, fy*y+cy));
-  }
-}
-
 }  // namespace SD_SLAM
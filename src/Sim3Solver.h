@@ -29,6 +29,7 @@
 #include <opencv2/opencv.hpp>
 #include <Eigen/Dense>
 #include "KeyFrame.h"
+#include "extra/prosac.h"
 
 namespace SD_SLAM {
 
@@ -36,7 +37,8 @@ class Sim3Solver {
  public:
   Sim3Solver(KeyFrame* pKF1, KeyFrame* pKF2, const std::vector<MapPoint*> &vpMatched12, const bool bFixScale = true);
 
-  void SetRansacParameters(double probability = 0.99, int minInliers = 6 , int maxIterations = 300);
+  // If bProsac is set, minimal sets are sampled with PROSAC ordered by descriptor distance
+  void SetRansacParameters(double probability = 0.99, int minInliers = 6 , int maxIterations = 300, bool bProsac = false);
 
   Eigen::Matrix4d find(std::vector<bool> &vbInliers12, int &nInliers);
 
@@ -52,10 +54,12 @@ class Sim3Solver {
 
   void ComputeSim3(const Eigen::Matrix3d &P1, const Eigen::Matrix3d &P2);
 
-  void CheckInliers();
+  // Count inliers of current hypothesis. Verification stops as soon as nMinInliers
+  // can not be reached, leaving mnInliersi below it. Points are reprojected 4 at a time with AVX
+  void CheckInliers(int nMinInliers = 0);
 
-  void Project(const std::vector<Eigen::Vector3d> &vP3Dw, std::vector<Eigen::Vector2d> &vP2D, const Eigen::Matrix4d &Tcw, const Eigen::Matrix3d &K);
-  void FromCameraToImage(const std::vector<Eigen::Vector3d> &vP3Dc, std::vector<Eigen::Vector2d> &vP2D, const Eigen::Matrix3d &K);
+  // Add correspondence to the buffers read by CheckInliers
+  void AddProjection(const Eigen::Vector3d &X3Dc1, const Eigen::Vector3d &X3Dc2, double maxError1, double maxError2);
 
 
  protected:
@@ -69,10 +73,6 @@ class Sim3Solver {
   std::vector<MapPoint*> mvpMapPoints2;
   std::vector<MapPoint*> mvpMatches12;
   std::vector<size_t> mvnIndices1;
-  std::vector<size_t> mvSigmaSquare1;
-  std::vector<size_t> mvSigmaSquare2;
-  std::vector<size_t> mvnMaxError1;
-  std::vector<size_t> mvnMaxError2;
 
   int N;
   int mN1;
@@ -101,9 +101,18 @@ class Sim3Solver {
   // Indices for random selection
   std::vector<size_t> mvAllIndices;
 
-  // Projections
-  std::vector<Eigen::Vector2d> mvP1im1;
-  std::vector<Eigen::Vector2d> mvP2im2;
+  // Descriptor distance of each correspondence, empty if not available
+  std::vector<float> mvDistances;
+
+  // Sampler for ordered selection
+  bool mbProsac;
+  ProsacSampler mProsac;
+
+  // Points in camera coordinates, their projections in their own keyframe and the maximum squared
+  // reprojection error of each correspondence, as structure of arrays
+  std::vector<double> mvX1[3], mvX2[3];
+  std::vector<double> mvU1, mvV1, mvU2, mvV2;
+  std::vector<double> mvMaxError1, mvMaxError2;
 
   // RANSAC probability
   double mRansacProb;
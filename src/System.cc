@@ -23,13 +23,23 @@
  */
 
 #include "System.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <set>
+#include <unordered_map>
 #include <iomanip>
 #include <fstream>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "Config.h"
+#include "MapMerger.h"
+#include "Optimizer.h"
 #include "extra/timer.h"
 #include "extra/log.h"
+#include "extra/utils.h"
+#include "extra/trace.h"
+#include "extra/lie.h"
 
 using std::mutex;
 using std::unique_lock;
@@ -40,32 +50,94 @@ using std::endl;
 
 namespace SD_SLAM {
 
-System::System(const eSensor sensor, bool loopClosing): mSensor(sensor), mbReset(false),
-               mbActivateLocalizationMode(false), mbDeactivateLocalizationMode(false),
-               stopRequested_(false) {
+System::System(const eSensor sensor, bool loopClosing, bool localizationOnly): mSensor(sensor),
+               mbLocalizationOnly(localizationOnly), mbReset(false),
+               mbActivateLocalizationMode(false), mbDeactivateLocalizationMode(false), mnLastBigChangeIdx(0),
+               stopRequested_(false), mptInput(nullptr), mbFinishInput(false), mLastIMUTimestamp(-1.0),
+               mbRecording(false), mbDeterministic(false), mpCheckpointer(nullptr), mptCheckpoint(nullptr),
+               mpMetrics(nullptr), mpRemoteLoop(nullptr), mptRemoteLoop(nullptr), mbLoaded(true) {
   if (mSensor==MONOCULAR) {
     LOGD("Input sensor was set to Monocular");
   } else if (mSensor==RGBD) {
     LOGD("Input sensor was set to RGB-D");
   } else if (mSensor==MONOCULAR_IMU) {
     LOGD("Input sensor was set to Monocular-IMU");
+  } else if (mSensor==STEREO) {
+    LOGD("Input sensor was set to Stereo");
   }
 
+  // No frame processed yet
+  std::shared_ptr<Results> results(new Results());
+  results->nFrameId = 0;
+  results->state = Tracking::NO_IMAGES_YET;
+  results->Tcw.setIdentity();
+  mpResults = results;
+
+  // Nothing to extrapolate from yet
+  FramePrediction frame = FramePrediction();
+  frame.timestamp = -1.0;
+  SeqLock::Store(mFramePrediction, &frame, sizeof(frame));
+  IMUPrediction imu = IMUPrediction();
+  imu.timestamp = -1.0;
+  SeqLock::Store(mIMUPrediction, &imu, sizeof(imu));
+
   // Create the Map
   mpMap = new Map();
 
+  // Calling thread runs tracking
+  SetThreadPlacement(Config::TrackingCore(), Config::TrackingPriority(), 0);
+
+  if (!Config::TraceFile().empty()) {
+    Trace::Start(Config::TraceEvents());
+    Trace::SetThreadName("Tracking");
+  }
+
+  if (!Config::RecordFile().empty()) {
+    mbRecording = mRecorder.Open(Config::RecordFile(), mSensor);
+    if (!mbRecording) {
+      LOGE("Can't write input recording %s", Config::RecordFile().c_str());
+    }
+  }
+
+  // Worker threads for parallel tasks of every subsystem
+  mpThreadPool = new ThreadPool(Config::Threads(), Config::ThreadAffinity());
+  LOGD("Thread pool with %d threads", mpThreadPool->GetThreads());
+
+  mpEnergy = new EnergyPolicy(Config::EnergyDutyCycle(), Config::EnergyLoopBatch());
+
   // Initialize the Tracking thread (it will live in the main thread of execution)
-  mpTracker = new Tracking(this, mpMap, mSensor);
+  mpTracker = new Tracking(this, mpMap, mSensor, mbLocalizationOnly, mpThreadPool);
+
+  if (mbLocalizationOnly) {
+    LOGD("Localization only mode, mapping threads not launched");
+    mpLocalMapper = nullptr;
+    mptLocalMapping = nullptr;
+    mpLoopCloser = nullptr;
+    mptLoopClosing = nullptr;
+    return;
+  }
 
   // Initialize the Local Mapping thread and launch
-  mpLocalMapper = new LocalMapping(mpMap, mSensor!=RGBD);
+  mpLocalMapper = new LocalMapping(mpMap, mSensor==MONOCULAR || mSensor==MONOCULAR_IMU, mpThreadPool);
   mptLocalMapping = new std::thread(&SD_SLAM::LocalMapping::Run, mpLocalMapper);
 
   // Initialize the Loop Closing thread and launch
   if (loopClosing) {
     LOGD("Loop closing activated");
-    mpLoopCloser = new LoopClosing(mpMap, mSensor==RGBD);
-    mptLoopClosing = new std::thread(&SD_SLAM::LoopClosing::Run, mpLoopCloser);
+    mpLoopCloser = new LoopClosing(mpMap, mSensor==RGBD || mSensor==STEREO, mpThreadPool);
+    mpLoopCloser->SetEnergyPolicy(mpEnergy);
+
+    // Loops are closed by a server if it is reachable, here otherwise. With fast start, the
+    // connection is made by the loop closing thread, keyframes wait in its queue meanwhile
+    if (Config::FastStart()) {
+      mptLoopClosing = new std::thread([this] {
+        ConnectLoopServer();
+        mpLoopCloser->Run();
+      });
+    } else {
+      ConnectLoopServer();
+      mptLoopClosing = new std::thread(&SD_SLAM::LoopClosing::Run, mpLoopCloser);
+    }
   } else {
     LOGD("Loop closing not activated");
     mpLoopCloser = nullptr;
@@ -75,6 +147,7 @@ System::System(const eSensor sensor, bool loopClosing): mSensor(sensor), mbReset
   // Set pointers between threads
   mpTracker->SetLocalMapper(mpLocalMapper);
   mpLocalMapper->SetTracker(mpTracker);
+  mpLocalMapper->SetEnergyPolicy(mpEnergy);
 
   if (loopClosing) {
     mpTracker->SetLoopClosing(mpLoopCloser);
@@ -82,6 +155,42 @@ System::System(const eSensor sensor, bool loopClosing): mSensor(sensor), mbReset
     mpLoopCloser->SetTracker(mpTracker);
     mpLoopCloser->SetLocalMapper(mpLocalMapper);
   }
+
+  // Launch background checkpoints
+  if (!Config::CheckpointFile().empty()) {
+    LOGD("Map checkpoints every %.1fs to %s", Config::CheckpointPeriod(), Config::CheckpointFile().c_str());
+    mpCheckpointer = new MapCheckpointer(Config::CheckpointFile(), mpMap, mSensor==RGBD || mSensor==STEREO,
+                                         Config::CheckpointPeriod());
+    mptCheckpoint = new std::thread(&SD_SLAM::MapCheckpointer::Run, mpCheckpointer);
+  }
+
+  // Serve live metrics on localhost
+  if (Config::MetricsPort() > 0) {
+    mpMetrics = new MetricsExporter();
+    if (mpMetrics->Start(Config::MetricsPort())) {
+      LOGD("Metrics on http://localhost:%d/metrics", Config::MetricsPort());
+    } else {
+      LOGE("Can't serve metrics on port %d", Config::MetricsPort());
+      delete mpMetrics;
+      mpMetrics = nullptr;
+    }
+  }
+}
+
+void System::ConnectLoopServer() {
+  if (Config::LoopServer().empty())
+    return;
+
+  mpRemoteLoop = new RemoteLoopClient(mpMap, mSensor==RGBD || mSensor==STEREO);
+  if (mpRemoteLoop->Connect(Config::LoopServer())) {
+    LOGD("Loop closing offloaded to %s", Config::LoopServer().c_str());
+    mpLoopCloser->SetRemote(mpRemoteLoop);
+    mptRemoteLoop = new std::thread(&SD_SLAM::RemoteLoopClient::Run, mpRemoteLoop);
+  } else {
+    LOGE("Can't connect to loop closing server %s, closing loops locally", Config::LoopServer().c_str());
+    delete mpRemoteLoop;
+    mpRemoteLoop = nullptr;
+  }
 }
 
 Eigen::Matrix4d System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, const std::string filename) {
@@ -92,49 +201,51 @@ Eigen::Matrix4d System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, co
     exit(-1);
   }
 
-  // Check mode change
-  {
-    unique_lock<mutex> lock(mMutexMode);
-    if(mbActivateLocalizationMode) {
-      mpLocalMapper->RequestStop();
+  if (mbRecording)
+    RecordFrame(InputRecord::RGBD, {im}, depthmap, vector<double>(), 0.0, filename);
 
-      // Wait until Local Mapping has effectively stopped
-      while(!mpLocalMapper->isStopped()) {
-        usleep(1000);
-      }
+  // Check mode change and reset
+  CheckRequests(true);
 
-      mpTracker->InformOnlyTracking(true);
-      mbActivateLocalizationMode = false;
-    }
-    if(mbDeactivateLocalizationMode) {
-      mpTracker->InformOnlyTracking(false);
-      mpLocalMapper->Release();
-      mbDeactivateLocalizationMode = false;
-    }
-  }
+  Timer total(true);
 
-  // Check reset
-  {
-    unique_lock<mutex> lock(mMutexReset);
-    if (mbReset) {
-      mpTracker->Reset();
-      mbReset = false;
-    }
+  Eigen::Matrix4d Tcw = mpTracker->GrabImageRGBD(im, depthmap, filename);
+
+  total.Stop();
+  Statistics::Record(Statistics::TRACKING, total.GetMsTime());
+  LOGD("Tracking time is %.2fms", total.GetMsTime());
+
+  LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
+
+  UpdateTrackingState(total.GetMsTime());
+  return Tcw;
+}
+
+Eigen::Matrix4d System::TrackStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const std::string filename) {
+  LOGD("Track stereo images");
+
+  if (mSensor!=STEREO) {
+    LOGE("Called TrackStereo but input sensor was not set to Stereo");
+    exit(-1);
   }
 
+  if (mbRecording)
+    RecordFrame(InputRecord::STEREO, {imLeft, imRight}, cv::Mat(), vector<double>(), 0.0, filename);
+
+  // Check mode change and reset
+  CheckRequests(true);
+
   Timer total(true);
 
-  Eigen::Matrix4d Tcw = mpTracker->GrabImageRGBD(im, depthmap, filename);
+  Eigen::Matrix4d Tcw = mpTracker->GrabImageStereo(imLeft, imRight, filename);
 
   total.Stop();
+  Statistics::Record(Statistics::TRACKING, total.GetMsTime());
   LOGD("Tracking time is %.2fms", total.GetMsTime());
 
   LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
 
-  unique_lock<mutex> lock2(mMutexState);
-  mTrackingState = mpTracker->GetState();
-  mTrackedMapPoints = mpTracker->GetCurrentFrame().mvpMapPoints;
-  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn;
+  UpdateTrackingState(total.GetMsTime());
   return Tcw;
 }
 
@@ -146,88 +257,537 @@ Eigen::Matrix4d System::TrackMonocular(const cv::Mat &im, const std::string file
     exit(-1);
   }
 
-  // Check mode change
-  {
-    unique_lock<mutex> lock(mMutexMode);
-    if(mbActivateLocalizationMode) {
-      mpLocalMapper->RequestStop();
+  if (mbRecording)
+    RecordFrame(InputRecord::MONOCULAR, {im}, cv::Mat(), vector<double>(), 0.0, filename);
 
-      // Wait until Local Mapping has effectively stopped
-      while(!mpLocalMapper->isStopped()) {
-        usleep(1000);
-      }
+  // Check mode change and reset
+  CheckRequests(true);
 
-      mpTracker->InformOnlyTracking(true);
-      mbActivateLocalizationMode = false;
-    }
-    if(mbDeactivateLocalizationMode) {
-      mpTracker->InformOnlyTracking(false);
-      mpLocalMapper->Release();
-      mbDeactivateLocalizationMode = false;
-    }
+  Timer total(true);
+
+  Eigen::Matrix4d Tcw = mpTracker->GrabImageMonocular(im, filename);
+
+  total.Stop();
+  Statistics::Record(Statistics::TRACKING, total.GetMsTime());
+  LOGD("Tracking time is %.2fms", total.GetMsTime());
+
+  LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
+
+  UpdateTrackingState(total.GetMsTime());
+
+  return Tcw;
+}
+
+Eigen::Matrix4d System::TrackFusion(const cv::Mat &im, const vector<double> &measurements, const std::string filename) {
+  LOGD("Track monocular image with other sensor measurements");
+
+  if (mSensor!=MONOCULAR_IMU) {
+    LOGE("Called TrackFusion but input sensor was not set to Monocular-IMU");
+    exit(-1);
   }
 
+  if (mbRecording)
+    RecordFrame(InputRecord::FUSION, {im}, cv::Mat(), measurements, 0.0, filename);
+
   // Check reset
-  {
-    unique_lock<mutex> lock(mMutexReset);
-    if (mbReset) {
-      mpTracker->Reset();
-      mbReset = false;
-    }
-  }
+  CheckRequests(false);
 
   Timer total(true);
 
+  mpTracker->SetMeasurements(measurements);
   Eigen::Matrix4d Tcw = mpTracker->GrabImageMonocular(im, filename);
 
   total.Stop();
+  Statistics::Record(Statistics::TRACKING, total.GetMsTime());
   LOGD("Tracking time is %.2fms", total.GetMsTime());
 
   LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
 
-  unique_lock<mutex> lock2(mMutexState);
-  mTrackingState = mpTracker->GetState();
-  mTrackedMapPoints = mpTracker->GetCurrentFrame().mvpMapPoints;
-  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn;
+  UpdateTrackingState(total.GetMsTime());
 
   return Tcw;
 }
 
-Eigen::Matrix4d System::TrackFusion(const cv::Mat &im, const vector<double> &measurements, const std::string filename) {
-  LOGD("Track monocular image with other sensor measurements");
+Eigen::Matrix4d System::TrackFusion(const cv::Mat &im, double timestamp, const std::string filename) {
+  LOGD("Track monocular image with preintegrated IMU samples");
 
   if (mSensor!=MONOCULAR_IMU) {
     LOGE("Called TrackFusion but input sensor was not set to Monocular-IMU");
     exit(-1);
   }
 
+  if (mbRecording)
+    RecordFrame(InputRecord::FUSION_IMU, {im}, cv::Mat(), vector<double>(), timestamp, filename);
+
   // Check reset
-  {
-    unique_lock<mutex> lock(mMutexReset);
-    if (mbReset) {
-      mpTracker->Reset();
-      mbReset = false;
-    }
-  }
+  CheckRequests(false);
 
   Timer total(true);
 
-  mpTracker->SetMeasurements(measurements);
+  SetIMUInput(timestamp);
   Eigen::Matrix4d Tcw = mpTracker->GrabImageMonocular(im, filename);
 
   total.Stop();
+  Statistics::Record(Statistics::TRACKING, total.GetMsTime());
+  LOGD("Tracking time is %.2fms", total.GetMsTime());
+
+  LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
+
+  UpdateTrackingState(total.GetMsTime());
+
+  return Tcw;
+}
+
+void System::SetTimestamp(double timestamp) {
+  mpTracker->SetTimestamp(timestamp);
+}
+
+void System::SetMask(const cv::Mat &mask) {
+  mpTracker->SetMask(mask);
+}
+
+void System::AddIMUMeasurement(double timestamp, const Eigen::Vector3d &gyro, const Eigen::Vector3d &acc) {
+  if (mbRecording) {
+    InputRecord record;
+    record.type = InputRecord::IMU;
+    record.timestamp = timestamp;
+    record.values = {gyro(0), gyro(1), gyro(2), acc(0), acc(1), acc(2)};
+    mRecorder.Write(record);
+  }
+
+  mIMUBuffer.Add(timestamp, gyro, acc);
+
+  // Newest sample for GetPredictedPose
+  unique_lock<mutex> lock(mMutexIMUPrediction);
+  IMUPrediction imu;
+  SeqLock::Load(&imu, mIMUPrediction, sizeof(imu));
+  if (timestamp <= imu.timestamp)
+    return;
+
+  Eigen::Matrix3d R;
+  if (!mIMUBuffer.Rotation(timestamp, R))
+    return;
+
+  imu.timestamp = timestamp;
+  Eigen::Map<Eigen::Vector3d>(imu.gyro) = gyro;
+  Eigen::Map<Eigen::Matrix3d>(imu.R) = R;
+
+  mIMUPredictionLock.BeginWrite();
+  SeqLock::Store(mIMUPrediction, &imu, sizeof(imu));
+  mIMUPredictionLock.EndWrite();
+}
+
+void System::SetIMUInput(double timestamp) {
+  Eigen::Vector3d w, a;
+  IMUBuffer::Preintegrated p;
+
+  if (mLastIMUTimestamp >= 0.0 && mIMUBuffer.Integrate(mLastIMUTimestamp, timestamp, p) && p.dt > 0.0) {
+    w = p.MeanGyro();
+    a = p.MeanAcc();
+  } else if (!mIMUBuffer.Measurement(timestamp, w, a)) {
+    LOGE("No IMU samples before frame at %.6f", timestamp);
+    w.setZero();
+    a.setZero();
+  }
+  mLastIMUTimestamp = timestamp;
+
+  vector<double> measurements = {w(0), w(1), w(2), a(0), a(1), a(2)};
+  mpTracker->SetMeasurements(measurements);
+  mpTracker->SetMotionInput(measurements);
+  mpTracker->SetTimestamp(timestamp);
+}
+
+void System::RecordFrame(uint8_t type, const vector<cv::Mat> &ims, const cv::Mat &depthmap,
+                         const vector<double> &values, double timestamp, const std::string &filename) {
+  InputRecord record;
+  record.type = type;
+  record.timestamp = timestamp;
+  record.images = ims;
+  record.depth = depthmap;
+  record.values = values;
+  record.filename = filename;
+  mRecorder.Write(record);
+}
+
+Eigen::Matrix4d System::TrackRig(const vector<cv::Mat> &ims, const cv::Mat &depthmap, const std::string filename) {
+  LOGD("Track camera rig images");
+
+  if (mSensor==MONOCULAR_IMU) {
+    LOGE("Called TrackRig but input sensor was set to Monocular-IMU");
+    exit(-1);
+  }
+
+  if (mbRecording)
+    RecordFrame(InputRecord::RIG, ims, depthmap, vector<double>(), 0.0, filename);
+
+  // Check mode change and reset
+  CheckRequests(true);
+
+  Timer total(true);
+
+  Eigen::Matrix4d Tcw = mpTracker->GrabImageRig(ims, mSensor==RGBD || mSensor==STEREO ? depthmap : cv::Mat(), filename);
+
+  total.Stop();
+  Statistics::Record(Statistics::TRACKING, total.GetMsTime());
   LOGD("Tracking time is %.2fms", total.GetMsTime());
 
   LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
 
-  unique_lock<mutex> lock2(mMutexState);
-  mTrackingState = mpTracker->GetState();
-  mTrackedMapPoints = mpTracker->GetCurrentFrame().mvpMapPoints;
-  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn;
+  UpdateTrackingState(total.GetMsTime());
 
   return Tcw;
 }
 
+std::future<System::Pose> System::SubmitFrame(const cv::Mat &im, const cv::Mat &depthmap,
+                                              const vector<double> &measurements, double timestamp,
+                                              const std::string filename) {
+  InputFrame frame;
+  im.copyTo(frame.im);
+  depthmap.copyTo(frame.depthmap);
+  frame.measurements = measurements;
+  frame.timestamp = timestamp;
+  frame.filename = filename;
+
+  return PushInput(std::move(frame));
+}
+
+std::future<System::Pose> System::SubmitSharedFrame(const cv::Mat &im, const cv::Mat &depthmap,
+                                                    std::shared_ptr<const void> hold,
+                                                    const vector<double> &measurements, double timestamp,
+                                                    const std::string filename) {
+  InputFrame frame;
+  frame.im = im;
+  frame.depthmap = depthmap;
+  frame.hold = std::move(hold);
+  frame.measurements = measurements;
+  frame.timestamp = timestamp;
+  frame.filename = filename;
+
+  return PushInput(std::move(frame));
+}
+
+std::future<System::Pose> System::PushInput(InputFrame &&frame) {
+  std::future<Pose> result = frame.pose.get_future();
+
+  // Recorded as the equivalent synchronous call
+  if (mbRecording) {
+    if (mSensor == MONOCULAR)
+      RecordFrame(InputRecord::MONOCULAR, {frame.im}, cv::Mat(), vector<double>(), 0.0, frame.filename);
+    else if (mSensor == RGBD)
+      RecordFrame(InputRecord::RGBD, {frame.im}, frame.depthmap, vector<double>(), 0.0, frame.filename);
+    else if (mSensor == STEREO)
+      RecordFrame(InputRecord::STEREO, {frame.im, frame.depthmap}, cv::Mat(), vector<double>(), 0.0, frame.filename);
+    else if (frame.measurements.empty())
+      RecordFrame(InputRecord::FUSION_IMU, {frame.im}, cv::Mat(), vector<double>(), frame.timestamp, frame.filename);
+    else
+      RecordFrame(InputRecord::FUSION, {frame.im}, cv::Mat(), frame.measurements, 0.0, frame.filename);
+  }
+
+  const size_t max_size = std::max(Config::InputQueueSize(), 1);
+
+  unique_lock<mutex> lock(mMutexInput);
+
+  // Offline, wait for room in the queue instead of dropping frames
+  if (Config::InputOffline())
+    mCondInputSpace.wait(lock, [this, max_size] { return mbFinishInput || mlInputFrames.size() < max_size; });
+
+  if (mbFinishInput) {
+    frame.pose.set_value(Pose::Zero());
+    return result;
+  }
+
+  // Launch input thread the first time
+  if (!mptInput)
+    mptInput = new std::thread(&SD_SLAM::System::RunInput, this);
+
+  // Keep queue bounded
+  while (mlInputFrames.size() >= max_size) {
+    mlInputFrames.front().pose.set_value(Pose::Zero());
+    mlInputFrames.pop_front();
+  }
+
+  mlInputFrames.push_back(std::move(frame));
+  mCondInput.notify_one();
+
+  return result;
+}
+
+void System::SetPoseCallback(const PoseCallback &callback) {
+  unique_lock<mutex> lock(mMutexInput);
+  mPoseCallback = callback;
+}
+
+void System::RunInput() {
+  SetThreadPlacement(Config::TrackingCore(), Config::TrackingPriority(), 0);
+  Trace::SetThreadName("Input");
+
+  InputFrame next;                // Input whose frame is being built
+  std::thread* ptBuild = nullptr;
+
+  while (true) {
+    InputFrame frame;
+    PoseCallback callback;
+    bool prebuilt = false;
+
+    if (ptBuild) {
+      // Frame was built while last one was tracked
+      ptBuild->join();
+      delete ptBuild;
+      ptBuild = nullptr;
+
+      frame = std::move(next);
+      prebuilt = true;
+
+      unique_lock<mutex> lock(mMutexInput);
+      if (mbFinishInput) {
+        frame.pose.set_value(Pose::Zero());
+        break;
+      }
+      callback = mPoseCallback;
+    } else {
+      unique_lock<mutex> lock(mMutexInput);
+      mCondInput.wait(lock, [this]{ return mbFinishInput || !mlInputFrames.empty(); });
+      if (mbFinishInput)
+        break;
+
+      PopInput(frame);
+      callback = mPoseCallback;
+    }
+
+    // No frame is being built now, so a reset can be applied safely
+    bool reset = CheckRequests(mSensor != MONOCULAR_IMU);
+
+    Timer total(true);
+
+    Frame current;
+    if (prebuilt && !reset && mpTracker->IsValidInputFrame(mPrebuiltFrame))
+      current = std::move(mPrebuiltFrame);
+    else
+      current = mpTracker->CreateInputFrame(frame.im, frame.depthmap);
+
+    // Extract features of next frame while this one is tracked
+    if (Config::InputPipeline() && mpTracker->CanPrebuildFrame()) {
+      unique_lock<mutex> lock(mMutexInput);
+      if (!mlInputFrames.empty() && !mbFinishInput) {
+        PopInput(next);
+        ptBuild = new std::thread([this, &next]() {
+          mPrebuiltFrame = mpTracker->CreateInputFrame(next.im, next.depthmap);
+        });
+      }
+    }
+
+    if (mSensor == MONOCULAR_IMU && frame.measurements.empty()) {
+      SetIMUInput(frame.timestamp);
+    } else {
+      if (mSensor == MONOCULAR_IMU)
+        mpTracker->SetMeasurements(frame.measurements);
+      if (frame.timestamp > 0.0)
+        mpTracker->SetTimestamp(frame.timestamp);
+    }
+    Eigen::Matrix4d Tcw = mpTracker->GrabFrame(std::move(current));
+
+    total.Stop();
+    Statistics::Record(Statistics::TRACKING, total.GetMsTime());
+    LOGD("Tracking time is %.2fms", total.GetMsTime());
+
+    LOGD("Pose: [%.4f, %.4f, %.4f]", Tcw(0, 3), Tcw(1, 3), Tcw(2, 3));
+
+    UpdateTrackingState(total.GetMsTime());
+
+    if (callback)
+      callback(Tcw, frame.im, frame.timestamp);
+    frame.pose.set_value(Tcw);
+  }
+}
+
+int System::Replay(InputPlayer &player, bool deterministic) {
+  if (player.GetSensor() != mSensor) {
+    LOGE("Input was recorded with another sensor (%d)", player.GetSensor());
+    return -1;
+  }
+
+  mbDeterministic = deterministic;
+
+  InputRecord record;
+  Timer clock(true);
+  int nFrames = 0;
+  while (!stopRequested_ && player.Next(record)) {
+    // Same pace as when it was recorded
+    if (!deterministic) {
+      clock.Stop();
+      if (record.time > clock.GetTime())
+        usleep((record.time-clock.GetTime())*1e6);
+    }
+
+    if (record.type == InputRecord::IMU) {
+      if (record.values.size() == 6)
+        AddIMUMeasurement(record.timestamp, Eigen::Vector3d(record.values[0], record.values[1], record.values[2]),
+                          Eigen::Vector3d(record.values[3], record.values[4], record.values[5]));
+      continue;
+    }
+
+    if (record.images.empty() || (record.type == InputRecord::STEREO && record.images.size() < 2)) {
+      LOGE("Wrong recorded frame %d", nFrames);
+      break;
+    }
+
+    // Motion model intervals from recording times (fused frames use IMU timestamps)
+    if (deterministic && record.type != InputRecord::FUSION_IMU)
+      mpTracker->SetTimestamp(record.time);
+
+    if (record.type == InputRecord::MONOCULAR) {
+      TrackMonocular(record.images[0], record.filename);
+    } else if (record.type == InputRecord::RGBD) {
+      TrackRGBD(record.images[0], record.depth, record.filename);
+    } else if (record.type == InputRecord::STEREO) {
+      TrackStereo(record.images[0], record.images[1], record.filename);
+    } else if (record.type == InputRecord::FUSION) {
+      TrackFusion(record.images[0], record.values, record.filename);
+    } else if (record.type == InputRecord::FUSION_IMU) {
+      TrackFusion(record.images[0], record.timestamp, record.filename);
+    } else if (record.type == InputRecord::RIG) {
+      TrackRig(record.images, record.depth, record.filename);
+    } else {
+      LOGE("Unknown recorded input %d", record.type);
+      break;
+    }
+    nFrames++;
+
+    if (deterministic)
+      WaitUntilMappingIdle();
+  }
+
+  mbDeterministic = false;
+  return nFrames;
+}
+
+void System::WaitUntilMappingIdle() {
+  if (mbLocalizationOnly)
+    return;
+
+  mpLocalMapper->WaitUntilIdle();
+  if (mpLoopCloser) {
+    mpLoopCloser->WaitUntilIdle();
+    mpLoopCloser->WaitUntilFinishedGBA();
+  }
+}
+
+void System::PopInput(InputFrame &frame) {
+  // Discard older frames, only newest one is tracked
+  if (Config::InputDropPolicy() == SKIP_TO_LATEST && !Config::InputOffline()) {
+    while (mlInputFrames.size() > 1) {
+      mlInputFrames.front().pose.set_value(Pose::Zero());
+      mlInputFrames.pop_front();
+    }
+  }
+
+  frame = std::move(mlInputFrames.front());
+  mlInputFrames.pop_front();
+  mCondInputSpace.notify_all();
+}
+
+bool System::CheckRequests(bool mode) {
+  // Map given to LoadTrajectoryAsync must be loaded before tracking
+  if (mLoading.valid())
+    WaitForLoad();
+
+  // Check mode change
+  if (mode && !mbLocalizationOnly) {
+    unique_lock<mutex> lock(mMutexMode);
+    if(mbActivateLocalizationMode) {
+      mpLocalMapper->RequestStop();
+
+      // Wait until Local Mapping has effectively stopped
+      mpLocalMapper->WaitUntilStopped();
+
+      mpTracker->InformOnlyTracking(true);
+      mbActivateLocalizationMode = false;
+    }
+    if(mbDeactivateLocalizationMode) {
+      mpTracker->InformOnlyTracking(false);
+      mpLocalMapper->Release();
+      mbDeactivateLocalizationMode = false;
+    }
+  }
+
+  // Check reset
+  unique_lock<mutex> lock(mMutexReset);
+  if (mbReset) {
+    // Checkpointer must not read the map while it is cleared
+    if (mpCheckpointer)
+      mpCheckpointer->Reset([this] { mpTracker->Reset(); });
+    else
+      mpTracker->Reset();
+    mbReset = false;
+    return true;
+  }
+
+  return false;
+}
+
+void System::UpdateTrackingState(double ms) {
+  // Budget depends on tracking time, it would change the workload between runs
+  if (!mbDeterministic)
+    mpTracker->UpdateFeatureBudget(ms);
+
+  const Frame &frame = mpTracker->GetCurrentFrame();
+
+  // Built outside the lock, readers keep using the previous results meanwhile
+  std::shared_ptr<Results> results(new Results());   // Aligned operator new, make_shared ignores it
+  results->nFrameId = frame.mnId;
+  results->state = mpTracker->GetState();
+  results->Tcw = frame.GetPose();
+  results->vKeyPointsUn = frame.mvKeysUn;
+
+  const int N = frame.mvpMapPoints.size();
+  results->vMapPointIdx.reserve(N);
+  results->vMapPointIds.reserve(N);
+  results->vMapPoints.reserve(N);
+  for (int i = 0; i < N; i++) {
+    MapPoint* pMP = frame.mvpMapPoints[i];
+    if (pMP && !frame.mvbOutlier[i] && !pMP->isBad()) {
+      results->vMapPointIdx.push_back(i);
+      results->vMapPointIds.push_back(pMP->mnId);
+      results->vMapPoints.push_back(pMP->GetWorldPos());
+    }
+  }
+
+  std::shared_ptr<const Results> published(results);
+  std::atomic_store(&mpResults, published);
+
+  PublishPrediction();
+  Metrics::RecordState(results->state);
+  Statistics::RecordLatency(Statistics::CAPTURE_TO_POSE, frame.mTimeStamp, Config::InputTimestampClock());
+
+  ResultsCallback callback;
+  {
+    unique_lock<mutex> lock(mMutexState);
+    mTrackedMapPoints = frame.mvpMapPoints;
+    callback = mResultsCallback;
+  }
+
+  if (callback)
+    callback(published);
+}
+
+void System::FinishInput() {
+  {
+    unique_lock<mutex> lock(mMutexInput);
+    mbFinishInput = true;
+    for (auto it = mlInputFrames.begin(); it != mlInputFrames.end(); it++)
+      it->pose.set_value(Pose::Zero());
+    mlInputFrames.clear();
+  }
+  mCondInput.notify_all();
+  mCondInputSpace.notify_all();
+
+  if (mptInput) {
+    mptInput->join();
+    delete mptInput;
+    mptInput = nullptr;
+  }
+}
+
 void System::ActivateLocalizationMode() {
   unique_lock<mutex> lock(mMutexMode);
   mbActivateLocalizationMode = true;
@@ -238,11 +798,20 @@ void System::DeactivateLocalizationMode() {
   mbDeactivateLocalizationMode = true;
 }
 
+void System::SetCharging(bool charging) {
+  LOGD("Device %s charging", charging ? "is" : "is not");
+  mpEnergy->SetCharging(charging);
+}
+
+void System::SetThermalThrottle(double throttle) {
+  LOGD("Thermal throttle set to %.2f", throttle);
+  mpEnergy->SetThermalThrottle(throttle);
+}
+
 bool System::MapChanged() {
-  static int n = 0;
   int curn = mpMap->GetLastBigChangeIdx();
-  if (n<curn) {
-    n=curn;
+  if (mnLastBigChangeIdx<curn) {
+    mnLastBigChangeIdx=curn;
     return true;
   } else
     return false;
@@ -254,30 +823,66 @@ void System::Reset() {
 }
 
 void System::Shutdown() {
-  bool waitLoop = false;
+  // Track no more submitted frames
+  FinishInput();
 
-  mpLocalMapper->RequestFinish();
-  if (mpLoopCloser) {
-    mpLoopCloser->RequestFinish();
-    waitLoop = true;
-  }
+  // Background threads must not rest anymore
+  mpEnergy->Stop();
+
+  if (mLoading.valid())
+    WaitForLoad();
 
-  // Wait until all thread have effectively stopped
-  while (!mpLocalMapper->isFinished() || waitLoop) {
-    usleep(5000);
+  if (!mbLocalizationOnly) {
+    mpLocalMapper->RequestFinish();
     if (mpLoopCloser)
-      waitLoop = !mpLoopCloser->isFinished() || mpLoopCloser->isRunningGBA();
+      mpLoopCloser->RequestFinish();
+
+    // Wait until all thread have effectively stopped
+    mpLocalMapper->WaitUntilFinished();
+    if (mpLoopCloser) {
+      mpLoopCloser->WaitUntilFinished();
+      mpLoopCloser->WaitUntilFinishedGBA();
+    }
+
+    mptLocalMapping->join();
+    if (mptLoopClosing)
+      mptLoopClosing->join();
+
+    if (mptRemoteLoop) {
+      mpRemoteLoop->RequestFinish();
+      mptRemoteLoop->join();
+      delete mptRemoteLoop;
+      mptRemoteLoop = nullptr;
+    }
+  }
+
+  // Last checkpoint, with the final map
+  if (mptCheckpoint) {
+    mpCheckpointer->RequestFinish();
+    mptCheckpoint->join();
+    delete mptCheckpoint;
+    mptCheckpoint = nullptr;
   }
 
-  mptLocalMapping->join();
-  if (mptLoopClosing)
-    mptLoopClosing->join();
+  if (mpMetrics) {
+    mpMetrics->Stop();
+    delete mpMetrics;
+    mpMetrics = nullptr;
+  }
+
+  mRecorder.Close();
+
+  if (Trace::Enabled()) {
+    Trace::Stop();
+    if (!Trace::Save(Config::TraceFile())) {
+      LOGE("Can't write trace %s", Config::TraceFile().c_str());
+    }
+  }
 }
 
 void System::SaveTrajectory(const std::string &filename, const std::string &foldername) {
 #ifndef ANDROID
   int counter;
-  std::string output = "%YAML:1.0\n";
 
   std::cout << "Saving trajectory to " << filename << " ..." << std::endl;
 
@@ -288,96 +893,127 @@ void System::SaveTrajectory(const std::string &filename, const std::string &fold
 
   vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
   sort(vpKFs.begin(), vpKFs.end(), KeyFrame::lId);
+  vpKFs.erase(std::remove_if(vpKFs.begin(), vpKFs.end(), [](KeyFrame* pKF) { return pKF->isBad(); }), vpKFs.end());
+
+  // Save images, encoding is the slow part, so they are written concurrently
+  const int nKFs = vpKFs.size();
+  const int progressStep = std::max(nKFs/10, 1);
+  std::atomic<int> nSaved(0);
+
+  mpThreadPool->ParallelFor(nKFs, [&](int i) {
+    KeyFrame* pKF = vpKFs[i];
+
+    ScopedPage page(mpMap->GetPager(), pKF);
+    string imgname = foldername + "/" + std::to_string(pKF->mnId) + ".png";
+    if (!pKF->mvImagePyramid[0].empty()) {
+      cv::imwrite(imgname, pKF->mvImagePyramid[0]);
+    } else {
+      // Fine levels were released, upscale finest available one
+      size_t level = 0;
+      while (level < pKF->mvImagePyramid.size() && pKF->mvImagePyramid[level].empty())
+        level++;
+      if (level < pKF->mvImagePyramid.size()) {
+        cv::Mat im;
+        cv::resize(pKF->mvImagePyramid[level], im, cv::Size(Config::Width(), Config::Height()));
+        cv::imwrite(imgname, im);
+      }
+    }
+
+    if (mSensor==RGBD) {
+      float depthFactor = 1.0/mpTracker->GetDepthFactor();
+      string depthname = foldername + "/" + std::to_string(pKF->mnId) + "_depth.png";
+      // Restore initial depth image (buffer is shared, don't convert in place)
+      cv::Mat depth;
+      pKF->GetDepthImage().convertTo(depth, CV_16U, depthFactor);
+      cv::imwrite(depthname, depth);
+    }
+
+    const int n = ++nSaved;
+    if (n % progressStep == 0 || n == nKFs)
+      std::cout << "Saved " << n << "/" << nKFs << " keyframe images" << std::endl;
+  });
 
+  // The document is streamed through a large buffer instead of built in memory
+  vector<char> buffer(1 << 20);
   std::ofstream f;
+  f.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
   f.open(filename.c_str());
 
+  f << "%YAML:1.0\n";
+
   // Save camera parameters
-  output += "camera:\n";
-  output += "  fx: " + std::to_string(Config::fx()) + "\n";
-  output += "  fy: " + std::to_string(Config::fy()) + "\n";
-  output += "  cx: " + std::to_string(Config::cx()) + "\n";
-  output += "  cy: " + std::to_string(Config::cy()) + "\n";
-  output += "  k1: " + std::to_string(Config::k1()) + "\n";
-  output += "  k2: " + std::to_string(Config::k2()) + "\n";
-  output += "  p1: " + std::to_string(Config::p1()) + "\n";
-  output += "  p2: " + std::to_string(Config::p2()) + "\n";
-  output += "  k3: " + std::to_string(Config::k3()) + "\n";
+  f << "camera:\n";
+  f << "  fx: " << std::to_string(Config::fx()) << "\n";
+  f << "  fy: " << std::to_string(Config::fy()) << "\n";
+  f << "  cx: " << std::to_string(Config::cx()) << "\n";
+  f << "  cy: " << std::to_string(Config::cy()) << "\n";
+  f << "  k1: " << std::to_string(Config::k1()) << "\n";
+  f << "  k2: " << std::to_string(Config::k2()) << "\n";
+  f << "  p1: " << std::to_string(Config::p1()) << "\n";
+  f << "  p2: " << std::to_string(Config::p2()) << "\n";
+  f << "  k3: " << std::to_string(Config::k3()) << "\n";
 
   // Save keyframes
-  output += "keyframes:\n";
+  f << "keyframes:\n";
 
   for(size_t i=0; i<vpKFs.size(); i++) {
     KeyFrame* pKF = vpKFs[i];
 
-    if(pKF->isBad())
-      continue;
-
     Eigen::Matrix4d pose = pKF->GetPoseInverse();
     Eigen::Quaterniond q(pose.block<3, 3>(0, 0));
     Eigen::Vector3d t = pose.block<3, 1>(0, 3);
 
-    // Save images
-    string imgname, depthname;
-    imgname = foldername + "/" + std::to_string(pKF->mnId) + ".png";
-    cv::imwrite(imgname, pKF->mvImagePyramid[0]);
-
-    if (mSensor==RGBD) {
-      float depthFactor = 1.0/mpTracker->GetDepthFactor();
-      depthname = foldername + "/" + std::to_string(pKF->mnId) + "_depth.png";
-      // Restore initial depth image
-      pKF->mDepthImage.convertTo(pKF->mDepthImage, CV_16U, depthFactor);
-      cv::imwrite(depthname, pKF->mDepthImage);
-    }
-
-    output += "  - id: " + std::to_string(pKF->mnId) + "\n";
-    output += "    filename: \"" + imgname + "\"\n";
+    f << "  - id: " << std::to_string(pKF->mnId) << "\n";
+    f << "    filename: \"" << foldername << "/" << std::to_string(pKF->mnId) << ".png\"\n";
     if (mSensor==RGBD)
-      output += "    depthname: \"" + depthname + "\"\n";
-    output += "    pose:\n";
-    output += "      - " + std::to_string(q.w()) + "\n";
-    output += "      - " + std::to_string(q.x()) + "\n";
-    output += "      - " + std::to_string(q.y()) + "\n";
-    output += "      - " + std::to_string(q.z()) + "\n";
-    output += "      - " + std::to_string(t(0)) + "\n";
-    output += "      - " + std::to_string(t(1)) + "\n";
-    output += "      - " + std::to_string(t(2)) + "\n";
+      f << "    depthname: \"" << foldername << "/" << std::to_string(pKF->mnId) << "_depth.png\"\n";
+    f << "    pose:\n";
+    f << "      - " << std::to_string(q.w()) << "\n";
+    f << "      - " << std::to_string(q.x()) << "\n";
+    f << "      - " << std::to_string(q.y()) << "\n";
+    f << "      - " << std::to_string(q.z()) << "\n";
+    f << "      - " << std::to_string(t(0)) << "\n";
+    f << "      - " << std::to_string(t(1)) << "\n";
+    f << "      - " << std::to_string(t(2)) << "\n";
   }
 
   // Save map points
-  output += "points:\n";
+  f << "points:\n";
   counter = 0;
 
   const vector<MapPoint*> &vpMPs = mpMap->GetAllMapPoints();
+  const size_t pointStep = std::max(vpMPs.size()/10, static_cast<size_t>(1));
   for (size_t i = 0, iend=vpMPs.size(); i < iend; i++) {
+    if ((i+1) % pointStep == 0)
+      std::cout << "Saved " << i+1 << "/" << iend << " map points" << std::endl;
+
     if (vpMPs[i]->isBad())
       continue;
     Eigen::Vector3d pos = vpMPs[i]->GetWorldPos();
 
-    output += "  - id: " + std::to_string(counter) + "\n";
-    output += "    pose:\n";
-    output += "      - " + std::to_string(pos(0)) + "\n";
-    output += "      - " + std::to_string(pos(1)) + "\n";
-    output += "      - " + std::to_string(pos(2)) + "\n";
-    output += "    observations:\n";
+    f << "  - id: " << std::to_string(counter) << "\n";
+    f << "    pose:\n";
+    f << "      - " << std::to_string(pos(0)) << "\n";
+    f << "      - " << std::to_string(pos(1)) << "\n";
+    f << "      - " << std::to_string(pos(2)) << "\n";
+    f << "    observations:\n";
 
     // Observations
-    std::map<KeyFrame*, size_t> observations = vpMPs[i]->GetObservations();
+    MapPoint::ObservationVector observations = vpMPs[i]->GetObservations();
 
-    for (std::map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+    for (MapPoint::ObservationVector::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
       KeyFrame* kf = mit->first;
       const cv::KeyPoint &kp = kf->mvKeys[mit->second];
 
-      output += "      - kf: " + std::to_string(kf->mnId) + "\n";
-      output += "        pixel:\n";
-      output += "          - "+ std::to_string(kp.pt.x) + "\n";
-      output += "          - "+ std::to_string(kp.pt.y) + "\n";
+      f << "      - kf: " << std::to_string(kf->mnId) << "\n";
+      f << "        pixel:\n";
+      f << "          - " << std::to_string(kp.pt.x) << "\n";
+      f << "          - " << std::to_string(kp.pt.y) << "\n";
     }
 
     counter++;
   }
 
-  f << output;
   f.close();
   std::cout << "Trajectory saved!" << std::endl;
 #endif // ANDROID
@@ -385,9 +1021,11 @@ void System::SaveTrajectory(const std::string &filename, const std::string &fold
 
 // Load saved trajectory
 bool System::LoadTrajectory(const std::string &filename) {
+  if (MapFile::IsMapFile(filename))
+    return LoadMap(filename);
+
 #ifndef ANDROID
   cv::FileStorage fs;
-  cv::Mat im, imD;
 
   LOGD("Loading trajectory from file %s", filename.c_str());
   try {
@@ -403,66 +1041,111 @@ bool System::LoadTrajectory(const std::string &filename) {
   }
 
   // Read keyframes
-  cv::FileNode keyframes = fs["keyframes"];
-
-  for(auto it = keyframes.begin(); it != keyframes.end(); ++it) {
+  struct TrajectoryKeyFrame {
     int id;
     vector<double> pose;
     std::string filename, depthname;
+    cv::Mat im, imD;
+  };
 
-    (*it)["id"] >> id;
-    (*it)["filename"] >> filename;
+  vector<TrajectoryKeyFrame> entries;
+  cv::FileNode keyframes = fs["keyframes"];
+
+  for(auto it = keyframes.begin(); it != keyframes.end(); ++it) {
+    TrajectoryKeyFrame e;
+
+    (*it)["id"] >> e.id;
+    (*it)["filename"] >> e.filename;
     if (mSensor==RGBD)
-      (*it)["depthname"] >> depthname;
-    (*it)["pose"] >> pose;
+      (*it)["depthname"] >> e.depthname;
+    (*it)["pose"] >> e.pose;
 
-    if (pose.size() != 7) {
+    if (e.pose.size() != 7) {
       LOGE("KeyFrame pose not valid");
       continue;
     }
 
-    // Load image
-    im = cv::imread(filename, CV_LOAD_IMAGE_GRAYSCALE);
-    if(im.empty()) {
-      LOGE("Couldn't load image %s", filename.c_str());
-      continue;
-    }
+    entries.push_back(std::move(e));
+  }
 
-    if (mSensor==RGBD) {
-      imD = cv::imread(depthname, CV_LOAD_IMAGE_UNCHANGED);
-      if(imD.empty()) {
-        LOGE("Couldn't load depth image %s", depthname.c_str());
+  // Loaded keyframes by id, with the index of their keypoints by position (first one if repeated).
+  // Positions are rounded to 1/1000 pixel, saved ones have 6 decimals
+  auto pixelKey = [](double x, double y) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(std::lround(x*1000))) << 32) |
+           static_cast<uint32_t>(std::lround(y*1000));
+  };
+
+  struct LoadedKeyFrame {
+    KeyFrame* kf;
+    std::unordered_map<uint64_t, int> keys;
+  };
+  std::unordered_map<int, LoadedKeyFrame> loaded;
+
+  // Images are decoded in parallel in batches (to bound memory), features are extracted
+  // in order, as the extractor is shared and already runs its levels in the pool
+  const size_t batch = 4*mpThreadPool->GetThreads();
+  for (size_t start = 0; start < entries.size(); start += batch) {
+    const size_t end = std::min(start+batch, entries.size());
+
+    mpThreadPool->ParallelFor(end-start, [&](int i) {
+      TrajectoryKeyFrame &e = entries[start+i];
+      e.im = cv::imread(e.filename, CV_LOAD_IMAGE_GRAYSCALE);
+      if (mSensor==RGBD && !e.im.empty())
+        e.imD = cv::imread(e.depthname, CV_LOAD_IMAGE_UNCHANGED);
+    });
+
+    for (size_t i = start; i < end; i++) {
+      TrajectoryKeyFrame &e = entries[i];
+      const vector<double> &pose = e.pose;
+
+      if(e.im.empty()) {
+        LOGE("Couldn't load image %s", e.filename.c_str());
         continue;
       }
-    }
 
-    // Calculate pose
-    Eigen::Matrix4d mpose;
-    Eigen::Quaterniond q(pose[0], pose[1], pose[2], pose[3]);
-    Eigen::Vector3d t(pose[4], pose[5], pose[6]);
-    mpose.setIdentity();
-    mpose.block<3, 3>(0, 0) = q.toRotationMatrix();
-    mpose.block<3, 1>(0, 3) = t;
+      if (mSensor==RGBD && e.imD.empty()) {
+        LOGE("Couldn't load depth image %s", e.depthname.c_str());
+        continue;
+      }
 
-    Frame frame;
-    if (mSensor==RGBD) {
-      frame = mpTracker->CreateFrame(im, imD);
-    } else {
-      frame = mpTracker->CreateFrame(im);
-    }
-    frame.SetPose(mpose);
-    frame.SetPose(frame.GetPoseInverse()); // Saved pose was in "world to camera coordinates"
+      // Calculate pose
+      Eigen::Matrix4d mpose;
+      Eigen::Quaterniond q(pose[0], pose[1], pose[2], pose[3]);
+      Eigen::Vector3d t(pose[4], pose[5], pose[6]);
+      mpose.setIdentity();
+      mpose.block<3, 3>(0, 0) = q.toRotationMatrix();
+      mpose.block<3, 1>(0, 3) = t;
+
+      Frame frame;
+      if (mSensor==RGBD) {
+        frame = mpTracker->CreateFrame(e.im, e.imD);
+      } else {
+        frame = mpTracker->CreateFrame(e.im);
+      }
+      e.im.release();
+      e.imD.release();
 
-    KeyFrame* kf = new KeyFrame(frame, mpMap);
-    kf->SetID(id);
+      frame.SetPose(mpose);
+      frame.SetPose(frame.GetPoseInverse()); // Saved pose was in "world to camera coordinates"
 
-    // Insert Keyframe in Map
-    mpTracker->SetReferenceKeyFrame(kf);
-    mpMap->AddKeyFrame(kf);
+      KeyFrame* kf = new KeyFrame(frame, mpMap);
+      kf->SetID(e.id);
+
+      // Insert Keyframe in Map
+      mpTracker->SetReferenceKeyFrame(kf);
+      mpMap->AddKeyFrame(kf);
+
+      LoadedKeyFrame &lkf = loaded[e.id];
+      lkf.kf = kf;
+      lkf.keys.reserve(kf->mvKeys.size());
+      for (size_t j = 0; j < kf->mvKeys.size(); j++)
+        lkf.keys.emplace(pixelKey(kf->mvKeys[j].pt.x, kf->mvKeys[j].pt.y), j);
+    }
   }
 
   // Read map points
   cv::FileNode points = fs["points"];
+  vector<MapPoint*> vpNewPoints;
 
   for(auto it = points.begin(); it != points.end(); ++it) {
     int id;
@@ -493,33 +1176,42 @@ bool System::LoadTrajectory(const std::string &filename) {
         continue;
       }
 
-      // Search keyFrame by id
-      KeyFrame * kf = mpMap->GetKeyFrame(kf_id);
-      if (kf == nullptr)
+      // Search keyFrame by id and feature by position
+      auto kit = loaded.find(kf_id);
+      if (kit == loaded.end())
         continue;
 
+      auto pit = kit->second.keys.find(pixelKey(pixel[0], pixel[1]));
+      if (pit == kit->second.keys.end())
+        continue;
+
+      KeyFrame * kf = kit->second.kf;
+      const int index = pit->second;
+
       // Create map point for the first time
       if (mp == nullptr) {
         Eigen::Vector3d worldPos(position[0], position[1], position[2]);
         mp = new MapPoint(worldPos, kf, mpMap);
+        vpNewPoints.push_back(mp);
       }
 
-      Eigen::Vector2d imgPos(pixel[0], pixel[1]);
-      int index = kf->AddMapPoint(mp, imgPos);
-      if (index >= 0) {
-        mp->AddObservation(kf, index);
-        mp->ComputeDistinctiveDescriptors();
-        mp->UpdateNormalAndDepth();
-
-        //Add to Map
-        mpMap->AddMapPoint(mp);
-      }
-
+      kf->AddMapPoint(mp, index);
+      mp->AddObservation(kf, index);
     }
   }
 
+  // Descriptor, normal and depth once per point, with all its observations
+  mpThreadPool->ParallelFor(vpNewPoints.size(), [&](int i) {
+    vpNewPoints[i]->UpdateDescriptorNormalAndDepth();
+  });
+
+  //Add to Map
+  for (MapPoint* mp : vpNewPoints)
+    mpMap->AddMapPoint(mp);
+
   // Update links in the Covisibility Graph
   mpMap->UpdateConnections();
+  mpMap->PublishSnapshot();
 
   LOGD("Map loaded!");
 
@@ -534,9 +1226,93 @@ bool System::LoadTrajectory(const std::string &filename) {
   return true;
 }
 
+bool System::SaveMap(const std::string &filename) {
+  LOGD("Saving map to %s", filename.c_str());
+
+  unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+  return MapFile::Save(filename, mpMap, mSensor==RGBD || mSensor==STEREO);
+}
+
+void System::LoadTrajectoryAsync(const std::string &filename) {
+  mLoading = std::async(std::launch::async, [this, filename] { return LoadTrajectory(filename); });
+}
+
+bool System::WaitForLoad() {
+  if (mLoading.valid()) {
+    Timer wait(true);
+    mbLoaded = mLoading.get();
+    wait.Stop();
+    if (wait.GetMsTime() > 1.0)
+      LOGD("Waited %.2fms for map to be loaded", wait.GetMsTime());
+  }
+  return mbLoaded;
+}
+
+bool System::LoadMap(const std::string &filename) {
+  LOGD("Loading map from file %s", filename.c_str());
+
+  std::string mapname = filename;
+  if (MapFile::IsCheckpointFile(filename)) {
+    mapname = filename + ".map";
+    if (!MapFile::Compact(filename, mapname))
+      return false;
+  }
+
+  if (!mMapFile.Load(mapname, mpMap, mpTracker, mSensor==RGBD || mSensor==STEREO))
+    return false;
+
+  mpMap->PublishSnapshot();
+
+  // Force relocalization inside loaded map
+  mpTracker->ForceRelocalization();
+
+  return true;
+}
+
+bool System::MergeMap(const std::string &filename) {
+  if (mpMap->KeyFramesInMap() == 0)
+    return LoadMap(filename);
+
+  LOGD("Merging map from file %s", filename.c_str());
+
+  const bool rgbd = mSensor==RGBD || mSensor==STEREO;
+  vector<KeyFrame*> vpOldKFs = mpMap->GetAllKeyFrames();
+  if (!mMapFile.Load(filename, mpMap, mpTracker, rgbd, mpMap->NextKeyFrameId()))
+    return false;
+
+  const std::set<KeyFrame*> sOldKFs(vpOldKFs.begin(), vpOldKFs.end());
+  vector<KeyFrame*> vpNewKFs;
+  for (KeyFrame* pKF : mpMap->GetAllKeyFrames()) {
+    if (!sOldKFs.count(pKF))
+      vpNewKFs.push_back(pKF);
+  }
+
+  MapMerger merger(mpMap, rgbd, mpThreadPool, Config::ThreadsLoop());
+  const bool bMerged = merger.Merge(vpNewKFs);
+
+  mpMap->PublishSnapshot();
+  mpTracker->ForceRelocalization();
+
+  return bMerged;
+}
+
+void System::OptimizeMap(int nIterations) {
+  const int nPartitionSize = Config::PartitionSize();
+  if (nPartitionSize > 0 && mpMap->KeyFramesInMap() > static_cast<unsigned long>(nPartitionSize)) {
+    Optimizer::PartitionedBundleAdjustment(mpMap, nPartitionSize, Config::PartitionRounds(), nIterations,
+                                           mpThreadPool);
+  } else {
+    MapPointBatch batch;
+    Optimizer::GlobalBundleAdjustemnt(mpMap, nIterations, NULL, 0, true, Config::ThreadsBA(), Config::BackendBA(),
+                                      &batch);
+    batch.Apply(mpThreadPool, Config::ThreadsBA());
+  }
+
+  mpMap->PublishSnapshot();
+}
+
 int System::GetTrackingState() {
-  unique_lock<mutex> lock(mMutexState);
-  return mTrackingState;
+  return GetResults()->state;
 }
 
 vector<MapPoint*> System::GetTrackedMapPoints() {
@@ -545,8 +1321,97 @@ vector<MapPoint*> System::GetTrackedMapPoints() {
 }
 
 vector<cv::KeyPoint> System::GetTrackedKeyPointsUn() {
+  return GetResults()->vKeyPointsUn;
+}
+
+std::shared_ptr<const System::Results> System::GetResults() const {
+  return std::atomic_load(&mpResults);
+}
+
+void System::PublishPrediction() {
+  FramePrediction frame = FramePrediction();
+  Eigen::Matrix<double, 6, 1> xi;
+  if (mpTracker->GetVelocity(xi, frame.timestamp)) {
+    Eigen::Map<Eigen::Matrix4d>(frame.Tcw) = mpTracker->GetCurrentFrame().GetPose();
+    Eigen::Map<Eigen::Matrix<double, 6, 1> >(frame.xi) = xi;
+
+    Eigen::Matrix3d R;
+    if (mSensor == MONOCULAR_IMU && mIMUBuffer.Rotation(frame.timestamp, R)) {
+      frame.imu = 1.0;
+      Eigen::Map<Eigen::Matrix3d>(frame.R) = R;
+    }
+  } else {
+    frame.timestamp = -1.0;
+  }
+
+  // Only written from the tracking thread
+  mFramePredictionLock.BeginWrite();
+  SeqLock::Store(mFramePrediction, &frame, sizeof(frame));
+  mFramePredictionLock.EndWrite();
+}
+
+bool System::GetPredictedPose(double timestamp, Eigen::Matrix4d &Tcw) const {
+  FramePrediction frame;
+  unsigned seq;
+  do {
+    seq = mFramePredictionLock.BeginRead();
+    SeqLock::Load(&frame, mFramePrediction, sizeof(frame));
+  } while (mFramePredictionLock.Retry(seq));
+
+  if (frame.timestamp < 0.0)
+    return false;
+
+  const double dt = std::max(timestamp-frame.timestamp, 0.0);
+  const Eigen::Matrix<double, 6, 1> xi = Eigen::Map<Eigen::Matrix<double, 6, 1> >(frame.xi);
+  Tcw = Lie::ExpSE3<double>(xi*dt) * Eigen::Map<Eigen::Matrix4d>(frame.Tcw);
+
+  if (frame.imu == 0.0)
+    return true;
+
+  IMUPrediction imu;
+  do {
+    seq = mIMUPredictionLock.BeginRead();
+    SeqLock::Load(&imu, mIMUPrediction, sizeof(imu));
+  } while (mIMUPredictionLock.Retry(seq));
+
+  if (imu.timestamp < frame.timestamp)
+    return true;
+
+  // Rotation from gyro since the frame, continued with newest sample up to timestamp.
+  // Position keeps moving with the filter velocity
+  Eigen::Matrix3d R1 = Eigen::Map<Eigen::Matrix3d>(imu.R);
+  if (timestamp > imu.timestamp) {
+    const Eigen::Vector3d w = Eigen::Map<Eigen::Vector3d>(imu.gyro)*(timestamp-imu.timestamp);
+    R1 = R1*Lie::ExpSO3<double>(w).toRotationMatrix();
+  }
+  const Eigen::Matrix3d dR = Eigen::Map<Eigen::Matrix3d>(frame.R).transpose()*R1;
+
+  const Eigen::Vector3d Ow = -Tcw.block<3, 3>(0, 0).transpose()*Tcw.block<3, 1>(0, 3);
+  const Eigen::Matrix3d Rcw = dR.transpose()*Eigen::Map<Eigen::Matrix4d>(frame.Tcw).block<3, 3>(0, 0);
+  Tcw.block<3, 3>(0, 0) = Rcw;
+  Tcw.block<3, 1>(0, 3) = -Rcw*Ow;
+  return true;
+}
+
+void System::SetResultsCallback(const ResultsCallback &callback) {
   unique_lock<mutex> lock(mMutexState);
-  return mTrackedKeyPointsUn;
+  mResultsCallback = callback;
+}
+
+vector<Statistics::Summary> System::GetStatistics() {
+  return Statistics::GetSummary();
+}
+
+void System::ResetStatistics() {
+  Statistics::Reset();
+}
+
+Map::MemoryReport System::GetMemoryReport() {
+  unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+  Map::MemoryReport report = mpMap->GetMemoryReport();
+  report.optimizer = Optimizer::GetPeakGraphBytes();
+  report.total += report.optimizer;
+  return report;
 }
 
 }  // namespace SD_SLAM
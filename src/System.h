@@ -27,11 +27,25 @@
 
 #include <thread>
 #include <vector>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
 #include <opencv2/core/core.hpp>
 #include "Tracking.h"
 #include "Map.h"
 #include "LocalMapping.h"
 #include "LoopClosing.h"
+#include "MapFile.h"
+#include "sensors/IMUBuffer.h"
+#include "extra/stats.h"
+#include "extra/thread_pool.h"
+#include "extra/input_log.h"
+#include "extra/seqlock.h"
+#include "extra/metrics.h"
+#include "extra/energy_policy.h"
 
 namespace SD_SLAM {
 
@@ -39,6 +53,7 @@ class Map;
 class Tracking;
 class LocalMapping;
 class LoopClosing;
+class RemoteLoopClient;
 
 class System {
  public:
@@ -46,19 +61,53 @@ class System {
   enum eSensor{
     MONOCULAR = 0,
     RGBD = 1,
-    MONOCULAR_IMU = 2
+    MONOCULAR_IMU = 2,
+    STEREO = 3
   };
 
+  // What to do with queued frames when tracking is slower than input
+  enum eDropPolicy {
+    DROP_OLDEST = 0,      // When queue is full, discard oldest frame
+    SKIP_TO_LATEST = 1    // Only track newest frame, discard older ones
+  };
+
+  // Pose of a frame submitted with SubmitFrame. Not aligned so it can be stored in a future
+  typedef Eigen::Matrix<double, 4, 4, Eigen::DontAlign> Pose;
+
+  // Called from the tracking thread after each submitted frame is processed
+  typedef std::function<void(const Eigen::Matrix4d &pose, const cv::Mat &im, double timestamp)> PoseCallback;
+
+  // Everything known about a processed frame. Published once and never modified, so it can be
+  // read from any thread and kept as long as needed without locking or copying
+  struct Results {
+    long unsigned int nFrameId;
+    int state;                                    // Tracking state
+    Eigen::Matrix4d Tcw;                          // Valid if state is OK
+    std::vector<cv::KeyPoint> vKeyPointsUn;       // All undistorted keypoints of the frame
+    std::vector<int> vMapPointIdx;                // Keypoint of each tracked map point (outliers excluded)
+    std::vector<long unsigned int> vMapPointIds;
+    std::vector<Eigen::Vector3d> vMapPoints;      // World positions
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Called from the tracking thread with the results of each processed frame
+  typedef std::function<void(const std::shared_ptr<const Results> &results)> ResultsCallback;
+
  public:
   // Initialize the SLAM system. It launches the Local Mapping and Loop Closing.
-  System(const eSensor sensor, bool loopClosing = true);
+  // If localizationOnly is set, no mapping threads are launched and the camera is only localized
+  // in a map loaded with LoadMap or LoadTrajectory, which is never modified.
+  System(const eSensor sensor, bool loopClosing = true, bool localizationOnly = false);
 
   inline Map * GetMap() { return mpMap; }
   inline Tracking * GetTracker() { return mpTracker; }
+  inline LoopClosing * GetLoopCloser() { return mpLoopCloser; }
 
   inline void RequestStop() { stopRequested_ = true; }
   inline bool StopRequested() const { return stopRequested_; }
 
+  // Synchronous calls do not copy the input images, they can be views of external buffers.
   // Process the given rgbd frame. Depthmap must be registered to the RGB frame.
   // Input image: Grayscale (CV_8U).
   // Input depthmap: Float (CV_32F).
@@ -70,17 +119,84 @@ class System {
   // Returns the camera pose (empty if tracking fails).
   Eigen::Matrix4d TrackMonocular(const cv::Mat &im, const std::string filename = "");
 
+  // Process the given stereo frame. Images must be rectified (see Camera.bf).
+  // Input images: Grayscale (CV_8U).
+  // Returns the camera pose of the left camera (empty if tracking fails).
+  Eigen::Matrix4d TrackStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const std::string filename = "");
+
   // Proccess the given monocular frame and sensor measurements
   // Input images: Grayscale (CV_8U).
   // Input measurements: Float (CV_32F).
   // Returns the camera pose (empty if tracking fails).
   Eigen::Matrix4d TrackFusion(const cv::Mat &im, const std::vector<double> &measurements, const std::string filename = "");
 
+  // Same as TrackFusion, but measurements are the IMU samples added since last frame,
+  // preintegrated up to timestamp (s). Motion model uses timestamps instead of wall clock.
+  Eigen::Matrix4d TrackFusion(const cv::Mat &im, double timestamp, const std::string filename = "");
+
+  // Sensor timestamp (s) of the next frame given to a synchronous Track function. Motion model
+  // uses timestamps instead of wall clock, and capture latency is measured from them
+  // (see Input.TimestampClock)
+  void SetTimestamp(double timestamp);
+
+  // Mask (CV_8U, image size) of the next frame given to a synchronous Track function. Features
+  // are not extracted where it is zero, e.g. over moving objects. Combined with ORBextractor.Mask
+  void SetMask(const cv::Mat &mask);
+
+  // Add IMU sample (rad/s and m/s^2 in camera frame) at its timestamp (s). It can be called
+  // from any thread at sensor rate, samples must be added before the frames they precede.
+  void AddIMUMeasurement(double timestamp, const Eigen::Vector3d &gyro, const Eigen::Vector3d &acc);
+
+  // Process the images of a camera rig (see Rig parameters). ims[0] is the main camera image,
+  // ims[i] the image of rig camera i. Depthmap is only used with RGBD sensor, for main camera
+  // (with stereo sensor it is the right image of main camera).
+  // Input images: Grayscale (CV_8U).
+  // Returns the camera pose of the main camera (empty if tracking fails).
+  Eigen::Matrix4d TrackRig(const std::vector<cv::Mat> &ims, const cv::Mat &depthmap = cv::Mat(),
+                           const std::string filename = "");
+
+  // Non blocking version of TrackMonocular, TrackRGBD, TrackStereo and TrackFusion (depending on sensor).
+  // With stereo sensor, depthmap is the right image. With Monocular-IMU and no measurements,
+  // IMU samples added with AddIMUMeasurement are preintegrated up to timestamp.
+  // Frames are copied to a bounded queue and tracked in order by an internal thread.
+  // The future returns the camera pose, or zero if the frame was dropped. A positive timestamp
+  // is used as in SetTimestamp.
+  // With Input.Offline, it blocks while the queue is full and frames are never dropped.
+  std::future<Pose> SubmitFrame(const cv::Mat &im, const cv::Mat &depthmap = cv::Mat(),
+                                const std::vector<double> &measurements = std::vector<double>(),
+                                double timestamp = 0.0, const std::string filename = "");
+
+  // Same as SubmitFrame, but images are queued without copying them, so their buffers must not be
+  // modified until the frame is processed. If the buffers are not owned by the cv::Mat (e.g. borrowed
+  // from a ROS message), hold must keep them alive. It is released when the frame is processed or dropped.
+  std::future<Pose> SubmitSharedFrame(const cv::Mat &im, const cv::Mat &depthmap = cv::Mat(),
+                                      std::shared_ptr<const void> hold = nullptr,
+                                      const std::vector<double> &measurements = std::vector<double>(),
+                                      double timestamp = 0.0, const std::string filename = "");
+
+  // Set callback receiving poses of submitted frames (dropped frames are not reported)
+  void SetPoseCallback(const PoseCallback &callback);
+
+  // Track the input recorded with System.RecordFile, calling the synchronous Track functions
+  // (submitted frames are tracked synchronously too). Frames are paced as they were recorded.
+  // If deterministic is set, frames are tracked as fast as possible, but each one waits until
+  // mapping and loop closing have processed every keyframe, the motion model uses recording
+  // times instead of wall clock, and the feature budget is not adapted to tracking time.
+  // Returns the number of frames tracked, or -1 if the recording is for another sensor.
+  int Replay(InputPlayer &player, bool deterministic);
+
   // This stops local mapping thread (map building) and performs only camera tracking.
   void ActivateLocalizationMode();
   // This resumes local mapping thread and performs SLAM again.
+  // It has no effect if the system was created in localization only mode.
   void DeactivateLocalizationMode();
 
+  // Power state of the device for the energy policy (see Energy parameters). They can be called
+  // from any thread, e.g. battery and thermal status listeners. While charging, background threads
+  // are not limited. Thermal throttle goes from 0 (none) to 1 (critical) and lowers their duty cycle
+  void SetCharging(bool charging);
+  void SetThermalThrottle(double throttle);
+
   // Returns true if there have been a big map change (loop closure, global BA)
   // since last call to this function
   bool MapChanged();
@@ -99,12 +215,55 @@ class System {
   std::vector<MapPoint*> GetTrackedMapPoints();
   std::vector<cv::KeyPoint> GetTrackedKeyPointsUn();
 
+  // Results of most recent processed frame, without locking tracking. Never null
+  std::shared_ptr<const Results> GetResults() const;
+
+  // Camera pose at timestamp (s, clock of frame timestamps), extrapolated from last tracked
+  // frame with the velocity of the motion model. With Monocular-IMU, rotation is integrated
+  // from the samples added since that frame. Lock free, it can be called from any thread at
+  // any rate. Returns false if last frame was not tracked or frames have no timestamps
+  bool GetPredictedPose(double timestamp, Eigen::Matrix4d &Tcw) const;
+
+  // Set callback receiving results of every processed frame (synchronous or submitted)
+  void SetResultsCallback(const ResultsCallback &callback);
+
+  // Latency of every processing stage (count, p50, p99, max, mean and jitter in ms). Capture
+  // latencies are measured from frame timestamps, see Input.TimestampClock
+  std::vector<Statistics::Summary> GetStatistics();
+  void ResetStatistics();
+
+  // Memory used by the map, by category
+  Map::MemoryReport GetMemoryReport();
+
   // Save trajectory calculated
   void SaveTrajectory(const std::string &filename, const std::string &foldername);
 
-  // Load saved trajectory
+  // Load saved trajectory. Binary map files are loaded with LoadMap.
   bool LoadTrajectory(const std::string &filename);
 
+  // Same as LoadTrajectory, but in background, so sensors can be opened meanwhile. It must be
+  // called before the first frame is tracked, which waits until the map is loaded
+  void LoadTrajectoryAsync(const std::string &filename);
+
+  // Wait until the map given to LoadTrajectoryAsync is loaded, from the thread that tracks.
+  // Returns false if it couldn't be loaded
+  bool WaitForLoad();
+
+  // Save map in binary format (keyframes, features, covisibility and map points)
+  bool SaveMap(const std::string &filename);
+
+  // Load map saved with SaveMap, without extracting features again. A checkpoint log
+  // (System.CheckpointFile) is first compacted to filename.map
+  bool LoadMap(const std::string &filename);
+
+  // Load another session saved with SaveMap and align it with the current map.
+  // Returns false if sessions do not overlap, loaded keyframes are kept unaligned.
+  bool MergeMap(const std::string &filename);
+
+  // Global BA over the whole map, split in partitions if it is larger than Optimizer.PartitionSize.
+  // Only for maps not being tracked or mapped (offline)
+  void OptimizeMap(int nIterations);
+
  private:
   // Input sensor
   eSensor mSensor;
@@ -124,6 +283,15 @@ class System {
   // a pose graph optimization and full bundle adjustment (in a new thread) afterwards.
   LoopClosing* mpLoopCloser;
 
+  // Thread pool shared by all subsystems, each one limits how many of its threads it uses
+  ThreadPool* mpThreadPool;
+
+  // Power budget of Local Mapping and Loop Closing
+  EnergyPolicy* mpEnergy;
+
+  // No mapping threads, map is read-only
+  bool mbLocalizationOnly;
+
   // System threads: Local Mapping, Loop Closing
   // The Tracking thread "lives" in the main execution thread that creates the System object.
   std::thread* mptLocalMapping;
@@ -138,12 +306,117 @@ class System {
   bool mbActivateLocalizationMode;
   bool mbDeactivateLocalizationMode;
 
-  // Tracking state
-  int mTrackingState;
+  // Last big map change returned by MapChanged
+  int mnLastBigChangeIdx;
+
+  // Tracking state. Results are swapped atomically, the mutex protects the rest
+  std::shared_ptr<const Results> mpResults;
   std::vector<MapPoint*> mTrackedMapPoints;
-  std::vector<cv::KeyPoint> mTrackedKeyPointsUn;
+  ResultsCallback mResultsCallback;
   std::mutex mMutexState;
   bool stopRequested_;          // True if stop is requested
+
+  // Loaded binary maps, keyframe buffers point to their mappings
+  MapFile mMapFile;
+
+  // Map loaded by LoadTrajectoryAsync, valid until first waited for
+  std::future<bool> mLoading;
+  bool mbLoaded;
+
+  // Frame submitted with SubmitFrame
+  struct InputFrame {
+    cv::Mat im;
+    cv::Mat depthmap;
+    std::vector<double> measurements;
+    double timestamp;
+    std::string filename;
+    std::promise<Pose> pose;
+    std::shared_ptr<const void> hold;   // Keeps borrowed image buffers alive
+  };
+
+  // Add frame to the input queue
+  std::future<Pose> PushInput(InputFrame &&frame);
+
+  // Track submitted frames until input is finished. If Input.Pipeline is set, features of
+  // next queued frame are extracted while current one is tracked
+  void RunInput();
+
+  // Pop next frame to track from input queue, applying drop policy. Input mutex must be locked
+  void PopInput(InputFrame &frame);
+
+  // Apply pending localization mode changes (if mode is true) and reset. Returns true if reset
+  bool CheckRequests(bool mode);
+
+  // Save information of last tracked frame, ms is the time it took to track it
+  void UpdateTrackingState(double ms);
+
+  // Stop input thread, pending frames are dropped
+  void FinishInput();
+
+  // Set preintegrated IMU samples since last frame as tracker measurements
+  void SetIMUInput(double timestamp);
+
+  // Publish pose and velocity of last frame for GetPredictedPose
+  void PublishPrediction();
+
+  // Record input frame if System.RecordFile is set
+  void RecordFrame(uint8_t type, const std::vector<cv::Mat> &ims, const cv::Mat &depthmap,
+                   const std::vector<double> &values, double timestamp, const std::string &filename);
+
+  // Block until mapping threads have processed every keyframe
+  void WaitUntilMappingIdle();
+
+  // Connect to LoopClosing.Server and hand it to loop closing, which closes loops locally if
+  // it is not reachable
+  void ConnectLoopServer();
+
+  std::thread* mptInput;
+  Frame mPrebuiltFrame;
+  std::list<InputFrame> mlInputFrames;
+  PoseCallback mPoseCallback;
+  bool mbFinishInput;
+  std::mutex mMutexInput;
+  std::condition_variable mCondInput;
+  std::condition_variable mCondInputSpace;   // Offline producers wait for room in the queue
+
+  // IMU samples for TrackFusion
+  IMUBuffer mIMUBuffer;
+  double mLastIMUTimestamp;   // Timestamp of last fused frame, negative if none
+
+  // Pose extrapolation state, copied by GetPredictedPose under sequence locks
+  struct FramePrediction {
+    double timestamp;   // Last tracked frame, negative if not tracked
+    double Tcw[16];
+    double xi[6];       // Velocity twist (s^-1)
+    double imu;         // Non zero if R holds the integrated IMU rotation at timestamp
+    double R[9];
+  };
+  struct IMUPrediction {
+    double timestamp;   // Newest sample, negative if none
+    double gyro[3];
+    double R[9];        // Integrated IMU rotation at timestamp
+  };
+  SeqLock mFramePredictionLock;
+  SeqLock::Word mFramePrediction[(sizeof(FramePrediction)+7)/8];
+  SeqLock mIMUPredictionLock;
+  SeqLock::Word mIMUPrediction[(sizeof(IMUPrediction)+7)/8];
+  std::mutex mMutexIMUPrediction;   // AddIMUMeasurement can be called from several threads
+
+  // Input recording and replay
+  InputRecorder mRecorder;
+  bool mbRecording;
+  bool mbDeterministic;
+
+  // Background map checkpoints, null if System.CheckpointFile is not set
+  MapCheckpointer* mpCheckpointer;
+  std::thread* mptCheckpoint;
+
+  // Metrics endpoint, null if System.MetricsPort is not set
+  MetricsExporter* mpMetrics;
+
+  // Loop closing server connection, null if LoopClosing.Server is not set or not reachable
+  RemoteLoopClient* mpRemoteLoop;
+  std::thread* mptRemoteLoop;
 };
 
 }  // namespace SD_SLAM
@@ -26,12 +26,16 @@
 #include <iostream>
 #include <mutex>
 #include <unistd.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
 #include "ORBmatcher.h"
 #include "Converter.h"
 #include "Optimizer.h"
 #include "ImageAlign.h"
 #include "Config.h"
 #include "extra/log.h"
+#include "extra/timer.h"
+#include "extra/stats.h"
 #include "sensors/ConstantVelocity.h"
 #include "sensors/IMU.h"
 
@@ -39,9 +43,11 @@ using namespace std;
 
 namespace SD_SLAM {
 
-Tracking::Tracking(System *pSys, Map *pMap, const int sensor):
+Tracking::Tracking(System *pSys, Map *pMap, const int sensor, bool localizationOnly, ThreadPool* pPool):
   mState(NO_IMAGES_YET), mSensor(sensor), mpInitializer(static_cast<Initializer*>(NULL)),
-  mpPatternDetector(), mpSystem(pSys), mpMap(pMap), mnLastRelocFrameId(0), mbOnlyTracking(false) {
+  mpPatternDetector(), mpSystem(pSys), mpMap(pMap), mnLastRelocFrameId(0), mbOnlyTracking(localizationOnly),
+  mbLocalizationOnly(localizationOnly), mpThreadPool(pPool), mbInitAttemptDone(false),
+  mbTrackAfterInitialization(false) {
   // Load camera parameters
   float fx = Config::fx();
   float fy = Config::fy();
@@ -94,22 +100,64 @@ Tracking::Tracking(System *pSys, Map *pMap, const int sensor):
   float fScaleFactor = Config::ScaleFactor();
   int nLevels = Config::NumLevels();
   int fThFAST = Config::ThresholdFAST();
+  int nThreads = Config::ThreadsORB();
+  int nBackend = Config::BackendORB();
 
-  mpORBextractorLeft = new ORBextractor(nFeatures, fScaleFactor,nLevels, fThFAST);
+  mpORBextractorLeft = new ORBextractor(nFeatures, fScaleFactor,nLevels, fThFAST, mpThreadPool, nThreads, nBackend);
 
-  if (sensor!=System::RGBD)
-    mpIniORBextractor = new ORBextractor(2*nFeatures, fScaleFactor,nLevels, fThFAST);
+  // Right image extractor for stereo
+  mpORBextractorRight = nullptr;
+  if (sensor==System::STEREO)
+    mpORBextractorRight = new ORBextractor(nFeatures, fScaleFactor,nLevels, fThFAST, mpThreadPool, nThreads, nBackend);
+
+  // Initialization extractor is not needed if map is never created
+  mpIniORBextractor = nullptr;
+  if (!HasDepth() && !localizationOnly)
+    mpIniORBextractor = new ORBextractor(2*nFeatures, fScaleFactor,nLevels, fThFAST, mpThreadPool, nThreads, nBackend);
 
   cout << endl  << "ORB Extractor Parameters: " << endl;
   cout << "- Number of Features: " << nFeatures << endl;
   cout << "- Scale Levels: " << nLevels << endl;
   cout << "- Scale Factor: " << fScaleFactor << endl;
   cout << "- Fast Threshold: " << fThFAST << endl;
+  cout << "- Threads: " << nThreads << endl;
+  cout << "- Backend: " << (nBackend == ORBextractor::BACKEND_OPENCL ? "OpenCL" : "CPU") << endl;
+
+  // Reduced resolution extraction, tracked points are refined at full resolution
+  if (Config::FirstLevelORB() > 0) {
+    mpORBextractorLeft->SetFirstLevel(Config::FirstLevelORB());
+    if (mpORBextractorRight)
+      mpORBextractorRight->SetFirstLevel(Config::FirstLevelORB());
+    if (mpIniORBextractor)
+      mpIniORBextractor->SetFirstLevel(Config::FirstLevelORB());
+    cout << "- First Level: " << Config::FirstLevelORB() << endl;
+  }
 
-  if (sensor==System::RGBD) {
+  // Image regions never worth a feature (e.g. robot body), main camera only
+  if (!Config::MaskFile().empty()) {
+    cv::Mat mask = cv::imread(Config::MaskFile(), cv::IMREAD_GRAYSCALE);
+    if (mask.cols != Config::Width() || mask.rows != Config::Height()) {
+      LOGE("Can't load mask %s with camera size", Config::MaskFile().c_str());
+    } else {
+      mpORBextractorLeft->SetMask(mask);
+      if (mpIniORBextractor)
+        mpIniORBextractor->SetMask(mask);
+      cout << "- Mask: " << Config::MaskFile() << endl;
+    }
+  }
+
+  mpRig = nullptr;
+  if (!Config::RigCameras().empty()) {
+    mpRig = new CameraRig(nFeatures, fScaleFactor, nLevels, fThFAST);
+    cout << endl << "Rig Cameras: " << mpRig->Size()+1 << endl;
+  }
+
+  if (HasDepth()) {
     mThDepth = mbf*(float)Config::ThDepth()/fx;
     cout << endl << "Depth Threshold (Close/Far Points): " << mThDepth << endl;
+  }
 
+  if (sensor==System::RGBD) {
     mDepthMapFactor = Config::DepthMapFactor();
     if (fabs(mDepthMapFactor)<1e-5)
       mDepthMapFactor=1;
@@ -120,6 +168,8 @@ Tracking::Tracking(System *pSys, Map *pMap, const int sensor):
   threshold_ = 8;
   usePattern = Config::UsePattern();
   align_image_ = true;
+  align_residual_ = -1.0;
+  align_residual_mean_ = -1.0;
 
   if (usePattern)
     std::cout << "Use pattern for initialization" << std::endl;
@@ -127,27 +177,50 @@ Tracking::Tracking(System *pSys, Map *pMap, const int sensor):
   mpLoopClosing = nullptr;
   mpLocalMapper = nullptr;
 
+  mpReferenceKF = nullptr;
+  mpLocalMapRefKF = nullptr;
+  mnLocalMapChangeIdx = -1;
+  mnLocalMapInliers = 0;
+  mnLocalKeyFramePoints = 0;
+  mLocalPointTable.Clear();
+  mnMatchesInliers = 0;
+  mFrameTime = 0.0;
+  mbOverload = false;
+  mnStaticFrames = 0;
+
+  if (Config::TargetFrameTime() > 0)
+    cout << endl << "Target Frame Time: " << Config::TargetFrameTime() << "ms" << endl;
+
   lastRelativePose_.setZero();
 
+  mnReclaimerSlot = mpMap->GetReclaimer()->Register();
+
   // Set motion model
-  Sensor * sensor_model;
+  mbTimestampSet = false;
+  mTimestamp = -1.0;
   if (sensor == System::MONOCULAR_IMU)
-    sensor_model = new IMU();
+    motion_model_ = new EKF<IMU::STATE_SIZE, IMU::MEASUREMENT_SIZE>(new IMU());
   else
-    sensor_model = new ConstantVelocity();
-  motion_model_ = new EKF(sensor_model);
+    motion_model_ = new EKF<ConstantVelocity::STATE_SIZE, ConstantVelocity::MEASUREMENT_SIZE>(new ConstantVelocity());
 }
 
-Eigen::Matrix4d Tracking::GrabImageRGBD(const cv::Mat &im, const cv::Mat &imD, const std::string filename) {
-  cv::Mat imDepth = imD;
+Tracking::~Tracking() {
+  JoinInitialization();
+}
 
+bool Tracking::HasDepth() const {
+  return mSensor==System::RGBD || mSensor==System::STEREO;
+}
+
+Eigen::Matrix4d Tracking::GrabImageRGBD(const cv::Mat &im, const cv::Mat &imD, const std::string filename) {
   // Image must be in gray scale
   assert(im.channels() == 1);
 
-  if ((fabs(mDepthMapFactor-1.0f) > 1e-5) || imD.type() != CV_32F)
-    imDepth.convertTo(imDepth, CV_32F, mDepthMapFactor);
+  if (TrackStatic(im))
+    return mCurrentFrame.GetPose();
 
-  mCurrentFrame = Frame(im, imDepth, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
+  mCurrentFrame = CreateInputFrame(im, imD, mFrameMask);
+  mFrameMask.release();
 
   Track();
 
@@ -155,14 +228,100 @@ Eigen::Matrix4d Tracking::GrabImageRGBD(const cv::Mat &im, const cv::Mat &imD, c
 }
 
 
+Eigen::Matrix4d Tracking::GrabImageStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const std::string filename) {
+  // Images must be in gray scale
+  assert(imLeft.channels() == 1 && imRight.channels() == 1);
+
+  if (TrackStatic(imLeft))
+    return mCurrentFrame.GetPose();
+
+  mCurrentFrame = CreateInputFrame(imLeft, imRight, mFrameMask);
+  mFrameMask.release();
+
+  Track();
+
+  return mCurrentFrame.GetPose();
+}
+
 Eigen::Matrix4d Tracking::GrabImageMonocular(const cv::Mat &im, const std::string filename) {
   // Image must be in gray scale
   assert(im.channels() == 1);
 
+  if (TrackStatic(im))
+    return mCurrentFrame.GetPose();
+
+  mCurrentFrame = CreateInputFrame(im, cv::Mat(), mFrameMask);
+  mFrameMask.release();
+
+  Track();
+
+  return mCurrentFrame.GetPose();
+}
+
+Eigen::Matrix4d Tracking::GrabImageRig(const vector<cv::Mat> &ims, const cv::Mat &imD, const std::string filename) {
+  if (ims.empty())
+    return Eigen::Matrix4d::Zero();
+
+  if (!mpRig || ims.size()-1 != mpRig->Size()) {
+    LOGE("Received %lu images but rig has %lu cameras", ims.size(), mpRig ? mpRig->Size()+1 : 1);
+    return Eigen::Matrix4d::Zero();
+  }
+
+  // Image must be in gray scale
+  assert(ims[0].channels() == 1);
+
+  // Secondary cameras are extracted while main one is
+  vector<cv::Mat> vRigImages(ims.begin()+1, ims.end());
+  vector<RigView> vViews;
+  std::thread tRig([this, &vRigImages, &vViews]() {
+    mpRig->Extract(vRigImages, vViews);
+  });
+
+  mCurrentFrame = CreateInputFrame(ims[0], imD, mFrameMask);
+  mFrameMask.release();
+
+  tRig.join();
+  mCurrentFrame.mvRigViews = std::move(vViews);
+
+  Track();
+
+  return mCurrentFrame.GetPose();
+}
+
+Frame Tracking::CreateInputFrame(const cv::Mat &im, const cv::Mat &imD, const cv::Mat &mask) {
+  if (mbLocalizationOnly) {
+    // Frames never become keyframes, keep only what tracking and relocalization use
+    Frame frame = imD.empty() ? Frame(im, mpORBextractorLeft, &mCamera, mK, mDistCoef, mbf, mThDepth, mask) :
+                                CreateFrame(im, imD, mask);
+    frame.ReleaseKeyFrameData(ImageAlign::MIN_LEVEL);
+    return frame;
+  }
+
+  if (!imD.empty())
+    return CreateFrame(im, imD, mask);
+
   if (mState==NOT_INITIALIZED || mState==NO_IMAGES_YET)
-    mCurrentFrame = Frame(im, mpIniORBextractor, mK, mDistCoef, mbf, mThDepth);
+    return Frame(im, mpIniORBextractor, &mCamera, mK, mDistCoef, mbf, mThDepth, mask);
   else
-    mCurrentFrame = Frame(im, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
+    return Frame(im, mpORBextractorLeft, &mCamera, mK, mDistCoef, mbf, mThDepth, mask);
+}
+
+bool Tracking::IsValidInputFrame(const Frame &frame) {
+  if (HasDepth() || mbLocalizationOnly)
+    return frame.mpORBextractorLeft == mpORBextractorLeft;
+
+  if (mState==NOT_INITIALIZED || mState==NO_IMAGES_YET)
+    return frame.mpORBextractorLeft == mpIniORBextractor;
+  else
+    return frame.mpORBextractorLeft == mpORBextractorLeft;
+}
+
+Eigen::Matrix4d Tracking::GrabFrame(Frame &&frame) {
+  // Features are already extracted, there is nothing to save
+  mStaticThumb.release();
+  mnStaticFrames = 0;
+
+  mCurrentFrame = std::move(frame);
 
   Track();
 
@@ -170,29 +329,74 @@ Eigen::Matrix4d Tracking::GrabImageMonocular(const cv::Mat &im, const std::strin
 }
 
 Frame Tracking::CreateFrame(const cv::Mat &im) {
-  return Frame(im, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
+  return Frame(im, mpORBextractorLeft, &mCamera, mK, mDistCoef, mbf, mThDepth);
 }
 
-Frame Tracking::CreateFrame(const cv::Mat &im, const cv::Mat &imD) {
-  cv::Mat imDepth = imD;
+Frame Tracking::CreateFrame(const cv::Mat &im, const cv::Mat &imD, const cv::Mat &mask) {
+  if (mSensor==System::STEREO)
+    return Frame(im, imD, mpORBextractorLeft, mpORBextractorRight, &mCamera, mK, mDistCoef, mbf, mThDepth, mask);
 
-  if ((fabs(mDepthMapFactor-1.0f) > 1e-5) || imD.type() != CV_32F)
-    imDepth.convertTo(imDepth, CV_32F, mDepthMapFactor);
+  // 16-bit and float depth is kept raw and scaled when sampled. It is not copied: most frames
+  // only sample it at keypoints, the buffer is copied when the frame becomes a keyframe
+  if (imD.type() == CV_16U || imD.type() == CV_32F) {
+    Frame frame(im, imD, mDepthMapFactor, mpORBextractorLeft, &mCamera, mK, mDistCoef, mbf, mThDepth, mask);
+    frame.mbBorrowedDepth = true;
+    return frame;
+  }
 
-  return Frame(im, imDepth, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
+  cv::Mat imDepth;
+  imD.convertTo(imDepth, CV_32F, mDepthMapFactor);
+  return Frame(im, imDepth, 1.0f, mpORBextractorLeft, &mCamera, mK, mDistCoef, mbf, mThDepth, mask);
+}
+
+Frame Tracking::CreateFrame(vector<cv::KeyPoint> &&keys, vector<cv::KeyPoint> &&keysUn, vector<float> &&uRight,
+                            vector<float> &&depth, const cv::Mat &descriptors, const vector<cv::Mat> &pyramid,
+                            const cv::Mat &imDepth, const cv::Size &imSize) {
+  unique_lock<mutex> lock(mMutexCamera);
+  return Frame(std::move(keys), std::move(keysUn), std::move(uRight), std::move(depth), descriptors, pyramid,
+               imDepth, imSize, mpORBextractorLeft, &mCamera, mK, mDistCoef, mbf, mThDepth);
 }
 
 void Tracking::Track() {
+  TrackFrame();
+
+  // Keyframes have been created by now, so current and last frames are left as tracking-only
+  // frames. Depth borrowed from the input is not kept past this call
+  mCurrentFrame.ReleaseKeyFrameData(ImageAlign::MIN_LEVEL);
+  mLastFrame.ReleaseKeyFrameData(ImageAlign::MIN_LEVEL);
+}
+
+void Tracking::TrackFrame() {
+  SD_TRACE("Track");
+  // Bad points are dropped from each tracked frame, older pointers are not kept
+  mpMap->GetReclaimer()->Quiescent(mnReclaimerSlot);
+
+  // Offline, frames without timestamp come at camera rate, so motion model does not
+  // depend on processing speed
+  if (Config::InputOffline() && !mbTimestampSet && Config::fps() > 0)
+    motion_model_->SetTimestamp(mCurrentFrame.mnId/Config::fps());
+  mCurrentFrame.mTimeStamp = mbTimestampSet ? mTimestamp : -1.0;
+  mbTimestampSet = false;
+
   if (mState==NO_IMAGES_YET)
     mState = NOT_INITIALIZED;
 
   mLastProcessedState = mState;
 
-  // Get Map Mutex -> Map cannot be changed
-  unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+  // Get Map Mutex -> Map cannot be changed. Not needed if there are no mapping threads
+  unique_lock<mutex> lock(mpMap->mMutexMapUpdate, std::defer_lock);
+  if (!mbLocalizationOnly)
+    lock = TraceLock(mpMap->mMutexMapUpdate, "MapUpdate");
 
-  if (mState==NOT_INITIALIZED) {
-    if (mSensor==System::RGBD)
+  const bool bInitializing = mState==NOT_INITIALIZED;
+  if (bInitializing) {
+    // A map must be loaded before tracking, it can't be created
+    if (mbLocalizationOnly) {
+      LOGE("Localization only mode needs a loaded map");
+      return;
+    }
+
+    if (HasDepth())
       StereoInitialization();
     else {
       if (usePattern)
@@ -203,7 +407,12 @@ void Tracking::Track() {
 
     if (mState!=OK)
       return;
-  } else {
+  }
+
+  // Also the frame after an initialization finished in background
+  if (!bInitializing || mbTrackAfterInitialization) {
+    mbTrackAfterInitialization = false;
+
     // System is initialized. Track Frame.
     bool bOK;
 
@@ -278,10 +487,10 @@ void Tracking::Track() {
     }
 
     // Reset if the camera get lost soon after initialization
-    if (mState==LOST) {
-      if (mpMap->KeyFramesInMap()<=5) {
-        LOGD("Track lost soon after initialisation, reseting...");
-        mpSystem->Reset();
+    if (mState==LOST && !mbLocalizationOnly) {
+      if (mpMap->KeyFramesInSession(mpMap->GetActiveSession())<=5) {
+        LOGD("Track lost soon after initialisation, starting a new map...");
+        StartNewSession();
         return;
       }
     }
@@ -289,7 +498,10 @@ void Tracking::Track() {
     if (!mCurrentFrame.mpReferenceKF)
       mCurrentFrame.mpReferenceKF = mpReferenceKF;
 
-    mLastFrame = Frame(mCurrentFrame);
+    // Rig views are not used to track next frame
+    mCurrentFrame.mvRigViews.clear();
+
+    mLastFrame = mCurrentFrame;
   }
 
   // Store relative pose
@@ -311,20 +523,13 @@ void Tracking::StereoInitialization() {
     mpMap->AddKeyFrame(pKFini);
 
     // Create MapPoints and asscoiate to KeyFrame
+    vector<int> vIndices;
+    vIndices.reserve(mCurrentFrame.N);
     for (int i = 0; i<mCurrentFrame.N; i++) {
-      float z = mCurrentFrame.mvDepth[i];
-      if (z > 0) {
-        Eigen::Vector3d x3D = mCurrentFrame.UnprojectStereo(i);
-        MapPoint* pNewMP = new MapPoint(x3D, pKFini, mpMap);
-        pNewMP->AddObservation(pKFini, i);
-        pKFini->AddMapPoint(pNewMP, i);
-        pNewMP->ComputeDistinctiveDescriptors();
-        pNewMP->UpdateNormalAndDepth();
-        mpMap->AddMapPoint(pNewMP);
-
-        mCurrentFrame.mvpMapPoints[i]=pNewMP;
-      }
+      if (mCurrentFrame.mvDepth[i] > 0)
+        vIndices.push_back(i);
     }
+    CreateDepthMapPoints(pKFini, vIndices);
 
     LOGD("New map created with %lu points", mpMap->MapPointsInMap());
 
@@ -338,7 +543,7 @@ void Tracking::StereoInitialization() {
     mpReferenceKF = pKFini;
     mCurrentFrame.mpReferenceKF = pKFini;
 
-    mLastFrame = Frame(mCurrentFrame);
+    mLastFrame = mCurrentFrame;
 
     mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
@@ -349,19 +554,32 @@ void Tracking::StereoInitialization() {
 }
 
 void Tracking::MonocularInitialization() {
+  // Attempt running in background, frames are not used for initialization until it finishes
+  if (mtInitializer.joinable()) {
+    if (!mbInitAttemptDone)
+      return;
+
+    mtInitializer.join();
+    FinishInitialization(mInitAttempt.frame);
+    if (mState==OK)
+      return;
+  }
+
   if (!mpInitializer) {
     // Set Reference Frame
     if (mCurrentFrame.mvKeys.size()>100) {
-      mInitialFrame = Frame(mCurrentFrame);
-      mLastFrame = Frame(mCurrentFrame);
+      mInitialFrame = mCurrentFrame;
+      mLastFrame = mCurrentFrame;
       mvbPrevMatched.resize(mCurrentFrame.mvKeysUn.size());
       for (size_t i = 0; i<mCurrentFrame.mvKeysUn.size(); i++)
         mvbPrevMatched[i] = mCurrentFrame.mvKeysUn[i].pt;
+      mvbPrevTracked.assign(mCurrentFrame.mvKeysUn.size(), false);
 
       if (mpInitializer)
         delete mpInitializer;
 
-      mpInitializer =  new Initializer(mCurrentFrame, 1.0, 200);
+      mpInitializer =  new Initializer(mCurrentFrame, 1.0, 200, mpIniORBextractor->GetThreadPool(),
+                                       mpIniORBextractor->GetThreads());
 
       fill(mvIniMatches.begin(), mvIniMatches.end(),-1);
 
@@ -376,42 +594,92 @@ void Tracking::MonocularInitialization() {
       return;
     }
 
-    // Find correspondences
-    ORBmatcher matcher(0.9, true);
-    int nmatches = matcher.SearchForInitialization(mInitialFrame, mCurrentFrame, mvbPrevMatched, mvIniMatches, 100);
-
-    // Check if there are enough correspondences
-    if (nmatches<100) {
-      delete mpInitializer;
-      mpInitializer = static_cast<Initializer*>(NULL);
+    // Offline, every frame is tried in order so results do not depend on processing speed
+    if (Config::InputOffline()) {
+      TryInitialization(mCurrentFrame);
+      FinishInitialization(mCurrentFrame);
       return;
     }
 
-    Eigen::Matrix3d Rcw; // Current Camera Rotation
-    Eigen::Vector3d tcw; // Current Camera Translation
-    vector<bool> vbTriangulated; // Triangulated Correspondences (mvIniMatches)
+    // Matching and H/F hypotheses take longer than a frame, camera keeps being read meanwhile
+    mInitAttempt.frame = mCurrentFrame;
+    mbInitAttemptDone = false;
+    mtInitializer = std::thread([this]() {
+      Trace::SetThreadName("Initializer");
+      TryInitialization(mInitAttempt.frame);
+      mbInitAttemptDone = true;
+    });
+  }
+}
 
-    if (mpInitializer->Initialize(mCurrentFrame, mvIniMatches, Rcw, tcw, mvIniP3D, vbTriangulated)) {
-      for (size_t i = 0, iend = mvIniMatches.size(); i < iend; i++) {
-        if (mvIniMatches[i] >= 0 && !vbTriangulated[i]) {
-          mvIniMatches[i]=-1;
-          nmatches--;
-        }
-      }
+void Tracking::TryInitialization(Frame &F) {
+  SD_TRACE("TryInitialization");
+  InitializationAttempt &attempt = mInitAttempt;
 
-      // Set Frame Poses
-      mInitialFrame.SetPose(Eigen::Matrix4d::Identity());
-      Eigen::Matrix4d Tcw;
-      Tcw.setIdentity();
-      Tcw.block<3, 3>(0, 0) = Rcw;
-      Tcw.block<3, 1>(0, 3) = tcw;
-      mCurrentFrame.SetPose(Tcw);
+  // Find correspondences
+  ORBmatcher matcher(0.9, true);
+  attempt.nMatches = matcher.SearchForInitialization(mInitialFrame, F, mvbPrevMatched, attempt.vMatches, 100,
+                                                     &mvbPrevTracked, 20);
+  attempt.bInitialized = false;
+
+  // Check if there are enough correspondences
+  if (attempt.nMatches<100)
+    return;
 
-      CreateInitialMapMonocular();
+  vector<bool> vbTriangulated; // Triangulated Correspondences (vMatches)
+  attempt.bInitialized = mpInitializer->Initialize(F, attempt.vMatches, attempt.Rcw, attempt.tcw, attempt.vP3D,
+                                                   vbTriangulated);
+  if (attempt.bInitialized) {
+    for (size_t i = 0, iend = attempt.vMatches.size(); i < iend; i++) {
+      if (attempt.vMatches[i] >= 0 && !vbTriangulated[i]) {
+        attempt.vMatches[i]=-1;
+        attempt.nMatches--;
+      }
     }
   }
 }
 
+void Tracking::FinishInitialization(Frame &F) {
+  InitializationAttempt &attempt = mInitAttempt;
+  mvIniMatches = attempt.vMatches;
+
+  if (attempt.nMatches<100) {
+    delete mpInitializer;
+    mpInitializer = static_cast<Initializer*>(NULL);
+    return;
+  }
+
+  if (!attempt.bInitialized)
+    return;
+
+  mvIniP3D.swap(attempt.vP3D);
+
+  // Set Frame Poses
+  mInitialFrame.SetPose(Eigen::Matrix4d::Identity());
+  Eigen::Matrix4d Tcw;
+  Tcw.setIdentity();
+  Tcw.block<3, 3>(0, 0) = attempt.Rcw;
+  Tcw.block<3, 1>(0, 3) = attempt.tcw;
+  F.SetPose(Tcw);
+
+  if (&F == &mCurrentFrame) {
+    CreateInitialMapMonocular();
+    return;
+  }
+
+  // Map is created from the attempt frame, which becomes last frame, and newest one is tracked against it
+  std::swap(mCurrentFrame, F);
+  CreateInitialMapMonocular();
+  std::swap(mCurrentFrame, F);
+  mbTrackAfterInitialization = mState==OK;
+}
+
+void Tracking::JoinInitialization() {
+  if (mtInitializer.joinable())
+    mtInitializer.join();
+  mbTrackAfterInitialization = false;
+}
+
 void Tracking::CreateInitialMapMonocular() {
   // Create KeyFrames
   KeyFrame* pKFini = new KeyFrame(mInitialFrame, mpMap);
@@ -494,7 +762,7 @@ void Tracking::CreateInitialMapMonocular() {
   mpReferenceKF = pKFcur;
   mCurrentFrame.mpReferenceKF = pKFcur;
 
-  mLastFrame = Frame(mCurrentFrame);
+  mLastFrame = mCurrentFrame;
 
   mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
@@ -556,7 +824,7 @@ void Tracking::PatternInitialization() {
     mpReferenceKF = pKFini;
     mCurrentFrame.mpReferenceKF = pKFini;
 
-    mLastFrame = Frame(mCurrentFrame);
+    mLastFrame = mCurrentFrame;
 
     mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
@@ -591,23 +859,41 @@ bool Tracking::TrackReferenceKeyFrame() {
 
   // Align current and last image
   if (align_image_) {
-    ImageAlign image_align;
-    if (!image_align.ComputePose(mCurrentFrame, mpReferenceKF)) {
+    ScopedSpan span_align(Statistics::IMAGE_ALIGN);
+
+    // Reference keyframe and its best covisibles, alignment holds if the frame overlaps little with one
+    vector<KeyFrame*> vpAlignKFs(1, mpReferenceKF);
+    if (Config::AlignReferences() > 1) {
+      for (KeyFrame* pKF : mpReferenceKF->GetBestCovisibilityKeyFrames(Config::AlignReferences()-1)) {
+        if (!pKF->isBad())
+          vpAlignKFs.push_back(pKF);
+      }
+    }
+
+    KeyFramePager* pPager = mpMap->GetPager();
+    for (KeyFrame* pKF : vpAlignKFs)
+      pPager->Acquire(pKF);
+
+    image_align_.SetCoarseOnly(false);
+    if (!image_align_.ComputePose(mCurrentFrame, vpAlignKFs)) {
       LOGE("Image align failed");
       mCurrentFrame.SetPose(last_pose);
     }
+
+    for (KeyFrame* pKF : vpAlignKFs)
+      pPager->Release(pKF);
   }
 
   // Project points seen in reference keyframe
   fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
-  int nmatches = matcher.SearchByProjection(mCurrentFrame, mpReferenceKF, threshold_, mSensor!=System::RGBD);
+  int nmatches = matcher.SearchByProjection(mCurrentFrame, mpReferenceKF, threshold_, !HasDepth());
 
   // If few matches, ignores alignment and uses a wider window search
   if (nmatches<20) {
     LOGD("Not enough matches [%d], double threshold", nmatches);
     mCurrentFrame.SetPose(last_pose);
     fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
-    nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, 2*threshold_, mSensor!=System::RGBD);
+    nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, 2*threshold_, !HasDepth());
   }
 
   if (nmatches<20) {
@@ -616,7 +902,7 @@ bool Tracking::TrackReferenceKeyFrame() {
   }
 
   // Optimize frame pose with all matches
-  Optimizer::PoseOptimization(&mCurrentFrame);
+  Optimizer::PoseOptimization(&mCurrentFrame, PoseIterations());
 
   // Discard outliers
   int nmatchesMap = 0;
@@ -652,6 +938,7 @@ void Tracking::UpdateLastFrame() {
 }
 
 bool Tracking::TrackWithMotionModel() {
+  ScopedSpan span(Statistics::TRACK_MOTION_MODEL);
   ORBmatcher matcher(0.9, true);
 
   // Update last frame pose according to its reference keyframe
@@ -663,25 +950,47 @@ bool Tracking::TrackWithMotionModel() {
 
   LOGD("Predicted pose: [%.4f, %.4f, %.4f]", predicted_pose(0, 3), predicted_pose(1, 3), predicted_pose(2, 3));
 
-  // Align current and last image
-  if (align_image_) {
-    ImageAlign image_align;
-    if (!image_align.ComputePose(mCurrentFrame, mLastFrame)) {
+  // Search windows from prior uncertainty, unless pose is refined by image alignment
+  Eigen::Matrix<double, 6, 6> poseCov;
+  bool bPrior = motion_model_->PoseCovariance(poseCov);
+
+  // Align current and last image, unless prior is confident
+  eAlignDecision align = ALIGN_FULL;
+  if (align_image_ && bPrior)
+    align = DecideAlignment(poseCov);
+
+  if (align_image_ && align != ALIGN_SKIP) {
+    ScopedSpan span_align(Statistics::IMAGE_ALIGN);
+    image_align_.SetCoarseOnly(align == ALIGN_COARSE);
+    if (!image_align_.ComputePose(mCurrentFrame, mLastFrame)) {
       LOGE("Image align failed");
       mCurrentFrame.SetPose(predicted_pose);
+      align_residual_ = -1.0;
+    } else {
+      bPrior = false;
+
+      // Coarse residuals are not comparable with full ones
+      if (align == ALIGN_FULL && image_align_.Refined()) {
+        align_residual_ = image_align_.GetResidual();
+        if (align_residual_mean_ < 0)
+          align_residual_mean_ = align_residual_;
+        else
+          align_residual_mean_ = 0.9*align_residual_mean_ + 0.1*align_residual_;
+      }
     }
   }
 
   // Project points seen in previous frame
   fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
-  int nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, threshold_, mSensor!=System::RGBD);
+  int nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, threshold_, !HasDepth(),
+                                            bPrior ? &poseCov : NULL);
 
   // If few matches, ignores alignment and uses a wider window search
   if (nmatches<20) {
     LOGD("Not enough matches [%d], double threshold", nmatches);
     mCurrentFrame.SetPose(predicted_pose);
     fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
-    nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, 2*threshold_, mSensor!=System::RGBD);
+    nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, 2*threshold_, !HasDepth());
   }
 
   if (nmatches<20) {
@@ -690,7 +999,7 @@ bool Tracking::TrackWithMotionModel() {
   }
 
   // Optimize frame pose with all matches
-  Optimizer::PoseOptimization(&mCurrentFrame);
+  Optimizer::PoseOptimization(&mCurrentFrame, PoseIterations());
 
   // Discard outliers
   int nmatchesMap = 0;
@@ -717,16 +1026,64 @@ bool Tracking::TrackWithMotionModel() {
   return true;
 }
 
+Tracking::eAlignDecision Tracking::DecideAlignment(const Eigen::Matrix<double, 6, 6> &poseCov) {
+  // Last alignment must be as good as usual, otherwise the scene is hard to track
+  if (align_residual_ < 0 || align_residual_mean_ < 0 || align_residual_ > 1.5*align_residual_mean_)
+    return ALIGN_FULL;
+
+  // Median projection uncertainty of a sample of points seen in last frame
+  const Eigen::Matrix4d &Tcw = mCurrentFrame.GetPose();
+  const Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
+  const Eigen::Vector3d tcw = Tcw.block<3, 1>(0, 3);
+  const int step = std::max(mLastFrame.N/50, 1);
+
+  vector<float> vSigmas;
+  vSigmas.reserve(50);
+  for (int i = 0; i < mLastFrame.N; i += step) {
+    MapPoint* pMP = mLastFrame.mvpMapPoints[i];
+    if (!pMP || mLastFrame.mvbOutlier[i])
+      continue;
+
+    Eigen::Vector3d x3Dc = Rcw*pMP->GetWorldPos()+tcw;
+    if (x3Dc(2) <= 0)
+      continue;
+    vSigmas.push_back(ORBmatcher::ProjectionSigma(x3Dc, mCurrentFrame.fx, mCurrentFrame.fy, poseCov));
+  }
+
+  if (vSigmas.size() < 10)
+    return ALIGN_FULL;
+
+  std::nth_element(vSigmas.begin(), vSigmas.begin()+vSigmas.size()/2, vSigmas.end());
+  const float sigma = vSigmas[vSigmas.size()/2];
+
+  // Skip when prior is within a pixel, align coarsely when it is well inside the search window
+  eAlignDecision decision = ALIGN_FULL;
+  if (sigma < 1.0)
+    decision = ALIGN_SKIP;
+  else if (sigma < 0.5*threshold_)
+    decision = ALIGN_COARSE;
+
+  LOGD("Prior pixel sigma %.2f, align decision %d", sigma, decision);
+  return decision;
+}
+
 bool Tracking::TrackLocalMap() {
+  ScopedSpan span(Statistics::TRACK_LOCAL_MAP);
+
   // We have an estimation of the camera pose and some map points tracked in the frame.
   // We retrieve the local map and try to find matches to points in the local map.
 
   UpdateLocalMap();
 
   SearchLocalPoints();
+  SearchRigViews();
+
+  // Points detected at reduced resolution are measured at full resolution
+  if (Config::FirstLevelORB() > 0 || mbOverload)
+    mCurrentFrame.RefineMatchedKeyPoints();
 
   // Optimize Pose
-  Optimizer::PoseOptimization(&mCurrentFrame);
+  Optimizer::PoseOptimization(&mCurrentFrame, PoseIterations());
   mnMatchesInliers = 0;
 
   // Update MapPoints Statistics
@@ -740,17 +1097,48 @@ bool Tracking::TrackLocalMap() {
     }
   }
 
+  // Reference for the cached local map, set by the first frame tracked with it
+  if (mnLocalMapInliers == 0)
+    mnLocalMapInliers = mnMatchesInliers;
+
+  // Rig inliers help to keep tracking, keyframe decisions only use the main camera
+  int nRigInliers = 0;
+  for (const RigView &view : mCurrentFrame.mvRigViews) {
+    for (int i = 0; i < view.N; i++) {
+      if (view.mvpMapPoints[i] && !view.mvbOutlier[i])
+        nRigInliers++;
+    }
+  }
+
   // Decide if the tracking was succesful
-  if (mnMatchesInliers<30) {
-    LOGD("Not enough points tracked [%d], tracking failed", mnMatchesInliers);
+  if (mnMatchesInliers+nRigInliers<30) {
+    LOGD("Not enough points tracked [%d], tracking failed", mnMatchesInliers+nRigInliers);
     return false;
   }
 
   return true;
 }
 
+int Tracking::SearchRigViews() {
+  if (mCurrentFrame.mvRigViews.empty())
+    return 0;
+
+  // Coarse search, extrinsics errors are added to the pose error
+  ORBmatcher matcher(0.8);
+  int nmatches = 0;
+  for (RigView &view : mCurrentFrame.mvRigViews) {
+    std::fill(view.mvpMapPoints.begin(), view.mvpMapPoints.end(), static_cast<MapPoint*>(nullptr));
+    nmatches += matcher.SearchByProjection(view, mCurrentFrame, mvpLocalMapPoints, 3);
+  }
+
+  return nmatches;
+}
+
 
 bool Tracking::NeedNewKeyFrame() {
+  if (mbOnlyTracking)
+    return false;
+
   // If Local Mapping is freezed by a Loop Closure do not insert keyframes
   if (mpLocalMapper->isStopped() || mpLocalMapper->stopRequested())
     return false;
@@ -769,13 +1157,13 @@ bool Tracking::NeedNewKeyFrame() {
     nMinObs=1;
   int nRefMatches = mpReferenceKF->TrackedMapPoints(nMinObs);
 
-  // Local Mapping accept keyframes?
-  bool bLocalMappingIdle = mpLocalMapper->AcceptKeyFrames();
+  // Local Mapping accept keyframes? Offline, it is waited for when a keyframe is needed
+  bool bLocalMappingIdle = Config::InputOffline() || mpLocalMapper->AcceptKeyFrames();
 
   // Check how many "close" points are being tracked and how many could be potentially created.
   int nNonTrackedClose = 0;
   int nTrackedClose= 0;
-  if (mSensor==System::RGBD) {
+  if (HasDepth()) {
     for (int i  = 0; i<mCurrentFrame.N; i++) {
       if (mCurrentFrame.mvDepth[i] > 0 && mCurrentFrame.mvDepth[i]<mThDepth) {
         if (mCurrentFrame.mvpMapPoints[i] && !mCurrentFrame.mvbOutlier[i])
@@ -793,7 +1181,7 @@ bool Tracking::NeedNewKeyFrame() {
   if (nKFs<2)
     thRefRatio = 0.4f;
 
-  if (mSensor!=System::RGBD)
+  if (!HasDepth())
     thRefRatio = 0.9f;
 
   // Condition 1a: More than "MaxFrames" have passed from last keyframe insertion
@@ -801,31 +1189,56 @@ bool Tracking::NeedNewKeyFrame() {
   // Condition 1b: More than "MinFrames" have passed and Local Mapping is idle
   const bool c1b = (mCurrentFrame.mnId >= mnLastKeyFrameId+mMinFrames && bLocalMappingIdle);
   //Condition 1c: tracking is weak
-  const bool c1c =  mSensor==System::RGBD && (mnMatchesInliers<nRefMatches*0.25 || bNeedToInsertClose) ;
+  const bool c1c =  HasDepth() && (mnMatchesInliers<nRefMatches*0.25 || bNeedToInsertClose) ;
   // Condition 2: Few tracked points compared to reference keyframe. Lots of visual odometry compared to map matches.
   const bool c2 = ((mnMatchesInliers<nRefMatches*thRefRatio|| bNeedToInsertClose) && mnMatchesInliers>15);
 
   if ((c1a||c1b||c1c)&&c2) {
+    // Offline, block until mapping has processed its queue (backpressure) instead of
+    // deferring the keyframe or interrupting BA
+    if (Config::InputOffline()) {
+      mpLocalMapper->WaitUntilIdle();
+      return true;
+    }
+
     // If the mapping accepts keyframes, insert keyframe.
-    // Otherwise send a signal to interrupt BA
-    if (bLocalMappingIdle) {
+    if (bLocalMappingIdle)
       return true;
-    } else {
-      mpLocalMapper->InterruptBA();
 
-      if (mSensor==System::RGBD) {
-        if (mpLocalMapper->KeyframesInQueue()<3)
-          return true;
-        else
-          return false;
-      } else
-        return false;
+    // Mapping is busy. Defer while the backlog is over budget, a later keyframe covers the
+    // deferred frames
+    const double kfTime = mpLocalMapper->KeyFrameTime();
+    const double maxLatency = Config::MappingMaxLatency();
+    const double backlog = (mpLocalMapper->KeyframesInQueue()+1)*kfTime;
+    if (kfTime > 0 && backlog > maxLatency) {
+      LOGD("Mapping backlog %.1fms, keyframe deferred", backlog);
+      return false;
     }
+
+    // Let running BA finish if it fits in budget and tracking is not weak
+    const double baElapsed = mpLocalMapper->BAElapsedTime();
+    const double baTime = mpLocalMapper->BATime();
+    if (!c1c && kfTime > 0 && baElapsed >= 0 && baTime > 0 &&
+        backlog + std::max(baTime-baElapsed, 0.0) <= maxLatency)
+      return false;
+
+    // Otherwise send a signal to interrupt BA
+    mpLocalMapper->InterruptBA();
+
+    if (HasDepth()) {
+      if (mpLocalMapper->KeyframesInQueue()<3)
+        return true;
+      else
+        return false;
+    } else
+      return false;
   } else
     return false;
 }
 
 void Tracking::CreateNewKeyFrame() {
+  ScopedSpan span(Statistics::KEYFRAME_CREATION);
+
   if (!mpLocalMapper->SetNotStop(true))
     return;
 
@@ -834,57 +1247,42 @@ void Tracking::CreateNewKeyFrame() {
   mpReferenceKF = pKF;
   mCurrentFrame.mpReferenceKF = pKF;
 
-  if (mSensor==System::RGBD) {
+  if (HasDepth()) {
     mCurrentFrame.UpdatePoseMatrices();
 
-    // We sort points by the measured depth by the stereo/RGBD sensor.
     // We create all those MapPoints whose depth < mThDepth.
     // If there are less than 100 close points we create the 100 closest.
     vector<pair<float, int> > vDepthIdx;
     vDepthIdx.reserve(mCurrentFrame.N);
+    size_t nClose = 0;
     for (int i = 0; i<mCurrentFrame.N; i++) {
       float z = mCurrentFrame.mvDepth[i];
       if (z > 0) {
         vDepthIdx.push_back(make_pair(z, i));
+        if (z <= mThDepth)
+          nClose++;
       }
     }
 
-    if (!vDepthIdx.empty()) {
-      sort(vDepthIdx.begin(), vDepthIdx.end());
-
-      int nPoints = 0;
-      for (size_t j = 0; j < vDepthIdx.size(); j++) {
-        int i = vDepthIdx[j].second;
+    // Only the selected points need to be closest, their order does not matter
+    const size_t nSelected = std::min(vDepthIdx.size(), std::max<size_t>(nClose, 101));
+    if (nSelected < vDepthIdx.size())
+      std::nth_element(vDepthIdx.begin(), vDepthIdx.begin()+nSelected, vDepthIdx.end());
 
-        bool bCreateNew = false;
-
-        MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
-        if (!pMP)
-          bCreateNew = true;
-        else if (pMP->Observations()<1) {
-          bCreateNew = true;
-          mCurrentFrame.mvpMapPoints[i] = static_cast<MapPoint*>(NULL);
-        }
+    vector<int> vIndices;
+    vIndices.reserve(nSelected);
+    for (size_t j = 0; j < nSelected; j++) {
+      int i = vDepthIdx[j].second;
 
-        if (bCreateNew) {
-          Eigen::Vector3d x3D = mCurrentFrame.UnprojectStereo(i);
-          MapPoint* pNewMP = new MapPoint(x3D, pKF, mpMap);
-          pNewMP->AddObservation(pKF, i);
-          pKF->AddMapPoint(pNewMP, i);
-          pNewMP->ComputeDistinctiveDescriptors();
-          pNewMP->UpdateNormalAndDepth();
-          mpMap->AddMapPoint(pNewMP);
-
-          mCurrentFrame.mvpMapPoints[i]=pNewMP;
-          nPoints++;
-        } else {
-          nPoints++;
-        }
-
-        if (vDepthIdx[j].first>mThDepth && nPoints>100)
-          break;
+      MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+      if (!pMP) {
+        vIndices.push_back(i);
+      } else if (pMP->Observations()<1) {
+        mCurrentFrame.mvpMapPoints[i] = static_cast<MapPoint*>(NULL);
+        vIndices.push_back(i);
       }
     }
+    CreateDepthMapPoints(pKF, vIndices);
   }
 
   mpLocalMapper->InsertKeyFrame(pKF);
@@ -895,6 +1293,74 @@ void Tracking::CreateNewKeyFrame() {
   mpLastKeyFrame = pKF;
 }
 
+void Tracking::CreateDepthMapPoints(KeyFrame* pKF, const vector<int> &vIndices) {
+  vector<MapPoint*> vpNewMPs;
+  vpNewMPs.reserve(vIndices.size());
+
+  for (int i : vIndices) {
+    Eigen::Vector3d x3D = mCurrentFrame.UnprojectStereo(i);
+    MapPoint* pNewMP = new MapPoint(x3D, pKF, mpMap, i);
+    pNewMP->AddObservation(pKF, i);
+    pKF->AddMapPoint(pNewMP, i);
+    mCurrentFrame.mvpMapPoints[i] = pNewMP;
+    vpNewMPs.push_back(pNewMP);
+  }
+
+  mpMap->AddMapPoints(vpNewMPs);
+}
+
+bool Tracking::TrackStatic(const cv::Mat &im) {
+  if (Config::StaticThreshold() <= 0)
+    return false;
+
+  // Coarse image, about a thousand pixels at VGA
+  cv::Mat thumb;
+  cv::resize(im, thumb, cv::Size(std::max(im.cols/16, 1), std::max(im.rows/16, 1)), 0, 0, cv::INTER_AREA);
+
+  bool bStatic = mState==OK && mLastProcessedState==OK && mnStaticFrames < Config::StaticMaxFrames() &&
+                 mStaticThumb.size() == thumb.size() && mCurrentFrame.mnId == mLastFrame.mnId &&
+                 cv::norm(thumb, mStaticThumb, cv::NORM_L1)/thumb.total() < Config::StaticThreshold();
+
+  // Motion model must be at rest too, slow motion may not be seen at this scale yet. Without
+  // timestamps velocity is not available and the image decides alone
+  Eigen::Matrix<double, 6, 1> xi;
+  double timestamp;
+  if (bStatic && motion_model_->Velocity(mCurrentFrame.GetPose(), xi, timestamp))
+    bStatic = xi.head<3>().norm() < 0.01 && xi.tail<3>().norm() < 0.01;
+
+  if (!bStatic) {
+    // Compared with next frames, which must change as much to be tracked again
+    mStaticThumb = thumb;
+    mnStaticFrames = 0;
+    return false;
+  }
+
+  // Same pose as a new frame. Points are not matched again, drop those Local Mapping
+  // erased or replaced meanwhile
+  mpMap->GetReclaimer()->Quiescent(mnReclaimerSlot);
+  for (int i = 0; i<mCurrentFrame.N; i++) {
+    MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+    if (!pMP)
+      continue;
+    MapPoint* pRep = pMP->GetReplaced();
+    if (pRep)
+      mCurrentFrame.mvpMapPoints[i] = pRep;
+    else if (pMP->isBad())
+      mCurrentFrame.mvpMapPoints[i] = static_cast<MapPoint*>(NULL);
+  }
+
+  mCurrentFrame.mnId = mCamera.mnNextFrameId++;
+  mCurrentFrame.mTimeStamp = mbTimestampSet ? mTimestamp : -1.0;
+  mbTimestampSet = false;
+  mLastProcessedState = mState;
+  mFrameMask.release();
+  mLastFrame.mnId = mCurrentFrame.mnId;
+  mLastFrame.mTimeStamp = mCurrentFrame.mTimeStamp;
+  mnStaticFrames++;
+
+  return true;
+}
+
 void Tracking::SearchLocalPoints() {
   // Do not search map points already matched
   for (vector<MapPoint*>::iterator vit = mCurrentFrame.mvpMapPoints.begin(), vend = mCurrentFrame.mvpMapPoints.end(); vit!=vend; vit++) {
@@ -910,11 +1376,34 @@ void Tracking::SearchLocalPoints() {
     }
   }
 
-  int nToMatch = 0;
+  vector<MapPoint*> vpToMatch;
 
-  // Project points in frame and check its visibility
-  for (vector<MapPoint*>::iterator vit = mvpLocalMapPoints.begin(), vend = mvpLocalMapPoints.end(); vit!=vend; vit++) {
-    MapPoint* pMP = *vit;
+  // Points of local keyframes are projected at once, only those in view are visited
+  mvVisiblePoints.clear();
+  mCurrentFrame.isInFrustum(mLocalPointTable, 0.5, mvVisiblePoints);
+  vpToMatch.reserve(mvVisiblePoints.size());
+
+  for (const PointTable::Visible &p : mvVisiblePoints) {
+    MapPoint* pMP = mvpLocalMapPoints[p.idx];
+    if (pMP->mnLastFrameSeen == mCurrentFrame.mnId)
+      continue;
+    if (pMP->isBad())
+      continue;
+
+    // Fill MapPoint variables for matching
+    pMP->mbTrackInView = true;
+    pMP->mTrackProjX = p.u;
+    pMP->mTrackProjXR = p.uR;
+    pMP->mTrackProjY = p.v;
+    pMP->mnTrackScaleLevel = p.level;
+    pMP->mTrackViewCos = p.viewCos;
+    pMP->IncreaseVisible();
+    vpToMatch.push_back(pMP);
+  }
+
+  // Project the rest of points in frame and check its visibility
+  for (size_t i = mLocalPointTable.Size(); i < mvpLocalMapPoints.size(); i++) {
+    MapPoint* pMP = mvpLocalMapPoints[i];
     if (pMP->mnLastFrameSeen == mCurrentFrame.mnId)
       continue;
     if (pMP->isBad())
@@ -922,19 +1411,20 @@ void Tracking::SearchLocalPoints() {
     // Project (this fills MapPoint variables for matching)
     if (mCurrentFrame.isInFrustum(pMP, 0.5)) {
       pMP->IncreaseVisible();
-      nToMatch++;
+      vpToMatch.push_back(pMP);
     }
   }
 
-  if (nToMatch > 0) {
+  if (!vpToMatch.empty()) {
     ORBmatcher matcher(0.8);
+    matcher.SetThreadPool(mpThreadPool, Config::ThreadsORB());
     int th = 1;
-    if (mSensor==System::RGBD)
+    if (HasDepth())
       th=3;
     // If the camera has been relocalised recently, perform a coarser search
     if (mCurrentFrame.mnId<mnLastRelocFrameId+2)
       th=5;
-    matcher.SearchByProjection(mCurrentFrame, mvpLocalMapPoints, th);
+    matcher.SearchByProjection(mCurrentFrame, vpToMatch, th);
   }
 }
 
@@ -942,9 +1432,29 @@ void Tracking::UpdateLocalMap() {
   // This is for visualization
   mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
-  // Update
-  UpdateLocalKeyFrames();
-  UpdateLocalPoints();
+  // Local map is mostly the same between frames, rebuild it only if it may have changed
+  int nChangeIdx = mpMap->GetLastChangeIdx();
+  bool bRebuild = mpReferenceKF != mpLocalMapRefKF || nChangeIdx != mnLocalMapChangeIdx ||
+                  mCurrentFrame.mnId < mnLastRelocFrameId+2 || mnMatchesInliers < 0.75*mnLocalMapInliers;
+
+  if (bRebuild) {
+    UpdateLocalKeyFrames();
+    UpdateLocalPoints();
+
+    mpLocalMapRefKF = mpReferenceKF;
+    mnLocalMapChangeIdx = nChangeIdx;
+    mnLocalMapInliers = 0;
+  } else {
+    mCurrentFrame.mpReferenceKF = mpReferenceKF;
+
+    // Points in view depend on current pose
+    if (Config::FrustumPoints()) {
+      mvpLocalMapPoints.resize(mnLocalKeyFramePoints);
+      for (MapPoint* pMP : mvpLocalMapPoints)
+        pMP->mnTrackReferenceForFrame = mCurrentFrame.mnId;
+      UpdateFrustumPoints();
+    }
+  }
 }
 
 void Tracking::UpdateLocalPoints() {
@@ -952,18 +1462,50 @@ void Tracking::UpdateLocalPoints() {
 
   for (vector<KeyFrame*>::const_iterator itKF = mvpLocalKeyFrames.begin(), itEndKF = mvpLocalKeyFrames.end(); itKF!=itEndKF; itKF++) {
     KeyFrame* pKF = *itKF;
-    const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
 
-    for (vector<MapPoint*>::const_iterator itMP=vpMPs.begin(), itEndMP=vpMPs.end(); itMP!=itEndMP; itMP++) {
-      MapPoint* pMP = *itMP;
-      if (!pMP)
-        continue;
+    pKF->ForEachMapPoint([&](size_t, MapPoint* pMP) {
       if (pMP->mnTrackReferenceForFrame == mCurrentFrame.mnId)
-        continue;
+        return;
       if (!pMP->isBad()) {
         mvpLocalMapPoints.push_back(pMP);
         pMP->mnTrackReferenceForFrame = mCurrentFrame.mnId;
       }
+    });
+  }
+
+  mnLocalKeyFramePoints = mvpLocalMapPoints.size();
+
+  mLocalPointTable.Clear();
+  mLocalPointTable.Reserve(mnLocalKeyFramePoints);
+  for (MapPoint* pMP : mvpLocalMapPoints)
+    mLocalPointTable.Add(pMP->GetWorldPos(), pMP->GetNormal(), pMP->GetMinDistanceInvariance(), pMP->GetMaxDistanceInvariance());
+
+  if (Config::FrustumPoints())
+    UpdateFrustumPoints();
+}
+
+void Tracking::UpdateFrustumPoints() {
+  // Add points in view not observed by local keyframes
+  MapPointIndex::Frustum frustum;
+  frustum.Tcw = mCurrentFrame.GetPose();
+  frustum.fx = mCurrentFrame.fx;
+  frustum.fy = mCurrentFrame.fy;
+  frustum.cx = mCurrentFrame.cx;
+  frustum.cy = mCurrentFrame.cy;
+  frustum.minX = mCurrentFrame.mnMinX;
+  frustum.maxX = mCurrentFrame.mnMaxX;
+  frustum.minY = mCurrentFrame.mnMinY;
+  frustum.maxY = mCurrentFrame.mnMaxY;
+  frustum.maxDepth = 0;
+
+  const vector<MapPoint*> vpMPs = mpMap->GetMapPointsInFrustum(frustum);
+  for (vector<MapPoint*>::const_iterator itMP=vpMPs.begin(), itEndMP=vpMPs.end(); itMP!=itEndMP; itMP++) {
+    MapPoint* pMP = *itMP;
+    if (pMP->mnTrackReferenceForFrame == mCurrentFrame.mnId)
+      continue;
+    if (!pMP->isBad()) {
+      mvpLocalMapPoints.push_back(pMP);
+      pMP->mnTrackReferenceForFrame = mCurrentFrame.mnId;
     }
   }
 }
@@ -977,9 +1519,9 @@ void Tracking::UpdateLocalKeyFrames() {
     if (mCurrentFrame.mvpMapPoints[i]) {
       MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
       if (!pMP->isBad()) {
-        const map<KeyFrame*, size_t> observations = pMP->GetObservations();
-        for (map<KeyFrame*, size_t>::const_iterator it=observations.begin(), itend=observations.end(); it!=itend; it++)
-          keyframeCounter[it->first]++;
+        pMP->ForEachObservation([&](KeyFrame* pKF, size_t) {
+          keyframeCounter[pKF]++;
+        });
       } else {
         mCurrentFrame.mvpMapPoints[i]=NULL;
       }
@@ -1013,8 +1555,8 @@ void Tracking::UpdateLocalKeyFrames() {
 
   // Include also some not-already-included keyframes that are neighbors to already-included keyframes
   for (vector<KeyFrame*>::const_iterator itKF = mvpLocalKeyFrames.begin(), itEndKF = mvpLocalKeyFrames.end(); itKF!=itEndKF; itKF++) {
-    // Limit the number of keyframes
-    if (mvpLocalKeyFrames.size()>80)
+    // Limit the number of keyframes, half of them if overloaded
+    if (mvpLocalKeyFrames.size()>(mbOverload ? 40 : 80))
       break;
 
     KeyFrame* pKF = *itKF;
@@ -1065,44 +1607,129 @@ bool Tracking::Relocalization() {
   ORBmatcher matcher(0.75, true);
   int nmatches, nGood;
 
-  // Compare to all keyframes starting from the last one
-  vector<KeyFrame*> kfs = mpMap->GetAllKeyFrames();
-  for (auto it=kfs.rbegin(); it != kfs.rend(); it++) {
-    KeyFrame* kf = *it;
+  // Retrieve most similar keyframes, best first
+  // Optionally only around the last place tracked
+  KeyFrameDatabase::Gate gate;
+  if (Config::RelocGate() && Config::LoopGateRadius() > 0 && mpReferenceKF && !mpReferenceKF->isBad())
+    gate = KeyFrameDatabase::Gate(mpReferenceKF->GetCameraCenter(), Config::LoopGateRadius());
+
+  vector<KeyFrame*> kfs = mpMap->GetKeyFrameDatabase()->DetectRelocalizationCandidates(&mCurrentFrame, Config::RelocCandidates(), gate);
+
+  Timer total(true);
+  const double budget = Config::RelocTimeBudget();
+
+  // All candidates are scored at once, aligned at the coarsest level only (cheap and
+  // independent, so in parallel). Candidates far from the frame fail there
+  const int nCandidates = kfs.size();
+  const int nBatch = mpThreadPool ? std::max(1, Config::ThreadsORB()) : 1;
+  vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > vPoses(nCandidates);
+  vector<double> vErrors(nCandidates, -1.0);
+  if (static_cast<int>(reloc_aligns_.size()) < std::max(nCandidates, nBatch))
+    reloc_aligns_.resize(std::max(nCandidates, nBatch));
+
+  auto score = [&](int i) {
+    KeyFrame* kf = kfs[i];
+    ScopedPage page(mpMap->GetPager(), kf);
+    ImageAlign &image_align = reloc_aligns_[i];
+    vPoses[i] = kf->GetPose();
+    image_align.SetCoarseOnly(true);
+    if (image_align.ComputePose(mCurrentFrame, kf, vPoses[i], true))
+      vErrors[i] = image_align.GetError();
+  };
+
+  if (mpThreadPool && nCandidates > 1) {
+    mpThreadPool->ParallelFor(nCandidates, score, Config::ThreadsORB());
+  } else {
+    for (int i = 0; i < nCandidates; i++)
+      score(i);
+  }
 
-    mCurrentFrame.SetPose(kf->GetPose());
+  // Lowest coarse error first, similarity order between equal ones
+  vector<int> vOrder;
+  for (int i = 0; i < nCandidates; i++) {
+    if (vErrors[i] >= 0)
+      vOrder.push_back(i);
+  }
+  std::stable_sort(vOrder.begin(), vOrder.end(), [&](int a, int b) { return vErrors[a] < vErrors[b]; });
 
-    // Try to align current frame and candidate keyframe
-    ImageAlign image_align;
-    if (!image_align.ComputePose(mCurrentFrame, kf, true))
-      continue;
+  // Survivors are refined from their coarse pose in parallel in batches of one per thread, then
+  // verified in order. Remaining batches are skipped once a candidate is accepted
+  vector<char> vbAligned(nBatch);
 
-    fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
+  for (size_t first = 0; first < vOrder.size(); first += nBatch) {
+    // Give up and try again with next frame
+    total.Stop();
+    if (budget > 0 && total.GetMsTime() > budget) {
+      LOGD("Relocalization time budget exceeded (%.2fms)", total.GetMsTime());
+      break;
+    }
 
-    // Project points seen in previous frame
-    nmatches = matcher.SearchByProjection(mCurrentFrame, kf, threshold_, mSensor!=System::RGBD);
-    if (nmatches < 20)
-      continue;
+    // Align current frame and candidate keyframes at every level
+    const int n = std::min(vOrder.size()-first, static_cast<size_t>(nBatch));
+    auto align = [&](int i) {
+      const int c = vOrder[first+i];
+      KeyFrame* kf = kfs[c];
+      ScopedPage page(mpMap->GetPager(), kf);
+      ImageAlign &image_align = reloc_aligns_[c];
+      image_align.SetCoarseOnly(false);
+      vbAligned[i] = image_align.ComputePose(mCurrentFrame, kf, vPoses[c], true);
+    };
+
+    if (mpThreadPool && n > 1) {
+      mpThreadPool->ParallelFor(n, align, Config::ThreadsORB());
+    } else {
+      for (int i = 0; i < n; i++)
+        align(i);
+    }
 
-    // Optimize frame pose with all matches
-    nGood = Optimizer::PoseOptimization(&mCurrentFrame);
-    if (nGood < 10)
-      continue;
+    for (int i = 0; i < n; i++) {
+      if (!vbAligned[i])
+        continue;
+
+      const int c = vOrder[first+i];
+      KeyFrame* kf = kfs[c];
+      mCurrentFrame.SetPose(vPoses[c]);
 
-    mnLastRelocFrameId = mCurrentFrame.mnId;
-    return true;
+      fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
+
+      // Project points seen in previous frame
+      nmatches = matcher.SearchByProjection(mCurrentFrame, kf, threshold_, !HasDepth());
+      if (nmatches < 20)
+        continue;
+
+      // Optimize frame pose with all matches
+      nGood = Optimizer::PoseOptimization(&mCurrentFrame, PoseIterations());
+      if (nGood < 10)
+        continue;
+
+      // Tracking goes on in the map of kf, which may be an inactive one
+      mpMap->ActivateSession(kf);
+
+      mnLastRelocFrameId = mCurrentFrame.mnId;
+      return true;
+    }
   }
 
   return false;
 }
 
 void Tracking::Reset() {
+  // Loaded map is kept, relocalize in it again
+  if (mbLocalizationOnly) {
+    LOGD("Reseting tracking state");
+    mState = LOST;
+    lastRelativePose_.setZero();
+    motion_model_->Restart();
+    return;
+  }
 
   LOGD("System Reseting");
 
   // Reset Local Mapping
-  LOGD("Reseting Local Mapper...");
-  mpLocalMapper->RequestReset();
+  if (mpLocalMapper) {
+    LOGD("Reseting Local Mapper...");
+    mpLocalMapper->RequestReset();
+  }
 
   // Reset Loop Closing
   if (mpLoopClosing) {
@@ -1113,21 +1740,103 @@ void Tracking::Reset() {
   // Clear Map (this erase MapPoints and KeyFrames)
   mpMap->clear();
 
-  KeyFrame::nNextId = 0;
-  Frame::nNextId = 0;
+  mCamera.mnNextFrameId = 0;
+  ClearTrackingState();
+}
+
+void Tracking::StartNewSession() {
+  LOGD("New map started, previous one is kept until it can be merged");
+  mpMap->StartSession();
+  ClearTrackingState();
+}
+
+void Tracking::ClearTrackingState() {
+  align_residual_ = -1.0;
+  align_residual_mean_ = -1.0;
   mState = NO_IMAGES_YET;
 
+  mvpLocalKeyFrames.clear();
+  mvpLocalMapPoints.clear();
+  mpReferenceKF = nullptr;
+  mpLocalMapRefKF = nullptr;
+  mnLocalMapInliers = 0;
+  mnLocalKeyFramePoints = 0;
+  mLocalPointTable.Clear();
+
+  JoinInitialization();
   if (mpInitializer) {
     delete mpInitializer;
     mpInitializer = static_cast<Initializer*>(NULL);
   }
 
+  mStaticThumb.release();
+  mnStaticFrames = 0;
+
   lastRelativePose_.setZero();
   motion_model_->Restart();
 }
 
+void Tracking::UpdateFeatureBudget(double ms) {
+  const double target = Config::TargetFrameTime();
+  if (target <= 0)
+    return;
+
+  // Initialization uses its own extractor
+  if (mState != OK && mState != LOST)
+    return;
+
+  // Single slow frames should not change the budget
+  mFrameTime = mFrameTime > 0 ? 0.9*mFrameTime+0.1*ms : ms;
+
+  // Hysteresis, so the mode doesn't change every frame
+  if (Config::OverloadMode()) {
+    if (!mbOverload && mFrameTime > 1.25*target)
+      SetOverload(true);
+    else if (mbOverload && mFrameTime < 0.75*target)
+      SetOverload(false);
+  }
+
+  const int current = mpORBextractorLeft->GetNumFeatures();
+  const bool bWeak = mState == LOST || mnMatchesInliers < 100;
+  int n = current;
+
+  if (mFrameTime > target) {
+    // Too slow, unless tracking is about to fail
+    if (!bWeak)
+      n = 0.9*current;
+  } else if (bWeak) {
+    if (mFrameTime < 0.9*target)
+      n = 1.1*current;
+  } else if (mnMatchesInliers > 300) {
+    // Easy scene, spend less time
+    n = 0.95*current;
+  }
+
+  n = std::min(std::max(n, Config::MinFeatures()), Config::MaxFeatures());
+  if (n == current)
+    return;
+
+  mpORBextractorLeft->SetNumFeatures(n);
+  if (mpORBextractorRight)
+    mpORBextractorRight->SetNumFeatures(n);
+
+  LOGD("Feature budget set to %d (frame time %.2fms)", n, mFrameTime);
+}
+
+void Tracking::SetOverload(bool bOverload) {
+  mbOverload = bOverload;
+
+  // Finest level has most of the pixels
+  const int firstLevel = Config::FirstLevelORB() + (bOverload ? 1 : 0);
+  mpORBextractorLeft->SetFirstLevel(firstLevel);
+  if (mpORBextractorRight)
+    mpORBextractorRight->SetFirstLevel(firstLevel);
+
+  LOGD("Overload mode %s (frame time %.2fms)", bOverload ? "on" : "off", mFrameTime);
+}
+
 void Tracking::InformOnlyTracking(const bool &flag) {
-  mbOnlyTracking = flag;
+  mbOnlyTracking = flag || mbLocalizationOnly;
 }
 
 void Tracking::PatternCellSize(double w, double h){
@@ -26,6 +26,8 @@
 #define SD_SLAM_TRACKING_H
 
 #include <mutex>
+#include <thread>
+#include <atomic>
 #include <string>
 #include <list>
 #include <vector>
@@ -36,7 +38,9 @@
 #include "LoopClosing.h"
 #include "Frame.h"
 #include "ORBextractor.h"
+#include "CameraRig.h"
 #include "Initializer.h"
+#include "ImageAlign.h"
 #include "PatternDetector.h"
 #include "System.h"
 #include "sensors/EKF.h"
@@ -60,15 +64,46 @@ class Tracking {
   };
 
  public:
-  Tracking(System* pSys, Map* pMap, const int sensor);
+  // In localization only mode there are no mapping threads and the map is never modified
+  // Feature extraction, local map search and initialization use up to Config::ThreadsORB() threads of pPool
+  Tracking(System* pSys, Map* pMap, const int sensor, bool localizationOnly = false, ThreadPool* pPool = nullptr);
+  ~Tracking();
 
   // Preprocess the input and call Track(). Extract features and performs stereo matching.
   Eigen::Matrix4d GrabImageRGBD(const cv::Mat &im, const cv::Mat &imD, const std::string filename);
   Eigen::Matrix4d GrabImageMonocular(const cv::Mat &im, const std::string filename);
+  Eigen::Matrix4d GrabImageStereo(const cv::Mat &imLeft, const cv::Mat &imRight, const std::string filename);
+
+  // Same with a camera rig. ims[0] is the main camera image (imD its depthmap if RGBD) and
+  // ims[i] the image of rig camera i. Features of all cameras are extracted in parallel.
+  Eigen::Matrix4d GrabImageRig(const std::vector<cv::Mat> &ims, const cv::Mat &imD, const std::string filename);
+
+  // Secondary cameras, null if there is no rig
+  inline const CameraRig* GetRig() const { return mpRig; }
+
+  // Build frame as GrabImageMonocular or GrabImageRGBD (imD not empty) would do in current state.
+  // With stereo sensor imD is the right image. Features are not extracted where mask is zero
+  Frame CreateInputFrame(const cv::Mat &im, const cv::Mat &imD, const cv::Mat &mask = cv::Mat());
+
+  // True if frame was built with the extractor needed in current state
+  bool IsValidInputFrame(const Frame &frame);
+
+  // True if next frame can be built in another thread while current one is tracked.
+  // Only after initialization, when the extractor used does not change.
+  inline bool CanPrebuildFrame() { return mState==OK || mState==LOST; }
+
+  // Track a frame built with CreateInputFrame
+  Eigen::Matrix4d GrabFrame(Frame &&frame);
 
   // Create new frame and extract features
   Frame CreateFrame(const cv::Mat &im);
-  Frame CreateFrame(const cv::Mat &im, const cv::Mat &imD);
+  Frame CreateFrame(const cv::Mat &im, const cv::Mat &imD,  // imD is the right image if stereo
+                    const cv::Mat &mask = cv::Mat());
+
+  // Create new frame from already extracted features. Can be called from several threads
+  Frame CreateFrame(std::vector<cv::KeyPoint> &&keys, std::vector<cv::KeyPoint> &&keysUn, std::vector<float> &&uRight,
+                    std::vector<float> &&depth, const cv::Mat &descriptors, const std::vector<cv::Mat> &pyramid,
+                    const cv::Mat &imDepth, const cv::Size &imSize);
 
   inline void SetLocalMapper(LocalMapping* pLocalMapper) {
     mpLocalMapper = pLocalMapper;
@@ -82,6 +117,29 @@ class Tracking {
     measurements_ = measurements;
   }
 
+  // Sensor timestamp (s) and motion model input of next frame
+  inline void SetTimestamp(double timestamp) {
+    motion_model_->SetTimestamp(timestamp);
+    mTimestamp = timestamp;
+    mbTimestampSet = true;
+  }
+
+  // Mask of next grabbed image, features are not extracted where it is zero. It is combined
+  // with the static mask (see ORBextractor.Mask)
+  inline void SetMask(const cv::Mat &mask) {
+    mFrameMask = mask;
+  }
+
+  inline void SetMotionInput(const std::vector<double> &input) {
+    motion_model_->SetInput(input);
+  }
+
+  // Velocity and timestamp of last frame (see MotionModel::Velocity). Returns false if it
+  // was not tracked or has no timestamp
+  inline bool GetVelocity(Eigen::Matrix<double, 6, 1> &xi, double &timestamp) {
+    return mState == OK && motion_model_->Velocity(mCurrentFrame.GetPose(), xi, timestamp);
+  }
+
   inline void SetReferenceKeyFrame(KeyFrame * kf) {
     mpReferenceKF = kf;
   }
@@ -89,6 +147,7 @@ class Tracking {
   inline float GetDepthFactor() const { return mDepthMapFactor; }
 
   inline bool OnlyTracking() const { return mbOnlyTracking; }
+  inline bool LocalizationOnly() const { return mbLocalizationOnly; }
 
   inline eTrackingState GetState() { return mState; }
   inline eTrackingState GetLastState() { return mLastProcessedState; }
@@ -100,6 +159,13 @@ class Tracking {
   inline std::vector<int> GetInitialMatches() { return mvIniMatches; }
 
   void Reset();
+
+  // Adapt the number of extracted features to the last frame time (ms) and tracking quality.
+  // Only active if a target frame time is set (see ORBextractor.TargetFrameTime).
+  // Also enters and leaves overload mode (see ORBextractor.OverloadMode)
+  void UpdateFeatureBudget(double ms);
+
+  inline bool IsOverloaded() const { return mbOverload; }
   
   void PatternCellSize(double w, double h);
 
@@ -108,16 +174,34 @@ class Tracking {
   void InformOnlyTracking(const bool &flag);
 
  protected:
-  // Main tracking function. It is independent of the input sensor.
+  // Main tracking function. It is independent of the input sensor. Frames are left without
+  // keyframe data afterwards (see Frame::ReleaseKeyFrameData)
   void Track();
+  void TrackFrame();
 
   // Map initialization for stereo and RGB-D
   void StereoInitialization();
 
+  // Keep current map as an inactive session and initialize a new one. Loop Closing merges
+  // them when it finds a place seen in both
+  void StartNewSession();
+
+  // Forget local map, initializer and motion, as if no frame was tracked
+  void ClearTrackingState();
+
   // Map initialization for monocular
   void MonocularInitialization();
   void CreateInitialMapMonocular();
 
+  // Match F against mInitialFrame and try to initialize with mpInitializer. Results are left in mInitAttempt
+  void TryInitialization(Frame &F);
+
+  // Use results of last attempt on F, creating the map from it if it succeeded
+  void FinishInitialization(Frame &F);
+
+  // Wait for the initialization attempt running in background, if any
+  void JoinInitialization();
+
   // Initialization with pattern
   void PatternInitialization();
 
@@ -126,18 +210,46 @@ class Tracking {
   void UpdateLastFrame();
   bool TrackWithMotionModel();
 
+  // Image alignment needed before matching with a motion prior
+  enum eAlignDecision {
+    ALIGN_SKIP = 0,     // Prior is good enough for projection search
+    ALIGN_COARSE = 1,   // Align only at the coarsest level
+    ALIGN_FULL = 2
+  };
+
+  // Decide from predicted pixel uncertainty of points in last frame and last alignment residual
+  eAlignDecision DecideAlignment(const Eigen::Matrix<double, 6, 6> &poseCov);
+
   bool Relocalization();
 
   void UpdateLocalMap();
   void UpdateLocalPoints();
   void UpdateLocalKeyFrames();
 
+  // Reduce or restore the work done per frame
+  void SetOverload(bool bOverload);
+
+  // Pose optimization iterations per round
+  inline int PoseIterations() const { return mbOverload ? 5 : 10; }
+  void UpdateFrustumPoints();
+
   bool TrackLocalMap();
   void SearchLocalPoints();
 
+  // Match local map points in secondary rig cameras. Returns number of matches
+  int SearchRigViews();
+
   bool NeedNewKeyFrame();
   void CreateNewKeyFrame();
 
+  // Reuse last pose for im if the camera is static (see Input.StaticThreshold), without
+  // extracting features. Returns false if the frame has to be tracked
+  bool TrackStatic(const cv::Mat &im);
+
+  // Create a MapPoint in pKF for each keypoint in vIndices from its measured depth. Descriptor,
+  // normal and depth are taken from the keypoint, LocalMapping recomputes them in batch
+  void CreateDepthMapPoints(KeyFrame* pKF, const std::vector<int> &vIndices);
+
   // Other Thread Pointers
   LocalMapping* mpLocalMapper;
   LoopClosing* mpLoopClosing;
@@ -149,13 +261,23 @@ class Tracking {
   // Input sensor
   int mSensor;
 
+  // Stereo and RGBD sensors measure depth, they are initialized and tracked the same way
+  bool HasDepth() const;
+
   // Current Frame
   Frame mCurrentFrame;
 
   // ORB
   ORBextractor* mpORBextractorLeft;
+  ORBextractor* mpORBextractorRight;
   ORBextractor* mpIniORBextractor;
 
+  // Shared thread pool (not owned)
+  ThreadPool* mpThreadPool;
+
+  // Multi-camera rig
+  CameraRig* mpRig;
+
   // Initalization (only for monocular)
   Initializer* mpInitializer;
   PatternDetector mpPatternDetector;
@@ -165,6 +287,17 @@ class Tracking {
   std::vector<KeyFrame*> mvpLocalKeyFrames;
   std::vector<MapPoint*> mvpLocalMapPoints;
 
+  // Local map is cached between frames. It is rebuilt when the reference keyframe or the
+  // map change, after relocalization, or when inliers drop below those of its first frame.
+  KeyFrame* mpLocalMapRefKF;
+  int mnLocalMapChangeIdx;
+  int mnLocalMapInliers;
+  size_t mnLocalKeyFramePoints;  // Points observed by local keyframes, frustum points come after
+
+  // Packed copy of the points observed by local keyframes, for the batch frustum test
+  PointTable mLocalPointTable;
+  std::vector<PointTable::Visible> mvVisiblePoints;
+
   // System
   System* mpSystem;
 
@@ -176,6 +309,12 @@ class Tracking {
   cv::Mat mDistCoef;
   float mbf;
 
+  // Camera state shared by the frames of this tracker
+  FrameCamera mCamera;
+
+  // Frames built from extracted features may come from other threads
+  std::mutex mMutexCamera;
+
   // New KeyFrame rules (according to fps)
   int mMinFrames;
   int mMaxFrames;
@@ -191,6 +330,16 @@ class Tracking {
   // Current matches in frame
   int mnMatchesInliers;
 
+  // Thumbnail of last tracked input image and number of static frames skipped since
+  cv::Mat mStaticThumb;
+  int mnStaticFrames;
+
+  // Smoothed frame time used by the feature budget (ms)
+  double mFrameTime;
+
+  // Frames are over budget, tracking does less work
+  bool mbOverload;
+
   // Last Frame, KeyFrame and Relocalisation Info
   KeyFrame* mpLastKeyFrame;
   Frame mLastFrame;
@@ -198,8 +347,13 @@ class Tracking {
   unsigned int mnLastRelocFrameId;
 
   // Sensor model
-  EKF* motion_model_;
+  MotionModel* motion_model_;
   std::vector<double> measurements_;
+  bool mbTimestampSet;    // Timestamp given for current frame
+  double mTimestamp;
+
+  // Mask given for next grabbed image, empty if none
+  cv::Mat mFrameMask;
 
   std::list<MapPoint*> mlpTemporalPoints;
   int threshold_;
@@ -208,19 +362,48 @@ class Tracking {
   std::vector<int> mvIniLastMatches;
   std::vector<int> mvIniMatches;
   std::vector<cv::Point2f> mvbPrevMatched;
+  std::vector<bool> mvbPrevTracked;   // Matched in last attempt, searched in a small window
   std::vector<cv::Point3f> mvIniP3D;
   Frame mInitialFrame;
 
+  // Initialization attempt. With online input it runs in mtInitializer while tracking keeps
+  // taking frames, mInitialFrame, mvbPrevMatched and mpInitializer are not changed meanwhile
+  struct InitializationAttempt {
+    Frame frame;
+    std::vector<int> vMatches;
+    std::vector<cv::Point3f> vP3D;
+    Eigen::Matrix3d Rcw;
+    Eigen::Vector3d tcw;
+    int nMatches;
+    bool bInitialized;
+  };
+  InitializationAttempt mInitAttempt;
+  std::thread mtInitializer;
+  std::atomic<bool> mbInitAttemptDone;
+
+  // Map was created from an earlier frame, current one has to be tracked
+  bool mbTrackAfterInitialization;
+
   // Save last relative pose
   Eigen::Matrix4d lastRelativePose_;
 
   // True if local mapping is deactivated and we are performing only localization
   bool mbOnlyTracking;
 
+  // True if the system was created without mapping threads, map is read-only
+  bool mbLocalizationOnly;
+
+  // Slot in map reclaimer, see Map::GetReclaimer
+  int mnReclaimerSlot;
+
   bool usePattern;
 
-  // Image align
+  // Image align. Aligners are reused, relocalization has one per candidate
   bool align_image_;
+  ImageAlign image_align_;
+  std::vector<ImageAlign, Eigen::aligned_allocator<ImageAlign> > reloc_aligns_;
+  double align_residual_;       // Residual of last alignment, negative if it was skipped
+  double align_residual_mean_;  // Running mean of alignment residuals, negative if none
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -0,0 +1,182 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// JNI bindings of es.urjc.sdslam.SDSlam (see android/java). Camera images are tracked in place:
+// the Y plane of a direct ByteBuffer or a locked AHardwareBuffer is wrapped in a cv::Mat header
+// and passed to the synchronous Track functions, which don't copy their input. Poses are written
+// into an array allocated by the caller, so nothing is allocated in Java per frame.
+
+#include <jni.h>
+#include <android/hardware_buffer.h>
+#include <android/hardware_buffer_jni.h>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Dense>
+#include "System.h"
+#include "Config.h"
+#include "extra/log.h"
+
+namespace {
+
+struct NativeSLAM {
+  NativeSLAM(SD_SLAM::System::eSensor s): system(s, true), sensor(s) {}
+
+  SD_SLAM::System system;
+  const SD_SLAM::System::eSensor sensor;
+};
+
+inline NativeSLAM* FromHandle(jlong handle) {
+  return reinterpret_cast<NativeSLAM*>(handle);
+}
+
+// Track a grayscale view and write Tcw (row-major) to pose. False if tracking failed
+bool Track(JNIEnv *env, NativeSLAM *slam, const cv::Mat &im, jdouble timestamp, jfloatArray pose) {
+  Eigen::Matrix4d Tcw;
+  if (slam->sensor == SD_SLAM::System::MONOCULAR_IMU)
+    Tcw = slam->system.TrackFusion(im, timestamp);
+  else
+    Tcw = slam->system.TrackMonocular(im);
+
+  if (pose) {
+    jfloat values[16];
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        values[4*r+c] = Tcw(r, c);
+    env->SetFloatArrayRegion(pose, 0, 16, values);
+  }
+
+  return !Tcw.isZero();
+}
+
+}  // namespace
+
+extern "C" {
+
+// Read settings and create the system. Sensor is Monocular (0) or Monocular-IMU (2). Returns 0 on error
+JNIEXPORT jlong JNICALL Java_es_urjc_sdslam_SDSlam_nativeCreate(JNIEnv *env, jclass, jstring settings, jint sensor) {
+  if (sensor != SD_SLAM::System::MONOCULAR && sensor != SD_SLAM::System::MONOCULAR_IMU) {
+    LOGE("Only Monocular and Monocular-IMU sensors are available from Java");
+    return 0;
+  }
+
+  const char *path = env->GetStringUTFChars(settings, nullptr);
+  const bool ok = SD_SLAM::Config::GetInstance().ReadParameters(path);
+  env->ReleaseStringUTFChars(settings, path);
+  if (!ok) {
+    LOGE("Can't read settings file");
+    return 0;
+  }
+
+  return reinterpret_cast<jlong>(new NativeSLAM(static_cast<SD_SLAM::System::eSensor>(sensor)));
+}
+
+JNIEXPORT void JNICALL Java_es_urjc_sdslam_SDSlam_nativeDestroy(JNIEnv *, jclass, jlong handle) {
+  NativeSLAM *slam = FromHandle(handle);
+  if (!slam)
+    return;
+  slam->system.Shutdown();
+  delete slam;
+}
+
+// Track the Y plane of a direct ByteBuffer (e.g. Image.Plane of a YUV_420_888 image). The buffer
+// is only read during the call
+JNIEXPORT jboolean JNICALL Java_es_urjc_sdslam_SDSlam_nativeTrackBuffer(JNIEnv *env, jclass, jlong handle,
+    jobject yPlane, jint width, jint height, jint rowStride, jdouble timestamp, jfloatArray pose) {
+  NativeSLAM *slam = FromHandle(handle);
+  uchar *data = static_cast<uchar*>(env->GetDirectBufferAddress(yPlane));
+  if (!slam || !data || rowStride < width ||
+      env->GetDirectBufferCapacity(yPlane) < static_cast<jlong>(rowStride)*(height-1)+width) {
+    LOGE("Invalid image buffer");
+    return JNI_FALSE;
+  }
+
+  const cv::Mat im(height, width, CV_8U, data, rowStride);
+  return Track(env, slam, im, timestamp, pose) ? JNI_TRUE : JNI_FALSE;
+}
+
+// Track the luminance of an android.hardware.HardwareBuffer. The buffer is locked for CPU reads
+// during the call. YUV buffers need API 29 to lock each plane, before that the Y plane must be
+// the first one with the stride of the buffer (e.g. Y8 or NV21 from the camera)
+JNIEXPORT jboolean JNICALL Java_es_urjc_sdslam_SDSlam_nativeTrackHardwareBuffer(JNIEnv *env, jclass, jlong handle,
+    jobject hardwareBuffer, jdouble timestamp, jfloatArray pose) {
+  NativeSLAM *slam = FromHandle(handle);
+  AHardwareBuffer *buffer = AHardwareBuffer_fromHardwareBuffer(env, hardwareBuffer);
+  if (!slam || !buffer) {
+    LOGE("Invalid hardware buffer");
+    return JNI_FALSE;
+  }
+
+  AHardwareBuffer_Desc desc;
+  AHardwareBuffer_describe(buffer, &desc);
+
+  void *data = nullptr;
+  size_t rowStride = desc.stride;
+#if __ANDROID_API__ >= 29
+  AHardwareBuffer_Planes planes;
+  if (AHardwareBuffer_lockPlanes(buffer, AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN, -1, nullptr, &planes) != 0) {
+    LOGE("Can't lock hardware buffer");
+    return JNI_FALSE;
+  }
+  if (planes.planes[0].pixelStride != 1) {
+    LOGE("Luminance plane of hardware buffer is not 8 bit");
+    AHardwareBuffer_unlock(buffer, nullptr);
+    return JNI_FALSE;
+  }
+  data = planes.planes[0].data;
+  rowStride = planes.planes[0].rowStride;
+#else
+  if (AHardwareBuffer_lock(buffer, AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN, -1, nullptr, &data) != 0) {
+    LOGE("Can't lock hardware buffer");
+    return JNI_FALSE;
+  }
+#endif
+
+  const cv::Mat im(desc.height, desc.width, CV_8U, data, rowStride);
+  const bool ok = Track(env, slam, im, timestamp, pose);
+
+  AHardwareBuffer_unlock(buffer, nullptr);
+  return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// IMU sample (rad/s and m/s^2 in camera frame) for Monocular-IMU, see System::AddIMUMeasurement
+JNIEXPORT void JNICALL Java_es_urjc_sdslam_SDSlam_nativeAddIMUMeasurement(JNIEnv *, jclass, jlong handle,
+    jdouble timestamp, jfloat gx, jfloat gy, jfloat gz, jfloat ax, jfloat ay, jfloat az) {
+  NativeSLAM *slam = FromHandle(handle);
+  if (slam)
+    slam->system.AddIMUMeasurement(timestamp, Eigen::Vector3d(gx, gy, gz), Eigen::Vector3d(ax, ay, az));
+}
+
+JNIEXPORT jint JNICALL Java_es_urjc_sdslam_SDSlam_nativeGetTrackingState(JNIEnv *, jclass, jlong handle) {
+  NativeSLAM *slam = FromHandle(handle);
+  return slam ? slam->system.GetTrackingState() : -1;
+}
+
+// Power state for the energy policy, see System::SetCharging and System::SetThermalThrottle
+JNIEXPORT void JNICALL Java_es_urjc_sdslam_SDSlam_nativeSetCharging(JNIEnv *, jclass, jlong handle, jboolean charging) {
+  NativeSLAM *slam = FromHandle(handle);
+  if (slam)
+    slam->system.SetCharging(charging == JNI_TRUE);
+}
+
+JNIEXPORT void JNICALL Java_es_urjc_sdslam_SDSlam_nativeSetThermalThrottle(JNIEnv *, jclass, jlong handle,
+    jdouble throttle) {
+  NativeSLAM *slam = FromHandle(handle);
+  if (slam)
+    slam->system.SetThermalThrottle(throttle);
+}
+
+}  // extern "C"
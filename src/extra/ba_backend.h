@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_BA_BACKEND_H_
+#define SD_SLAM_BA_BACKEND_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace SD_SLAM {
+
+// Bundle adjustment problem in flat arrays, the same one Optimizer::BundleAdjustment builds
+// with g2o: SE3 keyframe poses, 3D points and monocular or stereo reprojection observations
+// with information invSigma2 and, if bRobust, a Huber kernel (same thresholds as g2o).
+// Kept free of Eigen and OpenCV so device compilers only see plain types.
+struct BAProblem {
+  struct Observation {
+    int32_t nKF;
+    int32_t nPoint;
+    double u, v;
+    double ur;          // Right coordinate, negative if monocular
+    double invSigma2;
+  };
+
+  std::vector<double> vPoses;     // Tcw of each keyframe, 3x4 row major [R|t]
+  std::vector<double> vCalib;     // fx, fy, cx, cy, bf of each keyframe
+  std::vector<uint8_t> vFixed;    // Keyframes not optimized
+  std::vector<double> vPoints;    // x, y, z of each point
+  std::vector<Observation> vObservations;
+  bool bRobust;
+
+  inline size_t KeyFrames() const { return vFixed.size(); }
+  inline size_t Points() const { return vPoints.size()/3; }
+};
+
+// Solver of a BAProblem on an accelerator. Poses are updated as g2o does (left multiplied
+// exponential map), so results match the CPU path up to the linear solver tolerance.
+class BAbackend {
+ public:
+  virtual ~BAbackend() {}
+
+  // Run up to nIterations Levenberg-Marquardt iterations, stopping early if *pbStopFlag is set.
+  // Poses and points of problem are replaced by the result. Returns the iterations run, or -1
+  // if the problem was not solved (e.g. it doesn't fit in device memory) and is left unchanged
+  virtual int Solve(BAProblem &problem, int nIterations, bool *pbStopFlag) = 0;
+};
+
+#ifdef USE_CUDA
+// Backend on the first CUDA device, null if there is none
+BAbackend* CreateCudaBAbackend();
+#endif
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_BA_BACKEND_H_
@@ -0,0 +1,781 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Bundle adjustment on a CUDA device. Each Levenberg-Marquardt iteration linearizes every
+// observation in parallel, accumulating the camera (6x6) and point (3x3) diagonal blocks and
+// keeping the camera-point block of each observation. Points are eliminated with the Schur
+// complement, whose camera system is solved with block Jacobi preconditioned conjugate
+// gradient without ever being built: products with it go through the observation blocks.
+// Host and device only exchange the problem, the result and a few scalars per iteration.
+
+#include "ba_backend.h"
+#include <string.h>
+#include <cmath>
+#include <vector>
+#include <mutex>
+#include <cuda_runtime.h>
+#include "log.h"
+
+namespace SD_SLAM {
+
+namespace {
+
+typedef BAProblem::Observation Observation;
+
+const int THREADS = 256;
+
+// Conjugate gradient stops after this many iterations or once the preconditioned residual
+// drops below this fraction of the initial one
+const int PCG_ITERATIONS = 100;
+const double PCG_TOLERANCE = 1e-12;
+
+// Same Levenberg-Marquardt constants as g2o
+const double LM_TAU = 1e-5;
+const int LM_TRIES = 10;
+
+inline int Blocks(int n) {
+  return (n+THREADS-1)/THREADS;
+}
+
+__device__ inline void AtomicAdd(double *address, double val) {
+#if __CUDA_ARCH__ >= 600
+  atomicAdd(address, val);
+#else
+  unsigned long long *p = reinterpret_cast<unsigned long long*>(address);
+  unsigned long long old = *p, assumed;
+  do {
+    assumed = old;
+    old = atomicCAS(p, assumed, __double_as_longlong(val + __longlong_as_double(assumed)));
+  } while (assumed != old);
+#endif
+}
+
+// Residual (prediction minus measurement) of an observation and the point in camera coordinates.
+// Returns the number of rows (2 monocular, 3 stereo), 0 if the point is on the camera plane
+__device__ inline int Residual(const Observation &o, const double *T, const double *K, const double *X,
+                               double Xc[3], double r[3]) {
+  for (int k = 0; k < 3; k++)
+    Xc[k] = T[4*k]*X[0] + T[4*k+1]*X[1] + T[4*k+2]*X[2] + T[4*k+3];
+  if (fabs(Xc[2]) < 1e-9)
+    return 0;
+
+  const double iz = 1.0/Xc[2];
+  const double u = K[0]*Xc[0]*iz + K[2];
+  r[0] = u - o.u;
+  r[1] = K[1]*Xc[1]*iz + K[3] - o.v;
+  if (o.ur < 0) {
+    r[2] = 0;
+    return 2;
+  }
+  r[2] = u - K[4]*iz - o.ur;
+  return 3;
+}
+
+// Huber cost of chi2 and the weight of its Hessian and gradient (first order, as g2o)
+__device__ inline double RobustCost(double chi2, int rows, bool robust, double &weight) {
+  weight = 1;
+  const double delta2 = rows == 3 ? 7.815 : 5.99;
+  if (!robust || chi2 <= delta2)
+    return chi2;
+  const double e = sqrt(chi2);
+  weight = sqrt(delta2)/e;
+  return 2*sqrt(delta2)*e - delta2;
+}
+
+__device__ inline void BlockReduce(double value, double *result) {
+  __shared__ double partial[THREADS];
+  const int t = threadIdx.x;
+  partial[t] = value;
+  __syncthreads();
+  for (int s = THREADS/2; s > 0; s >>= 1) {
+    if (t < s)
+      partial[t] += partial[t+s];
+    __syncthreads();
+  }
+  if (t == 0)
+    AtomicAdd(result, partial[0]);
+}
+
+// Inverse of a symmetric positive definite 6x6 matrix through its Cholesky factor.
+// Returns false if it is not positive definite
+__device__ inline bool InvertSPD6(const double *A, double *Ainv) {
+  double L[6][6];
+  for (int i = 0; i < 6; i++) {
+    for (int j = 0; j <= i; j++) {
+      double s = A[6*i+j];
+      for (int k = 0; k < j; k++)
+        s -= L[i][k]*L[j][k];
+      if (i == j) {
+        if (s <= 0)
+          return false;
+        L[i][i] = sqrt(s);
+      } else {
+        L[i][j] = s/L[j][j];
+      }
+    }
+  }
+
+  // Solve L L^T x = e_c for each column
+  for (int c = 0; c < 6; c++) {
+    double y[6];
+    for (int i = 0; i < 6; i++) {
+      double s = i == c ? 1 : 0;
+      for (int k = 0; k < i; k++)
+        s -= L[i][k]*y[k];
+      y[i] = s/L[i][i];
+    }
+    for (int i = 5; i >= 0; i--) {
+      double s = y[i];
+      for (int k = i+1; k < 6; k++)
+        s -= L[k][i]*y[k];
+      y[i] = s/L[i][i];
+    }
+    for (int i = 0; i < 6; i++)
+      Ainv[6*i+c] = y[i];
+  }
+  return true;
+}
+
+__global__ void CostKernel(int n, const Observation *obs, const double *poses, const double *calib,
+                           const double *points, bool robust, double *cost) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  double c = 0;
+  if (i < n) {
+    const Observation o = obs[i];
+    double Xc[3], r[3], w;
+    const int rows = Residual(o, poses+12*o.nKF, calib+5*o.nKF, points+3*o.nPoint, Xc, r);
+    if (rows > 0)
+      c = RobustCost(o.invSigma2*(r[0]*r[0]+r[1]*r[1]+r[2]*r[2]), rows, robust, w);
+  }
+  BlockReduce(c, cost);
+}
+
+// Jacobians of an observation, accumulated into the diagonal blocks and gradients of its
+// camera and point. Its camera-point block Hcp is kept (zero if the camera is fixed)
+__global__ void LinearizeKernel(int n, const Observation *obs, const double *poses, const double *calib,
+                                const uint8_t *fixed, const double *points, bool robust,
+                                double *Hcc, double *bc, double *Hpp, double *bp, float *Hcp) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const Observation o = obs[i];
+  const double *T = poses+12*o.nKF;
+  const double *K = calib+5*o.nKF;
+  float *H = Hcp+18*i;
+
+  double Xc[3], r[3];
+  const int rows = Residual(o, T, K, points+3*o.nPoint, Xc, r);
+  if (rows == 0) {
+    for (int k = 0; k < 18; k++)
+      H[k] = 0;
+    return;
+  }
+
+  double weight;
+  RobustCost(o.invSigma2*(r[0]*r[0]+r[1]*r[1]+r[2]*r[2]), rows, robust, weight);
+  const double w = weight*o.invSigma2;
+
+  // Derivative of the projection w.r.t. the point in camera coordinates
+  const double iz = 1.0/Xc[2], iz2 = iz*iz;
+  const double P[3][3] = {{K[0]*iz, 0, -K[0]*Xc[0]*iz2},
+                          {0, K[1]*iz, -K[1]*Xc[1]*iz2},
+                          {K[0]*iz, 0, -(K[0]*Xc[0]-K[4])*iz2}};
+
+  // Point: P R. Pose (rotation first, left update): P [-[Xc]x | I]
+  double Jp[3][3], Jc[3][6];
+  for (int k = 0; k < rows; k++) {
+    for (int j = 0; j < 3; j++)
+      Jp[k][j] = P[k][0]*T[j] + P[k][1]*T[4+j] + P[k][2]*T[8+j];
+    Jc[k][0] = -P[k][1]*Xc[2] + P[k][2]*Xc[1];
+    Jc[k][1] = P[k][0]*Xc[2] - P[k][2]*Xc[0];
+    Jc[k][2] = -P[k][0]*Xc[1] + P[k][1]*Xc[0];
+    Jc[k][3] = P[k][0];
+    Jc[k][4] = P[k][1];
+    Jc[k][5] = P[k][2];
+  }
+
+  double *Hp = Hpp+9*o.nPoint;
+  double *gp = bp+3*o.nPoint;
+  for (int a = 0; a < 3; a++) {
+    double g = 0;
+    for (int k = 0; k < rows; k++)
+      g += Jp[k][a]*r[k];
+    AtomicAdd(gp+a, w*g);
+    for (int b = 0; b < 3; b++) {
+      double h = 0;
+      for (int k = 0; k < rows; k++)
+        h += Jp[k][a]*Jp[k][b];
+      AtomicAdd(Hp+3*a+b, w*h);
+    }
+  }
+
+  if (fixed[o.nKF]) {
+    for (int k = 0; k < 18; k++)
+      H[k] = 0;
+    return;
+  }
+
+  double *Hc = Hcc+36*o.nKF;
+  double *gc = bc+6*o.nKF;
+  for (int a = 0; a < 6; a++) {
+    double g = 0;
+    for (int k = 0; k < rows; k++)
+      g += Jc[k][a]*r[k];
+    AtomicAdd(gc+a, w*g);
+    for (int b = 0; b < 6; b++) {
+      double h = 0;
+      for (int k = 0; k < rows; k++)
+        h += Jc[k][a]*Jc[k][b];
+      AtomicAdd(Hc+6*a+b, w*h);
+    }
+    for (int b = 0; b < 3; b++) {
+      double h = 0;
+      for (int k = 0; k < rows; k++)
+        h += Jc[k][a]*Jp[k][b];
+      H[3*a+b] = w*h;
+    }
+  }
+}
+
+// Largest diagonal entry of the Hessian, from the bit pattern of non negative doubles
+__global__ void MaxDiagonalKernel(int n, const double *blocks, int size, unsigned long long *result) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+  double m = 0;
+  for (int k = 0; k < size; k++)
+    m = fmax(m, blocks[size*size*i + size*k + k]);
+  atomicMax(result, static_cast<unsigned long long>(__double_as_longlong(m)));
+}
+
+// Damped point blocks are inverted, singular ones (points without parallax) are not moved
+__global__ void InvertPointsKernel(int n, const double *Hpp, double lambda, double *HppInv) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  double A[9];
+  for (int k = 0; k < 9; k++)
+    A[k] = Hpp[9*i+k];
+  A[0] += lambda;
+  A[4] += lambda;
+  A[8] += lambda;
+
+  double C[9];
+  C[0] = A[4]*A[8] - A[5]*A[7];
+  C[1] = A[2]*A[7] - A[1]*A[8];
+  C[2] = A[1]*A[5] - A[2]*A[4];
+  C[3] = A[5]*A[6] - A[3]*A[8];
+  C[4] = A[0]*A[8] - A[2]*A[6];
+  C[5] = A[2]*A[3] - A[0]*A[5];
+  C[6] = A[3]*A[7] - A[4]*A[6];
+  C[7] = A[1]*A[6] - A[0]*A[7];
+  C[8] = A[0]*A[4] - A[1]*A[3];
+  const double det = A[0]*C[0] + A[1]*C[3] + A[2]*C[6];
+
+  double *Ainv = HppInv+9*i;
+  const double invDet = fabs(det) > 1e-20 ? 1.0/det : 0;
+  for (int k = 0; k < 9; k++)
+    Ainv[k] = C[k]*invDet;
+}
+
+// Contribution of an observation to the diagonal block and right hand side of the reduced
+// camera system: Hcp Hpp^-1 Hcp^T and Hcp Hpp^-1 bp
+__global__ void SchurKernel(int n, const Observation *obs, const float *Hcp, const double *HppInv,
+                            const double *bp, double *S, double *rhs) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const Observation o = obs[i];
+  const float *H = Hcp+18*i;
+  if (H[0] == 0 && H[1] == 0 && H[2] == 0 && H[3] == 0 && H[4] == 0 && H[5] == 0)
+    return;
+
+  const double *Pinv = HppInv+9*o.nPoint;
+  const double *g = bp+3*o.nPoint;
+  double A[6][3];
+  for (int a = 0; a < 6; a++)
+    for (int b = 0; b < 3; b++)
+      A[a][b] = H[3*a]*Pinv[b] + H[3*a+1]*Pinv[3+b] + H[3*a+2]*Pinv[6+b];
+
+  double *Sc = S+36*o.nKF;
+  double *rc = rhs+6*o.nKF;
+  for (int a = 0; a < 6; a++) {
+    AtomicAdd(rc+a, A[a][0]*g[0] + A[a][1]*g[1] + A[a][2]*g[2]);
+    for (int b = 0; b < 6; b++)
+      AtomicAdd(Sc+6*a+b, A[a][0]*H[3*b] + A[a][1]*H[3*b+1] + A[a][2]*H[3*b+2]);
+  }
+}
+
+// Block Jacobi preconditioner (inverse of the diagonal blocks of the reduced system, which
+// replace the accumulated S) and right hand side -(bc - sum Hcp Hpp^-1 bp)
+__global__ void PrepareCamerasKernel(int n, const uint8_t *fixed, const double *Hcc, const double *bc,
+                                     double lambda, double *S, double *rhs) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  double *M = S+36*i;
+  double *r = rhs+6*i;
+  if (fixed[i]) {
+    for (int k = 0; k < 36; k++)
+      M[k] = 0;
+    for (int k = 0; k < 6; k++)
+      r[k] = 0;
+    return;
+  }
+
+  double A[36];
+  for (int k = 0; k < 36; k++)
+    A[k] = Hcc[36*i+k] - M[k];
+  for (int k = 0; k < 6; k++) {
+    A[7*k] += lambda;
+    r[k] -= bc[6*i+k];
+  }
+
+  if (!InvertSPD6(A, M)) {
+    // Fall back to the inverse of the damped diagonal
+    for (int k = 0; k < 36; k++)
+      M[k] = 0;
+    for (int k = 0; k < 6; k++)
+      M[7*k] = 1.0/(Hcc[36*i+7*k] + lambda);
+  }
+}
+
+// tmp[point] += Hcp^T x[camera]
+__global__ void TransposeProductKernel(int n, const Observation *obs, const float *Hcp, const double *x,
+                                       double *tmp) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const Observation o = obs[i];
+  const float *H = Hcp+18*i;
+  const double *xc = x+6*o.nKF;
+  double *t = tmp+3*o.nPoint;
+  for (int b = 0; b < 3; b++) {
+    double s = 0;
+    for (int a = 0; a < 6; a++)
+      s += H[3*a+b]*xc[a];
+    if (s != 0)
+      AtomicAdd(t+b, s);
+  }
+}
+
+// y[camera] -= Hcp tmp[point]
+__global__ void ProductKernel(int n, const Observation *obs, const float *Hcp, const double *tmp, double *y) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const Observation o = obs[i];
+  const float *H = Hcp+18*i;
+  const double *t = tmp+3*o.nPoint;
+  double *yc = y+6*o.nKF;
+  for (int a = 0; a < 6; a++) {
+    const double s = H[3*a]*t[0] + H[3*a+1]*t[1] + H[3*a+2]*t[2];
+    if (s != 0)
+      AtomicAdd(yc+a, -s);
+  }
+}
+
+// y = M x for 3x3 blocks, in place allowed
+__global__ void PointBlocksKernel(int n, const double *M, const double *x, double *y) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const double *A = M+9*i;
+  const double v[3] = {x[3*i], x[3*i+1], x[3*i+2]};
+  for (int a = 0; a < 3; a++)
+    y[3*i+a] = A[3*a]*v[0] + A[3*a+1]*v[1] + A[3*a+2]*v[2];
+}
+
+// y = (M + lambda I) x for 6x6 blocks of non fixed cameras
+__global__ void CameraBlocksKernel(int n, const uint8_t *fixed, const double *M, double lambda,
+                                   const double *x, double *y) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const double *A = M+36*i;
+  const double *xc = x+6*i;
+  for (int a = 0; a < 6; a++) {
+    double s = lambda*xc[a];
+    for (int b = 0; b < 6; b++)
+      s += A[6*a+b]*xc[b];
+    y[6*i+a] = fixed[i] ? 0 : s;
+  }
+}
+
+// Point update from the camera update: dp = -Hpp^-1 (bp + Hcp^T dc), with Hcp^T dc in tmp
+__global__ void BackSubstituteKernel(int n, const double *HppInv, const double *bp, const double *tmp,
+                                     double *dp) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const double *A = HppInv+9*i;
+  const double v[3] = {bp[3*i]+tmp[3*i], bp[3*i+1]+tmp[3*i+1], bp[3*i+2]+tmp[3*i+2]};
+  for (int a = 0; a < 3; a++)
+    dp[3*i+a] = -(A[3*a]*v[0] + A[3*a+1]*v[1] + A[3*a+2]*v[2]);
+}
+
+// Tcw' = exp(dc) Tcw, as g2o VertexSE3Expmap
+__global__ void UpdatePosesKernel(int n, const double *poses, const double *dc, double *newPoses) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i >= n)
+    return;
+
+  const double *w = dc+6*i;
+  const double *u = dc+6*i+3;
+  const double theta2 = w[0]*w[0] + w[1]*w[1] + w[2]*w[2];
+  const double theta = sqrt(theta2);
+  double a, b, c;
+  if (theta < 1e-5) {
+    a = 1;
+    b = 0.5;
+    c = 1.0/6;
+  } else {
+    a = sin(theta)/theta;
+    b = (1-cos(theta))/theta2;
+    c = (theta-sin(theta))/(theta2*theta);
+  }
+
+  const double W[9] = {0, -w[2], w[1], w[2], 0, -w[0], -w[1], w[0], 0};
+  double W2[9];
+  for (int r = 0; r < 3; r++)
+    for (int s = 0; s < 3; s++)
+      W2[3*r+s] = W[3*r]*W[s] + W[3*r+1]*W[3+s] + W[3*r+2]*W[6+s];
+
+  double R[9], V[9];
+  for (int k = 0; k < 9; k++) {
+    const double I = (k % 4 == 0) ? 1 : 0;
+    R[k] = I + a*W[k] + b*W2[k];
+    V[k] = I + b*W[k] + c*W2[k];
+  }
+  const double t[3] = {V[0]*u[0]+V[1]*u[1]+V[2]*u[2], V[3]*u[0]+V[4]*u[1]+V[5]*u[2],
+                       V[6]*u[0]+V[7]*u[1]+V[8]*u[2]};
+
+  const double *T = poses+12*i;
+  double *Tn = newPoses+12*i;
+  for (int r = 0; r < 3; r++) {
+    for (int s = 0; s < 4; s++)
+      Tn[4*r+s] = R[3*r]*T[s] + R[3*r+1]*T[4+s] + R[3*r+2]*T[8+s];
+    Tn[4*r+3] += t[r];
+  }
+}
+
+__global__ void DotKernel(int n, const double *x, const double *y, double *result) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  BlockReduce(i < n ? x[i]*y[i] : 0, result);
+}
+
+// y = a x + b y
+__global__ void AxpbyKernel(int n, double a, const double *x, double b, double *y) {
+  const int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if (i < n)
+    y[i] = a*x[i] + b*y[i];
+}
+
+template <typename T>
+class DeviceArray {
+ public:
+  DeviceArray(): data_(nullptr), size_(0), capacity_(0) {}
+  ~DeviceArray() { Free(); }
+
+  DeviceArray(const DeviceArray&) = delete;
+  DeviceArray& operator=(const DeviceArray&) = delete;
+
+  // Memory is kept between problems, it only grows
+  bool Resize(size_t n) {
+    if (n > capacity_) {
+      Free();
+      if (cudaMalloc(reinterpret_cast<void**>(&data_), n*sizeof(T)) != cudaSuccess) {
+        data_ = nullptr;
+        return false;
+      }
+      capacity_ = n;
+    }
+    size_ = n;
+    return true;
+  }
+
+  bool Upload(const T *src, size_t n) {
+    return Resize(n) && cudaMemcpy(data_, src, n*sizeof(T), cudaMemcpyHostToDevice) == cudaSuccess;
+  }
+
+  bool Download(T *dst) const {
+    return cudaMemcpy(dst, data_, size_*sizeof(T), cudaMemcpyDeviceToHost) == cudaSuccess;
+  }
+
+  void Zero() { cudaMemset(data_, 0, size_*sizeof(T)); }
+
+  inline T* get() const { return data_; }
+  inline size_t size() const { return size_; }
+
+ private:
+  void Free() {
+    if (data_)
+      cudaFree(data_);
+    data_ = nullptr;
+    size_ = capacity_ = 0;
+  }
+
+  T *data_;
+  size_t size_;
+  size_t capacity_;
+};
+
+class CudaBAbackend : public BAbackend {
+ public:
+  CudaBAbackend(): nKFs_(0), nPoints_(0), nObs_(0), robust_(false) {}
+
+  int Solve(BAProblem &problem, int nIterations, bool *pbStopFlag) override;
+
+ private:
+  bool Allocate(const BAProblem &problem);
+
+  double Cost(const double *poses, const double *points);
+  void Linearize();
+  double MaxDiagonal();
+
+  // Damped step of cameras into dc_ and points into dp_. Returns its predicted cost reduction
+  double ComputeStep(double lambda);
+
+  // y = S x, with S the reduced camera system
+  void ApplySchur(const double *x, double *y, double lambda);
+
+  double Dot(const double *x, const double *y, int n);
+
+  int nKFs_, nPoints_, nObs_;
+  bool robust_;
+
+  DeviceArray<Observation> obs_;
+  DeviceArray<double> poses_, newPoses_, calib_, points_, newPoints_;
+  DeviceArray<uint8_t> fixed_;
+
+  // Linear system: camera and point blocks, gradients and camera-point block per observation
+  DeviceArray<double> Hcc_, bc_, Hpp_, bp_, HppInv_;
+  DeviceArray<float> Hcp_;
+
+  // Reduced system: preconditioner, right hand side and conjugate gradient vectors
+  DeviceArray<double> S_, rhs_, dc_, r_, z_, p_, Ap_;
+  DeviceArray<double> tmp_, dp_;
+
+  DeviceArray<double> scalar_;
+  DeviceArray<unsigned long long> maxDiag_;
+
+  // Device memory is reused between calls, which are serialized
+  std::mutex mutex_;
+};
+
+bool CudaBAbackend::Allocate(const BAProblem &problem) {
+  nKFs_ = problem.KeyFrames();
+  nPoints_ = problem.Points();
+  nObs_ = problem.vObservations.size();
+  robust_ = problem.bRobust;
+
+  const size_t N = nKFs_, M = nPoints_, E = nObs_;
+  return obs_.Upload(problem.vObservations.data(), E) &&
+         poses_.Upload(problem.vPoses.data(), 12*N) && newPoses_.Resize(12*N) &&
+         calib_.Upload(problem.vCalib.data(), 5*N) && fixed_.Upload(problem.vFixed.data(), N) &&
+         points_.Upload(problem.vPoints.data(), 3*M) && newPoints_.Resize(3*M) &&
+         Hcc_.Resize(36*N) && bc_.Resize(6*N) && Hpp_.Resize(9*M) && bp_.Resize(3*M) &&
+         HppInv_.Resize(9*M) && Hcp_.Resize(18*E) &&
+         S_.Resize(36*N) && rhs_.Resize(6*N) && dc_.Resize(6*N) && r_.Resize(6*N) && z_.Resize(6*N) &&
+         p_.Resize(6*N) && Ap_.Resize(6*N) && tmp_.Resize(3*M) && dp_.Resize(3*M) &&
+         scalar_.Resize(1) && maxDiag_.Resize(1);
+}
+
+double CudaBAbackend::Cost(const double *poses, const double *points) {
+  double cost = 0;
+  scalar_.Zero();
+  CostKernel<<<Blocks(nObs_), THREADS>>>(nObs_, obs_.get(), poses, calib_.get(), points, robust_, scalar_.get());
+  scalar_.Download(&cost);
+  return cost;
+}
+
+void CudaBAbackend::Linearize() {
+  Hcc_.Zero();
+  bc_.Zero();
+  Hpp_.Zero();
+  bp_.Zero();
+  LinearizeKernel<<<Blocks(nObs_), THREADS>>>(nObs_, obs_.get(), poses_.get(), calib_.get(), fixed_.get(),
+                                              points_.get(), robust_, Hcc_.get(), bc_.get(), Hpp_.get(),
+                                              bp_.get(), Hcp_.get());
+}
+
+double CudaBAbackend::MaxDiagonal() {
+  unsigned long long bits = 0;
+  maxDiag_.Zero();
+  MaxDiagonalKernel<<<Blocks(nKFs_), THREADS>>>(nKFs_, Hcc_.get(), 6, maxDiag_.get());
+  MaxDiagonalKernel<<<Blocks(nPoints_), THREADS>>>(nPoints_, Hpp_.get(), 3, maxDiag_.get());
+  maxDiag_.Download(&bits);
+
+  double m;
+  memcpy(&m, &bits, sizeof(m));
+  return m;
+}
+
+double CudaBAbackend::Dot(const double *x, const double *y, int n) {
+  double result = 0;
+  scalar_.Zero();
+  DotKernel<<<Blocks(n), THREADS>>>(n, x, y, scalar_.get());
+  scalar_.Download(&result);
+  return result;
+}
+
+void CudaBAbackend::ApplySchur(const double *x, double *y, double lambda) {
+  tmp_.Zero();
+  TransposeProductKernel<<<Blocks(nObs_), THREADS>>>(nObs_, obs_.get(), Hcp_.get(), x, tmp_.get());
+  PointBlocksKernel<<<Blocks(nPoints_), THREADS>>>(nPoints_, HppInv_.get(), tmp_.get(), tmp_.get());
+  CameraBlocksKernel<<<Blocks(nKFs_), THREADS>>>(nKFs_, fixed_.get(), Hcc_.get(), lambda, x, y);
+  ProductKernel<<<Blocks(nObs_), THREADS>>>(nObs_, obs_.get(), Hcp_.get(), tmp_.get(), y);
+}
+
+double CudaBAbackend::ComputeStep(double lambda) {
+  const int n = 6*nKFs_;
+
+  // Reduced camera system
+  InvertPointsKernel<<<Blocks(nPoints_), THREADS>>>(nPoints_, Hpp_.get(), lambda, HppInv_.get());
+  S_.Zero();
+  rhs_.Zero();
+  SchurKernel<<<Blocks(nObs_), THREADS>>>(nObs_, obs_.get(), Hcp_.get(), HppInv_.get(), bp_.get(),
+                                          S_.get(), rhs_.get());
+  PrepareCamerasKernel<<<Blocks(nKFs_), THREADS>>>(nKFs_, fixed_.get(), Hcc_.get(), bc_.get(), lambda,
+                                                   S_.get(), rhs_.get());
+
+  // Preconditioned conjugate gradient from a zero step
+  dc_.Zero();
+  cudaMemcpy(r_.get(), rhs_.get(), n*sizeof(double), cudaMemcpyDeviceToDevice);
+  CameraBlocksKernel<<<Blocks(nKFs_), THREADS>>>(nKFs_, fixed_.get(), S_.get(), 0, r_.get(), z_.get());
+  cudaMemcpy(p_.get(), z_.get(), n*sizeof(double), cudaMemcpyDeviceToDevice);
+
+  double rz = Dot(r_.get(), z_.get(), n);
+  const double rz0 = rz;
+  for (int i = 0; i < PCG_ITERATIONS && rz > PCG_TOLERANCE*rz0; i++) {
+    ApplySchur(p_.get(), Ap_.get(), lambda);
+    const double pAp = Dot(p_.get(), Ap_.get(), n);
+    if (pAp <= 0)
+      break;
+
+    const double alpha = rz/pAp;
+    AxpbyKernel<<<Blocks(n), THREADS>>>(n, alpha, p_.get(), 1, dc_.get());
+    AxpbyKernel<<<Blocks(n), THREADS>>>(n, -alpha, Ap_.get(), 1, r_.get());
+    CameraBlocksKernel<<<Blocks(nKFs_), THREADS>>>(nKFs_, fixed_.get(), S_.get(), 0, r_.get(), z_.get());
+
+    const double rzNew = Dot(r_.get(), z_.get(), n);
+    AxpbyKernel<<<Blocks(n), THREADS>>>(n, 1, z_.get(), rzNew/rz, p_.get());
+    rz = rzNew;
+  }
+
+  // Points from cameras
+  tmp_.Zero();
+  TransposeProductKernel<<<Blocks(nObs_), THREADS>>>(nObs_, obs_.get(), Hcp_.get(), dc_.get(), tmp_.get());
+  BackSubstituteKernel<<<Blocks(nPoints_), THREADS>>>(nPoints_, HppInv_.get(), bp_.get(), tmp_.get(), dp_.get());
+
+  // Reduction predicted by the linear model, dx^T (lambda dx - b)
+  const double dx2 = Dot(dc_.get(), dc_.get(), n) + Dot(dp_.get(), dp_.get(), 3*nPoints_);
+  const double dxb = Dot(dc_.get(), bc_.get(), n) + Dot(dp_.get(), bp_.get(), 3*nPoints_);
+  return lambda*dx2 - dxb;
+}
+
+int CudaBAbackend::Solve(BAProblem &problem, int nIterations, bool *pbStopFlag) {
+  if (problem.vObservations.empty() || problem.KeyFrames() == 0 || problem.Points() == 0)
+    return -1;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (!Allocate(problem)) {
+    LOGE("Not enough device memory for BA of %d keyframes and %d observations", nKFs_, nObs_);
+    cudaGetLastError();
+    return -1;
+  }
+
+  double cost = Cost(poses_.get(), points_.get());
+  double lambda = 0, nu = 2;
+  int it = 0;
+  for (; it < nIterations; it++) {
+    if (pbStopFlag && *pbStopFlag)
+      break;
+
+    Linearize();
+    if (it == 0)
+      lambda = LM_TAU*MaxDiagonal();
+
+    bool accepted = false;
+    for (int tries = 0; tries < LM_TRIES && !accepted; tries++) {
+      const double predicted = ComputeStep(lambda) + 1e-3;
+
+      UpdatePosesKernel<<<Blocks(nKFs_), THREADS>>>(nKFs_, poses_.get(), dc_.get(), newPoses_.get());
+      cudaMemcpy(newPoints_.get(), points_.get(), 3*nPoints_*sizeof(double), cudaMemcpyDeviceToDevice);
+      AxpbyKernel<<<Blocks(3*nPoints_), THREADS>>>(3*nPoints_, 1, dp_.get(), 1, newPoints_.get());
+
+      const double newCost = Cost(newPoses_.get(), newPoints_.get());
+      const double rho = (cost - newCost)/predicted;
+      if (rho > 0 && std::isfinite(newCost)) {
+        const double alpha = fmin(1 - pow(2*rho-1, 3), 2.0/3);
+        lambda *= fmax(1.0/3, alpha);
+        nu = 2;
+        cost = newCost;
+        cudaMemcpy(poses_.get(), newPoses_.get(), 12*nKFs_*sizeof(double), cudaMemcpyDeviceToDevice);
+        cudaMemcpy(points_.get(), newPoints_.get(), 3*nPoints_*sizeof(double), cudaMemcpyDeviceToDevice);
+        accepted = true;
+      } else {
+        lambda *= nu;
+        nu *= 2;
+      }
+    }
+
+    // No step reduces the cost, converged
+    if (!accepted)
+      break;
+  }
+
+  cudaError_t error = cudaDeviceSynchronize();
+  if (error == cudaSuccess)
+    error = cudaGetLastError();
+  if (error != cudaSuccess) {
+    LOGE("CUDA BA failed: %s", cudaGetErrorString(error));
+    return -1;
+  }
+
+  std::vector<double> vPoses(poses_.size()), vPoints(points_.size());
+  if (!poses_.Download(vPoses.data()) || !points_.Download(vPoints.data()))
+    return -1;
+
+  problem.vPoses.swap(vPoses);
+  problem.vPoints.swap(vPoints);
+  return it;
+}
+
+}  // namespace
+
+BAbackend* CreateCudaBAbackend() {
+  int nDevices = 0;
+  if (cudaGetDeviceCount(&nDevices) != cudaSuccess || nDevices == 0) {
+    cudaGetLastError();
+    return nullptr;
+  }
+  return new CudaBAbackend();
+}
+
+}  // namespace SD_SLAM
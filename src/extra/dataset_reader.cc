@@ -0,0 +1,209 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dataset_reader.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <opencv2/highgui/highgui.hpp>
+
+using std::string;
+using std::vector;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+DatasetReader::DatasetReader(const string &path, const vector<string> &filenames,
+                             const vector<string> &depthFilenames, int capacity, int nthreads) :
+  path_(path), filenames_(filenames), depth_filenames_(depthFilenames), next_(0), consumed_(0), finish_(false) {
+  slots_.resize(std::max(capacity, 1));
+  for (Slot &slot : slots_)
+    slot.index = -1;
+
+  for (int i = 0; i < std::max(nthreads, 1); i++)
+    threads_.push_back(std::thread(&DatasetReader::Run, this));
+}
+
+DatasetReader::~DatasetReader() {
+  {
+    unique_lock<mutex> lock(mutex_);
+    finish_ = true;
+  }
+  cond_free_.notify_all();
+
+  for (std::thread &t : threads_)
+    t.join();
+}
+
+bool DatasetReader::Next(Item &item) {
+  unique_lock<mutex> lock(mutex_);
+  if (consumed_ >= Size())
+    return false;
+
+  Slot &slot = slots_[consumed_ % slots_.size()];
+  cond_decoded_.wait(lock, [&] { return slot.index == consumed_; });
+
+  item = std::move(slot.item);
+  slot.index = -1;
+  consumed_++;
+
+  lock.unlock();
+  cond_free_.notify_all();
+
+  return true;
+}
+
+void DatasetReader::Run() {
+  const int n = Size();
+  const int capacity = slots_.size();
+
+  while (true) {
+    int idx;
+    {
+      unique_lock<mutex> lock(mutex_);
+      cond_free_.wait(lock, [&] { return finish_ || next_ >= n || next_ < consumed_+capacity; });
+      if (finish_ || next_ >= n)
+        return;
+      idx = next_++;
+    }
+
+    // Decode without holding the lock
+    Item item;
+    item.index = idx;
+    item.filename = filenames_[idx];
+    item.image = cv::imread(path_+"/"+filenames_[idx], cv::IMREAD_GRAYSCALE);
+    if (!depth_filenames_.empty())
+      item.depth = cv::imread(path_+"/"+depth_filenames_[idx], cv::IMREAD_UNCHANGED);
+
+    {
+      unique_lock<mutex> lock(mutex_);
+      Slot &slot = slots_[idx % capacity];
+      slot.item = std::move(item);
+      slot.index = idx;
+    }
+    cond_decoded_.notify_all();
+  }
+}
+
+bool DatasetReader::LoadImages(const string &strFile, vector<string> &vFilenames) {
+  std::ifstream f;
+  f.open(strFile.c_str());
+  if (!f.is_open())
+    return false;
+
+  while (!f.eof()) {
+    string s;
+    getline(f, s);
+    if (!s.empty()) {
+      std::stringstream ss;
+      string sRGB;
+      ss << s;
+      ss >> sRGB;
+      vFilenames.push_back(sRGB);
+    }
+  }
+
+  return true;
+}
+
+bool DatasetReader::LoadAssociations(const string &strFile, vector<double> &vTimestamps,
+                                     vector<string> &vFilenamesRGB, vector<string> &vFilenamesD) {
+  std::ifstream f;
+  f.open(strFile.c_str());
+  if (!f.is_open())
+    return false;
+
+  while (!f.eof()) {
+    string s;
+    getline(f, s);
+    if (!s.empty()) {
+      std::stringstream ss;
+      ss << s;
+      double t, tD;
+      string sRGB, sD;
+      ss >> t;
+      ss >> sRGB;
+      ss >> tD;
+      ss >> sD;
+      vTimestamps.push_back(t);
+      vFilenamesRGB.push_back(sRGB);
+      vFilenamesD.push_back(sD);
+    }
+  }
+
+  return true;
+}
+
+bool DatasetReader::LoadIMU(const string &strFile, vector<vector<double> > &values) {
+  std::ifstream f;
+  f.open(strFile.c_str());
+  if (!f.is_open())
+    return false;
+
+  while (!f.eof()) {
+    string s;
+    getline(f, s);
+    if (!s.empty()) {
+      if (s[0] == '#')
+        continue;  // skip comments
+
+      std::stringstream ss;
+      long ts;
+      double wx, wy, wz, ax, ay, az;
+
+      std::replace(s.begin(), s.end(), ',', ' ');
+      ss << s;
+      ss >> ts >> wx >> wy >> wz >> ax >> ay >> az;
+      values.push_back({static_cast<double>(ts), wx, wy, wz, ax, ay, az});
+    }
+  }
+
+  return true;
+}
+
+void DatasetReader::AssociateIMU(const vector<string> &vFilenames, const vector<vector<double> > &values,
+                                 vector<int> &valuesIdx) {
+  int cindex = 0;
+  int vsize = values.size();
+
+  for (auto it = vFilenames.begin(); it != vFilenames.end(); it++) {
+    // Get time stamp
+    size_t lastindex = (*it).find_last_of(".");
+    string rawname = (*it).substr(0, lastindex);
+    long ts = std::stol(rawname);
+
+    // Search in imu values, save equal or greater
+    bool found = false;
+    for (int i = cindex; i < vsize && !found; i++) {
+      long cts = values[i][0];
+      if (cts >= ts) {
+        cindex = i;
+        found = true;
+      }
+    }
+
+    // Save last one
+    if (!found)
+      cindex = vsize-1;
+
+    valuesIdx.push_back(cindex);
+  }
+}
+
+}  // namespace SD_SLAM
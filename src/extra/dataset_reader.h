@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_DATASET_READER_H_
+#define SD_SLAM_DATASET_READER_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Reads dataset images in background threads. Images are decoded ahead of the consumer
+// into a bounded ring buffer and returned in sequence order.
+class DatasetReader {
+ public:
+  struct Item {
+    int index;
+    std::string filename;
+    cv::Mat image;    // Grayscale, empty if it couldn't be read
+    cv::Mat depth;    // Unchanged, only when depth filenames are given
+  };
+
+  // Images are read from path/filenames[i], and depthmaps from path/depthFilenames[i] if not empty.
+  // At most capacity images are kept decoded ahead.
+  DatasetReader(const std::string &path, const std::vector<std::string> &filenames,
+                const std::vector<std::string> &depthFilenames = std::vector<std::string>(),
+                int capacity = 8, int nthreads = 2);
+  ~DatasetReader();
+
+  // Wait for the next image. Returns false when the sequence is finished
+  bool Next(Item &item);
+
+  inline int Size() const { return filenames_.size(); }
+
+  // Image list with one filename per line (files.txt)
+  static bool LoadImages(const std::string &strFile, std::vector<std::string> &vFilenames);
+
+  // TUM association file: timestamp rgb timestamp depth
+  static bool LoadAssociations(const std::string &strFile, std::vector<double> &vTimestamps,
+                               std::vector<std::string> &vFilenamesRGB, std::vector<std::string> &vFilenamesD);
+
+  // IMU csv: timestamp, 3 gyroscope and 3 accelerometer values per line
+  static bool LoadIMU(const std::string &strFile, std::vector<std::vector<double> > &values);
+
+  // Index of the first IMU value not older than each image. Image names are timestamps
+  static void AssociateIMU(const std::vector<std::string> &vFilenames, const std::vector<std::vector<double> > &values,
+                           std::vector<int> &valuesIdx);
+
+ private:
+  struct Slot {
+    int index;          // Image stored in this slot, -1 if empty
+    Item item;
+  };
+
+  // Decoding thread
+  void Run();
+
+  std::string path_;
+  std::vector<std::string> filenames_;
+  std::vector<std::string> depth_filenames_;
+
+  std::vector<Slot> slots_;
+  int next_;            // Next image to decode
+  int consumed_;        // Next image to return
+  bool finish_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_decoded_;
+  std::condition_variable cond_free_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_DATASET_READER_H_
@@ -0,0 +1,68 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "energy_policy.h"
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+
+namespace SD_SLAM {
+
+const double EnergyPolicy::MIN_DUTY_CYCLE = 0.05;
+const double EnergyPolicy::MAX_REST = 2000.0;
+
+EnergyPolicy::EnergyPolicy(double duty_cycle, int loop_batch):
+  duty_cycle_(std::min(std::max(duty_cycle, MIN_DUTY_CYCLE), 1.0)), loop_batch_(std::max(loop_batch, 1)),
+  charging_(false), throttle_(0.0), stop_(false) {
+}
+
+void EnergyPolicy::SetCharging(bool charging) {
+  charging_ = charging;
+}
+
+void EnergyPolicy::SetThermalThrottle(double throttle) {
+  throttle_ = std::min(std::max(throttle, 0.0), 1.0);
+}
+
+double EnergyPolicy::DutyCycle() const {
+  // Heat is a limit even while charging
+  const double duty = charging_ ? 1.0 : duty_cycle_;
+  return std::max(duty*(1.0-throttle_), MIN_DUTY_CYCLE);
+}
+
+int EnergyPolicy::LoopBatch() const {
+  return charging_ ? 1 : loop_batch_;
+}
+
+void EnergyPolicy::Rest(double busy_ms) {
+  const double duty = DutyCycle();
+  if (duty >= 1.0 || busy_ms <= 0.0)
+    return;
+
+  const double rest = std::min(busy_ms*(1.0-duty)/duty, MAX_REST);
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait_for(lock, std::chrono::microseconds(static_cast<int64_t>(rest*1000.0)), [this] { return stop_; });
+}
+
+void EnergyPolicy::Stop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  stop_ = true;
+  cond_.notify_all();
+}
+
+}  // namespace SD_SLAM
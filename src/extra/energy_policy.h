@@ -0,0 +1,77 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_ENERGY_POLICY_H_
+#define SD_SLAM_ENERGY_POLICY_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+namespace SD_SLAM {
+
+// Power budget of the background threads (Local Mapping, Loop Closing). After each unit of work
+// a thread rests in proportion to the time it took, so it is busy at most the duty cycle of the
+// time, and loops are only searched from the newest of every batch of keyframes. Thermal
+// throttling lowers the duty cycle further, while charging there are no limits. Map updates
+// come later and less often in exchange. State can be changed from any thread.
+class EnergyPolicy {
+ public:
+  // Lowest duty cycle reached by thermal throttling
+  static const double MIN_DUTY_CYCLE;
+
+  // Longest rest after a unit of work (ms)
+  static const double MAX_REST;
+
+  EnergyPolicy(double duty_cycle, int loop_batch);
+
+  EnergyPolicy(const EnergyPolicy&) = delete;
+  EnergyPolicy& operator=(const EnergyPolicy&) = delete;
+
+  void SetCharging(bool charging);
+
+  // Thermal throttling, from 0 (none) to 1 (critical). Duty cycle is scaled by 1-throttle
+  void SetThermalThrottle(double throttle);
+
+  // Fraction of time background threads can be busy now
+  double DutyCycle() const;
+
+  // Keyframes gathered before searching loops, 1 searches from every keyframe
+  int LoopBatch() const;
+
+  // Rest after busy_ms of work as the duty cycle requires. Returns early after Stop
+  void Rest(double busy_ms);
+
+  // Rests return at once from now on (shutdown)
+  void Stop();
+
+ private:
+  const double duty_cycle_;
+  const int loop_batch_;
+
+  std::atomic<bool> charging_;
+  std::atomic<double> throttle_;
+
+  bool stop_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_ENERGY_POLICY_H_
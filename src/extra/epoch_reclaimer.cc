@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "epoch_reclaimer.h"
+
+using std::vector;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+EpochReclaimer::EpochReclaimer() : epoch_(1) {
+}
+
+EpochReclaimer::~EpochReclaimer() {
+  Clear();
+}
+
+int EpochReclaimer::Register() {
+  unique_lock<mutex> lock(mutex_);
+  for (size_t i = 0; i < seen_.size(); i++) {
+    if (seen_[i] == 0) {
+      seen_[i] = epoch_;
+      return i;
+    }
+  }
+
+  seen_.push_back(epoch_);
+  return seen_.size()-1;
+}
+
+void EpochReclaimer::Unregister(int slot) {
+  unique_lock<mutex> lock(mutex_);
+  seen_[slot] = 0;
+}
+
+void EpochReclaimer::Quiescent(int slot) {
+  unique_lock<mutex> lock(mutex_);
+  seen_[slot] = epoch_;
+}
+
+void EpochReclaimer::Retire(void* p, const std::function<void(void*)> &reclaim) {
+  Retired r;
+  r.p = p;
+  r.reclaim = reclaim;
+
+  unique_lock<mutex> lock(mutex_);
+  r.epoch = epoch_;
+  retired_.push_back(r);
+}
+
+size_t EpochReclaimer::Collect() {
+  vector<Retired> vSafe;
+
+  {
+    unique_lock<mutex> lock(mutex_);
+
+    // Advance only when everyone has seen current epoch
+    uint64_t minSeen = epoch_;
+    for (uint64_t e : seen_) {
+      if (e > 0 && e < minSeen)
+        minSeen = e;
+    }
+
+    if (minSeen == epoch_)
+      epoch_++;
+
+    // Objects retired at epoch e are safe once every thread has seen e+2, so it went
+    // through two quiescent points after retiring them
+    while (!retired_.empty() && retired_.front().epoch+2 <= minSeen) {
+      vSafe.push_back(retired_.front());
+      retired_.pop_front();
+    }
+  }
+
+  for (Retired &r : vSafe)
+    r.reclaim(r.p);
+
+  return vSafe.size();
+}
+
+void EpochReclaimer::Clear() {
+  std::deque<Retired> retired;
+  {
+    unique_lock<mutex> lock(mutex_);
+    retired.swap(retired_);
+  }
+
+  for (Retired &r : retired)
+    r.reclaim(r.p);
+}
+
+size_t EpochReclaimer::Pending() {
+  unique_lock<mutex> lock(mutex_);
+  return retired_.size();
+}
+
+}  // namespace SD_SLAM
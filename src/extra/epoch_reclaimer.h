@@ -0,0 +1,86 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_EPOCH_RECLAIMER_H_
+#define SD_SLAM_EPOCH_RECLAIMER_H_
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <cstdint>
+#include <functional>
+
+namespace SD_SLAM {
+
+// Epoch based reclamation. Objects removed from shared structures are retired instead
+// of deleted, and only reclaimed once every registered thread has gone twice through
+// a quiescent point, where it holds no pointers obtained before the previous one.
+class EpochReclaimer {
+ public:
+  EpochReclaimer();
+  ~EpochReclaimer();
+
+  // Threads dereferencing retired objects must register. Returns participant slot
+  int Register();
+  void Unregister(int slot);
+
+  // Called by a registered thread at a point where it holds no shared pointers
+  void Quiescent(int slot);
+
+  // Defer reclaim(p) until no thread can reference p
+  void Retire(void* p, const std::function<void(void*)> &reclaim);
+
+  // Advance epoch if every thread has seen it and reclaim safe objects. Returns number reclaimed
+  size_t Collect();
+
+  // Reclaim everything. Only safe when other threads are not using retired objects
+  void Clear();
+
+  size_t Pending();
+
+ private:
+  struct Retired {
+    void* p;
+    std::function<void(void*)> reclaim;
+    uint64_t epoch;
+  };
+
+  // Epoch seen by each participant, 0 for free slots
+  std::vector<uint64_t> seen_;
+  std::deque<Retired> retired_;
+  uint64_t epoch_;
+
+  std::mutex mutex_;
+};
+
+// Register calling thread for its scope
+class ScopedParticipant {
+ public:
+  explicit ScopedParticipant(EpochReclaimer* reclaimer) : reclaimer_(reclaimer), slot_(reclaimer->Register()) {}
+  ~ScopedParticipant() { reclaimer_->Unregister(slot_); }
+
+  inline void Quiescent() { reclaimer_->Quiescent(slot_); }
+
+ private:
+  EpochReclaimer* reclaimer_;
+  int slot_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_EPOCH_RECLAIMER_H_
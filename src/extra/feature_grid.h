@@ -0,0 +1,166 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_FEATURE_GRID_H_
+#define SD_SLAM_FEATURE_GRID_H_
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace SD_SLAM {
+
+// Feature indices bucketed by image cell, stored in compressed form: the features of cell c
+// are indices_[offsets_[c]] ... indices_[offsets_[c+1]-1]. Cells are stored column by column.
+class FeatureGrid {
+ public:
+  FeatureGrid() : cols_(0), rows_(0) {}
+
+  // Build with a counting sort. cellOf(i, ix, iy) returns false if feature i is outside the grid
+  template <typename CellFunc>
+  void Build(int cols, int rows, int n, CellFunc cellOf) {
+    const int ncells = cols*rows;
+    cols_ = cols;
+    rows_ = rows;
+    offsets_.assign(ncells+1, 0);
+
+    // Count features per cell
+    int ix, iy;
+    for (int i = 0; i < n; i++) {
+      if (cellOf(i, ix, iy))
+        offsets_[ix*rows+iy+1]++;
+    }
+
+    for (int c = 1; c <= ncells; c++)
+      offsets_[c] += offsets_[c-1];
+
+    // Place indices, offsets_[c] ends up pointing to the end of cell c
+    indices_.resize(offsets_[ncells]);
+    for (int i = 0; i < n; i++) {
+      if (cellOf(i, ix, iy))
+        indices_[offsets_[ix*rows+iy]++] = i;
+    }
+
+    for (int c = ncells; c > 0; c--)
+      offsets_[c] = offsets_[c-1];
+    offsets_[0] = 0;
+  }
+
+  inline int Cols() const { return cols_; }
+  inline int Rows() const { return rows_; }
+
+  inline const uint32_t* CellBegin(int ix, int iy) const { return indices_.data()+offsets_[ix*rows_+iy]; }
+  inline const uint32_t* CellEnd(int ix, int iy) const { return indices_.data()+offsets_[ix*rows_+iy+1]; }
+  inline size_t CellSize(int ix, int iy) const { return offsets_[ix*rows_+iy+1]-offsets_[ix*rows_+iy]; }
+
+  // Cells overlapping the square window of radius r around (x, y), for a grid starting at
+  // (minX, minY) with cells of 1/invW x 1/invH pixels. Returns false if there are none
+  inline bool CellRange(float x, float y, float r, float minX, float minY, float invW, float invH,
+                        int &minCellX, int &maxCellX, int &minCellY, int &maxCellY) const {
+    minCellX = std::max(0, static_cast<int>(std::floor((x-minX-r)*invW)));
+    maxCellX = std::min(cols_-1, static_cast<int>(std::ceil((x-minX+r)*invW)));
+    minCellY = std::max(0, static_cast<int>(std::floor((y-minY-r)*invH)));
+    maxCellY = std::min(rows_-1, static_cast<int>(std::ceil((y-minY+r)*invH)));
+    return minCellX <= maxCellX && minCellY <= maxCellY;
+  }
+
+  // Call f(begin, end) for each non empty cell overlapping the window
+  template <typename Func>
+  inline void ForEachCell(float x, float y, float r, float minX, float minY, float invW, float invH, Func f) const {
+    int minCellX, maxCellX, minCellY, maxCellY;
+    if (!CellRange(x, y, r, minX, minY, invW, invH, minCellX, maxCellX, minCellY, maxCellY))
+      return;
+
+    for (int ix = minCellX; ix <= maxCellX; ix++) {
+      for (int iy = minCellY; iy <= maxCellY; iy++) {
+        if (CellSize(ix, iy) > 0)
+          f(CellBegin(ix, iy), CellEnd(ix, iy));
+      }
+    }
+  }
+
+  // Call f(begin, end) for each non empty cell that may hold features within distance r of the
+  // line a*x+b*y+c = 0, for a grid as in CellRange. Cells are walked along the line, one column
+  // (or row, for steep lines) at a time, so only the band around it is visited
+  template <typename Func>
+  inline void ForEachCellNearLine(float a, float b, float c, float r, float minX, float minY, float invW, float invH,
+                                  Func f) const {
+    const float norm = std::sqrt(a*a+b*b);
+    if (norm == 0)
+      return;
+
+    // Features are assigned to the nearest cell, so cell i spans [i-0.5, i+0.5] cells
+    if (std::fabs(b) >= std::fabs(a)) {
+      const float pad = r*norm/std::fabs(b);
+      for (int ix = 0; ix < cols_; ix++) {
+        const float x0 = minX+(ix-0.5f)/invW;
+        const float x1 = minX+(ix+0.5f)/invW;
+        const float y0 = -(a*x0+c)/b;
+        const float y1 = -(a*x1+c)/b;
+        int minCellY, maxCellY;
+        if (!Span(std::min(y0, y1)-pad, std::max(y0, y1)+pad, minY, invH, rows_, minCellY, maxCellY))
+          continue;
+        for (int iy = minCellY; iy <= maxCellY; iy++) {
+          if (CellSize(ix, iy) > 0)
+            f(CellBegin(ix, iy), CellEnd(ix, iy));
+        }
+      }
+    } else {
+      const float pad = r*norm/std::fabs(a);
+      for (int iy = 0; iy < rows_; iy++) {
+        const float y0 = minY+(iy-0.5f)/invH;
+        const float y1 = minY+(iy+0.5f)/invH;
+        const float x0 = -(b*y0+c)/a;
+        const float x1 = -(b*y1+c)/a;
+        int minCellX, maxCellX;
+        if (!Span(std::min(x0, x1)-pad, std::max(x0, x1)+pad, minX, invW, cols_, minCellX, maxCellX))
+          continue;
+        for (int ix = minCellX; ix <= maxCellX; ix++) {
+          if (CellSize(ix, iy) > 0)
+            f(CellBegin(ix, iy), CellEnd(ix, iy));
+        }
+      }
+    }
+  }
+
+  inline size_t Bytes() const { return (offsets_.capacity()+indices_.capacity())*sizeof(uint32_t); }
+
+ private:
+  // Cells [first, last] overlapping coordinates [lo, hi], clamped before converting to int.
+  // Returns false if there are none
+  static inline bool Span(float lo, float hi, float min, float inv, int n, int &first, int &last) {
+    const float flo = std::floor((lo-min)*inv);
+    const float fhi = std::ceil((hi-min)*inv);
+    if (fhi < 0 || flo > n-1)
+      return false;
+    first = static_cast<int>(std::max(flo, 0.0f));
+    last = static_cast<int>(std::min(fhi, static_cast<float>(n-1)));
+    return true;
+  }
+
+  int cols_;
+  int rows_;
+  std::vector<uint32_t> offsets_;
+  std::vector<uint32_t> indices_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_FEATURE_GRID_H_
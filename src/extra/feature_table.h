@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_FEATURE_TABLE_H_
+#define SD_SLAM_FEATURE_TABLE_H_
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Keypoint data read by the matching loops, stored as separate contiguous arrays.
+// Entry i belongs to keypoint i. Descriptors are not copied, the table points to the
+// owner's descriptor matrix, which must stay alive and unmodified.
+class FeatureTable {
+ public:
+  static const int DESCRIPTOR_SIZE = 32;
+  static const size_t DESCRIPTOR_ALIGNMENT = 32;
+
+  FeatureTable() : desc_(nullptr), desc_step_(0) {}
+
+  // n descriptor rows, contiguous and with every row aligned to DESCRIPTOR_ALIGNMENT.
+  // The matrix header owns the block, so frames and keyframes can share it by copying the header
+  static cv::Mat AllocateDescriptors(int n) {
+    if (n <= 0)
+      return cv::Mat();
+    cv::Mat block(1, n*DESCRIPTOR_SIZE + DESCRIPTOR_ALIGNMENT-1, CV_8U);
+    const size_t offset = (DESCRIPTOR_ALIGNMENT - reinterpret_cast<size_t>(block.data)%DESCRIPTOR_ALIGNMENT) %
+                          DESCRIPTOR_ALIGNMENT;
+    return block.colRange(offset, offset + n*DESCRIPTOR_SIZE).reshape(1, n);
+  }
+
+  static inline bool IsAligned(const cv::Mat &descriptors) {
+    return descriptors.empty() || (descriptors.isContinuous() && descriptors.cols == DESCRIPTOR_SIZE &&
+                                   reinterpret_cast<size_t>(descriptors.data)%DESCRIPTOR_ALIGNMENT == 0);
+  }
+
+  // Descriptors as given if already aligned (or not ORB descriptors), else an aligned copy
+  static cv::Mat AlignDescriptors(const cv::Mat &descriptors) {
+    if (IsAligned(descriptors) || descriptors.cols != DESCRIPTOR_SIZE)
+      return descriptors;
+    cv::Mat aligned = AllocateDescriptors(descriptors.rows);
+    descriptors.copyTo(aligned);
+    return aligned;
+  }
+
+  void Build(const std::vector<cv::KeyPoint> &keys, const cv::Mat &descriptors) {
+    const size_t n = keys.size();
+    x_.resize(n);
+    y_.resize(n);
+    octave_.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      x_[i] = keys[i].pt.x;
+      y_[i] = keys[i].pt.y;
+      octave_[i] = static_cast<uint8_t>(keys[i].octave);
+    }
+
+    desc_ = descriptors.empty() ? nullptr : descriptors.ptr<uchar>();
+    desc_step_ = descriptors.empty() ? 0 : descriptors.step[0];
+  }
+
+  inline size_t Size() const { return x_.size(); }
+
+  // Memory of the tables, descriptors are not owned
+  inline size_t Bytes() const { return (x_.capacity()+y_.capacity())*sizeof(float)+octave_.capacity(); }
+
+  inline float X(size_t i) const { return x_[i]; }
+  inline float Y(size_t i) const { return y_[i]; }
+  inline int Octave(size_t i) const { return octave_[i]; }
+  inline const uchar* Descriptor(size_t i) const { return desc_ + i*desc_step_; }
+
+  inline void SetPosition(size_t i, float x, float y) {
+    x_[i] = x;
+    y_[i] = y;
+  }
+
+  // First descriptor, rows are DescriptorStep() bytes apart. Rows are aligned when
+  // descriptors come from AllocateDescriptors or AlignDescriptors
+  inline const uchar* Descriptors() const { return desc_; }
+  inline size_t DescriptorStep() const { return desc_step_; }
+
+  // Call f(idx) for indices in [begin, end) whose keypoint lies inside the square window of
+  // radius r. Levels are only checked when minLevel > 0 or maxLevel >= 0
+  template <typename Func>
+  inline void ForEach(const uint32_t* begin, const uint32_t* end, float x, float y, float r,
+                      int minLevel, int maxLevel, Func f) const {
+    const float* px = x_.data();
+    const float* py = y_.data();
+    const uint8_t* po = octave_.data();
+    const bool bCheckLevels = (minLevel > 0) || (maxLevel >= 0);
+    const int maxL = maxLevel >= 0 ? maxLevel : 255;
+
+    for (const uint32_t* it = begin; it != end; it++) {
+      const size_t idx = *it;
+      if (bCheckLevels && (po[idx] < minLevel || po[idx] > maxL))
+        continue;
+
+      if (std::fabs(px[idx]-x) < r && std::fabs(py[idx]-y) < r)
+        f(idx);
+    }
+  }
+
+  // Append the indices selected by ForEach
+  inline void Select(const uint32_t* begin, const uint32_t* end, float x, float y, float r,
+                     int minLevel, int maxLevel, std::vector<size_t> &indices) const {
+    ForEach(begin, end, x, y, r, minLevel, maxLevel, [&indices](size_t idx) { indices.push_back(idx); });
+  }
+
+ private:
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<uint8_t> octave_;
+
+  const uchar* desc_;
+  size_t desc_step_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_FEATURE_TABLE_H_
@@ -147,25 +147,73 @@ namespace g2o {
 
       void deallocate();
 
+      //! precompute the block operations of the Schur complement, valid until the structure changes
+      void buildSchurPlan();
+
+      //! dest = (Hpp - Hpl Dinv Hpl^T) src, without building the Schur complement
+      void multiplySchur(double* dest, const double* src);
+
+      /**
+       * \brief Schur complement given to linear solvers which only need its products
+       */
+      class SchurOperator : public LinearOperator<PoseMatrixType>
+      {
+        public:
+          explicit SchurOperator(BlockSolver* solver) : _solver(solver) {}
+          int rows() const { return _solver->_sizePoses;}
+          int numBlocks() const { return _solver->_numPoses;}
+          int rowBaseOfBlock(int i) const { return _solver->_Hpp->rowBaseOfBlock(i);}
+          const PoseMatrixType& diagonalBlock(int i) const { return _solver->_schurDiagonal[i];}
+          void multiply(double* y, const double* x) const { _solver->multiplySchur(y, x);}
+        protected:
+          BlockSolver* _solver;
+      };
+
+      /**
+       * \brief landmark observed by a pose, a row of the Schur elimination
+       *
+       * Products [begin, end) update the Schur blocks of this pose with the poses observing
+       * the same landmark (including itself)
+       */
+      struct SchurTerm {
+        int landmark;
+        int column;   //!< position of the pose in the landmark column of Hpl
+        const PoseLandmarkMatrixType* Bi;
+        int begin, end;
+      };
+
+      //! block of another pose observing the same landmark and Schur block (i1, i2) it updates
+      struct SchurProduct {
+        const PoseLandmarkMatrixType* Bj;
+        PoseMatrixType* target;
+      };
+
       SparseBlockMatrix<PoseMatrixType>* _Hpp;
       SparseBlockMatrix<LandmarkMatrixType>* _Hll;
       SparseBlockMatrix<PoseLandmarkMatrixType>* _Hpl;
 
-      SparseBlockMatrix<PoseMatrixType>* _Hschur;
+      SparseBlockMatrix<PoseMatrixType>* _Hschur;   //!< not allocated if the linear solver is implicit
       SparseBlockMatrixDiagonal<LandmarkMatrixType>* _DInvSchur;
 
       SparseBlockMatrixCCS<PoseLandmarkMatrixType>* _HplCCS;
-      SparseBlockMatrixCCS<PoseMatrixType>* _HschurTransposedCCS;
+
+      // Schur elimination plan in contiguous arrays. Terms of pose i are
+      // [_schurTermOffsets[i], _schurTermOffsets[i+1]), so poses are eliminated in parallel
+      // without sharing any output block
+      std::vector<std::pair<const PoseMatrixType*, PoseMatrixType*> > _schurCopies;  //!< Hpp block, Hschur block
+      std::vector<int> _schurTermOffsets;
+      std::vector<SchurTerm> _schurTerms;
+      std::vector<SchurProduct> _schurProducts;
+
+      // Implicit Schur complement: its diagonal blocks and a landmark sized workspace
+      std::vector<PoseMatrixType, Eigen::aligned_allocator<PoseMatrixType> > _schurDiagonal;
+      std::vector<double> _schurWorkspace;
 
       LinearSolver<PoseMatrixType>* _linearSolver;
 
       std::vector<PoseVectorType, Eigen::aligned_allocator<PoseVectorType> > _diagonalBackupPose;
       std::vector<LandmarkVectorType, Eigen::aligned_allocator<LandmarkVectorType> > _diagonalBackupLandmark;
 
-#    ifdef G2O_OPENMP
-      std::vector<OpenMPMutex> _coefficientsMutex;
-#    endif
-
       bool _doSchur;
 
       double* _coefficients;
@@ -48,7 +48,6 @@ BlockSolver<Traits>::BlockSolver(LinearSolverType* linearSolver) :
   _Hll = 0;
   _Hpl = 0;
   _HplCCS = 0;
-  _HschurTransposedCCS = 0;
   _Hschur = 0;
   _DInvSchur = 0;
   _coefficients = 0;
@@ -79,15 +78,12 @@ void BlockSolver<Traits>::resize(int* blockPoseIndices, int numPoseBlocks,
 
   _Hpp=new PoseHessianType(blockPoseIndices, blockPoseIndices, numPoseBlocks, numPoseBlocks);
   if (_doSchur) {
-    _Hschur=new PoseHessianType(blockPoseIndices, blockPoseIndices, numPoseBlocks, numPoseBlocks);
+    if (! _linearSolver->implicit())
+      _Hschur=new PoseHessianType(blockPoseIndices, blockPoseIndices, numPoseBlocks, numPoseBlocks);
     _Hll=new LandmarkHessianType(blockLandmarkIndices, blockLandmarkIndices, numLandmarkBlocks, numLandmarkBlocks);
     _DInvSchur = new SparseBlockMatrixDiagonal<LandmarkMatrixType>(_Hll->colBlockIndices());
     _Hpl=new PoseLandmarkHessianType(blockPoseIndices, blockLandmarkIndices, numPoseBlocks, numLandmarkBlocks);
     _HplCCS = new SparseBlockMatrixCCS<PoseLandmarkMatrixType>(_Hpl->rowBlockIndices(), _Hpl->colBlockIndices());
-    _HschurTransposedCCS = new SparseBlockMatrixCCS<PoseMatrixType>(_Hschur->colBlockIndices(), _Hschur->rowBlockIndices());
-#ifdef G2O_OPENMP
-    _coefficientsMutex.resize(numPoseBlocks);
-#endif
   }
 }
 
@@ -126,10 +122,12 @@ void BlockSolver<Traits>::deallocate()
     delete _HplCCS;
     _HplCCS = 0;
   }
-  if (_HschurTransposedCCS) {
-    delete _HschurTransposedCCS;
-    _HschurTransposedCCS = 0;
-  }
+  _schurCopies.clear();
+  _schurTermOffsets.clear();
+  _schurTerms.clear();
+  _schurProducts.clear();
+  _schurDiagonal.clear();
+  _schurWorkspace.clear();
 }
 
 template <typename Traits>
@@ -196,7 +194,7 @@ bool BlockSolver<Traits>::buildStructure(bool zeroBlocks)
 
   // temporary structures for building the pattern of the Schur complement
   SparseBlockMatrixHashMap<PoseMatrixType>* schurMatrixLookup = 0;
-  if (_doSchur) {
+  if (_Hschur) {
     schurMatrixLookup = new SparseBlockMatrixHashMap<PoseMatrixType>(_Hschur->rowBlockIndices(), _Hschur->colBlockIndices());
     schurMatrixLookup->blockCols().resize(_Hschur->blockCols().size());
   }
@@ -259,41 +257,140 @@ bool BlockSolver<Traits>::buildStructure(bool zeroBlocks)
   _DInvSchur->diagonal().resize(landmarkIdx);
   _Hpl->fillSparseBlockMatrixCCS(*_HplCCS);
 
-  for (size_t i = 0; i < _optimizer->indexMapping().size(); ++i) {
-    OptimizableGraph::Vertex* v = _optimizer->indexMapping()[i];
-    if (v->marginalized()){
-      const HyperGraph::EdgeSet& vedges=v->edges();
-      for (HyperGraph::EdgeSet::const_iterator it1=vedges.begin(); it1!=vedges.end(); ++it1){
-        for (size_t i = 0; i < (*it1)->vertices().size(); ++i)
-        {
-          OptimizableGraph::Vertex* v1= (OptimizableGraph::Vertex*) (*it1)->vertex(i);
-          if (v1->hessianIndex()==-1 || v1==v)
-            continue;
-          for  (HyperGraph::EdgeSet::const_iterator it2=vedges.begin(); it2!=vedges.end(); ++it2){
-            for (size_t j = 0; j < (*it2)->vertices().size(); ++j)
-            {
-              OptimizableGraph::Vertex* v2= (OptimizableGraph::Vertex*) (*it2)->vertex(j);
-              if (v2->hessianIndex()==-1 || v2==v)
-                continue;
-              int i1=v1->hessianIndex();
-              int i2=v2->hessianIndex();
-              if (i1<=i2) {
-                schurMatrixLookup->addBlock(i1, i2);
+  // pattern of the Schur complement, unless it is only applied implicitly
+  if (_Hschur) {
+    for (size_t i = 0; i < _optimizer->indexMapping().size(); ++i) {
+      OptimizableGraph::Vertex* v = _optimizer->indexMapping()[i];
+      if (v->marginalized()){
+        const HyperGraph::EdgeSet& vedges=v->edges();
+        for (HyperGraph::EdgeSet::const_iterator it1=vedges.begin(); it1!=vedges.end(); ++it1){
+          for (size_t i = 0; i < (*it1)->vertices().size(); ++i)
+          {
+            OptimizableGraph::Vertex* v1= (OptimizableGraph::Vertex*) (*it1)->vertex(i);
+            if (v1->hessianIndex()==-1 || v1==v)
+              continue;
+            for  (HyperGraph::EdgeSet::const_iterator it2=vedges.begin(); it2!=vedges.end(); ++it2){
+              for (size_t j = 0; j < (*it2)->vertices().size(); ++j)
+              {
+                OptimizableGraph::Vertex* v2= (OptimizableGraph::Vertex*) (*it2)->vertex(j);
+                if (v2->hessianIndex()==-1 || v2==v)
+                  continue;
+                int i1=v1->hessianIndex();
+                int i2=v2->hessianIndex();
+                if (i1<=i2) {
+                  schurMatrixLookup->addBlock(i1, i2);
+                }
               }
             }
           }
         }
       }
     }
+
+    _Hschur->takePatternFromHash(*schurMatrixLookup);
+    delete schurMatrixLookup;
   }
 
-  _Hschur->takePatternFromHash(*schurMatrixLookup);
-  delete schurMatrixLookup;
-  _Hschur->fillSparseBlockMatrixCCSTransposed(*_HschurTransposedCCS);
+  buildSchurPlan();
 
   return true;
 }
 
+template <typename Traits>
+void BlockSolver<Traits>::buildSchurPlan()
+{
+  // Hpp blocks copied to Hschur
+  _schurCopies.clear();
+  for (size_t c = 0; _Hschur && c < _Hpp->blockCols().size(); ++c) {
+    const typename SparseBlockMatrix<PoseMatrixType>::IntBlockMap& col = _Hpp->blockCols()[c];
+    for (typename SparseBlockMatrix<PoseMatrixType>::IntBlockMap::const_iterator it = col.begin(); it != col.end(); ++it)
+      _schurCopies.push_back(std::make_pair(it->second, _Hschur->block(it->first, c)));
+  }
+
+  // Landmarks observed by each pose
+  _schurTermOffsets.assign(_numPoses+1, 0);
+  for (size_t l = 0; l < _HplCCS->blockCols().size(); ++l) {
+    const typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn& landmarkColumn = _HplCCS->blockCols()[l];
+    for (size_t k = 0; k < landmarkColumn.size(); ++k)
+      _schurTermOffsets[landmarkColumn[k].row+1]++;
+  }
+  for (int i = 0; i < _numPoses; ++i)
+    _schurTermOffsets[i+1] += _schurTermOffsets[i];
+
+  std::vector<int> next(_schurTermOffsets.begin(), _schurTermOffsets.end()-1);
+  _schurTerms.resize(_schurTermOffsets[_numPoses]);
+  for (size_t l = 0; l < _HplCCS->blockCols().size(); ++l) {
+    const typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn& landmarkColumn = _HplCCS->blockCols()[l];
+    for (size_t k = 0; k < landmarkColumn.size(); ++k) {
+      SchurTerm& term = _schurTerms[next[landmarkColumn[k].row]++];
+      term.landmark = l;
+      term.column = k;
+      term.Bi = landmarkColumn[k].block;
+    }
+  }
+
+  // Products of each pose, rows in a landmark column are sorted so i2 >= i1 from the pose position
+  _schurProducts.clear();
+  for (int i1 = 0; i1 < _numPoses; ++i1) {
+    for (int t = _schurTermOffsets[i1]; t < _schurTermOffsets[i1+1]; ++t) {
+      SchurTerm& term = _schurTerms[t];
+      const typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn& landmarkColumn = _HplCCS->blockCols()[term.landmark];
+      term.begin = _schurProducts.size();
+      for (size_t k = term.column; _Hschur && k < landmarkColumn.size(); ++k) {
+        SchurProduct product;
+        product.Bj = landmarkColumn[k].block;
+        product.target = _Hschur->block(i1, landmarkColumn[k].row);
+        assert(product.target && "something wrong with the Schur structure");
+        _schurProducts.push_back(product);
+      }
+      term.end = _schurProducts.size();
+    }
+  }
+
+  if (! _Hschur) {
+    _schurDiagonal.resize(_numPoses);
+    _schurWorkspace.resize(_sizeLandmarks);
+  }
+}
+
+template <typename Traits>
+void BlockSolver<Traits>::multiplySchur(double* dest, const double* src)
+{
+  // dest = Hpp src
+  memset(dest, 0, _sizePoses * sizeof(double));
+  _Hpp->multiplySymmetricUpperTriangle(dest, src);
+
+  // w = Dinv Hpl^T src, landmark by landmark
+  const std::vector<typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn>& landmarkColumns = _HplCCS->blockCols();
+# ifdef G2O_OPENMP
+# pragma omp parallel for default (shared) schedule(dynamic, 64)
+# endif
+  for (int l = 0; l < static_cast<int>(landmarkColumns.size()); ++l) {
+    const LandmarkMatrixType& Dinv = _DInvSchur->diagonal()[l];
+    LandmarkVectorType tmp = LandmarkVectorType::Zero(Dinv.rows());
+    for (size_t k = 0; k < landmarkColumns[l].size(); ++k) {
+      const int row = landmarkColumns[l][k].row;
+      typename PoseVectorType::ConstMapType xp(&src[_Hpp->rowBaseOfBlock(row)], _Hpp->rowsOfBlock(row));
+      tmp.noalias() += landmarkColumns[l][k].block->transpose()*xp;
+    }
+    typename LandmarkVectorType::MapType w(&_schurWorkspace[_Hll->rowBaseOfBlock(l)], Dinv.rows());
+    w.noalias() = Dinv*tmp;
+  }
+
+  // dest -= Hpl w, pose by pose
+# ifdef G2O_OPENMP
+# pragma omp parallel for default (shared) schedule(dynamic, 4)
+# endif
+  for (int i1 = 0; i1 < _numPoses; ++i1) {
+    typename PoseVectorType::MapType y(&dest[_Hpp->rowBaseOfBlock(i1)], _Hpp->rowsOfBlock(i1));
+    for (int t = _schurTermOffsets[i1]; t < _schurTermOffsets[i1+1]; ++t) {
+      const SchurTerm& term = _schurTerms[t];
+      typename LandmarkVectorType::ConstMapType w(&_schurWorkspace[_Hll->rowBaseOfBlock(term.landmark)], _Hll->rowsOfBlock(term.landmark));
+      y.noalias() -= (*term.Bi)*w;
+    }
+  }
+}
+
 template <typename Traits>
 bool BlockSolver<Traits>::updateStructure(const std::vector<HyperGraph::Vertex*>& vset, const HyperGraph::EdgeSet& edges)
 {
@@ -370,63 +467,57 @@ bool BlockSolver<Traits>::solve(){
   double t=get_monotonic_time();
 
   // _Hschur = _Hpp, but keeping the pattern of _Hschur
-  _Hschur->clear();
-  _Hpp->add(_Hschur);
+  if (_Hschur)
+    _Hschur->clear();
+  for (size_t i = 0; i < _schurCopies.size(); ++i)
+    *_schurCopies[i].second = *_schurCopies[i].first;
 
-  //_DInvSchur->clear();
-  memset (_coefficients, 0, _sizePoses*sizeof(double));
+  // Inverse landmark blocks, Dinv * bl is kept in the landmark part of the coefficients
 # ifdef G2O_OPENMP
-# pragma omp parallel for default (shared) schedule(dynamic, 10)
+# pragma omp parallel for default (shared) schedule(dynamic, 64)
 # endif
   for (int landmarkIndex = 0; landmarkIndex < static_cast<int>(_Hll->blockCols().size()); ++landmarkIndex) {
     const typename SparseBlockMatrix<LandmarkMatrixType>::IntBlockMap& marginalizeColumn = _Hll->blockCols()[landmarkIndex];
     assert(marginalizeColumn.size() == 1 && "more than one block in _Hll column");
 
-    // calculate inverse block for the landmark
     const LandmarkMatrixType * D = marginalizeColumn.begin()->second;
     assert (D && D->rows()==D->cols() && "Error in landmark matrix");
     LandmarkMatrixType& Dinv = _DInvSchur->diagonal()[landmarkIndex];
     Dinv = D->inverse();
 
-    LandmarkVectorType  db(D->rows());
-    for (int j = 0; j < D->rows(); ++j) {
-      db[j]=_b[_Hll->rowBaseOfBlock(landmarkIndex) + _sizePoses + j];
+    const int base = _sizePoses + _Hll->rowBaseOfBlock(landmarkIndex);
+    typename LandmarkVectorType::MapType db(&_coefficients[base], D->rows());
+    typename LandmarkVectorType::ConstMapType bl(&_b[base], D->rows());
+    db.noalias() = Dinv*bl;
+  }
+
+  // Eliminate landmarks pose by pose, each pose only writes its own Schur blocks and coefficients.
+  // If the Schur complement is implicit only its diagonal blocks are computed, for preconditioning
+# ifdef G2O_OPENMP
+# pragma omp parallel for default (shared) schedule(dynamic, 4)
+# endif
+  for (int i1 = 0; i1 < _numPoses; ++i1) {
+    typename PoseVectorType::MapType Bb(&_coefficients[_Hpp->rowBaseOfBlock(i1)], _Hpp->rowsOfBlock(i1));
+    Bb.setZero();
+
+    PoseMatrixType* Sii = 0;
+    if (! _Hschur) {
+      Sii = &_schurDiagonal[i1];
+      *Sii = *_Hpp->block(i1, i1);
     }
-    db=Dinv*db;
-
-    assert((size_t)landmarkIndex < _HplCCS->blockCols().size() && "Index out of bounds");
-    const typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn& landmarkColumn = _HplCCS->blockCols()[landmarkIndex];
-
-    for (typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn::const_iterator it_outer = landmarkColumn.begin();
-        it_outer != landmarkColumn.end(); ++it_outer) {
-      int i1 = it_outer->row;
-
-      const PoseLandmarkMatrixType* Bi = it_outer->block;
-      assert(Bi);
-
-      PoseLandmarkMatrixType BDinv = (*Bi)*(Dinv);
-      assert(_HplCCS->rowBaseOfBlock(i1) < _sizePoses && "Index out of bounds");
-      typename PoseVectorType::MapType Bb(&_coefficients[_HplCCS->rowBaseOfBlock(i1)], Bi->rows());
-#    ifdef G2O_OPENMP
-      ScopedOpenMPMutex mutexLock(&_coefficientsMutex[i1]);
-#    endif
-      Bb.noalias() += (*Bi)*db;
-
-      assert(i1 >= 0 && i1 < static_cast<int>(_HschurTransposedCCS->blockCols().size()) && "Index out of bounds");
-      typename SparseBlockMatrixCCS<PoseMatrixType>::SparseColumn::iterator targetColumnIt = _HschurTransposedCCS->blockCols()[i1].begin();
-
-      typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::RowBlock aux(i1, 0);
-      typename SparseBlockMatrixCCS<PoseLandmarkMatrixType>::SparseColumn::const_iterator it_inner = lower_bound(landmarkColumn.begin(), landmarkColumn.end(), aux);
-      for (; it_inner != landmarkColumn.end(); ++it_inner) {
-        int i2 = it_inner->row;
-        const PoseLandmarkMatrixType* Bj = it_inner->block;
-        assert(Bj); 
-        while (targetColumnIt->row < i2 /*&& targetColumnIt != _HschurTransposedCCS->blockCols()[i1].end()*/)
-          ++targetColumnIt;
-        assert(targetColumnIt != _HschurTransposedCCS->blockCols()[i1].end() && targetColumnIt->row == i2 && "invalid iterator, something wrong with the matrix structure");
-        PoseMatrixType* Hi1i2 = targetColumnIt->block;//_Hschur->block(i1, i2);
-        assert(Hi1i2);
-        (*Hi1i2).noalias() -= BDinv*Bj->transpose();
+
+    for (int t = _schurTermOffsets[i1]; t < _schurTermOffsets[i1+1]; ++t) {
+      const SchurTerm& term = _schurTerms[t];
+      const LandmarkMatrixType& Dinv = _DInvSchur->diagonal()[term.landmark];
+      typename LandmarkVectorType::ConstMapType db(&_coefficients[_sizePoses + _Hll->rowBaseOfBlock(term.landmark)], Dinv.rows());
+      Bb.noalias() += (*term.Bi)*db;
+
+      PoseLandmarkMatrixType BDinv = (*term.Bi)*Dinv;
+      if (Sii)
+        (*Sii).noalias() -= BDinv*term.Bi->transpose();
+      for (int p = term.begin; p < term.end; ++p) {
+        const SchurProduct& product = _schurProducts[p];
+        (*product.target).noalias() -= BDinv*product.Bj->transpose();
       }
     }
   }
@@ -444,7 +535,13 @@ bool BlockSolver<Traits>::solve(){
   }
 
   t=get_monotonic_time();
-  bool solvedPoses = _linearSolver->solve(*_Hschur, _x, _bschur);
+  bool solvedPoses;
+  if (_Hschur) {
+    solvedPoses = _linearSolver->solve(*_Hschur, _x, _bschur);
+  } else {
+    SchurOperator schur(this);
+    solvedPoses = _linearSolver->solveImplicit(schur, _x, _bschur);
+  }
   if (globalStats) {
     globalStats->timeLinearSolver = get_monotonic_time() - t;
     globalStats->hessianPoseDimension = _Hpp->cols();
@@ -0,0 +1,133 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "graph_arena.h"
+#include <Eigen/Core>
+
+namespace g2o {
+
+  namespace {
+    thread_local GraphArena* currentArena = 0;
+  }
+
+  GraphArena::GraphArena(size_t chunkSize) :
+    _chunkSize(chunkSize), _current(0), _offset(0), _used(0)
+  {
+  }
+
+  GraphArena::~GraphArena()
+  {
+    for (size_t i = 0; i < _chunks.size(); ++i)
+      Eigen::internal::aligned_free(_chunks[i].data);
+  }
+
+  GraphArena* GraphArena::current()
+  {
+    return currentArena;
+  }
+
+  void* GraphArena::allocate(size_t size)
+  {
+    if (currentArena)
+      return currentArena->allocateInArena(size);
+    return Eigen::internal::aligned_malloc(size);
+  }
+
+  void GraphArena::release(void* p)
+  {
+    if (!p || (currentArena && currentArena->owns(p)))
+      return;
+    Eigen::internal::aligned_free(p);
+  }
+
+  bool GraphArena::owns(const void* p) const
+  {
+    const char* c = static_cast<const char*>(p);
+    for (size_t i = 0; i < _chunks.size(); ++i) {
+      if (c >= _chunks[i].data && c < _chunks[i].data + _chunks[i].size)
+        return true;
+    }
+    return false;
+  }
+
+  void* GraphArena::allocateInArena(size_t size)
+  {
+    size = (size + Alignment - 1) & ~(Alignment - 1);
+
+    // next chunk (kept from a previous graph) or a new one twice as big
+    while (_current < _chunks.size() && _offset + size > _chunks[_current].size) {
+      ++_current;
+      _offset = 0;
+    }
+    if (_current == _chunks.size()) {
+      size_t chunkSize = _chunks.empty() ? _chunkSize : 2 * _chunks.back().size;
+      addChunk(chunkSize > size ? chunkSize : size);
+    }
+
+    void* p = _chunks[_current].data + _offset;
+    _offset += size;
+    _used += size;
+    return p;
+  }
+
+  void GraphArena::addChunk(size_t size)
+  {
+    Chunk chunk;
+    chunk.data = static_cast<char*>(Eigen::internal::aligned_malloc(size));
+    chunk.size = size;
+    _chunks.push_back(chunk);
+  }
+
+  void GraphArena::reset()
+  {
+    // merge chunks, so a graph of the same size fits in a single one next time
+    if (_chunks.size() > 1) {
+      size_t total = 0;
+      for (size_t i = 0; i < _chunks.size(); ++i) {
+        total += _chunks[i].size;
+        Eigen::internal::aligned_free(_chunks[i].data);
+      }
+      _chunks.clear();
+      addChunk(total);
+    }
+    _current = 0;
+    _offset = 0;
+    _used = 0;
+  }
+
+  ScopedGraphArena::ScopedGraphArena(GraphArena& arena) :
+    _arena(arena), _previous(currentArena)
+  {
+    currentArena = &arena;
+  }
+
+  ScopedGraphArena::~ScopedGraphArena()
+  {
+    currentArena = _previous;
+    _arena.reset();
+  }
+
+} // end namespace
@@ -0,0 +1,121 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_GRAPH_ARENA_H
+#define G2O_GRAPH_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace g2o {
+
+  /**
+   * \brief bump pointer arena for the vertices, edges and robust kernels of a graph
+   *
+   * While a ScopedGraphArena is active on a thread, graph objects created on that thread are
+   * carved from the arena, and deleting them only runs their destructor. Memory is reused
+   * when the scope ends, so building and destroying a graph costs a few pointer increments.
+   * Objects created in an arena must be deleted before its scope ends, on the same thread
+   * (e.g. the optimizer is declared after the scope). Other objects use the aligned heap.
+   */
+  class GraphArena
+  {
+    public:
+      //! alignment of every object, enough for vectorized Eigen members
+      static const size_t Alignment = 32;
+
+      explicit GraphArena(size_t chunkSize = 1 << 20);
+      ~GraphArena();
+
+      //! arena active on this thread, 0 if none
+      static GraphArena* current();
+
+      //! allocate from the current arena, or from the aligned heap if there is none
+      static void* allocate(size_t size);
+      //! release memory returned by allocate, arena memory is kept until the scope ends
+      static void release(void* p);
+
+      //! true if p was allocated in this arena
+      bool owns(const void* p) const;
+
+      //! bytes allocated since last reset
+      size_t used() const { return _used;}
+
+      //! forget every allocation, memory is kept for the next graph
+      void reset();
+
+    protected:
+      void* allocateInArena(size_t size);
+      void addChunk(size_t size);
+
+      struct Chunk {
+        char* data;
+        size_t size;
+      };
+
+      std::vector<Chunk> _chunks;
+      size_t _chunkSize;
+      size_t _current;    //!< chunk being filled
+      size_t _offset;     //!< first free byte in current chunk
+      size_t _used;
+
+    private:
+      GraphArena(const GraphArena&);
+      GraphArena& operator=(const GraphArena&);
+
+      friend class ScopedGraphArena;
+  };
+
+  /**
+   * \brief makes an arena current on this thread until destroyed, then resets it
+   */
+  class ScopedGraphArena
+  {
+    public:
+      explicit ScopedGraphArena(GraphArena& arena);
+      ~ScopedGraphArena();
+
+    private:
+      GraphArena& _arena;
+      GraphArena* _previous;
+
+      ScopedGraphArena(const ScopedGraphArena&);
+      ScopedGraphArena& operator=(const ScopedGraphArena&);
+  };
+
+} // end namespace
+
+/**
+ * operators of classes allocated through GraphArena, in place of EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+ */
+#define G2O_ARENA_OPERATOR_NEW \
+  void* operator new(std::size_t size) { return g2o::GraphArena::allocate(size); } \
+  void operator delete(void* p) { g2o::GraphArena::release(p); } \
+  void* operator new(std::size_t, void* ptr) { return ptr; } \
+  void operator delete(void*, void*) {}
+
+#endif
@@ -31,6 +31,27 @@
 
 namespace g2o {
 
+/**
+ * \brief symmetric system matrix A given only by its products, for solvers that never store it
+ */
+template <typename MatrixType>
+class LinearOperator
+{
+  public:
+    virtual ~LinearOperator() {}
+
+    //! dimension of A
+    virtual int rows() const = 0;
+    //! number of diagonal blocks
+    virtual int numBlocks() const = 0;
+    //! first row of block i
+    virtual int rowBaseOfBlock(int i) const = 0;
+    //! diagonal block i of A
+    virtual const MatrixType& diagonalBlock(int i) const = 0;
+    //! y = A x
+    virtual void multiply(double* y, const double* x) const = 0;
+};
+
 /**
  * \brief basic solver for Ax = b
  *
@@ -75,6 +96,17 @@ class LinearSolver
       return false;
     }
 
+    /**
+     * true if the solver only needs products with A, then the block solver calls solveImplicit
+     * and never builds the Schur complement
+     */
+    virtual bool implicit() const { return false;}
+
+    /**
+     * solve system Ax = b with A given as an operator, x and b have to allocated beforehand!!
+     */
+    virtual bool solveImplicit(const LinearOperator<MatrixType>& A, double* x, double* b) { (void) A; (void) x; (void) b; return false;}
+
     //! write a debug dump of the system matrix if it is not PSD in solve
     virtual bool writeDebug() const { return false;}
     virtual void setWriteDebug(bool) {}
@@ -76,6 +76,25 @@ namespace g2o {
 #endif
   };
 
+#endif
+
+#ifdef G2O_OPENMP
+
+  /**
+   * \brief set the number of threads of the parallel regions started by the
+   * calling thread within a scope, the previous value is restored on exit
+   */
+  class ScopedOpenMPThreads
+  {
+    public:
+      explicit ScopedOpenMPThreads(int numThreads) : _previous(omp_get_max_threads()) { omp_set_num_threads(numThreads > 0 ? numThreads : 1); }
+      ~ScopedOpenMPThreads() { omp_set_num_threads(_previous); }
+    private:
+      int _previous;
+      ScopedOpenMPThreads(const ScopedOpenMPThreads&);
+      void operator=(const ScopedOpenMPThreads&);
+  };
+
 #endif
 
   /**
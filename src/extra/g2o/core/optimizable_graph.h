@@ -35,6 +35,7 @@
 #include <typeinfo>
 
 #include "openmp_mutex.h"
+#include "graph_arena.h"
 #include "hyper_graph.h"
 #include "parameter.h"
 #include "parameter_container.h"
@@ -34,6 +34,8 @@
 #endif
 #include <Eigen/Core>
 
+#include "graph_arena.h"
+
 
 namespace g2o {
 
@@ -51,6 +53,7 @@ namespace g2o {
   class  RobustKernel
   {
     public:
+      G2O_ARENA_OPERATOR_NEW
       RobustKernel();
       explicit RobustKernel(double delta);
       virtual ~RobustKernel() {}
@@ -38,6 +38,7 @@
 #include "batch_stats.h"
 #include "hyper_graph_action.h"
 #include "robust_kernel.h"
+#include "openmp_mutex.h"
 #include "../stuff/timeutil.h"
 #include "../stuff/macros.h"
 #include "../stuff/misc.h"
@@ -48,9 +49,10 @@ namespace g2o{
 
 
   SparseOptimizer::SparseOptimizer() :
-    _forceStopFlag(0), _verbose(false), _algorithm(0), _computeBatchStatistics(false)
+    _forceStopFlag(0), _verbose(false), _numThreads(1), _algorithm(0), _computeBatchStatistics(false)
   {
     _graphActions.resize(AT_NUM_ELEMENTS);
+    initMultiThreading();
   }
 
   SparseOptimizer::~SparseOptimizer(){
@@ -358,6 +360,11 @@ namespace g2o{
       return -1;
     }
 
+#   ifdef G2O_OPENMP
+    // all parallel regions below (errors, linearization, Schur complement) use this team size
+    ScopedOpenMPThreads scopedThreads(_numThreads);
+#   endif
+
     int cjIterations = 0;
     double cumTime = 0;
     bool ok=true;
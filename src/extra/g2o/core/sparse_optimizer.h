@@ -187,6 +187,11 @@ namespace g2o {
     //! if external stop flag is given, return its state. False otherwise
     bool terminate() {return _forceStopFlag ? (*_forceStopFlag) : false; }
 
+    //! number of threads used by optimize(), only effective if compiled with G2O_OPENMP
+    int numThreads() const { return _numThreads; }
+    //! set the number of threads used by optimize(), 1 runs single threaded
+    void setNumThreads(int numThreads) { _numThreads = numThreads; }
+
     //! the index mapping of the vertices
     const VertexContainer& indexMapping() const {return _ivMap;}
     //! the vertices active in the current optimization
@@ -289,6 +294,7 @@ namespace g2o {
     protected:
     bool* _forceStopFlag;
     bool _verbose;
+    int _numThreads;
 
     VertexContainer _ivMap;
     VertexContainer _activeVertices;   ///< sorted according to VertexIDCompare
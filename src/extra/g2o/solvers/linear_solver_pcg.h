@@ -0,0 +1,190 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_LINEAR_SOLVER_PCG_H
+#define G2O_LINEAR_SOLVER_PCG_H
+
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+
+#include "../core/linear_solver.h"
+#include "../core/batch_stats.h"
+#include "../stuff/timeutil.h"
+
+#include "../core/eigen_types.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace g2o {
+
+/**
+ * \brief preconditioned conjugate gradient with a block Jacobi preconditioner
+ *
+ * Only products with A and its diagonal blocks are needed. With a block solver doing Schur
+ * elimination, A is the reduced camera system applied implicitly as Hpp - Hpl Hll^-1 Hpl^T,
+ * so memory stays linear in the number of observations. Meant for large problems where
+ * the fill-in of a Cholesky factorization is too expensive, at the price of an inexact
+ * solution.
+ */
+template <typename MatrixType>
+class LinearSolverPCG: public LinearSolver<MatrixType>
+{
+  public:
+    LinearSolverPCG() :
+      LinearSolver<MatrixType>(),
+      _tolerance(1e-6), _maxIterations(-1), _iterations(0), _residual(0)
+    {
+    }
+
+    virtual ~LinearSolverPCG()
+    {
+    }
+
+    virtual bool init()
+    {
+      return true;
+    }
+
+    virtual bool implicit() const { return true;}
+
+    bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      SparseOperator op(A);
+      return solveImplicit(op, x, b);
+    }
+
+    virtual bool solveImplicit(const LinearOperator<MatrixType>& A, double* x, double* b)
+    {
+      double t=get_monotonic_time();
+      const int n = A.rows();
+
+      // Inverse of the diagonal blocks
+      _preconditioner.resize(A.numBlocks());
+      for (int i = 0; i < A.numBlocks(); ++i) {
+        const MatrixType& D = A.diagonalBlock(i);
+        Eigen::LDLT<MatrixType> ldlt(D);
+        if (ldlt.info() != Eigen::Success)
+          return false;
+        _preconditioner[i] = ldlt.solve(MatrixType::Identity(D.rows(), D.cols()));
+      }
+
+      Eigen::Map<VectorXD> xv(x, n);
+      Eigen::Map<const VectorXD> bv(b, n);
+      _r = bv;
+      _z.resize(n);
+      _q.resize(n);
+      xv.setZero();
+
+      applyPreconditioner(A, _r, _z);
+      _p = _z;
+      double rz = _r.dot(_z);
+      const double bNorm2 = bv.squaredNorm();
+      const double threshold = _tolerance*_tolerance*bNorm2;
+      const int maxIterations = _maxIterations > 0 ? _maxIterations : n;
+
+      _iterations = 0;
+      _residual = _r.squaredNorm();
+      while (_residual > threshold && _iterations < maxIterations) {
+        A.multiply(_q.data(), _p.data());
+        const double pq = _p.dot(_q);
+        if (pq <= 0 || !std::isfinite(pq))
+          break;
+
+        const double alpha = rz/pq;
+        xv += alpha*_p;
+        _r -= alpha*_q;
+        _residual = _r.squaredNorm();
+        ++_iterations;
+
+        applyPreconditioner(A, _r, _z);
+        const double rzNew = _r.dot(_z);
+        _p = _z + (rzNew/rz)*_p;
+        rz = rzNew;
+      }
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats) {
+        globalStats->timeNumericDecomposition = get_monotonic_time() - t;
+        globalStats->iterationsLinearSolver = _iterations;
+      }
+
+      return std::isfinite(_residual);
+    }
+
+    //! relative residual |r|/|b| to stop
+    double tolerance() const { return _tolerance;}
+    void setTolerance(double tolerance) { _tolerance = tolerance;}
+
+    //! maximum number of iterations, the system size if not positive
+    int maxIterations() const { return _maxIterations;}
+    void setMaxIterations(int maxIter) { _maxIterations = maxIter;}
+
+    //! iterations and squared residual of the last solve
+    int iterations() const { return _iterations;}
+    double residual() const { return _residual;}
+
+  protected:
+    //! explicitly stored A, upper triangle
+    class SparseOperator : public LinearOperator<MatrixType>
+    {
+      public:
+        explicit SparseOperator(const SparseBlockMatrix<MatrixType>& A) : _A(A) {}
+        int rows() const { return _A.rows();}
+        int numBlocks() const { return _A.blockCols().size();}
+        int rowBaseOfBlock(int i) const { return _A.rowBaseOfBlock(i);}
+        const MatrixType& diagonalBlock(int i) const { return *_A.block(i, i);}
+        void multiply(double* y, const double* x) const
+        {
+          memset(y, 0, _A.rows() * sizeof(double));
+          _A.multiplySymmetricUpperTriangle(y, x);
+        }
+      protected:
+        const SparseBlockMatrix<MatrixType>& _A;
+    };
+
+    void applyPreconditioner(const LinearOperator<MatrixType>& A, const VectorXD& src, VectorXD& dest) const
+    {
+      for (size_t i = 0; i < _preconditioner.size(); ++i) {
+        const int base = A.rowBaseOfBlock(i);
+        const MatrixType& P = _preconditioner[i];
+        dest.segment(base, P.rows()).noalias() = P*src.segment(base, P.rows());
+      }
+    }
+
+    double _tolerance;
+    int _maxIterations;
+    int _iterations;
+    double _residual;
+
+    std::vector<MatrixType, Eigen::aligned_allocator<MatrixType> > _preconditioner;
+    VectorXD _r, _z, _p, _q;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,394 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_LINEAR_SOLVER_SUPERNODAL_H
+#define G2O_LINEAR_SOLVER_SUPERNODAL_H
+
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+#include <Eigen/Dense>
+
+#include "../core/linear_solver.h"
+#include "../core/batch_stats.h"
+#include "../stuff/timeutil.h"
+
+#include "../core/eigen_types.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+namespace g2o {
+
+/**
+ * \brief supernodal sparse Cholesky solver working on the block structure of A
+ *
+ * The symbolic phase runs once per non-zero pattern: AMD ordering of the block
+ * graph, elimination tree, fill-in pattern of L and grouping of consecutive block
+ * columns with the same structure into supernodes. Each supernode is stored as a
+ * dense panel, so the numeric factorization is a sequence of dense Cholesky,
+ * triangular solve and matrix product kernels. Pays off for large systems such as
+ * global BA or the essential graph, where the simplicial solver is dominated by
+ * scalar indexing.
+ */
+template <typename MatrixType>
+class LinearSolverSupernodal: public LinearSolver<MatrixType>
+{
+  public:
+    typedef Eigen::SparseMatrix<double, Eigen::ColMajor> SparseMatrix;
+    typedef Eigen::Triplet<double> Triplet;
+    typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> PermutationMatrix;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor> DenseMatrix;
+
+  public:
+    LinearSolverSupernodal() :
+      LinearSolver<MatrixType>(),
+      _init(true), _writeDebug(false)
+    {
+    }
+
+    virtual ~LinearSolverSupernodal()
+    {
+    }
+
+    virtual bool init()
+    {
+      _init = true;
+      return true;
+    }
+
+    bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      if (_init) // compute the symbolic decomposition once
+        computeSymbolicDecomposition(A);
+      _init = false;
+
+      double t=get_monotonic_time();
+      if (!computeNumericDecomposition(A)) { // the matrix is not positive definite
+        if (_writeDebug) {
+          std::cerr << "Cholesky failure, writing debug.txt (Hessian loadable by Octave)" << std::endl;
+          A.writeOctave("debug.txt");
+        }
+        return false;
+      }
+
+      // Permute b into elimination order
+      VectorXD y(_size);
+      for (size_t k = 0; k < _order.size(); ++k) {
+        const int base = A.colBaseOfBlock(_order[k]);
+        for (int j = 0; j < _blockSize[k]; ++j)
+          y(_blockBase[k] + j) = b[base + j];
+      }
+
+      // Forward substitution, L z = y
+      for (size_t s = 0; s < _supernodes.size(); ++s) {
+        const Supernode& sn = _supernodes[s];
+        const DenseMatrix& L = _panels[s];
+        y.segment(sn.base, sn.width) = L.topRows(sn.width).template triangularView<Eigen::Lower>().solve(y.segment(sn.base, sn.width));
+        for (size_t r = 0; r < sn.rows.size(); ++r) {
+          const RowBlock& rb = sn.rows[r];
+          y.segment(_blockBase[rb.block], _blockSize[rb.block]).noalias() -=
+              L.block(rb.offset, 0, _blockSize[rb.block], sn.width) * y.segment(sn.base, sn.width);
+        }
+      }
+
+      // Backward substitution, L^T x = z
+      for (int s = static_cast<int>(_supernodes.size()) - 1; s >= 0; --s) {
+        const Supernode& sn = _supernodes[s];
+        const DenseMatrix& L = _panels[s];
+        for (size_t r = 0; r < sn.rows.size(); ++r) {
+          const RowBlock& rb = sn.rows[r];
+          y.segment(sn.base, sn.width).noalias() -=
+              L.block(rb.offset, 0, _blockSize[rb.block], sn.width).transpose() * y.segment(_blockBase[rb.block], _blockSize[rb.block]);
+        }
+        y.segment(sn.base, sn.width) = L.topRows(sn.width).template triangularView<Eigen::Lower>().transpose().solve(y.segment(sn.base, sn.width));
+      }
+
+      for (size_t k = 0; k < _order.size(); ++k) {
+        const int base = A.colBaseOfBlock(_order[k]);
+        for (int j = 0; j < _blockSize[k]; ++j)
+          x[base + j] = y(_blockBase[k] + j);
+      }
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats) {
+        globalStats->timeNumericDecomposition = get_monotonic_time() - t;
+        globalStats->choleskyNNZ = _nonZeros;
+      }
+
+      return true;
+    }
+
+    //! write a debug dump of the system matrix if it is not SPD in solve
+    virtual bool writeDebug() const { return _writeDebug;}
+    virtual void setWriteDebug(bool b) { _writeDebug = b;}
+
+  protected:
+    //! block row of a supernode panel and its first scalar row inside the panel
+    struct RowBlock
+    {
+      int block;
+      int offset;
+      bool operator<(const RowBlock& other) const { return block < other.block; }
+    };
+
+    //! consecutive block columns [first, last] sharing the same structure below the diagonal
+    struct Supernode
+    {
+      int first;
+      int last;
+      int base;                     ///< first scalar column
+      int width;                    ///< number of scalar columns
+      std::vector<RowBlock> rows;   ///< block rows below the diagonal, sorted
+    };
+
+    bool _init;
+    bool _writeDebug;
+    int _size;
+    size_t _nonZeros;
+
+    std::vector<int> _order;        ///< original block column of the k-th eliminated block
+    std::vector<int> _position;     ///< elimination position of each original block column
+    std::vector<int> _blockSize;    ///< scalar size of each block, in elimination order
+    std::vector<int> _blockBase;    ///< first scalar index of each block, in elimination order
+    std::vector<int> _supernodeOf;  ///< supernode containing each block, in elimination order
+    std::vector<Supernode> _supernodes;
+    std::vector<DenseMatrix> _panels;
+
+    //! offset of block row b inside the panel of supernode s (b has to be part of its structure)
+    int rowOffset(int s, int b) const
+    {
+      const Supernode& sn = _supernodes[s];
+      if (b <= sn.last)
+        return _blockBase[b] - sn.base;
+      RowBlock key;
+      key.block = b;
+      typename std::vector<RowBlock>::const_iterator it = std::lower_bound(sn.rows.begin(), sn.rows.end(), key);
+      assert(it != sn.rows.end() && it->block == b && "block is not part of the supernode structure");
+      return it->offset;
+    }
+
+    /**
+     * compute the symbolic decompostion of the matrix only once.
+     * Since A has the same pattern in all the iterations, the ordering,
+     * the structure of L and the supernode partition are re-used for all
+     * the following iterations.
+     */
+    void computeSymbolicDecomposition(const SparseBlockMatrix<MatrixType>& A)
+    {
+      double t=get_monotonic_time();
+      const int n = A.blockCols().size();
+
+      // AMD ordering on the block structure
+      {
+        std::vector<Triplet> triplets;
+        for (int c = 0; c < n; ++c){
+          const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+          for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+            if (it->first > c) // only upper triangle
+              break;
+            triplets.push_back(Triplet(it->first, c, 0.));
+          }
+        }
+
+        SparseMatrix auxBlockMatrix(n, n);
+        auxBlockMatrix.setFromTriplets(triplets.begin(), triplets.end());
+        SparseMatrix C;
+        C = auxBlockMatrix.selfadjointView<Eigen::Upper>();
+        PermutationMatrix blockP;
+        Eigen::internal::minimum_degree_ordering(C, blockP);
+
+        _order.resize(n);
+        _position.resize(n);
+        for (int k = 0; k < n; ++k) {
+          _order[k] = blockP.indices()(k);
+          _position[_order[k]] = k;
+        }
+      }
+
+      _blockSize.resize(n);
+      _blockBase.resize(n + 1);
+      _blockBase[0] = 0;
+      for (int k = 0; k < n; ++k) {
+        _blockSize[k] = A.colsOfBlock(_order[k]);
+        _blockBase[k+1] = _blockBase[k] + _blockSize[k];
+      }
+      _size = _blockBase[n];
+
+      // Structure of A below the diagonal, in elimination order
+      std::vector<std::vector<int> > structure(n);
+      for (int c = 0; c < n; ++c){
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first >= c)
+            break;
+          const int i = _position[it->first];
+          const int j = _position[c];
+          structure[std::min(i, j)].push_back(std::max(i, j));
+        }
+      }
+
+      // Symbolic factorization: the structure of each column of L is its own
+      // structure in A plus the one of its children in the elimination tree
+      std::vector<int> parent(n, -1);
+      std::vector<int> merged;
+      for (int j = 0; j < n; ++j) {
+        std::vector<int>& s = structure[j];
+        std::sort(s.begin(), s.end());
+        s.erase(std::unique(s.begin(), s.end()), s.end());
+        if (s.empty())
+          continue;
+        parent[j] = s.front();
+
+        std::vector<int>& p = structure[parent[j]];
+        merged.clear();
+        std::sort(p.begin(), p.end());
+        std::set_union(p.begin(), p.end(), s.begin() + 1, s.end(), std::back_inserter(merged));
+        p.swap(merged);
+      }
+
+      // Fundamental supernodes, block j+1 joins the supernode of j if it is its only
+      // child and both columns have the same structure below j+1
+      std::vector<int> children(n, 0);
+      for (int j = 0; j < n; ++j) {
+        if (parent[j] >= 0)
+          children[parent[j]]++;
+      }
+
+      _supernodes.clear();
+      _supernodeOf.resize(n);
+      _nonZeros = 0;
+      for (int j = 0; j < n; ) {
+        Supernode sn;
+        sn.first = j;
+        sn.last = j;
+        while (sn.last + 1 < n && parent[sn.last] == sn.last + 1 && children[sn.last + 1] == 1 &&
+               structure[sn.last].size() == structure[sn.last + 1].size() + 1)
+          sn.last++;
+
+        sn.base = _blockBase[sn.first];
+        sn.width = _blockBase[sn.last + 1] - sn.base;
+        int offset = sn.width;
+        const std::vector<int>& s = structure[sn.last];
+        sn.rows.resize(s.size());
+        for (size_t r = 0; r < s.size(); ++r) {
+          sn.rows[r].block = s[r];
+          sn.rows[r].offset = offset;
+          offset += _blockSize[s[r]];
+        }
+
+        for (int k = sn.first; k <= sn.last; ++k)
+          _supernodeOf[k] = _supernodes.size();
+        _nonZeros += static_cast<size_t>(offset) * sn.width - static_cast<size_t>(sn.width) * (sn.width - 1) / 2;
+        _supernodes.push_back(sn);
+        j = sn.last + 1;
+      }
+
+      _panels.resize(_supernodes.size());
+      for (size_t s = 0; s < _supernodes.size(); ++s) {
+        const Supernode& sn = _supernodes[s];
+        const int rows = sn.rows.empty() ? sn.width : sn.rows.back().offset + _blockSize[sn.rows.back().block];
+        _panels[s].resize(rows, sn.width);
+      }
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats)
+        globalStats->timeSymbolicDecomposition = get_monotonic_time() - t;
+    }
+
+    /**
+     * right-looking supernodal factorization. Each panel is factorized with dense
+     * kernels and its outer product is scattered into the panels of its ancestors.
+     */
+    bool computeNumericDecomposition(const SparseBlockMatrix<MatrixType>& A)
+    {
+      for (size_t s = 0; s < _panels.size(); ++s)
+        _panels[s].setZero();
+
+      // Scatter A into the lower triangle of the panels
+      const int n = A.blockCols().size();
+      for (int c = 0; c < n; ++c){
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          if (it->first > c)
+            break;
+          const MatrixType& m = *(it->second);
+          const int i = _position[it->first];
+          const int j = _position[c];
+          if (i >= j) {
+            const int s = _supernodeOf[j];
+            _panels[s].block(rowOffset(s, i), _blockBase[j] - _supernodes[s].base, m.rows(), m.cols()) += m;
+          } else {
+            const int s = _supernodeOf[i];
+            _panels[s].block(rowOffset(s, j), _blockBase[i] - _supernodes[s].base, m.cols(), m.rows()) += m.transpose();
+          }
+        }
+      }
+
+      DenseMatrix update;
+      for (size_t s = 0; s < _supernodes.size(); ++s) {
+        const Supernode& sn = _supernodes[s];
+        DenseMatrix& L = _panels[s];
+
+        // Diagonal block
+        Eigen::LLT<DenseMatrix> llt(L.topRows(sn.width));
+        if (llt.info() != Eigen::Success)
+          return false;
+        L.topRows(sn.width) = llt.matrixL();
+
+        if (sn.rows.empty())
+          continue;
+
+        // Off-diagonal panel, B = B L11^-T
+        const int below = L.rows() - sn.width;
+        L.topRows(sn.width).template triangularView<Eigen::Lower>().transpose().template solveInPlace<Eigen::OnTheRight>(L.bottomRows(below));
+
+        // Update of the ancestors with B B^T, lower triangle only
+        update.setZero(below, below);
+        update.template selfadjointView<Eigen::Lower>().rankUpdate(L.bottomRows(below));
+        for (size_t cb = 0; cb < sn.rows.size(); ++cb) {
+          const int bj = sn.rows[cb].block;
+          const int oj = sn.rows[cb].offset - sn.width;
+          const int t = _supernodeOf[bj];
+          const int col = _blockBase[bj] - _supernodes[t].base;
+          for (size_t rb = cb; rb < sn.rows.size(); ++rb) {
+            const int bi = sn.rows[rb].block;
+            const int oi = sn.rows[rb].offset - sn.width;
+            _panels[t].block(rowOffset(t, bi), col, _blockSize[bi], _blockSize[bj]) -=
+                update.block(oi, oj, _blockSize[bi], _blockSize[bj]);
+          }
+        }
+      }
+
+      return true;
+    }
+};
+
+} // end namespace
+
+#endif
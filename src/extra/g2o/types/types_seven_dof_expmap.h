@@ -48,7 +48,7 @@ namespace g2o {
   class VertexSim3Expmap : public BaseVertex<7, Sim3>
   {
   public:
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    G2O_ARENA_OPERATOR_NEW
     VertexSim3Expmap();
     virtual bool read(std::istream& is);
     virtual bool write(std::ostream& os) const;
@@ -99,7 +99,7 @@ namespace g2o {
   class EdgeSim3 : public BaseBinaryEdge<7, Sim3, VertexSim3Expmap, VertexSim3Expmap>
   {
   public:
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    G2O_ARENA_OPERATOR_NEW
     EdgeSim3();
     virtual bool read(std::istream& is);
     virtual bool write(std::ostream& os) const;
@@ -130,7 +130,7 @@ namespace g2o {
 class EdgeSim3ProjectXYZ : public  BaseBinaryEdge<2, Vector2d,  VertexSBAPointXYZ, VertexSim3Expmap>
 {
   public:
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    G2O_ARENA_OPERATOR_NEW
     EdgeSim3ProjectXYZ();
     virtual bool read(std::istream& is);
     virtual bool write(std::ostream& os) const;
@@ -152,7 +152,7 @@ class EdgeSim3ProjectXYZ : public  BaseBinaryEdge<2, Vector2d,  VertexSBAPointXY
 class EdgeInverseSim3ProjectXYZ : public  BaseBinaryEdge<2, Vector2d,  VertexSBAPointXYZ, VertexSim3Expmap>
 {
   public:
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    G2O_ARENA_OPERATOR_NEW
     EdgeInverseSim3ProjectXYZ();
     virtual bool read(std::istream& is);
     virtual bool write(std::ostream& os) const;
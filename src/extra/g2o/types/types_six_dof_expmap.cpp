@@ -364,4 +364,77 @@ void EdgeStereoSE3ProjectXYZOnlyPose::linearizeOplus() {
 }
 
 
+
+//Pose prior
+
+bool EdgeSE3Prior::read(std::istream& is){
+  Vector7d meas;
+  for (int i = 0; i<7; i++)
+    is >> meas[i];
+  _measurement.fromVector(meas);
+  for (int i = 0; i<6; i++)
+    for (int j = i; j < 6; j++) {
+      is >> information()(i, j);
+      if (i != j)
+        information()(j, i)=information()(i, j);
+    }
+  return true;
+}
+
+bool EdgeSE3Prior::write(std::ostream& os) const {
+  Vector7d meas = _measurement.toVector();
+  for (int i = 0; i<7; i++){
+    os << meas[i] << " ";
+  }
+
+  for (int i = 0; i<6; i++)
+    for (int j = i; j < 6; j++){
+      os << " " <<  information()(i, j);
+    }
+  return os.good();
+}
+
+void EdgeSE3Prior::linearizeOplus() {
+  // Left update exp(d)*T moves the error by d (first order)
+  _jacobianOplusXi.setIdentity();
+}
+
+bool EdgeSE3::read(std::istream& is){
+  Vector7d meas;
+  for (int i = 0; i<7; i++)
+    is >> meas[i];
+  _measurement.fromVector(meas);
+  for (int i = 0; i<6; i++)
+    for (int j = i; j < 6; j++) {
+      is >> information()(i, j);
+      if (i != j)
+        information()(j, i)=information()(i, j);
+    }
+  return true;
+}
+
+bool EdgeSE3::write(std::ostream& os) const {
+  Vector7d meas = _measurement.toVector();
+  for (int i = 0; i<7; i++){
+    os << meas[i] << " ";
+  }
+
+  for (int i = 0; i<6; i++)
+    for (int j = i; j < 6; j++){
+      os << " " <<  information()(i, j);
+    }
+  return os.good();
+}
+
+void EdgeSE3::linearizeOplus() {
+  // Error E = Tji*Ti*Tj^-1. Left updates exp(d)*Ti and exp(d)*Tj give, to first order,
+  // E' = exp(Ad(Tji)*d)*E and E' = exp(-Ad(E)*d)*E
+  const VertexSE3Expmap* v1 = static_cast<const VertexSE3Expmap*>(_vertices[0]);
+  const VertexSE3Expmap* v2 = static_cast<const VertexSE3Expmap*>(_vertices[1]);
+  const SE3Quat E = _measurement*v1->estimate()*v2->estimate().inverse();
+
+  _jacobianOplusXi = _measurement.adj();
+  _jacobianOplusXj = -E.adj();
+}
+
 } // end namespace
@@ -30,6 +30,7 @@
 // Added EdgeStereoSE3ProjectXYZ (project using focal_length in x, y directions)
 // Added EdgeSE3ProjectXYZOnlyPose (unary edge to optimize only the camera pose)
 // Added EdgeStereoSE3ProjectXYZOnlyPose (unary edge to optimize only the camera pose)
+// Added EdgeSE3Prior (unary edge keeping a camera pose close to a prior one)
 
 #ifndef G2O_SIX_DOF_TYPES_EXPMAP
 #define G2O_SIX_DOF_TYPES_EXPMAP
@@ -58,7 +59,7 @@ typedef Matrix<double, 6, 6> Matrix6d;
  */
 class  VertexSE3Expmap : public BaseVertex<6, SE3Quat>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_ARENA_OPERATOR_NEW
 
   VertexSE3Expmap();
 
@@ -79,7 +80,7 @@ public:
 
 class  EdgeSE3ProjectXYZ: public  BaseBinaryEdge<2, Vector2d, VertexSBAPointXYZ, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_ARENA_OPERATOR_NEW
 
   EdgeSE3ProjectXYZ();
 
@@ -111,7 +112,7 @@ public:
 
 class  EdgeStereoSE3ProjectXYZ: public  BaseBinaryEdge<3, Vector3d, VertexSBAPointXYZ, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_ARENA_OPERATOR_NEW
 
   EdgeStereoSE3ProjectXYZ();
 
@@ -142,7 +143,7 @@ public:
 
 class  EdgeSE3ProjectXYZOnlyPose: public  BaseUnaryEdge<2, Vector2d, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_ARENA_OPERATOR_NEW
 
   EdgeSE3ProjectXYZOnlyPose(){}
 
@@ -173,7 +174,7 @@ public:
 
 class  EdgeStereoSE3ProjectXYZOnlyPose: public  BaseUnaryEdge<3, Vector3d, VertexSE3Expmap>{
 public:
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  G2O_ARENA_OPERATOR_NEW
 
   EdgeStereoSE3ProjectXYZOnlyPose(){}
 
@@ -203,6 +204,49 @@ public:
 
 
 
+
+class  EdgeSE3Prior: public  BaseUnaryEdge<6, SE3Quat, VertexSE3Expmap>{
+public:
+  G2O_ARENA_OPERATOR_NEW
+
+  EdgeSE3Prior(){}
+
+  bool read(std::istream& is);
+
+  bool write(std::ostream& os) const;
+
+  void computeError()  {
+    const VertexSE3Expmap* v1 = static_cast<const VertexSE3Expmap*>(_vertices[0]);
+    _error = (v1->estimate()*_measurement.inverse()).log();
+  }
+
+  virtual void linearizeOplus();
+};
+
+
+/**
+ * \brief Relative pose between two SE3 vertices, measurement is Tji = Tjw*Tiw^-1.
+ * Same convention as EdgeSim3 (vertex 0 is i, vertex 1 is j), for pose graphs with fixed scale
+ */
+class  EdgeSE3: public  BaseBinaryEdge<6, SE3Quat, VertexSE3Expmap, VertexSE3Expmap>{
+public:
+  G2O_ARENA_OPERATOR_NEW
+
+  EdgeSE3(){}
+
+  bool read(std::istream& is);
+
+  bool write(std::ostream& os) const;
+
+  void computeError()  {
+    const VertexSE3Expmap* v1 = static_cast<const VertexSE3Expmap*>(_vertices[0]);
+    const VertexSE3Expmap* v2 = static_cast<const VertexSE3Expmap*>(_vertices[1]);
+    _error = (_measurement*v1->estimate()*v2->estimate().inverse()).log();
+  }
+
+  virtual void linearizeOplus();
+};
+
 } // end namespace
 
 #endif
@@ -0,0 +1,345 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "image_codec.h"
+#include <string.h>
+#include <cstdlib>
+#include <algorithm>
+
+using std::vector;
+
+namespace SD_SLAM {
+
+namespace {
+
+const int ESCAPE = 24;            // Unary prefix length followed by a raw 32-bit value
+const int CONTEXTS = 16;          // Contexts by gradient magnitude (bit length)
+const int32_t MAX_QUANTIZED = 1 << 30;
+
+enum Coding {
+  RAW = 0,
+  RICE = 1,
+};
+
+struct Header {
+  int32_t rows, cols, type;
+  int32_t coding;
+  float step;
+  uint32_t padding;
+};
+
+// Most significant bit first
+class BitWriter {
+ public:
+  explicit BitWriter(vector<uint8_t> &out) : out_(out), acc_(0), n_(0) {}
+
+  // Append the count (<= 32) lowest bits of bits
+  inline void Put(uint32_t bits, int count) {
+    acc_ = (acc_ << count) | bits;
+    n_ += count;
+    while (n_ >= 8) {
+      n_ -= 8;
+      out_.push_back(static_cast<uint8_t>(acc_ >> n_));
+    }
+  }
+
+  inline void Flush() {
+    if (n_ > 0)
+      Put(0, 8-n_);
+  }
+
+ private:
+  vector<uint8_t> &out_;
+  uint64_t acc_;
+  int n_;
+};
+
+class BitReader {
+ public:
+  BitReader(const uint8_t *p, const uint8_t *end) : p_(p), end_(end), acc_(0), n_(0), padding_(0) {}
+
+  inline uint32_t Get(int count) {
+    if (count == 0)
+      return 0;
+    Refill();
+    n_ -= count;
+    return static_cast<uint32_t>((acc_ >> n_) & ((static_cast<uint64_t>(1) << count) - 1));
+  }
+
+  // Number of leading ones, up to max. The zero after them is consumed too
+  inline int Unary(int max) {
+    Refill();
+    const uint64_t top = ~(acc_ << (64-n_));
+    const int ones = top == 0 ? 64 : __builtin_clzll(top);
+    if (ones >= max) {
+      n_ -= max;
+      return max;
+    }
+    n_ -= ones+1;
+    return ones;
+  }
+
+  // Bits past the end of data were used
+  inline bool Overrun() const { return 8*padding_ > n_; }
+
+ private:
+  inline void Refill() {
+    while (n_ <= 56) {
+      uint8_t byte = 0;
+      if (p_ < end_)
+        byte = *p_++;
+      else
+        padding_++;
+      acc_ = (acc_ << 8) | byte;
+      n_ += 8;
+    }
+  }
+
+  const uint8_t *p_;
+  const uint8_t *end_;
+  uint64_t acc_;
+  int n_;
+  int padding_;
+};
+
+// Running mean of coded values, it selects the Rice parameter k: the smallest one
+// with n*2^k >= a. It is adjusted on each update, it rarely moves more than one step
+struct Context {
+  uint64_t a;
+  uint32_t n;
+  int k;
+
+  Context() : a(4), n(1), k(2) {}
+
+  inline void Update(uint32_t v) {
+    a += v;
+    if (++n == 64) {
+      a >>= 1;
+      n >>= 1;
+    }
+
+    while ((static_cast<uint64_t>(n) << k) < a && k < 31)
+      k++;
+    while (k > 0 && (static_cast<uint64_t>(n) << (k-1)) >= a)
+      k--;
+  }
+};
+
+inline void PutRice(BitWriter &w, uint32_t v, int k) {
+  const uint32_t q = v >> k;
+  if (q < ESCAPE) {
+    w.Put(((1u << q) - 1) << 1, q+1);
+    if (k > 0)
+      w.Put(v & ((1u << k) - 1), k);
+  } else {
+    w.Put((1u << ESCAPE) - 1, ESCAPE);
+    w.Put(v, 32);
+  }
+}
+
+inline uint32_t GetRice(BitReader &r, int k) {
+  const int q = r.Unary(ESCAPE);
+  if (q == ESCAPE)
+    return r.Get(32);
+  return (static_cast<uint32_t>(q) << k) | r.Get(k);
+}
+
+// Median predictor from left (a), top (b) and top-left (c) neighbours
+inline int32_t Predict(int32_t a, int32_t b, int32_t c) {
+  if (c >= std::max(a, b))
+    return std::min(a, b);
+  if (c <= std::min(a, b))
+    return std::max(a, b);
+  return static_cast<int64_t>(a) + b - c;
+}
+
+inline int ContextIndex(int32_t a, int32_t b, int32_t c) {
+  const uint64_t d = std::abs(static_cast<int64_t>(a) - c) + std::abs(static_cast<int64_t>(b) - c);
+  return d == 0 ? 0 : std::min(CONTEXTS-1, 64 - __builtin_clzll(d));
+}
+
+// Neighbours of pixel x. First row uses a zero row above, first column the pixel above
+inline void Neighbours(const vector<int32_t> &prev, const vector<int32_t> &cur, int x, int32_t &a, int32_t &b, int32_t &c) {
+  b = prev[x];
+  a = x > 0 ? cur[x-1] : b;
+  c = x > 0 ? prev[x-1] : b;
+}
+
+inline uint32_t ZigZag(int32_t v) {
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+inline int32_t UnZigZag(uint32_t v) {
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+void LoadRow(const cv::Mat &im, int r, double invStep, vector<int32_t> &row) {
+  if (im.type() == CV_8U) {
+    const uint8_t *p = im.ptr<uint8_t>(r);
+    for (int x = 0; x < im.cols; x++)
+      row[x] = p[x];
+  } else if (im.type() == CV_16U) {
+    const uint16_t *p = im.ptr<uint16_t>(r);
+    for (int x = 0; x < im.cols; x++)
+      row[x] = p[x];
+  } else {
+    const float *p = im.ptr<float>(r);
+    for (int x = 0; x < im.cols; x++) {
+      // Also false for NaN
+      if (p[x] > 0)
+        row[x] = static_cast<int32_t>(std::min(p[x]*invStep + 0.5, static_cast<double>(MAX_QUANTIZED)));
+      else
+        row[x] = 0;
+    }
+  }
+}
+
+void StoreRow(const vector<int32_t> &row, float step, int r, cv::Mat &im) {
+  if (im.type() == CV_8U) {
+    uint8_t *p = im.ptr<uint8_t>(r);
+    for (int x = 0; x < im.cols; x++)
+      p[x] = static_cast<uint8_t>(row[x]);
+  } else if (im.type() == CV_16U) {
+    uint16_t *p = im.ptr<uint16_t>(r);
+    for (int x = 0; x < im.cols; x++)
+      p[x] = static_cast<uint16_t>(row[x]);
+  } else {
+    float *p = im.ptr<float>(r);
+    for (int x = 0; x < im.cols; x++)
+      p[x] = row[x]*step;
+  }
+}
+
+}  // namespace
+
+void CompressImage(const cv::Mat &im, float step, vector<uint8_t> &data) {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.rows = im.rows;
+  header.cols = im.cols;
+  header.type = im.type();
+  header.step = step;
+  header.coding = (im.type() == CV_8U || im.type() == CV_16U || (im.type() == CV_32F && step > 0)) ? RICE : RAW;
+
+  data.resize(sizeof(header));
+  memcpy(data.data(), &header, sizeof(header));
+
+  if (header.coding == RAW) {
+    // Images can be submatrices, rows are stored contiguously
+    const size_t row_size = im.cols*im.elemSize();
+    for (int r = 0; r < im.rows; r++)
+      data.insert(data.end(), im.ptr(r), im.ptr(r) + row_size);
+    return;
+  }
+
+  // Usual images compress to about half
+  data.reserve(sizeof(header) + im.total()*im.elemSize()/2);
+
+  const bool bWrap = im.type() == CV_8U;
+  const double invStep = 1.0/step;
+  vector<int32_t> prev(im.cols, 0), cur(im.cols);
+  Context contexts[CONTEXTS];
+  BitWriter w(data);
+
+  for (int r = 0; r < im.rows; r++) {
+    LoadRow(im, r, invStep, cur);
+
+    for (int x = 0; x < im.cols; x++) {
+      int32_t a, b, c;
+      Neighbours(prev, cur, x, a, b, c);
+      Context &ctx = contexts[ContextIndex(a, b, c)];
+
+      // 8-bit residuals are taken modulo 256, so they fit in [-128, 127]
+      int32_t res = cur[x] - Predict(a, b, c);
+      if (bWrap)
+        res = static_cast<int8_t>(res);
+
+      const uint32_t v = ZigZag(res);
+      PutRice(w, v, ctx.k);
+      ctx.Update(v);
+    }
+
+    prev.swap(cur);
+  }
+
+  w.Flush();
+}
+
+cv::Mat DecompressImage(const uint8_t *data, size_t size) {
+  Header header;
+  if (size < sizeof(header))
+    return cv::Mat();
+  memcpy(&header, data, sizeof(header));
+
+  if (header.rows < 0 || header.cols < 0 || CV_MAT_CN(header.type) > 4 || CV_MAT_DEPTH(header.type) > CV_64F)
+    return cv::Mat();
+
+  const uint8_t *p = data + sizeof(header);
+  const uint8_t *end = data + size;
+  const size_t elemSize = CV_ELEM_SIZE(header.type);
+
+  if (header.coding == RAW) {
+    if (static_cast<size_t>(end-p)/std::max<size_t>(elemSize, 1) < static_cast<size_t>(header.rows)*header.cols)
+      return cv::Mat();
+    cv::Mat im(header.rows, header.cols, header.type);
+    memcpy(im.data, p, im.total()*elemSize);
+    return im;
+  }
+
+  if (header.coding != RICE || (header.type != CV_8U && header.type != CV_16U && header.type != CV_32F))
+    return cv::Mat();
+
+  // Each pixel takes one bit at least
+  if (static_cast<size_t>(header.rows)*header.cols > 8*static_cast<size_t>(end-p))
+    return cv::Mat();
+
+  cv::Mat im(header.rows, header.cols, header.type);
+  const bool bWrap = header.type == CV_8U;
+  vector<int32_t> prev(header.cols, 0), cur(header.cols);
+  Context contexts[CONTEXTS];
+  BitReader reader(p, end);
+
+  for (int r = 0; r < header.rows; r++) {
+    for (int x = 0; x < header.cols; x++) {
+      int32_t a, b, c;
+      Neighbours(prev, cur, x, a, b, c);
+      Context &ctx = contexts[ContextIndex(a, b, c)];
+
+      const uint32_t v = GetRice(reader, ctx.k);
+      ctx.Update(v);
+
+      // Unsigned, corrupted data must not overflow
+      int32_t value = static_cast<int32_t>(static_cast<uint32_t>(Predict(a, b, c)) + static_cast<uint32_t>(UnZigZag(v)));
+      if (bWrap)
+        value &= 255;
+      else if (header.type == CV_16U)
+        value &= 0xffff;
+      cur[x] = value;
+    }
+
+    StoreRow(cur, header.step, r, im);
+    prev.swap(cur);
+  }
+
+  if (reader.Overrun())
+    return cv::Mat();
+
+  return im;
+}
+
+}  // namespace SD_SLAM
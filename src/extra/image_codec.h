@@ -0,0 +1,40 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_IMAGE_CODEC_H_
+#define SD_SLAM_IMAGE_CODEC_H_
+
+#include <stdint.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Compress a single channel image. Each pixel is predicted from its left, top and top-left
+// neighbours (LOCO-I median predictor) and the residual is written with a Rice code whose
+// parameter adapts to the local gradient. 8 and 16-bit images are lossless. Float images (depth)
+// are quantized to step first, so values are kept within step/2; zero, negative and NaN
+// values are decoded as 0. Other types are stored uncompressed
+void CompressImage(const cv::Mat &im, float step, std::vector<uint8_t> &data);
+
+// Decode an image compressed with CompressImage. Returns an empty image if data is not valid
+cv::Mat DecompressImage(const uint8_t *data, size_t size);
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_IMAGE_CODEC_H_
@@ -0,0 +1,214 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "input_log.h"
+#include <string.h>
+#include <opencv2/highgui/highgui.hpp>
+
+using std::string;
+using std::vector;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+namespace {
+
+const char MAGIC[4] = {'S', 'D', 'I', 'N'};
+
+enum Encoding {
+  RAW = 0,
+  PNG = 1,
+};
+
+// Sanity limits for malformed files
+const uint32_t MAX_IMAGES = 64;
+const uint32_t MAX_VALUES = 1 << 20;
+const uint32_t MAX_FILENAME = 4096;
+
+template <typename T>
+inline void WriteValue(std::ofstream &f, const T &v) {
+  f.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template <typename T>
+inline bool ReadValue(std::ifstream &f, T &v) {
+  return static_cast<bool>(f.read(reinterpret_cast<char*>(&v), sizeof(T)));
+}
+
+}  // namespace
+
+const uint32_t InputRecorder::VERSION = 1;
+
+InputRecorder::InputRecorder() : timer_(false) {
+}
+
+InputRecorder::~InputRecorder() {
+  Close();
+}
+
+bool InputRecorder::Open(const string &filename, int sensor) {
+  unique_lock<mutex> lock(mutex_);
+  if (file_.is_open())
+    file_.close();
+
+  file_.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!file_.is_open())
+    return false;
+
+  file_.write(MAGIC, 4);
+  WriteValue(file_, VERSION);
+  WriteValue(file_, static_cast<uint32_t>(sensor));
+  timer_.Start();
+
+  return static_cast<bool>(file_);
+}
+
+void InputRecorder::Close() {
+  unique_lock<mutex> lock(mutex_);
+  if (file_.is_open())
+    file_.close();
+}
+
+void InputRecorder::Write(InputRecord &record) {
+  unique_lock<mutex> lock(mutex_);
+  if (!file_.is_open())
+    return;
+
+  timer_.Stop();
+  record.time = timer_.GetTime();
+
+  WriteValue(file_, record.type);
+  WriteValue(file_, record.time);
+  WriteValue(file_, record.timestamp);
+
+  WriteValue(file_, static_cast<uint32_t>(record.images.size()));
+  for (const cv::Mat &im : record.images)
+    WriteMat(im);
+
+  WriteValue(file_, static_cast<uint8_t>(record.depth.empty() ? 0 : 1));
+  if (!record.depth.empty())
+    WriteMat(record.depth);
+
+  WriteValue(file_, static_cast<uint32_t>(record.values.size()));
+  file_.write(reinterpret_cast<const char*>(record.values.data()), record.values.size()*sizeof(double));
+
+  WriteValue(file_, static_cast<uint32_t>(record.filename.size()));
+  file_.write(record.filename.data(), record.filename.size());
+}
+
+void InputRecorder::WriteMat(const cv::Mat &m) {
+  int32_t header[3] = {m.rows, m.cols, m.type()};
+  file_.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+  // Fastest PNG compression, recording should not slow down the system much
+  const int depth = m.depth();
+  if (!m.empty() && (depth == CV_8U || depth == CV_16U) &&
+      cv::imencode(".png", m, buffer_, vector<int>{cv::IMWRITE_PNG_COMPRESSION, 1})) {
+    WriteValue(file_, static_cast<uint8_t>(PNG));
+    WriteValue(file_, static_cast<uint32_t>(buffer_.size()));
+    file_.write(reinterpret_cast<const char*>(buffer_.data()), buffer_.size());
+    return;
+  }
+
+  // Images can be submatrices, rows are written contiguously
+  const size_t row_size = m.cols*m.elemSize();
+  WriteValue(file_, static_cast<uint8_t>(RAW));
+  WriteValue(file_, static_cast<uint32_t>(row_size*m.rows));
+  for (int r = 0; r < m.rows; r++)
+    file_.write(reinterpret_cast<const char*>(m.ptr(r)), row_size);
+}
+
+InputPlayer::InputPlayer() : sensor_(-1) {
+}
+
+bool InputPlayer::Open(const string &filename) {
+  file_.open(filename.c_str(), std::ios::binary);
+  if (!file_.is_open())
+    return false;
+
+  char magic[4];
+  uint32_t version, sensor;
+  if (!file_.read(magic, 4) || memcmp(magic, MAGIC, 4) != 0 || !ReadValue(file_, version) ||
+      version != InputRecorder::VERSION || !ReadValue(file_, sensor)) {
+    file_.close();
+    return false;
+  }
+
+  sensor_ = sensor;
+  return true;
+}
+
+bool InputPlayer::Next(InputRecord &record) {
+  if (!file_.is_open())
+    return false;
+
+  uint32_t n;
+  if (!ReadValue(file_, record.type) || !ReadValue(file_, record.time) || !ReadValue(file_, record.timestamp) ||
+      !ReadValue(file_, n) || n > MAX_IMAGES)
+    return false;
+
+  record.images.resize(n);
+  for (cv::Mat &im : record.images) {
+    if (!ReadMat(im))
+      return false;
+  }
+
+  uint8_t hasDepth;
+  if (!ReadValue(file_, hasDepth))
+    return false;
+  record.depth.release();
+  if (hasDepth && !ReadMat(record.depth))
+    return false;
+
+  if (!ReadValue(file_, n) || n > MAX_VALUES)
+    return false;
+  record.values.resize(n);
+  if (!file_.read(reinterpret_cast<char*>(record.values.data()), n*sizeof(double)))
+    return false;
+
+  if (!ReadValue(file_, n) || n > MAX_FILENAME)
+    return false;
+  record.filename.resize(n);
+  return n == 0 || static_cast<bool>(file_.read(&record.filename[0], n));
+}
+
+bool InputPlayer::ReadMat(cv::Mat &m) {
+  int32_t header[3];
+  uint8_t encoding;
+  uint32_t size;
+  if (!file_.read(reinterpret_cast<char*>(header), sizeof(header)) || !ReadValue(file_, encoding) ||
+      !ReadValue(file_, size) || header[0] < 0 || header[1] < 0)
+    return false;
+
+  if (encoding == RAW) {
+    m.create(header[0], header[1], header[2]);
+    if (m.total()*m.elemSize() != size)
+      return false;
+    return size == 0 || static_cast<bool>(file_.read(reinterpret_cast<char*>(m.data), size));
+  }
+
+  buffer_.resize(size);
+  if (encoding != PNG || !file_.read(reinterpret_cast<char*>(buffer_.data()), size))
+    return false;
+
+  m = cv::imdecode(buffer_, cv::IMREAD_UNCHANGED);
+  return !m.empty() && m.rows == header[0] && m.cols == header[1] && m.type() == header[2];
+}
+
+}  // namespace SD_SLAM
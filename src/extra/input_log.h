@@ -0,0 +1,107 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_INPUT_LOG_H_
+#define SD_SLAM_INPUT_LOG_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <opencv2/core/core.hpp>
+#include "timer.h"
+
+namespace SD_SLAM {
+
+// One input call recorded from System
+struct InputRecord {
+  enum Type {
+    MONOCULAR = 0,    // images[0]
+    RGBD = 1,         // images[0], depth
+    STEREO = 2,       // images[0] left, images[1] right
+    FUSION = 3,       // images[0], values are the measurements
+    FUSION_IMU = 4,   // images[0], preintegrated IMU samples up to timestamp
+    RIG = 5,          // images of every camera, depth if any
+    IMU = 6,          // values are gyroscope and accelerometer, at timestamp
+  };
+
+  uint8_t type;
+  double time;                  // Seconds since recording started
+  double timestamp;             // Sensor timestamp (FUSION_IMU and IMU)
+  std::vector<cv::Mat> images;
+  cv::Mat depth;
+  std::vector<double> values;
+  std::string filename;
+};
+
+// Writes input records to a file. 8 and 16 bit images are stored as PNG (lossless), other
+// types raw. Write can be called from several threads.
+//
+// File layout: magic "SDIN", version (u32), sensor (u32), then one record after another:
+//   type (u8), time (f64), timestamp (f64), images count (u32), images, depth flag (u8), depth,
+//   values count (u32), values (f64), filename length (u32), filename
+// Images are stored as rows, cols, type (i32), encoding (u8), size (u32) and data.
+class InputRecorder {
+ public:
+  static const uint32_t VERSION;
+
+  InputRecorder();
+  ~InputRecorder();
+
+  // Start a new recording. Sensor is stored as is, replay uses it to create the system
+  bool Open(const std::string &filename, int sensor);
+  void Close();
+
+  inline bool IsOpen() const { return file_.is_open(); }
+
+  // Record time is set here, from recording start
+  void Write(InputRecord &record);
+
+ private:
+  void WriteMat(const cv::Mat &m);
+
+  std::ofstream file_;
+  Timer timer_;
+  std::vector<uchar> buffer_;
+  std::mutex mutex_;
+};
+
+// Reads records written by InputRecorder, in order
+class InputPlayer {
+ public:
+  InputPlayer();
+
+  bool Open(const std::string &filename);
+
+  inline int GetSensor() const { return sensor_; }
+
+  // Returns false at the end of the file or if the record is malformed
+  bool Next(InputRecord &record);
+
+ private:
+  bool ReadMat(cv::Mat &m);
+
+  std::ifstream file_;
+  int sensor_;
+  std::vector<uchar> buffer_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_INPUT_LOG_H_
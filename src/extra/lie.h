@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_LIE_H_
+#define SD_SLAM_LIE_H_
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Dense>
+
+namespace SD_SLAM {
+
+// SO3, SE3 and Sim3 maps on fixed-size Eigen types. Transformations are 4x4 matrices [sR t; 0 1]
+// (s = 1 for SE3), tangent vectors are (upsilon, omega) with translation first.
+namespace Lie {
+
+template <typename T>
+inline Eigen::Matrix<T, 3, 3> Hat(const Eigen::Matrix<T, 3, 1> &v) {
+  Eigen::Matrix<T, 3, 3> Omega;
+  Omega <<     0, -v(2),  v(1),
+            v(2),     0, -v(0),
+           -v(1),  v(0),     0;
+  return Omega;
+}
+
+// Rotation of angle |omega| around omega. theta receives the angle if given
+template <typename T>
+inline Eigen::Quaternion<T> ExpSO3(const Eigen::Matrix<T, 3, 1> &omega, T *theta = nullptr) {
+  const T angle = omega.norm();
+  const T half = T(0.5)*angle;
+
+  // Taylor expansion of sin(x/2)/x near 0
+  T imag;
+  if (angle < T(1e-10)) {
+    const T angle2 = angle*angle;
+    imag = T(0.5)-T(0.0208333)*angle2+T(0.000260417)*angle2*angle2;
+  } else {
+    imag = std::sin(half)/angle;
+  }
+
+  if (theta)
+    *theta = angle;
+  return Eigen::Quaternion<T>(std::cos(half), imag*omega(0), imag*omega(1), imag*omega(2));
+}
+
+// Inverse of ExpSO3 for a unit quaternion, with angle in [0, pi]
+template <typename T>
+inline Eigen::Matrix<T, 3, 1> LogSO3(const Eigen::Quaternion<T> &rot, T *theta = nullptr) {
+  // q and -q are the same rotation, take the one with w >= 0
+  const Eigen::Quaternion<T> q = rot.w() < 0 ? Eigen::Quaternion<T>(-rot.coeffs()) : rot;
+  const T n = q.vec().norm();
+  const T w = q.w();
+
+  T factor;   // 2*atan(n/w)/n
+  if (n < T(1e-10))
+    factor = T(2)/w - T(2)*n*n/(w*w*w);
+  else if (w < T(1e-10))
+    factor = T(M_PI)/n;
+  else
+    factor = T(2)*std::atan(n/w)/n;
+
+  if (theta)
+    *theta = factor*n;
+  return factor*q.vec();
+}
+
+template <typename T>
+inline Eigen::Matrix<T, 4, 4> ExpSE3(const Eigen::Matrix<T, 6, 1> &update) {
+  const Eigen::Matrix<T, 3, 1> upsilon = update.template head<3>();
+  const Eigen::Matrix<T, 3, 1> omega = update.template tail<3>();
+
+  T theta;
+  const Eigen::Matrix<T, 3, 3> R = ExpSO3(omega, &theta).normalized().toRotationMatrix();
+
+  // Left jacobian of SO3 maps translation
+  Eigen::Matrix<T, 3, 3> V;
+  if (theta < T(1e-10)) {
+    V = R;
+  } else {
+    const Eigen::Matrix<T, 3, 3> Omega = Hat(omega);
+    const T theta2 = theta*theta;
+    V = Eigen::Matrix<T, 3, 3>::Identity() + (1-std::cos(theta))/theta2*Omega +
+        (theta-std::sin(theta))/(theta2*theta)*(Omega*Omega);
+  }
+
+  Eigen::Matrix<T, 4, 4> pose = Eigen::Matrix<T, 4, 4>::Identity();
+  pose.template block<3, 3>(0, 0) = R;
+  pose.template block<3, 1>(0, 3) = V*upsilon;
+  return pose;
+}
+
+template <typename T>
+inline Eigen::Matrix<T, 6, 1> LogSE3(const Eigen::Matrix<T, 4, 4> &pose) {
+  Eigen::Quaternion<T> q(Eigen::Matrix<T, 3, 3>(pose.template block<3, 3>(0, 0)));
+  q.normalize();
+
+  T theta;
+  Eigen::Matrix<T, 6, 1> update;
+  update.template tail<3>() = LogSO3(q, &theta);
+
+  const Eigen::Matrix<T, 3, 3> Omega = Hat(Eigen::Matrix<T, 3, 1>(update.template tail<3>()));
+  const T c = theta < T(1e-10) ? T(1)/T(12) : (1-theta/(2*std::tan(theta/2)))/(theta*theta);
+  const Eigen::Matrix<T, 3, 3> V_inv = Eigen::Matrix<T, 3, 3>::Identity() - T(0.5)*Omega + c*(Omega*Omega);
+  update.template head<3>() = V_inv*pose.template block<3, 1>(0, 3);
+  return update;
+}
+
+// a*b using only the 3x4 upper blocks (SE3 or Sim3)
+template <typename T>
+inline Eigen::Matrix<T, 4, 4> Compose(const Eigen::Matrix<T, 4, 4> &a, const Eigen::Matrix<T, 4, 4> &b) {
+  Eigen::Matrix<T, 4, 4> res;
+  res.template block<3, 3>(0, 0).noalias() = a.template block<3, 3>(0, 0)*b.template block<3, 3>(0, 0);
+  res.template block<3, 1>(0, 3) = a.template block<3, 3>(0, 0)*b.template block<3, 1>(0, 3) + a.template block<3, 1>(0, 3);
+  res.row(3) << 0, 0, 0, 1;
+  return res;
+}
+
+// Closed form inverse of a rigid transformation
+template <typename T>
+inline Eigen::Matrix<T, 4, 4> InverseSE3(const Eigen::Matrix<T, 4, 4> &pose) {
+  Eigen::Matrix<T, 4, 4> res;
+  res.template block<3, 3>(0, 0) = pose.template block<3, 3>(0, 0).transpose();
+  res.template block<3, 1>(0, 3) = -res.template block<3, 3>(0, 0)*pose.template block<3, 1>(0, 3);
+  res.row(3) << 0, 0, 0, 1;
+  return res;
+}
+
+// Inverse of [sR t], s^2 is the squared norm of any column of sR
+template <typename T>
+inline Eigen::Matrix<T, 4, 4> InverseSim3(const Eigen::Matrix<T, 4, 4> &pose) {
+  const Eigen::Matrix<T, 3, 3> sR = pose.template block<3, 3>(0, 0);
+  const T s2 = sR.col(0).squaredNorm();
+  Eigen::Matrix<T, 4, 4> res;
+  res.template block<3, 3>(0, 0) = sR.transpose()/s2;
+  res.template block<3, 1>(0, 3) = -res.template block<3, 3>(0, 0)*pose.template block<3, 1>(0, 3);
+  res.row(3) << 0, 0, 0, 1;
+  return res;
+}
+
+// dst[i] = R*src[i]+t for n points, as one 3xn product Eigen vectorizes
+template <typename T>
+inline void TransformPoints(const Eigen::Matrix<T, 3, 3> &R, const Eigen::Matrix<T, 3, 1> &t,
+                            const Eigen::Matrix<T, 3, 1> *src, Eigen::Matrix<T, 3, 1> *dst, size_t n) {
+  typedef Eigen::Matrix<T, 3, Eigen::Dynamic> Points;
+  Eigen::Map<const Points> in(src[0].data(), 3, n);
+  Eigen::Map<Points> out(dst[0].data(), 3, n);
+  out.noalias() = R*in;
+  out.colwise() += t;
+}
+
+template <typename T>
+inline void TransformPoints(const Eigen::Matrix<T, 3, 3> &R, const Eigen::Matrix<T, 3, 1> &t,
+                            const std::vector<Eigen::Matrix<T, 3, 1> > &src, std::vector<Eigen::Matrix<T, 3, 1> > &dst) {
+  dst.resize(src.size());
+  if (!src.empty())
+    TransformPoints(R, t, src.data(), dst.data(), src.size());
+}
+
+}  // namespace Lie
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_LIE_H_
@@ -0,0 +1,216 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "metrics.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+using std::string;
+using std::vector;
+
+namespace SD_SLAM {
+
+std::atomic<double> Metrics::gauges_[NUM_GAUGES];
+std::atomic<uint64_t> Metrics::counters_[NUM_COUNTERS];
+std::atomic<uint64_t> Metrics::transitions_[NUM_STATES][NUM_STATES];
+std::atomic<int> Metrics::state_(FIRST_STATE);
+
+namespace {
+
+// Append formatted text to out
+void Append(string &out, const char *format, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (n > 0)
+    out.append(buf, std::min(n, static_cast<int>(sizeof(buf))-1));
+}
+
+const char* GaugeLabel(Metrics::Gauge gauge) {
+  switch (gauge) {
+    case Metrics::LOCAL_MAPPING_QUEUE: return "local_mapping";
+    case Metrics::LOOP_QUEUE: return "loop_closing";
+    case Metrics::MEMORY_KEYFRAMES: return "keyframes";
+    case Metrics::MEMORY_MAPPOINTS: return "mappoints";
+    case Metrics::MEMORY_IMAGES: return "images";
+    case Metrics::MEMORY_DEPTH: return "depth";
+    case Metrics::MEMORY_DESCRIPTORS: return "descriptors";
+    case Metrics::MEMORY_FEATURES: return "features";
+    case Metrics::MEMORY_VOCABULARY: return "vocabulary";
+    case Metrics::MEMORY_OPTIMIZER: return "optimizer";
+    default: return "";
+  }
+}
+
+// Requests are small, larger ones are not read further
+const size_t MAX_REQUEST = 8192;
+const int REQUEST_TIMEOUT = 1000;
+
+}  // namespace
+
+void Metrics::RecordState(int state) {
+  gauges_[TRACKING_STATE].store(state, std::memory_order_relaxed);
+
+  // Only the tracking thread changes the state
+  const int last = state_.exchange(state, std::memory_order_relaxed);
+  if (last != state && last >= FIRST_STATE && last < FIRST_STATE+NUM_STATES &&
+      state >= FIRST_STATE && state < FIRST_STATE+NUM_STATES)
+    transitions_[last-FIRST_STATE][state-FIRST_STATE].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Metrics::GetTransitions(int from, int to) {
+  return transitions_[from-FIRST_STATE][to-FIRST_STATE].load(std::memory_order_relaxed);
+}
+
+const char* Metrics::StateName(int state) {
+  switch (state) {
+    case -1: return "SYSTEM_NOT_READY";
+    case 0: return "NO_IMAGES_YET";
+    case 1: return "NOT_INITIALIZED";
+    case 2: return "OK";
+    case 3: return "LOST";
+    default: return "UNKNOWN";
+  }
+}
+
+MetricsExporter::MetricsExporter(): thread_(nullptr) {
+}
+
+MetricsExporter::~MetricsExporter() {
+  Stop();
+}
+
+bool MetricsExporter::Start(int port) {
+  if (thread_ || !listener_.Listen(port, true))
+    return false;
+
+  thread_ = new std::thread(&MetricsExporter::Run, this);
+  LOGD("Serving metrics on localhost:%d", port);
+  return true;
+}
+
+void MetricsExporter::Stop() {
+  if (!thread_)
+    return;
+
+  listener_.Close();
+  thread_->join();
+  delete thread_;
+  thread_ = nullptr;
+}
+
+void MetricsExporter::Run() {
+  Trace::SetThreadName("Metrics");
+
+  // Scrapes are rare and small, they are answered one by one
+  while (true) {
+    TcpLink link;
+    if (!listener_.Accept(link))
+      break;
+    Serve(link);
+  }
+}
+
+void MetricsExporter::Serve(TcpLink &link) {
+  // Wait for end of headers, whatever the request is
+  string request;
+  char buf[1024];
+  while (request.size() < MAX_REQUEST && request.find("\r\n\r\n") == string::npos) {
+    int n = link.ReceiveRaw(buf, sizeof(buf), REQUEST_TIMEOUT);
+    if (n <= 0)
+      return;
+    request.append(buf, n);
+  }
+
+  const string body = Format();
+  string response;
+  Append(response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+         body.size());
+  response += body;
+  link.SendRaw(response.data(), response.size());
+}
+
+string MetricsExporter::Format() {
+  string out;
+
+  // Stage latencies
+  const vector<Statistics::Summary> stats = Statistics::GetSummary();
+  Append(out, "# HELP sdslam_stage_latency_ms Latency of processing stages.\n");
+  Append(out, "# TYPE sdslam_stage_latency_ms summary\n");
+  for (const Statistics::Summary &s : stats) {
+    const char *name = s.name.c_str();
+    Append(out, "sdslam_stage_latency_ms{stage=\"%s\",quantile=\"0.5\"} %g\n", name, s.p50);
+    Append(out, "sdslam_stage_latency_ms{stage=\"%s\",quantile=\"0.99\"} %g\n", name, s.p99);
+    Append(out, "sdslam_stage_latency_ms{stage=\"%s\",quantile=\"1\"} %g\n", name, s.max);
+    Append(out, "sdslam_stage_latency_ms_sum{stage=\"%s\"} %g\n", name, s.mean*s.count);
+    Append(out, "sdslam_stage_latency_ms_count{stage=\"%s\"} %llu\n", name, static_cast<unsigned long long>(s.count));
+  }
+  Append(out, "# HELP sdslam_stage_jitter_ms Standard deviation of stage latency.\n");
+  Append(out, "# TYPE sdslam_stage_jitter_ms gauge\n");
+  for (const Statistics::Summary &s : stats)
+    Append(out, "sdslam_stage_jitter_ms{stage=\"%s\"} %g\n", s.name.c_str(), s.jitter);
+
+  // Queues and map
+  Append(out, "# HELP sdslam_queue_keyframes Keyframes waiting to be processed.\n");
+  Append(out, "# TYPE sdslam_queue_keyframes gauge\n");
+  for (Metrics::Gauge g : {Metrics::LOCAL_MAPPING_QUEUE, Metrics::LOOP_QUEUE})
+    Append(out, "sdslam_queue_keyframes{queue=\"%s\"} %g\n", GaugeLabel(g), Metrics::Get(g));
+
+  Append(out, "# TYPE sdslam_keyframes gauge\nsdslam_keyframes %g\n", Metrics::Get(Metrics::KEYFRAMES));
+  Append(out, "# TYPE sdslam_mappoints gauge\nsdslam_mappoints %g\n", Metrics::Get(Metrics::MAPPOINTS));
+
+  // Optimization
+  Append(out, "# HELP sdslam_ba_iterations_total Iterations run by bundle adjustments.\n");
+  Append(out, "# TYPE sdslam_ba_iterations_total counter\n");
+  Append(out, "sdslam_ba_iterations_total{ba=\"local\"} %llu\n",
+         static_cast<unsigned long long>(Metrics::Get(Metrics::LOCAL_BA_ITERATIONS)));
+  Append(out, "sdslam_ba_iterations_total{ba=\"global\"} %llu\n",
+         static_cast<unsigned long long>(Metrics::Get(Metrics::GLOBAL_BA_ITERATIONS)));
+
+  // Tracking state
+  Append(out, "# TYPE sdslam_tracking_state gauge\nsdslam_tracking_state %g\n", Metrics::Get(Metrics::TRACKING_STATE));
+  Append(out, "# HELP sdslam_tracking_transitions_total Changes of tracking state.\n");
+  Append(out, "# TYPE sdslam_tracking_transitions_total counter\n");
+  for (int from = Metrics::FIRST_STATE; from < Metrics::FIRST_STATE+Metrics::NUM_STATES; from++) {
+    for (int to = Metrics::FIRST_STATE; to < Metrics::FIRST_STATE+Metrics::NUM_STATES; to++) {
+      const uint64_t n = Metrics::GetTransitions(from, to);
+      if (n > 0)
+        Append(out, "sdslam_tracking_transitions_total{from=\"%s\",to=\"%s\"} %llu\n", Metrics::StateName(from),
+               Metrics::StateName(to), static_cast<unsigned long long>(n));
+    }
+  }
+
+  // Memory, refreshed by Local Mapping
+  Append(out, "# HELP sdslam_memory_bytes Memory used by the map.\n");
+  Append(out, "# TYPE sdslam_memory_bytes gauge\n");
+  for (int g = Metrics::MEMORY_KEYFRAMES; g <= Metrics::MEMORY_OPTIMIZER; g++) {
+    Metrics::Gauge gauge = static_cast<Metrics::Gauge>(g);
+    Append(out, "sdslam_memory_bytes{category=\"%s\"} %.0f\n", GaugeLabel(gauge), Metrics::Get(gauge));
+  }
+
+  return out;
+}
+
+}  // namespace SD_SLAM
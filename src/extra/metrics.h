@@ -0,0 +1,112 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_METRICS_H_
+#define SD_SLAM_METRICS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "tcp_link.h"
+
+namespace SD_SLAM {
+
+// Gauges and counters of the processing threads, exported with the latency histograms
+// (see Statistics) by MetricsExporter. Values are relaxed atomics updated where they change,
+// so neither updating nor reading them takes a lock.
+class Metrics {
+ public:
+  enum Gauge {
+    LOCAL_MAPPING_QUEUE = 0,  // Keyframes waiting for Local Mapping
+    LOOP_QUEUE,               // Keyframes waiting for Loop Closing
+    KEYFRAMES,
+    MAPPOINTS,
+    TRACKING_STATE,
+    MEMORY_KEYFRAMES,         // Bytes by category, see Map::MemoryReport
+    MEMORY_MAPPOINTS,
+    MEMORY_IMAGES,
+    MEMORY_DEPTH,
+    MEMORY_DESCRIPTORS,
+    MEMORY_FEATURES,
+    MEMORY_VOCABULARY,
+    MEMORY_OPTIMIZER,
+    NUM_GAUGES
+  };
+
+  enum Counter {
+    LOCAL_BA_ITERATIONS = 0,
+    GLOBAL_BA_ITERATIONS,
+    NUM_COUNTERS
+  };
+
+  // Tracking states, from SYSTEM_NOT_READY (-1) to LOST (3)
+  static const int FIRST_STATE = -1;
+  static const int NUM_STATES = 5;
+
+  static inline void Set(Gauge gauge, double value) { gauges_[gauge].store(value, std::memory_order_relaxed); }
+  static inline double Get(Gauge gauge) { return gauges_[gauge].load(std::memory_order_relaxed); }
+
+  // Negative n (failed optimization) is ignored
+  static inline void Add(Counter counter, int n) {
+    if (n > 0)
+      counters_[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+  static inline uint64_t Get(Counter counter) { return counters_[counter].load(std::memory_order_relaxed); }
+
+  // Count a change of tracking state and set TRACKING_STATE
+  static void RecordState(int state);
+  static uint64_t GetTransitions(int from, int to);
+
+  static const char* StateName(int state);
+
+ private:
+  static std::atomic<double> gauges_[NUM_GAUGES];
+  static std::atomic<uint64_t> counters_[NUM_COUNTERS];
+  static std::atomic<uint64_t> transitions_[NUM_STATES][NUM_STATES];
+  static std::atomic<int> state_;
+};
+
+// Serves Metrics and Statistics on a port of localhost in Prometheus text format, answering
+// any HTTP request on its own thread. Values are read without locking the processing threads.
+class MetricsExporter {
+ public:
+  MetricsExporter();
+  ~MetricsExporter();
+
+  // Start serving. Returns false if port can't be opened
+  bool Start(int port);
+
+  void Stop();
+
+  // Text exposition of every metric
+  static std::string Format();
+
+ private:
+  void Run();
+
+  // Read request headers and send metrics
+  void Serve(TcpLink &link);
+
+  TcpListener listener_;
+  std::thread* thread_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_METRICS_H_
@@ -0,0 +1,175 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_OBJECT_POOL_H_
+#define SD_SLAM_OBJECT_POOL_H_
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <cstddef>
+
+namespace SD_SLAM {
+
+// Slab allocator for objects of type T. Memory is taken in slabs of SlabSize objects
+// and freed slots are reused, so objects created together stay close in memory.
+// Memory is bounded by the peak number of live objects until Trim is called.
+template <typename T, size_t SlabSize = 256>
+class ObjectPool {
+ public:
+  // Never destroyed, pooled objects may be used by threads still running at exit
+  static ObjectPool& GetInstance() {
+    static ObjectPool* instance = new ObjectPool();
+    return *instance;
+  }
+
+  // Objects of a different size (derived classes) use the global allocator
+  void* Allocate(size_t size) {
+    if (size != sizeof(T))
+      return ::operator new(size);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!free_) {
+      char* slab = static_cast<char*>(::operator new(SlotSize*SlabSize+Alignment));
+      slabs_.push_back(slab);
+
+      // Align first slot, slot size keeps the rest aligned
+      size_t offset = reinterpret_cast<size_t>(slab) % Alignment;
+      if (offset > 0)
+        slab += Alignment-offset;
+
+      for (size_t i = 0; i < SlabSize; i++) {
+        Slot* s = reinterpret_cast<Slot*>(slab+i*SlotSize);
+        s->next = free_;
+        free_ = s;
+      }
+    }
+
+    Slot* s = free_;
+    free_ = s->next;
+    used_++;
+    return s;
+  }
+
+  void Free(void* p, size_t size) {
+    if (!p)
+      return;
+
+    if (size != sizeof(T)) {
+      ::operator delete(p);
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    Slot* s = static_cast<Slot*>(p);
+    s->next = free_;
+    free_ = s;
+    used_--;
+  }
+
+  // Number of live objects and reserved slots
+  size_t Used() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return used_;
+  }
+
+  size_t Capacity() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return slabs_.size()*SlabSize;
+  }
+
+  // Memory taken by slabs
+  size_t ReservedBytes() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return slabs_.size()*(SlotSize*SlabSize+Alignment);
+  }
+
+  // Release slabs without live objects and rebuild the free list in address order, so new
+  // objects fill the lowest slabs first and live ones stay packed. Returns bytes released
+  size_t Trim() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (slabs_.empty())
+      return 0;
+
+    std::sort(slabs_.begin(), slabs_.end());
+
+    std::vector<Slot*> vFree;
+    vFree.reserve(slabs_.size()*SlabSize-used_);
+    for (Slot* s = free_; s; s = s->next)
+      vFree.push_back(s);
+    std::sort(vFree.begin(), vFree.end());
+
+    // Free slots of each slab, both vectors are sorted
+    std::vector<size_t> vnFree(slabs_.size(), 0);
+    size_t slab = 0;
+    for (Slot* s : vFree) {
+      while (slab+1 < slabs_.size() && reinterpret_cast<char*>(s) >= slabs_[slab+1])
+        slab++;
+      vnFree[slab]++;
+    }
+
+    std::vector<char*> vKept;
+    vKept.reserve(slabs_.size());
+    for (size_t i = 0; i < slabs_.size(); i++) {
+      if (vnFree[i] == SlabSize)
+        ::operator delete(slabs_[i]);
+      else
+        vKept.push_back(slabs_[i]);
+    }
+    const size_t released = slabs_.size()-vKept.size();
+
+    // Push slots of kept slabs from the highest address, so the lowest one is taken first
+    free_ = nullptr;
+    slab = slabs_.size()-1;
+    for (auto it = vFree.rbegin(); it != vFree.rend(); ++it) {
+      while (reinterpret_cast<char*>(*it) < slabs_[slab])
+        slab--;
+      if (vnFree[slab] == SlabSize)
+        continue;
+      (*it)->next = free_;
+      free_ = *it;
+    }
+
+    slabs_.swap(vKept);
+    return released*(SlotSize*SlabSize+Alignment);
+  }
+
+ private:
+  struct Slot {
+    Slot* next;
+  };
+
+  // Slots are aligned for T (Eigen fixed size members) and at least to 16 bytes
+  static const size_t Alignment = alignof(T) > 16 ? alignof(T) : 16;
+  static const size_t SlotSize = ((sizeof(T) > sizeof(Slot) ? sizeof(T) : sizeof(Slot))+Alignment-1) & ~(Alignment-1);
+
+  ObjectPool() : free_(nullptr), used_(0) {}
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  std::vector<char*> slabs_;
+  Slot* free_;
+  size_t used_;
+  std::mutex mutex_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_OBJECT_POOL_H_
@@ -0,0 +1,180 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "plane_fitter.h"
+#include <cmath>
+#include <algorithm>
+#include "utils.h"
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+using std::vector;
+
+namespace SD_SLAM {
+
+PlaneFitter::PlaneFitter() {
+}
+
+void PlaneFitter::SetPoints(const vector<Eigen::Vector3d> &points) {
+  const size_t N = points.size();
+  x_.resize(N);
+  y_.resize(N);
+  z_.resize(N);
+  for (size_t i = 0; i < N; i++) {
+    x_[i] = points[i](0);
+    y_[i] = points[i](1);
+    z_[i] = points[i](2);
+  }
+}
+
+void PlaneFitter::Distances(const Eigen::Vector4f &plane, float *dist) const {
+  const size_t N = x_.size();
+  const float a = plane(0), b = plane(1), c = plane(2), d = plane(3);
+  size_t i = 0;
+
+#if defined(__AVX__)
+  const __m256 va = _mm256_set1_ps(a);
+  const __m256 vb = _mm256_set1_ps(b);
+  const __m256 vc = _mm256_set1_ps(c);
+  const __m256 vd = _mm256_set1_ps(d);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+
+  for (; i+8 <= N; i += 8) {
+    __m256 s = _mm256_add_ps(_mm256_mul_ps(va, _mm256_loadu_ps(&x_[i])), vd);
+    s = _mm256_add_ps(s, _mm256_mul_ps(vb, _mm256_loadu_ps(&y_[i])));
+    s = _mm256_add_ps(s, _mm256_mul_ps(vc, _mm256_loadu_ps(&z_[i])));
+    _mm256_storeu_ps(dist+i, _mm256_andnot_ps(sign, s));
+  }
+#endif
+
+  for (; i < N; i++)
+    dist[i] = std::fabs(a*x_[i] + b*y_[i] + c*z_[i] + d);
+}
+
+bool PlaneFitter::Ransac(int iterations, vector<bool> &inliers, float quantile, int minPoints) {
+  const int N = x_.size();
+  const int nth = std::max(static_cast<int>(quantile*N), minPoints);
+  if (N < 3 || nth >= N)
+    return false;
+
+  dist_.resize(N);
+  sorted_.resize(N);
+  best_.clear();
+
+  float bestDist = 1e10;
+
+  for (int n = 0; n < iterations; n++) {
+    // Random triplet
+    int idx[3];
+    idx[0] = Random(0, N-1);
+    do {
+      idx[1] = Random(0, N-1);
+    } while (idx[1] == idx[0]);
+    do {
+      idx[2] = Random(0, N-1);
+    } while (idx[2] == idx[0] || idx[2] == idx[1]);
+
+    const Eigen::Vector3f p0(x_[idx[0]], y_[idx[0]], z_[idx[0]]);
+    const Eigen::Vector3f p1(x_[idx[1]], y_[idx[1]], z_[idx[1]]);
+    const Eigen::Vector3f p2(x_[idx[2]], y_[idx[2]], z_[idx[2]]);
+
+    Eigen::Vector3f normal = (p1-p0).cross(p2-p0);
+    const float norm = normal.norm();
+    if (norm < 1e-9f)
+      continue;
+    normal /= norm;
+
+    Eigen::Vector4f plane;
+    plane << normal, -normal.dot(p0);
+
+    Distances(plane, dist_.data());
+
+    // Only the quantile is needed, no full sort
+    sorted_ = dist_;
+    std::nth_element(sorted_.begin(), sorted_.begin()+nth, sorted_.end());
+    const float score = sorted_[nth];
+
+    if (score < bestDist) {
+      bestDist = score;
+      best_.swap(dist_);
+      dist_.resize(N);
+    }
+  }
+
+  if (best_.empty())
+    return false;
+
+  const float th = 1.4f*bestDist;
+  inliers.resize(N);
+  for (int i = 0; i < N; i++)
+    inliers[i] = best_[i] < th;
+
+  return true;
+}
+
+PlaneLeastSquares::PlaneLeastSquares() {
+  Clear();
+}
+
+void PlaneLeastSquares::Clear() {
+  n_ = 0;
+  origin_.setZero();
+  sum_.setZero();
+  sum2_.setZero();
+}
+
+void PlaneLeastSquares::Add(const Eigen::Vector3d &p) {
+  if (n_ == 0) {
+    origin_ = p;
+    sum_.setZero();
+    sum2_.setZero();
+  }
+
+  const Eigen::Vector3d q = p-origin_;
+  sum_ += q;
+  sum2_ += q*q.transpose();
+  n_++;
+}
+
+void PlaneLeastSquares::Remove(const Eigen::Vector3d &p) {
+  if (n_ == 0)
+    return;
+
+  const Eigen::Vector3d q = p-origin_;
+  sum_ -= q;
+  sum2_ -= q*q.transpose();
+  n_--;
+}
+
+bool PlaneLeastSquares::Fit(Eigen::Vector3d &centroid, Eigen::Vector3d &normal) const {
+  if (n_ < 3)
+    return false;
+
+  const Eigen::Vector3d mean = sum_/n_;
+  const Eigen::Matrix3d cov = sum2_/n_ - mean*mean.transpose();
+
+  // Normal is the direction of lowest variance (eigenvalues in increasing order)
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(cov);
+  centroid = origin_+mean;
+  normal = solver.eigenvectors().col(0);
+
+  return true;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,81 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_PLANE_FITTER_H_
+#define SD_SLAM_PLANE_FITTER_H_
+
+#include <vector>
+#include <Eigen/Dense>
+
+namespace SD_SLAM {
+
+// RANSAC plane detection over a packed set of 3D points. Hypotheses come from random
+// triplets and are scored by the distance at a quantile of all points, computed 8 points
+// at a time with AVX.
+class PlaneFitter {
+ public:
+  PlaneFitter();
+
+  void SetPoints(const std::vector<Eigen::Vector3d> &points);
+
+  inline size_t Size() const { return x_.size(); }
+
+  // Absolute distances of all points to plane (a, b, c, d), with unit normal (a, b, c)
+  void Distances(const Eigen::Vector4f &plane, float *dist) const;
+
+  // Run iterations hypotheses and keep the one with lowest distance at the quantile (at
+  // least minPoints points). Inliers are the points closer than 1.4 times that distance.
+  // Returns false if there are not enough points
+  bool Ransac(int iterations, std::vector<bool> &inliers, float quantile = 0.2f, int minPoints = 20);
+
+ private:
+  std::vector<float> x_, y_, z_;
+
+  // Buffers, kept between calls
+  std::vector<float> dist_;
+  std::vector<float> sorted_;
+  std::vector<float> best_;
+};
+
+// Least squares plane of a set of points, from their first and second order moments. Points
+// can be added, removed or moved without visiting the rest of the set.
+class PlaneLeastSquares {
+ public:
+  PlaneLeastSquares();
+
+  void Clear();
+  void Add(const Eigen::Vector3d &p);
+  void Remove(const Eigen::Vector3d &p);
+  inline void Move(const Eigen::Vector3d &from, const Eigen::Vector3d &to) { Remove(from); Add(to); }
+
+  inline int Size() const { return n_; }
+
+  // Centroid and unit normal of the plane minimizing squared point distances.
+  // Returns false with less than 3 points
+  bool Fit(Eigen::Vector3d &centroid, Eigen::Vector3d &normal) const;
+
+ private:
+  int n_;
+  Eigen::Vector3d origin_;    // Moments are relative to the first point, to keep precision
+  Eigen::Vector3d sum_;
+  Eigen::Matrix3d sum2_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_PLANE_FITTER_H_
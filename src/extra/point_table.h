@@ -0,0 +1,153 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_POINT_TABLE_H_
+#define SD_SLAM_POINT_TABLE_H_
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <Eigen/Dense>
+#include "scale_levels.h"
+
+namespace SD_SLAM {
+
+// MapPoint data read by the frustum test, stored as separate contiguous arrays so all
+// points are transformed, projected and checked in a branch free loop the compiler can
+// vectorize. Entry i belongs to the i-th point added.
+class PointTable {
+ public:
+  // Camera where points are tested
+  struct View {
+    float R[9];                    // Rcw, row major
+    float t[3];                    // tcw
+    float O[3];                    // Camera center
+    float fx, fy, cx, cy, bf;
+    float minX, maxX, minY, maxY;  // Image bounds
+    float viewingCosLimit;
+    const float* scaleFactors;     // Pyramid scale factors, levels values
+    int levels;
+  };
+
+  // Point in view, as filled by Frame::isInFrustum
+  struct Visible {
+    uint32_t idx;
+    float u, v, uR;
+    float viewCos;
+    int level;
+  };
+
+  inline void Clear() {
+    x_.clear(); y_.clear(); z_.clear();
+    nx_.clear(); ny_.clear(); nz_.clear();
+    min_dist_.clear(); max_dist_.clear();
+  }
+
+  inline void Reserve(size_t n) {
+    x_.reserve(n); y_.reserve(n); z_.reserve(n);
+    nx_.reserve(n); ny_.reserve(n); nz_.reserve(n);
+    min_dist_.reserve(n); max_dist_.reserve(n);
+  }
+
+  // Distances are the scale invariance region of the point
+  inline void Add(const Eigen::Vector3d &pos, const Eigen::Vector3d &normal, float minDist, float maxDist) {
+    x_.push_back(pos(0)); y_.push_back(pos(1)); z_.push_back(pos(2));
+    nx_.push_back(normal(0)); ny_.push_back(normal(1)); nz_.push_back(normal(2));
+    min_dist_.push_back(minDist);
+    max_dist_.push_back(maxDist);
+  }
+
+  inline size_t Size() const { return x_.size(); }
+
+  // Append points in view and their predicted level to visible
+  void Cull(const View &view, std::vector<Visible> &visible) {
+    const size_t n = Size();
+    u_.resize(n);
+    v_.resize(n);
+    invz_.resize(n);
+    cos_.resize(n);
+    dist_.resize(n);
+    mask_.resize(n);
+    level_.resize(n);
+
+    const float* R = view.R;
+    const float* t = view.t;
+    const float* O = view.O;
+    float* pu = u_.data();
+    float* pv = v_.data();
+    float* pinvz = invz_.data();
+    float* pcos = cos_.data();
+    float* pdist = dist_.data();
+    uint8_t* pmask = mask_.data();
+
+    // Test all points, no early exits
+    for (size_t i = 0; i < n; i++) {
+      const float x = x_[i], y = y_[i], z = z_[i];
+      const float xc = R[0]*x+R[1]*y+R[2]*z+t[0];
+      const float yc = R[3]*x+R[4]*y+R[5]*z+t[1];
+      const float zc = R[6]*x+R[7]*y+R[8]*z+t[2];
+      const float invz = 1.0f/zc;
+      const float u = view.fx*xc*invz+view.cx;
+      const float v = view.fy*yc*invz+view.cy;
+
+      const float dx = x-O[0], dy = y-O[1], dz = z-O[2];
+      const float dist = std::sqrt(dx*dx+dy*dy+dz*dz);
+      const float viewCos = (dx*nx_[i]+dy*ny_[i]+dz*nz_[i])/dist;
+
+      pu[i] = u;
+      pv[i] = v;
+      pinvz[i] = invz;
+      pcos[i] = viewCos;
+      pdist[i] = 1.2f*dist;   // Max distance is 1.2 times the one used by PredictScale
+      pmask[i] = (zc > 0.0f) & (u >= view.minX) & (u <= view.maxX) & (v >= view.minY) & (v <= view.maxY) &
+                 (dist >= min_dist_[i]) & (dist <= max_dist_[i]) & (viewCos >= view.viewingCosLimit);
+    }
+
+    // Level is predicted as MapPoint::PredictScale does
+    PredictLevels(max_dist_.data(), pdist, n, view.scaleFactors, view.levels, level_.data());
+
+    // Compact points in view
+    for (size_t i = 0; i < n; i++) {
+      if (!pmask[i])
+        continue;
+
+      Visible p;
+      p.idx = i;
+      p.u = pu[i];
+      p.v = pv[i];
+      p.uR = pu[i]-view.bf*pinvz[i];
+      p.viewCos = pcos[i];
+      p.level = level_[i];
+      visible.push_back(p);
+    }
+  }
+
+ private:
+  std::vector<float> x_, y_, z_;
+  std::vector<float> nx_, ny_, nz_;
+  std::vector<float> min_dist_, max_dist_;
+
+  // Scratch buffers of Cull
+  std::vector<float> u_, v_, invz_, cos_, dist_;
+  std::vector<uint8_t> mask_;
+  std::vector<int> level_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_POINT_TABLE_H_
@@ -0,0 +1,274 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "pose_optimizer.h"
+#include <cmath>
+#include <algorithm>
+
+using std::vector;
+
+namespace SD_SLAM {
+
+PoseOptimizer::PoseOptimizer() : fx_(0), fy_(0), cx_(0), cy_(0), bf_(0), robust_(true) {
+}
+
+void PoseOptimizer::Clear(double fx, double fy, double cx, double cy, double bf) {
+  observations_.clear();
+  cameras_.clear();
+  batch_.Clear(fx, fy, cx, cy, bf);
+  fx_ = fx;
+  fy_ = fy;
+  cx_ = cx;
+  cy_ = cy;
+  bf_ = bf;
+  robust_ = true;
+}
+
+int PoseOptimizer::AddCamera(double fx, double fy, double cx, double cy, const Eigen::Matrix4d &Tcb) {
+  Camera cam;
+  cam.R = Tcb.block<3, 3>(0, 0);
+  cam.t = Tcb.block<3, 1>(0, 3);
+  cam.fx = fx;
+  cam.fy = fy;
+  cam.cx = cx;
+  cam.cy = cy;
+  cameras_.push_back(cam);
+  return cameras_.size();
+}
+
+void PoseOptimizer::AddObservation(const Eigen::Vector3d &Xw, double u, double v, double ur, double invSigma2, double delta,
+                                   int camera) {
+  Observation obs;
+  obs.Xw = Xw;
+  obs.z << u, v, ur;
+  obs.invSigma2 = invSigma2;
+  obs.delta = delta;
+  obs.camera = camera;
+  obs.index = -1;
+  obs.stereo = camera == 0 && ur >= 0;
+  obs.inlier = true;
+
+  if (camera == 0) {
+    obs.index = batch_.Size();
+    batch_.Add(Xw, u, v, obs.stereo ? ur : -1, invSigma2, delta);
+  }
+
+  observations_.push_back(obs);
+}
+
+void PoseOptimizer::SetInlier(size_t i, bool inlier) {
+  Observation &obs = observations_[i];
+  obs.inlier = inlier;
+  if (obs.index >= 0)
+    batch_.SetInlier(obs.index, inlier);
+}
+
+int PoseOptimizer::Linearize(const Observation &obs, const g2o::SE3Quat &Tcw, Eigen::Vector3d &r,
+                             Eigen::Matrix<double, 3, 6> &J, bool bJacobian) const {
+  if (obs.camera > 0)
+    return LinearizeRig(obs, Tcw, r, J, bJacobian);
+
+  const Eigen::Vector3d Xc = Tcw.map(obs.Xw);
+  const double x = Xc(0);
+  const double y = Xc(1);
+  const double invz = 1.0/Xc(2);
+  const double invz_2 = invz*invz;
+
+  const double u = fx_*x*invz + cx_;
+  r(0) = obs.z(0) - u;
+  r(1) = obs.z(1) - (fy_*y*invz + cy_);
+  if (obs.stereo)
+    r(2) = obs.z(2) - (u - bf_*invz);
+
+  if (bJacobian) {
+    J(0, 0) =  x*y*invz_2 *fx_;
+    J(0, 1) = -(1+(x*x*invz_2)) *fx_;
+    J(0, 2) = y*invz *fx_;
+    J(0, 3) = -invz *fx_;
+    J(0, 4) = 0;
+    J(0, 5) = x*invz_2 *fx_;
+
+    J(1, 0) = (1+y*y*invz_2) *fy_;
+    J(1, 1) = -x*y*invz_2 *fy_;
+    J(1, 2) = -x*invz *fy_;
+    J(1, 3) = 0;
+    J(1, 4) = -invz *fy_;
+    J(1, 5) = y*invz_2 *fy_;
+
+    if (obs.stereo) {
+      J(2, 0) = J(0, 0)-bf_*y*invz_2;
+      J(2, 1) = J(0, 1)+bf_*x*invz_2;
+      J(2, 2) = J(0, 2);
+      J(2, 3) = J(0, 3);
+      J(2, 4) = 0;
+      J(2, 5) = J(0, 5)-bf_*invz_2;
+    }
+  }
+
+  return obs.stereo ? 3 : 2;
+}
+
+int PoseOptimizer::LinearizeRig(const Observation &obs, const g2o::SE3Quat &Tcw, Eigen::Vector3d &r,
+                                Eigen::Matrix<double, 3, 6> &J, bool bJacobian) const {
+  const Camera &cam = cameras_[obs.camera-1];
+  const Eigen::Vector3d Xb = Tcw.map(obs.Xw);
+  const Eigen::Vector3d Xc = cam.R*Xb + cam.t;
+  const double x = Xc(0);
+  const double y = Xc(1);
+  const double invz = 1.0/Xc(2);
+  const double invz_2 = invz*invz;
+
+  r(0) = obs.z(0) - (cam.fx*x*invz + cam.cx);
+  r(1) = obs.z(1) - (cam.fy*y*invz + cam.cy);
+
+  if (bJacobian) {
+    // Projection jacobian, chained with the left update of Tcw seen from this camera
+    Eigen::Matrix<double, 2, 3> Jp;
+    Jp << cam.fx*invz, 0, -cam.fx*x*invz_2,
+          0, cam.fy*invz, -cam.fy*y*invz_2;
+
+    Eigen::Matrix<double, 3, 6> dX;
+    dX << 0, Xb(2), -Xb(1), 1, 0, 0,
+          -Xb(2), 0, Xb(0), 0, 1, 0,
+          Xb(1), -Xb(0), 0, 0, 0, 1;
+
+    J.topRows<2>() = -Jp*cam.R*dX;
+  }
+
+  return 2;
+}
+
+double PoseOptimizer::BuildSystem(const g2o::SE3Quat &Tcw, Eigen::Matrix<double, 6, 6> *H, Eigen::Matrix<double, 6, 1> *b) const {
+  const bool bJacobian = H && b;
+  if (bJacobian) {
+    H->setZero();
+    b->setZero();
+  }
+
+  // Optimized camera in batch, rig cameras one by one
+  double chi2 = batch_.Accumulate(Tcw, robust_, H, b);
+
+  Eigen::Vector3d r;
+  Eigen::Matrix<double, 3, 6> J;
+
+  for (const Observation &obs : observations_) {
+    if (!obs.inlier || obs.camera == 0)
+      continue;
+
+    const int dim = Linearize(obs, Tcw, r, J, bJacobian);
+    const double e2 = r.head(dim).squaredNorm()*obs.invSigma2;
+
+    // Huber kernel, weights information with its first derivative
+    double w = obs.invSigma2;
+    if (robust_ && e2 > obs.delta*obs.delta) {
+      const double e = sqrt(e2);
+      chi2 += 2*e*obs.delta - obs.delta*obs.delta;
+      w *= obs.delta/e;
+    } else {
+      chi2 += e2;
+    }
+
+    if (bJacobian) {
+      if (dim == 2) {
+        const Eigen::Matrix<double, 2, 6> J2 = J.topRows<2>();
+        H->noalias() += w*J2.transpose()*J2;
+        b->noalias() -= w*J2.transpose()*r.head<2>();
+      } else {
+        H->noalias() += w*J.transpose()*J;
+        b->noalias() -= w*J.transpose()*r;
+      }
+    }
+  }
+
+  return chi2;
+}
+
+int PoseOptimizer::Optimize(g2o::SE3Quat &Tcw, int nIterations, double minUpdate) {
+  bool bInliers = false;
+  for (const Observation &obs : observations_) {
+    if (obs.inlier) {
+      bInliers = true;
+      break;
+    }
+  }
+
+  if (!bInliers)
+    return 0;
+
+  Eigen::Matrix<double, 6, 6> H;
+  Eigen::Matrix<double, 6, 1> b;
+  double chi2 = BuildSystem(Tcw, &H, &b);
+
+  // Initial damping as g2o
+  double lambda = 1e-5*H.diagonal().maxCoeff();
+  double ni = 2.0;
+  const double minUpdate2 = minUpdate*minUpdate;
+
+  int it = 0;
+  while (it < nIterations) {
+    it++;
+    double rho = 0;
+    double update2 = 0;
+    int tries = 0;
+
+    do {
+      Eigen::Matrix<double, 6, 6> Hl = H;
+      Hl.diagonal().array() += lambda;
+      const Eigen::Matrix<double, 6, 1> dx = Hl.ldlt().solve(b);
+
+      const g2o::SE3Quat Tnew = g2o::SE3Quat::exp(dx)*Tcw;
+      const double chi2New = BuildSystem(Tnew, nullptr, nullptr);
+
+      const double scale = lambda*dx.dot(dx) + dx.dot(b) + 1e-3;
+      rho = (chi2 - chi2New)/scale;
+
+      if (rho > 0 && std::isfinite(chi2New)) {
+        // Good step, decrease damping
+        double alpha = 1.0 - pow(2*rho-1, 3);
+        alpha = std::min(alpha, 2.0/3.0);
+        lambda *= std::max(1.0/3.0, alpha);
+        ni = 2.0;
+
+        Tcw = Tnew;
+        chi2 = BuildSystem(Tcw, &H, &b);
+        update2 = dx.squaredNorm();
+      } else {
+        // Bad step, increase damping and retry
+        lambda *= ni;
+        ni *= 2.0;
+        rho = -1;
+      }
+      tries++;
+    } while (rho < 0 && tries < 10);
+
+    if (rho < 0 || update2 < minUpdate2)
+      break;
+  }
+
+  return it;
+}
+
+double PoseOptimizer::Chi2(size_t i, const g2o::SE3Quat &Tcw) const {
+  Eigen::Vector3d r;
+  Eigen::Matrix<double, 3, 6> J;
+  const Observation &obs = observations_[i];
+  const int dim = Linearize(obs, Tcw, r, J, false);
+  return r.head(dim).squaredNorm()*obs.invSigma2;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_POSE_OPTIMIZER_H_
+#define SD_SLAM_POSE_OPTIMIZER_H_
+
+#include <vector>
+#include <Eigen/Dense>
+#include "extra/g2o/types/se3quat.h"
+#include "extra/reprojection_batch.h"
+
+namespace SD_SLAM {
+
+// Levenberg-Marquardt over a single camera pose observing fixed 3D points. Same steps
+// and damping as g2o, but the 6x6 normal equations are solved directly and
+// observations are kept in a buffer reused between calls. Observations of the optimized
+// camera are linearized together in a ReprojectionBatch. Other cameras rigidly attached
+// to the optimized one can add monocular observations too.
+class PoseOptimizer {
+ public:
+  PoseOptimizer();
+
+  // Remove observations and rig cameras, keeping allocated memory. Camera 0 is the optimized one
+  void Clear(double fx, double fy, double cx, double cy, double bf);
+
+  // Add a camera with pose Tcb w.r.t. the optimized camera. Returns its index
+  int AddCamera(double fx, double fy, double cx, double cy, const Eigen::Matrix4d &Tcb);
+
+  // Add observation of point Xw at (u, v) by a camera. Monocular if ur < 0 (always for cameras
+  // other than 0). delta is the Huber threshold
+  void AddObservation(const Eigen::Vector3d &Xw, double u, double v, double ur, double invSigma2, double delta,
+                      int camera = 0);
+
+  // Optimize Tcw using inlier observations. It stops before nIterations once an accepted
+  // update is smaller than minUpdate (norm of the tangent vector). Returns iterations done
+  int Optimize(g2o::SE3Quat &Tcw, int nIterations, double minUpdate = 0.0);
+
+  // Squared error of observation i, without robust kernel
+  double Chi2(size_t i, const g2o::SE3Quat &Tcw) const;
+
+  inline size_t Size() const { return observations_.size(); }
+  inline bool IsStereo(size_t i) const { return observations_[i].stereo; }
+  inline bool IsInlier(size_t i) const { return observations_[i].inlier; }
+  void SetInlier(size_t i, bool inlier);
+  inline void SetRobust(bool robust) { robust_ = robust; }
+
+ private:
+  struct Observation {
+    Eigen::Vector3d Xw;
+    Eigen::Vector3d z;
+    double invSigma2;
+    double delta;
+    int camera;
+    int index;        // Index in batch_, only camera 0
+    bool stereo;
+    bool inlier;
+  };
+
+  // Rigidly attached camera, transforms points from camera 0 with R and t
+  struct Camera {
+    Eigen::Matrix3d R;
+    Eigen::Vector3d t;
+    double fx, fy, cx, cy;
+  };
+
+  // Residual and jacobian w.r.t. a left update of Tcw. Returns dimension (2 or 3)
+  int Linearize(const Observation &obs, const g2o::SE3Quat &Tcw, Eigen::Vector3d &r,
+                Eigen::Matrix<double, 3, 6> &J, bool bJacobian) const;
+
+  // Same for an observation of another camera (monocular)
+  int LinearizeRig(const Observation &obs, const g2o::SE3Quat &Tcw, Eigen::Vector3d &r,
+                   Eigen::Matrix<double, 3, 6> &J, bool bJacobian) const;
+
+  // Robust squared error of inliers, and normal equations if H and b are given
+  double BuildSystem(const g2o::SE3Quat &Tcw, Eigen::Matrix<double, 6, 6> *H, Eigen::Matrix<double, 6, 1> *b) const;
+
+  std::vector<Observation> observations_;
+  std::vector<Camera> cameras_;     // cameras_[i-1] is camera i
+  ReprojectionBatch batch_;
+
+  double fx_, fy_, cx_, cy_, bf_;
+  bool robust_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_POSE_OPTIMIZER_H_
@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_PRECISION_H_
+#define SD_SLAM_PRECISION_H_
+
+#include <Eigen/Dense>
+
+namespace SD_SLAM {
+
+// Scalar used by per-frame geometry in the tracking thread (frustum tests and image
+// alignment projections). Building with FLOAT_TRACKING halves its size, which doubles SIMD
+// width on ARM. Poses, map points and bundle adjustment stay in double.
+#ifdef FLOAT_TRACKING
+typedef float TrackScalar;
+#else
+typedef double TrackScalar;
+#endif
+
+typedef Eigen::Matrix<TrackScalar, 2, 1> TrackVector2;
+typedef Eigen::Matrix<TrackScalar, 3, 1> TrackVector3;
+typedef Eigen::Matrix<TrackScalar, 3, 3> TrackMatrix3;
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_PRECISION_H_
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "prosac.h"
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include "utils.h"
+
+using std::vector;
+
+namespace SD_SLAM {
+
+ProsacSampler::ProsacSampler() : m_(0), N_(0), n_(0), t_(0), Tn_(0.0), Tn_prime_(1) {
+}
+
+void ProsacSampler::Init(const vector<float> &vQuality, int sampleSize, int maxIterations) {
+  m_ = sampleSize;
+  N_ = vQuality.size();
+  n_ = 0;
+  t_ = 0;
+
+  sorted_.resize(N_);
+  std::iota(sorted_.begin(), sorted_.end(), 0);
+  std::stable_sort(sorted_.begin(), sorted_.end(),
+                   [&vQuality](size_t a, size_t b) { return vQuality[a] < vQuality[b]; });
+
+  if (m_ <= 0 || N_ < m_)
+    return;
+
+  // Average number of samples drawn only from the m best correspondences
+  Tn_ = maxIterations;
+  for (int i = 0; i < m_; i++)
+    Tn_ *= static_cast<double>(m_-i)/(N_-i);
+
+  n_ = m_;
+  Tn_prime_ = 1;
+}
+
+void ProsacSampler::Sample(vector<size_t> &vIndices) {
+  vIndices.resize(m_);
+  t_++;
+
+  // Grow subset following the schedule
+  if (t_ > Tn_prime_ && n_ < N_) {
+    double Tn1 = Tn_*(n_+1)/(n_+1-m_);
+    Tn_prime_ += static_cast<int>(ceil(Tn1-Tn_));
+    Tn_ = Tn1;
+    n_++;
+  }
+
+  // Draw from the n best, forcing the n-th one if the subset has just grown
+  int nRandom = n_;
+  int first = 0;
+  if (Tn_prime_ >= t_) {
+    vIndices[0] = sorted_[n_-1];
+    nRandom = n_-1;
+    first = 1;
+  }
+
+  vector<size_t> vAvailable(sorted_.begin(), sorted_.begin()+nRandom);
+  for (int i = first; i < m_; i++) {
+    int randi = Random(0, vAvailable.size()-1);
+    vIndices[i] = vAvailable[randi];
+
+    vAvailable[randi] = vAvailable.back();
+    vAvailable.pop_back();
+  }
+}
+
+}  // namespace SD_SLAM
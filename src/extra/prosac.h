@@ -0,0 +1,57 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_PROSAC_H_
+#define SD_SLAM_PROSAC_H_
+
+#include <vector>
+#include <cstddef>
+
+namespace SD_SLAM {
+
+// PROSAC sampler (Chum and Matas, 2005). Minimal sets are drawn from a subset of
+// the best ranked correspondences, which grows until it covers all of them.
+class ProsacSampler {
+ public:
+  ProsacSampler();
+
+  // Set correspondence quality, lower is better. Resets the growth schedule, which
+  // reaches all correspondences after about maxIterations samples
+  void Init(const std::vector<float> &vQuality, int sampleSize, int maxIterations);
+
+  // Draw a minimal set of indices for the next iteration
+  void Sample(std::vector<size_t> &vIndices);
+
+  inline bool IsValid() const { return n_ >= m_ && m_ > 0; }
+
+ private:
+  // Correspondences sorted by quality
+  std::vector<size_t> sorted_;
+
+  int m_;   // Minimal set size
+  int N_;   // Number of correspondences
+  int n_;   // Current subset size
+  int t_;   // Current iteration
+
+  double Tn_;
+  int Tn_prime_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_PROSAC_H_
@@ -0,0 +1,284 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "reprojection_batch.h"
+#include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace SD_SLAM {
+
+namespace {
+
+// Jacobian of (u, v, ur) w.r.t. a left update of the pose, row 2 is zero if monocular.
+// Same as PoseOptimizer and EdgeStereoSE3ProjectXYZOnlyPose
+inline void ProjectionJacobian(double x, double y, double invz, bool stereo, double fx, double fy, double bf,
+                               double J[3][6]) {
+  const double invz_2 = invz*invz;
+
+  J[0][0] = x*y*invz_2 *fx;
+  J[0][1] = -(1+(x*x*invz_2)) *fx;
+  J[0][2] = y*invz *fx;
+  J[0][3] = -invz *fx;
+  J[0][4] = 0;
+  J[0][5] = x*invz_2 *fx;
+
+  J[1][0] = (1+y*y*invz_2) *fy;
+  J[1][1] = -x*y*invz_2 *fy;
+  J[1][2] = -x*invz *fy;
+  J[1][3] = 0;
+  J[1][4] = -invz *fy;
+  J[1][5] = y*invz_2 *fy;
+
+  const double s = stereo ? 1.0 : 0.0;
+  J[2][0] = s*(J[0][0]-bf*y*invz_2);
+  J[2][1] = s*(J[0][1]+bf*x*invz_2);
+  J[2][2] = s*J[0][2];
+  J[2][3] = s*J[0][3];
+  J[2][4] = 0;
+  J[2][5] = s*(J[0][5]-bf*invz_2);
+}
+
+}  // namespace
+
+ReprojectionBatch::ReprojectionBatch() : fx_(0), fy_(0), cx_(0), cy_(0), bf_(0) {
+}
+
+void ReprojectionBatch::Clear(double fx, double fy, double cx, double cy, double bf) {
+  xw_.clear();
+  yw_.clear();
+  zw_.clear();
+  u_.clear();
+  v_.clear();
+  ur_.clear();
+  info_.clear();
+  delta_.clear();
+  inlier_.clear();
+  fx_ = fx;
+  fy_ = fy;
+  cx_ = cx;
+  cy_ = cy;
+  bf_ = bf;
+}
+
+void ReprojectionBatch::Add(const Eigen::Vector3d &Xw, double u, double v, double ur, double invSigma2, double delta) {
+  xw_.push_back(Xw(0));
+  yw_.push_back(Xw(1));
+  zw_.push_back(Xw(2));
+  u_.push_back(u);
+  v_.push_back(v);
+  ur_.push_back(ur);
+  info_.push_back(invSigma2);
+  delta_.push_back(delta);
+  inlier_.push_back(1.0);
+}
+
+double ReprojectionBatch::Accumulate(const g2o::SE3Quat &Tcw, bool robust, Eigen::Matrix<double, 6, 6> *H,
+                                     Eigen::Matrix<double, 6, 1> *b) const {
+  const bool bJacobian = H && b;
+  const Eigen::Matrix3d R = Tcw.rotation().toRotationMatrix();
+  const Eigen::Vector3d &t = Tcw.translation();
+  const size_t n = Size();
+
+  // Upper triangle of J^T*W*J row by row, and J^T*W*r
+  double h[21] = {0};
+  double g[6] = {0};
+  double chi2 = 0.0;
+  size_t i = 0;
+
+#if defined(__AVX__)
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d two = _mm256_set1_pd(2.0);
+  const __m256d fx = _mm256_set1_pd(fx_), fy = _mm256_set1_pd(fy_);
+  const __m256d cx = _mm256_set1_pd(cx_), cy = _mm256_set1_pd(cy_);
+  const __m256d bf = _mm256_set1_pd(bf_);
+
+  __m256d Rv[3][3], tv[3];
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++)
+      Rv[r][c] = _mm256_set1_pd(R(r, c));
+    tv[r] = _mm256_set1_pd(t(r));
+  }
+
+  __m256d hv[21], gv[6], chi2v = zero;
+  for (int k = 0; k < 21; k++)
+    hv[k] = zero;
+  for (int k = 0; k < 6; k++)
+    gv[k] = zero;
+
+  for (; i+4 <= n; i += 4) {
+    const __m256d xw = _mm256_loadu_pd(&xw_[i]);
+    const __m256d yw = _mm256_loadu_pd(&yw_[i]);
+    const __m256d zw = _mm256_loadu_pd(&zw_[i]);
+
+    // Outliers are zeroed, so they stay finite and add nothing
+    const __m256d inlier = _mm256_cmp_pd(_mm256_loadu_pd(&inlier_[i]), zero, _CMP_GT_OQ);
+    __m256d xc[3];
+    for (int r = 0; r < 3; r++) {
+      xc[r] = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(Rv[r][0], xw), _mm256_mul_pd(Rv[r][1], yw)),
+                            _mm256_add_pd(_mm256_mul_pd(Rv[r][2], zw), tv[r]));
+    }
+    const __m256d x = _mm256_and_pd(inlier, xc[0]);
+    const __m256d y = _mm256_and_pd(inlier, xc[1]);
+    const __m256d invz = _mm256_and_pd(inlier, _mm256_div_pd(one, xc[2]));
+
+    const __m256d ur = _mm256_loadu_pd(&ur_[i]);
+    const __m256d stereo = _mm256_and_pd(inlier, _mm256_cmp_pd(ur, zero, _CMP_GE_OQ));
+
+    const __m256d u = _mm256_add_pd(_mm256_mul_pd(fx, _mm256_mul_pd(x, invz)), cx);
+    const __m256d r0 = _mm256_sub_pd(_mm256_loadu_pd(&u_[i]), u);
+    const __m256d r1 = _mm256_sub_pd(_mm256_loadu_pd(&v_[i]), _mm256_add_pd(_mm256_mul_pd(fy, _mm256_mul_pd(y, invz)), cy));
+    const __m256d r2 = _mm256_and_pd(stereo, _mm256_sub_pd(ur, _mm256_sub_pd(u, _mm256_mul_pd(bf, invz))));
+
+    const __m256d info = _mm256_loadu_pd(&info_[i]);
+    const __m256d e2 = _mm256_mul_pd(info, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(r0, r0), _mm256_mul_pd(r1, r1)),
+                                                         _mm256_mul_pd(r2, r2)));
+
+    // Huber kernel, weights information with its first derivative
+    __m256d w = info;
+    __m256d err = e2;
+    if (robust) {
+      const __m256d delta = _mm256_loadu_pd(&delta_[i]);
+      const __m256d e = _mm256_sqrt_pd(e2);
+      const __m256d outside = _mm256_cmp_pd(e2, _mm256_mul_pd(delta, delta), _CMP_GT_OQ);
+      const __m256d huber = _mm256_sub_pd(_mm256_mul_pd(two, _mm256_mul_pd(e, delta)), _mm256_mul_pd(delta, delta));
+      err = _mm256_blendv_pd(e2, huber, outside);
+      w = _mm256_blendv_pd(info, _mm256_mul_pd(info, _mm256_div_pd(delta, e)), outside);
+    }
+    chi2v = _mm256_add_pd(chi2v, _mm256_and_pd(inlier, err));
+
+    if (!bJacobian)
+      continue;
+
+    w = _mm256_and_pd(inlier, w);
+
+    const __m256d invz_2 = _mm256_mul_pd(invz, invz);
+    const __m256d x_invz_2 = _mm256_mul_pd(x, invz_2);
+    const __m256d y_invz_2 = _mm256_mul_pd(y, invz_2);
+    const __m256d xy_invz_2 = _mm256_mul_pd(x, y_invz_2);
+
+    __m256d J[3][6];
+    J[0][0] = _mm256_mul_pd(xy_invz_2, fx);
+    J[0][1] = _mm256_sub_pd(zero, _mm256_mul_pd(_mm256_add_pd(one, _mm256_mul_pd(x, x_invz_2)), fx));
+    J[0][2] = _mm256_mul_pd(_mm256_mul_pd(y, invz), fx);
+    J[0][3] = _mm256_sub_pd(zero, _mm256_mul_pd(invz, fx));
+    J[0][4] = zero;
+    J[0][5] = _mm256_mul_pd(x_invz_2, fx);
+
+    J[1][0] = _mm256_mul_pd(_mm256_add_pd(one, _mm256_mul_pd(y, y_invz_2)), fy);
+    J[1][1] = _mm256_sub_pd(zero, _mm256_mul_pd(xy_invz_2, fy));
+    J[1][2] = _mm256_sub_pd(zero, _mm256_mul_pd(_mm256_mul_pd(x, invz), fy));
+    J[1][3] = zero;
+    J[1][4] = _mm256_sub_pd(zero, _mm256_mul_pd(invz, fy));
+    J[1][5] = _mm256_mul_pd(y_invz_2, fy);
+
+    J[2][0] = _mm256_and_pd(stereo, _mm256_sub_pd(J[0][0], _mm256_mul_pd(bf, y_invz_2)));
+    J[2][1] = _mm256_and_pd(stereo, _mm256_add_pd(J[0][1], _mm256_mul_pd(bf, x_invz_2)));
+    J[2][2] = _mm256_and_pd(stereo, J[0][2]);
+    J[2][3] = _mm256_and_pd(stereo, J[0][3]);
+    J[2][4] = zero;
+    J[2][5] = _mm256_and_pd(stereo, _mm256_sub_pd(J[0][5], _mm256_mul_pd(bf, invz_2)));
+
+    int k = 0;
+    for (int p = 0; p < 6; p++) {
+      const __m256d wJ0 = _mm256_mul_pd(w, J[0][p]);
+      const __m256d wJ1 = _mm256_mul_pd(w, J[1][p]);
+      const __m256d wJ2 = _mm256_mul_pd(w, J[2][p]);
+      for (int q = p; q < 6; q++, k++) {
+        hv[k] = _mm256_add_pd(hv[k], _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(wJ0, J[0][q]), _mm256_mul_pd(wJ1, J[1][q])),
+                                                   _mm256_mul_pd(wJ2, J[2][q])));
+      }
+      gv[p] = _mm256_add_pd(gv[p], _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(wJ0, r0), _mm256_mul_pd(wJ1, r1)),
+                                                 _mm256_mul_pd(wJ2, r2)));
+    }
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, chi2v);
+  chi2 = (lanes[0]+lanes[1]) + (lanes[2]+lanes[3]);
+  if (bJacobian) {
+    for (int k = 0; k < 21; k++) {
+      _mm256_storeu_pd(lanes, hv[k]);
+      h[k] = (lanes[0]+lanes[1]) + (lanes[2]+lanes[3]);
+    }
+    for (int k = 0; k < 6; k++) {
+      _mm256_storeu_pd(lanes, gv[k]);
+      g[k] = (lanes[0]+lanes[1]) + (lanes[2]+lanes[3]);
+    }
+  }
+#endif
+
+  // Remaining observations (all of them without AVX)
+  for (; i < n; i++) {
+    if (inlier_[i] == 0)
+      continue;
+
+    const Eigen::Vector3d Xc = R*Eigen::Vector3d(xw_[i], yw_[i], zw_[i]) + t;
+    const double invz = 1.0/Xc(2);
+    const bool stereo = ur_[i] >= 0;
+
+    const double u = fx_*Xc(0)*invz + cx_;
+    double r[3];
+    r[0] = u_[i] - u;
+    r[1] = v_[i] - (fy_*Xc(1)*invz + cy_);
+    r[2] = stereo ? ur_[i] - (u - bf_*invz) : 0.0;
+
+    const double e2 = (r[0]*r[0] + r[1]*r[1] + r[2]*r[2])*info_[i];
+    const double delta = delta_[i];
+
+    double w = info_[i];
+    if (robust && e2 > delta*delta) {
+      const double e = sqrt(e2);
+      chi2 += 2*e*delta - delta*delta;
+      w *= delta/e;
+    } else {
+      chi2 += e2;
+    }
+
+    if (!bJacobian)
+      continue;
+
+    double J[3][6];
+    ProjectionJacobian(Xc(0), Xc(1), invz, stereo, fx_, fy_, bf_, J);
+
+    int k = 0;
+    for (int p = 0; p < 6; p++) {
+      for (int q = p; q < 6; q++, k++)
+        h[k] += w*(J[0][p]*J[0][q] + J[1][p]*J[1][q] + J[2][p]*J[2][q]);
+      g[p] += w*(J[0][p]*r[0] + J[1][p]*r[1] + J[2][p]*r[2]);
+    }
+  }
+
+  if (bJacobian) {
+    int k = 0;
+    for (int p = 0; p < 6; p++) {
+      for (int q = p; q < 6; q++, k++) {
+        (*H)(p, q) += h[k];
+        if (q != p)
+          (*H)(q, p) += h[k];
+      }
+      (*b)(p) -= g[p];
+    }
+  }
+
+  return chi2;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_REPROJECTION_BATCH_H_
+#define SD_SLAM_REPROJECTION_BATCH_H_
+
+#include <vector>
+#include <Eigen/Dense>
+#include "extra/g2o/types/se3quat.h"
+
+namespace SD_SLAM {
+
+// Monocular and stereo reprojection errors of fixed 3D points seen by one camera, stored
+// as structure of arrays. Residuals, Huber weights and jacobians w.r.t. a left update of
+// the pose are computed for 4 observations at a time with AVX, without branches, and
+// accumulated into the 6x6 normal equations.
+class ReprojectionBatch {
+ public:
+  ReprojectionBatch();
+
+  // Remove observations, keeping allocated memory
+  void Clear(double fx, double fy, double cx, double cy, double bf);
+
+  // Add observation of point Xw at (u, v). Monocular if ur < 0. delta is the Huber threshold
+  void Add(const Eigen::Vector3d &Xw, double u, double v, double ur, double invSigma2, double delta);
+
+  inline size_t Size() const { return u_.size(); }
+  inline void SetInlier(size_t i, bool inlier) { inlier_[i] = inlier ? 1.0 : 0.0; }
+
+  // Squared error of inliers for pose Tcw, with Huber kernel if robust. If H and b are
+  // given, the normal equations are added to them
+  double Accumulate(const g2o::SE3Quat &Tcw, bool robust, Eigen::Matrix<double, 6, 6> *H,
+                    Eigen::Matrix<double, 6, 1> *b) const;
+
+ private:
+  std::vector<double> xw_, yw_, zw_;
+  std::vector<double> u_, v_, ur_;
+  std::vector<double> info_;
+  std::vector<double> delta_;
+  std::vector<double> inlier_;    // 1 or 0, used as a mask
+
+  double fx_, fy_, cx_, cy_, bf_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_REPROJECTION_BATCH_H_
@@ -0,0 +1,77 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SCALE_LEVELS_H_
+#define SD_SLAM_SCALE_LEVELS_H_
+
+#include <cstddef>
+#include <cmath>
+#include <vector>
+
+namespace SD_SLAM {
+
+// Scale factors and sigmas of an image pyramid, scaleFactor^k for level k. Built once per
+// extractor and shared read-only by its frames and keyframes.
+struct ScalePyramid {
+  ScalePyramid(int levels, float scaleFactor): nLevels(levels), fScaleFactor(scaleFactor),
+      fLogScaleFactor(std::log(scaleFactor)), vScaleFactors(levels), vInvScaleFactors(levels),
+      vLevelSigma2(levels), vInvLevelSigma2(levels) {
+    for (int i = 0; i < levels; i++) {
+      vScaleFactors[i] = i == 0 ? 1.0f : vScaleFactors[i-1]*scaleFactor;
+      vLevelSigma2[i] = vScaleFactors[i]*vScaleFactors[i];
+      vInvScaleFactors[i] = 1.0f/vScaleFactors[i];
+      vInvLevelSigma2[i] = 1.0f/vLevelSigma2[i];
+    }
+  }
+
+  const int nLevels;
+  const float fScaleFactor;
+  const float fLogScaleFactor;
+  std::vector<float> vScaleFactors;
+  std::vector<float> vInvScaleFactors;
+  std::vector<float> vLevelSigma2;
+  std::vector<float> vInvLevelSigma2;
+};
+
+// Pyramid level where a point seen at maxDist in level 0 keeps its size at distance dist,
+// ceil(log(maxDist/dist)/log(scaleFactor)) clamped to [0, levels-1]. scaleFactors are the
+// pyramid factors (scaleFactors[k] = scaleFactor^k), so the level is the number of them the
+// distance ratio exceeds and no log is needed.
+inline int PredictLevel(float maxDist, float dist, const float *scaleFactors, int levels) {
+  int level = 0;
+  for (int k = 0; k < levels-1; k++)
+    level += maxDist > dist*scaleFactors[k];
+  return level;
+}
+
+// Same for n points, one pass over all points per level so the compiler can vectorize it
+inline void PredictLevels(const float *maxDist, const float *dist, size_t n, const float *scaleFactors,
+                          int levels, int *level) {
+  for (size_t i = 0; i < n; i++)
+    level[i] = 0;
+
+  for (int k = 0; k < levels-1; k++) {
+    const float sf = scaleFactors[k];
+    for (size_t i = 0; i < n; i++)
+      level[i] += maxDist[i] > dist[i]*sf;
+  }
+}
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SCALE_LEVELS_H_
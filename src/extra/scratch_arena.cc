@@ -0,0 +1,111 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "scratch_arena.h"
+#include <cstdlib>
+#include <new>
+
+namespace SD_SLAM {
+
+ScratchArena::ScratchArena(size_t chunkSize):
+    chunkSize_(chunkSize), current_(0), offset_(0), used_(0), depth_(0) {
+}
+
+ScratchArena::~ScratchArena() {
+  for (const Chunk &chunk : chunks_)
+    free(chunk.data);
+}
+
+ScratchArena& ScratchArena::Local() {
+  thread_local ScratchArena arena;
+  return arena;
+}
+
+void* ScratchArena::Allocate(size_t size) {
+  size = (size+Alignment-1) & ~(Alignment-1);
+
+  // Next chunk kept from a previous scope, or a new one twice as big
+  while (current_ < chunks_.size() && offset_+size > chunks_[current_].size) {
+    current_++;
+    offset_ = 0;
+  }
+  if (current_ == chunks_.size()) {
+    const size_t chunkSize = chunks_.empty() ? chunkSize_ : 2*chunks_.back().size;
+    AddChunk(chunkSize > size ? chunkSize : size);
+  }
+
+  void* p = chunks_[current_].data+offset_;
+  offset_ += size;
+  used_ += size;
+  return p;
+}
+
+void ScratchArena::Release(void* p, size_t size) {
+  size = (size+Alignment-1) & ~(Alignment-1);
+  if (current_ < chunks_.size() && offset_ >= size && p == chunks_[current_].data+offset_-size) {
+    offset_ -= size;
+    used_ -= size;
+  }
+}
+
+size_t ScratchArena::Capacity() const {
+  size_t total = 0;
+  for (const Chunk &chunk : chunks_)
+    total += chunk.size;
+  return total;
+}
+
+void ScratchArena::AddChunk(size_t size) {
+  Chunk chunk;
+  void* data = nullptr;
+  if (posix_memalign(&data, Alignment, size) != 0)
+    throw std::bad_alloc();
+  chunk.data = static_cast<char*>(data);
+  chunk.size = size;
+  chunks_.push_back(chunk);
+}
+
+void ScratchArena::Reset() {
+  if (chunks_.size() > 1) {
+    const size_t total = Capacity();
+    for (const Chunk &chunk : chunks_)
+      free(chunk.data);
+    chunks_.clear();
+    AddChunk(total);
+  }
+  current_ = 0;
+  offset_ = 0;
+  used_ = 0;
+}
+
+ScratchScope::ScratchScope():
+    arena_(ScratchArena::Local()), current_(arena_.current_), offset_(arena_.offset_), used_(arena_.used_) {
+  arena_.depth_++;
+}
+
+ScratchScope::~ScratchScope() {
+  if (--arena_.depth_ == 0) {
+    arena_.Reset();
+  } else {
+    arena_.current_ = current_;
+    arena_.offset_ = offset_;
+    arena_.used_ = used_;
+  }
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,130 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SCRATCH_ARENA_H_
+#define SD_SLAM_SCRATCH_ARENA_H_
+
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <functional>
+
+namespace SD_SLAM {
+
+// Per-thread bump allocator for short-lived containers of the matcher, optimizer, local
+// mapping and loop closing. Allocation is a pointer increment in memory owned by the thread,
+// so threads never meet in the global allocator. Memory is handed back when the innermost
+// ScratchScope ends and kept for the next one. Containers using it must be created inside a
+// scope and destroyed before it ends, and must not grow while a nested scope is active.
+class ScratchArena {
+ public:
+  // Enough for vectorized Eigen types
+  static const size_t Alignment = 32;
+
+  explicit ScratchArena(size_t chunkSize = 256 << 10);
+  ~ScratchArena();
+
+  ScratchArena(const ScratchArena&) = delete;
+  ScratchArena& operator=(const ScratchArena&) = delete;
+
+  // Arena of the calling thread
+  static ScratchArena& Local();
+
+  void* Allocate(size_t size);
+
+  // Only the last allocation is given back (e.g. a vector reallocating), the rest when the scope ends
+  void Release(void* p, size_t size);
+
+  // Bytes allocated and reserved
+  inline size_t Used() const { return used_; }
+  size_t Capacity() const;
+
+ private:
+  friend class ScratchScope;
+
+  void AddChunk(size_t size);
+
+  // Called when the outermost scope ends: chunks are merged, so the same work fits in one
+  void Reset();
+
+  struct Chunk {
+    char* data;
+    size_t size;
+  };
+
+  std::vector<Chunk> chunks_;
+  size_t chunkSize_;
+  size_t current_;    // Chunk being filled
+  size_t offset_;     // First free byte in current chunk
+  size_t used_;
+  int depth_;         // Active scopes
+};
+
+// Marks the arena of the calling thread and rewinds it to the mark when destroyed
+class ScratchScope {
+ public:
+  ScratchScope();
+  ~ScratchScope();
+
+  ScratchScope(const ScratchScope&) = delete;
+  ScratchScope& operator=(const ScratchScope&) = delete;
+
+ private:
+  ScratchArena &arena_;
+  size_t current_, offset_, used_;
+};
+
+// Standard allocator on the arena of the thread that creates it
+template <typename T>
+class ScratchAllocator {
+ public:
+  typedef T value_type;
+
+  ScratchAllocator(): arena_(&ScratchArena::Local()) {}
+
+  template <typename U>
+  ScratchAllocator(const ScratchAllocator<U> &other): arena_(other.arena_) {}
+
+  inline T* allocate(size_t n) {
+    return static_cast<T*>(arena_->Allocate(n*sizeof(T)));
+  }
+
+  inline void deallocate(T* p, size_t n) {
+    arena_->Release(p, n*sizeof(T));
+  }
+
+  template <typename U>
+  inline bool operator==(const ScratchAllocator<U> &other) const { return arena_ == other.arena_; }
+  template <typename U>
+  inline bool operator!=(const ScratchAllocator<U> &other) const { return arena_ != other.arena_; }
+
+ private:
+  template <typename U> friend class ScratchAllocator;
+
+  ScratchArena* arena_;
+};
+
+template <typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T> >;
+
+template <typename K, typename V, typename Compare = std::less<K> >
+using ScratchMap = std::map<K, V, Compare, ScratchAllocator<std::pair<const K, V> > >;
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SCRATCH_ARENA_H_
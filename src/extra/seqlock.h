@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SEQLOCK_H_
+#define SD_SLAM_SEQLOCK_H_
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+
+namespace SD_SLAM {
+
+// Sequence lock for data read much more often than written. Readers never block
+// writers nor allocate: they copy the data and retry if a write was in progress.
+// Protected data must be stored in SeqLock::Word arrays, so copies do not race.
+class SeqLock {
+ public:
+  typedef std::atomic<uint64_t> Word;
+
+  SeqLock() : seq_(0) {}
+
+  // Writer side. Writers must be serialized by the caller
+  inline void BeginWrite() {
+    seq_.store(seq_.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  inline void EndWrite() {
+    seq_.store(seq_.load(std::memory_order_relaxed)+1, std::memory_order_release);
+  }
+
+  // Reader side. Data is valid if Retry returns false
+  inline unsigned BeginRead() const {
+    unsigned seq;
+    while ((seq = seq_.load(std::memory_order_acquire)) & 1)
+      std::this_thread::yield();
+    return seq;
+  }
+
+  inline bool Retry(unsigned seq) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq_.load(std::memory_order_relaxed) != seq;
+  }
+
+  // Copy bytes to/from protected words
+  static inline void Store(Word *dst, const void *src, size_t bytes) {
+    const char *p = static_cast<const char*>(src);
+    for (size_t i = 0; i < bytes; i += sizeof(uint64_t)) {
+      uint64_t w = 0;
+      memcpy(&w, p+i, bytes-i < sizeof(uint64_t) ? bytes-i : sizeof(uint64_t));
+      dst[i/sizeof(uint64_t)].store(w, std::memory_order_relaxed);
+    }
+  }
+
+  static inline void Load(void *dst, const Word *src, size_t bytes) {
+    char *p = static_cast<char*>(dst);
+    for (size_t i = 0; i < bytes; i += sizeof(uint64_t)) {
+      uint64_t w = src[i/sizeof(uint64_t)].load(std::memory_order_relaxed);
+      memcpy(p+i, &w, bytes-i < sizeof(uint64_t) ? bytes-i : sizeof(uint64_t));
+    }
+  }
+
+ private:
+  std::atomic<unsigned> seq_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SEQLOCK_H_
@@ -0,0 +1,329 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "sequence_file.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "log.h"
+
+using std::string;
+using std::vector;
+
+namespace SD_SLAM {
+
+const uint32_t SequenceWriter::VERSION = 1;
+const int SequenceReader::PREFETCH_FRAMES = 8;
+
+namespace {
+
+const char MAGIC[4] = {'S', 'D', 'S', 'Q'};
+const size_t HEADER_SIZE = 64;
+const size_t ALIGNMENT = 64;
+const size_t IMAGE_SIZE = 3*sizeof(int32_t)+sizeof(uint64_t);
+const size_t ENTRY_SIZE = sizeof(double)+sizeof(uint32_t)+2*IMAGE_SIZE;
+
+template <typename T>
+inline void Store(vector<uint8_t> &buf, T v) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&v);
+  buf.insert(buf.end(), p, p+sizeof(T));
+}
+
+template <typename T>
+inline T Load(const uint8_t* &p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  p += sizeof(T);
+  return v;
+}
+
+}  // namespace
+
+SequenceWriter::SequenceWriter(): offset_(0), ok_(false) {
+}
+
+SequenceWriter::~SequenceWriter() {
+  if (file_.is_open())
+    Close();
+}
+
+bool SequenceWriter::Open(const string &filename) {
+  file_.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!file_.is_open()) {
+    LOGE("Can't create sequence file %s", filename.c_str());
+    return false;
+  }
+
+  // Header is written on close, when offsets are known
+  const char zeros[HEADER_SIZE] = {0};
+  file_.write(zeros, HEADER_SIZE);
+  offset_ = HEADER_SIZE;
+  entries_.clear();
+  imu_.clear();
+  ok_ = file_.good();
+  return ok_;
+}
+
+bool SequenceWriter::WriteMat(const cv::Mat &m, Image &image) {
+  image.rows = m.rows;
+  image.cols = m.cols;
+  image.type = m.type();
+  image.offset = 0;
+  if (m.empty())
+    return true;
+
+  const char zeros[ALIGNMENT] = {0};
+  const size_t pad = (ALIGNMENT - offset_%ALIGNMENT) % ALIGNMENT;
+  file_.write(zeros, pad);
+  offset_ += pad;
+  image.offset = offset_;
+
+  // Rows are stored contiguous
+  const size_t rowSize = m.cols*m.elemSize();
+  for (int r = 0; r < m.rows; r++)
+    file_.write(reinterpret_cast<const char*>(m.ptr(r)), rowSize);
+  offset_ += rowSize*m.rows;
+
+  return file_.good();
+}
+
+bool SequenceWriter::AddFrame(double timestamp, const cv::Mat &image, const cv::Mat &depth) {
+  if (!ok_ || image.empty() || image.type() != CV_8UC1)
+    return false;
+
+  Entry entry;
+  entry.timestamp = timestamp;
+  ok_ = WriteMat(image, entry.image) && WriteMat(depth, entry.depth);
+  if (ok_)
+    entries_.push_back(entry);
+  return ok_;
+}
+
+void SequenceWriter::AddIMU(double timestamp, const double gyro[3], const double acc[3]) {
+  imu_.push_back(timestamp);
+  imu_.insert(imu_.end(), gyro, gyro+3);
+  imu_.insert(imu_.end(), acc, acc+3);
+}
+
+bool SequenceWriter::Close() {
+  if (!file_.is_open())
+    return false;
+
+  // Index, with the first IMU sample not older than each frame
+  vector<uint8_t> buf;
+  buf.reserve(entries_.size()*ENTRY_SIZE);
+  const size_t nimu = imu_.size()/7;
+  size_t imuIdx = 0;
+  for (const Entry &e : entries_) {
+    while (imuIdx < nimu && imu_[7*imuIdx] < e.timestamp)
+      imuIdx++;
+
+    Store<double>(buf, e.timestamp);
+    Store<uint32_t>(buf, imuIdx);
+    for (const Image *im : {&e.image, &e.depth}) {
+      Store<int32_t>(buf, im->rows);
+      Store<int32_t>(buf, im->cols);
+      Store<int32_t>(buf, im->type);
+      Store<uint64_t>(buf, im->offset);
+    }
+  }
+
+  const uint64_t indexOffset = offset_;
+  file_.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+  offset_ += buf.size();
+
+  // IMU samples are read as doubles, keep them aligned
+  const char zeros[ALIGNMENT] = {0};
+  const size_t pad = (ALIGNMENT - offset_%ALIGNMENT) % ALIGNMENT;
+  file_.write(zeros, pad);
+  offset_ += pad;
+  const uint64_t imuOffset = offset_;
+  file_.write(reinterpret_cast<const char*>(imu_.data()), imu_.size()*sizeof(double));
+
+  vector<uint8_t> header;
+  header.insert(header.end(), MAGIC, MAGIC+4);
+  Store<uint32_t>(header, VERSION);
+  Store<uint32_t>(header, entries_.size());
+  Store<uint32_t>(header, nimu);
+  Store<uint64_t>(header, indexOffset);
+  Store<uint64_t>(header, imuOffset);
+  header.resize(HEADER_SIZE, 0);
+
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char*>(header.data()), header.size());
+  ok_ = ok_ && file_.good();
+  file_.close();
+
+  return ok_;
+}
+
+SequenceReader::SequenceReader(): data_(nullptr), size_(0), nframes_(0), nimu_(0), index_(nullptr),
+                                  imu_(nullptr), prefetched_(0) {
+}
+
+SequenceReader::~SequenceReader() {
+  if (data_)
+    munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+bool SequenceReader::Open(const string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOGE("Failed to open sequence: %s", filename.c_str());
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+    LOGE("Sequence not valid: %s", filename.c_str());
+    close(fd);
+    return false;
+  }
+
+  size_ = st.st_size;
+  void* data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOGE("Failed to map sequence: %s", filename.c_str());
+    return false;
+  }
+  data_ = static_cast<const uint8_t*>(data);
+
+  // Frames are read in order, let the kernel read ahead aggressively
+  madvise(data, size_, MADV_SEQUENTIAL);
+
+  const uint8_t* p = data_;
+  if (memcmp(p, MAGIC, 4) != 0) {
+    LOGE("%s is not a sequence file", filename.c_str());
+    return false;
+  }
+  p += 4;
+
+  const uint32_t version = Load<uint32_t>(p);
+  nframes_ = Load<uint32_t>(p);
+  nimu_ = Load<uint32_t>(p);
+  const uint64_t indexOffset = Load<uint64_t>(p);
+  const uint64_t imuOffset = Load<uint64_t>(p);
+
+  if (version != SequenceWriter::VERSION || indexOffset+nframes_*ENTRY_SIZE > size_ ||
+      imuOffset+nimu_*7*sizeof(double) > size_ || imuOffset%sizeof(double) != 0) {
+    LOGE("Sequence %s is truncated or has an unsupported version", filename.c_str());
+    nframes_ = nimu_ = 0;
+    return false;
+  }
+
+  index_ = data_+indexOffset;
+  imu_ = reinterpret_cast<const double*>(data_+imuOffset);
+  prefetched_ = 0;
+  return true;
+}
+
+bool SequenceReader::HasDepth() const {
+  if (nframes_ == 0)
+    return false;
+  const uint8_t* p = index_+sizeof(double)+sizeof(uint32_t)+IMAGE_SIZE;
+  return Load<int32_t>(p) > 0;
+}
+
+bool SequenceReader::ReadMat(const uint8_t* p, cv::Mat &m) const {
+  const int rows = Load<int32_t>(p);
+  const int cols = Load<int32_t>(p);
+  const int type = Load<int32_t>(p);
+  const uint64_t offset = Load<uint64_t>(p);
+
+  if (rows <= 0 || cols <= 0) {
+    m = cv::Mat();
+    return true;
+  }
+
+  const size_t bytes = static_cast<size_t>(rows)*cols*CV_ELEM_SIZE(type);
+  if (offset+bytes > size_)
+    return false;
+
+  // View of the mapping, it must not be written
+  m = cv::Mat(rows, cols, type, const_cast<uint8_t*>(data_+offset));
+  return true;
+}
+
+void SequenceReader::Prefetch(size_t i) {
+  // Request frames [i, i+PREFETCH_FRAMES) once, their pages are read while earlier ones are used
+  const size_t end = std::min(i+PREFETCH_FRAMES, nframes_);
+  if (end <= prefetched_)
+    return;
+  const size_t first = std::max(i, prefetched_);
+
+  const uint8_t* p = index_+first*ENTRY_SIZE+sizeof(double)+sizeof(uint32_t)+3*sizeof(int32_t);
+  const uint64_t begin = Load<uint64_t>(p);
+  const uint8_t* q = index_+(end-1)*ENTRY_SIZE+sizeof(double)+sizeof(uint32_t);
+  const int rows = Load<int32_t>(q);
+  const int cols = Load<int32_t>(q);
+  const int type = Load<int32_t>(q);
+  uint64_t last = Load<uint64_t>(q) + static_cast<uint64_t>(rows)*cols*CV_ELEM_SIZE(type);
+
+  // Depth follows its image
+  const int drows = Load<int32_t>(q);
+  const int dcols = Load<int32_t>(q);
+  const int dtype = Load<int32_t>(q);
+  const uint64_t doffset = Load<uint64_t>(q);
+  if (drows > 0)
+    last = doffset + static_cast<uint64_t>(drows)*dcols*CV_ELEM_SIZE(dtype);
+
+  const long page = sysconf(_SC_PAGESIZE);
+  const uint64_t pageBegin = begin - begin%page;
+  if (last > pageBegin && last <= size_)
+    madvise(const_cast<uint8_t*>(data_+pageBegin), last-pageBegin, MADV_WILLNEED);
+
+  prefetched_ = end;
+}
+
+bool SequenceReader::Get(size_t i, Frame &frame) {
+  if (i >= nframes_)
+    return false;
+
+  Prefetch(i);
+
+  const uint8_t* p = index_+i*ENTRY_SIZE;
+  frame.timestamp = Load<double>(p);
+  frame.imuEnd = std::min(static_cast<size_t>(Load<uint32_t>(p))+1, nimu_);
+  frame.imuBegin = 0;
+  if (i > 0) {
+    const uint8_t* prev = index_+(i-1)*ENTRY_SIZE+sizeof(double);
+    frame.imuBegin = std::min(static_cast<size_t>(Load<uint32_t>(prev))+1, frame.imuEnd);
+  }
+
+  if (!ReadMat(p, frame.image) || !ReadMat(p+IMAGE_SIZE, frame.depth)) {
+    LOGE("Frame %lu of sequence is out of the file", i);
+    return false;
+  }
+  return !frame.image.empty();
+}
+
+void SequenceReader::GetIMU(size_t i, double &timestamp, double gyro[3], double acc[3]) const {
+  const double* s = imu_+7*i;
+  timestamp = s[0];
+  for (int k = 0; k < 3; k++) {
+    gyro[k] = s[1+k];
+    acc[k] = s[4+k];
+  }
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,129 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef SD_SLAM_SEQUENCE_FILE_H_
+#define SD_SLAM_SEQUENCE_FILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Packed sequence: decoded frames, IMU samples and timestamps of a dataset in a single file, so
+// benchmarks read it at memory speed instead of walking directories and decoding PNG files.
+// Images are stored raw at 64 byte aligned offsets and read without copying from a mapping.
+//
+// File layout: header, frame images one after another, frame index and IMU samples.
+//   Header (64 bytes): magic "SDSQ", version (u32), frames (u32), IMU samples (u32),
+//     index offset (u64), IMU offset (u64), rest is zero
+//   Index, per frame: timestamp (f64), first IMU sample not older than it (u32), then image
+//     and depth as rows, cols, type (i32) and offset (u64), rows 0 if there is no depth
+//   IMU, per sample: timestamp (s), gyroscope and accelerometer (f64)
+// Values are little endian.
+class SequenceWriter {
+ public:
+  static const uint32_t VERSION;
+
+  SequenceWriter();
+  ~SequenceWriter();
+
+  bool Open(const std::string &filename);
+
+  // Write index and header. Returns false if the file is incomplete
+  bool Close();
+
+  // Add next frame (CV_8U image, depth of any type or empty) at timestamp (s)
+  bool AddFrame(double timestamp, const cv::Mat &image, const cv::Mat &depth = cv::Mat());
+
+  // Add IMU sample at timestamp (s). Samples must be in time order
+  void AddIMU(double timestamp, const double gyro[3], const double acc[3]);
+
+ private:
+  struct Image {
+    int32_t rows, cols, type;
+    uint64_t offset;
+  };
+
+  struct Entry {
+    double timestamp;
+    Image image;
+    Image depth;
+  };
+
+  bool WriteMat(const cv::Mat &m, Image &image);
+
+  std::ofstream file_;
+  uint64_t offset_;
+  std::vector<Entry> entries_;
+  std::vector<double> imu_;
+  bool ok_;
+};
+
+// Reads a packed sequence through a read-only mapping. Frames are views of the mapping, valid
+// while the reader is alive. Pages of the next frames are requested ahead of Get
+class SequenceReader {
+ public:
+  struct Frame {
+    double timestamp;
+    cv::Mat image;
+    cv::Mat depth;      // Empty if the sequence has no depth
+    size_t imuBegin;    // IMU samples since previous frame, up to the first not older than it
+    size_t imuEnd;
+  };
+
+  SequenceReader();
+  ~SequenceReader();
+
+  SequenceReader(const SequenceReader&) = delete;
+  SequenceReader& operator=(const SequenceReader&) = delete;
+
+  bool Open(const std::string &filename);
+
+  inline size_t Size() const { return nframes_; }
+  inline size_t IMUSize() const { return nimu_; }
+  bool HasDepth() const;
+
+  // Frame i. Pages of the following frames are prefetched in the background by the kernel
+  bool Get(size_t i, Frame &frame);
+
+  // IMU sample i: timestamp (s), gyroscope (rad/s) and accelerometer (m/s^2)
+  void GetIMU(size_t i, double &timestamp, double gyro[3], double acc[3]) const;
+
+  // Number of frames requested ahead of the one read
+  static const int PREFETCH_FRAMES;
+
+ private:
+  bool ReadMat(const uint8_t* p, cv::Mat &m) const;
+  void Prefetch(size_t i);
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t nframes_;
+  size_t nimu_;
+  const uint8_t* index_;
+  const double* imu_;
+  size_t prefetched_;     // Frames below this were already requested
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SEQUENCE_FILE_H_
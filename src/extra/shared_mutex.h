@@ -0,0 +1,99 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SHARED_MUTEX_H_
+#define SD_SLAM_SHARED_MUTEX_H_
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
+namespace SD_SLAM {
+
+// Reader-writer lock for short critical sections, one atomic word and no system calls
+// when uncontended. Any number of readers or a single writer hold it. A waiting writer
+// stops new readers from entering, so it is not starved, which also means a thread must
+// never take it twice (not even shared). Waiters spin briefly and then yield.
+// Exclusive side works with std::unique_lock, shared side with SharedLock.
+class SharedMutex {
+ public:
+  SharedMutex() : state_(0) {}
+
+  SharedMutex(const SharedMutex&) = delete;
+  SharedMutex& operator=(const SharedMutex&) = delete;
+
+  inline void lock() {
+    // Announce writer, then wait for readers to leave
+    uint32_t s = state_.load(std::memory_order_relaxed);
+    for (int n = 0;; n++) {
+      if (!(s & WRITER) && state_.compare_exchange_weak(s, s | WRITER, std::memory_order_acquire))
+        break;
+      Pause(n);
+      s = state_.load(std::memory_order_relaxed);
+    }
+
+    for (int n = 0; state_.load(std::memory_order_acquire) != WRITER; n++)
+      Pause(n);
+  }
+
+  inline void unlock() {
+    state_.fetch_sub(WRITER, std::memory_order_release);
+  }
+
+  inline void lock_shared() {
+    uint32_t s = state_.load(std::memory_order_relaxed);
+    for (int n = 0;; n++) {
+      if (!(s & WRITER) && state_.compare_exchange_weak(s, s+1, std::memory_order_acquire))
+        return;
+      Pause(n);
+      s = state_.load(std::memory_order_relaxed);
+    }
+  }
+
+  inline void unlock_shared() {
+    state_.fetch_sub(1, std::memory_order_release);
+  }
+
+ private:
+  static const uint32_t WRITER = 1u << 31;
+
+  static inline void Pause(int n) {
+    if (n >= 64)
+      std::this_thread::yield();
+  }
+
+  // Writer bit and number of readers
+  std::atomic<uint32_t> state_;
+};
+
+// Scoped shared ownership of a SharedMutex
+class SharedLock {
+ public:
+  explicit SharedLock(SharedMutex &m) : m_(m) { m_.lock_shared(); }
+  ~SharedLock() { m_.unlock_shared(); }
+
+  SharedLock(const SharedLock&) = delete;
+  SharedLock& operator=(const SharedLock&) = delete;
+
+ private:
+  SharedMutex &m_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SHARED_MUTEX_H_
@@ -0,0 +1,220 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "sim3_optimizer.h"
+#include <cmath>
+#include <algorithm>
+#include "lie.h"
+
+namespace SD_SLAM {
+
+Sim3Optimizer::Sim3Optimizer() : fixScale_(false) {
+  cam1_.fx = cam1_.fy = cam1_.cx = cam1_.cy = 0;
+  cam2_ = cam1_;
+}
+
+void Sim3Optimizer::Clear(const Eigen::Matrix3d &K1, const Eigen::Matrix3d &K2, bool bFixScale) {
+  correspondences_.clear();
+  cam1_.fx = K1(0, 0);
+  cam1_.fy = K1(1, 1);
+  cam1_.cx = K1(0, 2);
+  cam1_.cy = K1(1, 2);
+  cam2_.fx = K2(0, 0);
+  cam2_.fy = K2(1, 1);
+  cam2_.cx = K2(0, 2);
+  cam2_.cy = K2(1, 2);
+  fixScale_ = bFixScale;
+}
+
+void Sim3Optimizer::AddCorrespondence(const Eigen::Vector3d &X1, const Eigen::Vector2d &z1, double invSigma2_1,
+                                      const Eigen::Vector3d &X2, const Eigen::Vector2d &z2, double invSigma2_2,
+                                      double delta) {
+  Correspondence c;
+  c.X1 = X1;
+  c.z1 = z1;
+  c.invSigma2_1 = invSigma2_1;
+  c.X2 = X2;
+  c.z2 = z2;
+  c.invSigma2_2 = invSigma2_2;
+  c.delta = delta;
+  c.inlier = true;
+  correspondences_.push_back(c);
+}
+
+void Sim3Optimizer::Project(const Camera &cam, const Eigen::Vector3d &X, const Eigen::Vector2d &z,
+                            Eigen::Vector2d &r, Eigen::Matrix<double, 2, 3> *Jp) {
+  const double invz = 1.0/X(2);
+  r(0) = z(0) - (cam.fx*X(0)*invz + cam.cx);
+  r(1) = z(1) - (cam.fy*X(1)*invz + cam.cy);
+
+  if (Jp) {
+    const double invz_2 = invz*invz;
+    *Jp << cam.fx*invz, 0, -cam.fx*X(0)*invz_2,
+           0, cam.fy*invz, -cam.fy*X(1)*invz_2;
+  }
+}
+
+double Sim3Optimizer::BuildSystem(const g2o::Sim3 &S12, Eigen::Matrix<double, 7, 7> *H, Eigen::Matrix<double, 7, 1> *b) const {
+  const bool bJacobian = H && b;
+  if (bJacobian) {
+    H->setZero();
+    b->setZero();
+  }
+
+  const g2o::Sim3 S21 = S12.inverse();
+  // Linear part of S21, maps a left update of S12 at X1 into camera 2
+  const Eigen::Matrix3d A21 = S21.rotation().toRotationMatrix()*S21.scale();
+
+  Eigen::Vector2d r;
+  Eigen::Matrix<double, 2, 3> Jp;
+  Eigen::Matrix<double, 3, 7> dX;
+  Eigen::Matrix<double, 2, 7> J;
+  double chi2 = 0.0;
+
+  for (const Correspondence &c : correspondences_) {
+    if (!c.inlier)
+      continue;
+
+    for (int k = 0; k < 2; k++) {
+      double invSigma2;
+      if (k == 0) {
+        // x1 = S12*X2. Left update exp(d)*S12 moves Y = S12*X2 by [-Y^, I, Y]*d
+        const Eigen::Vector3d Y = S12.map(c.X2);
+        Project(cam1_, Y, c.z1, r, bJacobian ? &Jp : nullptr);
+        if (bJacobian) {
+          dX.block<3, 3>(0, 0) = -Lie::Hat(Y);
+          dX.block<3, 3>(0, 3).setIdentity();
+          dX.col(6) = Y;
+        }
+        invSigma2 = c.invSigma2_1;
+      } else {
+        // x2 = S12^-1*X1 = S21*exp(-d)*X1, moves with S21 applied to [X1^, -I, -X1]*d
+        const Eigen::Vector3d Y = S21.map(c.X1);
+        Project(cam2_, Y, c.z2, r, bJacobian ? &Jp : nullptr);
+        if (bJacobian) {
+          dX.block<3, 3>(0, 0) = A21*Lie::Hat(c.X1);
+          dX.block<3, 3>(0, 3) = -A21;
+          dX.col(6) = -A21*c.X1;
+        }
+        invSigma2 = c.invSigma2_2;
+      }
+
+      const double e2 = r.squaredNorm()*invSigma2;
+
+      // Huber kernel, weights information with its first derivative
+      double w = invSigma2;
+      if (e2 > c.delta*c.delta) {
+        const double e = sqrt(e2);
+        chi2 += 2*e*c.delta - c.delta*c.delta;
+        w *= c.delta/e;
+      } else {
+        chi2 += e2;
+      }
+
+      if (bJacobian) {
+        // Residual is z - project(X)
+        J.noalias() = -Jp*dX;
+        H->noalias() += w*J.transpose()*J;
+        b->noalias() -= w*J.transpose()*r;
+      }
+    }
+  }
+
+  // Scale is kept out of the system
+  if (bJacobian && fixScale_) {
+    H->row(6).setZero();
+    H->col(6).setZero();
+    (*H)(6, 6) = 1.0;
+    (*b)(6) = 0.0;
+  }
+
+  return chi2;
+}
+
+void Sim3Optimizer::Optimize(g2o::Sim3 &S12, int nIterations) {
+  bool bInliers = false;
+  for (const Correspondence &c : correspondences_) {
+    if (c.inlier) {
+      bInliers = true;
+      break;
+    }
+  }
+
+  if (!bInliers)
+    return;
+
+  Eigen::Matrix<double, 7, 7> H;
+  Eigen::Matrix<double, 7, 1> b;
+  double chi2 = BuildSystem(S12, &H, &b);
+
+  // Initial damping as g2o
+  double lambda = 1e-5*H.diagonal().maxCoeff();
+  double ni = 2.0;
+
+  for (int it = 0; it < nIterations; it++) {
+    double rho = 0;
+    int tries = 0;
+
+    do {
+      Eigen::Matrix<double, 7, 7> Hl = H;
+      Hl.diagonal().array() += lambda;
+      Eigen::Matrix<double, 7, 1> dx = Hl.ldlt().solve(b);
+      if (fixScale_)
+        dx(6) = 0.0;
+
+      const g2o::Sim3 Snew = g2o::Sim3(g2o::Vector7d(dx))*S12;
+      const double chi2New = BuildSystem(Snew, nullptr, nullptr);
+
+      const double scale = lambda*dx.dot(dx) + dx.dot(b) + 1e-3;
+      rho = (chi2 - chi2New)/scale;
+
+      if (rho > 0 && std::isfinite(chi2New)) {
+        // Good step, decrease damping
+        double alpha = 1.0 - pow(2*rho-1, 3);
+        alpha = std::min(alpha, 2.0/3.0);
+        lambda *= std::max(1.0/3.0, alpha);
+        ni = 2.0;
+
+        S12 = Snew;
+        chi2 = BuildSystem(S12, &H, &b);
+      } else {
+        // Bad step, increase damping and retry
+        lambda *= ni;
+        ni *= 2.0;
+        rho = -1;
+      }
+      tries++;
+    } while (rho < 0 && tries < 10);
+
+    if (rho < 0)
+      break;
+  }
+}
+
+void Sim3Optimizer::Chi2(size_t i, const g2o::Sim3 &S12, double &chi2_1, double &chi2_2) const {
+  const Correspondence &c = correspondences_[i];
+  Eigen::Vector2d r;
+
+  Project(cam1_, S12.map(c.X2), c.z1, r, nullptr);
+  chi2_1 = r.squaredNorm()*c.invSigma2_1;
+
+  Project(cam2_, S12.inverse().map(c.X1), c.z2, r, nullptr);
+  chi2_2 = r.squaredNorm()*c.invSigma2_2;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,84 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SIM3_OPTIMIZER_H_
+#define SD_SLAM_SIM3_OPTIMIZER_H_
+
+#include <vector>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include "extra/g2o/types/sim3.h"
+
+namespace SD_SLAM {
+
+// Levenberg-Marquardt over the similarity S12 between two keyframes, from matched points
+// reprojected in both images (x1 = S12*X2 and x2 = S12^-1*X1). Same steps and damping as
+// g2o, with analytic jacobians and the 7x7 normal equations solved directly.
+class Sim3Optimizer {
+ public:
+  Sim3Optimizer();
+
+  // Remove correspondences, keeping allocated memory. Scale is not optimized if bFixScale
+  void Clear(const Eigen::Matrix3d &K1, const Eigen::Matrix3d &K2, bool bFixScale);
+
+  // Add point X1 (camera 1 coordinates) observed at z1 in keyframe 1 and its match X2
+  // (camera 2 coordinates) observed at z2 in keyframe 2. delta is the Huber threshold
+  void AddCorrespondence(const Eigen::Vector3d &X1, const Eigen::Vector2d &z1, double invSigma2_1,
+                         const Eigen::Vector3d &X2, const Eigen::Vector2d &z2, double invSigma2_2,
+                         double delta);
+
+  // Optimize S12 using inlier correspondences
+  void Optimize(g2o::Sim3 &S12, int nIterations);
+
+  // Squared errors of correspondence i in both keyframes, without robust kernel
+  void Chi2(size_t i, const g2o::Sim3 &S12, double &chi2_1, double &chi2_2) const;
+
+  inline size_t Size() const { return correspondences_.size(); }
+  inline void SetInlier(size_t i, bool inlier) { correspondences_[i].inlier = inlier; }
+
+ private:
+  struct Correspondence {
+    Eigen::Vector3d X1, X2;
+    Eigen::Vector2d z1, z2;
+    double invSigma2_1, invSigma2_2;
+    double delta;
+    bool inlier;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  struct Camera {
+    double fx, fy, cx, cy;
+  };
+
+  // Residual z - project(X) and jacobian of the projection w.r.t. X
+  static void Project(const Camera &cam, const Eigen::Vector3d &X, const Eigen::Vector2d &z,
+                      Eigen::Vector2d &r, Eigen::Matrix<double, 2, 3> *Jp);
+
+  // Robust squared error of inliers, and normal equations if H and b are given
+  double BuildSystem(const g2o::Sim3 &S12, Eigen::Matrix<double, 7, 7> *H, Eigen::Matrix<double, 7, 1> *b) const;
+
+  std::vector<Correspondence, Eigen::aligned_allocator<Correspondence> > correspondences_;
+
+  Camera cam1_, cam2_;
+  bool fixScale_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SIM3_OPTIMIZER_H_
@@ -0,0 +1,130 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SMALL_VECTOR_H_
+#define SD_SLAM_SMALL_VECTOR_H_
+
+#include <cstddef>
+#include <utility>
+
+namespace SD_SLAM {
+
+// Vector that keeps up to N elements inline and only allocates when it grows beyond them.
+// Meant for small trivially copyable elements, erase keeps the order.
+template <typename T, size_t N>
+class SmallVector {
+ public:
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  SmallVector(): data_(inline_), size_(0), capacity_(N) {}
+
+  SmallVector(const SmallVector &other): SmallVector() {
+    *this = other;
+  }
+
+  SmallVector(SmallVector &&other): SmallVector() {
+    *this = std::move(other);
+  }
+
+  ~SmallVector() {
+    if (data_ != inline_)
+      delete[] data_;
+  }
+
+  SmallVector& operator=(const SmallVector &other) {
+    if (this == &other)
+      return *this;
+    clear();
+    reserve(other.size_);
+    for (size_t i = 0; i < other.size_; i++)
+      data_[i] = other.data_[i];
+    size_ = other.size_;
+    return *this;
+  }
+
+  SmallVector& operator=(SmallVector &&other) {
+    if (this == &other)
+      return *this;
+    if (other.data_ == other.inline_)
+      return *this = static_cast<const SmallVector&>(other);
+
+    // Take heap buffer
+    if (data_ != inline_)
+      delete[] data_;
+    data_ = other.data_;
+    size_ = other.size_;
+    capacity_ = other.capacity_;
+    other.data_ = other.inline_;
+    other.size_ = 0;
+    other.capacity_ = N;
+    return *this;
+  }
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  // Memory allocated beyond the inline elements
+  inline size_t heap_bytes() const { return data_ == inline_ ? 0 : capacity_*sizeof(T); }
+
+  inline iterator begin() { return data_; }
+  inline iterator end() { return data_+size_; }
+  inline const_iterator begin() const { return data_; }
+  inline const_iterator end() const { return data_+size_; }
+
+  inline T& operator[](size_t i) { return data_[i]; }
+  inline const T& operator[](size_t i) const { return data_[i]; }
+
+  void reserve(size_t n) {
+    if (n <= capacity_)
+      return;
+    T* data = new T[n];
+    for (size_t i = 0; i < size_; i++)
+      data[i] = data_[i];
+    if (data_ != inline_)
+      delete[] data_;
+    data_ = data;
+    capacity_ = n;
+  }
+
+  void push_back(const T &v) {
+    if (size_ == capacity_)
+      reserve(2*capacity_);
+    data_[size_++] = v;
+  }
+
+  iterator erase(iterator it) {
+    for (iterator next = it+1; next != end(); next++)
+      *(next-1) = *next;
+    size_--;
+    return it;
+  }
+
+  // Keeps allocated memory
+  void clear() { size_ = 0; }
+
+ private:
+  T* data_;
+  size_t size_;
+  size_t capacity_;
+  T inline_[N];
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SMALL_VECTOR_H_
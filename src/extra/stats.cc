@@ -0,0 +1,185 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stats.h"
+#include <cmath>
+#include <algorithm>
+
+using std::vector;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+mutex Statistics::mutex_;
+vector<std::unique_ptr<Statistics::Histogram> > Statistics::histograms_;
+
+Statistics::Histogram::Histogram() {
+  for (int i = 0; i < NUM_STAGES; i++) {
+    for (int j = 0; j < NUM_BUCKETS; j++)
+      buckets[i][j].store(0, std::memory_order_relaxed);
+    max[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Statistics::Record(Stage stage, double ms) {
+  Histogram *h = GetThreadHistogram();
+  uint64_t us = ms > 0.0 ? static_cast<uint64_t>(ms*1000.0) : 0;
+
+  h->buckets[stage][GetBucket(us)].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t current = h->max[stage].load(std::memory_order_relaxed);
+  while (us > current && !h->max[stage].compare_exchange_weak(current, us, std::memory_order_relaxed)) {}
+}
+
+void Statistics::RecordLatency(Stage stage, double timestamp, int clock) {
+  if (clock <= 0 || timestamp < 0.0)
+    return;
+
+  double ms = (Timer::Now(clock == 1 ? CLOCK_MONOTONIC : CLOCK_REALTIME) - timestamp)*1000.0;
+  if (ms >= 0.0)
+    Record(stage, ms);
+}
+
+vector<Statistics::Summary> Statistics::GetSummary() {
+  vector<Summary> summary(NUM_STAGES);
+  vector<uint64_t> counts(NUM_BUCKETS);
+
+  unique_lock<mutex> lock(mutex_);
+
+  for (int s = 0; s < NUM_STAGES; s++) {
+    Summary &sm = summary[s];
+    uint64_t max = 0;
+
+    std::fill(counts.begin(), counts.end(), 0);
+    sm.name = StageName(static_cast<Stage>(s));
+    sm.count = 0;
+
+    for (const auto &h : histograms_) {
+      for (int b = 0; b < NUM_BUCKETS; b++) {
+        uint64_t n = h->buckets[s][b].load(std::memory_order_relaxed);
+        counts[b] += n;
+        sm.count += n;
+      }
+      max = std::max(max, h->max[s].load(std::memory_order_relaxed));
+    }
+
+    sm.max = max/1000.0;
+    sm.p50 = sm.p99 = sm.mean = sm.jitter = 0.0;
+    if (sm.count == 0)
+      continue;
+
+    // Mean and deviation from bucket centers
+    double sum = 0.0, sum2 = 0.0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      double v = std::min(GetBucketValue(b), sm.max);
+      sum += counts[b]*v;
+      sum2 += counts[b]*v*v;
+    }
+    sm.mean = sum/sm.count;
+    sm.jitter = sqrt(std::max(sum2/sm.count - sm.mean*sm.mean, 0.0));
+
+    // Find buckets containing the requested ranks
+    uint64_t r50 = static_cast<uint64_t>(ceil(0.50*sm.count));
+    uint64_t r99 = static_cast<uint64_t>(ceil(0.99*sm.count));
+    uint64_t acc = 0;
+    bool b50 = false;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      acc += counts[b];
+      if (!b50 && acc >= r50) {
+        sm.p50 = std::min(GetBucketValue(b), sm.max);
+        b50 = true;
+      }
+      if (acc >= r99) {
+        sm.p99 = std::min(GetBucketValue(b), sm.max);
+        break;
+      }
+    }
+  }
+
+  return summary;
+}
+
+void Statistics::Reset() {
+  unique_lock<mutex> lock(mutex_);
+
+  for (const auto &h : histograms_) {
+    for (int s = 0; s < NUM_STAGES; s++) {
+      for (int b = 0; b < NUM_BUCKETS; b++)
+        h->buckets[s][b].store(0, std::memory_order_relaxed);
+      h->max[s].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+const char* Statistics::StageName(Stage stage) {
+  switch (stage) {
+    case ORB_EXTRACTION: return "ORBExtraction";
+    case STEREO_MATCHING: return "StereoMatching";
+    case IMAGE_ALIGN: return "ImageAlign";
+    case TRACK_MOTION_MODEL: return "TrackWithMotionModel";
+    case TRACK_LOCAL_MAP: return "TrackLocalMap";
+    case POSE_OPTIMIZATION: return "PoseOptimization";
+    case KEYFRAME_CREATION: return "CreateNewKeyFrame";
+    case LOCAL_BA: return "LocalBA";
+    case GLOBAL_BA: return "GlobalBA";
+    case TRACKING: return "Tracking";
+    case CAPTURE_TO_POSE: return "CaptureToPose";
+    case CAPTURE_TO_MAP: return "CaptureToMap";
+    default: return "Unknown";
+  }
+}
+
+Statistics::Histogram* Statistics::GetThreadHistogram() {
+  thread_local Histogram *histogram = nullptr;
+
+  if (!histogram) {
+    unique_lock<mutex> lock(mutex_);
+    histograms_.emplace_back(new Histogram());
+    histogram = histograms_.back().get();
+  }
+
+  return histogram;
+}
+
+int Statistics::GetBucket(uint64_t us) {
+  if (us < SUB_BUCKETS)
+    return static_cast<int>(us);
+
+  // Position of highest bit and following 3 bits
+  int e = 63 - __builtin_clzll(us);
+  int sub = static_cast<int>((us >> (e-3)) & (SUB_BUCKETS-1));
+  int bucket = (e-2)*SUB_BUCKETS + sub;
+
+  return std::min(bucket, NUM_BUCKETS-1);
+}
+
+double Statistics::GetBucketValue(int bucket) {
+  if (bucket < SUB_BUCKETS)
+    return bucket/1000.0;
+
+  // Middle of bucket range
+  int e = bucket/SUB_BUCKETS + 2;
+  int sub = bucket%SUB_BUCKETS;
+  double width = static_cast<double>(1ULL << (e-3));
+  double lower = (SUB_BUCKETS+sub)*width;
+
+  return (lower + width/2.0)/1000.0;
+}
+
+}  // namespace SD_SLAM
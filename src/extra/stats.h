@@ -0,0 +1,119 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_STATS_H_
+#define SD_SLAM_STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "timer.h"
+#include "trace.h"
+
+namespace SD_SLAM {
+
+// Latency histograms of the main processing stages. Every thread records in its own
+// histogram with relaxed atomics, so recording never takes a lock. Histograms are
+// merged when a summary is requested.
+class Statistics {
+ public:
+  enum Stage {
+    ORB_EXTRACTION = 0,
+    STEREO_MATCHING,
+    IMAGE_ALIGN,
+    TRACK_MOTION_MODEL,
+    TRACK_LOCAL_MAP,
+    POSE_OPTIMIZATION,
+    KEYFRAME_CREATION,
+    LOCAL_BA,             // Local or sliding window BA
+    GLOBAL_BA,            // Global BA after a loop, or BA of the loop region
+    TRACKING,
+    CAPTURE_TO_POSE,      // Frame timestamp to pose output, including queueing
+    CAPTURE_TO_MAP,       // Frame timestamp to its keyframe visible in map
+    NUM_STAGES
+  };
+
+  struct Summary {
+    std::string name;
+    uint64_t count;
+    double p50;           // Milliseconds
+    double p99;           // Milliseconds
+    double max;           // Milliseconds
+    double mean;          // Milliseconds
+    double jitter;        // Standard deviation (ms)
+  };
+
+  // Add a span to the histogram of the calling thread
+  static void Record(Stage stage, double ms);
+
+  // Add time elapsed since timestamp (s) of clock: 1 CLOCK_MONOTONIC, 2 CLOCK_REALTIME,
+  // 0 (timestamps are not capture times) records nothing. Negative spans are dropped
+  static void RecordLatency(Stage stage, double timestamp, int clock);
+
+  // Merge histograms from all threads
+  static std::vector<Summary> GetSummary();
+
+  // Clear all histograms
+  static void Reset();
+
+  static const char* StageName(Stage stage);
+
+ private:
+  // Log-linear buckets in microseconds: 8 sub-buckets per power of two
+  static const int SUB_BUCKETS = 8;
+  static const int NUM_BUCKETS = SUB_BUCKETS*26;
+
+  struct Histogram {
+    Histogram();
+
+    std::atomic<uint64_t> buckets[NUM_STAGES][NUM_BUCKETS];
+    std::atomic<uint64_t> max[NUM_STAGES];
+  };
+
+  // Histogram of the calling thread, registered on first use
+  static Histogram* GetThreadHistogram();
+
+  static int GetBucket(uint64_t us);
+  static double GetBucketValue(int bucket);
+
+  static std::mutex mutex_;
+  static std::vector<std::unique_ptr<Histogram> > histograms_;
+};
+
+// Record the lifetime of this object as a span of the given stage, also traced
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(Statistics::Stage stage) : stage_(stage), timer_(true), trace_(Statistics::StageName(stage)) {}
+
+  ~ScopedSpan() {
+    timer_.Stop();
+    Statistics::Record(stage_, timer_.GetMsTime());
+  }
+
+ private:
+  Statistics::Stage stage_;
+  Timer timer_;
+  ScopedTrace trace_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_STATS_H_
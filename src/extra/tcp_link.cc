@@ -0,0 +1,282 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "tcp_link.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "log.h"
+
+namespace SD_SLAM {
+
+const uint32_t TcpLink::MAX_MESSAGE = 256u << 20;
+
+namespace {
+
+// Messages are latency bound (keyframes, corrections), don't wait to fill segments
+void SetNoDelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+}  // namespace
+
+TcpLink::TcpLink(): fd_(-1), closed_(false) {
+}
+
+TcpLink::~TcpLink() {
+  Close();
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool TcpLink::Connect(const std::string &address) {
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos || colon == 0) {
+    LOGE("Address %s is not host:port", address.c_str());
+    return false;
+  }
+  const std::string host = address.substr(0, colon);
+  const std::string port = address.substr(colon+1);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *res = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+    LOGE("Can't resolve %s", address.c_str());
+    return false;
+  }
+
+  for (struct addrinfo *ai = res; ai && fd_ < 0; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      fd_ = fd;
+    else
+      close(fd);
+  }
+  freeaddrinfo(res);
+
+  if (fd_ < 0) {
+    LOGE("Can't connect to %s", address.c_str());
+    return false;
+  }
+
+  SetNoDelay(fd_);
+  return true;
+}
+
+bool TcpLink::Accept(int port) {
+  TcpListener listener;
+  return listener.Listen(port) && listener.Accept(*this);
+}
+
+bool TcpLink::Send(const std::vector<uint8_t> &msg) {
+  if (!IsOpen() || msg.size() > MAX_MESSAGE)
+    return false;
+
+  uint8_t header[4];
+  const uint32_t size = msg.size();
+  for (int i = 0; i < 4; i++)
+    header[i] = static_cast<uint8_t>(size >> (8*i));
+
+  std::unique_lock<std::mutex> lock(send_mutex_);
+  return WriteAll(header, sizeof(header)) && WriteAll(msg.data(), msg.size());
+}
+
+int TcpLink::Receive(std::vector<uint8_t> &msg, int timeout) {
+  if (!IsOpen())
+    return -1;
+
+  struct pollfd pfd;
+  pfd.fd = fd_;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int r = poll(&pfd, 1, timeout);
+  if (r < 0 && errno == EINTR)
+    return 0;
+  if (r < 0)
+    return -1;
+  if (r == 0)
+    return 0;
+
+  // Rest of the message is read blocking, it is already on its way
+  uint8_t header[4];
+  if (!ReadAll(header, sizeof(header)))
+    return -1;
+
+  uint32_t size = 0;
+  for (int i = 0; i < 4; i++)
+    size |= static_cast<uint32_t>(header[i]) << (8*i);
+  if (size > MAX_MESSAGE) {
+    LOGE("Received message is too large (%u bytes)", size);
+    return -1;
+  }
+
+  msg.resize(size);
+  return ReadAll(msg.data(), size) ? 1 : -1;
+}
+
+bool TcpLink::SendRaw(const void *data, size_t size) {
+  if (!IsOpen())
+    return false;
+
+  std::unique_lock<std::mutex> lock(send_mutex_);
+  return WriteAll(data, size);
+}
+
+int TcpLink::ReceiveRaw(void *data, size_t size, int timeout) {
+  if (!IsOpen())
+    return -1;
+
+  struct pollfd pfd;
+  pfd.fd = fd_;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int r = poll(&pfd, 1, timeout);
+  if (r < 0 && errno == EINTR)
+    return 0;
+  if (r <= 0)
+    return r;
+
+  ssize_t n;
+  do {
+    n = recv(fd_, data, size, 0);
+  } while (n < 0 && errno == EINTR);
+
+  return n > 0 ? static_cast<int>(n) : -1;
+}
+
+void TcpLink::Close() {
+  if (fd_ >= 0 && !closed_.exchange(true))
+    shutdown(fd_, SHUT_RDWR);
+}
+
+bool TcpLink::WriteAll(const void *data, size_t size) {
+  const uint8_t *p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    // No SIGPIPE if the other end is gone, the error is returned instead
+    ssize_t n = send(fd_, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool TcpLink::ReadAll(void *data, size_t size) {
+  uint8_t *p = static_cast<uint8_t*>(data);
+  while (size > 0) {
+    ssize_t n = recv(fd_, p, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+TcpListener::TcpListener(): fd_(-1), closed_(false) {
+}
+
+TcpListener::~TcpListener() {
+  Close();
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool TcpListener::Listen(int port, bool loopback) {
+  // Localhost is reached as 127.0.0.1, any interface also through IPv6
+  fd_ = socket(loopback ? AF_INET : AF_INET6, SOCK_STREAM, 0);
+  if (fd_ < 0) {
+    LOGE("Can't create socket");
+    return false;
+  }
+
+  int one = 1, zero = 0;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  int r;
+  if (loopback) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    r = bind(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+  } else {
+    setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(static_cast<uint16_t>(port));
+    r = bind(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+  }
+
+  if (r != 0 || listen(fd_, SOMAXCONN) != 0) {
+    LOGE("Can't listen on port %d", port);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  return true;
+}
+
+bool TcpListener::Accept(TcpLink &link) {
+  if (fd_ < 0 || link.fd_ >= 0)
+    return false;
+
+  int fd;
+  do {
+    fd = accept(fd_, nullptr, nullptr);
+  } while (fd < 0 && errno == EINTR && !closed_);
+
+  if (fd < 0) {
+    if (!closed_)
+      LOGE("Can't accept connection");
+    return false;
+  }
+
+  SetNoDelay(fd);
+  link.fd_ = fd;
+  return true;
+}
+
+void TcpListener::Close() {
+  if (fd_ >= 0 && !closed_.exchange(true))
+    shutdown(fd_, SHUT_RDWR);
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_TCP_LINK_H_
+#define SD_SLAM_TCP_LINK_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace SD_SLAM {
+
+// TCP connection carrying whole messages, each one sent as its size (u32, little endian)
+// followed by its bytes. Send can be called from several threads, Receive from one.
+// Close unblocks both, the socket itself is released on destruction.
+class TcpLink {
+ public:
+  // Larger messages are considered a protocol error
+  static const uint32_t MAX_MESSAGE;
+
+  TcpLink();
+  ~TcpLink();
+
+  TcpLink(const TcpLink&) = delete;
+  TcpLink& operator=(const TcpLink&) = delete;
+
+  // Connect to address ("host:port"). Returns false on error
+  bool Connect(const std::string &address);
+
+  // Wait for a connection on port (any interface). Returns false on error
+  bool Accept(int port);
+
+  inline bool IsOpen() const { return fd_ >= 0 && !closed_; }
+
+  bool Send(const std::vector<uint8_t> &msg);
+
+  // Wait up to timeout ms (forever if negative) for a message. Returns 1 if msg was
+  // received, 0 on timeout and -1 if the connection was closed or failed
+  int Receive(std::vector<uint8_t> &msg, int timeout);
+
+  // Unframed bytes, for text protocols. SendRaw writes all of them. ReceiveRaw waits up to
+  // timeout ms and returns the bytes read (up to size), 0 on timeout and -1 on close or error
+  bool SendRaw(const void *data, size_t size);
+  int ReceiveRaw(void *data, size_t size, int timeout);
+
+  void Close();
+
+ private:
+  friend class TcpListener;
+
+  bool WriteAll(const void *data, size_t size);
+  bool ReadAll(void *data, size_t size);
+
+  int fd_;
+  std::atomic<bool> closed_;
+  std::mutex send_mutex_;
+};
+
+// Listening socket accepting any number of TcpLink connections
+class TcpListener {
+ public:
+  TcpListener();
+  ~TcpListener();
+
+  TcpListener(const TcpListener&) = delete;
+  TcpListener& operator=(const TcpListener&) = delete;
+
+  // Listen on port, of any interface or only of localhost. Returns false on error
+  bool Listen(int port, bool loopback = false);
+
+  // Wait for next connection and hand it to link, which must not be open.
+  // Returns false on error or after Close
+  bool Accept(TcpLink &link);
+
+  // Unblock Accept and stop listening
+  void Close();
+
+ private:
+  int fd_;
+  std::atomic<bool> closed_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_TCP_LINK_H_
@@ -0,0 +1,185 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <string>
+#include "trace.h"
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+// Pool and queue of the worker running in this thread (none for external threads)
+static thread_local ThreadPool *tWorkerPool = nullptr;
+static thread_local int tWorkerId = -1;
+
+ThreadPool::ThreadPool(int nthreads, bool affinity) : nthreads_(nthreads), affinity_(affinity), stop_(false),
+  pending_(0), next_queue_(0) {
+  if (nthreads_ < 1)
+    nthreads_ = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+  // Calling thread is also used, so create one worker less
+  for (int i = 1; i < nthreads_; i++)
+    queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+
+  for (int i = 1; i < nthreads_; i++)
+    workers_.push_back(std::thread(&ThreadPool::Run, this, i-1));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    unique_lock<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i].join();
+}
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int)> &f, int maxThreads) {
+  if (n <= 0)
+    return;
+
+  int helpers = std::min(static_cast<int>(workers_.size()), n-1);
+  if (maxThreads > 0)
+    helpers = std::min(helpers, maxThreads-1);
+
+  // Serial path
+  if (helpers <= 0) {
+    for (int i = 0; i < n; i++)
+      f(i);
+    return;
+  }
+
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->next = 0;
+  job->done = 0;
+  job->n = n;
+  job->f = &f;
+
+  // Nested calls stay in worker queue, external ones are spread among queues
+  const int nqueues = queues_.size();
+  const bool worker = tWorkerPool == this;
+  for (int i = 0; i < helpers; i++) {
+    int q = worker ? tWorkerId : next_queue_.fetch_add(1) % nqueues;
+    unique_lock<mutex> lock(queues_[q]->mutex);
+    queues_[q]->tasks.push_back([job]() { Work(job.get()); });
+  }
+
+  {
+    unique_lock<mutex> lock(mutex_);
+    pending_.fetch_add(helpers);
+  }
+  cond_.notify_all();
+
+  Work(job.get());
+
+  // Help with other tasks while remaining iterations finish
+  while (job->done.load() < n) {
+    if (!RunPendingTask(worker ? tWorkerId : 0))
+      std::this_thread::yield();
+  }
+}
+
+void ThreadPool::Run(int id) {
+  tWorkerPool = this;
+  tWorkerId = id;
+  if (affinity_)
+    SetAffinity(id+1);
+  Trace::SetThreadName("Worker " + std::to_string(id));
+
+  while (true) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return stop_ || pending_.load() > 0; });
+      if (stop_ && pending_.load() == 0)
+        return;
+    }
+
+    while (RunPendingTask(id)) {}
+  }
+}
+
+void ThreadPool::SetAffinity(int core) {
+#if defined(__linux__) && !defined(__ANDROID__)
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(core % std::max(static_cast<int>(std::thread::hardware_concurrency()), 1), &cpuset);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+#else
+  (void)core;
+#endif
+}
+
+bool ThreadPool::RunPendingTask(int id) {
+  std::function<void()> task;
+  if (!Pop(id, task))
+    return false;
+
+  task();
+  return true;
+}
+
+bool ThreadPool::Pop(int id, std::function<void()> &task) {
+  const int nqueues = queues_.size();
+  if (pending_.load() == 0)
+    return false;
+
+  // Own queue, newest task first
+  {
+    Queue &q = *queues_[id];
+    unique_lock<mutex> lock(q.mutex);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      pending_.fetch_sub(1);
+      return true;
+    }
+  }
+
+  // Steal oldest task of the others
+  for (int i = 1; i < nqueues; i++) {
+    Queue &q = *queues_[(id+i) % nqueues];
+    unique_lock<mutex> lock(q.mutex);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      pending_.fetch_sub(1);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::Work(Job *job) {
+  int i;
+  while ((i = job->next.fetch_add(1)) < job->n) {
+    (*job->f)(i);
+    job->done.fetch_add(1);
+  }
+}
+
+}  // namespace SD_SLAM
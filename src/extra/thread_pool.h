@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_THREAD_POOL_H_
+#define SD_SLAM_THREAD_POOL_H_
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+
+namespace SD_SLAM {
+
+// Work-stealing pool. Every worker owns a task queue: it takes its own tasks from the back
+// and steals from the front of the others when it runs out. Tasks submitted from a worker
+// (nested ParallelFor calls) go to its own queue, so they are run by the same thread if
+// nobody is idle. One pool is shared by all subsystems.
+class ThreadPool {
+ public:
+  // nthreads < 1 uses all cores. If affinity is set, worker i is pinned to core i+1
+  // (calling threads are left unpinned)
+  explicit ThreadPool(int nthreads, bool affinity = false);
+  ~ThreadPool();
+
+  inline int GetThreads() const { return nthreads_; }
+
+  // Call f(i) for every i in [0, n) and wait until all calls finish.
+  // The calling thread also runs iterations, so nested calls are safe.
+  // At most maxThreads threads (calling one included) are used, 0 means no limit.
+  void ParallelFor(int n, const std::function<void(int)> &f, int maxThreads = 0);
+
+ private:
+  struct Job {
+    std::atomic<int> next;
+    std::atomic<int> done;
+    int n;
+    const std::function<void(int)> *f;
+  };
+
+  struct Queue {
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+  };
+
+  // Worker loop
+  void Run(int id);
+
+  // Pin calling thread to given core
+  static void SetAffinity(int core);
+
+  // Run a pending task in the calling thread, own queue first. Returns false if all queues are empty
+  bool RunPendingTask(int id);
+
+  // Take a task from queue id (back) or steal one from other queues (front)
+  bool Pop(int id, std::function<void()> &task);
+
+  // Run iterations until no one is left
+  static void Work(Job *job);
+
+  int nthreads_;
+  bool affinity_;
+  bool stop_;
+
+  std::vector<std::thread> workers_;
+  std::vector<std::unique_ptr<Queue> > queues_;
+
+  // Tasks in all queues, used to sleep and wake up workers
+  std::atomic<int> pending_;
+
+  // Queue for tasks submitted from non worker threads
+  std::atomic<unsigned int> next_queue_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_THREAD_POOL_H_
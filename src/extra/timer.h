@@ -21,7 +21,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <time.h>
 
 namespace SD_SLAM {
 
@@ -40,20 +40,28 @@ class Timer {
     return time_*1000.0;
   }
 
+  // Current time (s) of clock (CLOCK_MONOTONIC, CLOCK_REALTIME...)
+  static inline double Now(clockid_t clock) {
+    timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec*0.000000001;
+  }
+
+  // Monotonic clock, not affected by system time changes
   inline void Start() {
-    gettimeofday(&start_time_, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start_time_);
   }
 
   inline void Stop() {
-    timeval end_time;
-    gettimeofday(&end_time, NULL);
+    timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
     long seconds  = end_time.tv_sec  - start_time_.tv_sec;
-    long useconds = end_time.tv_usec - start_time_.tv_usec;
-    time_ = ((seconds) + useconds*0.000001);
+    long nseconds = end_time.tv_nsec - start_time_.tv_nsec;
+    time_ = ((seconds) + nseconds*0.000000001);
   }
 
  private:
-  timeval start_time_;
+  timespec start_time_;
   double time_;
 };
 
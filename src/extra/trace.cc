@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "trace.h"
+#include <stdio.h>
+#include <algorithm>
+
+using std::vector;
+using std::string;
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+std::atomic<bool> Trace::enabled_(false);
+std::chrono::steady_clock::time_point Trace::start_ = std::chrono::steady_clock::now();
+size_t Trace::capacity_ = 0;
+mutex Trace::mutex_;
+vector<std::unique_ptr<Trace::Buffer> > Trace::buffers_;
+
+void Trace::Start(size_t capacity) {
+  unique_lock<mutex> lock(mutex_);
+
+  // Buffers are sized once, a new start only clears them
+  if (capacity_ == 0)
+    capacity_ = std::max<size_t>(capacity, 1);
+  for (const auto &b : buffers_)
+    b->head.store(0, std::memory_order_relaxed);
+
+  start_ = std::chrono::steady_clock::now();
+  enabled_.store(true, std::memory_order_release);
+}
+
+void Trace::Stop() {
+  enabled_.store(false, std::memory_order_release);
+}
+
+void Trace::SetThreadName(const string &name) {
+  Buffer *b = GetThreadBuffer();
+  unique_lock<mutex> lock(mutex_);
+  b->name = name;
+}
+
+void Trace::Record(const char *name, const char *category, uint64_t start, uint64_t duration) {
+  Buffer *b = GetThreadBuffer();
+
+  // Thread registered before Start
+  if (b->events.empty()) {
+    unique_lock<mutex> lock(mutex_);
+    if (capacity_ == 0)
+      return;
+    b->events.resize(capacity_);
+  }
+
+  const uint64_t head = b->head.load(std::memory_order_relaxed);
+  Event &e = b->events[head % b->events.size()];
+  e.name = name;
+  e.category = category;
+  e.start = start;
+  e.duration = duration;
+  b->head.store(head+1, std::memory_order_release);
+}
+
+bool Trace::Save(const string &filename) {
+  FILE *f = fopen(filename.c_str(), "w");
+  if (!f)
+    return false;
+
+  unique_lock<mutex> lock(mutex_);
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  for (const auto &b : buffers_) {
+    if (!b->name.empty()) {
+      fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",\n", b->tid, b->name.c_str());
+      first = false;
+    }
+
+    // Oldest kept event first
+    const uint64_t head = b->head.load(std::memory_order_acquire);
+    const uint64_t size = b->events.size();
+    for (uint64_t i = head > size ? head-size : 0; i < head; i++) {
+      const Event &e = b->events[i % size];
+      fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu}",
+              first ? "" : ",\n", e.name, e.category, b->tid, static_cast<unsigned long long>(e.start),
+              static_cast<unsigned long long>(e.duration));
+      first = false;
+    }
+  }
+  fprintf(f, "\n]}\n");
+
+  return fclose(f) == 0;
+}
+
+Trace::Buffer* Trace::GetThreadBuffer() {
+  thread_local Buffer *buffer = nullptr;
+
+  if (!buffer) {
+    unique_lock<mutex> lock(mutex_);
+    buffers_.emplace_back(new Buffer());
+    buffer = buffers_.back().get();
+    buffer->events.resize(capacity_);
+    buffer->head.store(0, std::memory_order_relaxed);
+    buffer->tid = buffers_.size();
+  }
+
+  return buffer;
+}
+
+}  // namespace SD_SLAM
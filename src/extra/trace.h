@@ -0,0 +1,129 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_TRACE_H_
+#define SD_SLAM_TRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace SD_SLAM {
+
+// Timeline of what every thread is doing, saved as Chrome trace JSON (chrome://tracing,
+// ui.perfetto.dev). Every thread records complete events in its own ring buffer, only the
+// newest events are kept. Recording never takes a lock and costs a relaxed load when disabled.
+class Trace {
+ public:
+  // Start recording, keeping up to capacity events per thread. Should be called before
+  // starting the threads to trace
+  static void Start(size_t capacity);
+
+  // Stop recording, recorded events are kept
+  static void Stop();
+
+  static inline bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Name shown for the calling thread
+  static void SetThreadName(const std::string &name);
+
+  // Add an event to the calling thread buffer. Name must be a string literal
+  static void Record(const char *name, const char *category, uint64_t start, uint64_t duration);
+
+  // Write recorded events. Should be called after Stop, events recorded while writing may be torn
+  static bool Save(const std::string &filename);
+
+  // Microseconds since Start
+  static inline uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now()-start_).count();
+  }
+
+ private:
+  struct Event {
+    const char *name;
+    const char *category;
+    uint64_t start;
+    uint64_t duration;
+  };
+
+  // Single writer ring buffer
+  struct Buffer {
+    std::vector<Event> events;
+    std::atomic<uint64_t> head;
+    int tid;
+    std::string name;
+  };
+
+  // Buffer of the calling thread, registered on first use
+  static Buffer* GetThreadBuffer();
+
+  static std::atomic<bool> enabled_;
+  static std::chrono::steady_clock::time_point start_;
+  static size_t capacity_;
+  static std::mutex mutex_;
+  static std::vector<std::unique_ptr<Buffer> > buffers_;
+};
+
+// Record the lifetime of this object as an event
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const char *name, const char *category = "stage") : name_(nullptr) {
+    if (Trace::Enabled()) {
+      name_ = name;
+      category_ = category;
+      start_ = Trace::Now();
+    }
+  }
+
+  ~ScopedTrace() {
+    if (name_)
+      Trace::Record(name_, category_, start_, Trace::Now()-start_);
+  }
+
+ private:
+  const char *name_;
+  const char *category_;
+  uint64_t start_;
+};
+
+// Lock m, recording the time waiting for it
+template <typename Mutex>
+std::unique_lock<Mutex> TraceLock(Mutex &m, const char *name) {
+  if (!Trace::Enabled())
+    return std::unique_lock<Mutex>(m);
+
+  const uint64_t start = Trace::Now();
+  std::unique_lock<Mutex> lock(m);
+  Trace::Record(name, "lock", start, Trace::Now()-start);
+  return lock;
+}
+
+#define SD_TRACE_CONCAT_(a, b) a##b
+#define SD_TRACE_CONCAT(a, b) SD_TRACE_CONCAT_(a, b)
+
+// Trace the rest of the enclosing scope
+#define SD_TRACE(name) SD_SLAM::ScopedTrace SD_TRACE_CONCAT(sd_trace_, __LINE__)(name)
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_TRACE_H_
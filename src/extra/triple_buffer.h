@@ -0,0 +1,70 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_TRIPLE_BUFFER_H_
+#define SD_SLAM_TRIPLE_BUFFER_H_
+
+#include <atomic>
+
+namespace SD_SLAM {
+
+// Triple buffer for one writer and one reader. The writer fills the back slot and publishes
+// it, the reader takes the last published slot. Neither side waits for the other, and slots
+// are reused so their buffers are not allocated again.
+template <typename T>
+class TripleBuffer {
+ public:
+  TripleBuffer() : back_(0), front_(2), middle_(1) {}
+
+  // Writer side: fill Back() and publish it
+  inline T& Back() { return slots_[back_]; }
+
+  inline void Publish() {
+    back_ = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Reader side: take last published slot if there is a new one. Returns false otherwise
+  inline bool Update() {
+    if (!(middle_.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  inline T& Front() { return slots_[front_]; }
+
+  // Initialize all slots, before any reader or writer
+  template <typename F>
+  void ForEach(F f) {
+    for (int i = 0; i < 3; i++)
+      f(slots_[i]);
+  }
+
+ private:
+  static const int INDEX = 3;
+  static const int FRESH = 4;
+
+  T slots_[3];
+  int back_;
+  int front_;
+  std::atomic<int> middle_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_TRIPLE_BUFFER_H_
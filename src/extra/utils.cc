@@ -17,6 +17,14 @@
  */
 
 #include "utils.h"
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include "log.h"
 
 namespace SD_SLAM {
 
@@ -25,6 +33,42 @@ int Random(int min, int max) {
   return static_cast<int>(((static_cast<double>(rand())/(static_cast<double>(RAND_MAX) + 1.0)) * d) + min);
 }
 
+bool SetThreadPlacement(int core, int priority, int nice) {
+#if defined(__linux__) && !defined(__ANDROID__)
+  bool ok = true;
+
+  if (core >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+      LOGE("Can't pin thread to core %d", core);
+      ok = false;
+    }
+  }
+
+  if (priority > 0) {
+    // Real-time scheduling usually needs CAP_SYS_NICE or an rtprio limit
+    sched_param param;
+    param.sched_priority = priority;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+      LOGE("Can't set SCHED_FIFO priority %d", priority);
+      ok = false;
+    }
+  } else if (nice != 0) {
+    // Nice level is per thread on Linux
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), nice) != 0) {
+      LOGE("Can't set nice level %d", nice);
+      ok = false;
+    }
+  }
+
+  return ok;
+#else
+  return core < 0 && priority <= 0 && nice == 0;
+#endif
+}
+
 }  // namespace SD_SLAM
 
 
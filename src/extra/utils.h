@@ -26,6 +26,10 @@ namespace SD_SLAM {
 // Get a random int in range [min..max]
 int Random(int min, int max);
 
+// Place calling thread: pin it to core (if >= 0) and run it with SCHED_FIFO priority (if > 0)
+// or with the given nice level (if != 0). Linux only, returns false if any step fails
+bool SetThreadPlacement(int core, int priority, int nice);
+
 }  // namespace SD_SLAM
 
 #endif  // SD_SLAM_UTILS_H_
@@ -0,0 +1,266 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "v4l2_capture.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include <vector>
+#include <mutex>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#include "log.h"
+
+namespace SD_SLAM {
+
+namespace {
+
+int Ioctl(int fd, unsigned long request, void *arg) {
+  int r;
+  do {
+    r = ioctl(fd, request, arg);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+}  // namespace
+
+// Device and its mapped buffers, alive while the capture or any held frame uses them
+struct V4L2Capture::Device {
+  struct Buffer {
+    void *start;
+    size_t length;
+  };
+
+  Device(): fd(-1), streaming(false) {}
+
+  ~Device() {
+    for (const Buffer &b : buffers)
+      munmap(b.start, b.length);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // Give buffer back to the driver, from any thread. Ignored once streaming is stopped
+  void Queue(uint32_t index) {
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (streaming && Ioctl(fd, VIDIOC_QBUF, &buf) != 0)
+      LOGE("Can't queue capture buffer %u", index);
+  }
+
+  int fd;
+  std::vector<Buffer> buffers;
+  bool streaming;
+  std::mutex mutex;
+};
+
+V4L2Capture::V4L2Capture(): width_(0), height_(0), stride_(0), yuyv_(false) {
+}
+
+V4L2Capture::~V4L2Capture() {
+  Close();
+}
+
+bool V4L2Capture::Open(const std::string &device, int width, int height, double fps, int nbuffers) {
+  Close();
+
+  std::shared_ptr<Device> dev(new Device());
+  dev->fd = open(device.c_str(), O_RDWR | O_NONBLOCK);
+  if (dev->fd < 0) {
+    LOGE("Can't open %s", device.c_str());
+    return false;
+  }
+
+  struct v4l2_capability cap;
+  memset(&cap, 0, sizeof(cap));
+  if (Ioctl(dev->fd, VIDIOC_QUERYCAP, &cap) != 0 || !(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+      !(cap.capabilities & V4L2_CAP_STREAMING)) {
+    LOGE("%s is not a streaming capture device", device.c_str());
+    return false;
+  }
+
+  // Gray if the camera has it, YUYV (every UVC camera) otherwise
+  struct v4l2_format fmt;
+  const uint32_t formats[2] = {V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_YUYV};
+  bool ok = false;
+  for (int i = 0; i < 2 && !ok; i++) {
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = formats[i];
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    ok = Ioctl(dev->fd, VIDIOC_S_FMT, &fmt) == 0 && fmt.fmt.pix.pixelformat == formats[i];
+  }
+  if (!ok) {
+    LOGE("%s captures neither GREY nor YUYV frames", device.c_str());
+    return false;
+  }
+
+  yuyv_ = fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV;
+  width_ = fmt.fmt.pix.width;
+  height_ = fmt.fmt.pix.height;
+  stride_ = fmt.fmt.pix.bytesperline > 0 ? fmt.fmt.pix.bytesperline : width_*(yuyv_ ? 2 : 1);
+
+  // Frame rate is only a request, not every driver can set it
+  if (fps > 0) {
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1000;
+    parm.parm.capture.timeperframe.denominator = static_cast<uint32_t>(fps*1000.0);
+    if (Ioctl(dev->fd, VIDIOC_S_PARM, &parm) != 0)
+      LOGD("Can't set frame rate of %s", device.c_str());
+  }
+
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof(req));
+  req.count = nbuffers;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (Ioctl(dev->fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 2) {
+    LOGE("Can't allocate capture buffers of %s", device.c_str());
+    return false;
+  }
+
+  for (uint32_t i = 0; i < req.count; i++) {
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if (Ioctl(dev->fd, VIDIOC_QUERYBUF, &buf) != 0) {
+      LOGE("Can't query capture buffer %u of %s", i, device.c_str());
+      return false;
+    }
+
+    void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, buf.m.offset);
+    if (start == MAP_FAILED) {
+      LOGE("Can't map capture buffer %u of %s", i, device.c_str());
+      return false;
+    }
+    dev->buffers.push_back({start, buf.length});
+  }
+
+  dev->streaming = true;
+  for (uint32_t i = 0; i < req.count; i++)
+    dev->Queue(i);
+
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (Ioctl(dev->fd, VIDIOC_STREAMON, &type) != 0) {
+    LOGE("Can't start streaming from %s", device.c_str());
+    return false;
+  }
+
+  LOGD("Capturing %dx%d %s frames from %s", width_, height_, yuyv_ ? "YUYV" : "GREY", device.c_str());
+  device_ = dev;
+  return true;
+}
+
+bool V4L2Capture::Read(Frame &frame, int timeout) {
+  if (!device_)
+    return false;
+
+  struct pollfd pfd;
+  pfd.fd = device_->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, timeout) <= 0)
+    return false;
+
+  struct v4l2_buffer buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  if (Ioctl(device_->fd, VIDIOC_DQBUF, &buf) != 0)
+    return false;
+
+  // Corrupted frame, try with next one
+  if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+    device_->Queue(buf.index);
+    return false;
+  }
+
+  uint8_t *data = static_cast<uint8_t*>(device_->buffers[buf.index].start);
+  if (yuyv_) {
+    YUYVToGray(data, width_, height_, stride_);
+    frame.image = cv::Mat(height_, width_, CV_8U, data);
+  } else {
+    frame.image = cv::Mat(height_, width_, CV_8U, data, stride_);
+  }
+  frame.timestamp = buf.timestamp.tv_sec + buf.timestamp.tv_usec*1e-6;
+
+  std::shared_ptr<Device> dev = device_;
+  const uint32_t index = buf.index;
+  frame.hold = std::shared_ptr<const void>(data, [dev, index](const void*) { dev->Queue(index); });
+  return true;
+}
+
+void V4L2Capture::Close() {
+  if (!device_)
+    return;
+
+  {
+    std::unique_lock<std::mutex> lock(device_->mutex);
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    Ioctl(device_->fd, VIDIOC_STREAMOFF, &type);
+    device_->streaming = false;
+  }
+  device_.reset();
+}
+
+void V4L2Capture::YUYVToGray(uint8_t *data, int width, int height, int stride) {
+  // Each row is written before the next one is read, and within a row a block is stored after
+  // it is loaded. Writes only reach bytes already read, gray rows are shorter than YUYV ones
+  for (int y = 0; y < height; y++) {
+    const uint8_t *src = data + static_cast<size_t>(y)*stride;
+    uint8_t *dst = data + static_cast<size_t>(y)*width;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    for (; x+16 <= width; x += 16) {
+      const __m128i a = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+2*x)), mask);
+      const __m128i b = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+2*x+16)), mask);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+x), _mm_packus_epi16(a, b));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; x+16 <= width; x += 16) {
+      const uint8x16x2_t v = vld2q_u8(src+2*x);
+      vst1q_u8(dst+x, v.val[0]);
+    }
+#endif
+    for (; x < width; x++)
+      dst[x] = src[2*x];
+  }
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,78 @@
+/*
+ *  Copyright (C) 2017 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_V4L2_CAPTURE_H_
+#define SD_SLAM_V4L2_CAPTURE_H_
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Live frames of a V4L2 camera (Linux), captured into memory-mapped driver buffers. GREY frames
+// are used as they are and YUYV frames are converted to gray in place, so the image is a view of
+// the driver buffer and nothing is copied. The buffer goes back to the driver when the hold of
+// its frame is released: pass it to System::SubmitSharedFrame, or release it after a synchronous
+// Track function. While every buffer is held no frame can be read.
+class V4L2Capture {
+ public:
+  struct Frame {
+    cv::Mat image;                      // Grayscale (CV_8U) view of a driver buffer
+    double timestamp;                   // Capture time (s, CLOCK_MONOTONIC, see Input.TimestampClock)
+    std::shared_ptr<const void> hold;   // Gives the buffer back to the driver when released
+  };
+
+  V4L2Capture();
+  ~V4L2Capture();
+
+  V4L2Capture(const V4L2Capture&) = delete;
+  V4L2Capture& operator=(const V4L2Capture&) = delete;
+
+  // Open device (e.g. /dev/video0) and start streaming. Size and frame rate are requested, the
+  // driver may adjust them (see Width and Height). Returns false on error
+  bool Open(const std::string &device, int width, int height, double fps, int nbuffers = 4);
+
+  // Wait up to timeout ms for the next frame. Returns false on timeout or error
+  bool Read(Frame &frame, int timeout = 1000);
+
+  // Stop streaming. Held buffers stay valid until released
+  void Close();
+
+  inline bool IsOpen() const { return device_ != nullptr; }
+  inline int Width() const { return width_; }
+  inline int Height() const { return height_; }
+
+  // Keep the luma bytes of a YUYV image, packed at its start (gray image of width x height).
+  // Rows of the source are stride bytes apart
+  static void YUYVToGray(uint8_t *data, int width, int height, int stride);
+
+ private:
+  struct Device;
+
+  std::shared_ptr<Device> device_;
+  int width_;
+  int height_;
+  int stride_;
+  bool yuyv_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_V4L2_CAPTURE_H_
@@ -26,34 +26,30 @@
 
 namespace SD_SLAM {
 
-const double SMALL_EPS = 1e-10;
-
-class ConstantVelocity : public Sensor {
+// State: linear and angular velocity (6). Measurement: se3 displacement (6)
+class ConstantVelocity : public SensorModel<6, 6> {
  public:
   ConstantVelocity();
   ~ConstantVelocity();
 
-  void Init(Eigen::VectorXd &X, Eigen::MatrixXd &P);
-  void InitState(Eigen::VectorXd &X, const Eigen::VectorXd &Z);
+  void Init(StateVector &X, StateMatrix &P);
+  void InitState(StateVector &X, const MeasurementVector &Z);
+
+  Eigen::Matrix4d GetPose(const StateVector &X);
 
-  Eigen::Matrix4d GetPose(const Eigen::VectorXd &X);
-  Eigen::VectorXd PoseToVector(const Eigen::Matrix4d &pose);
+  void F(StateVector &X, double time);
+  StateMatrix jF(const StateVector &X, double time);
+  StateMatrix Q(const StateVector &X, double time);
 
-  void F(Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd jF(const Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd Q(const Eigen::VectorXd &X, double time);
+  MeasurementVector Z(const Eigen::Matrix4d &pose, const std::vector<double> &params, double time);
+  MeasurementVector H(const StateVector &X, double time);
+  MeasurementJacobian jH(const StateVector &X, double time);
+  MeasurementMatrix R(const StateVector &X, double time);
 
-  Eigen::VectorXd Z(const Eigen::Matrix4d &pose, const std::vector<double> &params, double time);
-  Eigen::VectorXd H(const Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd jH(const Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd R(const Eigen::VectorXd &X, double time);
+  // Predicted pose is exp(v) * last pose, velocity covariance perturbs the camera frame
+  bool PoseCovariance(const StateVector &X, const StateMatrix &P, Eigen::Matrix<double, 6, 6> &cov);
 
- private:
-  Eigen::Matrix4d Exp(const Eigen::Matrix<double, 6, 1> &update);
-  Eigen::Matrix<double, 6, 1> Log(const Eigen::Matrix4d &pose);
-  Eigen::Quaterniond RotationExp(const Eigen::Vector3d &omega, double *theta);
-  Eigen::Matrix3d RotationHat(const Eigen::Vector3d &v);
-  Eigen::Vector3d RotationLog(const Eigen::Quaterniond &other, double *theta);
+  bool Velocity(const StateVector &X, const Eigen::Matrix4d &pose, double interval, Eigen::Matrix<double, 6, 1> &xi);
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
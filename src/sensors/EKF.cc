@@ -18,31 +18,38 @@
  */
 
 #include "EKF.h"
+#include <algorithm>
+#include "ConstantVelocity.h"
+#include "IMU.h"
 
 using std::vector;
 
 namespace SD_SLAM {
 
-EKF::EKF(Sensor *sensor) : timer_(false) {
+template <int StateSize, int MeasurementSize>
+EKF<StateSize, MeasurementSize>::EKF(SensorType *sensor) : timer_(false) {
   sensor_ = sensor;
   it_time_ = 0.0;
+  use_timestamps_ = false;
+  timestamp_ = 0.0;
+  last_timestamp_ = 0.0;
 
-  const int size_s = sensor_->GetStateSize();
-
-  X_.resize(size_s, 1);
   X_.setZero();
-  P_.resize(size_s, size_s);
   P_.setZero();
 
   updated_ = false;
   sensor_->Init(X_, P_);
 }
 
-EKF::~EKF() {
+template <int StateSize, int MeasurementSize>
+EKF<StateSize, MeasurementSize>::~EKF() {
 }
 
-Eigen::Matrix4d EKF::Predict(const Eigen::Matrix4d &pose) {
-  if (updated_) {
+template <int StateSize, int MeasurementSize>
+Eigen::Matrix4d EKF<StateSize, MeasurementSize>::Predict(const Eigen::Matrix4d &pose) {
+  if (updated_ && use_timestamps_) {
+    it_time_ = std::max(timestamp_-last_timestamp_, 0.0);
+  } else if (updated_) {
     timer_.Stop();
     it_time_ = timer_.GetTime();
   } else {
@@ -53,8 +60,8 @@ Eigen::Matrix4d EKF::Predict(const Eigen::Matrix4d &pose) {
   sensor_->SetLastPose(pose);
 
   // Get matrices before predict
-  Eigen::MatrixXd jF = sensor_->jF(X_, it_time_);
-  Eigen::MatrixXd Q = sensor_->Q(X_, it_time_);
+  const typename SensorType::StateMatrix jF = sensor_->jF(X_, it_time_);
+  const typename SensorType::StateMatrix Q = sensor_->Q(X_, it_time_);
 
   // X_0 = f(X_0)
   sensor_->F(X_, it_time_);
@@ -65,30 +72,28 @@ Eigen::Matrix4d EKF::Predict(const Eigen::Matrix4d &pose) {
   return sensor_->GetPose(X_);
 }
 
-void EKF::Update(const Eigen::Matrix4d &pose, const vector<double> &params) {
-  Eigen::VectorXd Y;
-  Eigen::MatrixXd S, K;
-
+template <int StateSize, int MeasurementSize>
+void EKF<StateSize, MeasurementSize>::Update(const Eigen::Matrix4d &pose, const vector<double> &params) {
   // Set measurements vector
-  Eigen::VectorXd Z = sensor_->Z(pose, params, it_time_);
+  const typename SensorType::MeasurementVector Z = sensor_->Z(pose, params, it_time_);
 
   if (!updated_) {
     // Set initial state
     sensor_->InitState(X_, Z);
   } else {
     // Get matrices before update
-    Eigen::VectorXd H = sensor_->H(X_, it_time_);
-    Eigen::MatrixXd jH = sensor_->jH(X_, it_time_);
-    Eigen::MatrixXd R = sensor_->R(X_, it_time_);
+    const typename SensorType::MeasurementVector H = sensor_->H(X_, it_time_);
+    const typename SensorType::MeasurementJacobian jH = sensor_->jH(X_, it_time_);
+    const typename SensorType::MeasurementMatrix R = sensor_->R(X_, it_time_);
 
     // Y = Z - h(X_0)
-    Y = Z - H;
+    const typename SensorType::MeasurementVector Y = Z - H;
 
     // S = jH * P_0 * jH' + R
-    S = jH * P_ * jH.transpose() + R;
+    const typename SensorType::MeasurementMatrix S = jH * P_ * jH.transpose() + R;
 
     // K = P_0 * jH' * S^-1
-    K = P_ * jH.transpose() * S.inverse();
+    const Eigen::Matrix<double, StateSize, MeasurementSize> K = P_ * jH.transpose() * S.inverse();
 
     // X = X_0 + K * Y
     X_ = X_ + K * Y;
@@ -100,12 +105,36 @@ void EKF::Update(const Eigen::Matrix4d &pose, const vector<double> &params) {
 
   // Start timer for next iteration
   updated_ = true;
+  last_timestamp_ = timestamp_;
   timer_.Start();
 }
 
-void EKF::Restart() {
+template <int StateSize, int MeasurementSize>
+void EKF<StateSize, MeasurementSize>::Restart() {
   updated_ = false;
   sensor_->Init(X_, P_);
 }
 
+template <int StateSize, int MeasurementSize>
+void EKF<StateSize, MeasurementSize>::SetTimestamp(double timestamp) {
+  use_timestamps_ = true;
+  timestamp_ = timestamp;
+}
+
+template <int StateSize, int MeasurementSize>
+bool EKF<StateSize, MeasurementSize>::Velocity(const Eigen::Matrix4d &pose, Eigen::Matrix<double, 6, 1> &xi,
+                                               double &timestamp) {
+  if (!updated_ || !use_timestamps_)
+    return false;
+
+  timestamp = last_timestamp_;
+  if (it_time_ <= 0.0 || !sensor_->Velocity(X_, pose, it_time_, xi))
+    xi.setZero();
+  return true;
+}
+
+// Available sensor models
+template class EKF<ConstantVelocity::STATE_SIZE, ConstantVelocity::MEASUREMENT_SIZE>;
+template class EKF<IMU::STATE_SIZE, IMU::MEASUREMENT_SIZE>;
+
 }  // namespace SD_SLAM
@@ -21,15 +21,54 @@
 #define SD_SLAM_EKF_H_
 
 #include <iostream>
+#include <vector>
 #include <Eigen/Dense>
 #include "Sensor.h"
 #include "extra/timer.h"
 
 namespace SD_SLAM {
 
-class EKF {
+// Motion model interface used by Tracking
+class MotionModel {
  public:
-  EKF(Sensor *sensor);
+  virtual ~MotionModel() {}
+
+  virtual bool Started() = 0;
+
+  // Predict and return 3D Pose
+  virtual Eigen::Matrix4d Predict(const Eigen::Matrix4d &pose) = 0;
+
+  // Update with measured pose
+  virtual void Update(const Eigen::Matrix4d &pose, const std::vector<double> &params) = 0;
+
+  // Restart filter
+  virtual void Restart() = 0;
+
+  // Timestamp (s) of the next frame. Once set, intervals are measured from sensor
+  // timestamps instead of wall clock, so results do not depend on processing time
+  virtual void SetTimestamp(double timestamp) = 0;
+
+  // Sensor input for the interval up to the next frame, used by Predict
+  virtual void SetInput(const std::vector<double> &input) {}
+
+  // Covariance of last predicted pose, as a perturbation [rho, phi] of the camera frame.
+  // Returns false if the model can not provide it
+  virtual bool PoseCovariance(Eigen::Matrix<double, 6, 6> &cov) { return false; }
+
+  // Velocity at last update given its pose, as a twist xi per second (pose dt seconds later is
+  // ExpSE3(xi*dt)*pose), zero if not estimated yet, and sensor timestamp of that update.
+  // Returns false if frames have no timestamps
+  virtual bool Velocity(const Eigen::Matrix4d &pose, Eigen::Matrix<double, 6, 1> &xi, double &timestamp) { return false; }
+};
+
+// Extended Kalman Filter over a sensor model. Sizes are fixed at compile time, so
+// predict and update run on the stack
+template <int StateSize, int MeasurementSize>
+class EKF : public MotionModel {
+ public:
+  typedef SensorModel<StateSize, MeasurementSize> SensorType;
+
+  EKF(SensorType *sensor);
   ~EKF();
 
   inline bool Started() { return updated_; }
@@ -43,16 +82,30 @@ class EKF {
   // Restart filter
   void Restart();
 
+  void SetTimestamp(double timestamp);
+
+  inline void SetInput(const std::vector<double> &input) { sensor_->SetInput(input); }
+
+  inline bool PoseCovariance(Eigen::Matrix<double, 6, 6> &cov) {
+    return updated_ && sensor_->PoseCovariance(X_, P_, cov);
+  }
+
+  bool Velocity(const Eigen::Matrix4d &pose, Eigen::Matrix<double, 6, 1> &xi, double &timestamp);
+
  private:
-  Sensor* sensor_;    // Motion sensor
+  SensorType* sensor_;  // Motion sensor
 
   bool updated_;      // True if EKF has been updated at least once
   Timer timer_;       // Measure time since last iteration
   double it_time_;    // Time (s) since last iteration
 
+  bool use_timestamps_;     // True if frame timestamps are given
+  double timestamp_;        // Timestamp of current frame
+  double last_timestamp_;   // Timestamp of last update
+
   // State and covariance
-  Eigen::VectorXd X_;
-  Eigen::MatrixXd P_;
+  typename SensorType::StateVector X_;
+  typename SensorType::StateMatrix P_;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
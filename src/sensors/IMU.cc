@@ -28,15 +28,15 @@ const double IMU::COV_A_2 = 0.000625;  // 0.025^2
 const double IMU::SIGMA_GYRO = 2.60; // rad/s^2
 const double IMU::SIGMA_ACC = 8.94;  // m/s^3
 
-IMU::IMU() : Sensor() {
-  state_size_ = 16;
-  measurement_size_ = 13;
+IMU::IMU() : SensorModel<16, 13>() {
+  input_w_.setZero();
+  has_input_ = false;
 }
 
 IMU::~IMU() {
 }
 
-void IMU::Init(Eigen::VectorXd &X, Eigen::MatrixXd &P) {
+void IMU::Init(StateVector &X, StateMatrix &P) {
   Eigen::Vector3d x, v, w, a;
   Eigen::Vector4d q;
 
@@ -52,35 +52,41 @@ void IMU::Init(Eigen::VectorXd &X, Eigen::MatrixXd &P) {
   X.segment<3>(10) = w;
   X.segment<3>(13) = a;
 
-  P.block<3, 3>(0, 0) = Eigen::MatrixXd::Identity(3, 3) * Sensor::COV_X_2;
-  P.block<4, 4>(3, 3) = Eigen::MatrixXd::Identity(4, 4) * Sensor::COV_Q_2;
-  P.block<3, 3>(7, 7) = Eigen::MatrixXd::Identity(3, 3) * Sensor::COV_V_2;
-  P.block<3, 3>(10, 10) = Eigen::MatrixXd::Identity(3, 3) * Sensor::COV_W_2;
-  P.block<3, 3>(13, 13) = Eigen::MatrixXd::Identity(3, 3) * IMU::COV_A_2;
+  P.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity() * Sensor::COV_X_2;
+  P.block<4, 4>(3, 3) = Eigen::Matrix4d::Identity() * Sensor::COV_Q_2;
+  P.block<3, 3>(7, 7) = Eigen::Matrix3d::Identity() * Sensor::COV_V_2;
+  P.block<3, 3>(10, 10) = Eigen::Matrix3d::Identity() * Sensor::COV_W_2;
+  P.block<3, 3>(13, 13) = Eigen::Matrix3d::Identity() * IMU::COV_A_2;
 
   gravity_.setZero();
+  has_input_ = false;
 }
 
-void IMU::InitState(Eigen::VectorXd &X, const Eigen::VectorXd &z) {
+void IMU::InitState(StateVector &X, const MeasurementVector &z) {
   X.setZero();
   X.segment<7>(0) = z.segment<7>(0);  // Save pose
 
   gravity_.setZero();
 }
 
-void IMU::F(Eigen::VectorXd &X, double time) {
+Eigen::Matrix4d IMU::GetPose(const StateVector &X) {
+  return VectorToPose(X.segment<7>(0));
+}
+
+void IMU::F(StateVector &X, double time) {
   Eigen::Vector3d x = X.segment<3>(0);
   Eigen::Vector4d q = X.segment<4>(3);
   Eigen::Vector3d v = X.segment<3>(7);
   Eigen::Vector3d w = X.segment<3>(10);
   Eigen::Vector3d a = X.segment<3>(13);
+  Eigen::Vector3d wr = AngularVelocity(X);
 
   // x = x + x*t
   X.segment<3>(0) = x + v*time;
 
   // q = q X w*t
   Eigen::Quaterniond qold(q(0), q(1), q(2), q(3));
-  Eigen::Quaterniond qnew = qold * QuaternionFromAngularVelocity(w * time);
+  Eigen::Quaterniond qnew = qold * QuaternionFromAngularVelocity(wr * time);
   q << qnew.w(), qnew.x(), qnew.y(), qnew.z();
   X.segment<4>(3) = q;
 
@@ -92,13 +98,16 @@ void IMU::F(Eigen::VectorXd &X, double time) {
 
   // a = a
   X.segment<3>(13) = a;
+
+  // Input is only valid for one interval
+  has_input_ = false;
 }
 
-Eigen::MatrixXd IMU::jF(const Eigen::VectorXd &X, double time) {
-  Eigen::MatrixXd jF(state_size_, state_size_);
+IMU::StateMatrix IMU::jF(const StateVector &X, double time) {
+  StateMatrix jF;
 
   Eigen::Vector4d q = X.segment<4>(3);
-  Eigen::Vector3d w = X.segment<3>(10);
+  Eigen::Vector3d w = AngularVelocity(X);
 
   // Jacobian F
   // dx/dx   dx/dq   dx/dv   dx/dw   dx/da       I     0     I*t   0     0
@@ -107,33 +116,35 @@ Eigen::MatrixXd IMU::jF(const Eigen::VectorXd &X, double time) {
   // dw/dx   dw/dq   dw/dv   dw/dw   dw/da       0     0     0     I     0
   // da/dx   da/dq   da/dv   da/dw   da/da       0     0     0     0     I
   jF.setIdentity();
-  jF.block<3, 3>(0, 7) = Eigen::MatrixXd::Identity(3, 3) * time;
-  jF.block<3, 3>(7, 13) = Eigen::MatrixXd::Identity(3, 3) * time;
+  jF.block<3, 3>(0, 7) = Eigen::Matrix3d::Identity() * time;
+  jF.block<3, 3>(7, 13) = Eigen::Matrix3d::Identity() * time;
 
   // dq/dq
   Eigen::Quaterniond qwt = QuaternionFromAngularVelocity(w * time);
   jF.block<4, 4>(3, 3) = QuaternionJacobian(qwt);
 
-  // dq/dw
-  Eigen::Quaterniond qold(q(0), q(1), q(2), q(3));
-  jF.block<4, 3>(3, 10) = dq_by_dw(qold, w, time);
+  // dq/dw, rotation does not depend on state velocity when input is given
+  if (!has_input_) {
+    Eigen::Quaterniond qold(q(0), q(1), q(2), q(3));
+    jF.block<4, 3>(3, 10) = dq_by_dw(qold, w, time);
+  }
 
   return jF;
 }
 
-Eigen::MatrixXd IMU::Q(const Eigen::VectorXd &X, double time) {
-  Eigen::MatrixXd Q(state_size_, state_size_);
-  int noise_size = 9;
+IMU::StateMatrix IMU::Q(const StateVector &X, double time) {
+  StateMatrix Q;
+  const int noise_size = 9;
 
   Eigen::Vector4d q = X.segment<4>(3);
-  Eigen::Vector3d w = X.segment<3>(10);
+  Eigen::Vector3d w = AngularVelocity(X);
 
   // Noise matrix
-  Eigen::MatrixXd  P_n(noise_size, noise_size);
+  Eigen::Matrix<double, noise_size, noise_size> P_n;
   P_n.setZero();
-  P_n.block<3, 3>(0, 0) = Eigen::MatrixXd::Identity(3, 3) * Sensor::SIGMA_V * Sensor::SIGMA_V * time * time;
-  P_n.block<3, 3>(3, 3) = Eigen::MatrixXd::Identity(3, 3) * Sensor::SIGMA_W * Sensor::SIGMA_W * time * time;
-  P_n.block<3, 3>(6, 6) = Eigen::MatrixXd::Identity(3, 3) * IMU::SIGMA_ACC * IMU::SIGMA_ACC * time * time;
+  P_n.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity() * Sensor::SIGMA_V * Sensor::SIGMA_V * time * time;
+  P_n.block<3, 3>(3, 3) = Eigen::Matrix3d::Identity() * Sensor::SIGMA_W * Sensor::SIGMA_W * time * time;
+  P_n.block<3, 3>(6, 6) = Eigen::Matrix3d::Identity() * IMU::SIGMA_ACC * IMU::SIGMA_ACC * time * time;
 
   // Jacobian G
   // dx/dv   dx/dw   dx/da       I*t   0     0
@@ -141,14 +152,14 @@ Eigen::MatrixXd IMU::Q(const Eigen::VectorXd &X, double time) {
   // dv/dv   dv/dw   dv/da   =   I     0     I*t
   // dw/dv   dw/dw   dw/da       0     I     0
   // da/dv   da/dw   da/da       0     0     I
-  Eigen::MatrixXd G(state_size_, noise_size);
+  Eigen::Matrix<double, STATE_SIZE, noise_size> G;
   G.setZero();
 
-  G.block<3, 3>(0, 0) = Eigen::MatrixXd::Identity(3, 3) * time;
-  G.block<3, 3>(7, 0) = Eigen::MatrixXd::Identity(3, 3);
-  G.block<3, 3>(7, 6) = Eigen::MatrixXd::Identity(3, 3) * time;
-  G.block<3, 3>(10, 3) = Eigen::MatrixXd::Identity(3, 3);
-  G.block<3, 3>(13, 6) = Eigen::MatrixXd::Identity(3, 3);
+  G.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity() * time;
+  G.block<3, 3>(7, 0) = Eigen::Matrix3d::Identity();
+  G.block<3, 3>(7, 6) = Eigen::Matrix3d::Identity() * time;
+  G.block<3, 3>(10, 3) = Eigen::Matrix3d::Identity();
+  G.block<3, 3>(13, 6) = Eigen::Matrix3d::Identity();
 
   Eigen::Quaterniond qold(q(0), q(1), q(2), q(3));
   G.block<4, 3>(3, 3) = dq_by_dw(qold, w, time);
@@ -159,10 +170,10 @@ Eigen::MatrixXd IMU::Q(const Eigen::VectorXd &X, double time) {
   return Q;
 }
 
-Eigen::VectorXd IMU::Z(const Eigen::Matrix4d &pose, const vector<double> &params, double time) {
-  Eigen::VectorXd Z(measurement_size_);
+IMU::MeasurementVector IMU::Z(const Eigen::Matrix4d &pose, const vector<double> &params, double time) {
+  MeasurementVector Z;
 
-  assert(7 + static_cast<int>(params.size()) == measurement_size_);
+  assert(7 + static_cast<int>(params.size()) == MEASUREMENT_SIZE);
 
   Eigen::Vector3d w(params[0], params[1], params[2]);
   Eigen::Vector3d a(params[3], params[4], params[5]);
@@ -177,8 +188,8 @@ Eigen::VectorXd IMU::Z(const Eigen::Matrix4d &pose, const vector<double> &params
   return Z;
 }
 
-Eigen::VectorXd IMU::H(const Eigen::VectorXd &X, double time) {
-  Eigen::VectorXd H(measurement_size_);
+IMU::MeasurementVector IMU::H(const StateVector &X, double time) {
+  MeasurementVector H;
   H.setZero();
 
   Eigen::Vector3d x = X.segment<3>(0);
@@ -201,8 +212,8 @@ Eigen::VectorXd IMU::H(const Eigen::VectorXd &X, double time) {
   return H;
 }
 
-Eigen::MatrixXd IMU::jH(const Eigen::VectorXd &X, double time) {
-  Eigen::MatrixXd jH(measurement_size_, state_size_);
+IMU::MeasurementJacobian IMU::jH(const StateVector &X, double time) {
+  MeasurementJacobian jH;
 
   // Jacobian H
   // dx/dx   dx/dq   dx/dv   dx/dw   dx/da       I     0     0     0     0
@@ -210,26 +221,87 @@ Eigen::MatrixXd IMU::jH(const Eigen::VectorXd &X, double time) {
   // dw/dx   dw/dq   dw/dv   dw/dw   dw/da       0     0     0     I     0
   // da/dx   da/dq   da/dv   da/dw   da/da       0     0     0     0     I
   jH.setZero();
-  jH.block<3, 3>(0, 0) = Eigen::MatrixXd::Identity(3, 3);
-  jH.block<4, 4>(3, 3) = Eigen::MatrixXd::Identity(4, 4);
-  jH.block<3, 3>(7, 10) = Eigen::MatrixXd::Identity(3, 3);
-  jH.block<3, 3>(10, 13) = Eigen::MatrixXd::Identity(3, 3);
+  jH.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity();
+  jH.block<4, 4>(3, 3) = Eigen::Matrix4d::Identity();
+  jH.block<3, 3>(7, 10) = Eigen::Matrix3d::Identity();
+  jH.block<3, 3>(10, 13) = Eigen::Matrix3d::Identity();
 
   return jH;
 }
 
-Eigen::MatrixXd IMU::R(const Eigen::VectorXd &X, double time) {
-  Eigen::MatrixXd R(measurement_size_, measurement_size_);
+IMU::MeasurementMatrix IMU::R(const StateVector &X, double time) {
+  MeasurementMatrix R;
 
   R.setZero();
-  R.block<3, 3>(0, 0) = Eigen::MatrixXd::Identity(3, 3) * Sensor::SIGMA_X * Sensor::SIGMA_X * time * time;
-  R.block<4, 4>(3, 3) = Eigen::MatrixXd::Identity(4, 4) * Sensor::SIGMA_Q * Sensor::SIGMA_Q * time * time;
-  R.block<3, 3>(7, 7) = Eigen::MatrixXd::Identity(3, 3) * IMU::SIGMA_GYRO * IMU::SIGMA_GYRO * time * time;
-  R.block<3, 3>(10, 10) = Eigen::MatrixXd::Identity(3, 3) * IMU::SIGMA_ACC * IMU::SIGMA_ACC * time * time;
+  R.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity() * Sensor::SIGMA_X * Sensor::SIGMA_X * time * time;
+  R.block<4, 4>(3, 3) = Eigen::Matrix4d::Identity() * Sensor::SIGMA_Q * Sensor::SIGMA_Q * time * time;
+  R.block<3, 3>(7, 7) = Eigen::Matrix3d::Identity() * IMU::SIGMA_GYRO * IMU::SIGMA_GYRO * time * time;
+  R.block<3, 3>(10, 10) = Eigen::Matrix3d::Identity() * IMU::SIGMA_ACC * IMU::SIGMA_ACC * time * time;
 
   return R;
 }
 
+void IMU::SetInput(const vector<double> &input) {
+  if (input.size() < 3) {
+    has_input_ = false;
+    return;
+  }
+
+  input_w_ << input[0], input[1], input[2];
+  has_input_ = true;
+}
+
+bool IMU::PoseCovariance(const StateVector &X, const StateMatrix &P, Eigen::Matrix<double, 6, 6> &cov) {
+  Eigen::Vector3d t = X.segment<3>(0);
+  Eigen::Quaterniond q(X(3), X(4), X(5), X(6));
+  q.normalize();
+  Eigen::Vector3d qv = q.vec();
+
+  // Rotation error in body frame: dtheta = 2*vec(q^-1 * dq)
+  Eigen::Matrix<double, 3, 4> G;
+  Eigen::Matrix3d qvhat;
+  qvhat << 0.0, -qv(2), qv(1),
+           qv(2), 0.0, -qv(0),
+           -qv(1), qv(0), 0.0;
+  G.col(0) = -2.0*qv;
+  G.block<3, 3>(0, 1) = 2.0*(q.w()*Eigen::Matrix3d::Identity() - qvhat);
+
+  // Camera frame perturbation: phi = R*dtheta, rho = dt + [t]x*phi
+  Eigen::Matrix<double, 3, 4> Gphi = q.toRotationMatrix()*G;
+  Eigen::Matrix3d that;
+  that << 0.0, -t(2), t(1),
+          t(2), 0.0, -t(0),
+          -t(1), t(0), 0.0;
+
+  Eigen::Matrix<double, 6, 7> J;
+  J.setZero();
+  J.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity();
+  J.block<3, 4>(0, 3) = that*Gphi;
+  J.block<3, 4>(3, 3) = Gphi;
+
+  cov = J*P.block<7, 7>(0, 0)*J.transpose();
+  return true;
+}
+
+bool IMU::Velocity(const StateVector &X, const Eigen::Matrix4d &pose, double interval,
+                   Eigen::Matrix<double, 6, 1> &xi) {
+  Eigen::Vector3d t = pose.block<3, 1>(0, 3);
+  Eigen::Vector3d v = X.segment<3>(7);
+  Eigen::Vector3d w = X.segment<3>(10);
+
+  // Rotation is R*exp(w*dt), translation t+v*dt: phi = R*w, rho = v - phi x t
+  Eigen::Vector3d phi = pose.block<3, 3>(0, 0)*w;
+  xi.head<3>() = v - phi.cross(t);
+  xi.tail<3>() = phi;
+  return true;
+}
+
+Eigen::Vector3d IMU::AngularVelocity(const StateVector &X) const {
+  if (has_input_)
+    return input_w_;
+  return X.segment<3>(10);
+}
+
 void IMU::UpdateGravity(const Eigen::Vector3d &a, double time) {
   // Low pass filter
   double alpha =  0.27 / (0.27 + time);
@@ -26,30 +26,50 @@
 
 namespace SD_SLAM {
 
-class IMU : public Sensor {
+// State: position, quaternion, linear and angular velocity, acceleration (16).
+// Measurement: position, quaternion, angular velocity, acceleration (13)
+class IMU : public SensorModel<16, 13> {
  public:
   IMU();
   ~IMU();
 
-  void Init(Eigen::VectorXd &X, Eigen::MatrixXd &P);
-  void InitState(Eigen::VectorXd &X, const Eigen::VectorXd &Z);
+  void Init(StateVector &X, StateMatrix &P);
+  void InitState(StateVector &X, const MeasurementVector &Z);
 
-  void F(Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd jF(const Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd Q(const Eigen::VectorXd &X, double time);
+  Eigen::Matrix4d GetPose(const StateVector &X);
 
-  Eigen::VectorXd Z(const Eigen::Matrix4d &pose, const std::vector<double> &params, double time);
-  Eigen::VectorXd H(const Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd jH(const Eigen::VectorXd &X, double time);
-  Eigen::MatrixXd R(const Eigen::VectorXd &X, double time);
+  void F(StateVector &X, double time);
+  StateMatrix jF(const StateVector &X, double time);
+  StateMatrix Q(const StateVector &X, double time);
+
+  MeasurementVector Z(const Eigen::Matrix4d &pose, const std::vector<double> &params, double time);
+  MeasurementVector H(const StateVector &X, double time);
+  MeasurementJacobian jH(const StateVector &X, double time);
+  MeasurementMatrix R(const StateVector &X, double time);
+
+  // Mean angular velocity over the next interval (3 values). Prediction rotates with it
+  // instead of the filtered velocity, it is used once
+  void SetInput(const std::vector<double> &input);
+
+  // Position and quaternion covariance mapped to a perturbation of the camera frame
+  bool PoseCovariance(const StateVector &X, const StateMatrix &P, Eigen::Matrix<double, 6, 6> &cov);
+
+  bool Velocity(const StateVector &X, const Eigen::Matrix4d &pose, double interval, Eigen::Matrix<double, 6, 1> &xi);
 
  private:
   // Calculate gravity from IMU
   void UpdateGravity(const Eigen::Vector3d &a, double time);
 
+  // Angular velocity used to predict rotation
+  Eigen::Vector3d AngularVelocity(const StateVector &X) const;
+
   // Gravity parameters
   Eigen::Vector3d gravity_;
 
+  // Preintegrated angular velocity for next prediction
+  Eigen::Vector3d input_w_;
+  bool has_input_;
+
   // Covariance
   static const double COV_A_2;
 
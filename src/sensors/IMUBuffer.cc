@@ -0,0 +1,166 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "IMUBuffer.h"
+#include "extra/lie.h"
+
+using std::mutex;
+using std::unique_lock;
+
+namespace SD_SLAM {
+
+const int IMUBuffer::CAPACITY = 2000;
+
+Eigen::Vector3d IMUBuffer::Preintegrated::MeanGyro() const {
+  if (dt <= 0.0)
+    return Eigen::Vector3d::Zero();
+  Eigen::AngleAxisd aa(dR);
+  return aa.axis()*aa.angle()/dt;
+}
+
+Eigen::Vector3d IMUBuffer::Preintegrated::MeanAcc() const {
+  if (dt <= 0.0)
+    return Eigen::Vector3d::Zero();
+  return dV/dt;
+}
+
+IMUBuffer::IMUBuffer(int capacity) : samples_(capacity), head_(0), size_(0) {
+}
+
+void IMUBuffer::Add(double timestamp, const Eigen::Vector3d &gyro, const Eigen::Vector3d &acc) {
+  unique_lock<mutex> lock(mutex_);
+
+  Sample s;
+  s.t = timestamp;
+  s.gyro = gyro;
+  s.acc = acc;
+
+  if (size_ == 0) {
+    s.R.setIdentity();
+    s.V.setZero();
+    s.P.setZero();
+  } else {
+    const Sample &last = At(size_-1);
+    if (timestamp <= last.t)
+      return;
+
+    s.R = last.R;
+    s.V = last.V;
+    s.P = last.P;
+    Propagate(last, timestamp-last.t, s.R, s.V, s.P);
+  }
+
+  // Overwrite oldest sample when full
+  if (size_ == static_cast<int>(samples_.size())) {
+    head_ = (head_+1) % samples_.size();
+    size_--;
+  }
+
+  At(size_) = s;
+  size_++;
+}
+
+bool IMUBuffer::Integrate(double t0, double t1, Preintegrated &out) {
+  unique_lock<mutex> lock(mutex_);
+
+  if (Find(t1) < 0)
+    return false;
+
+  // Clamp to oldest sample
+  t0 = std::max(std::min(t0, t1), At(0).t);
+  t1 = std::max(t1, t0);
+
+  Eigen::Matrix3d R0, R1;
+  Eigen::Vector3d V0, V1, P0, P1;
+  StateAt(t0, R0, V0, P0);
+  StateAt(t1, R1, V1, P1);
+
+  out.dt = t1-t0;
+  out.dR = R0.transpose()*R1;
+  out.dV = R0.transpose()*(V1-V0);
+  out.dP = R0.transpose()*(P1-P0-V0*out.dt);
+
+  return true;
+}
+
+bool IMUBuffer::Rotation(double t, Eigen::Matrix3d &R) {
+  unique_lock<mutex> lock(mutex_);
+
+  if (Find(t) < 0)
+    return false;
+
+  Eigen::Vector3d V, P;
+  StateAt(t, R, V, P);
+  return true;
+}
+
+bool IMUBuffer::Measurement(double t, Eigen::Vector3d &gyro, Eigen::Vector3d &acc) {
+  unique_lock<mutex> lock(mutex_);
+
+  int i = Find(t);
+  if (i < 0)
+    return false;
+
+  gyro = At(i).gyro;
+  acc = At(i).acc;
+  return true;
+}
+
+void IMUBuffer::Clear() {
+  unique_lock<mutex> lock(mutex_);
+  head_ = 0;
+  size_ = 0;
+}
+
+void IMUBuffer::Propagate(const Sample &s, double dt, Eigen::Matrix3d &R, Eigen::Vector3d &V, Eigen::Vector3d &P) {
+  const Eigen::Vector3d a = R*s.acc;
+  P += V*dt + 0.5*a*dt*dt;
+  V += a*dt;
+  R = R*Lie::ExpSO3<double>(s.gyro*dt).toRotationMatrix();
+}
+
+void IMUBuffer::StateAt(double t, Eigen::Matrix3d &R, Eigen::Vector3d &V, Eigen::Vector3d &P) {
+  int i = std::max(Find(t), 0);
+  const Sample &s = At(i);
+
+  R = s.R;
+  V = s.V;
+  P = s.P;
+  if (t > s.t)
+    Propagate(s, t-s.t, R, V, P);
+}
+
+int IMUBuffer::Find(double t) {
+  if (size_ == 0 || At(0).t > t)
+    return -1;
+
+  // Binary search, samples are sorted by time
+  int lo = 0, hi = size_-1;
+  while (lo < hi) {
+    int mid = (lo+hi+1)/2;
+    if (At(mid).t <= t)
+      lo = mid;
+    else
+      hi = mid-1;
+  }
+
+  return lo;
+}
+
+}  // namespace SD_SLAM
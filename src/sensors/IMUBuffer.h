@@ -0,0 +1,102 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_IMUBUFFER_H_
+#define SD_SLAM_IMUBUFFER_H_
+
+#include <vector>
+#include <mutex>
+#include <Eigen/Dense>
+
+namespace SD_SLAM {
+
+// Ring buffer of timestamped IMU samples. Each sample stores the rotation, velocity and
+// position integrated in the body frame up to its timestamp, so the motion between any two
+// instants is recovered without iterating over the samples in between
+class IMUBuffer {
+ public:
+  // Motion between two instants, expressed in the body frame at the first one.
+  // Gravity is not removed, velocity and position deltas include it
+  struct Preintegrated {
+    double dt;
+    Eigen::Matrix3d dR;
+    Eigen::Vector3d dV;
+    Eigen::Vector3d dP;
+
+    // Mean angular velocity and acceleration in the interval
+    Eigen::Vector3d MeanGyro() const;
+    Eigen::Vector3d MeanAcc() const;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  IMUBuffer(int capacity = CAPACITY);
+
+  // Add measurement. Timestamps (s) must be increasing, older samples are discarded
+  void Add(double timestamp, const Eigen::Vector3d &gyro, const Eigen::Vector3d &acc);
+
+  // Motion between t0 and t1. Returns false if there are no samples before t1
+  bool Integrate(double t0, double t1, Preintegrated &out);
+
+  // Rotation integrated from oldest sample ever added up to t, so the rotation between two
+  // instants is R0'*R1. Returns false if there are no samples before t
+  bool Rotation(double t, Eigen::Matrix3d &R);
+
+  // Last measurement before t. Returns false if there are no samples before t
+  bool Measurement(double t, Eigen::Vector3d &gyro, Eigen::Vector3d &acc);
+
+  void Clear();
+
+  // 2s at 1kHz
+  static const int CAPACITY;
+
+ private:
+  struct Sample {
+    double t;
+    Eigen::Vector3d gyro;
+    Eigen::Vector3d acc;
+
+    // Integrated state at t
+    Eigen::Matrix3d R;
+    Eigen::Vector3d V;
+    Eigen::Vector3d P;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Integrate sample s during dt
+  static void Propagate(const Sample &s, double dt, Eigen::Matrix3d &R, Eigen::Vector3d &V, Eigen::Vector3d &P);
+
+  // Integrated state at t. Buffer must not be empty
+  void StateAt(double t, Eigen::Matrix3d &R, Eigen::Vector3d &V, Eigen::Vector3d &P);
+
+  // Index in buffer of last sample not newer than t, -1 if none
+  int Find(double t);
+
+  inline Sample& At(int i) { return samples_[(head_+i) % samples_.size()]; }
+
+  std::vector<Sample, Eigen::aligned_allocator<Sample> > samples_;
+  int head_;    // Oldest sample
+  int size_;    // Samples stored
+  std::mutex mutex_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_IMUBUFFER_H_
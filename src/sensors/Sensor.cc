@@ -18,6 +18,7 @@
  */
 
 #include "Sensor.h"
+#include "extra/lie.h"
 
 namespace SD_SLAM {
 
@@ -32,19 +33,17 @@ const double Sensor::SIGMA_V = 4.0;   // m/s^2
 const double Sensor::SIGMA_W = 6.0;   // rad/s^2
 
 Sensor::Sensor() {
-  state_size_ = 0;
-  measurement_size_ = 0;
   last_pose_.setZero();
 }
 
 Sensor::~Sensor() {
 }
 
-Eigen::Matrix4d Sensor::GetPose(const Eigen::VectorXd &X) {
+Eigen::Matrix4d Sensor::VectorToPose(const Eigen::Matrix<double, 7, 1> &v) {
   Eigen::Matrix4d pose;
 
-  Eigen::Vector3d x = X.segment<3>(0);
-  Eigen::Vector4d q = X.segment<4>(3);
+  Eigen::Vector3d x = v.segment<3>(0);
+  Eigen::Vector4d q = v.segment<4>(3);
 
   Eigen::Quaterniond qt(q(0), q(1), q(2), q(3));
   qt.normalize();
@@ -56,8 +55,8 @@ Eigen::Matrix4d Sensor::GetPose(const Eigen::VectorXd &X) {
   return pose;
 }
 
-Eigen::VectorXd Sensor::PoseToVector(const Eigen::Matrix4d &pose) {
-  Eigen::VectorXd v(7);
+Eigen::Matrix<double, 7, 1> Sensor::PoseToVector(const Eigen::Matrix4d &pose) {
+  Eigen::Matrix<double, 7, 1> v;
 
   Eigen::Matrix3d rot = pose.block<3, 3>(0, 0);
   Eigen::Quaterniond q(rot);
@@ -73,23 +72,7 @@ Eigen::VectorXd Sensor::PoseToVector(const Eigen::Matrix4d &pose) {
 }
 
 Eigen::Quaterniond Sensor::QuaternionFromAngularVelocity(const Eigen::Vector3d &w) {
-  Eigen::Quaterniond  q;
-  const double angle = sqrt(w(0)*w(0) + w(1)*w(1) + w(2)*w(2));
-
-  if (angle > 0.0) {
-    const double s = sin(angle/2.0) / angle;
-    const double c = cos(angle/2.0);
-
-    q.w() = c;
-    q.x() = s * w(0);
-    q.y() = s * w(1);
-    q.z() = s * w(2);
-  } else {
-    q.w() = 1.0;
-    q.x() = q.y() = q.z() = 0.0;
-  }
-
-  return  q;
+  return Lie::ExpSO3(w);
 }
 
 Eigen::Matrix4d Sensor::QuaternionJacobian(const Eigen::Quaterniond &q) {
@@ -132,7 +115,7 @@ Eigen::Matrix<double, 4, 3> Sensor::dq_by_dw(const Eigen::Quaterniond &q, const
 
   if (modw == 0) {
     res.block(0, 0, 1, 3).setZero();
-    res.block(1, 0, 3, 3) = Eigen::MatrixXd::Identity(3, 3) * time / 2.0;
+    res.block<3, 3>(1, 0) = Eigen::Matrix3d::Identity() * time / 2.0;
   } else {
     mdw(0, 0) = (-time / 2.0) * sin(beta) * w(0) / modw;
     mdw(0, 1) = (-time / 2.0) * sin(beta) * w(1) / modw;
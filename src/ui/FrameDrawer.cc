@@ -24,95 +24,80 @@
 
 #include "FrameDrawer.h"
 #include "Config.h"
-#include "extra/utils.h"
 
 using std::vector;
-using std::mutex;
-using std::unique_lock;
 
 namespace SD_SLAM {
 
 FrameDrawer::FrameDrawer(Map* pMap):mpMap(pMap) {
-  mState = Tracking::SYSTEM_NOT_READY;
-  mIm = cv::Mat(Config::Height(), Config::Width(), CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::Mat black(Config::Height(), Config::Width(), CV_8UC3, cv::Scalar(0, 0, 0));
+  mBuffer.ForEach([&](FrameData &data) {
+    data.im = black;
+    data.pose = Eigen::Matrix4d::Zero();
+    data.state = Tracking::SYSTEM_NOT_READY;
+    data.onlyTracking = false;
+    data.undistorted = false;
+  });
+
+  mnLastState = Tracking::SYSTEM_NOT_READY;
   undistort = false;
   addPlane = false;
   clearAR = false;
-  onlyTracking_ = false;
+}
+
+FrameDrawer::FrameData& FrameDrawer::GetFrameData() {
+  mBuffer.Update();
+  return mBuffer.Front();
 }
 
 cv::Mat FrameDrawer::DrawFrame() {
+  FrameData &data = GetFrameData();
+  int state = data.state;
+  if (data.state == Tracking::SYSTEM_NOT_READY)
+    data.state = Tracking::NO_IMAGES_YET;
+
+  // Shared image is never written, draw over a new one
   cv::Mat im;
-  vector<cv::KeyPoint> vIniKeys; // Initialization: KeyPoints in reference frame
-  vector<int> vMatches; // Initialization: correspondeces with reference keypoints
-  vector<cv::KeyPoint> vCurrentKeys; // KeyPoints in current frame
-  vector<bool> vbMap; // Tracked MapPoints in current frame
-  int state; // Tracking state
-
-  //Copy variables within scoped mutex
-  {
-    unique_lock<mutex> lock(mMutex);
-    state = mState;
-    if (mState == Tracking::SYSTEM_NOT_READY)
-      mState = Tracking::NO_IMAGES_YET;
-
-    mIm.copyTo(im);
-
-    if (mState == Tracking::NOT_INITIALIZED) {
-      vCurrentKeys = mvCurrentKeys;
-      vIniKeys = mvIniKeys;
-      vMatches = mvIniMatches;
-    } else if (mState == Tracking::OK) {
-      vCurrentKeys = mvCurrentKeys;
-      vbMap = mvbMap;
-    } else if (mState == Tracking::LOST) {
-      vCurrentKeys = mvCurrentKeys;
-    }
-  }
+  if (data.undistorted && !data.remap1.empty() && data.remap1.size() == data.im.size())
+    cv::remap(data.im, im, data.remap1, data.remap2, cv::INTER_LINEAR);
+  else
+    im = data.im;
 
   if (im.channels()<3)
     cvtColor(im, im, CV_GRAY2BGR);
+  else
+    im = im.clone();
 
   //Draw
   if (state==Tracking::NOT_INITIALIZED) { //INITIALIZING
-    for (unsigned int i = 0; i < vMatches.size(); i++) {
-      if (vMatches[i] >= 0)
-        cv::line(im, vIniKeys[i].pt, vCurrentKeys[vMatches[i]].pt, cv::Scalar(0, 255, 0), 2);
-    }
+    for (size_t i = 0; i < data.vIniPoints.size(); i++)
+      cv::line(im, data.vIniPoints[i], data.vCurPoints[i], cv::Scalar(0, 255, 0), 2);
   } else if (state==Tracking::OK) { //TRACKING
-    mnTracked = 0;
     const float r = 3;
-    const int n = vCurrentKeys.size();
-    for (int i = 0; i<n; i++) {
-      if (vbMap[i]) {
-        // This is a match to a MapPoint in the map
-        if (onlyTracking_)
-          cv::circle(im, vCurrentKeys[i].pt, r, cv::Scalar(0, 0, 255), 2);
-        else
-          cv::circle(im, vCurrentKeys[i].pt, r, cv::Scalar(0, 255, 0), 2);
-        mnTracked++;
-      }
-    }
+    cv::Scalar color = data.onlyTracking ? cv::Scalar(0, 0, 255) : cv::Scalar(0, 255, 0);
+    for (const cv::Point2f &pt : data.vTracked)
+      cv::circle(im, pt, r, color, 2);
   }
 
-  DrawTextInfo(im, state);
+  DrawTextInfo(im, data);
 
   return im;
 }
 
 
-void FrameDrawer::DrawTextInfo(cv::Mat &im, int nState) {
+void FrameDrawer::DrawTextInfo(cv::Mat &im, const FrameData &data) {
   std::stringstream s;
+  int nState = data.state;
   if (nState==Tracking::NO_IMAGES_YET)
     s << " WAITING FOR IMAGES";
   else if (nState==Tracking::NOT_INITIALIZED)
     s << " TRYING TO INITIALIZE ";
   else if (nState==Tracking::OK) {
-    if(onlyTracking_)
+    if(data.onlyTracking)
       s << "LOCALIZATION | ";
     int nKFs = mpMap->KeyFramesInMap();
     int nMPs = mpMap->MapPointsInMap();
-    s << "KFs: " << nKFs << ", MPs: " << nMPs << ", Matches: " << mnTracked;
+    s << "KFs: " << nKFs << ", MPs: " << nMPs << ", Matches: " << data.vTracked.size();
   } else if (nState==Tracking::LOST) {
     s << " TRACK LOST. TRYING TO RELOCALIZE ";
   } else if (nState==Tracking::SYSTEM_NOT_READY) {
@@ -127,92 +112,103 @@ void FrameDrawer::DrawTextInfo(cv::Mat &im, int nState) {
 }
 
 void FrameDrawer::Update(const cv::Mat &im, const Eigen::Matrix4d &pose, Tracking *pTracker) {
-  std::unique_lock<mutex> lock(mMutex);
-  mPose = pose;
-
+  int state = static_cast<int>(pTracker->GetLastState());
+
+  // Skip frames the viewer would not show, state changes are always sent
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double fps = Config::ViewerFPS();
+  if (fps > 0 && state == mnLastState &&
+      std::chrono::duration<double>(now-mLastUpdate).count() < 1.0/fps)
+    return;
+  mLastUpdate = now;
+  mnLastState = state;
+
+  FrameData &data = mBuffer.Back();
   Frame &currentFrame = pTracker->GetCurrentFrame();
-  if (undistort)
-    currentFrame.Undistort(im, mIm);
-  else
-    im.copyTo(mIm);
-  if (undistort)
-    mvCurrentKeys = currentFrame.mvKeysUn;
+  bool bUndistort = undistort;
+
+  // Finest pyramid level is the grayscale input and it is not modified after extraction
+  if (!currentFrame.mvImagePyramid.empty() && !currentFrame.mvImagePyramid[0].empty())
+    data.im = currentFrame.mvImagePyramid[0];
   else
-    mvCurrentKeys = currentFrame.mvKeys;
-  int n = mvCurrentKeys.size();
-  mvbMap = vector<bool>(n, false);
-  mvMPs.clear();
-  onlyTracking_ = pTracker->OnlyTracking();
-
-  if (pTracker->GetLastState() == Tracking::NOT_INITIALIZED)  {
-    if (undistort)
-      mvIniKeys = pTracker->GetInitialFrame().mvKeysUn;
-    else
-      mvIniKeys = pTracker->GetInitialFrame().mvKeys;
-    mvIniMatches = pTracker->GetInitialMatches();
-  } else if (pTracker->GetLastState() == Tracking::OK) {
+    data.im = im.clone();
+
+  if (currentFrame.mpCamera) {
+    data.remap1 = currentFrame.mpCamera->mRemapMap1;
+    data.remap2 = currentFrame.mpCamera->mRemapMap2;
+  }
+
+  data.pose = pose;
+  data.state = state;
+  data.onlyTracking = pTracker->OnlyTracking();
+  data.undistorted = bUndistort;
+  data.vTracked.clear();
+  data.vIniPoints.clear();
+  data.vCurPoints.clear();
+  data.vMPs.clear();
+
+  const vector<cv::KeyPoint> &vKeys = bUndistort ? currentFrame.mvKeysUn : currentFrame.mvKeys;
+
+  if (state == Tracking::NOT_INITIALIZED)  {
+    Frame &iniFrame = pTracker->GetInitialFrame();
+    const vector<cv::KeyPoint> &vIniKeys = bUndistort ? iniFrame.mvKeysUn : iniFrame.mvKeys;
+    const vector<int> &vMatches = pTracker->GetInitialMatches();
+    for (size_t i = 0; i < vMatches.size() && i < vIniKeys.size(); i++) {
+      if (vMatches[i] >= 0 && vMatches[i] < static_cast<int>(vKeys.size())) {
+        data.vIniPoints.push_back(vIniKeys[i].pt);
+        data.vCurPoints.push_back(vKeys[vMatches[i]].pt);
+      }
+    }
+  } else if (state == Tracking::OK) {
+    const int n = vKeys.size();
     for (int i = 0; i < n; i++) {
       MapPoint* pMP = currentFrame.mvpMapPoints[i];
       if (pMP) {
         // Save points seen
         if (!currentFrame.mvbOutlier[i])
-          mvbMap[i] = true;
+          data.vTracked.push_back(vKeys[i].pt);
 
         // Save best observed points
         if(pMP->Observations() > 5)
-          mvMPs.push_back(pMP);
+          data.vMPs.push_back(pMP);
       }
     }
   }
-  mState = static_cast<int>(pTracker->GetLastState());
+
+  mBuffer.Publish();
 }
 
 void FrameDrawer::GetCurrentOpenGLCameraMatrix(pangolin::OpenGlMatrix &M) {
-  if (!mPose.isZero()) {
-    Eigen::Matrix3d Rwc;
-    Eigen::Vector3d twc;
-    {
-      unique_lock<mutex> lock(mMutex);
-      Rwc = mPose.block<3, 3>(0, 0).transpose();
-      twc = -Rwc*mPose.block<3, 1>(0, 3);
-    }
-
-    M.m[0] = mPose(0, 0);
-    M.m[1] = mPose(1, 0);
-    M.m[2] = mPose(2, 0);
+  const Eigen::Matrix4d &pose = GetFrameData().pose;
+  if (!pose.isZero()) {
+    M.m[0] = pose(0, 0);
+    M.m[1] = pose(1, 0);
+    M.m[2] = pose(2, 0);
     M.m[3]  = 0.0;
 
-    M.m[4] = mPose(0, 1);
-    M.m[5] = mPose(1, 1);
-    M.m[6] = mPose(2, 1);
+    M.m[4] = pose(0, 1);
+    M.m[5] = pose(1, 1);
+    M.m[6] = pose(2, 1);
     M.m[7]  = 0.0;
 
-    M.m[8] = mPose(0, 2);
-    M.m[9] = mPose(1, 2);
-    M.m[10] = mPose(2, 2);
+    M.m[8] = pose(0, 2);
+    M.m[9] = pose(1, 2);
+    M.m[10] = pose(2, 2);
     M.m[11]  = 0.0;
 
-    M.m[12] = mPose(0, 3);
-    M.m[13] = mPose(1, 3);
-    M.m[14] = mPose(2, 3);
+    M.m[12] = pose(0, 3);
+    M.m[13] = pose(1, 3);
+    M.m[14] = pose(2, 3);
     M.m[15]  = 1.0;
   } else
     M.SetIdentity();
 }
 
 void FrameDrawer::CheckPlanes(bool recompute) {
-  int state;
-  std::vector<MapPoint*> vMPs;
-  Eigen::Matrix4d pose;
-
-  //Copy variables within scoped mutex
-  {
-    unique_lock<mutex> lock(mMutex);
-    state = mState;
-    vMPs = mvMPs;
-    pose = mPose;
-  }
-
+  FrameData &data = GetFrameData();
+  int state = data.state;
+  const std::vector<MapPoint*> &vMPs = data.vMPs;
+  const Eigen::Matrix4d &pose = data.pose;
 
   if(state == Tracking::OK) {
     if(clearAR) {
@@ -270,7 +266,7 @@ Plane* FrameDrawer::DetectPlane(const Eigen::Matrix4d &pose, const std::vector<M
   vPoints.reserve(vMPs.size());
 
   for(size_t i=0; i<vMPs.size(); i++) {
-    MapPoint* pMP = mvMPs[i];
+    MapPoint* pMP = vMPs[i];
     vPoints.push_back(pMP->GetWorldPos());
   }
 
@@ -280,74 +276,14 @@ Plane* FrameDrawer::DetectPlane(const Eigen::Matrix4d &pose, const std::vector<M
     return NULL;
 
 
-  // Indices for minimum set selection
-  vector<size_t> vAllIndices;
-  vAllIndices.reserve(N);
-  vector<size_t> vAvailableIndices;
-
-  for(int i=0; i<N; i++)
-    vAllIndices.push_back(i);
-
-  float bestDist = 1e10;
-  vector<float> bestvDist;
-
-  // RANSAC
-  for(int n=0; n<iterations; n++) {
-    vAvailableIndices = vAllIndices;
-
-    cv::Mat A(3,4,CV_32F);
-    A.col(3) = cv::Mat::ones(3,1,CV_32F);
-
-    // Get min set of points
-    for(short i = 0; i < 3; ++i) {
-      int randi = Random(0, vAvailableIndices.size()-1);
-      int idx = vAvailableIndices[randi];
-
-      A.at<float>(i, 0) = vPoints[idx](0);
-      A.at<float>(i, 1) = vPoints[idx](1);
-      A.at<float>(i, 2) = vPoints[idx](2);
-
-      vAvailableIndices[randi] = vAvailableIndices.back();
-      vAvailableIndices.pop_back();
-    }
-
-    cv::Mat u,w,vt;
-    cv::SVDecomp(A,w,u,vt,cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
-
-    const float a = vt.at<float>(3,0);
-    const float b = vt.at<float>(3,1);
-    const float c = vt.at<float>(3,2);
-    const float d = vt.at<float>(3,3);
+  PlaneFitter fitter;
+  fitter.SetPoints(vPoints);
 
-    vector<float> vDistances(N,0);
-
-    const float f = 1.0f/sqrt(a*a+b*b+c*c+d*d);
-
-    for(int i=0; i<N; i++)
-      vDistances[i] = fabs(vPoints[i](0)*a+vPoints[i](1)*b+vPoints[i](2)*c+d)*f;
-
-    vector<float> vSorted = vDistances;
-    sort(vSorted.begin(),vSorted.end());
-
-    int nth = std::max((int)(0.2*N),20);
-    const float medianDist = vSorted[nth];
-
-    if(medianDist < bestDist) {
-      bestDist = medianDist;
-      bestvDist = vDistances;
-    }
-  }
+  vector<bool> vbInliers;
+  if(!fitter.Ransac(iterations, vbInliers))
+    return NULL;
 
-  // Compute threshold inlier/outlier
-  const float th = 1.4*bestDist;
-  vector<bool> vbInliers(N,false);
-  int nInliers = 0;
-  for(int i=0; i<N; i++) {
-    if(bestvDist[i]<th) {
-      nInliers++;
-      vbInliers[i]=true;
-    }
-  }
+  const int nInliers = std::count(vbInliers.begin(), vbInliers.end(), true);
 
   vector<MapPoint*> vInlierMPs(nInliers,NULL);
   int nin = 0;
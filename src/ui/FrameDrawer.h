@@ -25,7 +25,7 @@
 #ifndef SD_SLAM_FRAMEDRAWER_H
 #define SD_SLAM_FRAMEDRAWER_H
 
-#include <mutex>
+#include <chrono>
 #include <opencv2/core/core.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <pangolin/pangolin.h>
@@ -34,6 +34,7 @@
 #include "MapPoint.h"
 #include "Map.h"
 #include "ui/Plane.h"
+#include "extra/triple_buffer.h"
 
 namespace SD_SLAM {
 
@@ -44,7 +45,8 @@ class FrameDrawer {
  public:
   FrameDrawer(Map* pMap);
 
-  // Update info from the last processed frame.
+  // Update info from the last processed frame. Called from the tracking thread,
+  // it never waits for the viewer and skips frames above Viewer.FPS.
   void Update(const cv::Mat &im, const Eigen::Matrix4d &pose, Tracking *pTracker);
 
   // Draw last processed frame.
@@ -65,7 +67,34 @@ class FrameDrawer {
   inline void ClearAR() { clearAR = true; }
 
  protected:
-  void DrawTextInfo(cv::Mat &im, int nState);
+  // Data of a processed frame. Image and remap tables are headers of buffers shared with
+  // the tracker, points are stored in reused vectors.
+  struct FrameData {
+    cv::Mat im;
+    cv::Mat remap1;
+    cv::Mat remap2;
+    Eigen::Matrix4d pose;
+    int state;
+    bool onlyTracking;
+    bool undistorted;
+
+    // Tracked keypoints
+    std::vector<cv::Point2f> vTracked;
+
+    // Initialization: matches between reference and current keypoints
+    std::vector<cv::Point2f> vIniPoints;
+    std::vector<cv::Point2f> vCurPoints;
+
+    // Best observed points, used to detect planes
+    std::vector<MapPoint*> vMPs;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Take last published frame, only from the viewer thread
+  FrameData& GetFrameData();
+
+  void DrawTextInfo(cv::Mat &im, const FrameData &data);
 
   Plane* DetectPlane(const Eigen::Matrix4d &pose, const std::vector<MapPoint*> &vMPs, const int iterations=50);
 
@@ -73,20 +102,11 @@ class FrameDrawer {
   void DrawPlane(int ndivs, float ndivsize);
   void DrawPlane(Plane* pPlane, int ndivs, float ndivsize);
 
-  // Last processed frame data
-  cv::Mat mIm;
-  Eigen::Matrix4d mPose;
-  int mState;
-  std::vector<cv::KeyPoint> mvCurrentKeys;
-  std::vector<bool> mvbMap;
-  std::vector<MapPoint*> mvMPs;
-  bool onlyTracking_;
-
-  int mnTracked;
+  TripleBuffer<FrameData> mBuffer;
 
-  // Initial points
-  std::vector<cv::KeyPoint> mvIniKeys;
-  std::vector<int> mvIniMatches;
+  // Rate limiter
+  std::chrono::steady_clock::time_point mLastUpdate;
+  int mnLastState;
 
   std::vector<Plane*> vpPlane;
   bool addPlane;
@@ -94,7 +114,6 @@ class FrameDrawer {
 
   bool undistort;
   Map* mpMap;
-  std::mutex mMutex;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -23,49 +23,394 @@
  */
 
 #include "MapDrawer.h"
+#include <algorithm>
+#include <limits>
 #include "Config.h"
-#include "Converter.h"
 
 using std::vector;
-using std::set;
 using std::mutex;
 using std::unique_lock;
 
 namespace SD_SLAM {
 
-MapDrawer::MapDrawer(Map* pMap): mpMap(pMap) {
+// Octree nodes with fewer points are leaves. Other nodes keep the first point of each cell of
+// a POINT_GRID^3 grid and pass the rest down
+static const size_t LEAF_POINTS = 256;
+static const int POINT_GRID = 16;
+static const int MAX_POINT_DEPTH = 16;
+
+// Upload vertices to buffer, growing it if needed
+static void UploadVertices(pangolin::GlBuffer &buffer, size_t &capacity, const vector<float> &vertices) {
+  const size_t n = vertices.size()/3;
+  if (n > capacity) {
+    capacity = std::max(2*capacity, std::max(n, static_cast<size_t>(1024)));
+    buffer.Reinitialise(pangolin::GlArrayBuffer, capacity, GL_FLOAT, 3, GL_DYNAMIC_DRAW);
+  }
+
+  if (n > 0)
+    buffer.Upload(vertices.data(), vertices.size()*sizeof(float));
+}
+
+// Draw first n vertices of buffer
+static void DrawVertices(pangolin::GlBuffer &buffer, GLenum mode, size_t n) {
+  if (n == 0)
+    return;
+
+  buffer.Bind();
+  glVertexPointer(3, GL_FLOAT, 0, 0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glDrawArrays(mode, 0, n);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  buffer.Unbind();
+}
+
+// False if cube is completely outside one of the clipping planes of PMV
+static bool CubeInView(const Eigen::Matrix4f &PMV, const Eigen::Vector3f &center, float half) {
+  int outside[6] = {0, 0, 0, 0, 0, 0};
+  for (int c = 0; c < 8; c++) {
+    const Eigen::Vector4f corner(center(0) + (c&1 ? half : -half), center(1) + (c&2 ? half : -half),
+                                 center(2) + (c&4 ? half : -half), 1.0f);
+    const Eigen::Vector4f p = PMV*corner;
+    for (int k = 0; k < 3; k++) {
+      outside[2*k] += p(k) < -p(3);
+      outside[2*k+1] += p(k) > p(3);
+    }
+  }
+
+  for (int k = 0; k < 6; k++) {
+    if (outside[k] == 8)
+      return false;
+  }
+  return true;
+}
+
+MapDrawer::MapDrawer(Map* pMap): mpMap(pMap), mnSnapshotVersion(0), mnPointCapacity(0), mbPointTree(false),
+  mnKeyFrameCapacity(0), mnKeyFrameVertices(0), mnGraphCapacity(0), mnGraphVertices(0) {
   mCameraPose.setZero();
 }
 
-void MapDrawer::DrawMapPoints() {
-  const vector<MapPoint*> &vpMPs = mpMap->GetAllMapPoints();
-  const vector<MapPoint*> &vpRefMPs = mpMap->GetReferenceMapPoints();
+void MapDrawer::UpdateBuffers() {
+  // Whole map is drawn from the last snapshot, mapping threads are not blocked.
+  // Buffers only change when a new snapshot is published
+  std::shared_ptr<const Map::Snapshot> snapshot = mpMap->GetSnapshot();
+  if (snapshot->version == mnSnapshotVersion)
+    return;
+
+  mnSnapshotVersion = snapshot->version;
+
+  // Large maps are drawn with level of detail, the octree is rebuilt with each snapshot
+  const int nLOD = Config::PointLOD();
+  if (nLOD > 0 && snapshot->vMapPoints.size() > static_cast<size_t>(nLOD)) {
+    BuildPointTree(*snapshot);
+  } else {
+    if (mbPointTree) {
+      // Slots are filled again from scratch
+      mbPointTree = false;
+      mvPointNodes.clear();
+      mvTreePoints.clear();
+      mvPointVertices.clear();
+    }
+    UpdatePoints(*snapshot);
+  }
+
+  UpdateKeyFrames(*snapshot);
+}
+
+void MapDrawer::BuildPointTree(const Map::Snapshot &snapshot) {
+  mbPointTree = true;
+  mvPointIds.clear();
+  mPointSlots.clear();
+
+  const vector<Eigen::Vector3d> &vMPs = snapshot.vMapPoints;
+  const size_t n = vMPs.size();
+  Eigen::Vector3f minPos = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+  Eigen::Vector3f maxPos = -minPos;
+  mvTreePoints.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    mvTreePoints[i] = vMPs[i].cast<float>();
+    minPos = minPos.cwiseMin(mvTreePoints[i]);
+    maxPos = maxPos.cwiseMax(mvTreePoints[i]);
+  }
+
+  mvPointNodes.clear();
+  mvPointVertices.clear();
+  mvPointVertices.reserve(3*n);
+  if (n > 0)
+    BuildPointNode(0, n, 0.5f*(minPos+maxPos), 0.5f*(maxPos-minPos).maxCoeff() + 1e-3f, 0);
+
+  UploadVertices(mPointBuffer, mnPointCapacity, mvPointVertices);
+}
 
-  set<MapPoint*> spRefMPs(vpRefMPs.begin(), vpRefMPs.end());
+int MapDrawer::BuildPointNode(size_t begin, size_t end, const Eigen::Vector3f &center, float half, int depth) {
+  const int idx = mvPointNodes.size();
+  mvPointNodes.push_back(PointNode());
+
+  PointNode node;
+  node.center = center;
+  node.half = half;
+  node.spacing = 2.0f*half/POINT_GRID;
+  std::fill(node.children, node.children+8, -1);
+
+  // Points owned by this node are moved to [begin, mid)
+  size_t mid = end;
+  if (end-begin > LEAF_POINTS && depth < MAX_POINT_DEPTH) {
+    vector<char> vbTaken(POINT_GRID*POINT_GRID*POINT_GRID, false);
+    const Eigen::Vector3f origin = center - Eigen::Vector3f::Constant(half);
+    const float inv = 1.0f/node.spacing;
+
+    mid = begin;
+    for (size_t i = begin; i < end; i++) {
+      int cell = 0;
+      for (int k = 2; k >= 0; k--) {
+        const int c = static_cast<int>((mvTreePoints[i](k)-origin(k))*inv);
+        cell = cell*POINT_GRID + std::min(std::max(c, 0), POINT_GRID-1);
+      }
 
-  if (vpMPs.empty())
+      if (!vbTaken[cell]) {
+        vbTaken[cell] = true;
+        std::swap(mvTreePoints[i], mvTreePoints[mid++]);
+      }
+    }
+  }
+
+  node.first = mvPointVertices.size()/3;
+  node.count = mid-begin;
+  for (size_t i = begin; i < mid; i++)
+    mvPointVertices.insert(mvPointVertices.end(), mvTreePoints[i].data(), mvTreePoints[i].data()+3);
+
+  // Rest go to the octant of their position (bit k set if above center along axis k)
+  size_t bounds[9];
+  bounds[0] = mid;
+  bounds[8] = end;
+  auto split = [&](size_t first, size_t last, int k) {
+    return std::partition(mvTreePoints.begin()+first, mvTreePoints.begin()+last, [&](const Eigen::Vector3f &p) {
+      return p(k) < center(k);
+    }) - mvTreePoints.begin();
+  };
+  bounds[4] = split(bounds[0], bounds[8], 2);
+  bounds[2] = split(bounds[0], bounds[4], 1);
+  bounds[6] = split(bounds[4], bounds[8], 1);
+  for (int o = 0; o < 8; o += 2)
+    bounds[o+1] = split(bounds[o], bounds[o+2], 0);
+
+  const float childHalf = 0.5f*half;
+  for (int o = 0; o < 8; o++) {
+    if (bounds[o] == bounds[o+1])
+      continue;
+
+    const Eigen::Vector3f childCenter = center + Eigen::Vector3f(o&1 ? childHalf : -childHalf,
+                                                                 o&2 ? childHalf : -childHalf,
+                                                                 o&4 ? childHalf : -childHalf);
+    node.children[o] = BuildPointNode(bounds[o], bounds[o+1], childCenter, childHalf, depth+1);
+  }
+
+  mvPointNodes[idx] = node;
+  return idx;
+}
+
+void MapDrawer::DrawPointTree(pangolin::OpenGlRenderState &state) {
+  if (mvPointNodes.empty())
     return;
 
-  glPointSize(Config::PointSize());
-  glBegin(GL_POINTS);
-  glColor3f(0.0, 0.0, 0.0);
+  const pangolin::OpenGlMatrix &P = state.GetProjectionMatrix();
+  const pangolin::OpenGlMatrix &MV = state.GetModelViewMatrix();
+  Eigen::Matrix4d Pm, MVm;
+  for (int i = 0; i < 16; i++) {
+    Pm.data()[i] = P.m[i];
+    MVm.data()[i] = MV.m[i];
+  }
+  const Eigen::Matrix4f PMV = (Pm*MVm).cast<float>();
+  const Eigen::Vector3f eye = MVm.inverse().block<3, 1>(0, 3).cast<float>();
+
+  // Pixels covered by a unit length at unit distance
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  const float focal = 0.5f*viewport[3]*static_cast<float>(Pm(1, 1));
+  const float minSpacing = Config::PointSize();
+
+  // Buffer ranges to draw, nodes are stored depth first so consecutive ones are merged
+  vector<std::pair<uint32_t, uint32_t> > vRanges;
+  vector<int> vStack(1, 0);
+  while (!vStack.empty()) {
+    const PointNode &node = mvPointNodes[vStack.back()];
+    vStack.pop_back();
+
+    if (!CubeInView(PMV, node.center, node.half))
+      continue;
+
+    if (node.count > 0) {
+      if (!vRanges.empty() && vRanges.back().first+vRanges.back().second == node.first)
+        vRanges.back().second += node.count;
+      else
+        vRanges.push_back(std::make_pair(node.first, node.count));
+    }
 
-  for (size_t i = 0, iend=vpMPs.size(); i < iend; i++) {
-    if (vpMPs[i]->isBad() || spRefMPs.count(vpMPs[i]))
+    // Children only add detail if points of this node are apart on screen
+    const float dist = std::max((node.center-eye).norm() - 1.7320508f*node.half, 1e-3f);
+    if (focal*node.spacing/dist <= minSpacing)
       continue;
-    Eigen::Vector3d pos = vpMPs[i]->GetWorldPos();
-    glVertex3f(pos(0), pos(1), pos(2));
+
+    for (int o = 7; o >= 0; o--) {
+      if (node.children[o] >= 0)
+        vStack.push_back(node.children[o]);
+    }
   }
-  glEnd();
+
+  if (vRanges.empty())
+    return;
+
+  mPointBuffer.Bind();
+  glVertexPointer(3, GL_FLOAT, 0, 0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  for (const std::pair<uint32_t, uint32_t> &range : vRanges)
+    glDrawArrays(GL_POINTS, range.first, range.second);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  mPointBuffer.Unbind();
+}
+
+void MapDrawer::UpdatePoints(const Map::Snapshot &snapshot) {
+  const vector<Eigen::Vector3d> &vMPs = snapshot.vMapPoints;
+  const vector<long unsigned int> &vIds = snapshot.vMapPointIds;
+
+  vector<size_t> vDirty;
+  vector<char> vbSeen(mvPointIds.size(), false);
+
+  // New and moved points
+  for (size_t i = 0; i < vMPs.size(); i++) {
+    size_t slot;
+    auto it = mPointSlots.find(vIds[i]);
+    const bool bNew = it == mPointSlots.end();
+    if (bNew) {
+      slot = mvPointIds.size();
+      mPointSlots[vIds[i]] = slot;
+      mvPointIds.push_back(vIds[i]);
+      mvPointVertices.resize(3*(slot+1));
+      vbSeen.push_back(true);
+    } else {
+      slot = it->second;
+      vbSeen[slot] = true;
+    }
+
+    float* v = &mvPointVertices[3*slot];
+    const float x = vMPs[i](0), y = vMPs[i](1), z = vMPs[i](2);
+    if (!bNew && v[0] == x && v[1] == y && v[2] == z)
+      continue;
+
+    v[0] = x;
+    v[1] = y;
+    v[2] = z;
+    vDirty.push_back(slot);
+  }
+
+  // Erased points, last slot is moved into the hole
+  for (size_t slot = 0; slot < mvPointIds.size();) {
+    if (vbSeen[slot]) {
+      slot++;
+      continue;
+    }
+
+    const size_t last = mvPointIds.size()-1;
+    mPointSlots.erase(mvPointIds[slot]);
+    if (slot != last) {
+      mvPointIds[slot] = mvPointIds[last];
+      std::copy(&mvPointVertices[3*last], &mvPointVertices[3*last]+3, &mvPointVertices[3*slot]);
+      vbSeen[slot] = vbSeen[last];
+      mPointSlots[mvPointIds[slot]] = slot;
+      vDirty.push_back(slot);
+    }
+
+    mvPointIds.pop_back();
+    mvPointVertices.resize(3*last);
+    vbSeen.pop_back();
+  }
+
+  const size_t n = mvPointIds.size();
+  if (n > mnPointCapacity) {
+    UploadVertices(mPointBuffer, mnPointCapacity, mvPointVertices);
+    return;
+  }
+
+  // Upload consecutive dirty slots together
+  std::sort(vDirty.begin(), vDirty.end());
+  vDirty.erase(std::unique(vDirty.begin(), vDirty.end()), vDirty.end());
+  while (!vDirty.empty() && vDirty.back() >= n)
+    vDirty.pop_back();
+
+  const size_t stride = 3*sizeof(float);
+  for (size_t i = 0; i < vDirty.size();) {
+    size_t j = i+1;
+    while (j < vDirty.size() && vDirty[j] == vDirty[j-1]+1)
+      j++;
+
+    mPointBuffer.Upload(&mvPointVertices[3*vDirty[i]], (j-i)*stride, vDirty[i]*stride);
+    i = j;
+  }
+}
+
+void MapDrawer::UpdateKeyFrames(const Map::Snapshot &snapshot) {
+  const float &w = Config::KeyFrameSize();
+  const float h = w*0.75;
+  const float z = w*0.6;
+
+  // Camera frustum as 8 lines from camera center and image corners
+  const Eigen::Vector3d lines[16] = {
+    Eigen::Vector3d(0, 0, 0), Eigen::Vector3d(w, h, z),
+    Eigen::Vector3d(0, 0, 0), Eigen::Vector3d(w, -h, z),
+    Eigen::Vector3d(0, 0, 0), Eigen::Vector3d(-w, -h, z),
+    Eigen::Vector3d(0, 0, 0), Eigen::Vector3d(-w, h, z),
+    Eigen::Vector3d(w, h, z), Eigen::Vector3d(w, -h, z),
+    Eigen::Vector3d(-w, h, z), Eigen::Vector3d(-w, -h, z),
+    Eigen::Vector3d(-w, h, z), Eigen::Vector3d(w, h, z),
+    Eigen::Vector3d(-w, -h, z), Eigen::Vector3d(w, -h, z)
+  };
+
+  vector<float> vVertices;
+  vVertices.reserve(snapshot.vKeyFramePoses.size()*16*3);
+  for (const Eigen::Matrix4d &Twc : snapshot.vKeyFramePoses) {
+    for (int i = 0; i < 16; i++) {
+      Eigen::Vector3d p = Twc.block<3, 3>(0, 0)*lines[i]+Twc.block<3, 1>(0, 3);
+      vVertices.push_back(p(0));
+      vVertices.push_back(p(1));
+      vVertices.push_back(p(2));
+    }
+  }
+  UploadVertices(mKeyFrameBuffer, mnKeyFrameCapacity, vVertices);
+  mnKeyFrameVertices = vVertices.size()/3;
+
+  // Covisibility graph, spanning tree and loops
+  const vector<Eigen::Vector3d> &vEdges = snapshot.vGraphEdges;
+  vVertices.clear();
+  vVertices.reserve(vEdges.size()*3);
+  for (const Eigen::Vector3d &p : vEdges) {
+    vVertices.push_back(p(0));
+    vVertices.push_back(p(1));
+    vVertices.push_back(p(2));
+  }
+  UploadVertices(mGraphBuffer, mnGraphCapacity, vVertices);
+  mnGraphVertices = vVertices.size()/3;
+}
+
+void MapDrawer::DrawMapPoints(pangolin::OpenGlRenderState &state) {
+  UpdateBuffers();
+
+  glPointSize(Config::PointSize());
+  glColor3f(0.0, 0.0, 0.0);
+  if (mbPointTree)
+    DrawPointTree(state);
+  else
+    DrawVertices(mPointBuffer, GL_POINTS, mvPointIds.size());
+
+  // Reference points change every frame, they are drawn over the snapshot
+  const vector<MapPoint*> &vpRefMPs = mpMap->GetReferenceMapPoints();
 
   glPointSize(Config::PointSize());
   glBegin(GL_POINTS);
   glColor3f(0.0, 0.8, 0.0);
 
-  for (set<MapPoint*>::iterator sit = spRefMPs.begin(), send = spRefMPs.end(); sit != send; sit++) {
-    if ((*sit)->isBad())
+  for (size_t i = 0, iend=vpRefMPs.size(); i < iend; i++) {
+    if (vpRefMPs[i]->isBad())
       continue;
-    Eigen::Vector3d pos = (*sit)->GetWorldPos();
+    Eigen::Vector3d pos = vpRefMPs[i]->GetWorldPos();
     glVertex3f(pos(0), pos(1), pos(2));
   }
 
@@ -73,92 +418,18 @@ void MapDrawer::DrawMapPoints() {
 }
 
 void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph) {
-  pangolin::OpenGlMatrix glmatrix;
-  const float &w = Config::KeyFrameSize();
-  const float h = w*0.75;
-  const float z = w*0.6;
-
-  const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+  UpdateBuffers();
 
   if (bDrawKF) {
-    double lwidth = Config::KeyFrameLineWidth();
-    for (size_t i = 0; i < vpKFs.size(); i++) {
-      KeyFrame* pKF = vpKFs[i];
-      Eigen::Matrix4d Twc = pKF->GetPoseInverse().transpose();
-
-      glPushMatrix();
-
-      cv::Mat Twc_cv = Converter::toCvMat(Twc);
-      glMultMatrixf(Twc_cv.ptr<GLfloat>(0));
-
-      glLineWidth(lwidth);
-      glColor3f(0.0f, 0.0f, 0.9f);
-      glBegin(GL_LINES);
-      glVertex3f(0, 0, 0);
-      glVertex3f(w, h, z);
-      glVertex3f(0, 0, 0);
-      glVertex3f(w,-h, z);
-      glVertex3f(0, 0, 0);
-      glVertex3f(-w,-h, z);
-      glVertex3f(0, 0, 0);
-      glVertex3f(-w, h, z);
-
-      glVertex3f(w, h, z);
-      glVertex3f(w,-h, z);
-
-      glVertex3f(-w, h, z);
-      glVertex3f(-w,-h, z);
-
-      glVertex3f(-w, h, z);
-      glVertex3f(w, h, z);
-
-      glVertex3f(-w,-h, z);
-      glVertex3f(w,-h, z);
-      glEnd();
-
-      glPopMatrix();
-    }
+    glLineWidth(Config::KeyFrameLineWidth());
+    glColor3f(0.0f, 0.0f, 0.9f);
+    DrawVertices(mKeyFrameBuffer, GL_LINES, mnKeyFrameVertices);
   }
 
   if (bDrawGraph) {
     glLineWidth(Config::GraphLineWidth());
     glColor4f(0.7f, 0.0f, 0.7f, 0.6f);
-    glBegin(GL_LINES);
-
-    for (size_t i = 0; i < vpKFs.size(); i++) {
-      // Covisibility Graph
-      const vector<KeyFrame*> vCovKFs = vpKFs[i]->GetCovisiblesByWeight(100);
-      Eigen::Vector3d Ow = vpKFs[i]->GetCameraCenter();
-      if (!vCovKFs.empty()) {
-        for (vector<KeyFrame*>::const_iterator vit=vCovKFs.begin(), vend=vCovKFs.end(); vit!=vend; vit++) {
-          if ((*vit)->mnId<vpKFs[i]->mnId)
-            continue;
-          Eigen::Vector3d Ow2 = (*vit)->GetCameraCenter();
-          glVertex3f(Ow(0),Ow(1),Ow(2));
-          glVertex3f(Ow2(0),Ow2(1),Ow2(2));
-        }
-      }
-
-      // Spanning tree
-      KeyFrame* pParent = vpKFs[i]->GetParent();
-      if (pParent) {
-        Eigen::Vector3d Owp = pParent->GetCameraCenter();
-        glVertex3f(Ow(0),Ow(1),Ow(2));
-        glVertex3f(Owp(0),Owp(1),Owp(2));
-      }
-
-      // Loops
-      set<KeyFrame*> sLoopKFs = vpKFs[i]->GetLoopEdges();
-      for (set<KeyFrame*>::iterator sit = sLoopKFs.begin(), send = sLoopKFs.end(); sit != send; sit++) {
-        if ((*sit)->mnId<vpKFs[i]->mnId)
-          continue;
-        Eigen::Vector3d Owl = (*sit)->GetCameraCenter();
-        glVertex3f(Ow(0),Ow(1),Ow(2));
-        glVertex3f(Owl(0),Owl(1),Owl(2));
-      }
-    }
-
-    glEnd();
+    DrawVertices(mGraphBuffer, GL_LINES, mnGraphVertices);
   }
 }
 
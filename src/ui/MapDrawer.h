@@ -26,6 +26,9 @@
 #define SD_SLAM_MAPDRAWER_H
 
 #include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
 #include <pangolin/pangolin.h>
 #include <Eigen/Dense>
 #include "Map.h"
@@ -40,17 +43,64 @@ class MapDrawer {
 
   Map* mpMap;
 
-  void DrawMapPoints();
+  // Points seen from camera state, whose matrices must be the active ones
+  void DrawMapPoints(pangolin::OpenGlRenderState &state);
   void DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph);
   void DrawCurrentCamera(pangolin::OpenGlMatrix &Twc);
   void SetCurrentCameraPose(const Eigen::Matrix4d &Tcw);
   void GetCurrentOpenGLCameraMatrix(pangolin::OpenGlMatrix &M);
 
  private:
+  // Upload changes of the last map snapshot to the vertex buffers
+  void UpdateBuffers();
+  void UpdatePoints(const Map::Snapshot &snapshot);
+  void UpdateKeyFrames(const Map::Snapshot &snapshot);
+
+  // Octree of level of detail, used instead of slots with more than Config::PointLOD() points.
+  // Each node owns points spread at least spacing apart, the rest go down to its children.
+  // Nodes are stored depth first and own a contiguous range of the buffer
+  struct PointNode {
+    Eigen::Vector3f center;
+    float half;           // Half side of the node cube
+    float spacing;
+    uint32_t first, count;
+    int children[8];      // -1 if empty
+  };
+
+  // Rebuild octree and buffer with all points of snapshot
+  void BuildPointTree(const Map::Snapshot &snapshot);
+
+  // Add node with points [begin, end) of mvTreePoints and its children. Returns its index
+  int BuildPointNode(size_t begin, size_t end, const Eigen::Vector3f &center, float half, int depth);
+
+  // Draw owned points of nodes in view, refining until their spacing is under a point on screen
+  void DrawPointTree(pangolin::OpenGlRenderState &state);
+
   Eigen::Matrix4d mCameraPose;
 
   std::mutex mMutexCamera;
 
+  // Version of the snapshot in the buffers
+  unsigned long mnSnapshotVersion;
+
+  // Map points, slot i of the buffer holds point mvPointIds[i]. Only changed slots are uploaded
+  pangolin::GlBuffer mPointBuffer;
+  size_t mnPointCapacity;
+  std::vector<float> mvPointVertices;
+  std::vector<long unsigned int> mvPointIds;
+  std::unordered_map<long unsigned int, size_t> mPointSlots;
+
+  // Level of detail octree, root is node 0. Points are reordered while it is built
+  bool mbPointTree;
+  std::vector<PointNode> mvPointNodes;
+  std::vector<Eigen::Vector3f> mvTreePoints;
+
+  // Keyframe frustums and graph edges as lines, rebuilt with each snapshot
+  pangolin::GlBuffer mKeyFrameBuffer;
+  pangolin::GlBuffer mGraphBuffer;
+  size_t mnKeyFrameCapacity, mnKeyFrameVertices;
+  size_t mnGraphCapacity, mnGraphVertices;
+
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
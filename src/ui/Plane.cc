@@ -23,6 +23,8 @@
  */
 
 #include "Plane.h"
+#include "Converter.h"
+#include "extra/lie.h"
 
 using std::vector;
 using std::mutex;
@@ -30,25 +32,6 @@ using std::unique_lock;
 
 namespace SD_SLAM {
 
-const float eps = 1e-4;
-
-cv::Mat ExpSO3(const float &x, const float &y, const float &z) {
-  cv::Mat I = cv::Mat::eye(3,3,CV_32F);
-  const float d2 = x*x+y*y+z*z;
-  const float d = sqrt(d2);
-  cv::Mat W = (cv::Mat_<float>(3,3) << 0, -z, y,
-               z, 0, -x,
-               -y,  x, 0);
-  if(d<eps)
-    return (I + W + 0.5f*W*W);
-  else
-    return (I + W*sin(d)/d + W*W*(1.0f-cos(d))/d2);
-}
-
-cv::Mat ExpSO3(const cv::Mat &v) {
-  return ExpSO3(v.at<float>(0),v.at<float>(1),v.at<float>(2));
-}
-
 Plane::Plane(const std::vector<MapPoint *> &vMPs, const Eigen::Matrix4d &pose): mvMPs(vMPs), mPose(pose) {
   rang = -3.14f/2+((float)rand()/RAND_MAX)*3.14f;
   XC.setZero();
@@ -57,37 +40,38 @@ Plane::Plane(const std::vector<MapPoint *> &vMPs, const Eigen::Matrix4d &pose):
 
 void Plane::Recompute() {
   const int N = mvMPs.size();
+  mvPositions.resize(N);
+  mvbUsed.resize(N, false);
 
-  // Recompute plane with all points
-  cv::Mat A = cv::Mat(N,4,CV_32F);
-  A.col(3) = cv::Mat::ones(N,1,CV_32F);
-
-  o.setZero();
-
-  int nPoints = 0;
+  // Update moments of points that changed
   for(int i=0; i<N; i++) {
     MapPoint* pMP = mvMPs[i];
-    if(!pMP->isBad()) {
-      Eigen::Vector3d Xw = pMP->GetWorldPos();
-      o += Xw;
-
-      A.at<float>(nPoints, 0) = Xw(0);
-      A.at<float>(nPoints, 1) = Xw(1);
-      A.at<float>(nPoints, 2) = Xw(2);
+    if(pMP->isBad()) {
+      if(mvbUsed[i]) {
+        mLeastSquares.Remove(mvPositions[i]);
+        mvbUsed[i] = false;
+      }
+      continue;
+    }
 
-      nPoints++;
+    Eigen::Vector3d Xw = pMP->GetWorldPos();
+    if(!mvbUsed[i]) {
+      mLeastSquares.Add(Xw);
+      mvbUsed[i] = true;
+    } else if(Xw != mvPositions[i]) {
+      mLeastSquares.Move(mvPositions[i], Xw);
     }
+    mvPositions[i] = Xw;
   }
-  A.resize(nPoints);
 
-  cv::Mat u,w,vt;
-  cv::SVDecomp(A,w,u,vt,cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+  Eigen::Vector3d normal;
+  if(!mLeastSquares.Fit(o, normal))
+    return;
 
-  float a = vt.at<float>(3,0);
-  float b = vt.at<float>(3,1);
-  float c = vt.at<float>(3,2);
+  float a = normal(0);
+  float b = normal(1);
+  float c = normal(2);
 
-  o = o*(1.0f/nPoints);
   const float f = 1.0f/sqrt(a*a+b*b+c*c);
 
   // Compute XC just the first time
@@ -108,15 +92,16 @@ void Plane::Recompute() {
 
   n = (cv::Mat_<float>(3,1)<<nx,ny,nz);
 
-  cv::Mat up = (cv::Mat_<float>(3,1) << 0.0f, 1.0f, 0.0f);
-
-  cv::Mat v = up.cross(n);
-  const float sa = cv::norm(v);
-  const float ca = up.dot(n);
-  const float ang = atan2(sa,ca);
+  const Eigen::Vector3d up(0.0, 1.0, 0.0);
+  const Eigen::Vector3d v = up.cross(Eigen::Vector3d(nx, ny, nz));
+  const double sa = v.norm();
+  const double ca = up(0)*nx+up(1)*ny+up(2)*nz;
+  const double ang = atan2(sa,ca);
   Tpw = cv::Mat::eye(4,4,CV_32F);
 
-  Tpw.rowRange(0,3).colRange(0,3) = ExpSO3(v*ang/sa)*ExpSO3(up*rang);
+  const Eigen::Matrix3d Rpw = (Lie::ExpSO3<double>(v*ang/sa)*Lie::ExpSO3<double>(up*rang)).toRotationMatrix();
+  cv::Mat Rpw_cv = Tpw.rowRange(0,3).colRange(0,3);
+  Converter::toCvMat(Rpw).convertTo(Rpw_cv, CV_32F);
   Tpw.at<float>(0,3) = o(0);
   Tpw.at<float>(1,3) = o(1);
   Tpw.at<float>(2,3) = o(2);
@@ -30,6 +30,7 @@
 #include <pangolin/pangolin.h>
 #include <Eigen/Dense>
 #include "MapPoint.h"
+#include "extra/plane_fitter.h"
 
 namespace SD_SLAM {
 
@@ -37,6 +38,8 @@ class Plane {
  public:
   Plane(const std::vector<MapPoint*> &vMPs, const Eigen::Matrix4d &pose);
 
+  // Update the plane with the current position of its MapPoints. Only points that moved
+  // or became bad are visited by the least squares fit
   void Recompute();
 
   //normal
@@ -54,6 +57,12 @@ class Plane {
   Eigen::Matrix4d mPose;
   Eigen::Vector3d XC;
 
+ private:
+  PlaneLeastSquares mLeastSquares;
+  //positions of mvMPs in the fit, and whether they are used
+  std::vector<Eigen::Vector3d> mvPositions;
+  std::vector<bool> mvbUsed;
+
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
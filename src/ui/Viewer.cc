@@ -25,7 +25,15 @@
 #include "Viewer.h"
 #include <pangolin/pangolin.h>
 #include <unistd.h>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
 #include "Config.h"
+#include "extra/log.h"
+#include "extra/trace.h"
+#include "extra/utils.h"
 
 using std::mutex;
 using std::unique_lock;
@@ -40,7 +48,13 @@ void Viewer::Run() {
   int w, h, mw, iw, ih, ib;
   double fx, fy, cx, cy;
 
+  if (!Config::ViewerOutput().empty()) {
+    RunOffscreen();
+    return;
+  }
+
   mbFinished = false;
+  Trace::SetThreadName("Viewer");
   iw = Config::Width();
   ih = Config::Height();
   fx = Config::fx();
@@ -107,7 +121,11 @@ void Viewer::Run() {
   bool bFollow = true;
   bool bLocalizationMode = false;
 
+  // Drawers read map points and keyframes
+  ScopedParticipant participant(mpSystem->GetMap()->GetReclaimer());
+
   while (!pangolin::ShouldQuit()) {
+    participant.Quiescent();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // Check localization mode
@@ -149,7 +167,7 @@ void Viewer::Run() {
       if (menuShowKeyFrames || menuShowGraph)
         mpMapDrawer->DrawKeyFrames(menuShowKeyFrames, menuShowGraph);
       if (menuShowPoints)
-        mpMapDrawer->DrawMapPoints();
+        mpMapDrawer->DrawMapPoints(s_cam);
 
       // Draw AR
       if (menuAddPlane) {
@@ -245,6 +263,104 @@ void Viewer::Run() {
 	std::cout << "UI thread finished, exiting..." << std::endl;
 }
 
+void Viewer::RunOffscreen() {
+  mbFinished = false;
+  Trace::SetThreadName("Viewer");
+
+  // Rendering must never take time from tracking
+  SetThreadPlacement(-1, 0, 19);
+
+  const std::string output = Config::ViewerOutput();
+  const double period = Config::ViewerOutputFPS() > 0 ? 1.0/Config::ViewerOutputFPS() : 1.0;
+  const int w = Config::Width();
+  const int h = Config::Height();
+
+  pangolin::CreateWindowAndBind("SD-SLAM", w, h, pangolin::Params({{"scheme", "headless"}}));
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  // Map is rendered into a texture, with the same size as the frame
+  pangolin::GlTexture color(w, h, GL_RGB, false, 0, GL_RGB, GL_UNSIGNED_BYTE);
+  pangolin::GlRenderBuffer depth(w, h);
+  pangolin::GlFramebuffer fbo(color, depth);
+
+  pangolin::OpenGlRenderState s_cam(
+        pangolin::ProjectionMatrix(w, h, Config::ViewpointF(), Config::ViewpointF(), w/2, h/2, 0.1, 1000),
+        pangolin::ModelViewLookAt(Config::ViewpointX(), Config::ViewpointY(), Config::ViewpointZ(), 0, 0, 0, 0.0,-1.0, 0.0)
+        );
+  pangolin::OpenGlMatrix Twc;
+  Twc.SetIdentity();
+
+  // Video if output is an .avi file, numbered images otherwise
+  cv::VideoWriter video;
+  const bool bVideo = output.size() > 4 && output.compare(output.size()-4, 4, ".avi") == 0;
+  if (bVideo && !video.open(output, CV_FOURCC('M', 'J', 'P', 'G'), 1.0/period, cv::Size(2*w, h))) {
+    LOGE("Can't open video %s", output.c_str());
+    SetFinish();
+    return;
+  }
+
+  cv::Mat map(h, w, CV_8UC3), canvas(h, 2*w, CV_8UC3);
+  int nImages = 0;
+
+  // Drawers read map points and keyframes
+  ScopedParticipant participant(mpSystem->GetMap()->GetReclaimer());
+
+  auto next = std::chrono::steady_clock::now();
+  while (!CheckFinish()) {
+    // Sleep in short steps, so finishing is not delayed by the period
+    if (std::chrono::steady_clock::now() < next) {
+      participant.Quiescent();
+      usleep(10000);
+      continue;
+    }
+    next += std::chrono::microseconds(static_cast<long>(period*1e6));
+    participant.Quiescent();
+
+    // Map seen from behind the current camera
+    fbo.Bind();
+    glViewport(0, 0, w, h);
+    glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    mpMapDrawer->GetCurrentOpenGLCameraMatrix(Twc);
+    s_cam.Follow(Twc);
+    s_cam.Apply();
+
+    mpMapDrawer->DrawCurrentCamera(Twc);
+    mpMapDrawer->DrawKeyFrames(true, true);
+    mpMapDrawer->DrawMapPoints(s_cam);
+    glFlush();
+    fbo.Unbind();
+
+    // Texture rows start at the bottom
+    color.Download(map.data, GL_RGB, GL_UNSIGNED_BYTE);
+    cv::flip(map, map, 0);
+    cv::cvtColor(map, canvas(cv::Rect(w, 0, w, h)), CV_RGB2BGR);
+
+    cv::Mat im = mpFrameDrawer->DrawFrame();
+    if (!im.empty()) {
+      cv::Rect roi(0, 0, std::min(w, im.cols), std::min(h, im.rows));
+      im(roi).copyTo(canvas(roi));
+    }
+
+    if (bVideo) {
+      video << canvas;
+    } else {
+      char name[32];
+      snprintf(name, sizeof(name), "/%06d.png", nImages);
+      if (!cv::imwrite(output+name, canvas))
+        LOGE("Can't write image %s%s", output.c_str(), name);
+    }
+    nImages++;
+  }
+
+  LOGD("Offscreen viewer finished, %d images rendered", nImages);
+
+  SetFinish();
+}
+
 void Viewer::RequestFinish() {
   unique_lock<mutex> lock(mMutexFinish);
   mbFinishRequested = true;
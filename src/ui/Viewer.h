@@ -46,6 +46,7 @@ class Viewer {
 
   // Main thread function. Draw points, keyframes, the current camera pose and the last processed
   // frame. Drawing is refreshed according to the camera fps. We use Pangolin.
+  // If Viewer.Output is set, no window is opened and RunOffscreen is called instead.
   void Run();
 
   void RequestFinish();
@@ -58,6 +59,11 @@ class Viewer {
   MapDrawer* mpMapDrawer;
   Tracking* mpTracker;
 
+  // Render the map and the last processed frame without a display at Viewer.OutputFPS, to a
+  // video (.avi) or to numbered png images in a folder. Runs with the lowest priority.
+  // Needs Pangolin built with headless (EGL) support.
+  void RunOffscreen();
+
   bool CheckFinish();
   void SetFinish();
   bool mbFinishRequested;